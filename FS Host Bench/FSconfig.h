@@ -0,0 +1,55 @@
+/******************************************************************************
+ *
+ *                PIC FAT File System Interface Library
+ *
+ ******************************************************************************
+ * FileName:        FSconfig.h
+ * Dependencies:    None
+ * Processor:       Workstation (POSIX)
+ * Compiler:        GCC
+ *
+ * File system configuration for running the library on a workstation with
+ * a disk image file as the media (see fsbench.c).  Keep the options the
+ * same as the board's FSconfig.h so the numbers measured here apply there.
+ *
+*****************************************************************************/
+
+
+#ifndef _FAT16_DEF_
+
+
+#define FS_MAX_FILES_OPEN    2
+
+#define FS_MAX_VOLUMES       2
+
+#define ALLOW_WRITES
+#define ALLOW_FORMATS
+#define ALLOW_DIRS
+#define ALLOW_FILESEARCH
+#define SUPPORT_FAT32
+#define FS_FREE_MAP_SIZE    64
+#define FS_FAT_CACHE_SECTORS    4
+#define FS_EXTENT_MAP_SIZE      8
+#define FS_FILE_BUFFERS
+#define FS_DIR_CACHE_SIZE       8
+#define SUPPORT_LFN
+#define FS_LFN_MAX_CHARS        64
+#define FS_WRITE_CACHE_SECTORS  8
+#define FS_READ_AHEAD_SECTORS   16
+
+// The size of the sector buffers, so the largest sector size the media can
+// have.  Media with smaller sectors (the images have 512 byte ones unless
+// fsbench is told otherwise) use part of each buffer.
+#define MEDIA_SECTOR_SIZE       4096
+
+// The media is reached through a block device driver chosen at run time
+#define INCLUDEFILE       "MDD File System/FSblockdev.h"
+
+// The application sets the time with SetClockVars
+#define USERDEFINEDCLOCK
+
+// No processor here; Nop() is only used for debugger breakpoints
+#define Nop()
+
+
+#endif
@@ -0,0 +1,289 @@
+/******************************************************************************
+ *
+ *               Microchip Memory Disk Drive File System
+ *
+ ******************************************************************************
+ * FileName:        fsbench.c
+ * Dependencies:    FSIO.c, FSblockdev.c, FSfiledisk.c, FSwritecache.c
+ * Processor:       Workstation (POSIX)
+ * Compiler:        GCC
+ *
+ * Runs the file system on a disk image file to measure FSformat, FSfwrite
+ * and FSfread and check what they wrote.  A file of half the image is
+ * written and read in chunks of the given size, then a quarter as much in
+ * 18 byte records, like the samples of the data logger in Demos.c.  Besides
+ * the time taken, each step shows the processor time the file system used,
+ * and the bytes moved per processor second, which is what limits small
+ * writes on the board.  The number of sector commands sent to the media is
+ * shown too, since that is what large transfers mostly depend on.  The exit
+ * status is 0 only if every step worked and the data read back matched.
+ *
+ *      fsbench [image [megabytes [chunk bytes [sector bytes]]]]
+ *
+ * The image has 512 byte sectors unless another size (up to
+ * MEDIA_SECTOR_SIZE) is given.
+ *
+ * Build it as shown at the top of FSfiledisk.c.  It runs under perf, gprof
+ * (add -pg) or valgrind like any other program.
+ *
+*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "MDD File System/FSIO.h"
+#include "MDD File System/FSfiledisk.h"
+
+
+#define RECORD_BYTES    18          // One sample of the data logger in Demos.c
+
+static BYTE     chunkBuffer[1048576];
+
+
+/******************************************************************************
+* Function:        double Now (void)
+*
+* Output:          double     - Seconds from an arbitrary starting point
+*
+* Overview:        Read the monotonic clock
+*****************************************************************************/
+
+static double Now (void)
+{
+    struct timespec t;
+
+    clock_gettime (CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+/******************************************************************************
+* Function:        double CpuNow (void)
+*
+* Output:          double     - Processor seconds the program has used
+*
+* Overview:        Read the process CPU time clock
+*****************************************************************************/
+
+static double CpuNow (void)
+{
+    struct timespec t;
+
+    clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+/******************************************************************************
+* Function:        void Report (const char * step, double start,
+*                               double cpuStart, DWORD bytes)
+*
+* Input:           step       - What was measured
+*                  start      - Now() when it began
+*                  cpuStart   - CpuNow() when it began
+*                  bytes      - File data moved, 0 if none
+*
+* Overview:        Print one result line and clear the command counts
+*****************************************************************************/
+
+static void Report (const char * step, double start, double cpuStart, DWORD bytes)
+{
+    double  seconds = Now() - start;
+    double  cpu = CpuNow() - cpuStart;
+
+    printf ("%-8s %9.3f ms  cpu %9.3f ms", step, seconds * 1e3, cpu * 1e3);
+    if ((bytes != 0) && (seconds > 0) && (cpu > 0))
+        printf (" %9.1f MB/s %9.1f MB/cpu s", bytes / seconds / 1048576.0, bytes / cpu / 1048576.0);
+    else
+        printf ("                             ");
+    printf ("   reads %lu cmds %lu sectors, writes %lu cmds %lu sectors\n",
+        (unsigned long)gFileDiskStats.readCommands, (unsigned long)gFileDiskStats.readSectors,
+        (unsigned long)gFileDiskStats.writeCommands, (unsigned long)gFileDiskStats.writeSectors);
+
+    gFileDiskStats.readCommands = gFileDiskStats.readSectors = 0;
+    gFileDiskStats.writeCommands = gFileDiskStats.writeSectors = 0;
+}
+
+
+int main (int argc, char ** argv)
+{
+    const char *            image = (argc > 1) ? argv[1] : "fsbench.img";
+    DWORD                   megabytes = (argc > 2) ? strtoul (argv[2], NULL, 0) : 64;
+    DWORD                   chunk = (argc > 3) ? strtoul (argv[3], NULL, 0) : 4096;
+    DWORD                   sectorSize = (argc > 4) ? strtoul (argv[4], NULL, 0) : 512;
+    DWORD                   total, done, i, n;
+    const FS_BLOCK_DEVICE * device;
+    FSFILE *                file;
+    double                  t, c;
+
+    if ((megabytes < 2) || (chunk == 0) || (chunk > sizeof (chunkBuffer)) ||
+        (sectorSize > 0xFFFF) || !FileDiskSetSectorSize ((WORD)sectorSize))
+    {
+        printf ("usage: fsbench [image [megabytes (2 or more) [chunk bytes (up to %u) [sector bytes (512 to %u)]]]]\n",
+                (unsigned)sizeof (chunkBuffer), (unsigned)MEDIA_SECTOR_SIZE);
+        return 2;
+    }
+    total = (megabytes / 2) * 1048576;
+
+    if (!FileDiskCreate (image, megabytes * (1048576 / sectorSize)) || ((device = FileDiskOpen (image, FALSE)) == NULL))
+    {
+        printf ("can't make %s\n", image);
+        return 1;
+    }
+    FSSetBlockDevice (device);
+    SetClockVars (2009, 1, 1, 0, 0, 0);
+
+    t = Now();
+    c = CpuNow();
+    if (FSformat (1, 0x12345678, "FSBENCH") != 0)
+    {
+        printf ("FSformat failed\n");
+        return 1;
+    }
+    Report ("format", t, c, 0);
+
+    t = Now();
+    c = CpuNow();
+    if (!FSInit())
+    {
+        printf ("FSInit failed\n");
+        return 1;
+    }
+    Report ("mount", t, c, 0);
+
+    // Write half the image in chunks of the given size
+    if ((file = FSfopen ("BENCH.BIN", "w")) == NULL)
+    {
+        printf ("FSfopen failed\n");
+        return 1;
+    }
+    t = Now();
+    c = CpuNow();
+    for (done = 0; done < total; done += n)
+    {
+        n = (total - done < chunk) ? total - done : chunk;
+        for (i = 0; i < n; i++)
+            chunkBuffer[i] = (BYTE)((done + i) * 7 + ((done + i) >> 9));
+        if (FSfwrite (chunkBuffer, 1, n, file) != n)
+        {
+            printf ("FSfwrite failed at %lu\n", (unsigned long)done);
+            return 1;
+        }
+    }
+    if (FSfclose (file) != 0)
+    {
+        printf ("FSfclose failed\n");
+        return 1;
+    }
+    Report ("write", t, c, total);
+
+    // The closed file is on the media, so FSsync has nothing left to write
+    if (FSsync() != 0)
+    {
+        printf ("FSsync failed\n");
+        return 1;
+    }
+    if (gFileDiskStats.writeCommands != 0)
+    {
+        printf ("FSfclose left %lu sectors unwritten\n", (unsigned long)gFileDiskStats.writeSectors);
+        return 1;
+    }
+
+    // Read it back and check it
+    if ((file = FSfopen ("BENCH.BIN", "r")) == NULL)
+    {
+        printf ("FSfopen failed\n");
+        return 1;
+    }
+    t = Now();
+    c = CpuNow();
+    for (done = 0; done < total; done += n)
+    {
+        n = (total - done < chunk) ? total - done : chunk;
+        if (FSfread (chunkBuffer, 1, n, file) != n)
+        {
+            printf ("FSfread failed at %lu\n", (unsigned long)done);
+            return 1;
+        }
+        for (i = 0; i < n; i++)
+        {
+            if (chunkBuffer[i] != (BYTE)((done + i) * 7 + ((done + i) >> 9)))
+            {
+                printf ("data wrong at %lu\n", (unsigned long)(done + i));
+                return 1;
+            }
+        }
+    }
+    FSfclose (file);
+
+    // Whatever the chunk and sector size, the file is read in order, so the
+    // burst and read-ahead paths must move several sectors per command
+    if (gFileDiskStats.readSectors < 2 * gFileDiskStats.readCommands)
+    {
+        printf ("FSfread read %lu sectors with %lu commands\n", (unsigned long)gFileDiskStats.readSectors,
+                (unsigned long)gFileDiskStats.readCommands);
+        return 1;
+    }
+    Report ("read", t, c, total);
+
+    // Log a quarter as much in small records, then read them back the same way
+    total = (total / 4) / RECORD_BYTES * RECORD_BYTES;
+    if ((file = FSfopen ("LOG.BIN", "w")) == NULL)
+    {
+        printf ("FSfopen failed\n");
+        return 1;
+    }
+    t = Now();
+    c = CpuNow();
+    for (done = 0; done < total; done += RECORD_BYTES)
+    {
+        for (i = 0; i < RECORD_BYTES; i++)
+            chunkBuffer[i] = (BYTE)((done + i) * 7 + ((done + i) >> 9));
+        if (FSfwrite (chunkBuffer, 1, RECORD_BYTES, file) != RECORD_BYTES)
+        {
+            printf ("FSfwrite failed at %lu\n", (unsigned long)done);
+            return 1;
+        }
+    }
+    if (FSfclose (file) != 0)
+    {
+        printf ("FSfclose failed\n");
+        return 1;
+    }
+    Report ("log", t, c, total);
+
+    if ((file = FSfopen ("LOG.BIN", "r")) == NULL)
+    {
+        printf ("FSfopen failed\n");
+        return 1;
+    }
+    t = Now();
+    c = CpuNow();
+    for (done = 0; done < total; done += RECORD_BYTES)
+    {
+        if (FSfread (chunkBuffer, 1, RECORD_BYTES, file) != RECORD_BYTES)
+        {
+            printf ("FSfread failed at %lu\n", (unsigned long)done);
+            return 1;
+        }
+        for (i = 0; i < RECORD_BYTES; i++)
+        {
+            if (chunkBuffer[i] != (BYTE)((done + i) * 7 + ((done + i) >> 9)))
+            {
+                printf ("data wrong at %lu\n", (unsigned long)(done + i));
+                return 1;
+            }
+        }
+    }
+    FSfclose (file);
+    Report ("logread", t, c, total);
+
+    if (FSunmount ('A') != 0)
+    {
+        printf ("FSunmount failed\n");
+        return 1;
+    }
+    FileDiskClose();
+
+    return 0;
+}
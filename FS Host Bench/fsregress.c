@@ -0,0 +1,880 @@
+/******************************************************************************
+ *
+ *               Microchip Memory Disk Drive File System
+ *
+ ******************************************************************************
+ * FileName:        fsregress.c
+ * Dependencies:    FSIO.c, FSblockdev.c, FSwritequeue.c, FSwritecache.c
+ * Processor:       Workstation (POSIX)
+ * Compiler:        GCC
+ *
+ * Regression checks for the file system, run on a RAM disk of two units.
+ * Each pass formats unit 0 as FAT12, FAT16 or FAT32 (512 byte sectors) or
+ * FAT16 with 4096 byte sectors, and unit 1 as a second FAT16 volume, then
+ * checks
+ *
+ *  - FSfallocate and FSfopenReserve: files written in turn after reserving
+ *    space, appending past a reservation, and reserved space given back by
+ *    FSfclose
+ *  - the directory cache: files that were removed, renamed, rewritten or in
+ *    a removed directory are not found stale, and reopening a file does not
+ *    scan its directory again
+ *  - long file names: create, reopen in another case, ~N aliases, overwrite,
+ *    remove, rename of an open file between long and 8.3 names, and names
+ *    that are refused
+ *  - FindFirst/FindNext: every file is listed once, in about one read per
+ *    directory sector, also when files are opened or removed between calls
+ *  - two volumes: copying from A: to B: with both files open, each volume's
+ *    working directory, "B:*.*" searches, remounting B:, and A: carrying on
+ *    when the media of B: is pulled
+ *
+ * Each failed check prints its line; the exit status is 0 only if they all
+ * passed.  Build it with the configuration in this directory:
+ *
+ *      gcc -O2 -fgnu89-inline -fpack-struct=2 -I "FS Host Bench" -I Microchip/Include
+ *          "Microchip/MDD File System/FSIO.c"
+ *          "Microchip/MDD File System/FSblockdev.c"
+ *          "Microchip/MDD File System/FSwritequeue.c"
+ *          "Microchip/MDD File System/FSwritecache.c"
+ *          "FS Host Bench/fsregress.c" -o fsregress
+ *
+ * Add -fsanitize=address,undefined -fno-sanitize=bounds to run it under ASan
+ * and UBSan; the library reads the name and extension of a directory entry
+ * as one 11 byte array, which the bounds check would report.
+ *
+*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "MDD File System/FSIO.h"
+#include "MDD File System/FSblockdev.h"
+
+
+// *****************************************************************************
+// Section: RAM Disk
+// *****************************************************************************
+
+#define RAM_DISK_UNITS      2
+
+// One unit of the RAM disk.  Sectors are only given memory once something
+// other than zeros is written to them, so a FAT32 sized unit fits.
+typedef struct _RAM_DISK_UNIT
+{
+    BYTE **     sector;             // Each sector's data, NULL if all zeros
+    DWORD       sectors;            // Size of the unit in sectors
+    BYTE        present;            // FALSE once the media is pulled
+} RAM_DISK_UNIT;
+
+static RAM_DISK_UNIT    ramDisk[RAM_DISK_UNITS];
+static BYTE             ramUnit = 0;            // The selected unit
+static WORD             ramSectorSize = 512;    // Bytes in a sector of every unit
+static DWORD            ramReads = 0;           // Sectors read from any unit
+
+
+/******************************************************************************
+* Function:        BYTE RamDiskPresent (void)
+*
+* Output:          TRUE       - The selected unit has media
+*
+* Overview:        MediaDetect and MediaInitialize entries of the driver
+*****************************************************************************/
+
+static BYTE RamDiskPresent (void)
+{
+    return ramDisk[ramUnit].present;
+}
+
+
+/******************************************************************************
+* Function:        BYTE RamDiskRead (DWORD sector, WORD count, BYTE * buffer)
+*
+* Input:           sector     - First sector to read
+*                  count      - Number of consecutive sectors
+*                  buffer     - Destination, count sectors
+*
+* Output:          TRUE       - All sectors read
+*                  FALSE      - No media, or the run is past its end
+*
+* Overview:        SectorReadMultiple entry of the driver
+*****************************************************************************/
+
+static BYTE RamDiskRead (DWORD sector, WORD count, BYTE * buffer)
+{
+    RAM_DISK_UNIT * u = &ramDisk[ramUnit];
+
+    if (!u->present || (sector >= u->sectors) || (count > u->sectors - sector))
+        return FALSE;
+
+    for (ramReads += count; count != 0; count--, sector++, buffer += ramSectorSize)
+    {
+        if (u->sector[sector] == NULL)
+            memset (buffer, 0, ramSectorSize);
+        else
+            memcpy (buffer, u->sector[sector], ramSectorSize);
+    }
+    return TRUE;
+}
+
+
+/******************************************************************************
+* Function:        BYTE RamDiskWrite (DWORD sector, WORD count, BYTE * buffer,
+*                                     BYTE allowWriteToZero)
+*
+* Input:           sector           - First sector to write
+*                  count            - Number of consecutive sectors
+*                  buffer           - Source, count sectors
+*                  allowWriteToZero - TRUE if sector 0 may be written
+*
+* Output:          TRUE       - All sectors written
+*                  FALSE      - No media, sector 0 without allowWriteToZero,
+*                               the run is past the end, or out of memory
+*
+* Overview:        SectorWriteMultiple entry of the driver
+*****************************************************************************/
+
+static BYTE RamDiskWrite (DWORD sector, WORD count, BYTE * buffer, BYTE allowWriteToZero)
+{
+    RAM_DISK_UNIT * u = &ramDisk[ramUnit];
+    WORD            i;
+
+    if (!u->present || (sector >= u->sectors) || (count > u->sectors - sector) ||
+        ((sector == 0) && !allowWriteToZero))
+        return FALSE;
+
+    for (; count != 0; count--, sector++, buffer += ramSectorSize)
+    {
+        if (u->sector[sector] == NULL)
+        {
+            for (i = 0; (i < ramSectorSize) && (buffer[i] == 0); i++)
+                ;
+            if (i == ramSectorSize)
+                continue;
+            if ((u->sector[sector] = malloc (ramSectorSize)) == NULL)
+                return FALSE;
+        }
+        memcpy (u->sector[sector], buffer, ramSectorSize);
+    }
+    return TRUE;
+}
+
+
+static DWORD RamDiskCapacity (void)
+{
+    return ramDisk[ramUnit].sectors;
+}
+
+
+static BYTE RamDiskWriteProtect (void)
+{
+    return FALSE;
+}
+
+
+static BYTE RamDiskSelect (BYTE unit)
+{
+    if ((unit >= RAM_DISK_UNITS) || (ramDisk[unit].sectors == 0))
+        return FALSE;
+
+    ramUnit = unit;
+    return TRUE;
+}
+
+
+static WORD RamDiskSectorSize (void)
+{
+    return ramSectorSize;
+}
+
+
+static const FS_BLOCK_DEVICE ramDiskDevice =
+{
+    RamDiskPresent,
+    RamDiskPresent,
+    RamDiskRead,
+    RamDiskWrite,
+    NULL,                               // zeros are written
+    NULL,                               // nothing cached
+    RamDiskCapacity,
+    RamDiskWriteProtect,
+    RamDiskSelect,
+    NULL,                               // written at once
+    NULL,
+    RamDiskSectorSize
+};
+
+
+/******************************************************************************
+* Function:        void RamDiskSetup (BYTE unit, DWORD bytes)
+*
+* Input:           unit       - Unit to set up
+*                  bytes      - Its size, 0 to free it
+*
+* Overview:        Free what a unit held and make it blank media of the
+*                  given size, in sectors of ramSectorSize bytes
+*****************************************************************************/
+
+static void RamDiskSetup (BYTE unit, DWORD bytes)
+{
+    RAM_DISK_UNIT * u = &ramDisk[unit];
+    DWORD           s;
+
+    for (s = 0; s < u->sectors; s++)
+        free (u->sector[s]);
+    free (u->sector);
+
+    u->sectors = bytes / ramSectorSize;
+    u->sector = (u->sectors != 0) ? calloc (u->sectors, sizeof (BYTE *)) : NULL;
+    if ((u->sectors != 0) && (u->sector == NULL))
+    {
+        printf ("out of memory\n");
+        exit (1);
+    }
+    u->present = TRUE;
+}
+
+
+// *****************************************************************************
+// Section: Helpers
+// *****************************************************************************
+
+static int      failures = 0;
+static BYTE     dataBuffer[8192];
+static BYTE     checkBuffer[8192];
+
+// Count a check that failed and show where it is
+#define CHECK(c)        Check ((c), #c, __LINE__)
+
+static BYTE Check (BYTE good, const char * what, int line)
+{
+    if (!good)
+    {
+        printf ("    FAILED line %d: %s\n", line, what);
+        failures++;
+    }
+    return good;
+}
+
+
+/******************************************************************************
+* Function:        void Pattern (BYTE * buffer, DWORD n, DWORD seed,
+*                                DWORD offset)
+*
+* Input:           buffer     - Where to put the bytes
+*                  n          - Number of bytes
+*                  seed       - Tells the files apart
+*                  offset     - Position of the first byte in the file
+*
+* Overview:        Make the contents of a test file, different for every
+*                  seed and position
+*****************************************************************************/
+
+static void Pattern (BYTE * buffer, DWORD n, DWORD seed, DWORD offset)
+{
+    DWORD   i;
+
+    for (i = 0; i < n; i++)
+        buffer[i] = (BYTE)((offset + i) * 7 + ((offset + i) >> 9) + seed * 13);
+}
+
+
+/******************************************************************************
+* Function:        BYTE WritePart (FSFILE * file, DWORD from, DWORD to,
+*                                  DWORD seed, DWORD chunk)
+*
+* Input:           file       - Open file, positioned at from
+*                  from, to   - The bytes of the file to write
+*                  seed       - Tells the files apart
+*                  chunk      - Bytes per FSfwrite, up to sizeof(dataBuffer)
+*
+* Output:          TRUE       - Everything was written
+*
+* Overview:        Write part of a test file
+*****************************************************************************/
+
+static BYTE WritePart (FSFILE * file, DWORD from, DWORD to, DWORD seed, DWORD chunk)
+{
+    DWORD   n;
+
+    for (; from < to; from += n)
+    {
+        n = (to - from < chunk) ? to - from : chunk;
+        Pattern (dataBuffer, n, seed, from);
+        if (FSfwrite (dataBuffer, 1, n, file) != n)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+
+/******************************************************************************
+* Function:        BYTE WriteFile (const char * name, DWORD size, DWORD seed)
+*
+* Input:           name       - File to make or replace
+*                  size       - Its size in bytes
+*                  seed       - Tells the files apart
+*
+* Output:          TRUE       - The file was written and closed
+*
+* Overview:        Write a whole test file
+*****************************************************************************/
+
+static BYTE WriteFile (const char * name, DWORD size, DWORD seed)
+{
+    FSFILE *    file;
+    BYTE        good;
+
+    if ((file = FSfopen (name, "w")) == NULL)
+        return FALSE;
+    good = WritePart (file, 0, size, seed, 1000);
+    return (FSfclose (file) == 0) && good;
+}
+
+
+/******************************************************************************
+* Function:        BYTE FileIs (const char * name, DWORD size, DWORD seed)
+*
+* Input:           name       - File to read
+*                  size       - The size it should have
+*                  seed       - The seed it was written with
+*
+* Output:          TRUE       - The file has exactly that size and contents
+*
+* Overview:        Read a whole test file back and check it
+*****************************************************************************/
+
+static BYTE FileIs (const char * name, DWORD size, DWORD seed)
+{
+    FSFILE *    file;
+    DWORD       done, n;
+    BYTE        good = TRUE;
+
+    if ((file = FSfopen (name, "r")) == NULL)
+        return FALSE;
+
+    for (done = 0; good && (done < size); done += n)
+    {
+        n = (size - done < 1500) ? size - done : 1500;
+        Pattern (checkBuffer, n, seed, done);
+        good = (FSfread (dataBuffer, 1, n, file) == n) && (memcmp (dataBuffer, checkBuffer, n) == 0);
+    }
+    if (good)
+        good = (FSfread (dataBuffer, 1, 1, file) == 0);
+
+    FSfclose (file);
+    return good;
+}
+
+
+/******************************************************************************
+* Function:        BYTE Exists (const char * name)
+*
+* Input:           name       - File to look for
+*
+* Output:          TRUE       - It can be opened for reading
+*****************************************************************************/
+
+static BYTE Exists (const char * name)
+{
+    FSFILE *    file;
+
+    if ((file = FSfopen (name, "r")) == NULL)
+        return FALSE;
+    FSfclose (file);
+    return TRUE;
+}
+
+
+/******************************************************************************
+* Function:        int Listed (const char * pattern, const char * name)
+*
+* Input:           pattern    - FindFirst pattern
+*                  name       - Long (or 8.3) name to count
+*
+* Output:          int        - How many times a search lists the name
+*****************************************************************************/
+
+static int Listed (const char * pattern, const char * name)
+{
+    SearchRec   rec;
+    int         count = 0;
+    int         found;
+
+    for (found = FindFirst (pattern, ATTR_ARCHIVE, &rec); found == 0; found = FindNext (&rec))
+    {
+#ifdef SUPPORT_LFN
+        if (strcmp (rec.longFilename, name) == 0)
+#else
+        if (strcmp (rec.filename, name) == 0)
+#endif
+            count++;
+    }
+    return count;
+}
+
+
+// *****************************************************************************
+// Section: Checks
+// *****************************************************************************
+
+/******************************************************************************
+* Function:        void CheckReserve (DWORD volumeBytes)
+*
+* Input:           volumeBytes - Size of the volume on drive A:
+*
+* Overview:        FSfallocate and FSfopenReserve
+*****************************************************************************/
+
+static void CheckReserve (DWORD volumeBytes)
+{
+    FSFILE *    one;
+    FSFILE *    two;
+    DWORD       done, big;
+
+    // Two files written in turn, each into the room reserved for it
+    one = FSfopenReserve ("RES1.BIN", "w", 65536);
+    two = FSfopenReserve ("RES2.BIN", "w", 65536);
+    if (!CHECK ((one != NULL) && (two != NULL)))
+        return;
+    for (done = 0; done < 60000; done += 1000)
+    {
+        CHECK (WritePart (one, done, done + 1000, 1, 1000));
+        CHECK (WritePart (two, done, done + 1000, 2, 1000));
+    }
+    CHECK (FSfclose (one) == 0);
+    CHECK (FSfclose (two) == 0);
+    CHECK (FileIs ("RES1.BIN", 60000, 1));
+    CHECK (FileIs ("RES2.BIN", 60000, 2));
+
+    // Appending past the reservation allocates as usual
+    one = FSfopenReserve ("RES3.BIN", "w", 4096);
+    if (!CHECK (one != NULL))
+        return;
+    CHECK (WritePart (one, 0, 20000, 3, 700));
+    CHECK (FSfclose (one) == 0);
+    CHECK (FileIs ("RES3.BIN", 20000, 3));
+    one = FSfopen ("RES3.BIN", "a");
+    if (!CHECK (one != NULL))
+        return;
+    CHECK (FSfallocate (one, 40000) == 0);
+    CHECK (WritePart (one, 20000, 30000, 3, 700));
+    CHECK (FSfclose (one) == 0);
+    CHECK (FileIs ("RES3.BIN", 30000, 3));
+
+    // Reserve most of the volume twice; the second only fits if FSfclose
+    // gave back what the first file did not use
+    big = volumeBytes / 4 * 3;
+    one = FSfopen ("BIG1.BIN", "w");
+    if (!CHECK (one != NULL))
+        return;
+    CHECK (FSfallocate (one, big) == 0);
+    CHECK (WritePart (one, 0, 100, 4, 100));
+    CHECK (FSfclose (one) == 0);
+    one = FSfopen ("BIG2.BIN", "w");
+    if (!CHECK (one != NULL))
+        return;
+    CHECK (FSfallocate (one, big) == 0);
+    CHECK (FSfclose (one) == 0);
+    CHECK (FileIs ("BIG1.BIN", 100, 4));
+    CHECK (FileIs ("BIG2.BIN", 0, 0));
+
+    // Nothing is left behind
+    CHECK (FSremove ("BIG1.BIN") == 0);
+    CHECK (FSremove ("BIG2.BIN") == 0);
+    one = FSfopen ("BIG3.BIN", "w");
+    if (!CHECK (one != NULL))
+        return;
+    CHECK (FSfallocate (one, big) == 0);
+    CHECK (FSfclose (one) == 0);
+    CHECK (FSremove ("BIG3.BIN") == 0);
+}
+
+
+/******************************************************************************
+* Function:        void CheckDirCache (void)
+*
+* Overview:        Lookups of files that changed after they were found
+*****************************************************************************/
+
+#define CACHE_FILES     120
+
+static void CheckDirCache (void)
+{
+    char        name[16];
+    FSFILE *    file;
+    DWORD       reads;
+    int         i;
+
+    if (!CHECK ((FSmkdir ("CACHE") == 0) && (FSchdir ("CACHE") == 0)))
+        return;
+
+    for (i = 0; i < CACHE_FILES; i++)
+    {
+        sprintf (name, "F%03d.TXT", i);
+        CHECK (WriteFile (name, 10 + i, i));
+    }
+    for (i = CACHE_FILES - 1; i >= 0; i--)
+    {
+        sprintf (name, "F%03d.TXT", i);
+        CHECK (FileIs (name, 10 + i, i));
+    }
+
+    // Opening the last file again takes about one read for its data, not
+    // a scan of the directory
+    reads = ramReads;
+    for (i = 0; i < 20; i++)
+        CHECK (FileIs ("F119.TXT", 129, 119));
+    CHECK (ramReads - reads <= 20 * 2);
+
+    CHECK (FSremove ("F007.TXT") == 0);
+    CHECK (!Exists ("F007.TXT"));
+
+    file = FSfopen ("F008.TXT", "r");
+    if (CHECK (file != NULL))
+    {
+        CHECK (FSrename ("MOVED.TXT", file) == 0);
+        FSfclose (file);
+    }
+    CHECK (!Exists ("F008.TXT"));
+    CHECK (FileIs ("MOVED.TXT", 18, 8));
+
+    CHECK (WriteFile ("F009.TXT", 5000, 99));
+    CHECK (FileIs ("F009.TXT", 5000, 99));
+
+    // A new directory of the same name must not show the old files
+    CHECK (FSchdir ("..") == 0);
+    CHECK (FSrmdir ("CACHE", TRUE) == 0);
+    CHECK (FSchdir ("CACHE") != 0);
+    CHECK (FSmkdir ("CACHE") == 0);
+    CHECK (FSchdir ("CACHE") == 0);
+    CHECK (!Exists ("F010.TXT"));
+    CHECK (FSchdir ("..") == 0);
+    CHECK (FSrmdir ("CACHE", TRUE) == 0);
+}
+
+
+/******************************************************************************
+* Function:        void CheckLongNames (void)
+*
+* Overview:        Long file names and their aliases
+*****************************************************************************/
+
+#ifdef SUPPORT_LFN
+
+#define LONG_FILES      12
+
+static void CheckLongNames (void)
+{
+    char        name[FS_LFN_MAX_CHARS + 8];
+    SearchRec   rec;
+    FSFILE *    file;
+    int         i, found;
+    char        seen[LONG_FILES];
+
+    if (!CHECK ((FSmkdir ("LONG") == 0) && (FSchdir ("LONG") == 0)))
+        return;
+
+    for (i = 0; i < LONG_FILES; i++)
+    {
+        sprintf (name, "Long file name number %d.txt", i);
+        CHECK (WriteFile (name, 100 + i, 20 + i));
+    }
+    CHECK (FileIs ("LONG FILE NAME NUMBER 3.TXT", 103, 23));
+    CHECK (FileIs ("long file name number 11.txt", 111, 31));
+
+    // Every name is listed once, each with its own alias
+    memset (seen, 0, sizeof (seen));
+    for (found = FindFirst ("*.*", ATTR_ARCHIVE, &rec); found == 0; found = FindNext (&rec))
+    {
+        if ((sscanf (rec.longFilename, "Long file name number %d.txt", &i) == 1) && (i >= 0) && (i < LONG_FILES))
+        {
+            seen[i]++;
+            CHECK (strchr (rec.filename, '~') != NULL);
+            CHECK (FileIs (rec.filename, 100 + i, 20 + i));
+        }
+    }
+    for (i = 0; i < LONG_FILES; i++)
+        CHECK (seen[i] == 1);
+
+    // Overwrite, then remove
+    CHECK (WriteFile ("Long file name number 4.txt", 7, 77));
+    CHECK (FileIs ("Long file name number 4.txt", 7, 77));
+    CHECK (FSremove ("Long file name number 5.txt") == 0);
+    CHECK (!Exists ("Long file name number 5.txt"));
+    CHECK (Listed ("*.*", "Long file name number 5.txt") == 0);
+    CHECK (FileIs ("Long file name number 6.txt", 106, 26));
+
+    // Rename a file while it is being written, long to 8.3 and back
+    file = FSfopen ("Rename me while open.txt", "w");
+    if (CHECK (file != NULL))
+    {
+        CHECK (WritePart (file, 0, 3000, 5, 1000));
+        CHECK (FSrename ("SHORT.TXT", file) == 0);
+        CHECK (WritePart (file, 3000, 6000, 5, 1000));
+        CHECK (FSfclose (file) == 0);
+    }
+    CHECK (!Exists ("Rename me while open.txt"));
+    CHECK (FileIs ("SHORT.TXT", 6000, 5));
+    file = FSfopen ("SHORT.TXT", "a");
+    if (CHECK (file != NULL))
+    {
+        CHECK (FSrename ("Back to a long name.txt", file) == 0);
+        CHECK (WritePart (file, 6000, 9000, 5, 1000));
+        CHECK (FSfclose (file) == 0);
+    }
+    CHECK (!Exists ("SHORT.TXT"));
+    CHECK (FileIs ("Back to a long name.txt", 9000, 5));
+    CHECK (Listed ("*.*", "Back to a long name.txt") == 1);
+
+    // Names that are too long, or that Windows could not open
+    memset (name, 'x', FS_LFN_MAX_CHARS + 1);
+    strcpy (name + FS_LFN_MAX_CHARS + 1, ".txt");
+    CHECK (FSfopen (name, "w") == NULL);
+    CHECK (FSfopen ("Ends in a dot.", "w") == NULL);
+    CHECK (FSfopen ("Ends in a space ", "w") == NULL);
+
+    CHECK (FSchdir ("..") == 0);
+    CHECK (FSrmdir ("LONG", TRUE) == 0);
+}
+
+#endif
+
+
+/******************************************************************************
+* Function:        void CheckSearch (void)
+*
+* Overview:        FindFirst/FindNext listing a directory
+*****************************************************************************/
+
+#define LIST_FILES      100
+
+static void CheckSearch (void)
+{
+    char        name[16];
+    char        seen[LIST_FILES];
+    SearchRec   rec;
+    DWORD       reads;
+    int         i, n, found, listed;
+
+    if (!CHECK ((FSmkdir ("LIST") == 0) && (FSchdir ("LIST") == 0)))
+        return;
+    for (i = 0; i < LIST_FILES; i++)
+    {
+        sprintf (name, "F%03d.TXT", i);
+        CHECK (WriteFile (name, i, i));
+    }
+
+    // A plain listing reads each directory sector about once
+    memset (seen, 0, sizeof (seen));
+    listed = 0;
+    reads = ramReads;
+    for (found = FindFirst ("*.*", ATTR_ARCHIVE, &rec); found == 0; found = FindNext (&rec))
+    {
+        listed++;
+        if ((sscanf (rec.filename, "F%03d.TXT", &n) == 1) && (n >= 0) && (n < LIST_FILES))
+        {
+            seen[n]++;
+            CHECK (rec.filesize == (unsigned long)n);
+        }
+    }
+    CHECK (ramReads - reads < (DWORD)listed / 4);
+    for (i = 0; i < LIST_FILES; i++)
+        CHECK (seen[i] == 1);
+
+    // Reading other files between the calls does not lose the place
+    memset (seen, 0, sizeof (seen));
+    for (found = FindFirst ("F*.TXT", ATTR_ARCHIVE, &rec); found == 0; found = FindNext (&rec))
+    {
+        if ((sscanf (rec.filename, "F%03d.TXT", &n) == 1) && (n >= 0) && (n < LIST_FILES))
+        {
+            seen[n]++;
+            sprintf (name, "F%03d.TXT", LIST_FILES - 1 - n);
+            CHECK (FileIs (name, LIST_FILES - 1 - n, LIST_FILES - 1 - n));
+        }
+    }
+    for (i = 0; i < LIST_FILES; i++)
+        CHECK (seen[i] == 1);
+
+    // Nor does removing each file as it is listed
+    memset (seen, 0, sizeof (seen));
+    for (found = FindFirst ("F*.TXT", ATTR_ARCHIVE, &rec); found == 0; found = FindNext (&rec))
+    {
+        if ((sscanf (rec.filename, "F%03d.TXT", &n) == 1) && (n >= 0) && (n < LIST_FILES))
+        {
+            seen[n]++;
+            CHECK (FSremove (rec.filename) == 0);
+        }
+    }
+    for (i = 0; i < LIST_FILES; i++)
+        CHECK (seen[i] == 1);
+    CHECK (FindFirst ("*.*", ATTR_ARCHIVE, &rec) != 0);
+
+    CHECK (FSchdir ("..") == 0);
+    CHECK (FSrmdir ("LIST", FALSE) == 0);
+}
+
+
+/******************************************************************************
+* Function:        void CheckVolumes (void)
+*
+* Overview:        Drives A: and B: on units 0 and 1
+*****************************************************************************/
+
+static void CheckVolumes (void)
+{
+    FSFILE *    from;
+    FSFILE *    to;
+    DWORD       done, n;
+    char        cwd[32];
+
+    // Copy between the volumes with both files open
+    CHECK (WriteFile ("A:SRC.BIN", 300000, 6));
+    from = FSfopen ("A:SRC.BIN", "r");
+    to = FSfopen ("B:COPY.BIN", "w");
+    if (CHECK ((from != NULL) && (to != NULL)))
+    {
+        for (done = 0; done < 300000; done += n)
+        {
+            n = (300000 - done < 700) ? 300000 - done : 700;
+            if (!CHECK ((FSfread (dataBuffer, 1, n, from) == n) && (FSfwrite (dataBuffer, 1, n, to) == n)))
+                break;
+        }
+    }
+    if (from != NULL)
+        CHECK (FSfclose (from) == 0);
+    if (to != NULL)
+        CHECK (FSfclose (to) == 0);
+    CHECK (FileIs ("B:COPY.BIN", 300000, 6));
+    CHECK (!Exists ("COPY.BIN"));
+    CHECK (Listed ("B:*.*", "COPY.BIN") == 1);
+    CHECK (Listed ("*.*", "COPY.BIN") == 0);
+
+    // Each volume has its own working directory
+    CHECK (FSmkdir ("B:BDIR") == 0);
+    CHECK (FSchdir ("B:BDIR") == 0);
+    CHECK ((FSgetcwd (cwd, sizeof (cwd)) != NULL) && (strcmp (cwd, "\\") == 0));
+    CHECK (WriteFile ("B:INNER.TXT", 1234, 7));
+    CHECK (FSchdrive ('B') == 0);
+    CHECK ((FSgetcwd (cwd, sizeof (cwd)) != NULL) && (strcmp (cwd, "\\BDIR") == 0));
+    CHECK (FileIs ("INNER.TXT", 1234, 7));
+    CHECK (FSchdir ("\\") == 0);
+    CHECK (FSchdrive ('A') == 0);
+    CHECK (FileIs ("SRC.BIN", 300000, 6));
+
+    // Mounted again, B: still has everything
+    CHECK (FSunmount ('B') == 0);
+    CHECK (!Exists ("B:COPY.BIN"));
+    CHECK (FSmount ('B', 1, 0));
+    CHECK (FileIs ("B:COPY.BIN", 300000, 6));
+    CHECK (FSchdir ("B:BDIR") == 0);
+    CHECK (FileIs ("B:INNER.TXT", 1234, 7));
+    CHECK (FSchdir ("B:\\") == 0);
+
+    // Pull the media of B: while a file on it is being written; A: carries on
+    to = FSfopen ("B:LOST.BIN", "w");
+    if (CHECK (to != NULL))
+    {
+        CHECK (WritePart (to, 0, 3000, 8, 1000));
+        ramDisk[1].present = FALSE;
+        FSfclose (to);
+    }
+    FSunmount ('B');
+    CHECK (WriteFile ("A:AFTER.BIN", 50000, 9));
+    CHECK (FileIs ("A:AFTER.BIN", 50000, 9));
+    CHECK (FileIs ("A:SRC.BIN", 300000, 6));
+    ramDisk[1].present = TRUE;
+    CHECK (FSmount ('B', 1, 0));
+    CHECK (FileIs ("B:COPY.BIN", 300000, 6));
+    CHECK (FSremove ("A:AFTER.BIN") == 0);
+    CHECK (FSremove ("A:SRC.BIN") == 0);
+}
+
+
+// *****************************************************************************
+// Section: Passes
+// *****************************************************************************
+
+// One pass: the media, and the file system FSformat should pick for unit 0
+typedef struct _PASS
+{
+    DWORD           bytes;          // Size of unit 0
+    WORD            sectorSize;     // Bytes in a sector of both units
+    const char *    type;           // "FAT12", "FAT16" or "FAT32"
+} PASS;
+
+static const PASS passes[] =
+{
+    {   2ul << 20,  512,    "FAT12" },
+    {  32ul << 20,  512,    "FAT16" },
+    { 2300ul << 20, 512,    "FAT32" },
+    {  64ul << 20,  4096,   "FAT16" },
+};
+
+
+/******************************************************************************
+* Function:        BYTE TypeIs (BYTE unit, const char * type)
+*
+* Input:           unit       - RAM disk unit
+*                  type       - "FAT12", "FAT16" or "FAT32"
+*
+* Output:          TRUE       - The first partition of the unit has that
+*                               file system type in its boot sector
+*****************************************************************************/
+
+static BYTE TypeIs (BYTE unit, const char * type)
+{
+    static BYTE sector[MEDIA_SECTOR_SIZE];
+    DWORD       first;
+
+    RamDiskSelect (unit);
+    if (!RamDiskRead (0, 1, sector))
+        return FALSE;
+    first = sector[454] | ((DWORD)sector[455] << 8) | ((DWORD)sector[456] << 16) | ((DWORD)sector[457] << 24);
+    if (!RamDiskRead (first, 1, sector))
+        return FALSE;
+    return (memcmp (sector + ((strcmp (type, "FAT32") == 0) ? 82 : 54), type, 5) == 0);
+}
+
+
+int main (void)
+{
+    const PASS *    p;
+    int             before;
+
+    FSSetBlockDevice (&ramDiskDevice);
+    SetClockVars (2009, 1, 1, 0, 0, 0);
+
+    for (p = passes; p < passes + sizeof (passes) / sizeof (passes[0]); p++)
+    {
+        before = failures;
+        ramSectorSize = p->sectorSize;
+        RamDiskSetup (0, p->bytes);
+        RamDiskSetup (1, 32ul << 20);
+
+        // Blank media does not mount, but the drives can be formatted
+        CHECK (!FSInit());
+        CHECK (!FSmount ('B', 1, 0));
+        CHECK ((FSchdrive ('A') == 0) && (FSformat (1, 0x12345678, "REGRESS") == 0));
+        CHECK ((FSchdrive ('B') == 0) && (FSformat (1, 0x87654321, "SECOND") == 0));
+        CHECK (TypeIs (0, p->type) && TypeIs (1, "FAT16"));
+        if (CHECK (FSInit() && FSmount ('B', 1, 0) && (FSchdrive ('A') == 0)))
+        {
+            CheckReserve (p->bytes);
+            CheckDirCache();
+#ifdef SUPPORT_LFN
+            CheckLongNames();
+#endif
+            CheckSearch();
+            CheckVolumes();
+            CHECK (FSunmount ('B') == 0);
+            CHECK (FSunmount ('A') == 0);
+        }
+
+        printf ("%s %s, %u byte sectors, %lu MB\n", (failures == before) ? "pass" : "FAIL",
+                p->type, (unsigned)p->sectorSize, (unsigned long)(p->bytes >> 20));
+    }
+
+    RamDiskSetup (0, 0);
+    RamDiskSetup (1, 0);
+    return (failures == 0) ? 0 : 1;
+}
@@ -69,11 +69,12 @@ typedef enum _CETYPE
 	CE_TMPMEMFULL,					 // No more external RAM
 	CE_FILENOTOPENED,				 // File not openned for the write
 	CE_BADCACHEREAD,				 // Bad cache read
-	CE_CARDFAT32,					 // FAT 32 - card not supported
+	CE_CARDFAT32,					 // FAT 32 - card not supported (SUPPORT_FAT32 not defined)
 	CE_IMAGENOTAVAIL,				 // The PC has tried to tell me to use a SQTP file without a part selected
 	CE_READONLY,					 // The File is readonly
 	CE_CARDFAT12,					 // FAT12 during intial testing we are not supporting FAT12
-	CE_WRITEONLY					 // The File is open in write only mode - a read was attempted
+	CE_WRITEONLY,					 // The File is open in write only mode - a read was attempted
+	CE_UNSUPPORTED_SECTOR_SIZE		 // The media sector size is not a power of 2 from 512 to MEDIA_SECTOR_SIZE
 } CETYPE;
 
 #define FOUND       0       // directory entry match
@@ -82,7 +83,7 @@ typedef enum _CETYPE
 #define NO_MORE     2       // no more files found
 #define WRITE_ERROR 3       // a write error occured
 
-#define FAT12       1       // internal flags for FAT type 12 and 16
+#define FAT12       1       // internal flags for FAT type 12, 16 and 32
 #define FAT16       2
 #define FAT32       3
 
@@ -109,9 +110,11 @@ typedef enum _CETYPE
 #define CLUSTER_EMPTY       0x0000
 #define LAST_CLUSTER_FAT12  0xff8
 #define LAST_CLUSTER_FAT16  0xfff8
-#define LAST_CLUSTER        0xfff8
+#define LAST_CLUSTER_FAT32  0x0FFFFFF8
+#define LAST_CLUSTER        0x0FFFFFF8  // ReadFAT returns this for the end of any chain
 #define END_CLUSTER         0xFFFE
-#define CLUSTER_FAIL        0xFFFF
+#define CLUSTER_FAIL        0xFFFFFFFF
+#define FAT32_CLUSTER_MASK  0x0FFFFFFF  // the upper 4 bits of a FAT32 entry are reserved
 #define WIN_LAST_CLUS       0xFFFF
         
 #define FAT_ENTRY0          0xFFF8
@@ -128,6 +131,7 @@ typedef enum _CETYPE
 #define RAMread( a, f)  *(a+f)
 #define RAMreadW( a, f) *(WORD *)(a+f)
 #define RAMreadD( a, f) *(DWORD *)(a+f)
+#define RAMwriteD( a, f, d) *(DWORD *)(a+f) = d
 
 #include <stdio.h>
 #ifndef EOF
@@ -143,11 +147,19 @@ typedef struct
     DWORD     	data;           // lba of the data area 
     WORD     	maxroot;        // max number of entries in root dir
     DWORD     	maxcls;         // max number of clusters in partition
-    WORD     	fatsize;        // number of sectors
+    DWORD     	fatsize;        // number of sectors
     BYTE      	fatcopy;        // number of copies
     BYTE      	SecPerClus;     // number of sectors per cluster
     BYTE      	type;           // type of FAT (FAT12, FAT16...)
     BYTE      	mount;          // flag (TRUE= mounted, FALSE= invalid)    
+    DWORD     	rootcls;        // first cluster of the root directory (FAT32)
+    DWORD     	fsinfo;         // lba of the FSInfo sector (FAT32), 0 if none
+    DWORD     	freecls;        // free cluster count, FSINFO_UNKNOWN if not known
+    DWORD     	nextfree;       // cluster to start the free cluster search from
+    BYTE      	unit;           // media unit the volume is on (see MediaSelect)
+    BYTE      	partition;      // MBR partition table entry (0-3) of the volume
+    WORD      	sectorSize;     // bytes per sector, 512 to MEDIA_SECTOR_SIZE
+    BYTE      	sectorShift;    // log2 of sectorSize
 } DISK;
 
 #ifdef USE_PIC18
@@ -233,6 +245,63 @@ typedef struct __BPB_FAT16 {
 
 typedef _BPB_FAT16 * BPB_FAT16;
 
+// BPB FAT32
+typedef struct __BPB_FAT32 {
+        SWORD BootSec_JumpCmd;        // Jump Command
+        BYTE  BootSec_OEMName[8];     // OEM name
+        WORD  BootSec_BPS;     // BYTEs per sector
+        BYTE  BootSec_SPC;     // sectors per allocation unit
+        WORD  BootSec_ResrvSec;     // number of reserved sectors after start
+        BYTE  BootSec_FATCount;        // number of FATs
+        WORD  BootSec_RootDirEnts;     // number of root directory entries (0)
+        WORD  BootSec_TotSec16;       // total number of sectors (0)
+        BYTE  BootSec_MDesc;          // media descriptor
+        WORD  BootSec_SPF;         // number of sectors per FAT (0)
+        WORD  BootSec_SPT;      // sectors per track
+        WORD  BootSec_HeadCnt;       // number of heads
+        DWORD BootSec_HiddenSecCnt;        // number of hidden sectors
+        DWORD BootSec_TotSec32;       // 32bit total sec count
+        DWORD BootSec_FATSz32;        // 32bit number of sectors per FAT
+        WORD  BootSec_ExtFlags;       // FAT mirroring flags
+        WORD  BootSec_FSVers;         // file system version
+        DWORD BootSec_RootClus;       // first cluster of the root directory
+        WORD  BootSec_FSInfo;         // sector number of the FSInfo structure
+        WORD  BootSec_BkBootSec;      // sector number of the backup boot sector
+        BYTE  BootSec_Reserved[12];   // Nothing
+        BYTE  BootSec_DriveNum;          // Int 13 drive number
+        BYTE  BootSec_Reserved1;       // Nothing
+        BYTE  BootSec_BootSig;         // 0x29
+        BYTE  BootSec_VolID[4];        // Volume Id
+        BYTE  BootSec_VolLabel[11];       // Volume Label
+        BYTE  BootSec_FSType[8];   // File system type, not used for determination
+}_BPB_FAT32;
+
+#define BSI_FATSZ32        36
+#define BSI_EXTFLAGS       40
+#define BSI_FSVERS         42
+#define BSI_ROOTCLUS       44
+#define BSI_FSINFO         48
+#define BSI_BKBOOTSEC      50
+#define BSI_FAT32_DRIVENUM 64
+#define BSI_FAT32_BOOTSIG  66
+#define BSI_FAT32_VOLID    67
+#define BSI_FAT32_VOLLABEL 71
+#define BSI_FAT32_FSTYPE   82
+
+typedef _BPB_FAT32 * BPB_FAT32;
+
+// FSInfo sector offsets and signatures (FAT32)
+#define FSI_LEADSIG        0
+#define FSI_STRUCSIG       484
+#define FSI_FREE_COUNT     488
+#define FSI_NXT_FREE       492
+#define FSI_TRAILSIG       508
+
+#define FSI_LEADSIG_VALUE  0x41615252
+#define FSI_STRUCSIG_VALUE 0x61417272
+#define FSI_TRAILSIG_VALUE 0xAA550000
+#define FSINFO_UNKNOWN     0xFFFFFFFF
+
 // PTE_MBR - Partition Table Entry
 typedef struct _PTE_MBR
 {
@@ -262,10 +331,11 @@ typedef struct __BootSec
 {
     union
     {
+        _BPB_FAT32  FAT_32;	
         _BPB_FAT16  FAT_16;	
         _BPB_FAT12  FAT_12;	
     }FAT;    
-    BYTE  	Reserved[MEDIA_SECTOR_SIZE-sizeof(_BPB_FAT16)-2];
+    BYTE  	Reserved[512-sizeof(_BPB_FAT32)-2];     // the signature is at 510 whatever the sector size
     BYTE      Signature0;     // 0x55
     BYTE      Signature1;     // 0xAA
 }_BootSec;
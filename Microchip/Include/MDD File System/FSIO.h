@@ -101,15 +101,21 @@ typedef struct
 {
     unsigned    write :1;           // set if the file was opened in a write mode 
 	unsigned    FileWriteEOF :1;    // set if we are writing and have reached the EOF
+    unsigned    reserved :1;        // set if FSfallocate linked clusters past the EOF
 }FILEFLAGS;
 
 #define FILE_NAME_SIZE	    11
 
+// Longest long file name handled, in characters
+#if defined(SUPPORT_LFN) && !defined(FS_LFN_MAX_CHARS)
+	#define FS_LFN_MAX_CHARS	255
+#endif
+
 typedef struct 
 {
     DISK *      	dsk;            // disk structure
-    WORD         	cluster;        // first cluster
-    WORD         	ccls;           // current cluster in file
+    DWORD         	cluster;        // first cluster
+    DWORD         	ccls;           // current cluster in file
     WORD         	sec;            // sector in current cluster
     WORD         	pos;            // position in current sector
     DWORD         	seek;           // position in the file
@@ -121,22 +127,41 @@ typedef struct
     WORD     		entry;          // entry position in cur directory
     WORD     		chk;            // FILE structure checksum = ~( entry + name[0])
     WORD     		attributes;     // the bare bones attributes
-    WORD     		dirclus;        // base cluster of directory
-    WORD     		dirccls;        // current cluster
+    DWORD     		dirclus;        // base cluster of directory
+    DWORD     		dirccls;        // current cluster
+#ifdef FS_EXTENT_MAP_SIZE
+    DWORD           extStart[FS_EXTENT_MAP_SIZE];   // first cluster of each run of the chain
+    DWORD           extLength[FS_EXTENT_MAP_SIZE];  // clusters in each run
+    BYTE            extCount;       // runs mapped so far, from the first cluster on
+#endif
+#ifdef FS_FILE_BUFFERS
+    BYTE *          buffer;         // this file's own sector buffer
+    DWORD           bufsec;         // sector held in the buffer
+    BYTE            bufdirty;       // set if the buffer must be written back
+#endif
+#ifdef FS_READ_AHEAD_SECTORS
+    BYTE            seqreads;       // sectors read in order since the last seek
+#endif
 } FSFILE;
 
 typedef struct
 {
 	// User accessed values
 	char			filename[FILE_NAME_SIZE + 2];	// File name
+#ifdef SUPPORT_LFN
+	char			longFilename[FS_LFN_MAX_CHARS + 1];	// Long file name, or filename if there is none
+#endif
 	unsigned char	attributes;		// The file's attributes
 	unsigned long	filesize;		// Size of the file
 	unsigned long 	timestamp;		// File's create time
 	// For internal use only
 	unsigned int 	entry;			// The file entry
 	char			searchname[FILE_NAME_SIZE + 2];	// Search string
+	char			searchpattern[FILE_NAME_SIZE];	// Search string as an 8.3 name
 	unsigned char	searchattr;		// The search attributes
-	unsigned int	cwdclus;		// The cwd for this search
+	unsigned long	cwdclus;		// The cwd for this search
+	unsigned long	dirccls;		// The directory cluster holding entry
+	unsigned char	volume;			// The volume searched
 	unsigned char	initialized;	// Check for if FindFirst was called
 } SearchRec;
 
@@ -146,8 +171,26 @@ typedef struct
 ***************************************************************************/
 
 int FSInit(void);
+// Mounts volume A: from media unit 0, partition 0
+// Returns TRUE if successful, otherwise returns FALSE
+
+int FSmount (char drive, BYTE unit, BYTE partition);
+// Mount the FAT volume in an MBR partition (0-3) of a media unit as drive
+// A:, B:, ... (up to FS_MAX_VOLUMES); call FSInit first
+// Returns TRUE if successful, otherwise returns FALSE
+
+int FSunmount (char drive);
+// Write back what is cached for a volume and forget it; close its files first
+// Returns 0 on success, otherwise returns EOF
+
+int FSchdrive (char drive);
+// Make drive the current volume, used by names without a drive letter and
+// by FSgetcwd and FSformat
+// Returns 0 if successful, otherwise returns -1
 
 FSFILE * FSfopen(const char * fileName, const char *mode);
+// fileName may start with a drive letter, as in "B:LOG.TXT"; without one
+// the file is in the current volume
 
 #ifdef ALLOW_PGMFUNCTIONS
 	FSFILE * FSfopenpgm(const rom char * fileName, const rom char *mode);
@@ -162,6 +205,7 @@ FSFILE * FSfopen(const char * fileName, const char *mode);
 
 int FSfclose(FSFILE *fo);
 //returns 0 on success. It returns EOF if any errors were detected.
+//A file written to is on the media once it returns.
 
 int FSremove (const char * fileName);
 //returns 0 on success, otherwise returns -1
@@ -176,6 +220,27 @@ size_t FSfwrite(const void *ptr, size_t size, size_t n, FSFILE *stream);
 //On successful completion fwrite returns the number of items (not bytes) actually written.
 //On error it returns a short count or 0.
 
+#ifdef ALLOW_WRITES
+int FSfallocate (FSFILE *stream, DWORD size);
+// Reserve contiguous clusters so the file can grow to size bytes without
+// allocating; unused clusters are freed by FSfclose
+// Returns 0 on success, otherwise returns EOF
+
+FSFILE * FSfopenReserve (const char * fileName, const char *mode, DWORD size);
+// FSfopen, then reserve room for size more bytes with FSfallocate
+// Returns NULL if the file could not be opened
+
+int FSfflush (FSFILE *fo);
+// Write the file's data, FAT sectors and directory entry to the media, as
+// FSfclose does, but leave the file open
+// Returns 0 on success, otherwise returns EOF
+
+int FSsync (void);
+// FSfflush every open file, then write everything still held for the
+// mounted volumes (FAT cache, write cache, write queue) to the media
+// Returns 0 on success, otherwise returns EOF
+#endif
+
 int FSfseek(FSFILE *stream, long offset, int whence);
 // return 0 if success. returns -1 on error
 
@@ -202,6 +267,8 @@ int FSrename (const char * fileName, FSFILE * fo);
 
 int FSchdir (char * path);
 // Returns 0 if successful, otherwise returns EOF
+// A path starting with a drive letter ("B:\\LOGS") changes the working
+// directory of that volume; it does not change the current volume
 
 char * FSgetcwd (char * path, int numbchars);
 // Returns NULL if unsuccessful, otherwise returns pointer to
@@ -230,6 +297,8 @@ int FindFirst (const char * fileName, unsigned int attr, SearchRec * rec);
 // fileName can be in the format *.*, *.EXT, FILENAME.*, or FILENAME.EXT
 // If you are searching for a dir, filename can be of the format
 //		FILENAME or *
+// The pattern is matched against the 8.3 names; with SUPPORT_LFN the
+// long name of each file found is returned in longFilename
 
 int FindNext (SearchRec * rec); 
 #endif
@@ -242,6 +311,16 @@ int FindNext (SearchRec * rec);
 	#endif
 #endif
 
+#if defined(ALLOW_WRITES) && defined(FS_BACKGROUND_WRITES)
+// FSWriteQueueTasks, FSWriteQueueFree and FSWriteQueueFlush
+#include "FSwritequeue.h"
+#endif
+
+#if defined(ALLOW_WRITES) && defined(FS_WRITE_CACHE_SECTORS)
+// The file system reaches the media through the write cache
+#include "FSwritecache.h"
+#endif
+
 
 
 #endif
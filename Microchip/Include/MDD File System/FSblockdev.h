@@ -0,0 +1,123 @@
+/******************************************************************************
+ *
+ *               Microchip Memory Disk Drive File System
+ *
+ ******************************************************************************
+ * FileName:        FSblockdev.h
+ * Dependencies:    GenericTypeDefs.h
+ * Processor:       PIC24/dsPIC30/dsPIC33/PIC32MX, or a workstation
+ * Compiler:        C30/C32/GCC
+ *
+ * Media layer that reaches the media through a table of functions chosen at
+ * run time instead of being bound to one driver when the library is built.
+ * Select it in FSconfig.h with
+ *
+ *      #define INCLUDEFILE     "MDD File System/FSblockdev.h"
+ *
+ * and hand the file system a driver with FSSetBlockDevice() before calling
+ * FSInit() or FSformat().  Each driver fills in an FS_BLOCK_DEVICE; the
+ * USB mass storage functions can be put in one, and FSfiledisk.c provides
+ * one backed by a disk image file for running the file system on a
+ * workstation.
+ *
+*****************************************************************************/
+
+#ifndef _FSBLOCKDEV_H_
+#define _FSBLOCKDEV_H_
+
+#include "GenericTypeDefs.h"
+
+
+// *****************************************************************************
+// Section: Data Structures
+// *****************************************************************************
+
+// The functions of a block device driver.  Sectors are MEDIA_SECTOR_SIZE
+// bytes unless sectorSize says otherwise.  The functions return TRUE when
+// they succeed.  Entries marked optional may be NULL.
+typedef struct _FS_BLOCK_DEVICE
+{
+    BYTE    (*detect) (void);               // TRUE if the media is present (optional)
+    BYTE    (*initialize) (void);           // Get the media ready for use
+    BYTE    (*readSectors) (DWORD sector, WORD count, BYTE * buffer);
+    BYTE    (*writeSectors) (DWORD sector, WORD count, BYTE * buffer, BYTE allowWriteToZero);
+    BYTE    (*zeroSectors) (DWORD sector, DWORD count, BYTE * buffer, WORD bufferSectors);
+                                            // Clear a run of sectors (optional; zeros are written)
+    BYTE    (*sync) (void);                 // Put cached writes on the media (optional)
+    DWORD   (*capacity) (void);             // Number of sectors, 0 if unknown (optional)
+    BYTE    (*writeProtect) (void);         // TRUE if the media can't be written (optional)
+    BYTE    (*select) (BYTE unit);          // Pick the unit to use (optional; only unit 0)
+    BYTE    (*writeStart) (DWORD sector, WORD count, BYTE * buffer, BYTE allowWriteToZero);
+                                            // Start a background write (optional; written at once)
+    BYTE    (*writeIsComplete) (BYTE * errorCode);
+                                            // TRUE once no write is running, errorCode 0 if it
+                                            // succeeded (needed with writeStart)
+    WORD    (*sectorSize) (void);           // Bytes in a sector, a power of 2 from 512 to
+                                            // MEDIA_SECTOR_SIZE (optional; MEDIA_SECTOR_SIZE)
+} FS_BLOCK_DEVICE;
+
+
+// *****************************************************************************
+// Section: Function Prototypes
+// *****************************************************************************
+
+/******************************************************************************
+ * Function:        void FSSetBlockDevice (const FS_BLOCK_DEVICE * device)
+ *
+ * PreCondition:    None
+ *
+ * Input:           device  - The driver to use, or NULL for none
+ *
+ * Output:          None
+ *
+ * Side Effects:    None
+ *
+ * Overview:        Choose the driver the file system reaches its media with
+ *
+ * Note:            Volumes mounted through the previous driver must be
+ *                  unmounted first; call FSInit() or FSmount() again after
+ *                  changing it.  Without a driver every media function
+ *                  fails.
+ *****************************************************************************/
+
+void FSSetBlockDevice (const FS_BLOCK_DEVICE * device);
+
+BYTE    BlockDeviceMediaDetect (void);
+BYTE    BlockDeviceMediaInitialize (void);
+BYTE    BlockDeviceSectorReadMultiple (DWORD sector, WORD count, BYTE * buffer);
+BYTE    BlockDeviceSectorWriteMultiple (DWORD sector, WORD count, BYTE * buffer, BYTE allowWriteToZero);
+BYTE    BlockDeviceSectorZeroMultiple (DWORD sector, DWORD count, BYTE * buffer, WORD bufferSectors);
+BYTE    BlockDeviceMediaSync (void);
+DWORD   BlockDeviceMediaCapacity (void);
+BYTE    BlockDeviceWriteProtectState (void);
+BYTE    BlockDeviceMediaSelect (BYTE unit);
+BYTE    BlockDeviceSectorWriteStart (DWORD sector, WORD count, BYTE * buffer, BYTE allowWriteToZero);
+BYTE    BlockDeviceSectorWriteIsComplete (BYTE * errorCode);
+WORD    BlockDeviceMediaSectorSize (void);
+
+WORD    ReadWord (BYTE * pBuffer, WORD index);
+DWORD   ReadDWord (BYTE * pBuffer, WORD index);
+
+
+// *****************************************************************************
+// Section: Compatibility Definitions
+// *****************************************************************************
+
+#define InitIO()                                // Nothing to do; the driver is set up by FSSetBlockDevice()
+#define MediaDetect             BlockDeviceMediaDetect
+#define MediaInitialize         BlockDeviceMediaInitialize
+#define SectorRead(s,b)         BlockDeviceSectorReadMultiple ((s), 1, (b))
+#define SectorReadMultiple      BlockDeviceSectorReadMultiple
+#define SectorWrite(s,b,z)      BlockDeviceSectorWriteMultiple ((s), 1, (b), (z))
+#define SectorWriteMultiple     BlockDeviceSectorWriteMultiple
+#define SectorZeroMultiple      BlockDeviceSectorZeroMultiple
+#define MediaSync               BlockDeviceMediaSync
+#define MediaCapacity           BlockDeviceMediaCapacity
+#define WriteProtectState       BlockDeviceWriteProtectState
+#define MediaSelect             BlockDeviceMediaSelect
+#define SectorWriteStart        BlockDeviceSectorWriteStart
+#define SectorWriteIsComplete   BlockDeviceSectorWriteIsComplete
+#define MediaSectorSize         BlockDeviceMediaSectorSize
+#define ReadByte(p,i)           ((p)[i])
+
+#endif
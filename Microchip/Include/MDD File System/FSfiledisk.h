@@ -0,0 +1,131 @@
+/******************************************************************************
+ *
+ *               Microchip Memory Disk Drive File System
+ *
+ ******************************************************************************
+ * FileName:        FSfiledisk.h
+ * Dependencies:    FSblockdev.h
+ * Processor:       Workstation (POSIX)
+ * Compiler:        GCC
+ *
+ * Block device backed by a disk image file, so the file system can be run,
+ * profiled and tested on a workstation.  The image is a raw copy of the
+ * media, sector 0 first, as made by dd or by FileDiskCreate().
+ *
+*****************************************************************************/
+
+#ifndef _FSFILEDISK_H_
+#define _FSFILEDISK_H_
+
+#include "GenericTypeDefs.h"
+#include "MDD File System/FSblockdev.h"
+
+
+// *****************************************************************************
+// Section: Data Structures
+// *****************************************************************************
+
+// Counts of the commands the file system sent to the image since it was
+// opened (or the counts were cleared)
+typedef struct _FILE_DISK_STATS
+{
+    DWORD   readCommands;           // SectorReadMultiple calls
+    DWORD   readSectors;            // Sectors read
+    DWORD   writeCommands;          // SectorWriteMultiple calls
+    DWORD   writeSectors;           // Sectors written
+    DWORD   syncs;                  // MediaSync calls
+} FILE_DISK_STATS;
+
+extern FILE_DISK_STATS gFileDiskStats;
+
+
+// *****************************************************************************
+// Section: Function Prototypes
+// *****************************************************************************
+
+/******************************************************************************
+ * Function:        BYTE FileDiskSetSectorSize (WORD bytes)
+ *
+ * PreCondition:    None
+ *
+ * Input:           bytes    - Bytes in a sector
+ *
+ * Output:          TRUE     - The size is used from now on
+ *                  FALSE    - It isn't a power of 2 from 512 to
+ *                             MEDIA_SECTOR_SIZE
+ *
+ * Side Effects:    None
+ *
+ * Overview:        Set the sector size of the images made or opened next,
+ *                  to try the file system on media with 4096 byte sectors
+ *
+ * Note:            Images have 512 byte sectors unless this is called
+ *****************************************************************************/
+
+BYTE FileDiskSetSectorSize (WORD bytes);
+
+
+/******************************************************************************
+ * Function:        BYTE FileDiskCreate (const char * path, DWORD sectors)
+ *
+ * PreCondition:    None
+ *
+ * Input:           path     - Name of the image file
+ *                  sectors  - Size of the image in sectors
+ *
+ * Output:          TRUE     - The image was made
+ *                  FALSE    - The file could not be written
+ *
+ * Side Effects:    An existing file of that name is replaced
+ *
+ * Overview:        Make a blank image of the given size
+ *
+ * Note:            The image has no partition table; FSformat() with mode
+ *                  1 puts one on it covering the whole image
+ *****************************************************************************/
+
+BYTE FileDiskCreate (const char * path, DWORD sectors);
+
+
+/******************************************************************************
+ * Function:        const FS_BLOCK_DEVICE * FileDiskOpen (const char * path,
+ *                                                        BYTE readOnly)
+ *
+ * PreCondition:    None
+ *
+ * Input:           path     - Name of the image file
+ *                  readOnly - TRUE to report the media as write protected
+ *
+ * Output:          The driver to pass to FSSetBlockDevice(), or NULL if the
+ *                  image could not be opened
+ *
+ * Side Effects:    An image opened before is closed; the counts in
+ *                  gFileDiskStats are cleared
+ *
+ * Overview:        Open a disk image as the media
+ *
+ * Note:            One image is open at a time
+ *****************************************************************************/
+
+const FS_BLOCK_DEVICE * FileDiskOpen (const char * path, BYTE readOnly);
+
+
+/******************************************************************************
+ * Function:        void FileDiskClose (void)
+ *
+ * PreCondition:    None
+ *
+ * Input:           None
+ *
+ * Output:          None
+ *
+ * Side Effects:    None
+ *
+ * Overview:        Write out and close the open image
+ *
+ * Note:            Unmount the volumes on it first
+ *****************************************************************************/
+
+void FileDiskClose (void);
+
+#endif
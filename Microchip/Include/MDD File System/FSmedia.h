@@ -0,0 +1,32 @@
+/******************************************************************************
+ *
+ *               Microchip Memory Disk Drive File System
+ *
+ ******************************************************************************
+ * FileName:        FSmedia.h
+ * Dependencies:    FSIO.h, the media layer (INCLUDEFILE)
+ * Processor:       PIC24/dsPIC30/dsPIC33/PIC32MX, or a workstation
+ * Compiler:        C30/C32/GCC
+ *
+ * Defaults for the media layer functions the file system can do without.
+ * FSIO.c, FSwritequeue.c and FSwritecache.c include this right after
+ * INCLUDEFILE, so a media layer that defines one of them is used and one
+ * that doesn't gets the same default in all three.
+ *
+*****************************************************************************/
+
+#ifndef _FSMEDIA_H_
+#define _FSMEDIA_H_
+
+// Media layers that write straight through have nothing to sync
+#ifndef MediaSync
+    #define MediaSync()     TRUE
+#endif
+
+// Media layers that can't tell their sector size have MEDIA_SECTOR_SIZE
+// byte sectors
+#ifndef MediaSectorSize
+    #define MediaSectorSize()   MEDIA_SECTOR_SIZE
+#endif
+
+#endif
@@ -0,0 +1,50 @@
+/******************************************************************************
+ *
+ *               Microchip Memory Disk Drive File System
+ *
+ ******************************************************************************
+ * FileName:        FSwritecache.h
+ * Dependencies:    GenericTypeDefs.h
+ * Processor:       PIC24/dsPIC30/dsPIC33/PIC32MX, or a workstation
+ * Compiler:        C30/C32/GCC
+ *
+ * Write-back sector cache.  With FS_WRITE_CACHE_SECTORS defined in
+ * FSconfig.h, the sectors the file system writes are kept in that many
+ * sector buffers instead of being written at once.  Writing a sector that
+ * is already cached only changes the buffer, so the data sector, FAT
+ * sectors and directory sector an append touches again and again reach the
+ * media once.  When the cache is written back, the sectors are sorted and
+ * each run of consecutive sectors goes out with one SectorWriteMultiple()
+ * (one WRITE10 on USB media).
+ *
+ * The cache is written back when it is full, when another media unit is
+ * selected, and at FSfclose(), FSfflush(), FSsync() and FSunmount(), so a
+ * closed file is on the media.  FSsync() writes every open file at once.
+ * FSInit() drops it, since the media may have been changed.
+ *
+ * The cache sits above the write queue when FS_BACKGROUND_WRITES is also
+ * defined.  The media layer must provide SectorReadMultiple and
+ * SectorWriteMultiple.
+ *
+*****************************************************************************/
+
+#ifndef _FSWRITECACHE_H_
+#define _FSWRITECACHE_H_
+
+#include "GenericTypeDefs.h"
+
+
+// *****************************************************************************
+// Section: Function Prototypes
+// *****************************************************************************
+
+// The file system reaches the media through these when the write cache is
+// enabled; see FSIO.c
+BYTE    WriteCacheSectorRead (DWORD sector, WORD count, BYTE * buffer);
+BYTE    WriteCacheSectorWrite (DWORD sector, WORD count, BYTE * buffer, BYTE allowWriteToZero);
+BYTE    WriteCacheSectorZero (DWORD sector, DWORD count, BYTE * buffer, WORD bufferSectors);
+BYTE    WriteCacheMediaSync (void);
+BYTE    WriteCacheMediaSelect (BYTE unit);
+void    WriteCacheInvalidate (void);
+
+#endif
@@ -0,0 +1,120 @@
+/******************************************************************************
+ *
+ *               Microchip Memory Disk Drive File System
+ *
+ ******************************************************************************
+ * FileName:        FSwritequeue.h
+ * Dependencies:    GenericTypeDefs.h
+ * Processor:       PIC24/dsPIC30/dsPIC33/PIC32MX, or a workstation
+ * Compiler:        C30/C32/GCC
+ *
+ * Background writes.  With FS_BACKGROUND_WRITES defined in FSconfig.h, the
+ * sectors the file system writes are copied to a queue of
+ * FS_WRITE_QUEUE_SECTORS sector buffers and the call returns.  The queue is
+ * sent to the media with the media layer's SectorWriteStart() while the
+ * application goes on; FSWriteQueueTasks() moves it on and must be called
+ * from the main loop.  A write only waits when the queue is full, and a
+ * read only waits when it asks for a sector that is still queued.
+ *
+ * A media layer writes in the background by defining
+ *
+ *      BYTE SectorWriteStart (DWORD sector, WORD count, BYTE * buffer,
+ *                             BYTE allowWriteToZero);
+ *          TRUE if the write was started
+ *      BYTE SectorWriteIsComplete (BYTE * errorCode);
+ *          TRUE once no write is running; *errorCode is 0 if the last one
+ *          succeeded
+ *
+ * (usb_host_msd_scsi.h and FSblockdev.h do).  Other media layers are
+ * written in the foreground as the queue is sent, so a write still returns
+ * before the media is written but the next FSWriteQueueTasks() waits for it.
+ * The media layer must provide SectorReadMultiple and SectorWriteMultiple.
+ *
+*****************************************************************************/
+
+#ifndef _FSWRITEQUEUE_H_
+#define _FSWRITEQUEUE_H_
+
+#include "GenericTypeDefs.h"
+
+
+// *****************************************************************************
+// Section: Function Prototypes
+// *****************************************************************************
+
+/******************************************************************************
+ * Function:        void FSWriteQueueTasks (void)
+ *
+ * PreCondition:    None
+ *
+ * Input:           None
+ *
+ * Output:          None
+ *
+ * Side Effects:    None
+ *
+ * Overview:        Finish the running write and start the next one
+ *
+ * Note:            Call from the main loop.  Sectors that follow on from
+ *                  each other on the media are sent with one command.
+ *****************************************************************************/
+
+void FSWriteQueueTasks (void);
+
+
+/******************************************************************************
+ * Function:        WORD FSWriteQueueFree (void)
+ *
+ * PreCondition:    None
+ *
+ * Input:           None
+ *
+ * Output:          WORD    - Number of sectors that can be queued without
+ *                            waiting
+ *
+ * Side Effects:    None
+ *
+ * Overview:        Room left in the write queue
+ *
+ * Note:            An application writing a large buffer can write it a
+ *                  few sectors at a time, as room comes free, to keep from
+ *                  waiting for the media.  FS_WRITE_QUEUE_SECTORS means the
+ *                  queue is empty.
+ *****************************************************************************/
+
+WORD FSWriteQueueFree (void);
+
+
+/******************************************************************************
+ * Function:        int FSWriteQueueFlush (void)
+ *
+ * PreCondition:    None
+ *
+ * Input:           None
+ *
+ * Output:          0       - Every queued sector is on the media
+ *                  EOF     - A background write failed since the last error
+ *                            was reported, or the media could not be synced
+ *
+ * Side Effects:    Waits for the queue to empty
+ *
+ * Overview:        Put every queued sector on the media
+ *
+ * Note:            Sectors still held by the file system (an open file's
+ *                  data buffer, the FAT cache) are only queued when it
+ *                  writes them, by FSfclose() for instance.  FSunmount()
+ *                  also empties the queue.
+ *****************************************************************************/
+
+int FSWriteQueueFlush (void);
+
+
+// The file system reaches the media through these when background writes
+// are enabled; see FSIO.c
+BYTE    WriteQueueSectorRead (DWORD sector, WORD count, BYTE * buffer);
+BYTE    WriteQueueSectorWrite (DWORD sector, WORD count, BYTE * buffer, BYTE allowWriteToZero);
+BYTE    WriteQueueSectorZero (DWORD sector, DWORD count, BYTE * buffer, WORD bufferSectors);
+BYTE    WriteQueueMediaSync (void);
+BYTE    WriteQueueMediaSelect (BYTE unit);
+
+#endif
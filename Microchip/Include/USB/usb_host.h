@@ -76,6 +76,12 @@ KO/BC       15-Oct-2007 First release
 // *****************************************************************************
 // *****************************************************************************
 
+#ifndef USB_MAX_DEVICES
+    #define USB_MAX_DEVICES             1   // Define how many devices can be attached
+                                            // at once, including hubs.  More than 1
+                                            // needs USB_HUB_SUPPORT_INCLUDED.
+#endif
+
 #ifndef USB_NUM_BULK_NAKS
     #define USB_NUM_BULK_NAKS       10000   // Define how many NAK's are allowed
                                             // during a bulk transfer before erroring.
@@ -106,6 +112,43 @@ KO/BC       15-Oct-2007 First release
 #endif
 
 
+#ifdef USB_HOST_MEMORY_POOLS
+    // The host layer takes its memory from fixed pools instead of the heap.
+    // Each pool may be sized in usb_config.h; USBHostGetPoolStatistics()
+    // reports the most of each that has been in use.
+    #ifndef USB_HOST_POOL_ENDPOINTS
+        #define USB_HOST_POOL_ENDPOINTS         (USB_MAX_DEVICES * 4)
+                                            // Number of endpoint records, including
+                                            // EP0 of each device.
+    #endif
+
+    #ifndef USB_HOST_POOL_INTERFACES
+        #define USB_HOST_POOL_INTERFACES        (USB_MAX_DEVICES * 2)
+                                            // Number of interface records.
+    #endif
+
+    #ifndef USB_HOST_POOL_CONFIGURATIONS
+        #define USB_HOST_POOL_CONFIGURATIONS    (USB_MAX_DEVICES * 2)
+                                            // Number of configuration records.
+    #endif
+
+    #ifndef USB_HOST_POOL_BLOCK_SIZE
+        #define USB_HOST_POOL_BLOCK_SIZE        16
+                                            // Size of a block of the buffer pool.
+    #endif
+
+    #ifndef USB_HOST_POOL_BUFFER_BLOCKS
+        #define USB_HOST_POOL_BUFFER_BLOCKS     (USB_MAX_DEVICES * 12)
+                                            // Number of blocks in the buffer pool,
+                                            // which holds the descriptors and the
+                                            // EP0 data buffer of each device.
+    #endif
+
+    #if (USB_HOST_POOL_BLOCK_SIZE % 4) != 0
+        #error USB_HOST_POOL_BLOCK_SIZE must be a multiple of 4.
+    #endif
+#endif
+
 #ifndef USB_INITIAL_VBUS_CURRENT
     #error The application must define USB_INITIAL_VBUS_CURRENT as 100 mA for Host or 8-100 mA for OTG.
 #endif
@@ -178,6 +221,40 @@ typedef struct _HOST_TRANSFER_DATA
    TRANSFER_ATTRIBUTES  bmAttributes;       // Endpoint transfer attributes.
 } HOST_TRANSFER_DATA;
 
+// *****************************************************************************
+/* Host Memory Pool Usage
+
+This structure gives the use of one of the memory pools of the host layer.  For
+the buffer pool, the counts are in blocks of USB_HOST_POOL_BLOCK_SIZE bytes; for
+the others, they are in records.
+*/
+
+typedef struct _USB_HOST_POOL_USAGE
+{
+    WORD                size;               // Size of the pool.
+    WORD                inUse;              // Amount in use now.
+    WORD                highWater;          // Most ever in use at once.
+    WORD                extent;             // Highest place ever used, plus one.
+    WORD                failures;           // Allocations that did not fit.
+} USB_HOST_POOL_USAGE;
+
+#define USB_HOST_POOL_ENDPOINT      0       // Endpoint records
+#define USB_HOST_POOL_INTERFACE     1       // Interface records
+#define USB_HOST_POOL_CONFIGURATION 2       // Configuration records
+#define USB_HOST_POOL_BUFFER        3       // Descriptors and EP0 data buffers
+#define USB_HOST_POOLS              4       // Number of pools
+
+// *****************************************************************************
+/* Host Memory Pool Statistics
+
+This structure is filled by USBHostGetPoolStatistics().
+*/
+
+typedef struct _USB_HOST_POOL_STATS
+{
+    USB_HOST_POOL_USAGE pool[USB_HOST_POOLS];   // Indexed by USB_HOST_POOL_*.
+} USB_HOST_POOL_STATS;
+
 // *****************************************************************************
 /* Targeted Peripheral List
 
@@ -385,8 +462,6 @@ typedef struct _CLIENT_DRIVER_TABLE
 // *****************************************************************************
 // *****************************************************************************
 
-extern BYTE                *pCurrentConfigurationDescriptor;    // Pointer to the current Configuration Descriptor of the attached device.
-extern BYTE                *pDeviceDescriptor;                  // Pointer to the Device Descriptor of the attached device.
 extern USB_TPL              usbTPL[];                           // Application's Targeted Peripheral List.
 extern CLIENT_DRIVER_TABLE  usbClientDrvTable[];                // Application's client driver table.
 
@@ -512,7 +587,7 @@ BYTE    USBHostDeviceRequest( BYTE deviceAddress, BYTE bmRequestType, BYTE bRequ
     USB_HOLDING_OUT_OF_MEMORY           - Not enough heap space available
     USB_HOLDING_UNSUPPORTED_DEVICE      - Invalid configuration or
                                             unsupported class
-    USB_HOLDING_UNSUPPORTED_HUB         - Hubs are not supported
+    USB_HOLDING_UNSUPPORTED_HUB         - Hub support is not included
     USB_HOLDING_INVALID_CONFIGURATION   - Invalid configuration requested
     USB_HOLDING_PROCESSING_CAPACITY     - Processing requirement excessive
     USB_HOLDING_POWER_REQUIREMENT       - Power requirement excessive
@@ -543,17 +618,14 @@ BYTE    USBHostDeviceStatus( BYTE deviceAddress );
     BYTE deviceAddress  - Address of device
 
   Returns:
-    BYTE *  - Pointer to the Configuration Descriptor.
+    BYTE *  - Pointer to the Configuration Descriptor, or NULL if the device
+                is not attached.
 
   Remarks:
     None
-
-  TODO:
-    This will need to be expanded to a full function when multiple device
-    support is added.
   ***************************************************************************/
 
-#define USBHostGetCurrentConfigurationDescriptor( deviceAddress) ( pCurrentConfigurationDescriptor )
+BYTE *  USBHostGetCurrentConfigurationDescriptor( BYTE deviceAddress );
 
 
 /****************************************************************************
@@ -571,14 +643,46 @@ BYTE    USBHostDeviceStatus( BYTE deviceAddress );
     BYTE deviceAddress  - Address of device
 
   Returns:
-    BYTE *  - Pointer to the Device Descriptor.
+    BYTE *  - Pointer to the Device Descriptor, or NULL if the device is not
+                attached.
 
   Remarks:
-    This will need to be expanded to a full function when multiple device
-    support is added.
+    None
   ***************************************************************************/
 
-#define USBHostGetDeviceDescriptor( deviceAddress )     ( pDeviceDescriptor )
+BYTE *  USBHostGetDeviceDescriptor( BYTE deviceAddress );
+
+
+/****************************************************************************
+  Function:
+    void USBHostGetPoolStatistics( USB_HOST_POOL_STATS *pStats )
+
+  Summary:
+    This function returns the use of the memory pools of the host layer.
+
+  Description:
+    This function copies the size, current use, high-water mark, extent and
+    failure count of each memory pool.  The high-water marks of a system
+    that has been through its worst case of attached devices give the pool
+    sizes to put in usb_config.h.
+
+  Precondition:
+    USB_HOST_MEMORY_POOLS is defined.
+
+  Parameters:
+    USB_HOST_POOL_STATS *pStats - Where to put the statistics
+
+  Returns:
+    None
+
+  Remarks:
+    The buffer pool can be fragmented by devices that come and go, so the
+    extent, not the high-water mark, is the number of blocks it needs.
+  ***************************************************************************/
+
+#ifdef USB_HOST_MEMORY_POOLS
+void    USBHostGetPoolStatistics( USB_HOST_POOL_STATS *pStats );
+#endif
 
 
 /****************************************************************************
@@ -625,6 +729,109 @@ BYTE    USBHostDeviceStatus( BYTE deviceAddress );
                 0, stringLength, stringDescriptor, USB_DEVICE_REQUEST_GET )
 
 
+#ifdef USB_HUB_SUPPORT_INCLUDED
+/****************************************************************************
+  Function:
+    BYTE USBHostHubPortAttach( BYTE hubAddress, BYTE portNumber )
+
+  Summary:
+    This function is called by a hub client driver before it resets a port
+    with a device on it.
+
+  Description:
+    This function is called by a hub client driver when a device has been
+    connected to one of its ports and the connection has settled, before
+    the port is reset.  It gives the device an entry in the device table
+    and the address it will be given.  Only one device may be at the
+    default address at a time, so if another device behind a hub is still
+    being reset or enumerated, or the device table is full, the hub driver
+    must try again later without resetting the port.
+
+  Precondition:
+    None
+
+  Parameters:
+    BYTE hubAddress - Address of the hub
+    BYTE portNumber - Port of the hub the device is connected to
+
+  Return Values:
+    0       - The port cannot be reset now.
+    Other   - The address the device will be given.
+
+  Remarks:
+    This function is only available if USB_HUB_SUPPORT_INCLUDED is defined.
+  ***************************************************************************/
+
+BYTE    USBHostHubPortAttach( BYTE hubAddress, BYTE portNumber );
+
+
+/****************************************************************************
+  Function:
+    BYTE USBHostHubPortDetach( BYTE deviceAddress )
+
+  Summary:
+    This function is called by a hub client driver when a device has been
+    removed from one of its ports.
+
+  Description:
+    This function is called by a hub client driver when a device has been
+    removed from one of its ports, or when the hub driver gives up on it.
+    The transfers of the device are stopped, the event EVENT_DETACH is sent
+    to its client drivers, and its memory and address are freed.  If the
+    device is itself a hub, the devices behind it are removed first.
+
+  Precondition:
+    None
+
+  Parameters:
+    BYTE deviceAddress  - Address returned by USBHostHubPortAttach()
+
+  Return Values:
+    USB_SUCCESS         - The device has been removed.
+    USB_UNKNOWN_DEVICE  - Device not found
+    USB_BUSY            - A token of the device is on the bus.  Call again.
+
+  Remarks:
+    This function is only available if USB_HUB_SUPPORT_INCLUDED is defined.
+  ***************************************************************************/
+
+BYTE    USBHostHubPortDetach( BYTE deviceAddress );
+
+
+/****************************************************************************
+  Function:
+    BYTE USBHostHubPortEnabled( BYTE deviceAddress, BOOL lowSpeed )
+
+  Summary:
+    This function is called by a hub client driver when a port reset is
+    complete.
+
+  Description:
+    This function is called by a hub client driver when it has reset the
+    port of a device given by USBHostHubPortAttach() and the port is
+    enabled.  The device is now at the default address, and the host state
+    machine will enumerate it the next time it is free.
+
+  Precondition:
+    USBHostHubPortAttach() returned deviceAddress.
+
+  Parameters:
+    BYTE deviceAddress  - Address returned by USBHostHubPortAttach()
+    BOOL lowSpeed       - The hub reported a low speed device on the port
+
+  Return Values:
+    USB_SUCCESS         - Enumeration will start.
+    USB_UNKNOWN_DEVICE  - Device not found
+    USB_ILLEGAL_REQUEST - The device is not waiting for its port reset.
+
+  Remarks:
+    This function is only available if USB_HUB_SUPPORT_INCLUDED is defined.
+  ***************************************************************************/
+
+BYTE    USBHostHubPortEnabled( BYTE deviceAddress, BOOL lowSpeed );
+#endif
+
+
 /****************************************************************************
   Function:
     BOOL USBHostInit(  unsigned long flags  )
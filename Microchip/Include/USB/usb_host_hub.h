@@ -0,0 +1,257 @@
+/******************************************************************************
+
+  USB Host Hub Driver Header File
+
+Description:
+    This is the header file for a USB Embedded Host that supports hubs.
+
+    This file should be included with usb_host.h.  It must be included after
+    the application-specific usb_config.h file and after the USB Embedded
+    Host header file usb_host.h, as definitions in those files are required
+    for proper compilation.
+
+    To interface with usb_host.c, the routine USBHostHubInitialize() should be
+    specified as the Initialize() function, and USBHostHubEventHandler()
+    should be specified as the EventHandler() function in the
+    usbClientDrvTable[] array declared in usb_config.c, with a TPL entry for
+    the hub class (INIT_CL_SC_P( 0x09ul, 0, 0 ) and TPL_CLASS_DRV).
+    usb_config.h must define USB_HUB_SUPPORT_INCLUDED, and USB_MAX_DEVICES
+    must count the hubs and the devices behind them.
+
+    The driver powers the ports of the hub, watches its status change
+    endpoint, and resets and enables a port when a device is connected to
+    it.  The device is then enumerated by usb_host.c like a device on the
+    root port, and its own client driver sees the same events.  The driver
+    polls its transfers, so USBHostHubTasks() must be called from USBTasks()
+    whether or not transfer events are used.
+
+Summary:
+    This is the header file for a USB Embedded Host that supports hubs.
+
+*******************************************************************************/
+//DOM-IGNORE-BEGIN
+/*******************************************************************************
+
+* FileName:        usb_host_hub.h
+* Dependencies:    None
+* Processor:       PIC24/dsPIC30/dsPIC33/PIC32MX
+* Compiler:        C30 v2.01/C32 v0.00.18
+* Company:         Microchip Technology, Inc.
+
+Software License Agreement
+
+The software supplied herewith by Microchip Technology Incorporated
+(the Company) for its PICmicro Microcontroller is intended and
+supplied to you, the Companys customer, for use solely and
+exclusively on Microchip PICmicro Microcontroller products. The
+software is owned by the Company and/or its supplier, and is
+protected under applicable copyright laws. All rights are reserved.
+Any use in violation of the foregoing restrictions may subject the
+user to criminal sanctions under applicable laws, as well as to
+civil liability for the breach of the terms and conditions of this
+license.
+
+THIS SOFTWARE IS PROVIDED IN AN AS IS CONDITION. NO WARRANTIES,
+WHETHER EXPRESS, IMPLIED OR STATUTORY, INCLUDING, BUT NOT LIMITED
+TO, IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+PARTICULAR PURPOSE APPLY TO THIS SOFTWARE. THE COMPANY SHALL NOT,
+IN ANY CIRCUMSTANCES, BE LIABLE FOR SPECIAL, INCIDENTAL OR
+CONSEQUENTIAL DAMAGES, FOR ANY REASON WHATSOEVER.
+
+*******************************************************************************/
+//DOM-IGNORE-END
+
+//DOM-IGNORE-BEGIN
+#ifndef _USBHOSTHUB_H_
+#define _USBHOSTHUB_H_
+//DOM-IGNORE-END
+
+// *****************************************************************************
+// *****************************************************************************
+// Section: Constants
+// *****************************************************************************
+// *****************************************************************************
+
+// *****************************************************************************
+// Section: Configuration
+// *****************************************************************************
+
+// Number of hubs that can be attached at once.  This may be overridden in
+// usb_config.h.
+#ifndef USB_MAX_HUBS
+    #define USB_MAX_HUBS                    1
+#endif
+
+// Number of ports of each hub that are used.  Devices on higher ports are
+// not enabled.  This may be overridden in usb_config.h.
+#ifndef USB_HUB_MAX_PORTS
+    #define USB_HUB_MAX_PORTS               4
+#endif
+
+// *****************************************************************************
+// Section: Additional return values for USBHostHubDeviceStatus (see USBHostDeviceStatus also)
+// *****************************************************************************
+
+#define USB_HUB_DEVICE_NOT_FOUND            0x60    // Device is not a hub being used by this driver.
+#define USB_HUB_INITIALIZING                0x61    // Hub is powering its ports.
+#define USB_HUB_NORMAL_RUNNING              0x62    // Hub is watching its ports.
+#define USB_HUB_ERROR_STATE                 0x65    // Hub is holding due to an error.
+
+// *****************************************************************************
+// Section: Hub Class Constants
+// *****************************************************************************
+
+#define USB_HUB_DESCRIPTOR_HUB              0x29    // Descriptor type of the hub descriptor.
+
+#define USB_HUB_PORT_CONNECTION             0       // Port feature selectors
+#define USB_HUB_PORT_ENABLE                 1
+#define USB_HUB_PORT_SUSPEND                2
+#define USB_HUB_PORT_OVER_CURRENT           3
+#define USB_HUB_PORT_RESET                  4
+#define USB_HUB_PORT_POWER                  8
+#define USB_HUB_PORT_LOW_SPEED              9
+#define USB_HUB_C_PORT_CONNECTION           16
+#define USB_HUB_C_PORT_ENABLE               17
+#define USB_HUB_C_PORT_SUSPEND              18
+#define USB_HUB_C_PORT_OVER_CURRENT         19
+#define USB_HUB_C_PORT_RESET                20
+
+
+// *****************************************************************************
+// *****************************************************************************
+// Section: Function Prototypes
+// *****************************************************************************
+// *****************************************************************************
+
+/****************************************************************************
+  Function:
+    BYTE USBHostHubDeviceStatus( BYTE deviceAddress )
+
+  Description:
+    This function determines the status of a hub.
+
+  Precondition:
+    None
+
+  Parameters:
+    BYTE deviceAddress - address of the hub
+
+  Return Values:
+    USB_HUB_DEVICE_NOT_FOUND    -   Illegal device address, or the device is
+                                    not a hub
+    USB_HUB_INITIALIZING        -   Hub is attached and powering its ports
+    USB_HUB_NORMAL_RUNNING      -   Hub is watching its ports
+    USB_HUB_ERROR_STATE         -   Hub is holding due to an error.  The
+                                    devices already behind it keep running.
+
+    Other                       -   Return codes from USBHostDeviceStatus()
+                                    will also be returned if the device is in
+                                    the process of enumerating.
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+BYTE    USBHostHubDeviceStatus( BYTE deviceAddress );
+
+
+/****************************************************************************
+  Function:
+    void USBHostHubTasks( void )
+
+  Summary:
+    This function performs the maintenance tasks required by hubs.
+
+  Description:
+    This function reads the status changes of each hub, and powers, resets,
+    enables and disables its ports.  It should be called on a regular basis
+    by the application, as part of USBTasks().
+
+  Precondition:
+    USBHostHubInitialize() has been called.
+
+  Parameters:
+    None - None
+
+  Returns:
+    None
+
+  Remarks:
+    The timing of the hub (power on, connection debounce and port reset
+    recovery) uses the frame number of the USB module, so nothing waits
+    here.
+  ***************************************************************************/
+
+void    USBHostHubTasks( void );
+
+
+// *****************************************************************************
+// *****************************************************************************
+// Section: Host Stack Interface Functions
+// *****************************************************************************
+// *****************************************************************************
+
+/****************************************************************************
+  Function:
+    BOOL USBHostHubInitialize( BYTE address, DWORD flags )
+
+  Summary:
+    This function is the initialization routine for this client driver.
+
+  Description:
+    This function is the initialization routine for this client driver.  It
+    is called by the host layer when the USB device is being enumerated.  It
+    checks that the configuration has a hub interface with an interrupt IN
+    endpoint.
+
+  Precondition:
+    None
+
+  Parameters:
+    BYTE address        - Address of the new device
+    DWORD flags         - Initialization flags
+
+  Return Values:
+    TRUE   - We can support the device.
+    FALSE  - We cannot support the device.
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+BOOL    USBHostHubInitialize( BYTE address, DWORD flags );
+
+
+/****************************************************************************
+  Function:
+    BOOL USBHostHubEventHandler( BYTE address, USB_EVENT event,
+                            void *data, DWORD size )
+
+  Summary:
+    This function is the event handler for this client driver.
+
+  Description:
+    This function is the event handler for this client driver.  It is called
+    by the host layer when various events occur.
+
+  Precondition:
+    The device has been initialized.
+
+  Parameters:
+    BYTE address    - Address of the device
+    USB_EVENT event - Event that has occurred
+    void *data      - Pointer to data pertinent to the event
+    DWORD size      - Size of the data
+
+  Return Values:
+    TRUE   - Event was handled
+    FALSE  - Event was not handled
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+BOOL    USBHostHubEventHandler( BYTE address, USB_EVENT event, void *data, DWORD size );
+
+
+#endif
@@ -22,12 +22,16 @@ Description:
     contains macros to allow the File System code to reference the functions in
     this file.
 
-    Currently, the file system layer above this interface layer is limited to
-    one LUN (Logical Unit Number) on a single mass storage device.  This layer
-    accepts and stores the max LUN from the USB MSD layer, but all sector reads
-    and writes are hard-coded to LUN 0, since the layer above does not specify
-    a LUN in the sector read and write commands.  Also, to interface with the
-    existing file system code, only one attached device is allowed.
+    Each LUN (Logical Unit Number) of each attached device is a media unit.
+    The sector read and write commands go to the unit picked with
+    USBHostMSDSCSIUnitSelect().
+
+    Sector transfers can run in the background: USBHostMSDSCSISectorReadStart()
+    and USBHostMSDSCSISectorWriteStart() return as soon as the first command is
+    sent, and USBHostMSDSCSITasks(), run from USBTasks(), moves the rest of the
+    run as the EVENT_MSD_TRANSFER completions come in.  The end of the request
+    is reported to a callback and by USBHostMSDSCSITransferIsComplete().  Each
+    device has its own request, so several devices can be busy at once.
 
 Summary:
     This is the header file for a USB Embedded Host that is using a SCSI
@@ -70,8 +74,8 @@ CONSEQUENTIAL DAMAGES, FOR ANY REASON WHATSOEVER.
 //DOM-IGNORE-END
 
 #include "usb_config.h"
-#include "USB\usb.h"
-#include "FSConfig.h"
+#include "USB/usb.h"
+#include "FSconfig.h"
 
 // *****************************************************************************
 // *****************************************************************************
@@ -85,7 +89,57 @@ CONSEQUENTIAL DAMAGES, FOR ANY REASON WHATSOEVER.
 
 #define USB_SCSI_ERROR_DISK_MOUNT   0xF0        // Unable to initiate proper communications with the attached device.
 #define USB_SCSI_ERROR_SECTOR_0     0xF1        // Writes to sector 0 are not allowed.
-#define USB_SCSI_ERROR_SECTOR_SIZE  0xF2        // Only devices with a sector size of 512 are supported.
+#define USB_SCSI_ERROR_SECTOR_SIZE  0xF2        // Only sector sizes that are a power of 2 from 512 to MEDIA_SECTOR_SIZE are supported.
+
+
+// *****************************************************************************
+// Section: Media Units
+// *****************************************************************************
+
+// The media unit number of a LUN of an attached device, for
+// USBHostMSDSCSIUnitSelect() and FSmount().  The device is its place in
+// attach order (up to USB_MAX_MASS_STORAGE_DEVICES), the LUN is 0 to 15, and
+// below USB_MSD_MAX_LUNS.
+#define USB_MSD_SCSI_UNIT(device,lun)   ((BYTE)(((device) << 4) | ((lun) & 0x0F)))
+
+
+// *****************************************************************************
+// Section: Configuration
+// *****************************************************************************
+
+// Number of sectors requested by a single READ10 or WRITE10 command to a unit
+// that gives no Maximum Transfer Length on its Block Limits page.  A unit
+// that gives one gets commands of up to that many sectors instead, more or
+// fewer than this.  Longer runs passed to USBHostMSDSCSISectorReadMultiple()
+// and USBHostMSDSCSISectorWriteMultiple() are split into several commands.
+// This may be overridden in usb_config.h.
+#ifndef USB_MSD_MAX_TRANSFER_SECTORS
+    #define USB_MSD_MAX_TRANSFER_SECTORS    64
+#endif
+
+// Number of LUNs of each device that can be used.  What each one reports at
+// its first USBHostMSDSCSIMediaInitialize() is kept in RAM (14 bytes per LUN
+// per device).  This may be overridden in usb_config.h.
+#ifndef USB_MSD_MAX_LUNS
+    #define USB_MSD_MAX_LUNS                4
+#endif
+
+// USBHostMSDSCSISectorZeroMultiple() clears sectors with WRITE SAME when the
+// unit gives a maximum WRITE SAME length on its Block Limits page.  Define
+// USB_MSD_NO_WRITE_SAME in usb_config.h to always clear them with WRITE10.
+//#define USB_MSD_NO_WRITE_SAME
+
+
+// *****************************************************************************
+// *****************************************************************************
+// Section: Data Structures
+// *****************************************************************************
+// *****************************************************************************
+
+// Function called when a sector request started with
+// USBHostMSDSCSISectorReadStart() or USBHostMSDSCSISectorWriteStart() ends.
+// The error code is USB_SUCCESS if every sector was transferred.
+typedef void (*USB_MSD_SCSI_CALLBACK)( BYTE errorCode );
 
 
 // *****************************************************************************
@@ -138,9 +192,12 @@ BYTE    USBHostMSDSCSIMediaDetect( void );
     FALSE   -   Initialization was unsuccessful
 
   Remarks:
-    This function performs the following SCSI commands:
-                        * READ CAPACITY 10
-                        * REQUEST SENSE
+    The first time a unit is initialized after its device is attached, this
+    function examines it with INQUIRY, READ CAPACITY 10, the Block Limits
+    page of INQUIRY (SPC-3 devices only) and MODE SENSE 6, and keeps what it
+    reports.  After that it sends no commands unless a sector command to the
+    unit has failed.  Then it sends REQUEST SENSE, and examines the unit again
+    only if the sense key is NOT READY or UNIT ATTENTION.
 
     The READ CAPACITY 10 command block is as follows:
 
@@ -162,7 +219,7 @@ BYTE    USBHostMSDSCSIMediaDetect( void );
 
     <code>
         Byte/Bit    7       6       5       4       3       2       1       0
-           0                    Operation Code (0x02)
+           0                    Operation Code (0x03)
            1        [                      Reserved                 ] [ DESC]
            2        [                      Reserved
            3                                                                ]
@@ -209,10 +266,10 @@ BYTE    USBHostMSDSCSIMediaReset( void  );
     BYTE USBHostMSDSCSISectorRead( DWORD sectorAddress, BYTE *dataBuffer)
 
   Summary:
-    This function reads a 512-byte sector.
+    This function reads one sector.
 
   Description:
-    This function uses the SCSI command READ10 to read a 512-byte sector.
+    This function uses the SCSI command READ10 to read one sector.
     The data is stored in the application buffer.
 
   Precondition:
@@ -223,9 +280,8 @@ BYTE    USBHostMSDSCSIMediaReset( void  );
     BYTE    *dataBuffer     - buffer to store data
 
   Return Values:
-    USB_SUCCESS - read performed successfully
-    Other       - Error codes from USBHostMSDRead() and
-                    USBHostMSDTransferIsComplete()
+    TRUE    - read performed successfully
+    FALSE   - read failed
 
   Remarks:
     The READ10 command block is as follows:
@@ -248,15 +304,49 @@ BYTE    USBHostMSDSCSIMediaReset( void  );
 BYTE    USBHostMSDSCSISectorRead( DWORD sectorAddress, BYTE *dataBuffer );
 
 
+/****************************************************************************
+  Function:
+    BYTE USBHostMSDSCSISectorReadMultiple( DWORD sectorAddress,
+                        WORD sectorCount, BYTE *dataBuffer )
+
+  Summary:
+    This function reads a run of consecutive sectors.
+
+  Description:
+    This function uses the SCSI command READ10 to read sectorCount
+    consecutive sectors starting at sectorAddress.  The data is stored in the
+    application buffer, which must be able to hold sectorCount sectors of the
+    unit.  Each READ10 command transfers up to the unit's Maximum Transfer
+    Length, or USB_MSD_MAX_TRANSFER_SECTORS sectors if it gives none.
+
+  Precondition:
+    None
+
+  Parameters:
+    DWORD   sectorAddress   - address of the first sector to read
+    WORD    sectorCount     - number of sectors to read
+    BYTE    *dataBuffer     - buffer to store data
+
+  Return Values:
+    TRUE    - read performed successfully
+    FALSE   - read failed
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+BYTE    USBHostMSDSCSISectorReadMultiple( DWORD sectorAddress, WORD sectorCount, BYTE *dataBuffer );
+
+
 /****************************************************************************
   Function:
     BYTE USBHostMSDSCSISectorWrite( DWORD sectorAddress, BYTE *dataBuffer, BYTE allowWriteToZero )
 
   Summary:
-    This function writes a 512-byte sector.
+    This function writes one sector.
 
   Description:
-    This function uses the SCSI command WRITE10 to write a 512-byte sector.
+    This function uses the SCSI command WRITE10 to write one sector.
     The data is read from the application buffer.
 
   Precondition:
@@ -268,9 +358,8 @@ BYTE    USBHostMSDSCSISectorRead( DWORD sectorAddress, BYTE *dataBuffer );
     BYTE    allowWriteToZero- If a write to sector 0 is allowed.
 
   Return Values:
-    USB_SUCCESS - Write performed successfully
-                    Other       - Error codes from USBHostMSDWrite() and
-                                USBHostMSDTransferIsComplete()
+    TRUE    - Write performed successfully
+    FALSE   - Write failed, or a write to sector 0 was not allowed
 
   Remarks:
     To follow convention, this function blocks until the write is complete.
@@ -295,6 +384,221 @@ BYTE    USBHostMSDSCSISectorRead( DWORD sectorAddress, BYTE *dataBuffer );
 BYTE    USBHostMSDSCSISectorWrite( DWORD sectorAddress, BYTE *dataBuffer, BYTE allowWriteToZero);
 
 
+/****************************************************************************
+  Function:
+    BYTE USBHostMSDSCSISectorWriteMultiple( DWORD sectorAddress,
+                        WORD sectorCount, BYTE *dataBuffer,
+                        BYTE allowWriteToZero )
+
+  Summary:
+    This function writes a run of consecutive sectors.
+
+  Description:
+    This function uses the SCSI command WRITE10 to write sectorCount
+    consecutive sectors starting at sectorAddress.  The data is read from the
+    application buffer, which must hold sectorCount sectors of the unit.
+    Each WRITE10 command transfers up to the unit's Maximum Transfer Length,
+    or USB_MSD_MAX_TRANSFER_SECTORS sectors if it gives none.
+
+  Precondition:
+    None
+
+  Parameters:
+    DWORD   sectorAddress   - address of the first sector to write
+    WORD    sectorCount     - number of sectors to write
+    BYTE    *dataBuffer     - buffer with application data
+    BYTE    allowWriteToZero- If a write to sector 0 is allowed.
+
+  Return Values:
+    TRUE    - Write performed successfully
+    FALSE   - Write failed, or a write to sector 0 was not allowed
+
+  Remarks:
+    To follow convention, this function blocks until the write is complete.
+  ***************************************************************************/
+
+BYTE    USBHostMSDSCSISectorWriteMultiple( DWORD sectorAddress, WORD sectorCount, BYTE *dataBuffer, BYTE allowWriteToZero );
+
+
+/****************************************************************************
+  Function:
+    BYTE USBHostMSDSCSISectorZeroMultiple( DWORD sectorAddress,
+                        DWORD sectorCount, BYTE *zeroBuffer,
+                        WORD bufferSectors )
+
+  Summary:
+    This function fills a run of consecutive sectors with zeros.
+
+  Description:
+    This function writes zeros to sectorCount consecutive sectors starting at
+    sectorAddress.  It uses the SCSI command WRITE SAME (10) when the device
+    accepts it, so one command clears up to 65535 sectors.  Otherwise the
+    zero buffer is written with WRITE10 commands.
+
+  Precondition:
+    None
+
+  Parameters:
+    DWORD   sectorAddress   - address of the first sector to clear
+    DWORD   sectorCount     - number of sectors to clear
+    BYTE    *zeroBuffer     - buffer of zeros
+    WORD    bufferSectors   - size of zeroBuffer, in sectors
+
+  Return Values:
+    TRUE    - The sectors were cleared
+    FALSE   - A write failed, or the run includes sector 0
+
+  Remarks:
+    To follow convention, this function blocks until the write is complete.
+  ***************************************************************************/
+
+BYTE    USBHostMSDSCSISectorZeroMultiple( DWORD sectorAddress, DWORD sectorCount, BYTE *zeroBuffer, WORD bufferSectors );
+
+
+/****************************************************************************
+  Function:
+    BYTE USBHostMSDSCSISectorReadStart( DWORD sectorAddress,
+                        WORD sectorCount, BYTE *dataBuffer,
+                        USB_MSD_SCSI_CALLBACK callback )
+
+  Summary:
+    This function starts reading a run of sectors in the background.
+
+  Description:
+    This function starts a request that reads sectorCount consecutive
+    sectors from the selected unit into dataBuffer and returns once the
+    first READ10 command is sent.  USBHostMSDSCSITasks() sends the rest.
+    When the request ends, the callback is called with the result and
+    USBHostMSDSCSITransferIsComplete() returns TRUE.
+
+  Precondition:
+    None
+
+  Parameters:
+    DWORD   sectorAddress   - address of the first sector to read
+    WORD    sectorCount     - number of sectors to read
+    BYTE    *dataBuffer     - buffer to store data, sectorCount
+                                sectors
+    USB_MSD_SCSI_CALLBACK callback - function to call when the request
+                                ends, or NULL
+
+  Return Values:
+    USB_SUCCESS                 - The request is running
+    USB_MSD_DEVICE_BUSY         - Another request is running on the device
+    USB_MSD_DEVICE_NOT_FOUND    - No unit is selected
+    Other                       - The first command could not be sent
+
+  Remarks:
+    The buffer must not be used until the request ends.  Only one request
+    runs at a time on a device; requests on different devices run together.
+  ***************************************************************************/
+
+BYTE    USBHostMSDSCSISectorReadStart( DWORD sectorAddress, WORD sectorCount, BYTE *dataBuffer, USB_MSD_SCSI_CALLBACK callback );
+
+
+/****************************************************************************
+  Function:
+    BYTE USBHostMSDSCSISectorWriteStart( DWORD sectorAddress,
+                        WORD sectorCount, BYTE *dataBuffer,
+                        BYTE allowWriteToZero,
+                        USB_MSD_SCSI_CALLBACK callback )
+
+  Summary:
+    This function starts writing a run of sectors in the background.
+
+  Description:
+    This function starts a request that writes sectorCount consecutive
+    sectors on the selected unit from dataBuffer and returns once the first
+    WRITE10 command is sent.  USBHostMSDSCSITasks() sends the rest.  When
+    the request ends, the callback is called with the result and
+    USBHostMSDSCSITransferIsComplete() returns TRUE.
+
+  Precondition:
+    None
+
+  Parameters:
+    DWORD   sectorAddress   - address of the first sector to write
+    WORD    sectorCount     - number of sectors to write
+    BYTE    *dataBuffer     - buffer with application data, sectorCount
+                                sectors
+    BYTE    allowWriteToZero- If a write to sector 0 is allowed.
+    USB_MSD_SCSI_CALLBACK callback - function to call when the request
+                                ends, or NULL
+
+  Return Values:
+    USB_SUCCESS                 - The request is running
+    USB_MSD_DEVICE_BUSY         - Another request is running on the device
+    USB_MSD_DEVICE_NOT_FOUND    - No unit is selected
+    USB_SCSI_ERROR_SECTOR_0     - A write to sector 0 was not allowed
+    Other                       - The first command could not be sent
+
+  Remarks:
+    The buffer must not be changed until the request ends.  Only one request
+    runs at a time on a device; requests on different devices run together.
+  ***************************************************************************/
+
+BYTE    USBHostMSDSCSISectorWriteStart( DWORD sectorAddress, WORD sectorCount, BYTE *dataBuffer, BYTE allowWriteToZero, USB_MSD_SCSI_CALLBACK callback );
+
+
+/****************************************************************************
+  Function:
+    BOOL USBHostMSDSCSITransferIsComplete( BYTE *errorCode )
+
+  Summary:
+    This function indicates whether or not the sector request has ended.
+
+  Description:
+    This function runs the USB tasks, then indicates whether or not the
+    request started with USBHostMSDSCSISectorReadStart() or
+    USBHostMSDSCSISectorWriteStart() on the device of the selected unit has
+    ended.  If it has, the error code is its result.
+
+  Precondition:
+    None
+
+  Parameters:
+    BYTE *errorCode     - Result of the last request: USB_SUCCESS, or the
+                            error from USBHostMSDTransferIsComplete()
+
+  Return Values:
+    TRUE    - No request is running, errorCode is valid
+    FALSE   - The request is still running, errorCode is not valid
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+BOOL    USBHostMSDSCSITransferIsComplete( BYTE *errorCode );
+
+
+/****************************************************************************
+  Function:
+    void USBHostMSDSCSITasks( void )
+
+  Summary:
+    This function moves the sector requests on.
+
+  Description:
+    This function sends the next command of the sector request of each
+    device when the running one has completed, or ends the request and calls
+    its callback.
+
+  Precondition:
+    None
+
+  Parameters:
+    None - None
+
+  Returns:
+    None
+
+  Remarks:
+    Call this function from USBTasks(), after USBHostMSDTasks().
+  ***************************************************************************/
+
+void    USBHostMSDSCSITasks( void );
+
+
 /****************************************************************************
   Function:
     BYTE USBHostMSDSCSIWriteProtectState( void )
@@ -310,13 +614,96 @@ BYTE    USBHostMSDSCSISectorWrite( DWORD sectorAddress, BYTE *dataBuffer, BYTE a
 
   Return Values:
     0 - not write protected
+    1 - write protected
 
+  Remarks:
+    This is the write protect bit the selected unit reported to MODE SENSE 6
+    when it was initialized.  No command is sent.
+  ***************************************************************************/
+
+BYTE    USBHostMSDSCSIWriteProtectState( void );
+
+
+/****************************************************************************
+  Function:
+    WORD USBHostMSDSCSIMediaSectorSize( void )
+
+  Description:
+    This function returns the number of bytes in a sector of the selected
+    unit.
+
+  Precondition:
+    None
+
+  Parameters:
+    None - None
+
+  Returns:
+    The logical block length the unit reported to READ CAPACITY 10 when it
+    was initialized: a power of 2 from 512 to MEDIA_SECTOR_SIZE.  512 if the
+    unit has not been initialized.
 
   Remarks:
+    Units with 4096 byte blocks can only be used with MEDIA_SECTOR_SIZE set
+    to 4096 in FSconfig.h.  No command is sent.
+  ***************************************************************************/
+
+WORD    USBHostMSDSCSIMediaSectorSize( void );
+
+
+/****************************************************************************
+  Function:
+    DWORD USBHostMSDSCSIMediaCapacity( void )
+
+  Description:
+    This function returns the number of sectors of the selected unit.
+
+  Precondition:
     None
+
+  Parameters:
+    None - None
+
+  Returns:
+    The number of logical blocks the unit reported to READ CAPACITY 10 when
+    it was initialized.  0 if the unit has not been initialized.
+
+  Remarks:
+    No command is sent.
   ***************************************************************************/
 
-BYTE    USBHostMSDSCSIWriteProtectState( void );
+DWORD   USBHostMSDSCSIMediaCapacity( void );
+
+
+/****************************************************************************
+  Function:
+    BYTE USBHostMSDSCSIUnitSelect( BYTE unit )
+
+  Summary:
+    This function picks the media unit that later commands go to.
+
+  Description:
+    This function picks the device and LUN that the sector read and write
+    functions and the media functions work on.  The unit is made with
+    USB_MSD_SCSI_UNIT(); unit 0 is LUN 0 of the first device attached.
+
+  Precondition:
+    None
+
+  Parameters:
+    BYTE unit   - The media unit to use
+
+  Return Values:
+    TRUE    - The unit is present and selected
+    FALSE   - There is no such device or LUN; commands fail until another
+                unit is selected
+
+  Remarks:
+    This is MediaSelect() in the file system, which calls it whenever it
+    moves to a volume on another unit.
+  ***************************************************************************/
+
+BYTE    USBHostMSDSCSIUnitSelect( BYTE unit );
 
 
 // *****************************************************************************
@@ -473,8 +860,16 @@ WORD    ReadWord(  BYTE* pBuffer, WORD index );
 #define InitIO()            // Unneeded - initialization is now done in the File System code.
 #define MediaDetect         USBHostMSDSCSIMediaDetect       // Used to access USBHostMSDSCSIMediaDetect(), for compatibility with the File System code.
 #define SectorRead          USBHostMSDSCSISectorRead        // Used to access USBHostMSDSCSISectorRead(), for compatibility with the File System code.
+#define SectorReadMultiple  USBHostMSDSCSISectorReadMultiple    // Used to access USBHostMSDSCSISectorReadMultiple(), for compatibility with the File System code.
 #define SectorWrite         USBHostMSDSCSISectorWrite       // Used to access USBHostMSDSCSISectorWrite(), for compatibility with the File System code.
+#define SectorWriteMultiple USBHostMSDSCSISectorWriteMultiple   // Used to access USBHostMSDSCSISectorWriteMultiple(), for compatibility with the File System code.
+#define SectorZeroMultiple  USBHostMSDSCSISectorZeroMultiple    // Used to access USBHostMSDSCSISectorZeroMultiple(), for compatibility with the File System code.
 #define WriteProtectState   USBHostMSDSCSIWriteProtectState // Used to access USBHostMSDSCSIWriteProtectState(), for compatibility with the File System code.
 #define MediaInitialize     USBHostMSDSCSIMediaInitialize   // Used to access USBHostMSDSCSIMediaInitialize(), for compatibility with the File System code
+#define MediaSelect         USBHostMSDSCSIUnitSelect        // Used to access USBHostMSDSCSIUnitSelect(), for compatibility with the File System code.
+#define MediaSectorSize     USBHostMSDSCSIMediaSectorSize   // Used to access USBHostMSDSCSIMediaSectorSize(), for compatibility with the File System code.
+#define MediaCapacity       USBHostMSDSCSIMediaCapacity     // Used to access USBHostMSDSCSIMediaCapacity(), so FSformat() can partition blank media.
+#define SectorWriteStart(s,c,b,z)   (USBHostMSDSCSISectorWriteStart( (s), (c), (b), (z), NULL ) == USB_SUCCESS)   // Starts a background write for the File System write queue (FS_BACKGROUND_WRITES).
+#define SectorWriteIsComplete       USBHostMSDSCSITransferIsComplete    // Used to access USBHostMSDSCSITransferIsComplete(), for the File System write queue.
 
 #endif
@@ -0,0 +1,528 @@
+/*******************************************************************************
+
+  USB Host Controller Simulator (Header File)
+
+Description:
+    This file lets the USB Embedded Host stack (usb_host.c, the Mass Storage
+    client driver, the SCSI interface and the file system above it) be built
+    and run on a workstation, to measure it without a board and a USB
+    analyzer.
+
+    It stands in for the processor header (p24fxxxx.h) in usb_config.h.  The
+    USB OTG module registers become variables, and usb_host_sim.c plays the
+    part of the module: it runs the tokens written to U1TOK against the
+    Buffer Descriptor Table, keeps the 1 ms frame timer, raises the interrupt
+    flags and calls _USB1Interrupt() when they are enabled.  The other end of
+    the cable is a bulk-only mass storage device backed by a disk image file,
+    or a hub with up to USB_HOST_SIM_MAX_DRIVES of them.
+
+    Time is simulated.  Each transaction takes as long as its packets would
+    on a full speed bus, and the device and the interrupt handler take as
+    long as USB_HOST_SIM_CONFIG says.  Nothing moves between calls to
+    USBHostSimTasks(), which usb_config.h adds to USBTasks(); each call runs
+    what the stack has started on the bus, then moves time on by one pass of
+    the application's main loop.  gUSBHostSimStats counts what went over the
+    bus.
+
+Summary:
+    Simulated PIC24 USB OTG module and mass storage device.
+
+*******************************************************************************/
+//DOM-IGNORE-BEGIN
+/*******************************************************************************
+
+* FileName:        usb_host_sim.h
+* Dependencies:    None
+* Processor:       Workstation (POSIX)
+* Compiler:        GCC
+
+*******************************************************************************/
+
+#ifndef __USBHOSTSIM_H__
+#define __USBHOSTSIM_H__
+//DOM-IGNORE-END
+
+#include "GenericTypeDefs.h"
+
+// The host stack is built the way it is for the PIC24 parts modeled here.
+#ifndef __C30__
+    #define __C30__
+#endif
+
+// _USB1Interrupt() is an ordinary function here, called by the simulator.
+#define __interrupt__               __used__
+#define auto_psv                    __unused__
+
+#define Nop()
+#define ClrWdt()
+
+
+// *****************************************************************************
+// *****************************************************************************
+// Section: USB OTG Module Registers
+// *****************************************************************************
+// *****************************************************************************
+
+// The registers and bit names used by the host stack, as in the PIC24FJ256GB1
+// family data sheet.  The interrupt flag registers U1OTGIR, U1IR and U1EIR are
+// cleared by writing a 1 to a flag, as on the part; write them whole with the
+// flags to clear, never through their bit fields.  _USB1Interrupt() sees one
+// enabled flag set per call.
+
+typedef struct
+{
+    unsigned VBUSVDIF:1;
+    unsigned :1;
+    unsigned SESENDIF:1;
+    unsigned SESVDIF:1;
+    unsigned ACTVIF:1;
+    unsigned LSTATEIF:1;
+    unsigned T1MSECIF:1;
+    unsigned IDIF:1;
+} U1OTGIRBITS;
+
+typedef struct
+{
+    unsigned VBUSVDIE:1;
+    unsigned :1;
+    unsigned SESENDIE:1;
+    unsigned SESVDIE:1;
+    unsigned ACTVIE:1;
+    unsigned LSTATEIE:1;
+    unsigned T1MSECIE:1;
+    unsigned IDIE:1;
+} U1OTGIEBITS;
+
+typedef struct
+{
+    unsigned USBPWR:1;
+    unsigned USUSPEND:1;
+    unsigned :2;
+    unsigned USBBUSY:1;
+    unsigned :2;
+    unsigned UACTPND:1;
+} U1PWRCBITS;
+
+typedef union
+{
+    struct
+    {
+        unsigned DETACHIF:1;
+        unsigned UERRIF:1;
+        unsigned SOFIF:1;
+        unsigned TRNIF:1;
+        unsigned IDLEIF:1;
+        unsigned RESUMEIF:1;
+        unsigned ATTACHIF:1;
+        unsigned STALLIF:1;
+    };
+    struct
+    {
+        unsigned URSTIF:1;
+    };
+} U1IRBITS;
+
+typedef union
+{
+    struct
+    {
+        unsigned DETACHIE:1;
+        unsigned UERRIE:1;
+        unsigned SOFIE:1;
+        unsigned TRNIE:1;
+        unsigned IDLEIE:1;
+        unsigned RESUMEIE:1;
+        unsigned ATTACHIE:1;
+        unsigned STALLIE:1;
+    };
+    struct
+    {
+        unsigned URSTIE:1;
+    };
+} U1IEBITS;
+
+typedef union
+{
+    struct
+    {
+        unsigned PIDEF:1;
+        unsigned EOFEF:1;
+        unsigned CRC16EF:1;
+        unsigned DFN8EF:1;
+        unsigned BTOEF:1;
+        unsigned DMAEF:1;
+        unsigned :1;
+        unsigned BTSEF:1;
+    };
+    struct
+    {
+        unsigned :1;
+        unsigned CRC5EF:1;
+    };
+} U1EIRBITS;
+
+typedef struct
+{
+    unsigned :2;
+    unsigned PPBI:1;
+    unsigned DIR:1;
+    unsigned ENDPT:4;
+} U1STATBITS;
+
+typedef union
+{
+    struct
+    {
+        unsigned SOFEN:1;
+        unsigned PPBRST:1;
+        unsigned RESUME:1;
+        unsigned HOSTEN:1;
+        unsigned USBRST:1;
+        unsigned TOKBUSY:1;
+        unsigned SE0:1;
+        unsigned JSTATE:1;
+    };
+    struct
+    {
+        unsigned USBEN:1;
+        unsigned :4;
+        unsigned PKTDIS:1;
+    };
+} U1CONBITS;
+
+typedef struct
+{
+    unsigned EPHSHK:1;
+    unsigned EPSTALL:1;
+    unsigned EPTXEN:1;
+    unsigned EPRXEN:1;
+    unsigned EPCONDIS:1;
+    unsigned :1;
+    unsigned RETRYDIS:1;
+    unsigned LSPD:1;
+} U1EP0BITS;
+
+typedef union { WORD Val; U1OTGIRBITS bits; }   USB_SIM_U1OTGIR;
+typedef union { WORD Val; U1OTGIEBITS bits; }   USB_SIM_U1OTGIE;
+typedef union { WORD Val; U1PWRCBITS bits; }    USB_SIM_U1PWRC;
+typedef union { WORD Val; U1IRBITS bits; }      USB_SIM_U1IR;
+typedef union { WORD Val; U1IEBITS bits; }      USB_SIM_U1IE;
+typedef union { WORD Val; U1EIRBITS bits; }     USB_SIM_U1EIR;
+typedef union { WORD Val; U1STATBITS bits; }    USB_SIM_U1STAT;
+typedef union { WORD Val; U1CONBITS bits; }     USB_SIM_U1CON;
+typedef union { WORD Val; U1EP0BITS bits; }     USB_SIM_U1EP0;
+
+extern volatile USB_SIM_U1OTGIR usbSimU1OTGIR;
+extern volatile USB_SIM_U1OTGIE usbSimU1OTGIE;
+extern volatile USB_SIM_U1PWRC  usbSimU1PWRC;
+extern volatile USB_SIM_U1IR    usbSimU1IR;
+extern volatile USB_SIM_U1IE    usbSimU1IE;
+extern volatile USB_SIM_U1EIR   usbSimU1EIR;
+extern volatile USB_SIM_U1EIR   usbSimU1EIE;
+extern volatile USB_SIM_U1STAT  usbSimU1STAT;
+extern volatile USB_SIM_U1CON   usbSimU1CON;
+extern volatile USB_SIM_U1EP0   usbSimU1EP0;
+extern volatile WORD            usbSimU1EP[16];
+extern volatile WORD            U1OTGSTAT, U1OTGCON, U1ADDR, U1TOK, U1SOF;
+extern volatile WORD            U1CNFG1, U1CNFG2, U1BDTP1, U1BDTP2, U1BDTP3;
+extern volatile WORD            IFS5, IEC5, IPC21;
+extern volatile WORD            U1FRML, U1FRMH;
+
+#define U1OTGIR         usbSimU1OTGIR.Val
+#define U1OTGIRbits     usbSimU1OTGIR.bits
+#define U1OTGIE         usbSimU1OTGIE.Val
+#define U1OTGIEbits     usbSimU1OTGIE.bits
+#define U1PWRC          usbSimU1PWRC.Val
+#define U1PWRCbits      usbSimU1PWRC.bits
+#define U1IR            usbSimU1IR.Val
+#define U1IRbits        usbSimU1IR.bits
+#define U1IE            usbSimU1IE.Val
+#define U1IEbits        usbSimU1IE.bits
+#define U1EIR           usbSimU1EIR.Val
+#define U1EIRbits       usbSimU1EIR.bits
+#define U1EIE           usbSimU1EIE.Val
+#define U1EIEbits       usbSimU1EIE.bits
+#define U1STAT          usbSimU1STAT.Val
+#define U1STATbits      usbSimU1STAT.bits
+#define U1CON           usbSimU1CON.Val
+#define U1CONbits       usbSimU1CON.bits
+#define U1EP0           usbSimU1EP0.Val
+#define U1EP0bits       usbSimU1EP0.bits
+#define U1EP1           usbSimU1EP[1]
+#define U1EP2           usbSimU1EP[2]
+#define U1EP3           usbSimU1EP[3]
+#define U1EP4           usbSimU1EP[4]
+#define U1EP5           usbSimU1EP[5]
+#define U1EP6           usbSimU1EP[6]
+#define U1EP7           usbSimU1EP[7]
+#define U1EP8           usbSimU1EP[8]
+#define U1EP9           usbSimU1EP[9]
+#define U1EP10          usbSimU1EP[10]
+#define U1EP11          usbSimU1EP[11]
+#define U1EP12          usbSimU1EP[12]
+#define U1EP13          usbSimU1EP[13]
+#define U1EP14          usbSimU1EP[14]
+#define U1EP15          usbSimU1EP[15]
+
+
+// *****************************************************************************
+// *****************************************************************************
+// Section: Data Structures
+// *****************************************************************************
+// *****************************************************************************
+
+// How the simulated device and processor behave.  The times are in
+// microseconds.  Change gUSBHostSimConfig before USBHostSimOpen().
+typedef struct _USB_HOST_SIM_CONFIG
+{
+    WORD    blockSize;          // Logical block length of the device (512 to 4096).
+    BYTE    scsiVersion;        // INQUIRY version; 5 and up also has the Block Limits page.
+    BYTE    writeProtect;       // Report the medium as write protected.
+    WORD    maxTransfer;        // Most blocks in one READ10 or WRITE10, on the Block Limits page and enforced (0 for no limit).
+    WORD    maxWriteSame;       // Most blocks in one WRITE SAME 10, on the Block Limits page (0 if it is not taken).
+    DWORD   commandTime;        // From a CBW until the device starts the data or status stage.
+    DWORD   readTime;           // Per block read, before its data can be sent.
+    DWORD   writeTime;          // Per block written, before the status is sent.
+    WORD    nakEvery;           // NAK every this many bulk tokens the device could have taken (0 for never).
+    DWORD   interruptTime;      // Spent by the processor in each call of _USB1Interrupt().
+    DWORD   taskTime;           // Spent by the processor in each main loop pass (USBTasks()).
+    BYTE    hubPorts;           // Ports of a hub on the root port (0 for no hub, drive 0 on the root port).
+    WORD    configLength;       // wTotalLength the drives claim for their configuration descriptor (0 for the real one).
+} USB_HOST_SIM_CONFIG;
+
+extern USB_HOST_SIM_CONFIG gUSBHostSimConfig;
+
+
+// What went over the bus since USBHostSimOpen() (or the counts were cleared).
+// A bit time is 1/12 us.
+typedef struct _USB_HOST_SIM_STATS
+{
+    QWORD   bitTimes;           // Simulated time.
+    QWORD   busyBitTimes;       // Time the bus carried packets, SOFs included.
+    DWORD   frames;             // Start of frame packets sent.
+    DWORD   setupTokens;        // SETUP transactions.
+    DWORD   inTokens;           // IN transactions.
+    DWORD   outTokens;          // OUT transactions.
+    DWORD   naks;               // Transactions the device answered with NAK.
+    DWORD   stalls;             // Transactions the device answered with STALL.
+    DWORD   errors;             // Transactions with no answer, a data overrun or no BDT.
+    DWORD   inBytes;            // Data received by the host (ACKed IN data).
+    DWORD   outBytes;           // Data sent by the host (ACKed OUT and SETUP data).
+    DWORD   interrupts;         // Calls of _USB1Interrupt().
+    DWORD   commands;           // Command Block Wrappers taken by the device.
+} USB_HOST_SIM_STATS;
+
+extern USB_HOST_SIM_STATS gUSBHostSimStats;
+
+#define USB_HOST_SIM_BIT_TIMES_PER_US   12
+
+// Drives that can be opened, and the most ports the hub can have.
+#define USB_HOST_SIM_MAX_DRIVES         4
+
+
+// *****************************************************************************
+// *****************************************************************************
+// Section: Function Prototypes
+// *****************************************************************************
+// *****************************************************************************
+
+/****************************************************************************
+  Function:
+    BOOL USBHostSimOpen( const char *path )
+
+  Description:
+    This function closes all the drives and opens the disk image that backs
+    drive 0.
+
+  Precondition:
+    None
+
+  Parameters:
+    const char *path    - The image, a whole number of blocks long
+
+  Return Values:
+    TRUE    - The image is open
+    FALSE   - It could not be opened, or gUSBHostSimConfig.blockSize is not
+                a power of 2 from 512 to 4096
+
+  Remarks:
+    The device is not attached yet; see USBHostSimAttach().  The counts in
+    gUSBHostSimStats are cleared.
+  ***************************************************************************/
+
+BOOL    USBHostSimOpen( const char *path );
+
+
+/****************************************************************************
+  Function:
+    BOOL USBHostSimOpenDrive( BYTE drive, const char *path )
+
+  Description:
+    This function opens the disk image that backs one drive.
+
+  Precondition:
+    None
+
+  Parameters:
+    BYTE drive          - The drive, 0 to USB_HOST_SIM_MAX_DRIVES - 1
+    const char *path    - The image, a whole number of blocks long
+
+  Return Values:
+    TRUE    - The image is open
+    FALSE   - It could not be opened, or the drive or block size is not valid
+
+  Remarks:
+    The drive is detached first if it was attached.  The counts in
+    gUSBHostSimStats are kept.
+  ***************************************************************************/
+
+BOOL    USBHostSimOpenDrive( BYTE drive, const char *path );
+
+
+/****************************************************************************
+  Function:
+    void USBHostSimClose( void )
+
+  Description:
+    This function detaches the devices and closes the images.
+
+  Precondition:
+    None
+
+  Parameters:
+    None - None
+
+  Returns:
+    None
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+void    USBHostSimClose( void );
+
+
+/****************************************************************************
+  Function:
+    void USBHostSimAttach( void )
+
+  Description:
+    This function plugs in what is on the root port: the hub if
+    gUSBHostSimConfig.hubPorts is set, otherwise drive 0.
+
+  Precondition:
+    USBHostSimOpen() has opened an image.
+
+  Parameters:
+    None - None
+
+  Returns:
+    None
+
+  Remarks:
+    The module sees the attach once the host stack has enabled it, and the
+    stack then enumerates the device as USBTasks() is called.
+  ***************************************************************************/
+
+void    USBHostSimAttach( void );
+
+
+/****************************************************************************
+  Function:
+    void USBHostSimDetach( void )
+
+  Description:
+    This function unplugs what is on the root port.
+
+  Precondition:
+    None
+
+  Parameters:
+    None - None
+
+  Returns:
+    None
+
+  Remarks:
+    A transfer that is running stops getting answers.  The drives behind an
+    unplugged hub stay in its ports.
+  ***************************************************************************/
+
+void    USBHostSimDetach( void );
+
+
+/****************************************************************************
+  Function:
+    void USBHostSimAttachDrive( BYTE drive )
+
+  Description:
+    This function plugs a drive into its port of the hub, or drive 0 into
+    the root port when there is no hub.
+
+  Precondition:
+    USBHostSimOpenDrive() has opened the image of the drive.
+
+  Parameters:
+    BYTE drive  - The drive
+
+  Returns:
+    None
+
+  Remarks:
+    The hub reports the connection once its port is powered.
+  ***************************************************************************/
+
+void    USBHostSimAttachDrive( BYTE drive );
+
+
+/****************************************************************************
+  Function:
+    void USBHostSimDetachDrive( BYTE drive )
+
+  Description:
+    This function unplugs a drive.
+
+  Precondition:
+    None
+
+  Parameters:
+    BYTE drive  - The drive
+
+  Returns:
+    None
+
+  Remarks:
+    A transfer to the drive that is running stops getting answers, and the
+    hub reports the disconnection.
+  ***************************************************************************/
+
+void    USBHostSimDetachDrive( BYTE drive );
+
+
+/****************************************************************************
+  Function:
+    void USBHostSimTasks( void )
+
+  Description:
+    This function runs the simulated module and bus.
+
+  Precondition:
+    None
+
+  Parameters:
+    None - None
+
+  Returns:
+    None
+
+  Remarks:
+    This is part of USBTasks() in the simulator's usb_config.h.  The tokens
+    written so far are sent, and the interrupts they cause are handled,
+    until the bus is idle or the frame is too full for the next one.  Then
+    gUSBHostSimConfig.taskTime passes, so calling this in a loop is like
+    waiting on the board.
+  ***************************************************************************/
+
+void    USBHostSimTasks( void );
+
+#endif
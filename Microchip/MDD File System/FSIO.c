@@ -10,6 +10,7 @@
 *               string.h
 *               stdlib.h
 *               FSDefs.h
+*               FSmedia.h
 *                   ctype.h
 *                   salloc.h
 * Processor:          PIC18/PIC24/dsPIC30/dsPIC33
@@ -39,13 +40,14 @@
 *
 *****************************************************************************/
 
-#include "MDD File System\FSIO.h"
+#include "MDD File System/FSIO.h"
 #include INCLUDEFILE
 #include "GenericTypeDefs.h"
 #include "string.h"
 #include "stdlib.h"
 #include "ctype.h"
-#include "MDD File System\FSDefs.h"
+#include "MDD File System/FSDefs.h"
+#include "MDD File System/FSmedia.h"
 
 #ifdef ALLOW_FSFPRINTF
     #include "stdarg.h"
@@ -67,6 +69,30 @@
     #ifdef ALLOW_FSFPRINTF
         #error Write functions must be enabled to use the FSfprintf function
     #endif
+    // The free cluster map is only used when allocating clusters
+    #undef FS_FREE_MAP_SIZE
+#endif
+
+// One FAT sector is cached unless the configuration asks for more
+#ifndef FS_FAT_CACHE_SECTORS
+    #define FS_FAT_CACHE_SECTORS    1
+#endif
+#if (FS_FAT_CACHE_SECTORS < 1) || (FS_FAT_CACHE_SECTORS > 16)
+    #error FS_FAT_CACHE_SECTORS must be between 1 and 16
+#endif
+#if defined(SUPPORT_LFN) && (FS_LFN_MAX_CHARS > 255)
+    #error FS_LFN_MAX_CHARS must not exceed 255
+#endif
+#if defined(FS_READ_AHEAD_SECTORS) && ((FS_READ_AHEAD_SECTORS < 2) || (FS_READ_AHEAD_SECTORS > 128))
+    #error FS_READ_AHEAD_SECTORS must be between 2 and 128
+#endif
+
+// One volume (drive A:) unless the configuration asks for more
+#ifndef FS_MAX_VOLUMES
+    #define FS_MAX_VOLUMES          1
+#endif
+#if (FS_MAX_VOLUMES < 1) || (FS_MAX_VOLUMES > 26)
+    #error FS_MAX_VOLUMES must be between 1 and 26
 #endif
 
 
@@ -81,10 +107,15 @@
     BYTE    gFileSlotOpen[FS_MAX_FILES_OPEN];
 #endif
 
-DWORD       gLastFATSectorRead = 0xFFFF;
-BYTE        gNeedFATWrite = FALSE;
+// FAT sector cache; the sector number, volume, dirty flag and LRU age of
+// each slot
+DWORD       gFATCacheSector[FS_FAT_CACHE_SECTORS];
+DISK *      gFATCacheDisk[FS_FAT_CACHE_SECTORS];
+BYTE        gFATCacheDirty[FS_FAT_CACHE_SECTORS];
+BYTE        gFATCacheAge[FS_FAT_CACHE_SECTORS];
 FSFILE  *   gBufferOwner = NULL;
 DWORD       gLastDataSectorRead = 0xFFFFFFFF;
+DWORD       gDirSectorRead = 0xFFFFFFFF;    // Directory sector in the shared buffer
 BYTE        gNeedDataWrite = FALSE;
 
 // Timing variables
@@ -98,28 +129,92 @@ WORD        gTimeWrtDate;   // last update date
 // This boolean shows that the buffer contains all zeros
 BYTE        gBufferZeroed = FALSE;
 
-// Global current working 
+// Free cluster map; one bit per group of 2^gFreeMapShift clusters,
+// a clear bit means every cluster in that group is known to be in use
+#ifdef FS_FREE_MAP_SIZE
+    BYTE    gFreeMap[FS_FREE_MAP_SIZE];
+    BYTE    gFreeMapShift;
+#endif
+
+// Read-ahead buffer; sectors read past the one a file reading in order
+// asked for, so the next ones don't each need a command of their own
+#ifdef FS_READ_AHEAD_SECTORS
+    BYTE    gReadAheadBuffer[FS_READ_AHEAD_SECTORS * MEDIA_SECTOR_SIZE];
+    DISK *  gReadAheadDisk = NULL;      // Volume the sectors came from
+    DWORD   gReadAheadSector;           // First sector in the buffer
+    WORD    gReadAheadCount = 0;        // Sectors in the buffer, 0 if empty
+#endif
+
+// Directory cache; recently resolved names, hashed on the directory's
+// first cluster and the 8.3 name. An empty slot has name[0] == 0.
+#ifdef FS_DIR_CACHE_SIZE
+    typedef struct
+    {
+        DWORD   dirclus;                // first cluster of the directory
+        char    name[FILE_NAME_SIZE];   // 8.3 name as stored in the entry
+        WORD    entry;                  // entry number in the directory
+        DWORD   cluster;                // first cluster of the file
+        DWORD   size;                   // file size
+        WORD    time;                   // last update time
+        WORD    date;                   // last update date
+        BYTE    attributes;             // entry attributes
+    } DIRCACHE;
+
+    DIRCACHE    gDirCache[FS_DIR_CACHE_SIZE];
+#endif
+
+// Long file names. Fill_File_Object puts gLfnName together from the long
+// name entries in front of each 8.3 entry; gLfnValid is set if it belongs to
+// the last 8.3 entry read. gLfnSearch is the long name being looked up or
+// created; gLfnSearchLen is 0 when the name in use is a plain 8.3 name.
+#ifdef SUPPORT_LFN
+    char    gLfnName[FS_LFN_MAX_CHARS + 1];
+    WORD    gLfnLength;             // characters in gLfnName
+    WORD    gLfnHash;               // hash of gLfnName, see LfnHashChar
+    BYTE    gLfnValid;
+    BYTE    gLfnSeq;                // number of the next long name entry expected
+    BYTE    gLfnChecksum;           // 8.3 name checksum the entries carry
+    WORD    gLfnEntry;              // entry number the next one must be at
+    DWORD   gLfnDirclus;            // directory the entries are in
+    char    gLfnSearch[FS_LFN_MAX_CHARS + 1];
+    WORD    gLfnSearchLen;
+    WORD    gLfnSearchHash;
+#endif
+
+// Current working directory of each volume; cwdptr is the active volume's
 #ifdef ALLOW_DIRS
-    FSFILE   cwd;
-    FSFILE * cwdptr = &cwd;
+    FSFILE   cwd[FS_MAX_VOLUMES];
+    FSFILE * cwdptr = &cwd[0];
 #endif
 
 #ifdef USE_PIC18
     #pragma udata dataBuffer
     BYTE gDataBuffer[MEDIA_SECTOR_SIZE];
     #pragma udata FATBuffer
-    BYTE gFATBuffer[MEDIA_SECTOR_SIZE];
+    BYTE gFATBuffer[FS_FAT_CACHE_SECTORS][MEDIA_SECTOR_SIZE];
+    #if defined(FS_FILE_BUFFERS) && !defined(FS_DYNAMIC_MEM)
+        #pragma udata fileBuffers
+        BYTE gFileBuffer[FS_MAX_FILES_OPEN][MEDIA_SECTOR_SIZE];
+    #endif
 #endif
 
-#ifdef USE_PIC24
+#ifndef USE_PIC18
     BYTE __attribute__ ((aligned(4)))   gDataBuffer[MEDIA_SECTOR_SIZE];
-    BYTE __attribute__ ((aligned(4)))   gFATBuffer[MEDIA_SECTOR_SIZE];
+    BYTE __attribute__ ((aligned(4)))   gFATBuffer[FS_FAT_CACHE_SECTORS][MEDIA_SECTOR_SIZE];
+    #if defined(FS_FILE_BUFFERS) && !defined(FS_DYNAMIC_MEM)
+        BYTE __attribute__ ((aligned(4)))   gFileBuffer[FS_MAX_FILES_OPEN][MEDIA_SECTOR_SIZE];
+    #endif
 #endif
 
 
 #pragma udata
 
-DISK gDiskData;
+// Volumes, drive A: first. gActiveDisk is the one the media layer and the
+// shared buffers were last set up for; names without a drive letter are on
+// gCurrentVolume.
+DISK    gDiskData[FS_MAX_VOLUMES];
+DISK *  gActiveDisk = NULL;
+BYTE    gCurrentVolume = 0;
 
 /************************************************************************/
 /*                        Structures and defines                        */
@@ -155,6 +250,7 @@ typedef _DIRENTRY * DIRENTRY;
 #define DIR_ATTRIB   11      // offset of attribute( 00ARSHDV) (BYTE)
 #define DIR_TIME   22      // offset of last use time  (WORD)
 #define DIR_DATE   24      // offset of last use date  (WORD)
+#define DIR_CLSTHI 20      // offset of high word of first cluster in FAT32 (WORD)
 #define DIR_CLST   26      // offset of first cluster in FAT (WORD)
 #define DIR_SIZE   28      // offset of file size (DWORD)
 #define DIR_DEL      0xE5    // marker of a deleted entry
@@ -162,14 +258,74 @@ typedef _DIRENTRY * DIRENTRY;
 
 #define DIRECTORY 0x12
 
-// number of directory entries in one sector
-#define DIRENTRIES_PER_SECTOR   0x10
+// number of directory entries in one sector of a disk, the place of an
+// entry in its sector, and the sector of the directory it is in
+#define DIRENTRIES_PER_SECTOR(d)    ((d)->sectorSize / sizeof (_DIRENTRY))
+#define DIRENTRY_INDEX(d,e)         ((e) & (DIRENTRIES_PER_SECTOR(d) - 1))
+#define DIRENTRY_SECTOR(d,e)        ((e) >> ((d)->sectorShift - 5))
 
 
 // internal errors
 #define CE_FAT_EOF            60   // fat attempt to read beyond EOF
 #define CE_EOF               61   // reached the end of file   
 
+// longest run of sectors handed to the media layer in one call: 16 MiB, so
+// 0x8000 sectors of 512 bytes and fewer of larger ones
+#define FS_MAX_SECTOR_RUN(d)    ((WORD)(0x01000000ul >> (d)->sectorShift))
+// FAT cache slot markers
+#define FAT_CACHE_EMPTY     0xFFFFFFFF  // sector number of an unused slot
+#define FAT_CACHE_FAIL      0xFF        // FATCacheLoad could not get the sector
+
+// The data sector of an open file lives either in the file's own buffer or
+// in the shared dsk->buffer, whose user is tracked through gBufferOwner
+#ifdef FS_FILE_BUFFERS
+    #define FileBuffer(f)           ((f)->buffer)
+    #define FileBufferSector(f)     ((f)->bufsec)
+    #define FileNeedWrite(f)        ((f)->bufdirty)
+    #define FileFlush(f)            FILEflush(f)
+#else
+    #define FileBuffer(f)           ((f)->dsk->buffer)
+    #define FileBufferSector(f)     gLastDataSectorRead
+    #define FileNeedWrite(f)        gNeedDataWrite
+    #define FileFlush(f)            flushData()
+#endif
+
+// A file can only be used while its volume is mounted; names without a
+// drive letter are on the current volume
+#define FileSelect(f)           ((f)->dsk->mount && VolumeSelect ((f)->dsk))
+#define CurrentVolumeSelect()   (gDiskData[gCurrentVolume].mount && VolumeSelect (&gDiskData[gCurrentVolume]))
+
+// cluster number that stands for the root directory; FAT12/16 keep the root in
+// a fixed region addressed as cluster 0, FAT32 keeps it in a cluster chain
+#define FatRootDirClusterValue(d)   (((d)->type == FAT32) ? (d)->rootcls : 0)
+
+// value that marks the last cluster of a chain in this disk's FAT
+#define FatLastClusterValue(d)      (((d)->type == FAT32) ? LAST_CLUSTER_FAT32 : \
+                                     ((d)->type == FAT16) ? LAST_CLUSTER_FAT16 : LAST_CLUSTER_FAT12)
+
+#ifdef SUPPORT_LFN
+    // long file name entries; each holds 13 UTF-16 characters of the name and
+    // the one holding the end of the name comes first, with LFN_LAST_ENTRY set
+    #define LFN_CHARS_PER_ENTRY     13
+    #define LFN_LAST_ENTRY          0x40    // flag in the order byte of the last entry
+    #define LFN_ORDER_MASK          0x1F    // entry number in the order byte
+    #define LFN_CHKSUM              13      // offset of the 8.3 name checksum
+    #define LFN_IDLE                0xFF    // gLfnSeq when no long name is being read
+    #define LFN_TAIL_MAP            64      // ~N tails LfnMakeAlias tracks one bit each
+    #define LFN_MAX_TAIL            999999ul
+
+    // byte offset in an entry of the kth character it holds
+    #define LfnCharOffset(k)        (((k) < 5) ? (1 + 2 * (k)) : ((k) < 11) ? (4 + 2 * (k)) : (6 + 2 * (k)))
+    // what a character adds to the hash of a name; weighted by position, and
+    // upper case since names match without regard to case
+    #define LfnHashChar(c, pos)     ((WORD)(BYTE)toupper((BYTE)(c)) * (WORD)((pos) + 1))
+
+    // FILEfind mode for the name given to FSfopen, FSremove or FSrename
+    #define FindNameMode()          ((gLfnSearchLen != 0) ? 2 : 0)
+#else
+    #define FindNameMode()          0
+#endif
+
 // since we use an address generator, FILE is not actually the cast of what we pass
 typedef FSFILE   * FILEOBJ;
 
@@ -212,10 +368,23 @@ typedef FSFILE   * FILEOBJ;
 /*                               Prototypes                                         */
 /************************************************************************************/
 
-WORD ReadFAT (DISK *dsk, WORD ccls);
+BYTE VolumeSelect (DISK * dsk);
+const char * VolumeFromName (const char * name);
+DWORD ReadFAT (DISK *dsk, DWORD ccls);
+BYTE FATCacheLoad (DISK * dsk, DWORD sector);
+void FATCacheInvalidate (void);
+void FATCacheForget (DISK * dsk);
+#ifdef FS_DIR_CACHE_SIZE
+    BYTE DirCacheSlot (DWORD dirclus, char * name);
+    BYTE DirCacheFind (FILEOBJ fo, char * name);
+    void DirCacheAdd (FILEOBJ fo);
+    void DirCacheForget (DWORD dirclus, WORD entry);
+    void DirCacheInvalidate (void);
+#endif
 DIRENTRY Cache_File_Entry( FILEOBJ fo, WORD * curEntry, BYTE ForceRead);
 BYTE Fill_File_Object(FILEOBJ fo, WORD *fHandle);
-DWORD Cluster2Sector(DISK * disk, WORD cluster);
+DWORD Cluster2Sector(DISK * disk, DWORD cluster);
+DWORD GetFullClusterNumber (DISK * dsk, DIRENTRY entry);
 DIRENTRY LoadDirAttrib(FILEOBJ fo, WORD *fHandle);
 #ifdef INCREMENTTIMESTAMP
     void IncrementTimeStamp(DIRENTRY dir);
@@ -229,24 +398,68 @@ BYTE isDIR (BYTE aChar, BYTE mode);
 extern BYTE WriteProtectState(void);
 BYTE ValidateChars (char * FileName, BYTE which, BYTE mode);
 BYTE FormatFileName( const char* fileName, char* fN2, BYTE mode);
+#ifdef SUPPORT_LFN
+    BYTE LfnChecksum (char * name);
+    void LfnCollect (FILEOBJ fo, WORD entry, DIRENTRY dir);
+    BYTE LfnSetSearch (const char * fileName);
+    BYTE LfnMatch (void);
+    #ifdef ALLOW_WRITES
+        char LfnShortChar (char c);
+        BYTE LfnMakeAlias (FILEOBJ fo, char * alias);
+        BYTE LfnWriteEntries (FILEOBJ fo, char * alias, WORD fHandle, BYTE count);
+        BYTE LfnErase (FILEOBJ fo, WORD entry, BYTE checksum);
+        int LfnRename (const char * fileName, FSFILE * fo);
+    #endif
+#endif
 CETYPE FILEfind( FILEOBJ foDest, FILEOBJ foCompareTo, BYTE cmd, BYTE mode);
-BYTE FILEget_next_cluster(FILEOBJ fo, WORD n);
+#ifdef ALLOW_FILESEARCH
+    int FindFromEntry (SearchRec * rec, WORD fHandle);
+#endif
+BYTE FILEget_next_cluster(FILEOBJ fo, DWORD n);
+BYTE FILEseek_cluster(FILEOBJ fo, DWORD n);
+#ifdef FS_EXTENT_MAP_SIZE
+    void ExtentMapCheck (FILEOBJ fo);
+    DWORD ExtentMapNext (FILEOBJ fo, DWORD ccls);
+    void ExtentMapAdd (FILEOBJ fo, DWORD ccls, DWORD next);
+#endif
+#ifdef FS_READ_AHEAD_SECTORS
+    BYTE ReadAheadLoad (FILEOBJ fo, DWORD sector, DWORD left);
+    void ReadAheadForget (DWORD sector, DWORD count);
+    #define ReadAheadHolds(d,s)     ((gReadAheadCount != 0) && (gReadAheadDisk == (d)) && \
+                                     ((s) >= gReadAheadSector) && ((s) < gReadAheadSector + gReadAheadCount))
+    // sectors of the disk the buffer holds
+    #define ReadAheadMost(d)        ((WORD)(((DWORD)FS_READ_AHEAD_SECTORS * MEDIA_SECTOR_SIZE) >> (d)->sectorShift))
+#else
+    #define ReadAheadForget(s,c)
+    #define ReadAheadHolds(d,s)     FALSE
+#endif
 CETYPE FILEopen (FILEOBJ fo, WORD *fHandle, char type);
 
 // Write functions
 #ifdef ALLOW_WRITES
     BYTE flushData (void);
+    #ifdef FS_FILE_BUFFERS
+        BYTE FILEflush (FILEOBJ fo);
+    #endif
     CETYPE FILEerase( FILEOBJ fo, WORD *fHandle, BYTE EraseClusters);
+    BYTE Write_File_Entry( FILEOBJ fo, WORD * curEntry);
     BYTE FILEallocate_new_cluster( FILEOBJ fo, BYTE mode);
-    BYTE FAT_erase_cluster_chain (WORD cluster, DISK * dsk);
-    WORD FATfindEmptyCluster(FILEOBJ fo);
-    BYTE FindEmptyEntries(FILEOBJ fo, WORD *fHandle);
+    BYTE FAT_erase_cluster_chain (DWORD cluster, DISK * dsk);
+    DWORD FATfindEmptyCluster(FILEOBJ fo);
+    DWORD FATfindEmptyRun (DISK * dsk, DWORD first, DWORD count);
+    #ifdef FS_FREE_MAP_SIZE
+        void FreeMapInit (DISK * dsk);
+        void FreeMapSet (DWORD cluster, BYTE mayBeFree);
+    #endif
+    BYTE FindEmptyEntries(FILEOBJ fo, WORD *fHandle, BYTE count);
     BYTE PopulateEntries(FILEOBJ fo, char *name , WORD *fHandle, BYTE mode);
-    CETYPE FILECreateHeadCluster( FILEOBJ fo, WORD *cluster);
-    BYTE EraseCluster(DISK *disk, WORD cluster);
+    CETYPE FILECreateHeadCluster( FILEOBJ fo, DWORD *cluster);
+    BYTE EraseCluster(DISK *disk, DWORD cluster);
     CETYPE CreateFirstCluster(FILEOBJ fo);
-    WORD WriteFAT (DISK *dsk, WORD ccls, WORD value, BYTE forceWrite);
+    DWORD WriteFAT (DISK *dsk, DWORD ccls, DWORD value, BYTE forceWrite);
+    BYTE FATCacheWriteBack (DISK * dsk, BYTE slot);
     CETYPE CreateFileEntry(FILEOBJ fo, WORD *fHandle, BYTE mode);
+    BYTE WriteFSInfo (DISK * dsk);
 #endif
 
 // Dir functions
@@ -254,7 +467,8 @@ CETYPE FILEopen (FILEOBJ fo, WORD *fHandle, char type);
     BYTE GetPreviousEntry (FILEOBJ fo);
     void FormatDirName (char * string, BYTE mode);
     int CreateDIR (char * path);
-    BYTE writeDotEntries (DISK * dsk, WORD dotAddress, WORD dotdotAddress);
+    char * getcwdhelper (char * path, int numchars);
+    BYTE writeDotEntries (DISK * dsk, DWORD dotAddress, DWORD dotdotAddress);
     int eraseDir (char * path);
     #ifdef ALLOW_PGMFUNCTIONS
         int mkdirhelper (BYTE mode, char * ramptr, const rom char * romptr);
@@ -278,9 +492,90 @@ CETYPE FILEopen (FILEOBJ fo, WORD *fHandle, char type);
 #endif
 
 BYTE DISKmount( DISK *dsk);
+BYTE LoadSectorSize (DISK *dsk);
 BYTE LoadMBR(DISK *dsk);
 BYTE LoadBootSector(DISK *dsk);
 
+// Media layers that only drive one unit have nothing to select
+#ifndef MediaSelect
+    #define FS_EMULATE_MEDIA_SELECT
+    BYTE MediaSelect (BYTE unit);
+#endif
+
+// Media layers that can't report their size leave it unknown (0)
+#ifndef MediaCapacity
+    #define MediaCapacity() 0
+#endif
+
+// Media layers that can only move one sector per command get a simple loop
+// over SectorRead/SectorWrite in place of the multiple sector functions.
+#ifndef SectorReadMultiple
+    #define FS_EMULATE_READ_MULTIPLE
+    BYTE SectorReadMultiple (DWORD sector, WORD count, BYTE * buffer);
+#endif
+#ifdef ALLOW_WRITES
+    #ifndef SectorWriteMultiple
+        #define FS_EMULATE_WRITE_MULTIPLE
+        BYTE SectorWriteMultiple (DWORD sector, WORD count, BYTE * buffer, BYTE allowWriteToZero);
+    #endif
+    #ifndef SectorZeroMultiple
+        #define FS_EMULATE_ZERO_MULTIPLE
+        BYTE SectorZeroMultiple (DWORD sector, DWORD count, BYTE * buffer, WORD bufferSectors);
+    #endif
+#endif
+
+// With background writes the sectors go through the write queue, which
+// reaches the media itself (FSwritequeue.c)
+#if defined(ALLOW_WRITES) && defined(FS_BACKGROUND_WRITES)
+    #if defined(FS_EMULATE_READ_MULTIPLE) || defined(FS_EMULATE_WRITE_MULTIPLE)
+        #error FS_BACKGROUND_WRITES needs a media layer with SectorReadMultiple and SectorWriteMultiple
+    #endif
+    #undef SectorRead
+    #undef SectorReadMultiple
+    #undef SectorWrite
+    #undef SectorWriteMultiple
+    #undef MediaSync
+    #define SectorRead(s,b)         WriteQueueSectorRead ((s), 1, (b))
+    #define SectorReadMultiple      WriteQueueSectorRead
+    #define SectorWrite(s,b,z)      WriteQueueSectorWrite ((s), 1, (b), (z))
+    #define SectorWriteMultiple     WriteQueueSectorWrite
+    #define MediaSync               WriteQueueMediaSync
+    #ifndef FS_EMULATE_ZERO_MULTIPLE
+        #undef SectorZeroMultiple
+        #define SectorZeroMultiple  WriteQueueSectorZero
+    #endif
+    #ifndef FS_EMULATE_MEDIA_SELECT
+        #undef MediaSelect
+        #define MediaSelect         WriteQueueMediaSelect
+    #endif
+#endif
+
+// With the write cache the sectors go through it, and it writes them back
+// through the write queue or to the media (FSwritecache.c)
+#if defined(ALLOW_WRITES) && defined(FS_WRITE_CACHE_SECTORS)
+    #if defined(FS_EMULATE_READ_MULTIPLE) || defined(FS_EMULATE_WRITE_MULTIPLE)
+        #error FS_WRITE_CACHE_SECTORS needs a media layer with SectorReadMultiple and SectorWriteMultiple
+    #endif
+    #undef SectorRead
+    #undef SectorReadMultiple
+    #undef SectorWrite
+    #undef SectorWriteMultiple
+    #undef MediaSync
+    #define SectorRead(s,b)         WriteCacheSectorRead ((s), 1, (b))
+    #define SectorReadMultiple      WriteCacheSectorRead
+    #define SectorWrite(s,b,z)      WriteCacheSectorWrite ((s), 1, (b), (z))
+    #define SectorWriteMultiple     WriteCacheSectorWrite
+    #define MediaSync               WriteCacheMediaSync
+    #ifndef FS_EMULATE_ZERO_MULTIPLE
+        #undef SectorZeroMultiple
+        #define SectorZeroMultiple  WriteCacheSectorZero
+    #endif
+    #ifndef FS_EMULATE_MEDIA_SELECT
+        #undef MediaSelect
+        #define MediaSelect         WriteCacheMediaSelect
+    #endif
+#endif
+
 extern void Delayms(BYTE milliseconds);
 
 
@@ -297,9 +592,9 @@ extern void Delayms(BYTE milliseconds);
 *
 * Overview:        Initialize the static memory slots for holding
 *               file structures; only used when FS_DYNAMIC_MEM is
-*               not defined
+*               not defined. Then mount volume A: from media unit 0.
 *
-* Note:            None
+* Note:            Every volume mounted before is forgotten
 *****************************************************************************/
 int FSInit()
 {
@@ -316,34 +611,294 @@ int FSInit()
 #endif
 
     gBufferZeroed = FALSE;
+    gDirSectorRead = 0xFFFFFFFF;
+
+    // The FAT cache may hold sectors from other media
+    FATCacheInvalidate();
+#if defined(ALLOW_WRITES) && defined(FS_WRITE_CACHE_SECTORS)
+    WriteCacheInvalidate();
+#endif
+#ifdef FS_READ_AHEAD_SECTORS
+    gReadAheadCount = 0;
+#endif
+#ifdef FS_DIR_CACHE_SIZE
+    DirCacheInvalidate();
+#endif
+#ifdef SUPPORT_LFN
+    gLfnSeq = LFN_IDLE;
+    gLfnValid = FALSE;
+    gLfnSearchLen = 0;
+#endif
+
+    // The media may have changed under every volume
+    for (fIndex = 0; fIndex < FS_MAX_VOLUMES; fIndex++)
+        gDiskData[fIndex].mount = FALSE;
+    gActiveDisk = NULL;
+    gCurrentVolume = 0;
 
     InitIO();
 
-    if(DISKmount(&gDiskData) == CE_GOOD)
-    {
-        // Initialize the current working directory to the root
-        #ifdef ALLOW_DIRS
-            cwdptr->dsk = &gDiskData;
-            cwdptr->sec = 0;
-            cwdptr->pos = 0;
-            cwdptr->seek = 0;
-            cwdptr->size = 0;
-            cwdptr->name[0] = '\\';
-            for (fIndex = 1; fIndex < 11; fIndex++)
-            {
-                cwdptr->name[fIndex] = 0x20;
-            } 
-            cwdptr->entry = 0;
-            cwdptr->attributes = ATTR_DIRECTORY;
-            // Zero indicates the root
-            cwdptr->dirclus = 0;
-            cwdptr->dirccls = 0;
-        #endif
-        
-        return TRUE;
+    return FSmount ('A', 0, 0);
+}
+
+
+/******************************************************************************
+* Function:        int FSmount (char drive, BYTE unit, BYTE partition)
+*
+* PreCondition:    FSInit called
+*
+* Input:           drive      - Drive letter of the volume, from 'A' to the
+*                               FS_MAX_VOLUMES-th letter
+*                  unit       - Media unit the volume is on
+*                  partition  - MBR partition table entry (0-3) holding it;
+*                               0 for media without a partition table
+*
+* Output:          int        - TRUE if the volume was mounted, otherwise FALSE
+*
+* Side Effects:    A volume already mounted as drive is unmounted first
+*
+* Overview:        Mount a FAT volume and start its current working
+*                  directory in the root
+*
+* Note:            With the USB mass storage layer a unit is one LUN of an
+*                  attached device. The drive keeps its unit and partition
+*                  even if the mount fails, so FSformat can be used on it.
+*****************************************************************************/
+
+int FSmount (char drive, BYTE unit, BYTE partition)
+{
+    BYTE    v = (drive | 0x20) - 'a';
+    DISK *  dsk;
+#ifdef ALLOW_DIRS
+    BYTE    i;
+#endif
+
+    if (v >= FS_MAX_VOLUMES)
+        return FALSE;
+
+    dsk = &gDiskData[v];
+    if (dsk->mount)
+        FSunmount (drive);
+
+    dsk->unit = unit;
+    dsk->partition = partition;
+    if (!VolumeSelect (dsk))
+        return FALSE;
+
+    if (DISKmount (dsk) != CE_GOOD)
+        return FALSE;
+
+    // Initialize the current working directory to the root
+    #ifdef ALLOW_DIRS
+        cwdptr->dsk = dsk;
+        cwdptr->sec = 0;
+        cwdptr->pos = 0;
+        cwdptr->seek = 0;
+        cwdptr->size = 0;
+        cwdptr->name[0] = '\\';
+        for (i = 1; i < 11; i++)
+        {
+            cwdptr->name[i] = 0x20;
+        } 
+        cwdptr->entry = 0;
+        cwdptr->attributes = ATTR_DIRECTORY;
+        // Start in the root
+        cwdptr->dirclus = FatRootDirClusterValue(dsk);
+        cwdptr->dirccls = cwdptr->dirclus;
+    #endif
+
+    #ifdef FS_FREE_MAP_SIZE
+        FreeMapInit (dsk);
+    #endif
+
+    return TRUE;
+}
+
+
+/******************************************************************************
+* Function:        int FSunmount (char drive)
+*
+* PreCondition:    The volume's files are closed
+*
+* Input:           drive      - Drive letter of the volume
+*
+* Output:          int        - 0 if everything cached for the volume was
+*                               written back, EOF otherwise
+*
+* Side Effects:    None
+*
+* Overview:        Write back the data and FAT sectors a volume still has in
+*                  RAM and forget the volume
+*
+* Note:            Call it when media is removed too; whatever could not be
+*                  written is dropped so the other volumes can carry on
+*****************************************************************************/
+
+int FSunmount (char drive)
+{
+    BYTE    v = (drive | 0x20) - 'a';
+    DISK *  dsk;
+    int     error = 0;
+
+    if ((v >= FS_MAX_VOLUMES) || !gDiskData[v].mount)
+        return EOF;
+
+    dsk = &gDiskData[v];
+
+#ifdef ALLOW_WRITES
+    if (VolumeSelect (dsk))
+    {
+        if (gNeedDataWrite)
+            if (flushData())
+                error = EOF;
+        if (WriteFAT (dsk, 0, 0, TRUE))
+            error = EOF;
+        if (!MediaSync())
+            error = EOF;
+    }
+    else
+        error = EOF;
+#endif
 
+    FATCacheForget (dsk);
+#ifdef FS_READ_AHEAD_SECTORS
+    if (gReadAheadDisk == dsk)
+        gReadAheadCount = 0;
+#endif
+    dsk->mount = FALSE;
+    if (gActiveDisk == dsk)
+        gActiveDisk = NULL;
+
+    return error;
+}
+
+
+/******************************************************************************
+* Function:        int FSchdrive (char drive)
+*
+* PreCondition:    None
+*
+* Input:           drive      - Drive letter of the volume
+*
+* Output:          int        - 0 if successful, -1 otherwise
+*
+* Side Effects:    None
+*
+* Overview:        Make a volume the current one; names without a drive
+*                  letter, FSgetcwd and FSformat use it
+*
+* Note:            The volume does not have to be mounted, so one that
+*                  failed to mount can be formatted
+*****************************************************************************/
+
+int FSchdrive (char drive)
+{
+    BYTE    v = (drive | 0x20) - 'a';
+
+    if (v >= FS_MAX_VOLUMES)
+        return -1;
+
+    gCurrentVolume = v;
+    return 0;
+}
+
+
+/******************************************************************************
+* Function:        BYTE VolumeSelect (DISK * dsk)
+*
+* PreCondition:    None
+*
+* Input:           dsk        - The volume about to be used
+*
+* Output:          TRUE       - The volume's media unit is selected
+*                  FALSE      - The media unit is not there
+*
+* Side Effects:    When the volume is not the last one used, the shared
+*                  buffer is written back and emptied, and the directory
+*                  cache and the free cluster map start over
+*
+* Overview:        Point the media layer, the shared buffers and cwdptr at
+*                  a volume
+*
+* Note:            Called by the user functions before they use the media.
+*                  The FAT cache keeps the sectors of every volume, each
+*                  slot tagged with its volume, so it is not emptied.
+*****************************************************************************/
+
+BYTE VolumeSelect (DISK * dsk)
+{
+    if (dsk != gActiveDisk)
+    {
+    #ifdef ALLOW_WRITES
+        // The shared buffer may hold data of the last volume
+        if ((gActiveDisk != NULL) && gNeedDataWrite && MediaSelect (gActiveDisk->unit))
+            flushData();
+    #endif
+        gNeedDataWrite = FALSE;
+        gBufferOwner = NULL;
+        gLastDataSectorRead = 0xFFFFFFFF;
+        gDirSectorRead = 0xFFFFFFFF;
+        gBufferZeroed = FALSE;
+
+    #ifdef FS_DIR_CACHE_SIZE
+        DirCacheInvalidate();
+    #endif
+    #ifdef SUPPORT_LFN
+        gLfnSeq = LFN_IDLE;
+        gLfnValid = FALSE;
+    #endif
+    #ifdef FS_FREE_MAP_SIZE
+        if (dsk->mount)
+            FreeMapInit (dsk);
+    #endif
+
+        gActiveDisk = dsk;
+    }
+
+#ifdef ALLOW_DIRS
+    cwdptr = &cwd[dsk - gDiskData];
+#endif
+
+    return MediaSelect (dsk->unit);
+}
+
+
+/******************************************************************************
+* Function:        const char * VolumeFromName (const char * name)
+*
+* PreCondition:    None
+*
+* Input:           name       - A file name or path, with or without a drive
+*                               letter in front ("B:LOG.TXT")
+*
+* Output:          const char * - The name without the drive letter, or NULL
+*                                 if its volume is not mounted or its media
+*                                 is not there
+*
+* Side Effects:    None
+*
+* Overview:        Select the volume a name is on; the one its drive letter
+*                  names, or the current volume
+*
+* Note:            Should not be called by user
+*****************************************************************************/
+
+const char * VolumeFromName (const char * name)
+{
+    BYTE    v = gCurrentVolume;
+
+    if ((name[0] != 0) && (name[1] == ':'))
+    {
+        v = (name[0] | 0x20) - 'a';
+        if (v >= FS_MAX_VOLUMES)
+            return NULL;
+        name += 2;
     }
-return FALSE;
+
+    if (!gDiskData[v].mount || !VolumeSelect (&gDiskData[v]))
+        return NULL;
+
+    return name;
 }
 
 /***********************************************************************************************
@@ -356,8 +911,12 @@ return FALSE;
 *               foCompareTo  - FILEOBJ containing name of file to be found
 *               cmd          - 1 - search for a matching entry
 *                              2 - search for an empty entry
+*                              3 - carry on a search for a matching entry
+*                                  from foDest->entry; foDest->dirccls is
+*                                  the cluster of the entry before it
 *            mode         - 0 - match a file exactly, default attr
 *                              1 - match with user attributes
+*                              2 - match the long name in gLfnSearch
 *                  
 * Output:          CE_GOOD             - File found
 *                  CE_FILE_NOT_FOUND   - File not found 
@@ -366,7 +925,10 @@ return FALSE;
 *
 * Overview:        Find a file given a name as passed via foCompareTo, place found in foDest
 *
-* Note:            None
+* Note:            In mode 2 only entries whose long name has the length and
+*                  hash of gLfnSearch have their characters compared. With
+*                  cmd 3 the directory sector isn't read again if it is still
+*                  in the buffer.
 ************************************************************************************************/
 
 CETYPE FILEfind( FILEOBJ foDest, FILEOBJ foCompareTo, BYTE cmd, BYTE mode)
@@ -376,10 +938,32 @@ CETYPE FILEfind( FILEOBJ foDest, FILEOBJ foCompareTo, BYTE cmd, BYTE mode)
     BYTE    state,index;              // state of the current object
     CETYPE  statusB = CE_FILE_NOT_FOUND;           
     BYTE    character,test;
+    BYTE    loaded = FALSE;           // the sector of fHandle is in the buffer
+    WORD    offset2;
+
+    // A search carried on within a sector may still have it in the buffer
+    if ((cmd == 3) && (DIRENTRY_INDEX (foDest->dsk, fHandle) != 0))
+    {
+        offset2 = DIRENTRY_SECTOR (foDest->dsk, fHandle);
+        if (foDest->dirclus != 0)
+            offset2 = offset2 % foDest->dsk->SecPerClus;
+        loaded = (gDirSectorRead == Cluster2Sector (foDest->dsk, foDest->dirccls) + offset2);
+    }
 
     // reset the cluster
-    foDest->dirccls = foDest->dirclus;
+    if (!loaded)
+        foDest->dirccls = foDest->dirclus;
     compareAttrib = 0xFFFF ^ foCompareTo->attributes;
+
+#ifdef FS_DIR_CACHE_SIZE
+    // A name looked up recently doesn't need a directory scan
+    if ((mode == 0) && (cmd == 1) && (fHandle == 0))
+    {
+        if (DirCacheFind (foDest, foCompareTo->name))
+            return CE_GOOD;
+    }
+#endif
+
     if (fHandle == 0)
     {
         if (Cache_File_Entry(foDest, &fHandle, TRUE) == NULL)
@@ -389,7 +973,7 @@ CETYPE FILEfind( FILEOBJ foDest, FILEOBJ foCompareTo, BYTE cmd, BYTE mode)
     }
     else
     {
-        if ((fHandle & 0xf) != 0)
+        if ((DIRENTRY_INDEX (foDest->dsk, fHandle) != 0) && !loaded)
         {
             if (Cache_File_Entry (foDest, &fHandle, TRUE) == NULL)
             {
@@ -491,6 +1075,18 @@ CETYPE FILEfind( FILEOBJ foDest, FILEOBJ foCompareTo, BYTE cmd, BYTE mode)
                         } // Attribute match
 
                         break;
+
+                #ifdef SUPPORT_LFN
+                    case 2:
+                        // Long name; the same entries are skipped as in mode 0
+                        if((attrib != ATTR_VOLUME) && (attrib & ATTR_HIDDEN) != ATTR_HIDDEN)
+                        {
+                            if (gLfnValid && (gLfnLength == gLfnSearchLen) &&
+                                (gLfnHash == gLfnSearchHash) && LfnMatch())
+                                statusB = CE_GOOD;
+                        }
+                        break;
+                #endif
                 }
             } // not found
             else
@@ -505,53 +1101,748 @@ CETYPE FILEfind( FILEOBJ foDest, FILEOBJ foCompareTo, BYTE cmd, BYTE mode)
 
         }// while 
     }
+
+#ifdef FS_DIR_CACHE_SIZE
+    if ((statusB == CE_GOOD) && (mode == 0) && (cmd == 1))
+        DirCacheAdd (foDest);
+#endif
+
     return(statusB);
 } // FILEFind
 
-
+#ifdef FS_DIR_CACHE_SIZE
 /******************************************************************************
-* Function:        CETYPE FILEopen (FILEOBJ fo, WORD *fHandle, char type)
+* Function:        BYTE DirCacheSlot (DWORD dirclus, char * name)
 *
-* PreCondition:    FILEfind returns true for read or append, fo contains file data
+* PreCondition:    None
 *
-* Input:           fo           - File to be opened
-*                  fHandle      - Location of file
-*                  type         - WRITE - Create a new file or replace an existing file
-*                                 READ - Read data from an existing file
-*                                 APPEND - Append data to an existing file
-*                  
-* Output:          CE_GOOD             - FILEopen successful
-*                  CE_NOT_INIT         - Card is not yet initialized because of some error
-*                  CE_FILE_NOT_FOUND   - Could not find the file on the card
-*                  CE_BAD_SECTOR_READ  - A bad read occured of a sector  
-*               
+* Input:           dirclus    - First cluster of the directory
+*                  name       - 8.3 name, as padded by FormatFileName
+*
+* Output:          BYTE       - The directory cache slot for the name
 *
 * Side Effects:    None
 *
-* Overview:        Opens a file to perform operations on
+* Overview:        Hash a directory and file name into the directory cache
 *
-* Note:            None
+* Note:            Letters are hashed as upper case, since names are matched
+*                  without regard to case
 *****************************************************************************/
 
-CETYPE FILEopen (FILEOBJ fo, WORD *fHandle, char type)
+BYTE DirCacheSlot (DWORD dirclus, char * name)
 {
-    DISK *  dsk;                //Disk structure
-    BYTE    r;                  //Result of search for file
-    DWORD   l;                  //lba of first sector of first cluster
-    CETYPE  error = CE_GOOD;
+    WORD    h;
+    BYTE    i;
 
-    dsk = (DISK *)(fo->dsk);
-    if (dsk->mount == FALSE)
-        error = CE_NOT_INIT;
-    else
-    {
-        // load the sector
-        fo->dirccls = fo->dirclus;
-        // Cache no matter what if it's the first entry
-        if (*fHandle == 0)
-        {
-            if (Cache_File_Entry(fo, fHandle, TRUE) == NULL)
-            {
+    h = (WORD)dirclus ^ (WORD)(dirclus >> 16);
+    for (i = 0; i < DIR_NAMECOMP; i++)
+        h = (h * 31) + (BYTE)toupper(name[i]);
+
+    return (BYTE)(h % FS_DIR_CACHE_SIZE);
+}
+
+
+/******************************************************************************
+* Function:        BYTE DirCacheFind (FILEOBJ fo, char * name)
+*
+* PreCondition:    fo->dirclus is the directory to look in
+*
+* Input:           fo         - File structure to fill in
+*                  name       - 8.3 name to look for
+*
+* Output:          TRUE       - The entry was cached and fo has been filled in
+*                  FALSE      - The directory has to be searched
+*
+* Side Effects:    None
+*
+* Overview:        Look up a name in the directory cache
+*
+* Note:            Fills in the same fields Fill_File_Object would
+*****************************************************************************/
+
+BYTE DirCacheFind (FILEOBJ fo, char * name)
+{
+    DIRCACHE *  rec;
+    BYTE        i;
+
+    rec = &gDirCache[DirCacheSlot (fo->dirclus, name)];
+
+    if ((rec->name[0] == 0) || (rec->dirclus != fo->dirclus))
+        return FALSE;
+
+    for (i = 0; i < DIR_NAMECOMP; i++)
+    {
+        if (rec->name[i] != (char)toupper(name[i]))
+            return FALSE;
+    }
+
+    for (i = 0; i < DIR_NAMECOMP; i++)
+        fo->name[i] = rec->name[i];
+    fo->entry = rec->entry;
+    fo->cluster = rec->cluster;
+    fo->size = rec->size;
+    fo->time = rec->time;
+    fo->date = rec->date;
+    fo->attributes = rec->attributes;
+    fo->dirccls = fo->dirclus;
+
+    return TRUE;
+}
+
+
+/******************************************************************************
+* Function:        void DirCacheAdd (FILEOBJ fo)
+*
+* PreCondition:    fo was just filled in from its directory entry
+*
+* Input:           fo         - File structure of the entry found
+*
+* Output:          None
+*
+* Side Effects:    Replaces whatever was cached in the same slot
+*
+* Overview:        Remember a directory entry that FILEfind resolved
+*
+* Note:            None
+*****************************************************************************/
+
+void DirCacheAdd (FILEOBJ fo)
+{
+    DIRCACHE *  rec;
+    BYTE        i;
+
+    rec = &gDirCache[DirCacheSlot (fo->dirclus, fo->name)];
+
+    rec->dirclus = fo->dirclus;
+    for (i = 0; i < DIR_NAMECOMP; i++)
+        rec->name[i] = fo->name[i];
+    rec->entry = fo->entry;
+    rec->cluster = fo->cluster;
+    rec->size = fo->size;
+    rec->time = fo->time;
+    rec->date = fo->date;
+    rec->attributes = fo->attributes;
+}
+
+
+/******************************************************************************
+* Function:        void DirCacheForget (DWORD dirclus, WORD entry)
+*
+* PreCondition:    None
+*
+* Input:           dirclus    - First cluster of the directory
+*                  entry      - An entry in the sector that was written
+*
+* Output:          None
+*
+* Side Effects:    None
+*
+* Overview:        Drop the cached entries held in a directory sector that
+*                  is about to be written
+*
+* Note:            A whole sector of entries goes to the media at once, so
+*                  every entry in it is dropped, not only the one asked for
+*****************************************************************************/
+
+void DirCacheForget (DWORD dirclus, WORD entry)
+{
+    BYTE    i;
+
+    for (i = 0; i < FS_DIR_CACHE_SIZE; i++)
+    {
+        if ((gDirCache[i].dirclus == dirclus) &&
+            ((gDirCache[i].entry / (MEDIA_SECTOR_SIZE / sizeof (_DIRENTRY))) ==
+             (entry / (MEDIA_SECTOR_SIZE / sizeof (_DIRENTRY)))))
+        {
+            gDirCache[i].name[0] = 0;
+        }
+    }
+}
+
+
+/******************************************************************************
+* Function:        void DirCacheInvalidate (void)
+*
+* PreCondition:    None
+*
+* Input:           None
+*
+* Output:          None
+*
+* Side Effects:    None
+*
+* Overview:        Empty the directory cache
+*
+* Note:            Used when the media changes and when a directory is
+*                  removed, since its entries are keyed by its cluster
+*****************************************************************************/
+
+void DirCacheInvalidate (void)
+{
+    BYTE    i;
+
+    for (i = 0; i < FS_DIR_CACHE_SIZE; i++)
+        gDirCache[i].name[0] = 0;
+}
+#endif
+
+
+#ifdef SUPPORT_LFN
+/******************************************************************************
+* Function:        BYTE LfnChecksum (char * name)
+*
+* PreCondition:    None
+*
+* Input:           name       - 8.3 name as stored in a directory entry
+*
+* Output:          BYTE       - The checksum of the name
+*
+* Side Effects:    None
+*
+* Overview:        Work out the checksum long name entries carry to tie them
+*                  to their 8.3 entry
+*
+* Note:            None
+*****************************************************************************/
+
+BYTE LfnChecksum (char * name)
+{
+    BYTE    i, sum = 0;
+
+    for (i = 0; i < DIR_NAMECOMP; i++)
+        sum = ((sum & 1) ? 0x80 : 0) + (sum >> 1) + (BYTE)name[i];
+
+    return sum;
+}
+
+
+/******************************************************************************
+* Function:        void LfnCollect (FILEOBJ fo, WORD entry, DIRENTRY dir)
+*
+* PreCondition:    Called by Fill_File_Object for each entry it reads
+*
+* Input:           fo         - File structure of the directory being read
+*                  entry      - Entry number of dir
+*                  dir        - The entry, or NULL past the end
+*
+* Output:          None
+*
+* Side Effects:    Updates gLfnName, gLfnValid and the state used to put
+*                  the long name together
+*
+* Overview:        Put a long file name together from its entries
+*
+* Note:            The entries come in front of their 8.3 entry, last part
+*                  of the name first. gLfnValid is only set on the 8.3 entry
+*                  if every part was read, in order and right before it,
+*                  and the checksum matches its name. Characters past
+*                  0xFF can't be held in a char and are read as '?'.
+*****************************************************************************/
+
+void LfnCollect (FILEOBJ fo, WORD entry, DIRENTRY dir)
+{
+    BYTE *  p = (BYTE *)dir;
+    BYTE    seq, k;
+    WORD    pos, u;
+
+    if ((dir == NULL) || (dir->DIR_Name[0] == DIR_EMPTY) || ((BYTE)dir->DIR_Name[0] == DIR_DEL))
+    {
+        gLfnSeq = LFN_IDLE;
+        gLfnValid = FALSE;
+        return;
+    }
+
+    if (dir->DIR_Attr != ATTR_LONG_NAME)
+    {
+        // An 8.3 entry ends the long name in front of it
+        gLfnValid = (gLfnSeq == 0) && (gLfnEntry == entry) && (gLfnDirclus == fo->dirclus) &&
+                    (gLfnLength <= FS_LFN_MAX_CHARS) && (LfnChecksum ((char *)p) == gLfnChecksum);
+        if (gLfnValid)
+            gLfnName[gLfnLength] = 0;
+        gLfnSeq = LFN_IDLE;
+        return;
+    }
+
+    seq = p[0] & LFN_ORDER_MASK;
+    if (p[0] & LFN_LAST_ENTRY)
+    {
+        // The first entry holds the end of the name and says how many follow
+        gLfnSeq = seq;
+        gLfnChecksum = p[LFN_CHKSUM];
+        gLfnLength = (WORD)seq * LFN_CHARS_PER_ENTRY;
+        gLfnHash = 0;
+        gLfnDirclus = fo->dirclus;
+    }
+    else if ((gLfnSeq == LFN_IDLE) || (gLfnEntry != entry) || (gLfnDirclus != fo->dirclus) ||
+             (p[LFN_CHKSUM] != gLfnChecksum))
+    {
+        // Not part of the name being read
+        gLfnSeq = LFN_IDLE;
+        return;
+    }
+
+    if ((seq == 0) || (seq != gLfnSeq))
+    {
+        gLfnSeq = LFN_IDLE;
+        return;
+    }
+
+    pos = (WORD)(seq - 1) * LFN_CHARS_PER_ENTRY;
+    for (k = 0; k < LFN_CHARS_PER_ENTRY; k++, pos++)
+    {
+        u = p[LfnCharOffset(k)] | ((WORD)p[LfnCharOffset(k) + 1] << 8);
+        // A name that doesn't fill its last entry ends with a null
+        if (u == 0)
+        {
+            gLfnLength = pos;
+            break;
+        }
+        if (u > 0xFF)
+            u = '?';
+        if (pos < FS_LFN_MAX_CHARS)
+            gLfnName[pos] = (char)u;
+        gLfnHash += LfnHashChar (u, pos);
+    }
+
+    gLfnSeq--;
+    gLfnEntry = entry + 1;
+}
+
+
+/******************************************************************************
+* Function:        BYTE LfnSetSearch (const char * fileName)
+*
+* PreCondition:    None
+*
+* Input:           fileName   - A name that is not a valid 8.3 name
+*
+* Output:          TRUE       - The name can be used as a long file name
+*                  FALSE      - The name is too long, has characters that
+*                               aren't allowed in long file names or ends
+*                               in a space or dot
+*
+* Side Effects:    None
+*
+* Overview:        Make a name the long name to look up or create
+*
+* Note:            Windows drops trailing spaces and dots from names, so it
+*                  could not open a file that had them.
+*                  The length and hash are worked out here once so
+*                  FILEfind only has to compare the characters of names
+*                  that already match in both.
+*****************************************************************************/
+
+BYTE LfnSetSearch (const char * fileName)
+{
+    WORD    len, i;
+    char    c;
+
+    gLfnSearchLen = 0;
+
+    len = strlen (fileName);
+    if ((len == 0) || (len > FS_LFN_MAX_CHARS))
+        return FALSE;
+    if ((fileName[len - 1] == ' ') || (fileName[len - 1] == '.'))
+        return FALSE;
+
+    gLfnSearchHash = 0;
+    for (i = 0; i < len; i++)
+    {
+        c = fileName[i];
+        if (((BYTE)c < 0x20) || (c == '"') || (c == '*') || (c == '/') ||
+            (c == ':') || (c == '<') || (c == '>') || (c == '?') ||
+            (c == '\\') || (c == '|'))
+            return FALSE;
+        gLfnSearch[i] = c;
+        gLfnSearchHash += LfnHashChar (c, i);
+    }
+    gLfnSearch[len] = 0;
+    gLfnSearchLen = len;
+
+    return TRUE;
+}
+
+
+/******************************************************************************
+* Function:        BYTE LfnMatch (void)
+*
+* PreCondition:    gLfnValid set and the lengths and hashes of gLfnName and
+*                  gLfnSearch are the same
+*
+* Input:           None
+*
+* Output:          TRUE       - The long name read is the one looked for
+*                  FALSE      - It is not
+*
+* Side Effects:    None
+*
+* Overview:        Compare the long name read with the one looked for
+*
+* Note:            Names match without regard to case
+*****************************************************************************/
+
+BYTE LfnMatch (void)
+{
+    WORD    i;
+
+    for (i = 0; i < gLfnSearchLen; i++)
+    {
+        if (tolower ((BYTE)gLfnName[i]) != tolower ((BYTE)gLfnSearch[i]))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+#ifdef ALLOW_WRITES
+/******************************************************************************
+* Function:        char LfnShortChar (char c)
+*
+* PreCondition:    None
+*
+* Input:           c          - A character of a long file name
+*
+* Output:          char       - The character to use in the 8.3 alias, or 0
+*                               if it is left out
+*
+* Side Effects:    None
+*
+* Overview:        Map a long name character to an 8.3 name character
+*
+* Note:            Spaces and dots are left out, lower case letters become
+*                  upper case and anything not allowed in 8.3 names '_'
+*****************************************************************************/
+
+char LfnShortChar (char c)
+{
+    if ((c == ' ') || (c == '.'))
+        return 0;
+
+    switch (isShort (c, 0))
+    {
+        case 0:
+            return c;
+        case 1:
+            return toupper (c);
+        default:
+            return '_';
+    }
+}
+
+
+/******************************************************************************
+* Function:        BYTE LfnMakeAlias (FILEOBJ fo, char * alias)
+*
+* PreCondition:    gLfnSearch holds the long name, fo->dirclus is the
+*                  directory it will go in
+*
+* Input:           fo         - File structure of the new entry
+*                  alias      - Where to put the 11 character 8.3 name
+*
+* Output:          TRUE       - alias holds a name no other entry uses
+*                  FALSE      - Every ~N tail is in use
+*
+* Side Effects:    None
+*
+* Overview:        Make the 8.3 alias that goes with a long file name
+*
+* Note:            The alias is the upper case name without spaces and
+*                  dots, cut short to make room for a ~N tail, plus the
+*                  first three characters of the extension. Characters not
+*                  allowed in 8.3 names become '_'. The tails already used
+*                  are found in one pass over the directory and the lowest
+*                  free one is taken.
+*****************************************************************************/
+
+BYTE LfnMakeAlias (FILEOBJ fo, char * alias)
+{
+    char        basis[DIR_NAMECOMP];
+    BYTE        used[LFN_TAIL_MAP / 8];
+    BYTE        baselen, i, t, digits;
+    WORD        j, dot, fHandle = 0;
+    DWORD       n, scale, maxTail = 0;
+    char        c;
+    DIRENTRY    dir;
+
+    // The extension starts after the last dot, unless that is the first character
+    for (dot = gLfnSearchLen; (dot != 0) && (gLfnSearch[dot] != '.'); dot--);
+    if (dot == 0)
+        dot = gLfnSearchLen;
+
+    memset (basis, ' ', DIR_NAMECOMP);
+    for (i = 0, j = 0; (j < dot) && (i < DIR_NAMESIZE); j++)
+    {
+        if ((c = LfnShortChar (gLfnSearch[j])) != 0)
+            basis[i++] = c;
+    }
+    if (i == 0)
+        basis[i++] = '_';
+    baselen = i;
+    for (i = DIR_NAMESIZE, j = dot + 1; (j < gLfnSearchLen) && (i < DIR_NAMECOMP); j++)
+    {
+        if ((c = LfnShortChar (gLfnSearch[j])) != 0)
+            basis[i++] = c;
+    }
+
+    // Find the tails in use with this basis and extension
+    memset (used, 0, sizeof (used));
+    fo->dirccls = fo->dirclus;
+    dir = Cache_File_Entry (fo, &fHandle, TRUE);
+    while (1)
+    {
+        // The end of the root or of the cluster chain ends the directory too
+        if ((dir == NULL) || (dir->DIR_Name[0] == DIR_EMPTY))
+            break;
+
+        if (((BYTE)dir->DIR_Name[0] != DIR_DEL) && (dir->DIR_Attr != ATTR_LONG_NAME) &&
+            !memcmp (dir->DIR_Extension, &basis[DIR_NAMESIZE], DIR_EXTENSION))
+        {
+            for (t = 1; (t < DIR_NAMESIZE) && (dir->DIR_Name[t] != '~'); t++);
+            for (i = t + 1, n = 0; (i < DIR_NAMESIZE) && (dir->DIR_Name[i] >= '0') && (dir->DIR_Name[i] <= '9'); i++)
+                n = (n * 10) + (dir->DIR_Name[i] - '0');
+            digits = i - t - 1;
+            for (j = i; (j < DIR_NAMESIZE) && (dir->DIR_Name[j] == ' '); j++);
+
+            if ((t < DIR_NAMESIZE) && (digits != 0) && (j == DIR_NAMESIZE) &&
+                (t == ((baselen < 7 - digits) ? baselen : 7 - digits)) &&
+                !memcmp (dir->DIR_Name, basis, t))
+            {
+                if (n < LFN_TAIL_MAP)
+                    used[n >> 3] |= 1 << (n & 7);
+                if (n > maxTail)
+                    maxTail = n;
+            }
+        }
+
+        fHandle++;
+        dir = Cache_File_Entry (fo, &fHandle, FALSE);
+    }
+
+    // Take the lowest free tail, or one past the highest in use
+    for (n = 1; (n < LFN_TAIL_MAP) && (used[n >> 3] & (1 << (n & 7))); n++);
+    if (n == LFN_TAIL_MAP)
+        n = maxTail + 1;
+    if (n > LFN_MAX_TAIL)
+        return FALSE;
+
+    for (digits = 1, scale = 10; n >= scale; digits++, scale *= 10);
+    t = (baselen < 7 - digits) ? baselen : 7 - digits;
+
+    memcpy (alias, basis, DIR_NAMECOMP);
+    memset (&alias[t], ' ', DIR_NAMESIZE - t);
+    alias[t] = '~';
+    for (i = t + digits; i > t; i--, n /= 10)
+        alias[i] = '0' + (n % 10);
+
+    return TRUE;
+}
+
+
+/******************************************************************************
+* Function:        BYTE LfnWriteEntries (FILEOBJ fo, char * alias,
+*                                        WORD fHandle, BYTE count)
+*
+* PreCondition:    FindEmptyEntries found count free entries at fHandle
+*
+* Input:           fo         - File structure of the new entry
+*                  alias      - The 8.3 name the long name goes with
+*                  fHandle    - First of the entries to write
+*                  count      - Number of long name entries
+*
+* Output:          TRUE       - The entries were written
+*                  FALSE      - A sector could not be read or written
+*
+* Side Effects:    None
+*
+* Overview:        Write the long name in gLfnSearch into the entries in
+*                  front of its 8.3 entry
+*
+* Note:            Each sector is written once, after all of its entries
+*                  have been filled in
+*****************************************************************************/
+
+BYTE LfnWriteEntries (FILEOBJ fo, char * alias, WORD fHandle, BYTE count)
+{
+    DIRENTRY    dir;
+    BYTE *      p;
+    BYTE        sum, seq, k;
+    WORD        pos, u;
+
+    sum = LfnChecksum (alias);
+
+    fo->dirccls = fo->dirclus;
+    if ((dir = Cache_File_Entry (fo, &fHandle, TRUE)) == NULL)
+        return FALSE;
+
+    for (seq = count; seq != 0; seq--)
+    {
+        p = (BYTE *)dir;
+        memset (p, 0, DIR_ESIZE);
+
+        p[0] = (seq == count) ? (seq | LFN_LAST_ENTRY) : seq;
+        p[DIR_ATTRIB] = ATTR_LONG_NAME;
+        p[LFN_CHKSUM] = sum;
+
+        // The name is ended with a null and padded with 0xFFFF
+        pos = (WORD)(seq - 1) * LFN_CHARS_PER_ENTRY;
+        for (k = 0; k < LFN_CHARS_PER_ENTRY; k++, pos++)
+        {
+            if (pos < gLfnSearchLen)
+                u = (BYTE)gLfnSearch[pos];
+            else if (pos == gLfnSearchLen)
+                u = 0;
+            else
+                u = 0xFFFF;
+            p[LfnCharOffset(k)] = (BYTE)u;
+            p[LfnCharOffset(k) + 1] = (BYTE)(u >> 8);
+        }
+
+        if ((seq == 1) || (DIRENTRY_INDEX (fo->dsk, fHandle) == DIRENTRIES_PER_SECTOR (fo->dsk) - 1))
+        {
+            if (!Write_File_Entry (fo, &fHandle))
+                return FALSE;
+        }
+
+        fHandle++;
+        if (seq != 1)
+        {
+            if (DIRENTRY_INDEX (fo->dsk, fHandle) == 0)
+            {
+                if ((dir = Cache_File_Entry (fo, &fHandle, FALSE)) == NULL)
+                    return FALSE;
+            }
+            else
+                dir++;
+        }
+    }
+
+    return TRUE;
+}
+
+
+/******************************************************************************
+* Function:        BYTE LfnErase (FILEOBJ fo, WORD entry, BYTE checksum)
+*
+* PreCondition:    The 8.3 entry at entry has been handled
+*
+* Input:           fo         - File structure of the directory
+*                  entry      - Entry number of the 8.3 entry
+*                  checksum   - LfnChecksum of its name
+*
+* Output:          TRUE       - Done
+*                  FALSE      - A sector could not be read or written
+*
+* Side Effects:    None
+*
+* Overview:        Mark the long name entries in front of an 8.3 entry
+*                  deleted
+*
+* Note:            Walks back while the entries carry the checksum, so an
+*                  8.3 entry without a long name costs one sector read.
+*                  The sector of the 8.3 entry is in the buffer afterwards,
+*                  as it was before, since callers such as FSrmdir carry on
+*                  through the directory from there.
+*****************************************************************************/
+
+BYTE LfnErase (FILEOBJ fo, WORD entry, BYTE checksum)
+{
+    DIRENTRY    dir;
+    WORD        fHandle = entry, last = 0;
+    BYTE        loaded = FALSE, dirty = FALSE;
+
+    while (fHandle != 0)
+    {
+        fHandle--;
+
+        if (!loaded || (DIRENTRY_INDEX (fo->dsk, fHandle) == DIRENTRIES_PER_SECTOR (fo->dsk) - 1))
+        {
+            // Write the sector we are leaving before reading the one in front
+            if (dirty)
+            {
+                if (!Write_File_Entry (fo, &last))
+                    return FALSE;
+                dirty = FALSE;
+            }
+            fo->dirccls = fo->dirclus;
+            if ((dir = Cache_File_Entry (fo, &fHandle, TRUE)) == NULL)
+                return FALSE;
+            loaded = TRUE;
+        }
+        else
+            dir = (DIRENTRY)fo->dsk->buffer + DIRENTRY_INDEX (fo->dsk, fHandle);
+
+        if ((dir->DIR_Attr != ATTR_LONG_NAME) || ((BYTE)dir->DIR_Name[0] == DIR_DEL) ||
+            (((BYTE *)dir)[LFN_CHKSUM] != checksum))
+            break;
+
+        dir->DIR_Name[0] = DIR_DEL;
+        dirty = TRUE;
+        last = fHandle;
+    }
+
+    if (dirty)
+        if (!Write_File_Entry (fo, &last))
+            return FALSE;
+
+    // Load the 8.3 entry's sector again if the walk left another one
+    if (loaded && (DIRENTRY_SECTOR (fo->dsk, fHandle) != DIRENTRY_SECTOR (fo->dsk, entry)))
+    {
+        fo->dirccls = fo->dirclus;
+        if (Cache_File_Entry (fo, &entry, TRUE) == NULL)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+#endif
+#endif
+
+
+
+/******************************************************************************
+* Function:        CETYPE FILEopen (FILEOBJ fo, WORD *fHandle, char type)
+*
+* PreCondition:    FILEfind returns true for read or append, fo contains file data
+*
+* Input:           fo           - File to be opened
+*                  fHandle      - Location of file
+*                  type         - WRITE - Create a new file or replace an existing file
+*                                 READ - Read data from an existing file
+*                                 APPEND - Append data to an existing file
+*                  
+* Output:          CE_GOOD             - FILEopen successful
+*                  CE_NOT_INIT         - Card is not yet initialized because of some error
+*                  CE_FILE_NOT_FOUND   - Could not find the file on the card
+*                  CE_BAD_SECTOR_READ  - A bad read occured of a sector  
+*               
+*
+* Side Effects:    None
+*
+* Overview:        Opens a file to perform operations on
+*
+* Note:            None
+*****************************************************************************/
+
+CETYPE FILEopen (FILEOBJ fo, WORD *fHandle, char type)
+{
+    DISK *  dsk;                //Disk structure
+    BYTE    r;                  //Result of search for file
+    DWORD   l;                  //lba of first sector of first cluster
+    CETYPE  error = CE_GOOD;
+
+    dsk = (DISK *)(fo->dsk);
+    if (dsk->mount == FALSE)
+        error = CE_NOT_INIT;
+    else
+    {
+        // load the sector
+        fo->dirccls = fo->dirclus;
+        // Cache no matter what if it's the first entry
+        if (*fHandle == 0)
+        {
+            if (Cache_File_Entry(fo, fHandle, TRUE) == NULL)
+            {
                 error = CE_BADCACHEREAD;
             }
         }
@@ -560,7 +1851,7 @@ CETYPE FILEopen (FILEOBJ fo, WORD *fHandle, char type)
             // If it's not the first, only cache it if it's
             // not divisible by the number of entries per sector
             // If it is, Fill_File_Object will cache it
-            if ((*fHandle & 0xf) != 0)
+            if (DIRENTRY_INDEX (dsk, *fHandle) != 0)
             {
                 if (Cache_File_Entry (fo, fHandle, TRUE) == NULL)
                 {
@@ -579,6 +1870,12 @@ CETYPE FILEopen (FILEOBJ fo, WORD *fHandle, char type)
             fo->ccls = fo->cluster;     // first cluster
             fo->sec = 0;                // first sector in the cluster
             fo->pos = 0;                // first byte in sector/cluster
+#ifdef FS_EXTENT_MAP_SIZE
+            fo->extCount = 0;           // the chain is not mapped yet
+#endif
+#ifdef FS_READ_AHEAD_SECTORS
+            fo->seqreads = 0;           // nothing read in order yet
+#endif
 
             if  ( r == NOT_FOUND)
             {
@@ -588,22 +1885,35 @@ CETYPE FILEopen (FILEOBJ fo, WORD *fHandle, char type)
             {   
                 // Determine the lba of the selected sector and load 
                 l = Cluster2Sector(dsk,fo->ccls);
+#ifdef FS_FILE_BUFFERS
+                // Nothing is in the file's own buffer yet
+                fo->bufsec = 0xFFFFFFFF;
+                fo->bufdirty = FALSE;
+#else
 #ifdef ALLOW_WRITES
                 if (gNeedDataWrite)
                     if (flushData())
                         return EOF;
 #endif
                 gBufferOwner = fo;
-                if (gLastDataSectorRead != l)
+                gDirSectorRead = 0xFFFFFFFF;
+#endif
+#ifdef FS_FILE_BUFFERS
+                // Objects that are not streams (FindFirst) have no buffer
+                if ((fo->buffer != NULL) && (FileBufferSector(fo) != l))
+#else
+                if (FileBufferSector(fo) != l)
+#endif
                 {
                     gBufferZeroed = FALSE;
-                    if ( !SectorRead( l, dsk->buffer))
+                    if ( !SectorRead( l, FileBuffer(fo)))
                         error = CE_BAD_SECTOR_READ;                         
-                    gLastDataSectorRead = l;
+                    FileBufferSector(fo) = l;
                 }
             } // -- found
 
             fo->flags.FileWriteEOF = FALSE;
+            fo->flags.reserved = FALSE;
             // Set flag for operation type
 #ifdef ALLOW_WRITES
             if (type == 'w' || type == 'a')
@@ -624,7 +1934,7 @@ CETYPE FILEopen (FILEOBJ fo, WORD *fHandle, char type)
 
 
 /******************************************************************************
-* Function:        BYTE FILEget_next_cluster(FILEOBJ fo, WORD n)
+* Function:        BYTE FILEget_next_cluster(FILEOBJ fo, DWORD n)
 *
 * PreCondition:    Disk mounted, fo contains valid file data
 *
@@ -642,12 +1952,13 @@ CETYPE FILEopen (FILEOBJ fo, WORD *fHandle, char type)
 *
 * Overview:        Steps through a chain of clusters
 *
-* Note:            None
+* Note:            Links the extent map already knows are followed without
+*                  reading the FAT, and new ones are added to it
 *****************************************************************************/
 
-BYTE FILEget_next_cluster(FILEOBJ fo, WORD n)
+BYTE FILEget_next_cluster(FILEOBJ fo, DWORD n)
 {
-    WORD        c, c2;
+    DWORD       c, c2;
     BYTE        error = CE_GOOD;
     DISK *      disk;
 
@@ -656,6 +1967,15 @@ BYTE FILEget_next_cluster(FILEOBJ fo, WORD n)
     // loop n times
     do 
     {
+    #ifdef FS_EXTENT_MAP_SIZE
+        // inside a known run the next cluster is simply the following one
+        if ((c = ExtentMapNext (fo, fo->ccls)) != 0)
+        {
+            fo->ccls = c;
+            continue;
+        }
+    #endif
+
         // get the next cluster link from FAT
         c2 = fo->ccls;
         if ( (c = ReadFAT( disk, c2)) == CLUSTER_FAIL)
@@ -669,7 +1989,9 @@ BYTE FILEget_next_cluster(FILEOBJ fo, WORD n)
             }
 
             // compare against max value of a cluster in FAT
-            if (disk->type == FAT16)
+            if (disk->type == FAT32)
+                c2 = LAST_CLUSTER_FAT32;
+            else if (disk->type == FAT16)
                 c2 = LAST_CLUSTER_FAT16;
             else if (disk->type == FAT12)
                 c2 = LAST_CLUSTER_FAT12;     
@@ -681,6 +2003,11 @@ BYTE FILEget_next_cluster(FILEOBJ fo, WORD n)
             }
         }
 
+    #ifdef FS_EXTENT_MAP_SIZE
+        if (error == CE_GOOD)
+            ExtentMapAdd (fo, fo->ccls, c);
+    #endif
+
         // update the FSFILE structure
         fo->ccls = c;
 
@@ -689,19 +2016,193 @@ BYTE FILEget_next_cluster(FILEOBJ fo, WORD n)
     return(error);
 } // get next cluster
 
+
+/******************************************************************************
+* Function:        BYTE FILEseek_cluster(FILEOBJ fo, DWORD n)
+*
+* PreCondition:    Disk mounted, fo contains valid file data
+*
+* Input:           fo         - Pointer to file structure
+*                  n          - Clusters to move past the first one
+*
+* Output:          CE_GOOD            - fo->ccls is the cluster asked for
+*                  CE_BAD_SECTOR_READ - A read failed
+*                  CE_INVALID_CLUSTER - Invalid cluster value
+*                  CE_FAT_EOF         - Fat attempt to read beyond EOF
+*
+* Side Effects:    None
+*
+* Overview:        Point fo->ccls at the nth cluster after the first cluster
+*                  of the file
+*
+* Note:            When the extent map already covers the cluster it is
+*                  worked out without reading the FAT; otherwise the chain
+*                  is followed from the last cluster the map knows
+*****************************************************************************/
+
+BYTE FILEseek_cluster(FILEOBJ fo, DWORD n)
+{
+#ifdef FS_EXTENT_MAP_SIZE
+    BYTE    i;
+    DWORD   idx = 0;
+#endif
+
+    fo->ccls = fo->cluster;
+    if (n == 0)
+        return CE_GOOD;
+
+#ifdef FS_EXTENT_MAP_SIZE
+    ExtentMapCheck (fo);
+
+    for (i = 0; i < fo->extCount; i++)
+    {
+        if (n < idx + fo->extLength[i])
+        {
+            fo->ccls = fo->extStart[i] + (n - idx);
+            return CE_GOOD;
+        }
+        idx += fo->extLength[i];
+    }
+
+    // Walk on from the last cluster the map knows about
+    if (idx != 0)
+    {
+        fo->ccls = fo->extStart[i - 1] + fo->extLength[i - 1] - 1;
+        n -= idx - 1;
+    }
+#endif
+
+    return FILEget_next_cluster (fo, n);
+}
+
+
+#ifdef FS_EXTENT_MAP_SIZE
+/******************************************************************************
+* Function:        void ExtentMapCheck (FILEOBJ fo)
+*
+* PreCondition:    fo contains valid file data
+*
+* Input:           fo         - Pointer to file structure
+*
+* Output:          None
+*
+* Side Effects:    None
+*
+* Overview:        Start the extent map of a file with its first cluster if
+*                  the map is empty or was made for another chain
+*
+* Note:            The map always describes the chain from its start, as
+*                  runs of clusters that follow each other on the disk
+*****************************************************************************/
+
+void ExtentMapCheck (FILEOBJ fo)
+{
+    if ((fo->extCount == 0) || (fo->extCount > FS_EXTENT_MAP_SIZE) || (fo->extStart[0] != fo->cluster))
+    {
+        fo->extCount = 0;
+        if (fo->cluster >= 2)
+        {
+            fo->extStart[0] = fo->cluster;
+            fo->extLength[0] = 1;
+            fo->extCount = 1;
+        }
+    }
+}
+
+
+/******************************************************************************
+* Function:        DWORD ExtentMapNext (FILEOBJ fo, DWORD ccls)
+*
+* PreCondition:    fo contains valid file data
+*
+* Input:           fo         - Pointer to file structure
+*                  ccls       - A cluster of the file
+*
+* Output:          DWORD      - The cluster after ccls, or 0 if the map
+*                               does not know it
+*
+* Side Effects:    None
+*
+* Overview:        Find the next cluster in the chain from the extent map
+*
+* Note:            None
+*****************************************************************************/
+
+DWORD ExtentMapNext (FILEOBJ fo, DWORD ccls)
+{
+    BYTE    i;
+
+    ExtentMapCheck (fo);
+
+    for (i = 0; i < fo->extCount; i++)
+    {
+        if ((ccls >= fo->extStart[i]) && (ccls - fo->extStart[i] + 1 < fo->extLength[i]))
+            return ccls + 1;
+    }
+
+    return 0;
+}
+
+
+/******************************************************************************
+* Function:        void ExtentMapAdd (FILEOBJ fo, DWORD ccls, DWORD next)
+*
+* PreCondition:    fo contains valid file data
+*
+* Input:           fo         - Pointer to file structure
+*                  ccls       - A cluster of the file
+*                  next       - The cluster that follows it in the chain
+*
+* Output:          None
+*
+* Side Effects:    None
+*
+* Overview:        Record a link of the chain in the extent map
+*
+* Note:            Only a link from the last cluster the map knows extends
+*                  it. Once every run is used the map stops growing and
+*                  the rest of the chain is read from the FAT.
+*****************************************************************************/
+
+void ExtentMapAdd (FILEOBJ fo, DWORD ccls, DWORD next)
+{
+    BYTE    r;
+
+    ExtentMapCheck (fo);
+
+    if ((fo->extCount == 0) || (next < 2) || (next >= fo->dsk->maxcls))
+        return;
+
+    r = fo->extCount - 1;
+    if (ccls != fo->extStart[r] + fo->extLength[r] - 1)
+        return;
+
+    if (next == ccls + 1)
+        fo->extLength[r]++;
+    else if (fo->extCount < FS_EXTENT_MAP_SIZE)
+    {
+        fo->extStart[fo->extCount] = next;
+        fo->extLength[fo->extCount] = 1;
+        fo->extCount++;
+    }
+}
+#endif
+
 /******************************************************************************
  * Function:        BYTE DISKmount ( DISK *dsk)
  *
- * PreCondition:    Called from FSInit()
+ * PreCondition:    Called from FSmount() with the disk's media unit selected
  *
  * Input:           dsk		- The disk to be mounted
  *
  * Output:          CE_GOOD 		- Disk mounted
  *					CE_INIT_ERROR	- Initialization error has occured
+ *                  CE_UNSUPPORTED_SECTOR_SIZE - The media's sectors don't
+ *                                    fit in the sector buffers
  *
  * Side Effects:    None
  *
- * Overview:        Will mount only the first partition on the disk/card
+ * Overview:        Will mount the partition dsk->partition of the disk/card
  *
  * Note:            None
  *****************************************************************************/
@@ -719,7 +2220,7 @@ BYTE DISKmount( DISK *dsk)
     {
         error = CE_INIT_ERROR;
     }
-    else
+    else if ((error = LoadSectorSize (dsk)) == CE_GOOD)
     {
         // Load the Master Boot Record (partition)
         if((error = LoadMBR(dsk)) == CE_GOOD)
@@ -734,6 +2235,42 @@ BYTE DISKmount( DISK *dsk)
     return(error);
 } // -- mount
 
+/******************************************************************************
+ * Function:        BYTE LoadSectorSize (DISK *dsk)
+ *
+ * PreCondition:    The media unit of dsk is selected and initialized
+ *
+ * Input:           dsk     - The disk about to be mounted or formatted
+ *
+ * Output:          CE_GOOD                     - dsk->sectorSize is set
+ *                  CE_UNSUPPORTED_SECTOR_SIZE  - The sector size isn't a
+ *                                  power of 2 from 512 to MEDIA_SECTOR_SIZE
+ *
+ * Side Effects:    None
+ *
+ * Overview:        Asks the media layer for the size of its sectors (512 or
+ *                  4096 bytes on most media) and keeps it, with its log2,
+ *                  in the disk structure.  Every sector offset of the volume
+ *                  is counted in these.
+ *
+ * Note:            MEDIA_SECTOR_SIZE is the size of the sector buffers, so
+ *                  the largest sector size that can be used.
+ *****************************************************************************/
+
+BYTE LoadSectorSize (DISK *dsk)
+{
+    WORD    size = MediaSectorSize();
+
+    if ((size < 512) || (size > MEDIA_SECTOR_SIZE) || ((size & (size - 1)) != 0))
+        return CE_UNSUPPORTED_SECTOR_SIZE;
+
+    dsk->sectorSize = size;
+    for (dsk->sectorShift = 9; size > 512; size >>= 1)
+        dsk->sectorShift++;
+
+    return CE_GOOD;
+}
+
 /******************************************************************************
  * Function:        CETYPE LoadMBR ( DISK *dsk)
  *
@@ -755,6 +2292,7 @@ BYTE DISKmount( DISK *dsk)
 BYTE LoadMBR(DISK *dsk)
 {
     PT_MBR  Partition;
+    PTE_MBR * Entry;
     BYTE error = CE_GOOD;
     BYTE type;
     BootSec BSec;
@@ -786,15 +2324,43 @@ BYTE LoadMBR(DISK *dsk)
                 BSec->FAT.FAT_16.BootSec_BootSig == 0x29)
 #endif
             {
+                // A FAT12/16 boot sector; there is no partition table to read
                 dsk->firsts = 0;
                 dsk->type = FAT16;
+                if (dsk->partition != 0)
+                    error = CE_BAD_PARTITION;
+                return(error);
+            }
+        #ifdef SUPPORT_FAT32
+            // A FAT32 boot sector keeps its type string further in
+        #ifdef USE_PIC24
+            if (ReadByte( dsk->buffer, BSI_FAT32_FSTYPE ) == 'F' && \
+                ReadByte( dsk->buffer, BSI_FAT32_FSTYPE + 1 ) == 'A' && \
+                ReadByte( dsk->buffer, BSI_FAT32_FSTYPE + 2 ) == 'T' && \
+                ReadByte( dsk->buffer, BSI_FAT32_FSTYPE + 3 ) == '3' && \
+                ReadByte( dsk->buffer, BSI_FAT32_BOOTSIG) == 0x29)
+        #else
+            if (BSec->FAT.FAT_32.BootSec_FSType[0] == 'F' && \
+                BSec->FAT.FAT_32.BootSec_FSType[1] == 'A' && \
+                BSec->FAT.FAT_32.BootSec_FSType[2] == 'T' && \
+                BSec->FAT.FAT_32.BootSec_FSType[3] == '3' && \
+                BSec->FAT.FAT_32.BootSec_BootSig == 0x29)
+        #endif
+            {
+                dsk->firsts = 0;
+                dsk->type = FAT32;
+                if (dsk->partition != 0)
+                    error = CE_BAD_PARTITION;
+                return(error);
             }
+        #endif
         }
         // assign it the partition table strucutre
         Partition = (PT_MBR)dsk->buffer;
         
         // Ensure its good
-        if((Partition->Signature0 != FAT_GOOD_SIGN_0) || (Partition->Signature1 != FAT_GOOD_SIGN_1))
+        if((Partition->Signature0 != FAT_GOOD_SIGN_0) || (Partition->Signature1 != FAT_GOOD_SIGN_1) ||
+            (dsk->partition > 3))
         {
             error = CE_BAD_PARTITION;
         }
@@ -802,11 +2368,12 @@ BYTE LoadMBR(DISK *dsk)
         {    
             /*    Valid Master Boot Record Loaded   */
             
-            // Get the 32 bit offset to the first partition 
-            dsk->firsts = Partition->Partition0.PTE_FrstSect; 
+            // Get the 32 bit offset to the partition asked for
+            Entry = &Partition->Partition0 + dsk->partition;
+            dsk->firsts = Entry->PTE_FrstSect; 
             
             // check if the partition type is acceptable
-            type = Partition->Partition0.PTE_FSDesc;
+            type = Entry->PTE_FSDesc;
         
             switch (type)
             {
@@ -822,8 +2389,11 @@ BYTE LoadMBR(DISK *dsk)
 
                 case 0x0B:
                 case 0x0C:
-                    dsk->type = FAT32; // and error out				
+                    dsk->type = FAT32;
+                #ifndef SUPPORT_FAT32
+                    // and error out
                     error = CE_CARDFAT32;
+                #endif
                     break;
 
                 default:
@@ -847,13 +2417,14 @@ BYTE LoadMBR(DISK *dsk)
  *                  CE_BAD_SECTOR_READ	- A bad read occured of a sector 
  *					CE_NOT_FORMATTED	- The disk is of an unsupported format
  *					CE_CARDFAT12		- FAT12 during intial testing we are not supporting FAT12
- *					CE_CARDFAT32		- FAT 32 - card not supported
+ *					CE_CARDFAT32		- FAT 32 - card not supported (SUPPORT_FAT32 not defined)
  *
  * Side Effects:    None
  *
  * Overview:        Load the boot sector information and extract the necessary information
  *
- * Note:            None
+ * Note:            On FAT32 volumes the FSInfo sector is read as well to pick
+ *                  up the free cluster count and the next free cluster hint
  *****************************************************************************/
 
 
@@ -865,6 +2436,13 @@ BYTE LoadBootSector(DISK *dsk)
     BYTE        error = CE_GOOD;
     BootSec     BSec;        // boot sector, assume its FAT16 til we know better
     WORD   BytesPerSec;
+    WORD   ReservedSec;
+    WORD   FSInfoSec = 0;
+
+    dsk->rootcls = 0;
+    dsk->fsinfo = 0;
+    dsk->freecls = FSINFO_UNKNOWN;
+    dsk->nextfree = 2;
 
     // Get the Boot sector
     if ( SectorRead( dsk->firsts, dsk->buffer) != TRUE) 
@@ -882,10 +2460,15 @@ BYTE LoadBootSector(DISK *dsk)
         else
         {     
             // determine the number of sectors in one FAT
+            // FAT32 leaves the 16-bit field at 0 and uses a 32-bit one
             #ifdef USE_PIC18
                 dsk->fatsize = BSec->FAT.FAT_16.BootSec_SPF;  
+                if (dsk->fatsize == 0)
+                    dsk->fatsize = BSec->FAT.FAT_32.BootSec_FATSz32;
             #else
                 dsk->fatsize = ReadWord( dsk->buffer, BSI_SPF ); 
+                if (dsk->fatsize == 0)
+                    dsk->fatsize = ReadDWord( dsk->buffer, BSI_FATSZ32 );
             #endif
     
             // Figure out the total number of sectors
@@ -912,7 +2495,8 @@ BYTE LoadBootSector(DISK *dsk)
     
                 // determine fat, root and data lbas
                 // FAT = first sector in partition (boot record) + reserved records
-                dsk->fat        = dsk->firsts + BSec->FAT.FAT_16.BootSec_ResrvSec;
+                ReservedSec     = BSec->FAT.FAT_16.BootSec_ResrvSec;
+                dsk->fat        = dsk->firsts + ReservedSec;
                 
                 // fatcopy is the number of FAT tables 
                 dsk->fatcopy    = BSec->FAT.FAT_16.BootSec_FATCount;
@@ -930,13 +2514,17 @@ BYTE LoadBootSector(DISK *dsk)
                 
                 RootDirSectors = ((BSec->FAT.FAT_16.BootSec_RootDirEnts * 32) + (BSec->FAT.FAT_16.BootSec_BPS - 1)) / BSec->FAT.FAT_16.BootSec_BPS;                    
     
+                // FAT32 only, read them before the buffer is reused
+                dsk->rootcls    = BSec->FAT.FAT_32.BootSec_RootClus;
+                FSInfoSec       = BSec->FAT.FAT_32.BootSec_FSInfo;
             #else
     
                 dsk->SecPerClus = ReadByte( dsk->buffer, BSI_SPC );
                 
                 // determine fat, root and data lbas
                 // FAT = first sector in partition (boot record) + reserved records
-                dsk->fat        = dsk->firsts + ReadWord( dsk->buffer, BSI_RESRVSEC );
+                ReservedSec     = ReadWord( dsk->buffer, BSI_RESRVSEC );
+                dsk->fat        = dsk->firsts + ReservedSec;
                 
                 // fatcopy is the number of FAT tables 
                 dsk->fatcopy    = ReadByte( dsk->buffer, BSI_FATCOUNT );
@@ -953,11 +2541,19 @@ BYTE LoadBootSector(DISK *dsk)
                     return( CE_NOT_FORMATTED );
                 
                 RootDirSectors = ((dsk->maxroot * 32) + (BytesPerSec - 1)) / BytesPerSec;               
+
+                // FAT32 only
+                dsk->rootcls    = ReadDWord( dsk->buffer, BSI_ROOTCLUS );
+                FSInfoSec       = ReadWord( dsk->buffer, BSI_FSINFO );
             #endif
     
+            if (dsk->SecPerClus == 0)
+                return( CE_NOT_FORMATTED );
+
             // figure out how many data sectors there are
-            DataSec = TotSec - (dsk->root + RootDirSectors) + dsk->firsts + 2;
+            DataSec = TotSec - (ReservedSec + (dsk->fatcopy * dsk->fatsize) + RootDirSectors);
             
+            // The count of data clusters decides the FAT type
             dsk->maxcls = DataSec / dsk->SecPerClus;
             
             // Calculate FAT type
@@ -974,21 +2570,58 @@ BYTE LoadBootSector(DISK *dsk)
                     dsk->type = FAT16;
                 }
                 else
+                {
                     /* Volume is FAT32 */
-                    // We don't support FAT32
+                    dsk->type = FAT32;
+                #ifndef SUPPORT_FAT32
                     error = CE_CARDFAT32;     
+                #endif
+                }
             }
+
+            // Data clusters are numbered from 2
+            dsk->maxcls += 2;
     
-            // DATA = ROOT + (MAXIMUM ROOT *32 / 512) 
-            dsk->data = dsk->root + ( dsk->maxroot >> 4); // assuming maxroot % 16 == 0
+            // DATA = ROOT + (MAXIMUM ROOT *32 / BYTES PER SECTOR), rounded up
+            dsk->data = dsk->root + RootDirSectors;
+
+            if (dsk->type == FAT32)
+            {
+                // The root directory is a cluster chain like any other
+                if ((dsk->rootcls < 2) || (dsk->rootcls >= dsk->maxcls))
+                    return( CE_NOT_FORMATTED );
+                dsk->root = Cluster2Sector (dsk, dsk->rootcls);
+            }
+            else
+                dsk->rootcls = 0;
     
-            // make sure that we can read in a complete sector
+            // the volume's sectors must be the media's sectors
             #ifdef USE_PIC18
-                if(BSec->FAT.FAT_16.BootSec_BPS != MEDIA_SECTOR_SIZE)
+                if(BSec->FAT.FAT_16.BootSec_BPS != dsk->sectorSize)
             #else
-                if(BytesPerSec != MEDIA_SECTOR_SIZE)
+                if(BytesPerSec != dsk->sectorSize)
             #endif
             error = CE_NOT_FORMATTED;
+
+        #ifdef SUPPORT_FAT32
+            // Pick up the free space hints from the FSInfo sector
+            if ((error == CE_GOOD) && (dsk->type == FAT32) && (FSInfoSec != 0) && (FSInfoSec != 0xFFFF))
+            {
+                if (SectorRead (dsk->firsts + FSInfoSec, dsk->buffer) != TRUE)
+                    error = CE_BAD_SECTOR_READ;
+                else if ((RAMreadD (dsk->buffer, FSI_LEADSIG) == FSI_LEADSIG_VALUE) &&
+                        (RAMreadD (dsk->buffer, FSI_STRUCSIG) == FSI_STRUCSIG_VALUE))
+                {
+                    dsk->fsinfo = dsk->firsts + FSInfoSec;
+                    dsk->freecls = RAMreadD (dsk->buffer, FSI_FREE_COUNT);
+                    if (dsk->freecls > dsk->maxcls - 2)
+                        dsk->freecls = FSINFO_UNKNOWN;
+                    dsk->nextfree = RAMreadD (dsk->buffer, FSI_NXT_FREE);
+                    if ((dsk->nextfree < 2) || (dsk->nextfree >= dsk->maxcls))
+                        dsk->nextfree = 2;
+                }
+            }
+        #endif
         }
     }
     
@@ -1009,9 +2642,12 @@ BYTE LoadBootSector(DISK *dsk)
  *
  * Side Effects:    None
  *
- * Overview:        Reads a byte from a buffer
+ * Overview:        Formats the current volume (see FSchdrive), in the media
+ *                  unit and partition it was mounted from
  *
- * Note:            None
+ * Note:            Mount the volume again afterwards. Blank media whose
+ *                  size the media layer reports (MediaCapacity) get a
+ *                  partition table with one partition when mode is 1.
  *****************************************************************************/
 
 #ifdef ALLOW_FORMATS
@@ -1019,24 +2655,42 @@ BYTE LoadBootSector(DISK *dsk)
 int FSformat (char mode, long int serialNumber, char * volumeID)
 {
 	PT_MBR	masterBootRecord;
+	PTE_MBR * partEntry;
 	DWORD 	secCount, FAT16DataClusters, RootDirSectors;
 	BootSec	BSec;
 	DISK	d;
 	DISK * disk = &d;
-	WORD 	i, j;
-	DWORD	fatsize, test;
+	WORD 	j;
+	DWORD	i, fatsize, test;
+	BYTE	ext;			// offset of the extended boot record fields
+	WORD	resrv;			// reserved sectors in front of the FAT
+	BYTE	big;			// log2 of the sector size over 512 bytes
 #ifdef USE_PIC18
 	// This is here because of a C18 compiler feature
 	BYTE *  dataBufferPointer = gDataBuffer;
 #endif
 
 	disk->buffer = gDataBuffer;
+	disk->rootcls = 0;
+	disk->fsinfo = 0;
+	disk->partition = gDiskData[gCurrentVolume].partition;
+	if (disk->partition > 3)
+		return EOF;
 
     InitIO();
 
+	if (!VolumeSelect (&gDiskData[gCurrentVolume]))
+		return EOF;
+
 	if (MediaInitialize() != TRUE)
 		return EOF;
 
+	// The sizes below are worked out for 512 byte sectors and shifted
+	// right by big for larger ones
+	if (LoadSectorSize (disk) != CE_GOOD)
+		return EOF;
+	big = disk->sectorShift - 9;
+
 	if (SectorRead (0x00, gDataBuffer) == FALSE)
 		return EOF;
 
@@ -1048,19 +2702,33 @@ int FSformat (char mode, long int serialNumber, char * volumeID)
 		// The alternative is to read the CIS from attribute
 		// memory.  See the PCMCIA metaformat for more details
 #ifdef USE_PIC24
-		if (ReadByte( disk->buffer, BSI_FSTYPE ) == 'F' && \
+		if ((ReadByte( disk->buffer, BSI_FSTYPE ) == 'F' && \
 			ReadByte( disk->buffer, BSI_FSTYPE + 1 ) == 'A' && \
 			ReadByte( disk->buffer, BSI_FSTYPE + 2 ) == 'T' && \
 			ReadByte( disk->buffer, BSI_FSTYPE + 3 ) == '1' && \
-			ReadByte( disk->buffer, BSI_BOOTSIG) == 0x29)
+			ReadByte( disk->buffer, BSI_BOOTSIG) == 0x29) || \
+			(ReadByte( disk->buffer, BSI_FAT32_FSTYPE ) == 'F' && \
+			ReadByte( disk->buffer, BSI_FAT32_FSTYPE + 1 ) == 'A' && \
+			ReadByte( disk->buffer, BSI_FAT32_FSTYPE + 2 ) == 'T' && \
+			ReadByte( disk->buffer, BSI_FAT32_FSTYPE + 3 ) == '3' && \
+			ReadByte( disk->buffer, BSI_FAT32_BOOTSIG) == 0x29))
 #else
-		if (BSec->FAT.FAT_16.BootSec_FSType[0] == 'F' && \
+		if ((BSec->FAT.FAT_16.BootSec_FSType[0] == 'F' && \
 			BSec->FAT.FAT_16.BootSec_FSType[1] == 'A' && \
 			BSec->FAT.FAT_16.BootSec_FSType[2] == 'T' && \
 			BSec->FAT.FAT_16.BootSec_FSType[3] == '1' && \
-			BSec->FAT.FAT_16.BootSec_BootSig == 0x29)
+			BSec->FAT.FAT_16.BootSec_BootSig == 0x29) || \
+			(BSec->FAT.FAT_32.BootSec_FSType[0] == 'F' && \
+			BSec->FAT.FAT_32.BootSec_FSType[1] == 'A' && \
+			BSec->FAT.FAT_32.BootSec_FSType[2] == 'T' && \
+			BSec->FAT.FAT_32.BootSec_FSType[3] == '3' && \
+			BSec->FAT.FAT_32.BootSec_BootSig == 0x29))
 #endif
 		{
+			// There is only the one volume without a partition table
+			if (disk->partition != 0)
+				return EOF;
+
 			switch (mode)
 			{
 				case 1:
@@ -1082,24 +2750,59 @@ int FSformat (char mode, long int serialNumber, char * volumeID)
 		else
 		{	
 			masterBootRecord = (PT_MBR) &gDataBuffer;
-			disk->firsts = masterBootRecord->Partition0.PTE_FrstSect;
+			partEntry = &masterBootRecord->Partition0 + disk->partition;
+			disk->firsts = partEntry->PTE_FrstSect;
+
+			// A partition that runs past the end of the media is bad
+			i = MediaCapacity();
+			if ((i != 0) && ((disk->firsts >= i) || (partEntry->PTE_NumSect > i - disk->firsts)))
+				return EOF;
 		}
 		
 	}
+	else
+	{
+		// Blank media.  If its size is known a partition table can be
+		// made, with one partition covering all of it.
+		i = MediaCapacity();
+		if ((mode != 1) || (disk->partition != 0) || (i < (0x1000UL >> big)))
+			return EOF;
+
+		memset (gDataBuffer, 0x00, MEDIA_SECTOR_SIZE);
+		masterBootRecord = (PT_MBR) &gDataBuffer;
+		partEntry = &masterBootRecord->Partition0;
+
+		// Start on a 1 MB boundary, as other systems do, unless that
+		// would waste much of a small media
+		disk->firsts = (i >= (0x40000UL >> big)) ? (2048 >> big) : 63;
+		partEntry->PTE_FrstSect = disk->firsts;
+		partEntry->PTE_NumSect = i - disk->firsts;
+
+		// No CHS addresses; LBA only
+		gDataBuffer[446 + 1] = 0xFE;
+		gDataBuffer[446 + 2] = 0xFF;
+		gDataBuffer[446 + 3] = 0xFF;
+		gDataBuffer[446 + 5] = 0xFE;
+		gDataBuffer[446 + 6] = 0xFF;
+		gDataBuffer[446 + 7] = 0xFF;
+
+		masterBootRecord->Signature0 = FAT_GOOD_SIGN_0;
+		masterBootRecord->Signature1 = FAT_GOOD_SIGN_1;
+	}
 
 
 	switch (mode)
 	{
 		// True: Rewrite the whole boot sector
 		case 1:
-			secCount = masterBootRecord->Partition0.PTE_NumSect;
+			secCount = partEntry->PTE_NumSect;
 			
 			if (secCount < 0x1039)
 			{
 				disk->type = FAT12;
 				// Format to FAT12 only if there are too few sectors to format
 				// as FAT16
-				masterBootRecord->Partition0.PTE_FSDesc = 0x01;
+				partEntry->PTE_FSDesc = 0x01;
 				if (SectorWrite (0x00, gDataBuffer, TRUE) == FALSE)
 					return EOF;
 				
@@ -1119,20 +2822,16 @@ int FSformat (char mode, long int serialNumber, char * volumeID)
 				
 				// Prepare a boot sector
 				memset (gDataBuffer, 0x00, MEDIA_SECTOR_SIZE);
-
-				// Last digit of file system name (FAT12   )
-				gDataBuffer[58] = '2';
-
 			}
-			else if (secCount <= 0x3FFD5F)
+			else if (secCount <= (0x3FFD5FUL >> big))
 			{
 				disk->type = FAT16;
 				// Format to FAT16
-				masterBootRecord->Partition0.PTE_FSDesc = 0x06;
+				partEntry->PTE_FSDesc = 0x06;
 				if (SectorWrite (0x00, gDataBuffer, TRUE) == FALSE)
 					return EOF;
 
-				FAT16DataClusters = secCount - 0x218;
+				FAT16DataClusters = secCount - (0x218 >> big);
 				// Figure out how many sectors per cluster we need
 				disk->SecPerClus = 1;
 				while (FAT16DataClusters > 0xFFED)
@@ -1146,27 +2845,90 @@ int FSformat (char mode, long int serialNumber, char * volumeID)
 
 				// Prepare a boot sector
 				memset (gDataBuffer, 0x00, MEDIA_SECTOR_SIZE);
-
-				// Last digit of file system name (FAT16   )
-				gDataBuffer[58] = '6';
-
 			}
 			else
 			{
+#ifdef SUPPORT_FAT32
+				disk->type = FAT32;
+				// Format to FAT32 (LBA)
+				partEntry->PTE_FSDesc = 0x0C;
+				if (SectorWrite (0x00, gDataBuffer, TRUE) == FALSE)
+					return EOF;
+
+				// Cluster sizes from the FAT32 table of the Microsoft
+				// FAT specification
+				if (secCount <= (0x1000000UL >> big))
+					disk->SecPerClus = 8;		// up to 8 GB: 4 kB clusters
+				else if (secCount <= (0x2000000UL >> big))
+					disk->SecPerClus = 16;		// up to 16 GB: 8 kB clusters
+				else if (secCount <= (0x4000000UL >> big))
+					disk->SecPerClus = 32;		// up to 32 GB: 16 kB clusters
+				else
+					disk->SecPerClus = 64;		// 32 kB clusters
+				// the same cluster sizes in fewer, larger sectors
+				disk->SecPerClus >>= big;
+				if (disk->SecPerClus == 0)
+					disk->SecPerClus = 1;
+
+				// Prepare a boot sector
+				memset (gDataBuffer, 0x00, MEDIA_SECTOR_SIZE);
+#else
 				// Cannot format; too many sectors
 				return EOF;
+#endif
 			}
 
-			// Calculate the size of the FAT
-			fatsize = (secCount - 0x21  + (2*disk->SecPerClus));
-			if (disk->type == FAT12)
-				test =	(341 * disk->SecPerClus) + 2;
+			if (disk->type == FAT32)
+			{
+				// FAT32 has no fixed root directory; it lives in cluster 2
+				// and the FSInfo and backup boot sectors sit in a larger
+				// reserved area
+				resrv = 0x20;
+				disk->maxroot = 0;
+				disk->rootcls = 2;
+				ext = 64;
+			}
 			else
-				test = 	(256  * disk->SecPerClus) + 2;
-			fatsize = (fatsize + (test-1)) / test;
+			{
+				resrv = 0x08;
+				disk->maxroot = 0x200;
+				ext = 36;
+			}
+			RootDirSectors = ((disk->maxroot * 32) + (disk->sectorSize - 1)) / disk->sectorSize;
+
+			while (1)
+			{
+				// Calculate the size of the FAT
+				if (disk->type == FAT32)
+				{
+					test = (((disk->sectorSize / 2) * (DWORD)disk->SecPerClus) + 2) / 2;
+					fatsize = (secCount - resrv + (test - 1)) / test;
+				}
+				else
+				{
+					fatsize = (secCount - 0x21  + (2*disk->SecPerClus));
+					if (disk->type == FAT12)
+						test =	((disk->sectorSize * 2 / 3) * (DWORD)disk->SecPerClus) + 2;
+					else
+						test = 	((disk->sectorSize / 2) * (DWORD)disk->SecPerClus) + 2;
+					fatsize = (fatsize + (test-1)) / test;
+				}
+
+				// Large sectors leave less room to the FAT and root
+				// directory, so the cluster count may pass what the FAT
+				// type allows; larger clusters bring it back
+				disk->maxcls = (secCount - (resrv + (2 * fatsize) + RootDirSectors)) / disk->SecPerClus;
+				if ((disk->type == FAT32) ||
+					((disk->type == FAT12) && (disk->maxcls < 4085)) ||
+					((disk->type == FAT16) && (disk->maxcls < 65525)))
+					break;
+				disk->SecPerClus *= 2;
+				if (disk->SecPerClus > 128)
+					return EOF;
+			}
 			// Non-file system specific values	
 			gDataBuffer[0] = 0xEB;			//Jump instruction
-			gDataBuffer[1] = 0x3C;
+			gDataBuffer[1] = ext + 0x18;	// jump past the boot record (0x3C, 0x58 on FAT32)
 			gDataBuffer[2] =  0x90;
 			gDataBuffer[3] =  'M';			//OEM Name "MCHP FAT"
 			gDataBuffer[4] =  'C';
@@ -1176,23 +2938,37 @@ int FSformat (char mode, long int serialNumber, char * volumeID)
 			gDataBuffer[8] =  'F';
 			gDataBuffer[9] =  'A';
 			gDataBuffer[10] = 'T';
-			gDataBuffer[11] =  0x00;	        //Bytes per sector - 512
-			gDataBuffer[12] =  0x02;
+			gDataBuffer[11] = disk->sectorSize & 0xFF;	//Bytes per sector
+			gDataBuffer[12] = disk->sectorSize >> 8;
 			gDataBuffer[13] = disk->SecPerClus;	//Sectors per cluster
-			gDataBuffer[14] = 0x08;			//Reserved sector count
+			gDataBuffer[14] = resrv;			//Reserved sector count
 			gDataBuffer[15] = 0x00;			
-			disk->fat = 0x08 + disk->firsts;
+			disk->fat = resrv + disk->firsts;
 			gDataBuffer[16] = 0x02;			//number of FATs
 			disk->fatcopy = 0x02;
-			gDataBuffer[17] = 0x00; 			//Max number of root directory entries - 512 files allowed
-			gDataBuffer[18] = 0x02;
-			disk->maxroot = 0x200;
+			gDataBuffer[17] = disk->maxroot & 0xFF; 	//Max number of root directory entries - 512 files allowed
+			gDataBuffer[18] = (disk->maxroot >> 8) & 0xFF;
 			gDataBuffer[19] = 0x00;			//total sectors	
 			gDataBuffer[20] = 0x00;
 			gDataBuffer[21] = 0xF8;			//Media Descriptor
-			gDataBuffer[22] = fatsize & 0xFF;			//Sectors per FAT
-			gDataBuffer[23] = (fatsize >> 8) & 0xFF;
 			disk->fatsize = fatsize;
+			if (disk->type == FAT32)
+			{
+				// Sectors per FAT is in the 32-bit field
+				gDataBuffer[36] = (BYTE)(fatsize & 0xFF);
+				gDataBuffer[37] = (BYTE)((fatsize / 0x100) & 0xFF);
+				gDataBuffer[38] = (BYTE)((fatsize / 0x10000) & 0xFF);
+				gDataBuffer[39] = (BYTE)((fatsize / 0x1000000) & 0xFF);
+				gDataBuffer[44] = 0x02;		// Root directory cluster
+				gDataBuffer[48] = 0x01;		// FSInfo sector
+				gDataBuffer[50] = 0x06;		// Backup boot sector
+				disk->fsinfo = disk->firsts + 1;
+			}
+			else
+			{
+				gDataBuffer[22] = fatsize & 0xFF;			//Sectors per FAT
+				gDataBuffer[23] = (fatsize >> 8) & 0xFF;
+			}
 			gDataBuffer[24] = 0x3F;	        //Sectors per track 
 			gDataBuffer[25] = 0x00;
 			gDataBuffer[26] = 0xFF;			//Number of heads 
@@ -1207,39 +2983,43 @@ int FSformat (char mode, long int serialNumber, char * volumeID)
 			gDataBuffer[33] = (BYTE)((secCount / 0x100) & 0xFF);
 			gDataBuffer[34] = (BYTE)((secCount / 0x10000) & 0xFF); 
 			gDataBuffer[35] = (BYTE)((secCount / 0x1000000) & 0xFF);
-			gDataBuffer[36] = 0x00;			// Physical drive number
-			gDataBuffer[37] = 0x00;			// Reserved (current head) 
-			gDataBuffer[38] = 0x29;			// Signature code
-			gDataBuffer[39] = (BYTE)(serialNumber & 0xFF);
-			gDataBuffer[40] = (BYTE)((serialNumber / 0x100) & 0xFF);
-			gDataBuffer[41] = (BYTE)((serialNumber / 0x10000) & 0xFF);
-			gDataBuffer[42] = (BYTE)((serialNumber / 0x1000000) & 0xFF);
+			// The extended boot record follows the FAT12/16 BPB at 36
+			// and the FAT32 BPB at 64
+			gDataBuffer[ext] = 0x00;			// Physical drive number
+			gDataBuffer[ext + 1] = 0x00;			// Reserved (current head) 
+			gDataBuffer[ext + 2] = 0x29;			// Signature code
+			gDataBuffer[ext + 3] = (BYTE)(serialNumber & 0xFF);
+			gDataBuffer[ext + 4] = (BYTE)((serialNumber / 0x100) & 0xFF);
+			gDataBuffer[ext + 5] = (BYTE)((serialNumber / 0x10000) & 0xFF);
+			gDataBuffer[ext + 6] = (BYTE)((serialNumber / 0x1000000) & 0xFF);
 			// Volume ID
 			if (volumeID != NULL)
 			{
 				for (i = 0; (*(volumeID + i) != 0) && (i < 11); i++)
 				{
-					gDataBuffer[i + 43] = *(volumeID + i);
+					gDataBuffer[i + ext + 7] = *(volumeID + i);
 				}
 				while (i < 11)
 				{
-					gDataBuffer[43 + i++] = 0x20;
+					gDataBuffer[ext + 7 + i++] = 0x20;
 				}
 			}
 			else
 			{
 				for (i = 0; i < 11; i++)
 				{
-					gDataBuffer[i+43] = 0;
+					gDataBuffer[i + ext + 7] = 0;
 				}
 			}
-			gDataBuffer[54] = 'F';
-			gDataBuffer[55] = 'A';
-			gDataBuffer[56] = 'T';
-			gDataBuffer[57] = '1';
-			gDataBuffer[59] = ' ';
-			gDataBuffer[60] = ' ';
-			gDataBuffer[61] = ' ';
+			// File system name (FAT12   , FAT16    or FAT32   )
+			gDataBuffer[ext + 18] = 'F';
+			gDataBuffer[ext + 19] = 'A';
+			gDataBuffer[ext + 20] = 'T';
+			gDataBuffer[ext + 21] = (disk->type == FAT32) ? '3' : '1';
+			gDataBuffer[ext + 22] = (disk->type == FAT16) ? '6' : '2';
+			gDataBuffer[ext + 23] = ' ';
+			gDataBuffer[ext + 24] = ' ';
+			gDataBuffer[ext + 25] = ' ';
 #ifdef USE_PIC18
 			// C18 can't reference a value greater than 256
 			// using an array name pointer
@@ -1251,9 +3031,15 @@ int FSformat (char mode, long int serialNumber, char * volumeID)
 #endif			
 
 	        disk->root = disk->fat + (disk->fatcopy * disk->fatsize);
+			disk->maxcls = ((secCount - (resrv + (disk->fatcopy * disk->fatsize) + RootDirSectors)) / disk->SecPerClus) + 2;
 
 			if (SectorWrite (disk->firsts, gDataBuffer, FALSE) == FALSE)
 				return EOF;
+
+			// FAT32 keeps a copy of the boot sector in the reserved area
+			if (disk->type == FAT32)
+				if (SectorWrite (disk->firsts + 6, gDataBuffer, FALSE) == FALSE)
+					return EOF;
 			
 			break;
 		case 0:
@@ -1264,13 +3050,44 @@ int FSformat (char mode, long int serialNumber, char * volumeID)
 			return EOF;
 	}
 
-	// Erase the FAT
+	// Erase every FAT copy in one run and the root directory in another.
+	// The FAT cache is emptied and its buffers used as a larger source of
+	// zeros; what other volumes changed in it is written back first.
+	if (disk->type == FAT32)
+		RootDirSectors = disk->SecPerClus;
+	else
+		RootDirSectors = ((disk->maxroot * 32) + (disk->sectorSize - 1)) / disk->sectorSize;
+
+	for (j = 0; j < FS_MAX_VOLUMES; j++)
+	{
+		if ((j != gCurrentVolume) && gDiskData[j].mount)
+			WriteFAT (&gDiskData[j], 0, 0, TRUE);
+	}
+	FATCacheInvalidate();
+	memset (gFATBuffer, 0x00, sizeof (gFATBuffer));
+	if (SectorZeroMultiple (disk->fat, disk->fatcopy * disk->fatsize, gFATBuffer[0], sizeof (gFATBuffer) >> disk->sectorShift) != TRUE)
+		return EOF;
+	if (SectorZeroMultiple (disk->root, RootDirSectors, gFATBuffer[0], sizeof (gFATBuffer) >> disk->sectorShift) != TRUE)
+		return EOF;
+
+	// Then write the sectors that aren't all zeros
 	memset (gDataBuffer, 0x00, MEDIA_SECTOR_SIZE);
-	gDataBuffer[0] = 0xF8;
-	gDataBuffer[1] = 0xFF;
-	gDataBuffer[2] = 0xFF;
-	if (disk->type == FAT16)
-		gDataBuffer[3] = 0xFF;
+	if (disk->type == FAT32)
+	{
+		// Media and end-of-chain entries, then the root directory's cluster
+		RAMwriteD (disk->buffer, 0, 0x0FFFFFF8);
+		RAMwriteD (disk->buffer, 4, 0x0FFFFFFF);
+		if (disk->rootcls < (disk->sectorSize / 4))
+			RAMwriteD (disk->buffer, disk->rootcls * 4, 0x0FFFFFFF);
+	}
+	else
+	{
+		gDataBuffer[0] = 0xF8;
+		gDataBuffer[1] = 0xFF;
+		gDataBuffer[2] = 0xFF;
+		if (disk->type == FAT16)
+			gDataBuffer[3] = 0xFF;
+	}
 
 	for (j = disk->fatcopy - 1; j != 0xFFFF; j--)
 	{
@@ -1278,24 +3095,18 @@ int FSformat (char mode, long int serialNumber, char * volumeID)
 			return EOF;
 	}
 			
-	memset (gDataBuffer, 0x00, 4);
-	
-	for (i = disk->fat + 1; i < (disk->fat + disk->fatsize); i++)
+	memset (gDataBuffer, 0x00, MEDIA_SECTOR_SIZE);
+
+	if ((disk->type == FAT32) && (disk->rootcls >= (disk->sectorSize / 4)))
 	{
+		// The root directory's cluster entry is past the first FAT sector
+		RAMwriteD (disk->buffer, ((disk->rootcls * 4) & (disk->sectorSize - 1)), 0x0FFFFFFF);
 		for (j = disk->fatcopy - 1; j != 0xFFFF; j--)
 		{
-			if (SectorWrite (i + (j * disk->fatsize), gDataBuffer, FALSE) == FALSE)
+			if (SectorWrite (disk->fat + ((disk->rootcls * 4) >> disk->sectorShift) + (j * disk->fatsize), gDataBuffer, FALSE) == FALSE)
 				return EOF;
 		}
-	}
-
-	// Erase the root directory
-	RootDirSectors = ((disk->maxroot * 32) + (0x200 - 1)) / 0x200;               
-
-	for (i = 1; i < RootDirSectors; i++)
-	{
-		if (SectorWrite (disk->root + i, gDataBuffer, FALSE) == FALSE)
-			return EOF;
+		memset (gDataBuffer, 0x00, MEDIA_SECTOR_SIZE);
 	}
 
 	if (volumeID != NULL)
@@ -1319,11 +3130,46 @@ int FSformat (char mode, long int serialNumber, char * volumeID)
 		if (SectorWrite (disk->root, gDataBuffer, FALSE) == FALSE)
 			return EOF;
 	}	
-	else
+
+#ifdef SUPPORT_FAT32
+	if ((disk->type == FAT32) && (disk->fsinfo != 0))
 	{
-		if (SectorWrite (disk->root, gDataBuffer, FALSE) == FALSE)
+		// Everything but the root directory's cluster is free
+		memset (gDataBuffer, 0x00, MEDIA_SECTOR_SIZE);
+		RAMwriteD (disk->buffer, FSI_LEADSIG, FSI_LEADSIG_VALUE);
+		RAMwriteD (disk->buffer, FSI_STRUCSIG, FSI_STRUCSIG_VALUE);
+		RAMwriteD (disk->buffer, FSI_FREE_COUNT, disk->maxcls - 3);
+		RAMwriteD (disk->buffer, FSI_NXT_FREE, 2);
+		RAMwriteD (disk->buffer, FSI_TRAILSIG, FSI_TRAILSIG_VALUE);
+		if (SectorWrite (disk->fsinfo, gDataBuffer, FALSE) == FALSE)
 			return EOF;
+		// and its backup next to the backup boot sector
+		if (mode == 1)
+			if (SectorWrite (disk->fsinfo + 6, gDataBuffer, FALSE) == FALSE)
+				return EOF;
 	}
+#endif
+
+	// The buffers no longer match the media
+	gLastDataSectorRead = 0xFFFFFFFF;
+	gDirSectorRead = 0xFFFFFFFF;
+	FATCacheInvalidate();
+#ifdef FS_DIR_CACHE_SIZE
+	DirCacheInvalidate();
+#endif
+#ifdef FS_READ_AHEAD_SECTORS
+	gReadAheadCount = 0;
+#endif
+	gNeedDataWrite = FALSE;
+	gBufferOwner = NULL;
+	gBufferZeroed = FALSE;
+#ifdef FS_FREE_MAP_SIZE
+	memset (gFreeMap, 0xFF, FS_FREE_MAP_SIZE);
+#endif
+
+	// The new file system has to be on the media before it is mounted
+	if (!MediaSync())
+		return EOF;
 
 	return 0;
 }
@@ -1355,24 +3201,33 @@ BYTE Write_File_Entry( FILEOBJ fo, WORD * curEntry)
     BYTE   status;
     BYTE   offset2;
     DWORD   sector;
-    WORD   ccls;
+    DWORD  ccls;
     
     dsk = fo->dsk;
     
     // get the cluster of this entry
     ccls = fo->dirccls;
     
-    offset2  = (*curEntry >> 4);
+    offset2  = DIRENTRY_SECTOR (dsk, *curEntry);
     
     // if its not the root, it's cluster based  
     if(ccls != 0)
         offset2 = offset2 % (dsk->SecPerClus);
     
     sector = Cluster2Sector(dsk,ccls);
+
+#ifdef FS_DIR_CACHE_SIZE
+    DirCacheForget (fo->dirclus, *curEntry);
+#endif
     
     // Now write it       
+    ReadAheadForget (sector + offset2, 1);
     if ( !SectorWrite( sector + offset2, dsk->buffer, FALSE)) 
+    {
+        // The buffer no longer matches the media
+        gDirSectorRead = 0xFFFFFFFF;
         status = FALSE;
+    }
     else
         status = TRUE;                      
     
@@ -1382,7 +3237,7 @@ BYTE Write_File_Entry( FILEOBJ fo, WORD * curEntry)
 
 
 /******************************************************************************
-* Function:        BYTE FAT_erase_cluster_chain (WORD cluster, DISK * dsk)
+* Function:        BYTE FAT_erase_cluster_chain (DWORD cluster, DISK * dsk)
 *
 * PreCondition:    Disk mounted, should be called from FILEerase
 *
@@ -1401,9 +3256,9 @@ BYTE Write_File_Entry( FILEOBJ fo, WORD * curEntry)
 *****************************************************************************/
 
 #ifdef ALLOW_WRITES
-BYTE FAT_erase_cluster_chain (WORD cluster, DISK * dsk)
+BYTE FAT_erase_cluster_chain (DWORD cluster, DISK * dsk)
 { 
-    WORD     c,c2;
+    DWORD    c,c2;
     enum    _status {Good, Fail, Exit}status;
     
     status = Good;
@@ -1478,10 +3333,10 @@ DIRENTRY Cache_File_Entry( FILEOBJ fo, WORD * curEntry, BYTE ForceRead)
     DIRENTRY dir;
     DISK *dsk;
     DWORD sector;
-    WORD cluster;
-    WORD ccls;
+    DWORD cluster;
+    DWORD ccls;
     BYTE offset2;
-    BYTE numofclus;
+    WORD numofclus;
     
     dsk = fo->dsk;
     
@@ -1490,7 +3345,7 @@ DIRENTRY Cache_File_Entry( FILEOBJ fo, WORD * curEntry, BYTE ForceRead)
     ccls = fo->dirccls;
     
     // figure out the offset from the base sector
-    offset2  = (*curEntry >> 4);
+    offset2  = DIRENTRY_SECTOR (dsk, *curEntry);
     offset2 = offset2; // emulator issue
     
     // if its the root its not cluster based
@@ -1498,10 +3353,10 @@ DIRENTRY Cache_File_Entry( FILEOBJ fo, WORD * curEntry, BYTE ForceRead)
         offset2  = offset2 % (dsk->SecPerClus);   // figure out the offset
     
     // check if a new sector of the root must be loaded
-    if (ForceRead || (*curEntry & 0xf) == 0)    // only 16 entries per sector
+    if (ForceRead || DIRENTRY_INDEX (dsk, *curEntry) == 0)    // first entry of a sector
     {
         // see if we have to load a new cluster
-        if((offset2 == 0 && (*curEntry) >= DIRENTRIES_PER_SECTOR) || ForceRead)
+        if((offset2 == 0 && (*curEntry) >= DIRENTRIES_PER_SECTOR(dsk)) || ForceRead)
         {
             if(cluster == 0)
             {
@@ -1511,7 +3366,7 @@ DIRENTRY Cache_File_Entry( FILEOBJ fo, WORD * curEntry, BYTE ForceRead)
             {
                 // If ForceRead, read the number of sectors from 0
                 if(ForceRead)
-                    numofclus = ((WORD)(*curEntry) / (WORD)(((WORD)DIRENTRIES_PER_SECTOR) * (WORD)dsk->SecPerClus));
+                    numofclus = ((WORD)(*curEntry) / (WORD)(((WORD)DIRENTRIES_PER_SECTOR(dsk)) * (WORD)dsk->SecPerClus));
                 // Otherwise just read the next sector
                 else
                     numofclus = 1;
@@ -1554,11 +3409,13 @@ DIRENTRY Cache_File_Entry( FILEOBJ fo, WORD * curEntry, BYTE ForceRead)
                 if ( SectorRead( sector + offset2, dsk->buffer) != TRUE) 
                 {
                     dir = ((DIRENTRY)NULL);
+                    gDirSectorRead = 0xFFFFFFFF;
                 }
                 else
                 {
+                    gDirSectorRead = sector + offset2;
                     if(ForceRead)
-                        dir = (DIRENTRY)((DIRENTRY)dsk->buffer) + ((*curEntry)%DIRENTRIES_PER_SECTOR);
+                        dir = (DIRENTRY)((DIRENTRY)dsk->buffer) + DIRENTRY_INDEX(dsk, *curEntry);
                     else
                         dir = (DIRENTRY)dsk->buffer;                        
                 }
@@ -1569,7 +3426,7 @@ DIRENTRY Cache_File_Entry( FILEOBJ fo, WORD * curEntry, BYTE ForceRead)
             dir = ((DIRENTRY)NULL);   
     }
     else
-        dir = (DIRENTRY)((DIRENTRY)dsk->buffer) + ((*curEntry)%DIRENTRIES_PER_SECTOR);
+        dir = (DIRENTRY)((DIRENTRY)dsk->buffer) + DIRENTRY_INDEX(dsk, *curEntry);
     
     return(dir);
 } // Cache_File_Entry 
@@ -1590,7 +3447,8 @@ DIRENTRY Cache_File_Entry( FILEOBJ fo, WORD * curEntry, BYTE ForceRead)
 *
 * Overview:        With the data passed within fo, create a new file entry in the current directory
 *
-* Note:            None
+* Note:            If gLfnSearch holds a long name, the entry gets an 8.3
+*                  alias and is written behind the entries of the long name
 *****************************************************************************/
 
 #ifdef ALLOW_WRITES
@@ -1599,7 +3457,17 @@ CETYPE CreateFileEntry(FILEOBJ fo, WORD *fHandle, BYTE mode)
     BYTE    index;
     CETYPE  error = CE_GOOD;
     char    name[11];
+    BYTE    count = 1;      // entries needed
     
+#ifdef SUPPORT_LFN
+    if (gLfnSearchLen != 0)
+    {
+        if (!LfnMakeAlias (fo, fo->name))
+            return CE_NO_MORE_TAILS;
+        count += (gLfnSearchLen + LFN_CHARS_PER_ENTRY - 1) / LFN_CHARS_PER_ENTRY;
+    }
+#endif
+
     for (index = 0; index < FILE_NAME_SIZE; index ++)
     {
         name[index] = fo->name[index];
@@ -1611,8 +3479,18 @@ CETYPE CreateFileEntry(FILEOBJ fo, WORD *fHandle, BYTE mode)
         *fHandle = 0;
     
         // figure out where to put this file in the directory stucture 
-        if(FindEmptyEntries(fo, fHandle))
+        if(FindEmptyEntries(fo, fHandle, count))
         {       
+        #ifdef SUPPORT_LFN
+            // the long name goes in front of the 8.3 entry
+            if (count > 1)
+            {
+                if (!LfnWriteEntries (fo, name, *fHandle, count - 1))
+                    return CE_WRITE_ERROR;
+                *fHandle += count - 1;
+            }
+        #endif
+
             // found the entry, now populate it 
             if((error = PopulateEntries(fo, name ,fHandle, mode)) == CE_GOOD)
             {
@@ -1650,7 +3528,7 @@ CETYPE CreateFileEntry(FILEOBJ fo, WORD *fHandle, BYTE mode)
 CETYPE CreateFirstCluster(FILEOBJ fo)
 {
     CETYPE    error;
-    WORD      cluster;
+    DWORD     cluster;
     WORD      fHandle;
     DIRENTRY  dir;
     
@@ -1663,7 +3541,8 @@ CETYPE CreateFirstCluster(FILEOBJ fo)
         dir = LoadDirAttrib(fo, &fHandle);
         
         // Now update the new cluster
-        dir->DIR_FstClusLO = cluster;
+        dir->DIR_FstClusLO = (WORD)cluster;
+        dir->DIR_FstClusHI = (WORD)(cluster >> 16);
         
         // now write it
         if(Write_File_Entry(fo, &fHandle) != TRUE)
@@ -1675,12 +3554,13 @@ CETYPE CreateFirstCluster(FILEOBJ fo)
 #endif
 
 /******************************************************************************
-* Function:        BYTE FindEmptyEntries(FILEOBJ fo, WORD *fHandle)
+* Function:        BYTE FindEmptyEntries(FILEOBJ fo, WORD *fHandle, BYTE count)
 *
 * PreCondition:    Disk mounted, CreateFileEntry called
 *
 * Input:           fo           - Pointer to file structure
 *                  fHandle      - Start of entries
+*                  count        - Number of entries needed in a row
 *                  
 * Output:          TRUE    - One found
 *                  FALSE   - None found
@@ -1689,19 +3569,23 @@ CETYPE CreateFirstCluster(FILEOBJ fo)
 *
 * Overview:        Find the passed number of contingiant empty entries
 *
-* Note:            Should not be called by user
+* Note:            Should not be called by user. The directory is given new
+*                  clusters if it runs out of entries, except for the root
+*                  of a FAT12/16 disk.
 *****************************************************************************/
 
 #ifdef ALLOW_WRITES
-BYTE FindEmptyEntries(FILEOBJ fo, WORD *fHandle)
+BYTE FindEmptyEntries(FILEOBJ fo, WORD *fHandle, BYTE count)
 {
     BYTE        status = NOT_FOUND;
-    BYTE        amountfound;
+    BYTE        amountfound = 0;
     BYTE        a;
-    WORD        bHandle, b;
+    WORD        bHandle;
+    DWORD       b;
     DIRENTRY    dir;
     
     fo->dirccls = fo->dirclus;
+    bHandle = *fHandle;
     if((dir = Cache_File_Entry( fo, fHandle, TRUE)) == NULL)
     {
         status = CE_BADCACHEREAD;
@@ -1711,23 +3595,9 @@ BYTE FindEmptyEntries(FILEOBJ fo, WORD *fHandle)
         // while its still not found
         while(status == NOT_FOUND)
         {
-            amountfound = 0;
-            bHandle = *fHandle;
-    
-            // find (number) continuous entries
-            do
-            {
-                // Get the entry
-                dir = Cache_File_Entry( fo, fHandle, FALSE);
-                
-                // Read the first char of the file name 
-                a = dir->DIR_Name[0];     
-                
-                // increase number
-                (*fHandle)++;
-            }while((a == DIR_DEL || a == DIR_EMPTY) && (dir != (DIRENTRY)NULL) &&  (++amountfound < 1));  
-    
-            // --- now why did we exit?
+            // Get the entry
+            dir = Cache_File_Entry( fo, fHandle, FALSE);
+            
             if(dir == NULL) // Last entry of the cluster
             {
                 //setup the current cluster
@@ -1738,29 +3608,37 @@ BYTE FindEmptyEntries(FILEOBJ fo, WORD *fHandle)
                     status = NO_MORE;
                 else    
                 {
-                fo->ccls = b;
+                    fo->ccls = b;
                 
-                if(FILEallocate_new_cluster(fo, 1) == CE_DISK_FULL)
-                    status = NO_MORE;    
-                else
-                {
-                    *fHandle = bHandle;
-                    status = FOUND;     // a new cluster will surely hold a new file name     
+                    if(FILEallocate_new_cluster(fo, 1) == CE_DISK_FULL)
+                        status = NO_MORE;    
+                    else if(amountfound + (WORD)DIRENTRIES_PER_SECTOR(fo->dsk) * fo->dsk->SecPerClus >= count)
+                        status = FOUND;     // the new cluster holds the rest of them
+                    // otherwise keep counting the empty entries of the new cluster
                 }
             }
-        }
-        else
-        {            
-            if(amountfound == 1)
+            else
             {
-                status = FOUND;
-                *fHandle = bHandle;
+                // Read the first char of the file name 
+                a = dir->DIR_Name[0];     
+                (*fHandle)++;
+
+                if(a == DIR_DEL || a == DIR_EMPTY)
+                {
+                    if(++amountfound == count)
+                        status = FOUND;
+                }
+                else
+                {
+                    // start again after this one
+                    amountfound = 0;
+                    bHandle = *fHandle;
+                }
             }
-        }
-    }// while    
+        }// while    
 
-    // copy the base handle over
-    *fHandle = bHandle;
+        // copy the base handle over
+        *fHandle = bHandle;
     }
     
     if(status == FOUND)
@@ -2064,7 +3942,7 @@ int SetClockVars (unsigned int year, unsigned char month, unsigned char day, uns
 BYTE FILEallocate_new_cluster( FILEOBJ fo, BYTE mode)
 {
     DISK *  dsk;
-    WORD    c,curcls;
+    DWORD   c,curcls;
     
     dsk = fo->dsk;   
     c = fo->ccls;
@@ -2076,13 +3954,21 @@ BYTE FILEallocate_new_cluster( FILEOBJ fo, BYTE mode)
     // mark the cluster as taken, and last in chain
     if(dsk->type == FAT12) 
         WriteFAT( dsk, c, LAST_CLUSTER_FAT12, FALSE);
-    else
+    else if(dsk->type == FAT16) 
         WriteFAT( dsk, c, LAST_CLUSTER_FAT16, FALSE);
+    else
+        WriteFAT( dsk, c, LAST_CLUSTER_FAT32, FALSE);
     
     // link current cluster to the new one
     curcls = fo->ccls;
     
     WriteFAT( dsk, curcls, c, FALSE);
+
+#ifdef FS_EXTENT_MAP_SIZE
+    // a file that grows keeps its extent map current
+    if (mode == 0)
+        ExtentMapAdd (fo, curcls, c);
+#endif
     
     // update the FILE structure
     fo->ccls = c;
@@ -2100,64 +3986,180 @@ BYTE FILEallocate_new_cluster( FILEOBJ fo, BYTE mode)
 #endif
 
 /******************************************************************************
-* Function:        WORD FATfindEmptyCluster(FILEOBJ fo)
+* Function:        DWORD FATfindEmptyCluster(FILEOBJ fo)
 *
 * PreCondition:    Disk mounted
 *
 * Input:           fo      - Pointer to file structure
-*                  
+*
 * Output:          c       - Cluster; 0 if failed
 *
 * Side Effects:    None
 *
 * Overview:        Find the next available cluster
 *
-* Note:            Should not be called by user
+* Note:            Should not be called by user. A file that does not have
+*                  a cluster yet starts the search at the disk's next free
+*                  cluster hint (from the FSInfo sector on FAT32). Groups
+*                  the free cluster map knows to be full are skipped
+*                  without reading their FAT sectors.
 *****************************************************************************/
 
 #ifdef ALLOW_WRITES
-WORD FATfindEmptyCluster(FILEOBJ fo)
-{    
+DWORD FATfindEmptyCluster(FILEOBJ fo)
+{
     DISK *  disk;
-    WORD    value=0x0,c,curcls;
-    
-    disk = fo->dsk;   
+    DWORD   value=0x0,c,curcls;
+    BYTE    wrapped = FALSE;
+#ifdef FS_FREE_MAP_SIZE
+    DWORD   g;
+    BYTE    wholeGroup;     // the current group was scanned from its start
+#endif
+
+    disk = fo->dsk;
     c = fo->ccls;
-    
+
     // just in case
     if(c < 2)
+        c = disk->nextfree;
+    if((c < 2) || (c >= disk->maxcls))
         c = 2;
-    
+
     curcls = c;
-    
+
+#ifdef FS_FREE_MAP_SIZE
+    wholeGroup = ((c >> gFreeMapShift) == 0) || ((c & ((1ul << gFreeMapShift) - 1)) == 0);
+#endif
+
     // sequentially scan through the FAT looking for an empty cluster
-    while(c)
+    while(1)
     {
-        // look at its value    
+        // check if reached last cluster in FAT, re-start from top
+        if (c >= disk->maxcls)
+        {
+        #ifdef FS_FREE_MAP_SIZE
+            if (wholeGroup)
+                FreeMapSet (disk->maxcls - 1, FALSE);
+            wholeGroup = TRUE;
+        #endif
+            if (wrapped)
+            {
+                c = 0;
+                break;
+            }
+            c = 2;
+            wrapped = TRUE;
+        }
+
+        // check if full circle done, disk full
+        if (wrapped && (c >= curcls))
+        {
+            c = 0;
+            break;
+        }
+
+    #ifdef FS_FREE_MAP_SIZE
+        // skip a group that has no free clusters in it
+        g = c >> gFreeMapShift;
+        if ((gFreeMap[g >> 3] & (1 << (g & 7))) == 0)
+        {
+            c = (g + 1) << gFreeMapShift;
+            wholeGroup = TRUE;
+            continue;
+        }
+    #endif
+
+        // look at its value
         if ( (value = ReadFAT(disk, c)) == CLUSTER_FAIL)
         {
             c = 0;
             break;
         }
-    
+
         // check if empty cluster found
         if (value == CLUSTER_EMPTY)
-            break;   
-    
+            break;
+
         c++;    // check next cluster in FAT
-        // check if reached last cluster in FAT, re-start from top
-        if (c == END_CLUSTER || c >= disk->maxcls)
-            c = 2;
-    
-        // check if full circle done, disk full
-        if ( c == curcls)
+
+    #ifdef FS_FREE_MAP_SIZE
+        // Leaving a group; if all of it was looked at it must be full
+        if ((c & ((1ul << gFreeMapShift) - 1)) == 0)
         {
-            c = 0;
-            break;
+            if (wholeGroup)
+                FreeMapSet (c - 1, FALSE);
+            wholeGroup = TRUE;
         }
+    #endif
     }  // scanning for an empty cluster
+
+    // Remember where we got to for the next search
+    if (c != 0)
+        disk->nextfree = c;
     return(c);
 }
+
+
+#ifdef FS_FREE_MAP_SIZE
+/******************************************************************************
+* Function:        void FreeMapInit (DISK * dsk)
+*
+* PreCondition:    Disk mounted
+*
+* Input:           dsk     - The disk structure
+*
+* Output:          None
+*
+* Side Effects:    None
+*
+* Overview:        Size the free cluster map for the disk and mark every
+*                  group as possibly having free clusters
+*
+* Note:            The map is filled in lazily; FATfindEmptyCluster clears
+*                  the bit of a group once it has scanned all of it without
+*                  finding a free cluster
+*****************************************************************************/
+
+void FreeMapInit (DISK * dsk)
+{
+    // Start with one FAT32 sector's worth of clusters per group and
+    // double it until the whole disk fits in the map
+    gFreeMapShift = 7;
+    while ((dsk->maxcls >> gFreeMapShift) >= (FS_FREE_MAP_SIZE * 8ul))
+        gFreeMapShift++;
+
+    memset (gFreeMap, 0xFF, FS_FREE_MAP_SIZE);
+}
+
+
+/******************************************************************************
+* Function:        void FreeMapSet (DWORD cluster, BYTE mayBeFree)
+*
+* PreCondition:    FreeMapInit called
+*
+* Input:           cluster   - Any cluster in the group
+*                  mayBeFree - TRUE if the group may now hold a free cluster,
+*                              FALSE if every cluster in it is in use
+*
+* Output:          None
+*
+* Side Effects:    None
+*
+* Overview:        Update the free cluster map bit for a group of clusters
+*
+* Note:            None
+*****************************************************************************/
+
+void FreeMapSet (DWORD cluster, BYTE mayBeFree)
+{
+    DWORD   g = cluster >> gFreeMapShift;
+
+    if (mayBeFree)
+        gFreeMap[g >> 3] |= (1 << (g & 7));
+    else
+        gFreeMap[g >> 3] &= ~(1 << (g & 7));
+}
+#endif
 #endif
 
 /******************************************************************************
@@ -2174,7 +4176,11 @@ WORD FATfindEmptyCluster(FILEOBJ fo)
 *
 * Overview:        Close a file
 *
-* Note:
+* Note:            For a file open for writing, the data buffer, the FAT
+*                  sectors and the directory entry are written, then the
+*                  write cache and the write queue are emptied and the
+*                  media is synced, as FSfflush does, so the media may be
+*                  removed once it returns.
 *****************************************************************************/
 
 int FSfclose(FSFILE   *fo)
@@ -2186,19 +4192,48 @@ int FSfclose(FSFILE   *fo)
     int        error = 72;
     #ifdef ALLOW_WRITES
         DIRENTRY    dir;
+        DWORD       clusbytes, c;
     #endif
     
     fHandle = fo->entry;
     
     #ifdef ALLOW_WRITES
+        if (fo->flags.write && !FileSelect (fo))
+        {
+            // The volume is gone; the file can only be let go of
+            fo->flags.write = FALSE;
+            error = EOF;
+        }
+
         if(fo->flags.write)
         {
-            if (gNeedDataWrite)
-                if (flushData())
+            if (FileNeedWrite(fo))
+                if (FileFlush(fo))
                     return EOF;
+
+            // Give back the clusters reserved by FSfallocate that the file
+            // did not grow into
+            if (fo->flags.reserved)
+            {
+                clusbytes = (DWORD)fo->dsk->SecPerClus * fo->dsk->sectorSize;
+                if (FILEseek_cluster (fo, (fo->size == 0) ? 0 : (fo->size - 1) / clusbytes) == CE_GOOD)
+                {
+                    c = ReadFAT (fo->dsk, fo->ccls);
+                    if ((c >= 2) && (c < LAST_CLUSTER))
+                    {
+                        WriteFAT (fo->dsk, fo->ccls, FatLastClusterValue(fo->dsk), FALSE);
+                        FAT_erase_cluster_chain (c, fo->dsk);
+                    }
+                }
+                fo->flags.reserved = FALSE;
+            }
     
-            // Write the current FAT sector to the disk
+            // Write the changed FAT sectors to the disk
             WriteFAT (fo->dsk, 0, 0, TRUE);
+
+            // Keep the FSInfo free space hints current
+            if (!WriteFSInfo (fo->dsk))
+                return EOF;
     
             // Get the file entry
             dir = LoadDirAttrib(fo, &fHandle);
@@ -2230,6 +4265,11 @@ int FSfclose(FSFILE   *fo)
                 error = 0;
             else
                 error = EOF;
+
+            // Get what the write cache and the write queue still hold onto
+            // the media
+            if (!MediaSync())
+                error = EOF;
     
             // it's now closed
             fo->flags.write = FALSE;
@@ -2237,6 +4277,9 @@ int FSfclose(FSFILE   *fo)
     #endif
     
     #ifdef FS_DYNAMIC_MEM
+        #ifdef FS_FILE_BUFFERS
+            FS_free(fo->buffer);
+        #endif
         FS_free((unsigned char *)fo);
     #else
     
@@ -2258,6 +4301,140 @@ int FSfclose(FSFILE   *fo)
 } // FSfclose
 
 
+/******************************************************************************
+* Function:        int FSfflush (FSFILE * fo)
+*
+* PreCondition:    File opened
+*
+* Input:           fo      - Pointer to file structure
+*
+* Output:          0              - The file is on the media
+*                  EOF            - Error writing the file
+*
+* Side Effects:    None
+*
+* Overview:        Write everything the file system holds for a file to
+*                  the media, as FSfclose does, and leave it open
+*
+* Note:            The data buffer, the FAT sectors and the directory entry
+*                  (size and time) are written, then the write cache and
+*                  the write queue are emptied and the media is synced.
+*                  Files opened for reading are left alone.
+*****************************************************************************/
+
+#ifdef ALLOW_WRITES
+int FSfflush (FSFILE * fo)
+{
+    WORD        fHandle;
+    DIRENTRY    dir;
+
+    if (!fo->flags.write)
+        return 0;
+
+    if (!FileSelect (fo))
+        return EOF;
+
+    if (FileNeedWrite(fo))
+        if (FileFlush(fo))
+            return EOF;
+
+    if (WriteFAT (fo->dsk, 0, 0, TRUE))
+        return EOF;
+
+    if (!WriteFSInfo (fo->dsk))
+        return EOF;
+
+    fHandle = fo->entry;
+    dir = LoadDirAttrib(fo, &fHandle);
+    if (dir == NULL)
+        return EOF;
+
+    #ifdef INCREMENTTIMESTAMP
+        IncrementTimeStamp(dir);
+    #elif defined USERDEFINEDCLOCK
+        dir->DIR_WrtTime = gTimeWrtTime;
+        dir->DIR_WrtDate = gTimeWrtDate;
+    #elif defined USEREALTIMECLOCK
+        CacheTime();
+        dir->DIR_WrtTime = gTimeWrtTime;
+        dir->DIR_WrtDate = gTimeWrtDate;
+    #endif
+
+    dir->DIR_FileSize = fo->size;
+
+    if (!Write_File_Entry(fo, &fHandle))
+        return EOF;
+
+    if (!MediaSync())
+        return EOF;
+
+    return 0;
+}
+
+
+/******************************************************************************
+* Function:        int FSsync (void)
+*
+* PreCondition:    None
+*
+* Input:           None
+*
+* Output:          0              - Everything written so far is on the
+*                                   media
+*                  EOF            - Something could not be written
+*
+* Side Effects:    None
+*
+* Overview:        Write everything the file system holds for every mounted
+*                  volume to the media
+*
+* Note:            Files open for writing are flushed with FSfflush.  With
+*                  FS_DYNAMIC_MEM the open files aren't known, so only the
+*                  data buffer, the FAT cache, the write cache and the
+*                  write queue are written; call FSfflush for each file to
+*                  update its size on the media too.
+*****************************************************************************/
+
+int FSsync (void)
+{
+    BYTE    v;
+    DISK *  dsk;
+    int     error = 0;
+    #ifndef FS_DYNAMIC_MEM
+        WORD    fIndex;
+
+        for (fIndex = 0; fIndex < FS_MAX_FILES_OPEN; fIndex++)
+        {
+            if (!gFileSlotOpen[fIndex] && FSfflush (&gFileArray[fIndex]))
+                error = EOF;
+        }
+    #endif
+
+    for (v = 0; v < FS_MAX_VOLUMES; v++)
+    {
+        dsk = &gDiskData[v];
+        if (!dsk->mount)
+            continue;
+
+        if (!VolumeSelect (dsk))
+        {
+            error = EOF;
+            continue;
+        }
+        if (gNeedDataWrite)
+            if (flushData())
+                error = EOF;
+        if (WriteFAT (dsk, 0, 0, TRUE))
+            error = EOF;
+        if (!MediaSync())
+            error = EOF;
+    }
+
+    return error;
+}
+#endif
+
+
 
 
 /******************************************************************************
@@ -2381,7 +4558,7 @@ BYTE Fill_File_Object(FILEOBJ fo, WORD *fHandle)
     BYTE        test = 0;
     
     // Get the entry
-    if (((*fHandle & 0xf) == 0) && (*fHandle != 0))
+    if ((DIRENTRY_INDEX (fo->dsk, *fHandle) == 0) && (*fHandle != 0))
     {
         fo->dirccls = fo->dirclus;
         dir = Cache_File_Entry(fo, fHandle, TRUE);
@@ -2390,17 +4567,22 @@ BYTE Fill_File_Object(FILEOBJ fo, WORD *fHandle)
     {
         dir = Cache_File_Entry (fo, fHandle, FALSE);
     }
-    
-    // Read the first char of the file name 
-    a = dir->DIR_Name[0]; 
+
+#ifdef SUPPORT_LFN
+    // Put together the long name of the 8.3 entry that follows
+    LfnCollect (fo, *fHandle, dir);
+#endif
     
     // Make sure there is a directory left
-    if(dir == (DIRENTRY)NULL || a == DIR_EMPTY)
+    if(dir == (DIRENTRY)NULL || dir->DIR_Name[0] == DIR_EMPTY)
     {                  
         status = NO_MORE;
     }
     else
     {
+        // Read the first char of the file name 
+        a = dir->DIR_Name[0]; 
+
         // Check for empty or deleted directory
         if ( a == DIR_DEL)
             status = NOT_FOUND;
@@ -2455,9 +4637,7 @@ BYTE Fill_File_Object(FILEOBJ fo, WORD *fHandle)
             fo->size = (dir->DIR_FileSize);
             
             // Now store the cluster
-            temp = (dir->DIR_FstClusHI);
-            temp = temp << 16;
-            temp |= dir->DIR_FstClusLO;
+            temp = GetFullClusterNumber (fo->dsk, dir);
             fo->cluster = temp;
             
             // get the date and time      
@@ -2562,8 +4742,11 @@ CETYPE FILEerase( FILEOBJ fo, WORD *fHandle, BYTE EraseClusters)
     DIRENTRY    dir;
     BYTE        a;           
     CETYPE      status = CE_GOOD;   
-    WORD        clus;  
+    DWORD       clus;  
     DISK *      disk;
+#ifdef SUPPORT_LFN
+    BYTE        sum;
+#endif
     
     disk = fo->dsk;    
     
@@ -2595,10 +4778,13 @@ CETYPE FILEerase( FILEOBJ fo, WORD *fHandle, BYTE EraseClusters)
             a = dir->DIR_Attr; 
     
             /* 8.3 File Name - entry*/
+        #ifdef SUPPORT_LFN
+            sum = LfnChecksum (dir->DIR_Name);
+        #endif
             dir->DIR_Name[0] = DIR_DEL; // mark as deleted
             
             // Get the starting cluster
-            clus = dir->DIR_FstClusLO;
+            clus = GetFullClusterNumber (disk, dir);
     
             // Now write it 
             if(status != CE_GOOD || !(Write_File_Entry( fo, fHandle)))
@@ -2613,6 +4799,17 @@ CETYPE FILEerase( FILEOBJ fo, WORD *fHandle, BYTE EraseClusters)
                         status = ((FAT_erase_cluster_chain(clus, disk)) ? CE_GOOD : CE_ERASE_FAIL);    
                     }
                 }
+            #ifdef SUPPORT_LFN
+                // The long name entries in front of it go too
+                if ((status == CE_GOOD) && !LfnErase (fo, *fHandle, sum))
+                    status = CE_ERASE_FAIL;
+            #endif
+            #ifdef FS_DIR_CACHE_SIZE
+                // The entries of a removed directory are cached under its
+                // cluster, which may now be given to a new directory
+                if (a & ATTR_DIRECTORY)
+                    DirCacheInvalidate();
+            #endif
             }
         } // Not already deleted
     }// Not existant
@@ -2647,18 +4844,23 @@ int FSrename (const char * fileName, FSFILE * fo)
     char string[12];
     WORD fHandle = 1, goodHandle;
     DIRENTRY    dir;
+#ifdef SUPPORT_LFN
+    BYTE        sum;
+#endif
 
 #ifdef ALLOW_DIRS
-    WORD        dirclus;
+    DWORD       dirclus;
     DWORD       sector;
     BYTE        offset2;
 
     if (fo == NULL)
     {
         // If fo == NULL, rename the CWD
+        if (!CurrentVolumeSelect())
+            return -1;
     
         // You can't rename the root directory
-        if (cwdptr->dirclus == 0)
+        if (cwdptr->dirclus == FatRootDirClusterValue(cwdptr->dsk))
             return -1;
     
         for (j = 0; (j < 11) && (*(fileName + j) != 0); j++)
@@ -2678,8 +4880,11 @@ int FSrename (const char * fileName, FSFILE * fo)
         // Load the dotdot entry
         dir = Cache_File_Entry (cwdptr, &fHandle, TRUE);
         // Change the directory cluster of the CWD to point to the previous dir
-        cwdptr->dirccls = dir->DIR_FstClusLO;
-        cwdptr->dirclus = dir->DIR_FstClusLO;
+        cwdptr->dirclus = GetFullClusterNumber (cwdptr->dsk, dir);
+        // A dotdot entry of 0 means the root
+        if (cwdptr->dirclus == 0)
+            cwdptr->dirclus = FatRootDirClusterValue(cwdptr->dsk);
+        cwdptr->dirccls = cwdptr->dirclus;
     
         // Load the first entry of the previous dir
         // Start at 0 in case it's the root
@@ -2698,8 +4903,8 @@ int FSrename (const char * fileName, FSFILE * fo)
         else
             k = 0;
         // Look through it until we find the cluster to rename
-        while ((dir->DIR_FstClusLO != dirclus) || 
-            ((dir->DIR_FstClusLO == dirclus) && 
+        while ((GetFullClusterNumber (cwdptr->dsk, dir) != dirclus) || 
+            ((GetFullClusterNumber (cwdptr->dsk, dir) == dirclus) && 
             (((unsigned char)dir->DIR_Name[0] == 0xE5) || (dir->DIR_Attr == ATTR_VOLUME) || (dir->DIR_Attr == ATTR_LONG_NAME)))) 
         {
             // Look through the entries until we get the
@@ -2748,6 +4953,9 @@ int FSrename (const char * fileName, FSFILE * fo)
         cwdptr->dirccls = cwdptr->dirclus;
         dir = Cache_File_Entry (cwdptr, &fHandle, TRUE);
     
+    #ifdef SUPPORT_LFN
+        sum = LfnChecksum (dir->DIR_Name);
+    #endif
         // Found it- now copy the name
         for (j = 0; j < 11; j++)
         {
@@ -2758,15 +4966,25 @@ int FSrename (const char * fileName, FSFILE * fo)
         // Figure out the base cluster for this directory
         sector = Cluster2Sector (cwdptr->dsk, cwdptr->dirccls);
         // Figure how how many sectors we've gone into the dir
-        offset2  = (fHandle >> 4);
+        offset2  = DIRENTRY_SECTOR (cwdptr->dsk, fHandle);
         // If it's not the root dir, it's cluster based
         if(cwdptr->dirclus != 0)
             offset2 = offset2 % (cwdptr->dsk->SecPerClus);
     
+#ifdef FS_DIR_CACHE_SIZE
+        DirCacheForget (cwdptr->dirclus, fHandle);
+#endif
+        ReadAheadForget (sector + offset2, 1);
         if (SectorWrite((sector + offset2), cwdptr->dsk->buffer, FALSE) == FALSE)
         {
             return -1;
         }
+
+    #ifdef SUPPORT_LFN
+        // Directories are renamed to 8.3 names only; drop an old long name
+        if (!LfnErase (cwdptr, fHandle, sum))
+            return -1;
+    #endif
     
         j = 0;
         while ((string[j] != 0x20) && (j < 11))
@@ -2774,7 +4992,7 @@ int FSrename (const char * fileName, FSFILE * fo)
     
         string[j] = 0x00;
     
-        FSchdir (string);
+        chdirhelper (0, string, NULL);
     }
     else
     {
@@ -2783,17 +5001,21 @@ int FSrename (const char * fileName, FSFILE * fo)
     if (fo == NULL)
         return -1;
 #endif
+    if (!FileSelect (fo))
+        return -1;
+
     // If fo != NULL, rename the file
-    if (FormatFileName (fileName, fo->name, 0) == FALSE)
+    if (FormatFileName (fileName, string, 0) == FALSE)
     {
+    #ifdef SUPPORT_LFN
+        // Not an 8.3 name; give the file a long name
+        return LfnRename (fileName, fo);
+    #else
         return -1;
+    #endif
     }
     else
     {
-        for (j = 0; j < 11; j++)
-        {
-            string[j] = fo->name[j];
-        }
         goodHandle = fo->entry;
     
         fHandle = 0;
@@ -2844,14 +5066,24 @@ int FSrename (const char * fileName, FSFILE * fo)
             return -1;
         }
     
+    #ifdef SUPPORT_LFN
+        sum = LfnChecksum (dir->DIR_Name);
+    #endif
         for (j = 0; j < 11; j++)
         {
-            dir->DIR_Name[j] = fo->name[j];
+            fo->name[j] = string[j];
+            dir->DIR_Name[j] = string[j];
         }
     
         // just write the last entry in
         if(!Write_File_Entry(fo,&fHandle))
             return -1;
+
+    #ifdef SUPPORT_LFN
+        // An old long name would no longer match the 8.3 name
+        if (!LfnErase (fo, fHandle, sum))
+            return -1;
+    #endif
     }
     
     #ifdef ALLOW_DIRS
@@ -2863,6 +5095,84 @@ int FSrename (const char * fileName, FSFILE * fo)
 
 #endif // Allow writes
 
+
+/******************************************************************************
+* Function:        int LfnRename (const char * fileName, FSFILE * fo)
+*
+* PreCondition:    fileName is not a valid 8.3 name
+*
+* Input:           fileName   - The new long name of the file
+*                  fo         - The file to rename
+*
+* Output:          int        - Returns 0 if success, -1 otherwise
+*
+* Side Effects:    None
+*
+* Overview:        Give a file a long name
+*
+* Note:            The long name may need more entries than are free in
+*                  front of the file's entry, so the entry is moved: the
+*                  new long name and 8.3 entries are written first, then the
+*                  old ones are deleted. The directory work is done on a
+*                  copy of fo so an open file keeps its position.
+*****************************************************************************/
+
+#if defined(SUPPORT_LFN) && defined(ALLOW_WRITES)
+int LfnRename (const char * fileName, FSFILE * fo)
+{
+    FSFILE      f;
+    FSFILE      gblFileTemp;
+    BYTE        entry[DIR_ESIZE];
+    char        alias[DIR_NAMECOMP];
+    WORD        fHandle, oldHandle = fo->entry;
+    BYTE        count;
+    DIRENTRY    dir;
+    int         result = -1;
+
+    if (!LfnSetSearch (fileName))
+        return -1;
+
+    // Make sure no other file has the name
+    FileObjectCopy (&f, fo);
+    f.entry = 0;
+    FileObjectCopy (&gblFileTemp, &f);
+    if ((FILEfind (&f, &gblFileTemp, 1, 2) != CE_GOOD) || (f.entry == oldHandle))
+    {
+        FileObjectCopy (&f, fo);
+        fHandle = oldHandle;
+        if ((dir = LoadDirAttrib (&f, &fHandle)) != NULL)
+        {
+            memcpy (entry, dir, DIR_ESIZE);
+            count = (gLfnSearchLen + LFN_CHARS_PER_ENTRY - 1) / LFN_CHARS_PER_ENTRY;
+            fHandle = 0;
+
+            if (LfnMakeAlias (&f, alias) && FindEmptyEntries (&f, &fHandle, count + 1) &&
+                LfnWriteEntries (&f, alias, fHandle, count))
+            {
+                // Copy the 8.3 entry in behind its long name, with the alias
+                fHandle += count;
+                f.dirccls = f.dirclus;
+                if ((dir = Cache_File_Entry (&f, &fHandle, TRUE)) != NULL)
+                {
+                    memcpy (dir, entry, DIR_ESIZE);
+                    memcpy (dir, alias, DIR_NAMECOMP);
+                    if (Write_File_Entry (&f, &fHandle) &&
+                        (FILEerase (&f, &oldHandle, FALSE) == CE_GOOD))
+                    {
+                        memcpy (fo->name, alias, DIR_NAMECOMP);
+                        fo->entry = fHandle;
+                        result = 0;
+                    }
+                }
+            }
+        }
+    }
+
+    gLfnSearchLen = 0;
+    return result;
+}
+#endif
+
 /******************************************************************************
 * Function:        FSFILE * FSfopen (const char * fileName, const char *mode)
 *
@@ -2893,6 +5203,10 @@ FSFILE * FSfopen( const char * fileName, const char *mode )
     WORD        fHandle;
     CETYPE      final;
     
+    // A drive letter in front of the name picks the volume
+    if ((fileName = VolumeFromName (fileName)) == NULL)
+        return NULL;
+
     if (WriteProtectState())
     {
         return NULL;
@@ -2900,6 +5214,16 @@ FSFILE * FSfopen( const char * fileName, const char *mode )
     
     #ifdef FS_DYNAMIC_MEM
         filePtr = (FILEOBJ) FS_malloc(sizeof(FSFILE));
+        if( filePtr == NULL )
+            return NULL;
+        #ifdef FS_FILE_BUFFERS
+            filePtr->buffer = (BYTE *) FS_malloc(MEDIA_SECTOR_SIZE);
+            if( filePtr->buffer == NULL )
+            {
+                FS_free( (unsigned char *)filePtr );
+                return NULL;
+            }
+        #endif
     #else
     
         filePtr = NULL;
@@ -2911,6 +5235,10 @@ FSFILE * FSfopen( const char * fileName, const char *mode )
             {
                 gFileSlotOpen[fIndex] = FALSE;
                 filePtr = &gFileArray[fIndex];
+                #ifdef FS_FILE_BUFFERS
+                    // each slot has its own sector buffer
+                    filePtr->buffer = gFileBuffer[fIndex];
+                #endif
                 break;
             }
         }
@@ -2920,9 +5248,20 @@ FSFILE * FSfopen( const char * fileName, const char *mode )
     #endif
     
     //Format the source string.
-    if( !FormatFileName(fileName, filePtr->name, 0) )
+    #ifdef SUPPORT_LFN
+        gLfnSearchLen = 0;
+    #endif
+    if( !FormatFileName(fileName, filePtr->name, 0)
+    #ifdef SUPPORT_LFN
+        // Names that aren't 8.3 are looked up and created as long names
+        && !LfnSetSearch (fileName)
+    #endif
+        )
     {
         #ifdef FS_DYNAMIC_MEM
+            #ifdef FS_FILE_BUFFERS
+                FS_free( filePtr->buffer );
+            #endif
             FS_free( (unsigned char *)filePtr );
         #else
             gFileSlotOpen[fIndex] = TRUE;   //put this slot back to the pool
@@ -2933,7 +5272,7 @@ FSFILE * FSfopen( const char * fileName, const char *mode )
     //Read the mode character
     ModeC = mode[0];
     
-    filePtr->dsk = &gDiskData;
+    filePtr->dsk = gActiveDisk;
     filePtr->cluster = 0;
     filePtr->ccls    = 0;
     filePtr->entry = 0;
@@ -2944,15 +5283,15 @@ FSFILE * FSfopen( const char * fileName, const char *mode )
         filePtr->dirclus    = cwdptr->dirclus;
         filePtr->dirccls    = cwdptr->dirccls;
     #else
-        filePtr->dirclus = 0;
-        filePtr->dirccls = 0;
+        filePtr->dirclus = FatRootDirClusterValue(gActiveDisk);
+        filePtr->dirccls = filePtr->dirclus;
     #endif
     
     // copy file object over
     FileObjectCopy(&gblFileTemp, filePtr);
     
     // See if the file is found
-    if(FILEfind (filePtr, &gblFileTemp, 1, 0) == CE_GOOD)
+    if(FILEfind (filePtr, &gblFileTemp, 1, FindNameMode()) == CE_GOOD)
     {
         // File is Found
         switch(ModeC)
@@ -3066,6 +5405,9 @@ FSFILE * FSfopen( const char * fileName, const char *mode )
     #ifdef FS_DYNAMIC_MEM
         if( final != CE_GOOD )
         {
+            #ifdef FS_FILE_BUFFERS
+                FS_free( filePtr->buffer );
+            #endif
             FS_free( (unsigned char *)filePtr );
             filePtr = NULL;
         }
@@ -3077,8 +5419,47 @@ FSFILE * FSfopen( const char * fileName, const char *mode )
         }
     #endif
 
+    #ifdef SUPPORT_LFN
+        gLfnSearchLen = 0;
+    #endif
+
+    return filePtr;
+}
+
+
+/******************************************************************************
+* Function:        FSFILE * FSfopenReserve (const char * fileName,
+*                                           const char * mode, DWORD size)
+*
+* PreCondition:    For read modes, file exists; FSInit performed
+*
+* Input:           fileName    - The name of the file to open
+*                  mode        - The mode, as for FSfopen
+*                  size        - Number of bytes the caller expects to write
+*
+* Output:          FSFILE *    - The pointer to the file object
+*
+* Side Effects:    None
+*
+* Overview:        Open a file and reserve room for it to grow by size bytes
+*
+* Note:            The reservation is a hint; the file is still returned if
+*                  FSfallocate could not find the space
+*****************************************************************************/
+
+#ifdef ALLOW_WRITES
+FSFILE * FSfopenReserve (const char * fileName, const char * mode, DWORD size)
+{
+    FSFILE *    filePtr;
+
+    filePtr = FSfopen (fileName, mode);
+
+    if ((filePtr != NULL) && filePtr->flags.write && (size != 0))
+        FSfallocate (filePtr, filePtr->size + size);
+
     return filePtr;
 }
+#endif
 
 /******************************************************************************
 * Function:        long FSftell (FSFILE * fo)
@@ -3125,16 +5506,26 @@ int FSremove (const char * fileName)
     FILEOBJ fo = &f;
     CETYPE  result;
 
+    if ((fileName = VolumeFromName (fileName)) == NULL)
+        return -1;
+
     if (WriteProtectState())
     {
         return (-1);
     }
 
     //Format the source string
-    if( !FormatFileName(fileName, fo->name, 0) )
+    #ifdef SUPPORT_LFN
+        gLfnSearchLen = 0;
+    #endif
+    if( !FormatFileName(fileName, fo->name, 0)
+    #ifdef SUPPORT_LFN
+        && !LfnSetSearch (fileName)
+    #endif
+        )
         return -1;
 
-    fo->dsk = &gDiskData;
+    fo->dsk = gActiveDisk;
     fo->cluster = 0;
     fo->ccls    = 0;
     fo->entry = 0;
@@ -3142,8 +5533,8 @@ int FSremove (const char * fileName)
     
     #ifndef ALLOW_DIRS
         // start at the root directory
-        fo->dirclus    = 0;
-        fo->dirccls    = 0;
+        fo->dirclus    = FatRootDirClusterValue(gActiveDisk);
+        fo->dirccls    = fo->dirclus;
     #else
         fo->dirclus = cwdptr->dirclus;
         fo->dirccls = cwdptr->dirccls;
@@ -3153,13 +5544,20 @@ int FSremove (const char * fileName)
     FileObjectCopy(&gblFileTemp, fo);
     
     // See if the file is found
-    result = FILEfind (fo, &gblFileTemp, 1, 0);
+    result = FILEfind (fo, &gblFileTemp, 1, FindNameMode());
+    #ifdef SUPPORT_LFN
+        gLfnSearchLen = 0;
+    #endif
     
     if (result != CE_GOOD)
         return -1;
     result = FILEerase(fo, &fo->entry, TRUE);
     if( result == CE_GOOD )
+    {
+        if (!WriteFSInfo (fo->dsk))
+            return -1;
         return 0;
+    }
     else
         return -1;
 }
@@ -3184,14 +5582,20 @@ int FSremove (const char * fileName)
 void FSrewind (FSFILE * fo)
 {
     #ifdef ALLOW_WRITES
-        if (gNeedDataWrite)
-            flushData();
+        if (FileSelect (fo) && FileNeedWrite(fo))
+            FileFlush(fo);
     #endif
     fo->seek = 0;
     fo->pos = 0;
     fo->sec = 0;
     fo->ccls = fo->cluster;
-    gBufferOwner = NULL;
+    fo->flags.FileWriteEOF = FALSE;
+    #ifdef FS_READ_AHEAD_SECTORS
+        fo->seqreads = 0;
+    #endif
+    #ifndef FS_FILE_BUFFERS
+        gBufferOwner = NULL;
+    #endif
     return;
 }
 
@@ -3213,8 +5617,8 @@ void FSrewind (FSFILE * fo)
 
 void FileObjectCopy(FILEOBJ foDest,FILEOBJ foSource)
 {
-    BYTE    i;
-    BYTE    size;
+    WORD    i;
+    WORD    size;
     BYTE *  dest;
     BYTE *  source;
     
@@ -3230,7 +5634,7 @@ void FileObjectCopy(FILEOBJ foDest,FILEOBJ foSource)
 }
 
 /******************************************************************************
-* Function:        CETYPE FILECreateHeadCluster( FILEOBJ fo, WORD *cluster)
+* Function:        CETYPE FILECreateHeadCluster( FILEOBJ fo, DWORD *cluster)
 *
 * PreCondition:    Disk mounted
 *
@@ -3249,7 +5653,7 @@ void FileObjectCopy(FILEOBJ foDest,FILEOBJ foSource)
 *****************************************************************************/
 
 #ifdef ALLOW_WRITES
-CETYPE FILECreateHeadCluster( FILEOBJ fo, WORD *cluster)
+CETYPE FILECreateHeadCluster( FILEOBJ fo, DWORD *cluster)
 {
     DISK *  disk;
     CETYPE  error = CE_GOOD;
@@ -3269,11 +5673,16 @@ CETYPE FILECreateHeadCluster( FILEOBJ fo, WORD *cluster)
             if(WriteFAT( disk, *cluster, LAST_CLUSTER_FAT12, FALSE) == CLUSTER_FAIL)
                 error = CE_WRITE_ERROR;
         }
-        else
+        else if(disk->type == FAT16) 
         {        
             if(WriteFAT( disk, *cluster, LAST_CLUSTER_FAT16, FALSE) == CLUSTER_FAIL)
                 error = CE_WRITE_ERROR;
         }
+        else
+        {        
+            if(WriteFAT( disk, *cluster, LAST_CLUSTER_FAT32, FALSE) == CLUSTER_FAIL)
+                error = CE_WRITE_ERROR;
+        }
     
         // lets erase this cluster                
         if(error == CE_GOOD)
@@ -3286,7 +5695,7 @@ CETYPE FILECreateHeadCluster( FILEOBJ fo, WORD *cluster)
 #endif
 
 /******************************************************************************
-* Function:        BYTE EraseCluster(DISK *disk, WORD cluster)
+* Function:        BYTE EraseCluster(DISK *disk, DWORD cluster)
 *
 * PreCondition:    File opened
 *
@@ -3300,13 +5709,13 @@ CETYPE FILECreateHeadCluster( FILEOBJ fo, WORD *cluster)
 *
 * Overview:        Erase the passed cluster
 *
-* Note:            Should not be called by user
+* Note:            The whole cluster is cleared with one SectorZeroMultiple
+*                  call. Should not be called by user
 *****************************************************************************/
 
 #ifdef ALLOW_WRITES
-BYTE EraseCluster(DISK *disk, WORD cluster)
+BYTE EraseCluster(DISK *disk, DWORD cluster)
 {
-    BYTE index;
     DWORD SectorAddress;
     BYTE error = CE_GOOD;
 
@@ -3316,52 +5725,133 @@ BYTE EraseCluster(DISK *disk, WORD cluster)
             return EOF;
 
     gBufferOwner = NULL;
+    gDirSectorRead = 0xFFFFFFFF;
+
+    if (gBufferZeroed == FALSE)
+    {
+        // clear out the memory first
+        memset(disk->buffer, 0x00, MEDIA_SECTOR_SIZE);
+        gBufferZeroed = TRUE;   
+    }
+
+    // Now clear them out
+    ReadAheadForget (SectorAddress, disk->SecPerClus);
+    if (SectorZeroMultiple (SectorAddress, disk->SecPerClus, disk->buffer, 1) != TRUE)
+        error = CE_WRITE_ERROR;
+    return(error);
+}
+#endif
+
+/******************************************************************************
+* Function:        DWORD Cluster2Sector(DISK * dsk, DWORD cluster)
+*
+* PreCondition:    Disk mounted
+*
+* Input:           disk      - Disk structure
+*                  cluster   - Cluster to be converted
+*                  
+* Output:          sector    - Sector that corresponds to given cluster
+*
+* Side Effects:    None
+*
+* Overview:        Given a cluster, figure out the sector number
+*
+* Note:            Should not be called by user
+*****************************************************************************/
+
+DWORD Cluster2Sector(DISK * dsk, DWORD cluster)
+{
+    DWORD sector;
+    
+    // The root dir takes up cluster 0 and 1 
+    if(cluster == 0 ||cluster == 1)
+        sector = dsk->root + cluster;
+    else
+        sector = ((cluster-2) * dsk->SecPerClus) + dsk->data;
+    return(sector);
+}
+
+/******************************************************************************
+* Function:        DWORD GetFullClusterNumber (DISK * dsk, DIRENTRY entry)
+*
+* PreCondition:    Disk mounted
+*
+* Input:           dsk       - Disk structure
+*                  entry     - Directory entry
+*                  
+* Output:          DWORD     - First cluster of the entry
+*
+* Side Effects:    None
+*
+* Overview:        Reads the first cluster number out of a directory entry
+*
+* Note:            The high word is only part of the cluster number on FAT32;
+*                  FAT12/16 use that field for other things.
+*****************************************************************************/
 
-    if (gBufferZeroed == FALSE)
-    {
-        // clear out the memory first
-        memset(disk->buffer, 0x00, MEDIA_SECTOR_SIZE);
-        gBufferZeroed = TRUE;   
-    }
+DWORD GetFullClusterNumber (DISK * dsk, DIRENTRY entry)
+{
+    DWORD cluster = 0;
 
-    // Now clear them out
-    for(index = 0; index < disk->SecPerClus && error == CE_GOOD; index++)
-    {
-        if (SectorWrite( SectorAddress++, disk->buffer, FALSE) != TRUE) 
-            error = CE_WRITE_ERROR;
-    }
-    return(error);
-}
+#ifdef SUPPORT_FAT32
+    if (dsk->type == FAT32)
+        cluster = ((DWORD)entry->DIR_FstClusHI) << 16;
 #endif
+    cluster |= entry->DIR_FstClusLO;
+    return(cluster);
+}
 
 /******************************************************************************
-* Function:        DWORD Cluster2Sector(DISK * dsk, WORD cluster)
+* Function:        BYTE WriteFSInfo (DISK * dsk)
 *
 * PreCondition:    Disk mounted
 *
-* Input:           disk      - Disk structure
-*                  cluster   - Cluster to be converted
+* Input:           dsk       - Disk structure
 *                  
-* Output:          sector    - Sector that corresponds to given cluster
+* Output:          TRUE      - FSInfo sector is up to date (or there is none)
+*                  FALSE     - The sector could not be read or written
 *
-* Side Effects:    None
+* Side Effects:    Flushes the FAT cache and borrows its first slot
 *
-* Overview:        Given a cluster, figure out the sector number
+* Overview:        Stores the free cluster count and the next free cluster
+*                  hint in the FAT32 FSInfo sector
 *
 * Note:            Should not be called by user
 *****************************************************************************/
 
-DWORD Cluster2Sector(DISK * dsk, WORD cluster)
+#ifdef ALLOW_WRITES
+BYTE WriteFSInfo (DISK * dsk)
 {
-    DWORD sector;
-    
-    // The root dir takes up cluster 0 and 1 
-    if(cluster == 0 ||cluster == 1)
-        sector = dsk->root + cluster;
-    else
-        sector = (((DWORD)cluster-2) * dsk->SecPerClus) + dsk->data;
-    return(sector);
+#ifdef SUPPORT_FAT32
+    if ((dsk->type != FAT32) || (dsk->fsinfo == 0))
+        return TRUE;
+
+    // Put the changed FAT sectors on the media before
+    // the first cache slot is borrowed
+    if (WriteFAT (dsk, 0, 0, TRUE))
+        return FALSE;
+    if (gFATCacheDirty[0] && !FATCacheWriteBack (gFATCacheDisk[0], 0))
+        return FALSE;
+
+    gFATCacheSector[0] = FAT_CACHE_EMPTY;
+    gFATCacheDisk[0] = NULL;
+    if (!SectorRead (dsk->fsinfo, gFATBuffer[0]))
+        return FALSE;
+
+    // Nothing to do if the hints on the media already match
+    if ((RAMreadD (gFATBuffer[0], FSI_FREE_COUNT) == dsk->freecls) &&
+        (RAMreadD (gFATBuffer[0], FSI_NXT_FREE) == dsk->nextfree))
+        return TRUE;
+
+    RAMwriteD (gFATBuffer[0], FSI_FREE_COUNT, dsk->freecls);
+    RAMwriteD (gFATBuffer[0], FSI_NXT_FREE, dsk->nextfree);
+
+    if (!SectorWrite (dsk->fsinfo, gFATBuffer[0], FALSE))
+        return FALSE;
+#endif
+    return TRUE;
 }
+#endif
 
 /******************************************************************************
 * Function:        size_t FSfwrite(const void *ptr, size_t size, size_t n, FSFILE *stream)
@@ -3379,7 +5869,10 @@ DWORD Cluster2Sector(DISK * dsk, WORD cluster)
 *
 * Overview:        Write file
 *
-* Note:            None
+* Note:            Data is copied into the sector buffer a sector at a time.
+*                  Whole sectors that start on a sector boundary are written
+*                  straight from the caller's buffer, up to the end of the
+*                  current cluster, without going through the sector buffer.
 *****************************************************************************/
 
 #ifdef ALLOW_WRITES
@@ -3392,7 +5885,10 @@ size_t FSfwrite(const void *ptr, size_t size, size_t n, FSFILE *stream)
     WORD        pos;
     DWORD       l;                     // absolute lba of sector to load
     DWORD       seek, filesize;
-    WORD        writeCount = 0;
+    DWORD       curcls;
+    DWORD       writeCount = 0;
+    DWORD       chunk;
+    WORD        run;
     
     // see if the file was opened in a write mode 
     if(!(stream->flags.write))
@@ -3404,6 +5900,9 @@ size_t FSfwrite(const void *ptr, size_t size, size_t n, FSFILE *stream)
     if (count == 0)   
         return 0;
     
+    if (!FileSelect (stream))
+        return 0;
+
     if (WriteProtectState())
     {
         error = CE_WRITE_PROTECTED;
@@ -3422,6 +5921,7 @@ size_t FSfwrite(const void *ptr, size_t size, size_t n, FSFILE *stream)
     l += (WORD)stream->sec;      // add the sector number to it
     
     
+#ifndef FS_FILE_BUFFERS
     // Check if the current stream was the last one to use the
     // buffer. If not, check if we need to write data from the
     // old stream
@@ -3433,19 +5933,22 @@ size_t FSfwrite(const void *ptr, size_t size, size_t n, FSFILE *stream)
                 return 0;
         }
         gBufferOwner = stream;
+        gDirSectorRead = 0xFFFFFFFF;
     }
-    if (gLastDataSectorRead != l)
+#endif
+    // A stream left at the end of a sector moves on to the next one below
+    if ((FileBufferSector(stream) != l) && (pos != dsk->sectorSize))
     {
-        if (gNeedDataWrite)
+        if (FileNeedWrite(stream))
         {
-            if (flushData())
+            if (FileFlush(stream))
                 return 0;
         }
     
         gBufferZeroed = FALSE;
-        if(!SectorRead( l, dsk->buffer) )
+        if(!SectorRead( l, FileBuffer(stream)) )
             error = CE_BAD_SECTOR_READ;
-        gLastDataSectorRead = l;
+        FileBufferSector(stream) = l;
     }   
     // exit loop if EOF reached 
     filesize = stream->size;
@@ -3457,12 +5960,12 @@ size_t FSfwrite(const void *ptr, size_t size, size_t n, FSFILE *stream)
             stream->flags.FileWriteEOF = TRUE;
     
         // load a new sector if necessary, multiples of sector
-        if (pos == MEDIA_SECTOR_SIZE) 
+        if (pos == dsk->sectorSize) 
         {    
             BYTE needRead = TRUE;
     
-            if (gNeedDataWrite)
-                if (flushData())
+            if (FileNeedWrite(stream))
+                if (FileFlush(stream))
                     return EOF;
     
             // reset position
@@ -3478,7 +5981,14 @@ size_t FSfwrite(const void *ptr, size_t size, size_t n, FSFILE *stream)
     
                 if(stream->flags.FileWriteEOF)
                 {
-                    error = FILEallocate_new_cluster(stream, 0);    // add new cluster to the file
+                    // Move into clusters reserved by FSfallocate before
+                    // allocating new ones
+                    curcls = stream->ccls;
+                    if ((error = FILEget_next_cluster( stream, 1)) == CE_FAT_EOF)
+                    {
+                        stream->ccls = curcls;
+                        error = FILEallocate_new_cluster(stream, 0);    // add new cluster to the file
+                    }
                     needRead = FALSE;
                 }
                 else
@@ -3492,40 +6002,87 @@ size_t FSfwrite(const void *ptr, size_t size, size_t n, FSFILE *stream)
             {
                 l = Cluster2Sector(dsk,stream->ccls);
                 l += (WORD)stream->sec;      // add the sector number to it
+
+                // If the caller has at least one whole sector for us, write
+                // it straight from their buffer. The run stops at the end of
+                // this cluster so the next one is found (or allocated) by
+                // the code above.
+                if (count >= dsk->sectorSize)
+                {
+                    run = dsk->SecPerClus - stream->sec;
+                    if (run > (count / dsk->sectorSize))
+                        run = count / dsk->sectorSize;
+
+                    ReadAheadForget (l, run);
+                    if (SectorWriteMultiple (l, run, src, FALSE) != TRUE)
+                        return 0;
+
+                    // The sector buffer may hold an old copy of one of them
+                    if ((FileBufferSector(stream) >= l) && (FileBufferSector(stream) < (l + run)))
+                        FileBufferSector(stream) = 0xFFFFFFFF;
+
+                    // Leave the stream at the end of the last sector we
+                    // wrote so the next access advances past it
+                    stream->sec += run - 1;
+                    pos = dsk->sectorSize;
+                    chunk = (DWORD)run * dsk->sectorSize;
+                    src += chunk;
+                    seek += chunk;
+                    count -= chunk;
+                    writeCount += chunk;
+                    if (seek > filesize)
+                    {
+                        filesize = seek;
+                        stream->flags.FileWriteEOF = TRUE;
+                    }
+                    continue;
+                }
+
+            #ifndef FS_FILE_BUFFERS
                 gBufferOwner = stream;
-                // If we just allocated a new cluster, then the cluster will
-                // contain garbage data, so it doesn't matter what we write to it
-                // Whatever is in the buffer will work fine
-                if (needRead)
+                gDirSectorRead = 0xFFFFFFFF;
+            #endif
+                // If we are past the end of the file, or just allocated a new
+                // cluster, the sector holds garbage data, so it doesn't matter
+                // what we write to it. Whatever is in the buffer will work fine.
+                if (needRead && (seek < filesize))
                 {
-                    if( !SectorRead( l, dsk->buffer) )
+                    if( !SectorRead( l, FileBuffer(stream)) )
                     {
                         error = CE_BAD_SECTOR_READ;
-                        gLastDataSectorRead = 0xFFFFFFFF;
+                        FileBufferSector(stream) = 0xFFFFFFFF;
                         return 0;
                     }
                     else
                     {
-                        gLastDataSectorRead = l;
+                        FileBufferSector(stream) = l;
                     }
                 }
                 else
-                    gLastDataSectorRead = l;
+                    FileBufferSector(stream) = l;
             }
         } //  load new sector
     
         if(error == CE_GOOD)
         {
-            // Write one byte at a time
-            RAMwrite(dsk->buffer, pos++, *(char *)src);
-            src = src + 1; // compiler bug
-            seek++;
-            count--;
-            writeCount++;
+            // copy the rest of this sector, or as much of it as we have
+            chunk = dsk->sectorSize - pos;
+            if (chunk > count)
+                chunk = count;
+
+            memcpy (FileBuffer(stream) + pos, src, chunk);
+            src += chunk;
+            pos += chunk;
+            seek += chunk;
+            count -= chunk;
+            writeCount += chunk;
             // now increment the size of the part
-            if(stream->flags.FileWriteEOF)
-                filesize++;             
-            gNeedDataWrite = TRUE;
+            if (seek > filesize)
+            {
+                filesize = seek;
+                stream->flags.FileWriteEOF = TRUE;
+            }
+            FileNeedWrite(stream) = TRUE;
         }
     } // while count
     
@@ -3540,51 +6097,398 @@ size_t FSfwrite(const void *ptr, size_t size, size_t n, FSFILE *stream)
     
     return(writeCount / size);
 } // fwrite
+
+
+/******************************************************************************
+* Function:        int FSfallocate (FSFILE * stream, DWORD size)
+*
+* PreCondition:    File opened in WRITE mode
+*
+* Input:           stream      - Pointer to file structure
+*                  size        - Number of bytes, from the start of the file,
+*                                that should have clusters behind them
+*
+* Output:          0           - The file's chain covers size bytes
+*                  EOF         - No run of free clusters was long enough, or
+*                                the FAT could not be read or written
+*
+* Side Effects:    None
+*
+* Overview:        Reserve space for a file that is going to grow
+*
+* Note:            The clusters that are missing are taken as one run of
+*                  free clusters, preferably right after the end of the
+*                  chain, and linked in a single pass over the FAT. FSfwrite
+*                  then moves into them without allocating. The file size
+*                  is not changed; reserved clusters that were not written
+*                  to are given back when the file is closed.
+*****************************************************************************/
+
+int FSfallocate (FSFILE * stream, DWORD size)
+{
+    DISK *      dsk;
+    DWORD       clusbytes, need, have;
+    DWORD       ccls, last, start, c;
+    BYTE        error = CE_GOOD;
+
+    if (!(stream->flags.write))
+        return EOF;
+
+    if (!FileSelect (stream))
+        return EOF;
+
+    if (WriteProtectState())
+        return EOF;
+
+    dsk = stream->dsk;
+
+    if (stream->cluster < 2)
+        return EOF;
+
+    clusbytes = (DWORD)dsk->SecPerClus * dsk->sectorSize;
+    need = (size + clusbytes - 1) / clusbytes;
+
+    // Follow the chain to its last cluster, counting as we go
+    ccls = stream->ccls;
+    stream->ccls = stream->cluster;
+    have = 1;
+    while (have < need)
+    {
+        last = stream->ccls;
+        if ((error = FILEget_next_cluster (stream, 1)) != CE_GOOD)
+        {
+            stream->ccls = last;
+            break;
+        }
+        have++;
+    }
+    last = stream->ccls;
+    stream->ccls = ccls;
+
+    if (error == CE_GOOD)
+        return 0;           // already big enough
+    if (error != CE_FAT_EOF)
+        return EOF;
+
+    need -= have;
+    if ((start = FATfindEmptyRun (dsk, last + 1, need)) == 0)
+        return EOF;
+
+    // Link the run together and end it before hanging it off the file, so
+    // the chain is never left pointing at clusters that are still free
+    for (c = start; c < start + need - 1; c++)
+    {
+        if (WriteFAT (dsk, c, c + 1, FALSE) == CLUSTER_FAIL)
+            return EOF;
+    }
+    if (WriteFAT (dsk, c, FatLastClusterValue(dsk), FALSE) == CLUSTER_FAIL)
+        return EOF;
+    if (WriteFAT (dsk, last, start, FALSE) == CLUSTER_FAIL)
+        return EOF;
+    if (WriteFAT (dsk, 0, 0, TRUE) == CLUSTER_FAIL)
+        return EOF;
+
+    dsk->nextfree = start + need;
+
+#ifdef FS_EXTENT_MAP_SIZE
+    ExtentMapAdd (stream, last, start);
+    for (c = start; c < start + need - 1; c++)
+        ExtentMapAdd (stream, c, c + 1);
+#endif
+
+    stream->flags.reserved = TRUE;
+
+    return 0;
+}
+
+
+/******************************************************************************
+* Function:        DWORD FATfindEmptyRun (DISK * dsk, DWORD first, DWORD count)
+*
+* PreCondition:    Disk mounted
+*
+* Input:           dsk     - The disk structure
+*                  first   - Cluster to start looking from
+*                  count   - Number of free clusters wanted in a row
+*
+* Output:          DWORD   - First cluster of the run; 0 if there is none
+*
+* Side Effects:    None
+*
+* Overview:        Find count free clusters that follow each other on the disk
+*
+* Note:            Should not be called by user. The search wraps around to
+*                  the start of the FAT once. Groups the free cluster map
+*                  knows to be full are skipped.
+*****************************************************************************/
+
+DWORD FATfindEmptyRun (DISK * dsk, DWORD first, DWORD count)
+{
+    DWORD   c, start, run, value;
+    BYTE    wrapped = FALSE;
+#ifdef FS_FREE_MAP_SIZE
+    DWORD   g;
+#endif
+
+    if ((first < 2) || (first >= dsk->maxcls))
+        first = 2;
+
+    c = start = first;
+    run = 0;
+
+    while (run < count)
+    {
+        // a run cannot go past the end of the FAT, start again from the top
+        if (c >= dsk->maxcls)
+        {
+            if (wrapped)
+                return 0;
+            c = start = 2;
+            run = 0;
+            wrapped = TRUE;
+        }
+
+        // every run from here on has been looked at already
+        if (wrapped && (start >= first))
+            return 0;
+
+    #ifdef FS_FREE_MAP_SIZE
+        // skip a group that has no free clusters in it
+        g = c >> gFreeMapShift;
+        if ((gFreeMap[g >> 3] & (1 << (g & 7))) == 0)
+        {
+            c = start = (g + 1) << gFreeMapShift;
+            run = 0;
+            continue;
+        }
+    #endif
+
+        if ((value = ReadFAT (dsk, c)) == CLUSTER_FAIL)
+            return 0;
+
+        c++;
+        if (value == CLUSTER_EMPTY)
+            run++;
+        else
+        {
+            start = c;
+            run = 0;
+        }
+    }
+
+    return start;
+}
+#endif
+
+
+/******************************************************************************
+* Function:        BYTE flushData (void)
+*
+* PreCondition:    File opened in WRITE mode, data needs to be written
+*
+* Input:           None
+*
+* Output:          BYTE - returns CE_GOOD if data was written successfully
+*
+* Side Effects:    None
+*
+* Overview:        Writes an unwritten buffer to the card if necessary
+*
+* Note:            None
+*****************************************************************************/
+
+#ifdef ALLOW_WRITES
+BYTE flushData (void)
+{
+    DWORD l;
+    DISK * dsk;
+    CETYPE error = CE_GOOD;
+    
+    // This will either be the pointer to the last file, or the handle
+    FILEOBJ stream = gBufferOwner;
+    
+    dsk = stream->dsk;
+    
+    // figure out the lba
+    l = Cluster2Sector(dsk,stream->ccls);
+    
+    l += (WORD)stream->sec;      // add the sector number to it
+    
+    ReadAheadForget (l, 1);
+    if(!SectorWrite( l, dsk->buffer, FALSE))
+    {
+        error = CE_WRITE_ERROR;
+        return EOF;
+    } 
+    
+    gNeedDataWrite = FALSE;
+    
+    return 0;
+}
+
+
+#ifdef FS_FILE_BUFFERS
+/******************************************************************************
+* Function:        BYTE FILEflush (FILEOBJ fo)
+*
+* PreCondition:    File opened in WRITE mode, data needs to be written
+*
+* Input:           fo   - The file whose buffer should be written
+*
+* Output:          BYTE - returns CE_GOOD if data was written successfully
+*
+* Side Effects:    None
+*
+* Overview:        Writes a file's own sector buffer to the card
+*
+* Note:            Used in place of flushData when every file has its
+*                  own buffer (FS_FILE_BUFFERS)
+*****************************************************************************/
+
+BYTE FILEflush (FILEOBJ fo)
+{
+    ReadAheadForget (fo->bufsec, 1);
+    if(!SectorWrite( fo->bufsec, fo->buffer, FALSE))
+        return EOF;
+
+    fo->bufdirty = FALSE;
+
+    return 0;
+}
+#endif
+#endif
+
+/******************************************************************************
+* Function:        BYTE MediaSelect (BYTE unit)
+*
+* PreCondition:    None
+*
+* Input:           unit       - The media unit to use
+*
+* Output:          TRUE       - The unit is there
+*                  FALSE      - There is no such unit
+*
+* Side Effects:    None
+*
+* Overview:        Stand-in for media layers that only drive one unit
+*
+* Note:            Should not be called by user
+*****************************************************************************/
+
+#ifdef FS_EMULATE_MEDIA_SELECT
+BYTE MediaSelect (BYTE unit)
+{
+    return (unit == 0);
+}
+#endif
+
+/******************************************************************************
+* Function:        BYTE SectorReadMultiple (DWORD sector, WORD count, BYTE * buffer)
+*
+* PreCondition:    Media initialized
+*
+* Input:           sector     - First sector to read
+*                  count      - Number of consecutive sectors
+*                  buffer     - Destination, count sectors
+*
+* Output:          TRUE       - All sectors read
+*                  FALSE      - A sector could not be read
+*
+* Side Effects:    None
+*
+* Overview:        Stand-in for media layers that do not provide their own
+*                  multiple sector read
+*
+* Note:            Should not be called by user
+*****************************************************************************/
+
+#ifdef FS_EMULATE_READ_MULTIPLE
+BYTE SectorReadMultiple (DWORD sector, WORD count, BYTE * buffer)
+{
+    while (count--)
+    {
+        if (!SectorRead (sector++, buffer))
+            return FALSE;
+        buffer += MediaSectorSize();
+    }
+    return TRUE;
+}
 #endif
 
+/******************************************************************************
+* Function:        BYTE SectorWriteMultiple (DWORD sector, WORD count,
+*                                            BYTE * buffer, BYTE allowWriteToZero)
+*
+* PreCondition:    Media initialized
+*
+* Input:           sector           - First sector to write
+*                  count            - Number of consecutive sectors
+*                  buffer           - Source, count sectors
+*                  allowWriteToZero - TRUE if sector 0 may be written
+*
+* Output:          TRUE       - All sectors written
+*                  FALSE      - A sector could not be written
+*
+* Side Effects:    None
+*
+* Overview:        Stand-in for media layers that do not provide their own
+*                  multiple sector write
+*
+* Note:            Should not be called by user
+*****************************************************************************/
+
+#ifdef FS_EMULATE_WRITE_MULTIPLE
+BYTE SectorWriteMultiple (DWORD sector, WORD count, BYTE * buffer, BYTE allowWriteToZero)
+{
+    while (count--)
+    {
+        if (SectorWrite (sector++, buffer, allowWriteToZero) != TRUE)
+            return FALSE;
+        buffer += MediaSectorSize();
+    }
+    return TRUE;
+}
+#endif
 
 /******************************************************************************
-* Function:        BYTE flushData (void)
+* Function:        BYTE SectorZeroMultiple (DWORD sector, DWORD count,
+*                                           BYTE * buffer, WORD bufferSectors)
 *
-* PreCondition:    File opened in WRITE mode, data needs to be written
+* PreCondition:    Media initialized
 *
-* Input:           None
+* Input:           sector           - First sector to clear
+*                  count            - Number of consecutive sectors
+*                  buffer           - bufferSectors sectors of zeros
+*                  bufferSectors    - Size of buffer in sectors
 *
-* Output:          BYTE - returns CE_GOOD if data was written successfully
+* Output:          TRUE             - All sectors cleared
+*                  FALSE            - A sector could not be written
 *
 * Side Effects:    None
 *
-* Overview:        Writes an unwritten buffer to the card if necessary
+* Overview:        Stand-in for media layers that cannot clear a run of
+*                  sectors themselves; writes the zero buffer over the run
+*                  as many times as it takes
 *
-* Note:            None
+* Note:            Should not be called by user
 *****************************************************************************/
 
-#ifdef ALLOW_WRITES
-BYTE flushData (void)
+#ifdef FS_EMULATE_ZERO_MULTIPLE
+BYTE SectorZeroMultiple (DWORD sector, DWORD count, BYTE * buffer, WORD bufferSectors)
 {
-    DWORD l;
-    DISK * dsk;
-    CETYPE error = CE_GOOD;
-    
-    // This will either be the pointer to the last file, or the handle
-    FILEOBJ stream = gBufferOwner;
-    
-    dsk = stream->dsk;
-    
-    // figure out the lba
-    l = Cluster2Sector(dsk,stream->ccls);
-    
-    l += (WORD)stream->sec;      // add the sector number to it
-    
-    if(!SectorWrite( l, dsk->buffer, FALSE))
+    WORD    run;
+
+    while (count != 0)
     {
-        error = CE_WRITE_ERROR;
-        return EOF;
-    } 
-    
-    gNeedDataWrite = FALSE;
-    
-    return 0;
+        run = bufferSectors;
+        if (count < run)
+            run = (WORD)count;
+        if (SectorWriteMultiple (sector, run, buffer, FALSE) != TRUE)
+            return FALSE;
+        sector += run;
+        count -= run;
+    }
+    return TRUE;
 }
 #endif
 
@@ -3611,6 +6515,108 @@ int FSfeof( FSFILE * stream )
 }
 
 
+#ifdef FS_READ_AHEAD_SECTORS
+/******************************************************************************
+* Function:        BYTE ReadAheadLoad (FILEOBJ fo, DWORD sector, DWORD left)
+*
+* PreCondition:    fo is reading in order and fo->ccls/fo->sec point at sector
+*
+* Input:           fo          - File being read
+*                  sector      - Sector to load into the file's buffer
+*                  left        - Sectors of the file from this one on
+*
+* Output:          TRUE        - The sector is in the file's buffer
+*                  FALSE       - The sector could not be read
+*
+* Side Effects:    The read-ahead buffer is refilled if it doesn't hold the
+*                  sector
+*
+* Overview:        Takes the sector from the read-ahead buffer if it is there.
+*                  If not, reads it together with the sectors after it: the
+*                  rest of the cluster and of any clusters that follow it
+*                  directly in the FAT, up to FS_READ_AHEAD_SECTORS (of
+*                  MEDIA_SECTOR_SIZE bytes) and the
+*                  end of the file, with one SectorReadMultiple().
+*
+* Note:            Walking the chain ahead only reads the FAT; the file's
+*                  current cluster is not moved.
+*****************************************************************************/
+
+BYTE ReadAheadLoad (FILEOBJ fo, DWORD sector, DWORD left)
+{
+    DISK *  dsk = fo->dsk;
+    DWORD   ccls, next;
+    WORD    run;
+    WORD    most;
+
+    if (!ReadAheadHolds (dsk, sector))
+    {
+        // The buffer holds fewer sectors when they are larger
+        most = ReadAheadMost (dsk);
+        ccls = fo->ccls;
+        run = dsk->SecPerClus - fo->sec;
+        while ((run < most) && (run < left))
+        {
+        #ifdef FS_EXTENT_MAP_SIZE
+            if ((next = ExtentMapNext (fo, ccls)) == 0)
+            {
+                next = ReadFAT (dsk, ccls);
+                ExtentMapAdd (fo, ccls, next);
+            }
+        #else
+            next = ReadFAT (dsk, ccls);
+        #endif
+            if (next != (ccls + 1))
+                break;
+            ccls = next;
+            run += dsk->SecPerClus;
+        }
+        if (run > most)
+            run = most;
+        if (run > left)
+            run = (WORD)left;
+
+        gReadAheadCount = 0;
+        if (!SectorReadMultiple (sector, run, gReadAheadBuffer))
+            return FALSE;
+        gReadAheadDisk = dsk;
+        gReadAheadSector = sector;
+        gReadAheadCount = run;
+    }
+
+    memcpy (FileBuffer(fo), gReadAheadBuffer + (DWORD)(sector - gReadAheadSector) * dsk->sectorSize, dsk->sectorSize);
+    return TRUE;
+}
+
+
+/******************************************************************************
+* Function:        void ReadAheadForget (DWORD sector, DWORD count)
+*
+* PreCondition:    None
+*
+* Input:           sector      - First sector about to be written
+*                  count       - Number of sectors
+*
+* Output:          None
+*
+* Side Effects:    None
+*
+* Overview:        Empties the read-ahead buffer if it holds any of the
+*                  sectors, so a file reading them later sees the new data.
+*
+* Note:            The volume is not compared; dropping a few sectors that
+*                  were read ahead on another volume is harmless.
+*****************************************************************************/
+
+void ReadAheadForget (DWORD sector, DWORD count)
+{
+    if ((gReadAheadCount != 0) && (sector < gReadAheadSector + gReadAheadCount) &&
+        (gReadAheadSector < sector + count))
+        gReadAheadCount = 0;
+}
+#endif
+
+
 /******************************************************************************
 * Function:        size_t FSfread(void *ptr, size_t size, size_t n, FSFILE *stream)
 *
@@ -3639,7 +6645,10 @@ size_t FSfread (void *ptr, size_t size, size_t n, FSFILE *stream)
     DWORD   seek, sec_sel;
     WORD    pos;       //position within sector
     CETYPE  error = CE_GOOD;
-    WORD    readCount = 0;   
+    DWORD   readCount = 0;
+    DWORD   chunk;
+    DWORD   first, next;
+    WORD    run;
     
     dsk = (DISK *)stream->dsk;
     pos = stream->pos;
@@ -3650,26 +6659,39 @@ size_t FSfread (void *ptr, size_t size, size_t n, FSFILE *stream)
         return 0;   // CE_WRITEONLY
     }
     
+    if (!FileSelect (stream))
+        return 0;
+
     #ifdef ALLOW_WRITES
-        if (gNeedDataWrite)
-            if (flushData())
+        if (FileNeedWrite(stream))
+            if (FileFlush(stream))
                 return EOF;
     #endif
     
     // if it not my buffer, then get it from the disk.
-    if( (gBufferOwner != stream) && (pos != MEDIA_SECTOR_SIZE ))
+    sec_sel = Cluster2Sector(dsk,stream->ccls);
+    sec_sel += (WORD)stream->sec;      // add the sector number to it
+#ifdef FS_FILE_BUFFERS
+    if( (stream->bufsec != sec_sel) && (pos != dsk->sectorSize ))
+#else
+    if( (gBufferOwner != stream) && (pos != dsk->sectorSize ))
+#endif
     {
+    #ifndef FS_FILE_BUFFERS
         gBufferOwner = stream;
-        sec_sel = Cluster2Sector(dsk,stream->ccls);
-        sec_sel += (WORD)stream->sec;      // add the sector number to it
+        gDirSectorRead = 0xFFFFFFFF;
+    #endif
+    #ifdef FS_READ_AHEAD_SECTORS
+        stream->seqreads = 0;           // not reached in order
+    #endif
         
         gBufferZeroed = FALSE;
-        if( !SectorRead( sec_sel, dsk->buffer) )
+        if( !SectorRead( sec_sel, FileBuffer(stream)) )
         {
             error = CE_BAD_SECTOR_READ;
             return 0;
         }
-        gLastDataSectorRead = sec_sel;
+        FileBufferSector(stream) = sec_sel;
     }
     
     //loop reading (count) bytes
@@ -3682,7 +6704,7 @@ size_t FSfread (void *ptr, size_t size, size_t n, FSFILE *stream)
         }
     
         // In fopen, pos is init to 0 and the sect is loaded
-        if( pos == MEDIA_SECTOR_SIZE )
+        if( pos == dsk->sectorSize )
         {
             // reset position
             pos = 0;
@@ -3701,22 +6723,122 @@ size_t FSfread (void *ptr, size_t size, size_t n, FSFILE *stream)
             sec_sel = Cluster2Sector(dsk,stream->ccls);
             sec_sel += (WORD)stream->sec;      // add the sector number to it
     
+            // If the caller wants at least one whole sector that is entirely
+            // inside the file, read it straight into the caller's buffer.
+            // The run covers the rest of this cluster and any clusters that
+            // follow it directly in the FAT, so it can go out as one command.
+            // Sectors already read ahead are copied from there instead.
+            chunk = 0;
+            if ((len >= dsk->sectorSize) && ((stream->size - seek) >= dsk->sectorSize) &&
+                !ReadAheadHolds (dsk, sec_sel))
+            {
+                chunk = len;
+                if (chunk > (stream->size - seek))
+                    chunk = stream->size - seek;
+                chunk /= dsk->sectorSize;
+            #ifdef FS_READ_AHEAD_SECTORS
+                // A file read in order in pieces smaller than the read-ahead
+                // buffer goes through the buffer, so each command still
+                // fetches a buffer full even when a piece is one sector
+                if ((stream->seqreads != 0) && (chunk < ReadAheadMost (dsk)))
+                    chunk = 0;
+            #endif
+            }
+            if (chunk != 0)
+            {
+                first = stream->ccls;
+                run = dsk->SecPerClus - stream->sec;
+                while ((run < chunk) && (run <= (FS_MAX_SECTOR_RUN (dsk) - dsk->SecPerClus)))
+                {
+                #ifdef FS_EXTENT_MAP_SIZE
+                    if ((next = ExtentMapNext (stream, stream->ccls)) == 0)
+                    {
+                        next = ReadFAT (dsk, stream->ccls);
+                        ExtentMapAdd (stream, stream->ccls, next);
+                    }
+                #else
+                    next = ReadFAT (dsk, stream->ccls);
+                #endif
+                    if (next != (stream->ccls + 1))
+                        break;
+                    stream->ccls = next;
+                    run += dsk->SecPerClus;
+                }
+                if (run > chunk)
+                    run = chunk;
+    
+                if( !SectorReadMultiple( sec_sel, run, pointer) )
+                {
+                    // Leave the stream on the first sector of the run so a
+                    // retry reloads it
+                    stream->ccls = first;
+                #ifndef FS_FILE_BUFFERS
+                    gBufferOwner = NULL;
+                #endif
+                    error = CE_BAD_SECTOR_READ;
+                    break;
+                }
+    
+                // Leave the stream at the end of the last sector we read so
+                // the next access advances past it. The sector buffer was not
+                // touched, so the sector it records is still accurate.
+                stream->sec = (stream->sec + run - 1) % dsk->SecPerClus;
+                pos = dsk->sectorSize;
+            #ifdef FS_READ_AHEAD_SECTORS
+                if (stream->seqreads != 0xFF)
+                    stream->seqreads++;
+            #endif
+                chunk = (DWORD)run * dsk->sectorSize;
+                pointer += chunk;
+                seek += chunk;
+                readCount += chunk;
+                len -= chunk;
+                continue;
+            }
+    
+        #ifndef FS_FILE_BUFFERS
             gBufferOwner = stream;
+            gDirSectorRead = 0xFFFFFFFF;
+        #endif
             gBufferZeroed = FALSE;
-            if( !SectorRead( sec_sel, dsk->buffer) )
+        #ifdef FS_READ_AHEAD_SECTORS
+            // Once the file has been read across a sector boundary in order,
+            // assume it goes on and fetch the sectors after this one with it
+            if (stream->seqreads != 0)
+            {
+                if (!ReadAheadLoad (stream, sec_sel, (stream->size - seek + dsk->sectorSize - 1) / dsk->sectorSize))
+                {
+                    error = CE_BAD_SECTOR_READ;
+                    break;
+                }
+            }
+            else
+        #endif
+            if( !SectorRead( sec_sel, FileBuffer(stream)) )
             {   
                 error = CE_BAD_SECTOR_READ;
                 break; 
             }
-            gLastDataSectorRead = sec_sel;
+        #ifdef FS_READ_AHEAD_SECTORS
+            if (stream->seqreads != 0xFF)
+                stream->seqreads++;
+        #endif
+            FileBufferSector(stream) = sec_sel;
         }
     
-        // copy one byte at a time
-        *pointer = RAMread( dsk->buffer, pos++ );
-        pointer++;
-        seek++;
-        readCount++;
-        len--;
+        // copy the rest of this sector, or as much of it as we need
+        chunk = dsk->sectorSize - pos;
+        if (chunk > len)
+            chunk = len;
+        if (chunk > (stream->size - seek))
+            chunk = stream->size - seek;
+    
+        memcpy (pointer, FileBuffer(stream) + pos, chunk);
+        pointer += chunk;
+        pos += chunk;
+        seek += chunk;
+        readCount += chunk;
+        len -= chunk;
     }
     
     // save off the positon
@@ -4017,9 +7139,12 @@ int FSfseek(FSFILE *stream, long offset, int whence)
             break;
     }
 
+    if (!FileSelect (stream))
+        return EOF;
+
     #ifdef ALLOW_WRITES      
-        if (gNeedDataWrite)
-            if (flushData())
+        if (FileNeedWrite(stream))
+            if (FileFlush(stream))
                 return EOF;
     #endif
 
@@ -4040,10 +7165,10 @@ int FSfseek(FSFILE *stream, long offset, int whence)
         stream->seek = offset;
         
         // figure out how many sectors
-        numsector = offset / MEDIA_SECTOR_SIZE;
+        numsector = offset / dsk->sectorSize;
         
         // figure out how many bytes off of the offset
-        offset = offset - (numsector * MEDIA_SECTOR_SIZE);
+        offset = offset - (numsector * dsk->sectorSize);
         stream->pos = offset;
         
         // figure out how many clusters
@@ -4056,7 +7181,7 @@ int FSfseek(FSFILE *stream, long offset, int whence)
         // if we are in the current cluster stay there
         if (temp > 0)
         {
-            test = FILEget_next_cluster(stream, temp);
+            test = FILEseek_cluster(stream, temp);
             if (test != CE_GOOD)
             {   
                 if (test == CE_FAT_EOF)
@@ -4065,10 +7190,7 @@ int FSfseek(FSFILE *stream, long offset, int whence)
                         if (stream->flags.write)
                         {
                             // load the previous cluster
-                            stream->ccls = stream->cluster;
-                            // Don't perform this operation if there's only one cluster
-                            if (temp != 1)
-                                test = FILEget_next_cluster(stream, temp - 1);
+                            test = FILEseek_cluster(stream, temp - 1);
                             if (FILEallocate_new_cluster(stream, 0) != CE_GOOD)
                                 return -1;
                             // sec and pos should already be zero
@@ -4076,11 +7198,10 @@ int FSfseek(FSFILE *stream, long offset, int whence)
                         else
                         {
                     #endif
-                    stream->ccls = stream->cluster;
-                    test = FILEget_next_cluster(stream, temp - 1);
+                    test = FILEseek_cluster(stream, temp - 1);
                     if (test != CE_GOOD)
                         return (-1);
-                    stream->pos = MEDIA_SECTOR_SIZE;
+                    stream->pos = dsk->sectorSize;
                     stream->sec = dsk->SecPerClus - 1;
                     #ifdef ALLOW_WRITES
                         }
@@ -4098,11 +7219,17 @@ int FSfseek(FSFILE *stream, long offset, int whence)
         numsector = stream->sec;
         temp += numsector;
 
+    #ifndef FS_FILE_BUFFERS
         gBufferOwner = NULL;
+        gDirSectorRead = 0xFFFFFFFF;
+    #endif
+    #ifdef FS_READ_AHEAD_SECTORS
+        stream->seqreads = 0;
+    #endif
         gBufferZeroed = FALSE;
-        if( !SectorRead(temp, dsk->buffer) )
+        if( !SectorRead(temp, FileBuffer(stream)) )
             return (-1);   // Bad read
-        gLastDataSectorRead = temp;
+        FileBufferSector(stream) = temp;
     }
     return (0);
 }
@@ -4252,238 +7379,401 @@ int FindFirstpgm (const rom char * fileName, unsigned int attr, SearchRec * rec)
 
 
 /******************************************************************************
-* Function:        WORD ReadFAT (DISK *dsk, WORD ccls)
+* Function:        BYTE FATCacheLoad (DISK * dsk, DWORD sector)
+*
+* PreCondition:    None
+*
+* Input:           dsk        - The disk structure
+*                  sector     - The FAT sector (in the first FAT) wanted
+*
+* Output:          BYTE       - The cache slot holding the sector, or
+*                               FAT_CACHE_FAIL if it could not be read in
+*
+* Side Effects:    May write a dirty FAT sector back to the media
+*
+* Overview:        Find a FAT sector in the FAT cache, reading it into the
+*                  least recently used slot if it is not there
+*
+* Note:            Should not be called by user
+*****************************************************************************/
+
+BYTE FATCacheLoad (DISK * dsk, DWORD sector)
+{
+    BYTE    i, slot, age;
+
+    // Look for it in the cache first
+    for (slot = 0; slot < FS_FAT_CACHE_SECTORS; slot++)
+    {
+        if ((gFATCacheSector[slot] == sector) && (gFATCacheDisk[slot] == dsk))
+            break;
+    }
+
+    if (slot == FS_FAT_CACHE_SECTORS)
+    {
+        // Not there; reuse the least recently used slot
+        slot = 0;
+        for (i = 1; i < FS_FAT_CACHE_SECTORS; i++)
+        {
+            if (gFATCacheAge[i] > gFATCacheAge[slot])
+                slot = i;
+        }
+
+        #ifdef ALLOW_WRITES
+            // A sector of another volume that can't be written (its media
+            // was removed) is dropped so it doesn't block this volume
+            if (gFATCacheDirty[slot])
+            {
+                if (!FATCacheWriteBack (gFATCacheDisk[slot], slot) && (gFATCacheDisk[slot] == dsk))
+                    return FAT_CACHE_FAIL;
+                gFATCacheDirty[slot] = FALSE;
+            }
+        #endif
+
+        if (!SectorRead (sector, gFATBuffer[slot]))
+        {
+            gFATCacheSector[slot] = FAT_CACHE_EMPTY;
+            gFATCacheDisk[slot] = NULL;
+            return FAT_CACHE_FAIL;
+        }
+        gFATCacheSector[slot] = sector;
+        gFATCacheDisk[slot] = dsk;
+    }
+
+    // Make it the most recently used
+    age = gFATCacheAge[slot];
+    for (i = 0; i < FS_FAT_CACHE_SECTORS; i++)
+    {
+        if (gFATCacheAge[i] < age)
+            gFATCacheAge[i]++;
+    }
+    gFATCacheAge[slot] = 0;
+
+    return slot;
+}
+
+
+/******************************************************************************
+* Function:        void FATCacheInvalidate (void)
+*
+* PreCondition:    None
+*
+* Input:           None
+*
+* Output:          None
+*
+* Side Effects:    Dirty FAT sectors are dropped without being written
+*
+* Overview:        Empty the FAT cache
+*
+* Note:            Used when the media may have changed under the cache
+*****************************************************************************/
+
+void FATCacheInvalidate (void)
+{
+    BYTE    i;
+
+    for (i = 0; i < FS_FAT_CACHE_SECTORS; i++)
+    {
+        gFATCacheSector[i] = FAT_CACHE_EMPTY;
+        gFATCacheDisk[i] = NULL;
+        gFATCacheDirty[i] = FALSE;
+        gFATCacheAge[i] = i;
+    }
+}
+
+
+/******************************************************************************
+* Function:        void FATCacheForget (DISK * dsk)
+*
+* PreCondition:    None
+*
+* Input:           dsk        - The volume whose sectors are dropped
+*
+* Output:          None
+*
+* Side Effects:    Dirty FAT sectors of the volume are dropped without being
+*                  written
+*
+* Overview:        Empty the FAT cache slots holding sectors of one volume
+*
+* Note:            Used when a volume is unmounted
+*****************************************************************************/
+
+void FATCacheForget (DISK * dsk)
+{
+    BYTE    i;
+
+    for (i = 0; i < FS_FAT_CACHE_SECTORS; i++)
+    {
+        if (gFATCacheDisk[i] == dsk)
+        {
+            gFATCacheSector[i] = FAT_CACHE_EMPTY;
+            gFATCacheDisk[i] = NULL;
+            gFATCacheDirty[i] = FALSE;
+        }
+    }
+}
+
+
+/******************************************************************************
+* Function:        BYTE FATCacheWriteBack (DISK * dsk, BYTE slot)
+*
+* PreCondition:    None
+*
+* Input:           dsk        - The volume the slot's sector belongs to
+*                  slot       - The FAT cache slot to write
+*
+* Output:          TRUE       - The sector was written to every FAT copy
+*                  FALSE      - A write failed
+*
+* Side Effects:    None
+*
+* Overview:        Write a dirty FAT sector to each copy of the FAT
+*
+* Note:            A sector of a volume other than the active one is written
+*                  through that volume's media unit. Should not be called
+*                  by user
+*****************************************************************************/
+
+#ifdef ALLOW_WRITES
+BYTE FATCacheWriteBack (DISK * dsk, BYTE slot)
+{
+    BYTE    i;
+    DWORD   li;
+    BYTE    good = TRUE;
+
+    if ((dsk != gActiveDisk) && !MediaSelect (dsk->unit))
+        good = FALSE;
+
+    for (i = 0, li = gFATCacheSector[slot]; good && (i < dsk->fatcopy); i++, li += dsk->fatsize)
+        if (!SectorWrite (li, gFATBuffer[slot], FALSE))
+            good = FALSE;
+
+    if (dsk != gActiveDisk)
+        MediaSelect (gActiveDisk->unit);
+
+    if (good)
+        gFATCacheDirty[slot] = FALSE;
+
+    return good;
+}
+#endif
+
+
+/******************************************************************************
+* Function:        DWORD ReadFAT (DISK *dsk, DWORD ccls)
 *
 * PreCondition:    None
 *
 * Input:           dsk        - The disk structure
 *                  ccls       - The current cluster
-*                  
-* Output:          WORD       - The next cluster in a file chain
+*
+* Output:          DWORD      - The next cluster in a file chain; the end of
+*                               a chain is returned as LAST_CLUSTER for every
+*                               FAT type
 *
 * Side Effects:    None
 *
 * Overview:        Find successive clusters in the FAT
 *
-* Note:            None
+* Note:            The FAT sectors come from the FAT cache
 *****************************************************************************/
 
-WORD ReadFAT (DISK *dsk, WORD ccls)
+DWORD ReadFAT (DISK *dsk, DWORD ccls)
 {
-    BYTE    q;
+    BYTE    q = 0, slot;
     DWORD   p, l;
-    WORD    c, d;   
-    
-    // We only support FAT16 and FAT12 right now   
+    DWORD   c, d;
+
+#ifdef SUPPORT_FAT32
+    if (dsk->type != FAT32 && dsk->type != FAT16 && dsk->type != FAT12)
+#else
     if (dsk->type != FAT16 && dsk->type != FAT12)
+#endif
         return CLUSTER_FAIL;
-    
+
     gBufferZeroed = FALSE;
-    
-    // Mulby 2 or 1.5 to find cluster pos in FAT
-    if (dsk->type == FAT16)
+
+    // Mulby 4, 2 or 1.5 to find cluster pos in FAT
+    if (dsk->type == FAT32)
     {
-        p = (DWORD)ccls *2;
+        p = ccls *4;
     }
-    if (dsk->type == FAT12)
+    else if (dsk->type == FAT16)
+    {
+        p = ccls *2;
+    }
+    else    // FAT12
     {
-        p = (DWORD) ccls *3;
+        p = ccls *3;
         q = p&1;
         p >>= 1;
     }
-    
-    l = dsk->fat + (p >> 9);
-    p &= 0x1ff;
-    
-    // Check if the appropriate FAT sector is already loaded
-    if (gLastFATSectorRead == l)
+
+    l = dsk->fat + (p >> dsk->sectorShift);
+    p &= dsk->sectorSize - 1;
+
+    // Get the FAT sector, reading it in if it isn't cached
+    if ((slot = FATCacheLoad (dsk, l)) == FAT_CACHE_FAIL)
+        return CLUSTER_FAIL;
+
+    if (dsk->type == FAT32)
+        c = RAMreadD (gFATBuffer[slot], p) & FAT32_CLUSTER_MASK;
+    else if (dsk->type == FAT16)
+        c = RAMreadW (gFATBuffer[slot], p);
+    else    // FAT12
     {
-        if (dsk->type == FAT16)
-            c = RAMreadW (gFATBuffer, p);
-        else if (dsk->type == FAT12)
+        c = RAMread (gFATBuffer[slot], p);
+        if (q)
         {
-            c = RAMread (gFATBuffer, p);
-            if (q)
-            {
-                c >>= 4;   
-            }
-            // Check if the MSB is across the sector boundry
-            p = (p +1) & 0x1FF;
-            if (p == 0)
-            {
-                // Start by writing the sector we just worked on to the card
-                // if we need to
-                #ifdef ALLOW_WRITES
-                    if (gNeedFATWrite)
-                        if(WriteFAT (dsk, 0, 0, TRUE))
-                            return CLUSTER_FAIL;
-                #endif
-    
-                if (!SectorRead (l+1, gFATBuffer))
-                {
-                    gLastFATSectorRead = 0xFFFF;
-                    return CLUSTER_FAIL;
-                }
-                else
-                {
-                    gLastFATSectorRead = l +1;
-                }
-            }
-            d = RAMread (gFATBuffer, p);
-            if (q)
-            {
-                c += (d <<4);
-            }
-            else
-            {
-                c += ((d & 0x0F)<<8);
-            }
+            c >>= 4;
         }
-    }
-    else
-    {
-        // If there's a currently open FAT sector,
-        // write it back before reading into the buffer
-        #ifdef ALLOW_WRITES
-            if (gNeedFATWrite)
-            {
-                if(WriteFAT (dsk, 0, 0, TRUE))
-                    return CLUSTER_FAIL;
-            }
-        #endif
-    
-        if (!SectorRead (l, gFATBuffer))
+        // Check if the MSB is across the sector boundry
+        p = (p +1) & (dsk->sectorSize - 1);
+        if (p == 0)
+        {
+            if ((slot = FATCacheLoad (dsk, l + 1)) == FAT_CACHE_FAIL)
+                return CLUSTER_FAIL;
+        }
+        d = RAMread (gFATBuffer[slot], p);
+        if (q)
         {
-            gLastFATSectorRead = 0xFFFF;
-            return CLUSTER_FAIL;
+            c += (d <<4);
         }
         else
         {
-            gLastFATSectorRead = l;
-            if (dsk->type == FAT16)
-                c = RAMreadW (gFATBuffer, p);
-            else if (dsk->type == FAT12)
-            {
-                c = RAMread (gFATBuffer, p);
-                if (q)
-                {
-                    c >>= 4;   
-                }
-                p = (p +1) & 0x1FF;
-                d = RAMread (gFATBuffer, p);
-                if (q)
-                {
-                    c += (d <<4);
-                }
-                else
-                {
-                    c += ((d & 0x0F)<<8);
-                }
-            }
+            c += ((d & 0x0F)<<8);
         }
     }
-    
-    // Normalize it so 0xFFFF is an error
-    if (c >= LAST_CLUSTER_FAT16)
+
+    // Normalize it so CLUSTER_FAIL is an error and every
+    // FAT type reports the end of a chain the same way
+    if (dsk->type == FAT32)
+    {
+        if (c >= LAST_CLUSTER_FAT32)
+            c = LAST_CLUSTER;
+    }
+    else if (dsk->type == FAT16)
+    {
+        if (c >= LAST_CLUSTER_FAT16)
+            c = LAST_CLUSTER;
+    }
+    else if (c >= LAST_CLUSTER_FAT12)
         c = LAST_CLUSTER;
-    
+
     return c;
 }   // ReadFAT
 
 
 
 /******************************************************************************
-* Function:        WORD WriteFAT (DISK *dsk, WORD ccls, WORD value, BYTE forceWrite)
+* Function:        DWORD WriteFAT (DISK *dsk, DWORD ccls, DWORD value, BYTE forceWrite)
 *
 * PreCondition:    None
 *
 * Input:           dsk        - The disk structure
 *                  ccls       - The current cluster
 *                  value      - The value to write in
-*                  forceWrite - Force the function to write the current FAT sector
-*                  
-* Output:          WORD       - 0 if successful, FAIL otherwise
+*                  forceWrite - Force the function to write the dirty FAT
+*                               sectors in the FAT cache to the card
+*
+* Output:          DWORD      - 0 if successful, CLUSTER_FAIL otherwise
 *
 * Side Effects:    None
 *
 * Overview:        Write a value to the FAT
 *
-* Note:            None
+* Note:            The change is made in the FAT cache and only reaches the
+*                  media (every FAT copy) when the sector is evicted or
+*                  forceWrite is used. On FAT32 the free cluster count is
+*                  kept up to date as entries change between empty and
+*                  used. Freeing a cluster marks its group in the free
+*                  cluster map.
 *****************************************************************************/
 
 #ifdef ALLOW_WRITES
-WORD WriteFAT (DISK *dsk, WORD ccls, WORD value, BYTE forceWrite)
+DWORD WriteFAT (DISK *dsk, DWORD ccls, DWORD value, BYTE forceWrite)
 {
-    BYTE    i, q, c;
-    DWORD   p, li, l;
-    
+    BYTE    i, q = 0, c, slot;
+    DWORD   p, l, old;
+
+#ifdef SUPPORT_FAT32
+    if (dsk->type != FAT32 && dsk->type != FAT16 && dsk->type != FAT12)
+#else
     if (dsk->type != FAT16 && dsk->type != FAT12)
+#endif
         return CLUSTER_FAIL;
-    
+
     gBufferZeroed = FALSE;
-    
+
     // The only purpose for calling this function with forceWrite
-    // is to write the current FAT sector to the card
+    // is to write the changed FAT sectors to the card
     if (forceWrite)
     {
-        for (i = 0, li = gLastFATSectorRead; i < dsk->fatcopy; i++, li += dsk->fatsize)
-            if (!SectorWrite (gLastFATSectorRead, gFATBuffer, FALSE))
-                return CLUSTER_FAIL;
-    
-        gNeedFATWrite = FALSE;
-    
+        for (i = 0; i < FS_FAT_CACHE_SECTORS; i++)
+        {
+            if (gFATCacheDirty[i] && (gFATCacheDisk[i] == dsk))
+                if (!FATCacheWriteBack (dsk, i))
+                    return CLUSTER_FAIL;
+        }
+
         return 0;
     }
-    
-    if (dsk->type == FAT16)
+
+    if (dsk->type == FAT32)
     {
-        p = (DWORD) ccls *2;
-    
-        l = dsk->fat + (p >> 9);
-    
-        p &= 0x1FF;
+        p = ccls *4;
+
+        l = dsk->fat + (p >> dsk->sectorShift);
+
+        p &= dsk->sectorSize - 1;
+    }
+    else if (dsk->type == FAT16)
+    {
+        p = ccls *2;
+
+        l = dsk->fat + (p >> dsk->sectorShift);
+
+        p &= dsk->sectorSize - 1;
     }
     else if (dsk->type == FAT12)
     {
-        p = (DWORD) ccls * 3;
+        p = ccls * 3;
         q = p & 1;   // Odd or even?
         p >>= 1;
-        l = dsk->fat + (p >>9);
-        p &= 0x1FF;
+        l = dsk->fat + (p >> dsk->sectorShift);
+        p &= dsk->sectorSize - 1;
     }
-    
-    if (gLastFATSectorRead != l)
+
+    // Get the FAT sector, reading it in if it isn't cached
+    if ((slot = FATCacheLoad (dsk, l)) == FAT_CACHE_FAIL)
+        return CLUSTER_FAIL;
+
+    if (dsk->type == FAT32)
     {
-        // If we are loading a new sector then write
-        // the current one to the card if we need to
-        if (gNeedFATWrite)
-        {
-            for (i = 0, li = gLastFATSectorRead; i < dsk->fatcopy; i++, li += dsk->fatsize)
-                if (!SectorWrite (gLastFATSectorRead, gFATBuffer, FALSE))
-                    return CLUSTER_FAIL;
-    
-            gNeedFATWrite = FALSE;
-        }
-    
-        // Load the new sector
-        if (!SectorRead (l, gFATBuffer))
+        old = RAMreadD (gFATBuffer[slot], p);
+
+        // Track the free cluster count for the FSInfo sector
+        if (dsk->freecls != FSINFO_UNKNOWN)
         {
-            gLastFATSectorRead = 0xFFFF;
-            return CLUSTER_FAIL;
+            if (((old & FAT32_CLUSTER_MASK) == CLUSTER_EMPTY) && (value != CLUSTER_EMPTY))
+                dsk->freecls--;
+            else if (((old & FAT32_CLUSTER_MASK) != CLUSTER_EMPTY) && (value == CLUSTER_EMPTY))
+                dsk->freecls++;
         }
-        else
-            gLastFATSectorRead = l;
+
+        // The upper 4 bits of the entry are reserved and must be preserved
+        RAMwriteD (gFATBuffer[slot], p, (value & FAT32_CLUSTER_MASK) | (old & ~FAT32_CLUSTER_MASK));
     }
-    
     if (dsk->type == FAT16)
     {
-        RAMwrite (gFATBuffer, p, value);            //lsB
-        RAMwrite (gFATBuffer, p+1, (value >> 8));   //msB
+        RAMwrite (gFATBuffer[slot], p, value);            //lsB
+        RAMwrite (gFATBuffer[slot], p+1, (value >> 8));   //msB
     }
     if (dsk->type == FAT12)
     {
         // Get the current byte from the FAT
-        c = RAMread (gFATBuffer, p);
+        c = RAMread (gFATBuffer[slot], p);
         if (q)
         {
             c = ((value & 0x0F) << 4) | ( c & 0x0F);
@@ -4493,28 +7783,20 @@ WORD WriteFAT (DISK *dsk, WORD ccls, WORD value, BYTE forceWrite)
             c = (value & 0xFF);
         }
         // Write in those bits
-        RAMwrite (gFATBuffer, p, c);
-        
+        RAMwrite (gFATBuffer[slot], p, c);
+
         // FAT12 entries can cross sector boundaries
-        // Check if we need to load a new sector
-        p = (p+1) & 0x1FF;
+        // Check if we need the next sector as well
+        p = (p+1) & (dsk->sectorSize - 1);
         if (p == 0)
         {
-            // call this function to update the FAT on the card
-            if (WriteFAT (dsk, 0,0,TRUE))
+            gFATCacheDirty[slot] = TRUE;
+            if ((slot = FATCacheLoad (dsk, l + 1)) == FAT_CACHE_FAIL)
                 return CLUSTER_FAIL;
-            // Load the next sector
-            if (!SectorRead (l +1, gFATBuffer))
-            {
-                gLastFATSectorRead = 0xFFFF;
-                return CLUSTER_FAIL;
-            }
-            else
-                gLastFATSectorRead = l + 1;
         }
-    
+
         // Get the second byte of the table entry
-        c = RAMread (gFATBuffer, p);
+        c = RAMread (gFATBuffer[slot], p);
         if (q)
         {
             c = (value >> 4);
@@ -4523,10 +7805,16 @@ WORD WriteFAT (DISK *dsk, WORD ccls, WORD value, BYTE forceWrite)
         {
             c = ((value >> 8) & 0x0F) | (c & 0xF0);
         }
-        RAMwrite (gFATBuffer, p, c);
+        RAMwrite (gFATBuffer[slot], p, c);
     }
-    
-    gNeedFATWrite = TRUE;
+
+#ifdef FS_FREE_MAP_SIZE
+    // A freed cluster makes its group worth searching again
+    if (value == CLUSTER_EMPTY)
+        FreeMapSet (ccls, TRUE);
+#endif
+
+    gFATCacheDirty[slot] = TRUE;
     return 0;
 }
 #endif
@@ -4540,12 +7828,17 @@ char defaultString [11];
 
 int FSchdir (char * path)
 {
+    // A drive letter changes the working directory of that volume
+    if ((path = (char *)VolumeFromName (path)) == NULL)
+        return -1;
     return chdirhelper (0, path, NULL);
 }
 
 #ifdef ALLOW_PGMFUNCTIONS
 int FSchdirpgm (const rom char * path)
 {
+    if (!CurrentVolumeSelect())
+        return -1;
     return chdirhelper (1, NULL, path);
 }
 #endif
@@ -4636,7 +7929,7 @@ int chdirhelper (BYTE mode, char * ramptr, char * romptr)
                         } 
                     #endif               
                     // Check if we're in the root
-                    if (tempCWD->dirclus == 0)
+                    if (tempCWD->dirclus == FatRootDirClusterValue(tempCWD->dsk))
                     {
                         // Fails if there's a dotdot chdir from the root
                         return -1;
@@ -4651,11 +7944,14 @@ int chdirhelper (BYTE mode, char * ramptr, char * romptr)
                         {
                             return -1;
                         }
-                        tempCWD->dirclus = entry->DIR_FstClusLO;
+                        tempCWD->dirclus = GetFullClusterNumber (tempCWD->dsk, entry);
+                        // A dotdot entry of 0 means the root
+                        if (tempCWD->dirclus == 0)
+                            tempCWD->dirclus = FatRootDirClusterValue(tempCWD->dsk);
                         tempCWD->dirccls = tempCWD->dirclus;
     
                         // If we changed to root, record the name
-                        if (tempCWD->dirclus == 0)
+                        if (tempCWD->dirclus == FatRootDirClusterValue(tempCWD->dsk))
                         {
                             tempCWD->name[0] = '\\';
                             for (j = 1; j < 11; j++)
@@ -4780,8 +8076,8 @@ int chdirhelper (BYTE mode, char * ramptr, char * romptr)
                 {
                     // The user is changing directory to
                     // the root
-                    cwdptr->dirclus = 0;
-                    cwdptr->dirccls = 0;
+                    cwdptr->dirclus = FatRootDirClusterValue(cwdptr->dsk);
+                    cwdptr->dirccls = cwdptr->dirclus;
                     cwdptr->name[0] = '\\';
                     for (j = 1; j < 11; j++)
                     {
@@ -4792,8 +8088,8 @@ int chdirhelper (BYTE mode, char * ramptr, char * romptr)
                 else
                 {
                     // Our first char is the root dir switch
-                    tempCWD->dirclus = 0;
-                    tempCWD->dirccls = 0;
+                    tempCWD->dirclus = FatRootDirClusterValue(tempCWD->dsk);
+                    tempCWD->dirccls = tempCWD->dirclus;
                     tempCWD->name[0] = '\\';
                     for (j = 1; j < 11; j++)
                     {
@@ -4923,6 +8219,14 @@ int chdirhelper (BYTE mode, char * ramptr, char * romptr)
 char defaultArray [10];
 
 
+char * FSgetcwd (char * path, int numchars)
+{
+    if (!CurrentVolumeSelect())
+        return NULL;
+    return getcwdhelper (path, numchars);
+}
+
+
 /******************************************************************************
 * Function:        char * FSgetcwd (char * path, int numchars)
 *
@@ -4937,11 +8241,11 @@ char defaultArray [10];
 *
 * Overview:        Gives the user the name of the cwd
 *
-* Note:            None
+* Note:            The cwd of the current volume, without a drive letter
 *****************************************************************************/
 
 
-char * FSgetcwd (char * path, int numchars)
+char * getcwdhelper (char * path, int numchars)
 {
     // If path is passed in as null, set up a default
     // array with 10 characters
@@ -4952,7 +8256,8 @@ char * FSgetcwd (char * path, int numchars)
     FILEOBJ     tempCWD = &tempCWDobj;
     BYTE        bufferOverflow = FALSE;
     signed char j;
-    WORD        curclus, fHandle, tempindex;
+    DWORD       curclus;
+    WORD        fHandle, tempindex;
     signed int  i, index = 0;
     char        aChar;
     DIRENTRY    entry;
@@ -4980,15 +8285,18 @@ char * FSgetcwd (char * path, int numchars)
         entry = Cache_File_Entry (tempCWD,&fHandle, TRUE);
         if (entry == NULL)
             return NULL;
-        tempCWD->dirclus = entry->DIR_FstClusLO;
-        tempCWD->dirccls = entry->DIR_FstClusLO;
+        tempCWD->dirclus = GetFullClusterNumber (tempCWD->dsk, entry);
+        // A dotdot entry of 0 means the root
+        if (tempCWD->dirclus == 0)
+            tempCWD->dirclus = FatRootDirClusterValue(tempCWD->dsk);
+        tempCWD->dirccls = tempCWD->dirclus;
         // Find the direntry for the entry we were just in
         fHandle = 0;
         entry = Cache_File_Entry (tempCWD, &fHandle, TRUE); 
         if (entry == NULL)
             return NULL;
-        while ((entry->DIR_FstClusLO != curclus) || 
-            ((entry->DIR_FstClusLO == curclus) && 
+        while ((GetFullClusterNumber (tempCWD->dsk, entry) != curclus) || 
+            ((GetFullClusterNumber (tempCWD->dsk, entry) == curclus) && 
             (((unsigned char)entry->DIR_Name[0] == 0xE5) || (entry->DIR_Attr == ATTR_VOLUME) || (entry->DIR_Attr == ATTR_LONG_NAME)))) 
         {
             fHandle++;
@@ -5019,7 +8327,7 @@ char * FSgetcwd (char * path, int numchars)
     else
     {
         // Loop until we get back to the root
-        while (tempCWD->dirclus != 0)
+        while (tempCWD->dirclus != FatRootDirClusterValue(tempCWD->dsk))
         {
             // Copy the current name into the buffer backwards
             j = 10;
@@ -5126,7 +8434,7 @@ BYTE GetPreviousEntry (FSFILE * fo)
 {
     BYTE        i, test;
     WORD        fHandle = 1;
-    WORD        dirclus;
+    DWORD       dirclus;
     DIRENTRY    dirptr;
     
     // Load the previous entry
@@ -5134,7 +8442,9 @@ BYTE GetPreviousEntry (FSFILE * fo)
     if (dirptr == NULL)
         return -1;
     
-    if (dirptr->DIR_FstClusLO == 0)
+    // A dotdot entry of 0 means the root
+    dirclus = GetFullClusterNumber (fo->dsk, dirptr);
+    if ((dirclus == 0) || (dirclus == FatRootDirClusterValue(fo->dsk)))
     {
         // The previous directory is the root
         fo->name[0] = '\\';
@@ -5142,30 +8452,31 @@ BYTE GetPreviousEntry (FSFILE * fo)
         {
             fo->name[i] = 0x20;
         }
-        fo->dirclus = 0;
-        fo->dirccls = 0;
+        fo->dirclus = FatRootDirClusterValue(fo->dsk);
+        fo->dirccls = fo->dirclus;
     }
     else
     {
         // Get the directory name
         // Save the previous cluster value
-        dirclus = dirptr->DIR_FstClusLO;
-        fo->dirclus = dirptr->DIR_FstClusLO;
-        fo->dirccls = dirptr->DIR_FstClusLO;
+        fo->dirclus = dirclus;
+        fo->dirccls = dirclus;
         // Load the previous previous cluster
         dirptr = Cache_File_Entry (fo, &fHandle, TRUE);
         if (dirptr == NULL)
             return -1;
-        fo->dirclus = dirptr->DIR_FstClusLO;
-        fo->dirccls = dirptr->DIR_FstClusLO;
+        fo->dirclus = GetFullClusterNumber (fo->dsk, dirptr);
+        if (fo->dirclus == 0)
+            fo->dirclus = FatRootDirClusterValue(fo->dsk);
+        fo->dirccls = fo->dirclus;
         fHandle = 0;
         dirptr = Cache_File_Entry (fo, &fHandle, TRUE);
         if (dirptr == NULL)
             return -1;
         // Look through it until we get the name 
         // of the previous cluster
-        while ((dirptr->DIR_FstClusLO != dirclus) || 
-            ((dirptr->DIR_FstClusLO == dirclus) && 
+        while ((GetFullClusterNumber (fo->dsk, dirptr) != dirclus) || 
+            ((GetFullClusterNumber (fo->dsk, dirptr) == dirclus) && 
             (((unsigned char)dirptr->DIR_Name[0] == 0xE5) || (dirptr->DIR_Attr == ATTR_VOLUME) || (dirptr->DIR_Attr == ATTR_LONG_NAME)))) 
         {
             // Look through the entries until we get the
@@ -5193,12 +8504,16 @@ BYTE GetPreviousEntry (FSFILE * fo)
 
 int FSmkdir (char * path)
 {
+    if ((path = (char *)VolumeFromName (path)) == NULL)
+        return -1;
     return mkdirhelper (0, path, NULL);
 }
 
 #ifdef ALLOW_PGMFUNCTIONS
 int FSmkdirpgm (const rom char * path)
 {
+    if (!CurrentVolumeSelect())
+        return -1;
     return mkdirhelper (1, NULL, path);
 }
 #endif
@@ -5323,7 +8638,7 @@ int mkdirhelper (char * path, char * ramptr, char * romptr)
     
             if (i == '.')
             {
-                if (cwdptr->dirclus == 0)
+                if (cwdptr->dirclus == FatRootDirClusterValue(cwdptr->dsk))
                 {
                     // If we try to change to the .. from the
                     // root, operation fails
@@ -5331,9 +8646,9 @@ int mkdirhelper (char * path, char * ramptr, char * romptr)
                 }
                 // dotdot entry
                 #ifndef USE_PIC18
-                    FSchdir ("..");
+                    chdirhelper (0, "..", NULL);
                 #else
-                    FSchdir (dotdot);
+                    chdirhelper (0, dotdot, NULL);
                 #endif
             }
             // Skip past any backslashes
@@ -5366,8 +8681,8 @@ int mkdirhelper (char * path, char * ramptr, char * romptr)
             if (i == '\\')
             {
                 // Start at the root
-                cwdptr->dirclus = 0;
-                cwdptr->dirccls = 0;
+                cwdptr->dirclus = FatRootDirClusterValue(cwdptr->dsk);
+                cwdptr->dirccls = cwdptr->dirclus;
                 cwdptr->name[0] = '\\';
                 for (i = 1; i < 11; i++)
                 {
@@ -5461,7 +8776,7 @@ int mkdirhelper (char * path, char * ramptr, char * romptr)
     
             // Try to change to it
             // If you can't we need to create it
-            if (FSchdir (tempArray))
+            if (chdirhelper (0, tempArray, NULL))
             {
                 break;
             }
@@ -5503,7 +8818,7 @@ int mkdirhelper (char * path, char * ramptr, char * romptr)
         }
     
         // Try to change to that directory
-        if (FSchdir (tempArray))
+        if (chdirhelper (0, tempArray, NULL))
         {
             FileObjectCopy (cwdptr, tempCWD);
             return -1;
@@ -5564,7 +8879,8 @@ int CreateDIR (char * path)
     FSFILE      directoryFile;
     FSFILE *    dirEntryPtr = &directoryFile;
     DIRENTRY    dir;
-    WORD        handle = 0, dot, dotdot;
+    WORD        handle = 0;
+    DWORD       dot, dotdot;
     BYTE        i;
     
     // Copy name into file object
@@ -5586,18 +8902,20 @@ int CreateDIR (char * path)
     }
     else
     {            
-        if (gNeedFATWrite)
-            if(WriteFAT (dirEntryPtr->dsk, 0, 0, TRUE))
-                return FALSE;
+        if(WriteFAT (dirEntryPtr->dsk, 0, 0, TRUE))
+            return FALSE;
         // Zero that cluster
         dotdot = dirEntryPtr->dirclus;
         dirEntryPtr->dirccls = dirEntryPtr->dirclus;
         dir = Cache_File_Entry(dirEntryPtr, &handle, TRUE);
         if (dir == NULL)
             return FALSE;
-        dot = dir->DIR_FstClusLO;
+        dot = GetFullClusterNumber (dirEntryPtr->dsk, dir);
+
+        if (!writeDotEntries (dirEntryPtr->dsk, dot, dotdot))
+            return FALSE;
 
-        if (writeDotEntries (dirEntryPtr->dsk, dot, dotdot))
+        if (WriteFSInfo (dirEntryPtr->dsk))
             return TRUE;
         else
             return FALSE;
@@ -5606,7 +8924,7 @@ int CreateDIR (char * path)
 
 
 /******************************************************************************
-* Function:        BYTE writeDotEntries (DISK * disk, WORD dotAddress, WORD dotdotAddress)
+* Function:        BYTE writeDotEntries (DISK * disk, DWORD dotAddress, DWORD dotdotAddress)
 *
 * PreCondition:    None
 *
@@ -5620,10 +8938,11 @@ int CreateDIR (char * path)
 *
 * Overview:        Create dot and dotdot entries in a subdirectory
 *
-* Note:            Should not be called by the user
+* Note:            Should not be called by the user. A dotdot entry that
+*                  points at the root always holds cluster 0, even on FAT32.
 *****************************************************************************/
 
-BYTE writeDotEntries (DISK * disk, WORD dotAddress, WORD dotdotAddress)
+BYTE writeDotEntries (DISK * disk, DWORD dotAddress, DWORD dotdotAddress)
 {
     WORD        i;
     WORD        size;
@@ -5645,8 +8964,8 @@ BYTE writeDotEntries (DISK * disk, WORD dotAddress, WORD dotdotAddress)
     }
     entry.DIR_Attr = ATTR_DIRECTORY;
     entry.DIR_NTRes = 0x00;
-    entry.DIR_FstClusHI = 0x0000;
-    entry.DIR_FstClusLO = dotAddress;
+    entry.DIR_FstClusHI = (WORD)(dotAddress >> 16);
+    entry.DIR_FstClusLO = (WORD)dotAddress;
     entry.DIR_FileSize = 0x00;
 
     // Times need to be the same as the times in the directory entry
@@ -5684,7 +9003,10 @@ BYTE writeDotEntries (DISK * disk, WORD dotAddress, WORD dotdotAddress)
         *(disk->buffer + i) = *((char *)entryptr + i);
     }
     entry.DIR_Name[1] = '.';
-    entry.DIR_FstClusLO = dotdotAddress;
+    if (dotdotAddress == FatRootDirClusterValue(disk))
+        dotdotAddress = 0;
+    entry.DIR_FstClusHI = (WORD)(dotdotAddress >> 16);
+    entry.DIR_FstClusLO = (WORD)dotdotAddress;
     for (i = 0; i < size; i++)
     {
         *(disk->buffer + i + size) = *((char *)entryptr + i);
@@ -5692,6 +9014,7 @@ BYTE writeDotEntries (DISK * disk, WORD dotAddress, WORD dotdotAddress)
 
     sector = Cluster2Sector (disk, dotAddress);
 
+    ReadAheadForget (sector, 1);
     if (SectorWrite(sector, disk->buffer, FALSE) == FALSE)
     {
         return FALSE;
@@ -5710,12 +9033,16 @@ BYTE writeDotEntries (DISK * disk, WORD dotAddress, WORD dotdotAddress)
 
 int FSrmdir (char * path, unsigned char rmsubdirs)
 {
+    if ((path = (char *)VolumeFromName (path)) == NULL)
+        return -1;
     return rmdirhelper (0, path, NULL, rmsubdirs);
 }
 
 #ifdef ALLOW_PGMFUNCTIONS
 int FSrmdirpgm (const rom char * path, unsigned char rmsubdirs)
 {
+    if (!CurrentVolumeSelect())
+        return -1;
     return rmdirhelper (1, NULL, path, rmsubdirs);
 }
 #endif
@@ -5751,8 +9078,8 @@ int rmdirhelper (BYTE mode, char * ramptr, char * romptr, unsigned char rmsubdir
     FILEOBJ     fo = &f;
     DIRENTRY    entry;
     WORD        handle = 0, handle2;
-    WORD        cluster;
-    WORD        dotdot;
+    DWORD       cluster;
+    DWORD       dotdot;
     BYTE        i;
     BYTE        dirCleared;
     WORD        subDirDepth;
@@ -5776,7 +9103,7 @@ int rmdirhelper (BYTE mode, char * ramptr, char * romptr, unsigned char rmsubdir
         else
         {
     #endif
-            if (FSchdir (ramptr))
+            if (chdirhelper (0, ramptr, NULL))
             return -1;
     #ifdef ALLOW_PGMFUNCTIONS
         }
@@ -5786,8 +9113,8 @@ int rmdirhelper (BYTE mode, char * ramptr, char * romptr, unsigned char rmsubdir
     entry = Cache_File_Entry (cwdptr, &handle, TRUE);
     if (entry != NULL)
     {
-        cluster = entry->DIR_FstClusLO;
-        if (cluster == 0 || cluster == tempCWD->dirclus)
+        cluster = GetFullClusterNumber (cwdptr->dsk, entry);
+        if (cluster == 0 || cluster == tempCWD->dirclus || cwdptr->dirclus == FatRootDirClusterValue(cwdptr->dsk))
         {
             FileObjectCopy (cwdptr, tempCWD);
             return -1;
@@ -5803,7 +9130,7 @@ int rmdirhelper (BYTE mode, char * ramptr, char * romptr, unsigned char rmsubdir
     entry = Cache_File_Entry (cwdptr, &handle, FALSE);
     if (entry != NULL)
     {
-        dotdot = entry->DIR_FstClusLO;
+        dotdot = GetFullClusterNumber (cwdptr->dsk, entry);
     }
     else
     {
@@ -5842,7 +9169,7 @@ int rmdirhelper (BYTE mode, char * ramptr, char * romptr, unsigned char rmsubdir
         // Do remove subdirectories and sub-files
         dirCleared = FALSE;
         subDirDepth = 0;
-        fo->dsk = &gDiskData;
+        fo->dsk = gActiveDisk;
 
         while (!dirCleared)
         {
@@ -5860,7 +9187,7 @@ int rmdirhelper (BYTE mode, char * ramptr, char * romptr, unsigned char rmsubdir
                             tempArray[i] = entry->DIR_Name[i];
                         }
                         // Change to the subdirectory
-                        if (FSchdir (tempArray))
+                        if (chdirhelper (0, tempArray, NULL))
                         {
                             FileObjectCopy (cwdptr, tempCWD);
                             return -1;
@@ -5937,11 +9264,11 @@ int rmdirhelper (BYTE mode, char * ramptr, char * romptr, unsigned char rmsubdir
                         return -1;
                     }
 
-                    handle2 = entry->DIR_FstClusLO;
+                    cluster = GetFullClusterNumber (cwdptr->dsk, entry);
                     #ifndef USE_PIC18
-                        if (FSchdir (".."))
+                        if (chdirhelper (0, "..", NULL))
                     #else
-                        if (FSchdir (dotdotname))
+                        if (chdirhelper (0, dotdotname, NULL))
                     #endif               
                     {
                         FileObjectCopy (cwdptr, tempCWD);
@@ -5957,8 +9284,8 @@ int rmdirhelper (BYTE mode, char * ramptr, char * romptr, unsigned char rmsubdir
                         return -1;
                     }
 
-                    while ((entry->DIR_FstClusLO != handle2) || 
-                        ((entry->DIR_FstClusLO == handle2) && 
+                    while ((GetFullClusterNumber (cwdptr->dsk, entry) != cluster) || 
+                        ((GetFullClusterNumber (cwdptr->dsk, entry) == cluster) && 
                         (((unsigned char)entry->DIR_Name[0] == 0xE5) || (entry->DIR_Attr == ATTR_VOLUME)))) 
                     {
                         handle++;
@@ -6006,7 +9333,7 @@ int rmdirhelper (BYTE mode, char * ramptr, char * romptr, unsigned char rmsubdir
     // Cache the current directory name
     // tempArray is used so we don't disturb the
     // global getcwd buffer
-    if (FSgetcwd (tempArray, 12) == NULL)
+    if (getcwdhelper (tempArray, 12) == NULL)
     {
         FileObjectCopy (cwdptr, tempCWD);
         return -1;
@@ -6021,9 +9348,9 @@ int rmdirhelper (BYTE mode, char * ramptr, char * romptr, unsigned char rmsubdir
 
     // If we're here, this directory is empty
     #ifndef USE_PIC18
-        if (FSchdir (".."))
+        if (chdirhelper (0, "..", NULL))
     #else
-        if (FSchdir (dotdotname))
+        if (chdirhelper (0, dotdotname, NULL))
     #endif
     {
         FileObjectCopy (cwdptr, tempCWD);
@@ -6094,6 +9421,8 @@ int eraseDir (char * path)
     if( result == CE_GOOD )
     {
         FileObjectCopy(cwdptr, &tempCWD);
+        if (!WriteFSInfo (cwdptr->dsk))
+            return -1;
         return 0;
     }
     else
@@ -6195,111 +9524,43 @@ void FormatDirName (char * string, BYTE mode)
 *
 * Overview:        Finds a file based on parameters passed in by the user
 *
-* Note:            Call FindFirst or FindFirstpgm before calling FindNext
+* Note:            Call FindFirst or FindFirstpgm before calling FindNext.
+*                  Attributes can be combined to list several kinds of entry
+*                  in one pass, eg. ATTR_DIRECTORY | ATTR_ARCHIVE for
+*                  directories and files; rec->attributes tells them apart
 *****************************************************************************/
 
 int FindFirst (const char * fileName, unsigned int attr, SearchRec * rec)
 {
-    FSFILE      f;
-    FSFILE      gblFileTemp;
-    FILEOBJ     fo = &f;
-    CETYPE      result;
-    WORD        fHandle;
-    BYTE        i, j;
-    DIRENTRY    dir;
-    
-    if( !FormatFileName(fileName, fo->name, 1) )
-        return -1;
+    BYTE        i;
     
     rec->initialized = FALSE;
     
+    if ((fileName = VolumeFromName (fileName)) == NULL)
+        return -1;
+
+    if( !FormatFileName(fileName, rec->searchpattern, 1) )
+        return -1;
+    
     for (i = 0; (i < 12) && (fileName[i] != 0); i++)
     {
         rec->searchname[i] = fileName[i];
     }
     rec->searchname[i] = 0;
     rec->searchattr = attr;
+    rec->volume = gActiveDisk - gDiskData;
     #ifdef ALLOW_DIRS
         rec->cwdclus = cwdptr->dirclus;
     #else
-        rec->cwdclus = 0;
-    #endif
-    
-    fo->dsk = &gDiskData;
-    fo->cluster = 0;
-    fo->ccls    = 0;
-    fo->entry = 0;
-    fo->attributes = attr;
-    
-    #ifndef ALLOW_DIRS
-        // start at the root directory
-        fo->dirclus    = 0;
-        fo->dirccls    = 0;
-    #else
-        fo->dirclus = cwdptr->dirclus;
-        fo->dirccls = cwdptr->dirccls;
+        rec->cwdclus = FatRootDirClusterValue(gActiveDisk);
     #endif
+    rec->dirccls = rec->cwdclus;
     
-    // copy file object over
-    FileObjectCopy(&gblFileTemp, fo);
-    
-    // See if the file is found
-    result = FILEfind (fo, &gblFileTemp, 1, 1);
-    
-    if (result != CE_GOOD)
+    if (FindFromEntry (rec, 0) != 0)
         return -1;
-    else
-    {
-        fHandle = fo->entry;
-        result = FILEopen (fo, &fHandle, 'r');
-    }
-    if (result == CE_GOOD)
-    {
-        // Copy as much name as there is
-        if (fo->attributes != ATTR_VOLUME && fo->attributes != ATTR_DIRECTORY)
-        {
-            for (i = 0, j = 0; (j < 8) && (fo->name[j] != 0x20); i++, j++)
-            {
-                rec->filename[i] = fo->name[j];
-            }
-            // Add the radix if its not a dir
-            if ((fo->name[8] != ' ') || (fo->name[9] != ' ') || (fo->name[10] != ' '))
-                rec->filename[i++] = '.';
-            // Move to the extension, even if there are more space chars
-            for (j = 8; (j < 11) && (fo->name[j] != 0x20); i++, j++)
-            {
-                rec->filename[i] = fo->name[j];
-            }
-            // Null terminate it
-            rec->filename[i] = 0;
-        }
-        else
-        {
-            for (i = 0; i < 11; i++)
-            {
-                rec->filename[i] = fo->name[i];
-            }
-            rec->filename[i] = 0;
-            i--;
-            while (rec->filename[i] == 0x20)
-                rec->filename[i--] = 0;
-        }
     
-        rec->attributes = fo->attributes;
-        rec->filesize = fo->size;
-        if ((fo->attributes & ATTR_DIRECTORY) == 0)
-            rec->timestamp = (DWORD)((DWORD)fo->date << 16) + fo->time;
-        else
-        {
-            dir = Cache_File_Entry (fo, &fo->entry, FALSE);
-            rec->timestamp = (DWORD)((DWORD)dir->DIR_CrtDate << 16) + dir->DIR_CrtTime;
-        }
-        rec->entry = fo->entry;
-        rec->initialized = TRUE;
-        return 0;
-    }
-    else
-        return -1;
+    rec->initialized = TRUE;
+    return 0;
 }
 
 
@@ -6322,92 +9583,125 @@ int FindFirst (const char * fileName, unsigned int attr, SearchRec * rec)
 
 int FindNext (SearchRec * rec)
 {   
-    FSFILE      f;
-    FSFILE      gblFileTemp;
-    FILEOBJ     fo = &f;
-    CETYPE      result;
-    BYTE        i, j;
-    DIRENTRY    dir;
-    
     // Make sure we called FindFirst on this object
     if (rec->initialized == FALSE)
         return -1;
     
+    if (!gDiskData[rec->volume].mount || !VolumeSelect (&gDiskData[rec->volume]))
+        return -1;
+
     // Make we called FindFirst in the cwd
     #ifdef ALLOW_DIRS
         if (rec->cwdclus != cwdptr->dirclus)
             return -1;
     #endif
     
-    if( !FormatFileName(rec->searchname, fo->name, 1) )
-        return -1;
+    return FindFromEntry (rec, rec->entry + 1);
+}
+
+
+/******************************************************************************
+* Function:        int FindFromEntry (SearchRec * rec, WORD fHandle)
+*
+* PreCondition:    rec holds the search set up by FindFirst
+*
+* Input:           rec       - The search; filled in with the entry found
+*                  fHandle   - The first directory entry to look at
+*                  
+* Output:          int       - 0 if an entry was found, -1 otherwise
+*
+* Side Effects:    None
+*
+* Overview:        Find the next entry of the directory being searched that
+*                  matches the pattern and attributes of rec
+*
+* Note:            rec keeps the cluster of the entry found, so the search
+*                  carries on from there without following the directory
+*                  chain from its start, and without reading the directory
+*                  sector again if nothing else has used the buffer since.
+*                  Should not be called by user
+*****************************************************************************/
+
+int FindFromEntry (SearchRec * rec, WORD fHandle)
+{
+    FSFILE      f;
+    FSFILE      gblFileTemp;
+    FILEOBJ     fo = &f;
+    BYTE        i, j;
+    DIRENTRY    dir;
     
-    fo->dsk = &gDiskData;
+    fo->dsk = gActiveDisk;
     fo->cluster = 0;
     fo->ccls    = 0;
-    fo->entry = rec->entry + 1;
+    fo->entry = fHandle;
     fo->attributes = rec->searchattr;
-    
-    #ifndef ALLOW_DIRS
-        // start at the root directory
-        fo->dirclus    = 0;
-        fo->dirccls    = 0;
-    #else
-        fo->dirclus = cwdptr->dirclus;
-        fo->dirccls = cwdptr->dirccls;
+    #ifdef FS_FILE_BUFFERS
+        fo->buffer = NULL;
     #endif
+    for (i = 0; i < FILE_NAME_SIZE; i++)
+    {
+        fo->name[i] = rec->searchpattern[i];
+    }
+    
+    // Carry on in the directory cluster the last entry was found in
+    fo->dirclus = rec->cwdclus;
+    fo->dirccls = rec->dirccls;
     
     // copy file object over
     FileObjectCopy(&gblFileTemp, fo);
     
     // See if the file is found
-    result = FILEfind (fo, &gblFileTemp, 1, 1);
-    
-    if (result != CE_GOOD)
+    if (FILEfind (fo, &gblFileTemp, 3, 1) != CE_GOOD)
         return -1;
-    else
+    
+    // Copy as much name as there is
+    if (fo->attributes != ATTR_VOLUME && fo->attributes != ATTR_DIRECTORY)
     {
-        if (fo->attributes != ATTR_VOLUME && fo->attributes != ATTR_DIRECTORY)
+        for (i = 0, j = 0; (j < 8) && (fo->name[j] != 0x20); i++, j++)
         {
-            for (i = 0, j = 0; (j < 8) && (fo->name[j] != 0x20); i++, j++)
-            {
-                rec->filename[i] = fo->name[j];
-            }
-            // Add the radix if its not a dir
-            if ((fo->name[8] != ' ') || (fo->name[9] != ' ') || (fo->name[10] != ' '))
-                rec->filename[i++] = '.';
-            // Move to the extension, even if there are more space chars
-            for (j = 8; (j < 11) && (fo->name[j] != 0x20); i++, j++)
-            {
-                rec->filename[i] = fo->name[j];
-            }
-            // Null terminate it
-            rec->filename[i] = 0;
+            rec->filename[i] = fo->name[j];
         }
-        else
+        // Add the radix if its not a dir
+        if ((fo->name[8] != ' ') || (fo->name[9] != ' ') || (fo->name[10] != ' '))
+            rec->filename[i++] = '.';
+        // Move to the extension, even if there are more space chars
+        for (j = 8; (j < 11) && (fo->name[j] != 0x20); i++, j++)
         {
-            for (i = 0; i < 11; i++)
-            {
-                rec->filename[i] = fo->name[i];
-            }
-            rec->filename[i] = 0;
-            i--;
-            while (rec->filename[i] == 0x20)
-                rec->filename[i--] = 0;
+            rec->filename[i] = fo->name[j];
         }
-    
-        rec->attributes = fo->attributes;
-        rec->filesize = fo->size;
-        if ((fo->attributes & ATTR_DIRECTORY) == 0)
-            rec->timestamp = (DWORD)((DWORD)fo->date << 16) + fo->time;
-        else
+        // Null terminate it
+        rec->filename[i] = 0;
+    }
+    else
+    {
+        for (i = 0; i < 11; i++)
         {
-            dir = Cache_File_Entry (fo, &fo->entry, FALSE);
-            rec->timestamp = (DWORD)((DWORD)dir->DIR_CrtDate << 16) + dir->DIR_CrtTime;
+            rec->filename[i] = fo->name[i];
         }
-        rec->entry = fo->entry;
-        return 0;
+        rec->filename[i] = 0;
+        i--;
+        while (rec->filename[i] == 0x20)
+            rec->filename[i--] = 0;
+    }
+
+#ifdef SUPPORT_LFN
+    // Give the long name if the entry has one
+    strcpy (rec->longFilename, gLfnValid ? gLfnName : rec->filename);
+#endif
+    
+    rec->attributes = fo->attributes;
+    rec->filesize = fo->size;
+    if ((fo->attributes & ATTR_DIRECTORY) == 0)
+        rec->timestamp = (DWORD)((DWORD)fo->date << 16) + fo->time;
+    else
+    {
+        // FILEfind leaves the entry's sector in the buffer
+        dir = (DIRENTRY)fo->dsk->buffer + DIRENTRY_INDEX (fo->dsk, fo->entry);
+        rec->timestamp = (DWORD)((DWORD)dir->DIR_CrtDate << 16) + dir->DIR_CrtTime;
     }
+    rec->entry = fo->entry;
+    rec->dirccls = fo->dirccls;
+    return 0;
 }
 
 
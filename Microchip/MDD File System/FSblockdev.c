@@ -0,0 +1,442 @@
+/******************************************************************************
+ *
+ *               Microchip Memory Disk Drive File System
+ *
+ ******************************************************************************
+ * FileName:        FSblockdev.c
+ * Dependencies:    FSblockdev.h
+ * Processor:       PIC24/dsPIC30/dsPIC33/PIC32MX, or a workstation
+ * Compiler:        C30/C32/GCC
+ *
+ * Passes the media calls of the file system on to the block device driver
+ * chosen with FSSetBlockDevice().  See FSblockdev.h.
+ *
+*****************************************************************************/
+
+#include "MDD File System/FSIO.h"
+#include "MDD File System/FSblockdev.h"
+
+
+// The driver in use; NULL until one is set
+const FS_BLOCK_DEVICE * gBlockDevice = NULL;
+
+// Result of the last write started on a driver that writes at once; 0 if it
+// succeeded
+BYTE gBlockDeviceWriteResult = 0;
+
+
+/******************************************************************************
+* Function:        void FSSetBlockDevice (const FS_BLOCK_DEVICE * device)
+*
+* PreCondition:    None
+*
+* Input:           device     - The driver to use, or NULL for none
+*
+* Output:          None
+*
+* Side Effects:    None
+*
+* Overview:        Choose the driver the file system reaches its media with
+*
+* Note:            None
+*****************************************************************************/
+
+void FSSetBlockDevice (const FS_BLOCK_DEVICE * device)
+{
+    gBlockDevice = device;
+}
+
+
+/******************************************************************************
+* Function:        BYTE BlockDeviceMediaDetect (void)
+*
+* PreCondition:    None
+*
+* Input:           None
+*
+* Output:          TRUE       - The media is present
+*                  FALSE      - No driver, or the media is not present
+*
+* Side Effects:    None
+*
+* Overview:        MediaDetect() of the file system
+*
+* Note:            A driver that can't tell is taken to have media
+*****************************************************************************/
+
+BYTE BlockDeviceMediaDetect (void)
+{
+    if (gBlockDevice == NULL)
+        return FALSE;
+    if (gBlockDevice->detect == NULL)
+        return TRUE;
+    return gBlockDevice->detect();
+}
+
+
+/******************************************************************************
+* Function:        BYTE BlockDeviceMediaInitialize (void)
+*
+* PreCondition:    None
+*
+* Input:           None
+*
+* Output:          TRUE       - The media is ready
+*                  FALSE      - No driver, or the media could not be set up
+*
+* Side Effects:    None
+*
+* Overview:        MediaInitialize() of the file system
+*
+* Note:            None
+*****************************************************************************/
+
+BYTE BlockDeviceMediaInitialize (void)
+{
+    if (gBlockDevice == NULL)
+        return FALSE;
+    return gBlockDevice->initialize();
+}
+
+
+/******************************************************************************
+* Function:        BYTE BlockDeviceSectorReadMultiple (DWORD sector, WORD count,
+*                                                      BYTE * buffer)
+*
+* PreCondition:    Media initialized
+*
+* Input:           sector     - First sector to read
+*                  count      - Number of consecutive sectors
+*                  buffer     - Destination, count sectors
+*
+* Output:          TRUE       - All sectors read
+*                  FALSE      - No driver, or a sector could not be read
+*
+* Side Effects:    None
+*
+* Overview:        SectorRead() and SectorReadMultiple() of the file system
+*
+* Note:            None
+*****************************************************************************/
+
+BYTE BlockDeviceSectorReadMultiple (DWORD sector, WORD count, BYTE * buffer)
+{
+    if (gBlockDevice == NULL)
+        return FALSE;
+    return gBlockDevice->readSectors (sector, count, buffer);
+}
+
+
+/******************************************************************************
+* Function:        BYTE BlockDeviceSectorWriteMultiple (DWORD sector, WORD count,
+*                                        BYTE * buffer, BYTE allowWriteToZero)
+*
+* PreCondition:    Media initialized
+*
+* Input:           sector           - First sector to write
+*                  count            - Number of consecutive sectors
+*                  buffer           - Source, count sectors
+*                  allowWriteToZero - TRUE if sector 0 may be written
+*
+* Output:          TRUE       - All sectors written
+*                  FALSE      - No driver, or a sector could not be written
+*
+* Side Effects:    None
+*
+* Overview:        SectorWrite() and SectorWriteMultiple() of the file system
+*
+* Note:            None
+*****************************************************************************/
+
+BYTE BlockDeviceSectorWriteMultiple (DWORD sector, WORD count, BYTE * buffer, BYTE allowWriteToZero)
+{
+    if (gBlockDevice == NULL)
+        return FALSE;
+    return gBlockDevice->writeSectors (sector, count, buffer, allowWriteToZero);
+}
+
+
+/******************************************************************************
+* Function:        BYTE BlockDeviceSectorZeroMultiple (DWORD sector, DWORD count,
+*                                          BYTE * buffer, WORD bufferSectors)
+*
+* PreCondition:    Media initialized
+*
+* Input:           sector           - First sector to clear
+*                  count            - Number of consecutive sectors
+*                  buffer           - bufferSectors sectors of zeros
+*                  bufferSectors    - Size of buffer in sectors
+*
+* Output:          TRUE             - All sectors cleared
+*                  FALSE            - No driver, or a sector could not be
+*                                     written
+*
+* Side Effects:    None
+*
+* Overview:        SectorZeroMultiple() of the file system
+*
+* Note:            Drivers that can't clear a run themselves get the zero
+*                  buffer written over it as many times as it takes
+*****************************************************************************/
+
+BYTE BlockDeviceSectorZeroMultiple (DWORD sector, DWORD count, BYTE * buffer, WORD bufferSectors)
+{
+    WORD    run;
+
+    if (gBlockDevice == NULL)
+        return FALSE;
+    if (gBlockDevice->zeroSectors != NULL)
+        return gBlockDevice->zeroSectors (sector, count, buffer, bufferSectors);
+
+    while (count != 0)
+    {
+        run = bufferSectors;
+        if (count < run)
+            run = (WORD)count;
+        if (gBlockDevice->writeSectors (sector, run, buffer, FALSE) != TRUE)
+            return FALSE;
+        sector += run;
+        count -= run;
+    }
+    return TRUE;
+}
+
+
+/******************************************************************************
+* Function:        BYTE BlockDeviceMediaSync (void)
+*
+* PreCondition:    Media initialized
+*
+* Input:           None
+*
+* Output:          TRUE       - Every write so far is on the media
+*                  FALSE      - No driver, or the writes could not be finished
+*
+* Side Effects:    None
+*
+* Overview:        MediaSync() of the file system
+*
+* Note:            None
+*****************************************************************************/
+
+BYTE BlockDeviceMediaSync (void)
+{
+    if (gBlockDevice == NULL)
+        return FALSE;
+    if (gBlockDevice->sync == NULL)
+        return TRUE;
+    return gBlockDevice->sync();
+}
+
+
+/******************************************************************************
+* Function:        DWORD BlockDeviceMediaCapacity (void)
+*
+* PreCondition:    Media initialized
+*
+* Input:           None
+*
+* Output:          DWORD      - Number of sectors on the media, 0 if unknown
+*
+* Side Effects:    None
+*
+* Overview:        MediaCapacity() of the file system
+*
+* Note:            None
+*****************************************************************************/
+
+DWORD BlockDeviceMediaCapacity (void)
+{
+    if ((gBlockDevice == NULL) || (gBlockDevice->capacity == NULL))
+        return 0;
+    return gBlockDevice->capacity();
+}
+
+
+/******************************************************************************
+* Function:        BYTE BlockDeviceWriteProtectState (void)
+*
+* PreCondition:    None
+*
+* Input:           None
+*
+* Output:          TRUE       - The media can't be written
+*                  FALSE      - The media can be written
+*
+* Side Effects:    None
+*
+* Overview:        WriteProtectState() of the file system
+*
+* Note:            None
+*****************************************************************************/
+
+BYTE BlockDeviceWriteProtectState (void)
+{
+    if (gBlockDevice == NULL)
+        return TRUE;
+    if (gBlockDevice->writeProtect == NULL)
+        return FALSE;
+    return gBlockDevice->writeProtect();
+}
+
+
+/******************************************************************************
+* Function:        BYTE BlockDeviceMediaSelect (BYTE unit)
+*
+* PreCondition:    None
+*
+* Input:           unit       - The media unit to use
+*
+* Output:          TRUE       - The unit is present and selected
+*                  FALSE      - No driver, or no such unit
+*
+* Side Effects:    None
+*
+* Overview:        MediaSelect() of the file system
+*
+* Note:            A driver without units only has unit 0
+*****************************************************************************/
+
+BYTE BlockDeviceMediaSelect (BYTE unit)
+{
+    if (gBlockDevice == NULL)
+        return FALSE;
+    if (gBlockDevice->select == NULL)
+        return (unit == 0);
+    return gBlockDevice->select (unit);
+}
+
+
+/******************************************************************************
+* Function:        BYTE BlockDeviceSectorWriteStart (DWORD sector, WORD count,
+*                                        BYTE * buffer, BYTE allowWriteToZero)
+*
+* PreCondition:    Media initialized, no write running
+*
+* Input:           sector           - First sector to write
+*                  count            - Number of consecutive sectors
+*                  buffer           - Source, count sectors;
+*                                     kept until the write is complete
+*                  allowWriteToZero - TRUE if sector 0 may be written
+*
+* Output:          TRUE       - The write was started
+*                  FALSE      - No driver, or the write could not be started
+*
+* Side Effects:    None
+*
+* Overview:        SectorWriteStart() of the file system write queue
+*
+* Note:            Drivers that can't write in the background write the
+*                  sectors now, and BlockDeviceSectorWriteIsComplete()
+*                  reports the result
+*****************************************************************************/
+
+BYTE BlockDeviceSectorWriteStart (DWORD sector, WORD count, BYTE * buffer, BYTE allowWriteToZero)
+{
+    if (gBlockDevice == NULL)
+        return FALSE;
+    if (gBlockDevice->writeStart != NULL)
+        return gBlockDevice->writeStart (sector, count, buffer, allowWriteToZero);
+
+    gBlockDeviceWriteResult = (gBlockDevice->writeSectors (sector, count, buffer, allowWriteToZero) == TRUE) ? 0 : 1;
+    return TRUE;
+}
+
+
+/******************************************************************************
+* Function:        BYTE BlockDeviceSectorWriteIsComplete (BYTE * errorCode)
+*
+* PreCondition:    None
+*
+* Input:           errorCode  - Set to 0 if the last write succeeded
+*
+* Output:          TRUE       - No write is running
+*                  FALSE      - The write is still running
+*
+* Side Effects:    None
+*
+* Overview:        SectorWriteIsComplete() of the file system write queue
+*
+* Note:            None
+*****************************************************************************/
+
+BYTE BlockDeviceSectorWriteIsComplete (BYTE * errorCode)
+{
+    if ((gBlockDevice == NULL) || (gBlockDevice->writeStart == NULL))
+    {
+        *errorCode = gBlockDeviceWriteResult;
+        return TRUE;
+    }
+    return gBlockDevice->writeIsComplete (errorCode);
+}
+
+
+/******************************************************************************
+* Function:        WORD BlockDeviceMediaSectorSize (void)
+*
+* PreCondition:    Media initialized
+*
+* Input:           None
+*
+* Output:          WORD       - Bytes in a sector of the media
+*
+* Side Effects:    None
+*
+* Overview:        MediaSectorSize() of the file system
+*
+* Note:            Drivers that don't say have MEDIA_SECTOR_SIZE byte
+*                  sectors
+*****************************************************************************/
+
+WORD BlockDeviceMediaSectorSize (void)
+{
+    if ((gBlockDevice == NULL) || (gBlockDevice->sectorSize == NULL))
+        return MEDIA_SECTOR_SIZE;
+    return gBlockDevice->sectorSize();
+}
+
+
+/******************************************************************************
+* Function:        WORD ReadWord (BYTE * pBuffer, WORD index)
+*
+* PreCondition:    None
+*
+* Input:           pBuffer    - Pointer to data buffer
+*                  index      - Starting point of data in the buffer
+*
+* Output:          WORD       - Little endian word at that place
+*
+* Side Effects:    None
+*
+* Overview:        Read a 16-bit value that may not be aligned
+*
+* Note:            None
+*****************************************************************************/
+
+WORD ReadWord (BYTE * pBuffer, WORD index)
+{
+    return (WORD)pBuffer[index] | ((WORD)pBuffer[index + 1] << 8);
+}
+
+
+/******************************************************************************
+* Function:        DWORD ReadDWord (BYTE * pBuffer, WORD index)
+*
+* PreCondition:    None
+*
+* Input:           pBuffer    - Pointer to data buffer
+*                  index      - Starting point of data in the buffer
+*
+* Output:          DWORD      - Little endian double word at that place
+*
+* Side Effects:    None
+*
+* Overview:        Read a 32-bit value that may not be aligned
+*
+* Note:            None
+*****************************************************************************/
+
+DWORD ReadDWord (BYTE * pBuffer, WORD index)
+{
+    return (DWORD)ReadWord (pBuffer, index) | ((DWORD)ReadWord (pBuffer, index + 2) << 16);
+}
@@ -0,0 +1,423 @@
+/******************************************************************************
+ *
+ *               Microchip Memory Disk Drive File System
+ *
+ ******************************************************************************
+ * FileName:        FSfiledisk.c
+ * Dependencies:    FSfiledisk.h, FSblockdev.h
+ * Processor:       Workstation (POSIX)
+ * Compiler:        GCC
+ *
+ * Block device backed by a disk image file.  See FSfiledisk.h.
+ *
+ * This file is not part of the PIC projects.  To run the file system on a
+ * workstation, use an FSconfig.h that selects FSblockdev.h as INCLUDEFILE
+ * (see "FS Host Bench") and build FSIO.c, FSblockdev.c, FSwritequeue.c,
+ * FSwritecache.c and this file with the application, for example
+ *
+ *      gcc -O2 -fgnu89-inline -fpack-struct=2 -I "FS Host Bench" -I Microchip/Include
+ *          "Microchip/MDD File System/FSIO.c"
+ *          "Microchip/MDD File System/FSblockdev.c"
+ *          "Microchip/MDD File System/FSfiledisk.c"
+ *          "Microchip/MDD File System/FSwritequeue.c"
+ *          "Microchip/MDD File System/FSwritecache.c"
+ *          "FS Host Bench/fsbench.c" -o fsbench
+ *
+ * -fgnu89-inline and -fpack-struct=2 make GCC treat inline functions and lay
+ * out the on-disk structures the way C30 does.
+ *
+*****************************************************************************/
+
+#define _FILE_OFFSET_BITS   64
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "MDD File System/FSIO.h"
+#include "MDD File System/FSfiledisk.h"
+
+
+FILE_DISK_STATS gFileDiskStats;
+
+static FILE *   diskFile = NULL;        // The open image
+static DWORD    diskSectors = 0;        // Size of the image in sectors
+static WORD     diskSectorSize = 512;   // Bytes in a sector of the image
+static BYTE     diskReadOnly = FALSE;   // Report the media as write protected
+
+
+static BYTE     FileDiskMediaDetect (void);
+static BYTE     FileDiskMediaInitialize (void);
+static BYTE     FileDiskSectorReadMultiple (DWORD sector, WORD count, BYTE * buffer);
+static BYTE     FileDiskSectorWriteMultiple (DWORD sector, WORD count, BYTE * buffer, BYTE allowWriteToZero);
+static BYTE     FileDiskMediaSync (void);
+static DWORD    FileDiskMediaCapacity (void);
+static BYTE     FileDiskWriteProtectState (void);
+static WORD     FileDiskMediaSectorSize (void);
+
+static const FS_BLOCK_DEVICE fileDisk =
+{
+    FileDiskMediaDetect,
+    FileDiskMediaInitialize,
+    FileDiskSectorReadMultiple,
+    FileDiskSectorWriteMultiple,
+    NULL,                               // zeros are written
+    FileDiskMediaSync,
+    FileDiskMediaCapacity,
+    FileDiskWriteProtectState,
+    NULL,                               // one unit
+    NULL,                               // written at once
+    NULL,
+    FileDiskMediaSectorSize
+};
+
+
+/******************************************************************************
+* Function:        BYTE FileDiskSetSectorSize (WORD bytes)
+*
+* PreCondition:    None
+*
+* Input:           bytes      - Bytes in a sector
+*
+* Output:          TRUE       - The size is used from now on
+*                  FALSE      - It isn't a power of 2 from 512 to
+*                               MEDIA_SECTOR_SIZE
+*
+* Side Effects:    None
+*
+* Overview:        Set the sector size of the images made or opened next
+*
+* Note:            Images have 512 byte sectors unless this is called
+*****************************************************************************/
+
+BYTE FileDiskSetSectorSize (WORD bytes)
+{
+    if ((bytes < 512) || (bytes > MEDIA_SECTOR_SIZE) || ((bytes & (bytes - 1)) != 0))
+        return FALSE;
+
+    diskSectorSize = bytes;
+    return TRUE;
+}
+
+
+/******************************************************************************
+* Function:        BYTE FileDiskCreate (const char * path, DWORD sectors)
+*
+* PreCondition:    None
+*
+* Input:           path       - Name of the image file
+*                  sectors    - Size of the image in sectors
+*
+* Output:          TRUE       - The image was made
+*                  FALSE      - The file could not be written
+*
+* Side Effects:    An existing file of that name is replaced
+*
+* Overview:        Make a blank image of the given size
+*
+* Note:            The file is extended without writing it, so on most file
+*                  systems a large image takes no space until it is used
+*****************************************************************************/
+
+BYTE FileDiskCreate (const char * path, DWORD sectors)
+{
+    FILE *  f;
+    BYTE    good;
+
+    if ((f = fopen (path, "wb")) == NULL)
+        return FALSE;
+
+    good = (ftruncate (fileno (f), (off_t)sectors * diskSectorSize) == 0);
+
+    if (fclose (f) != 0)
+        good = FALSE;
+
+    return good;
+}
+
+
+/******************************************************************************
+* Function:        const FS_BLOCK_DEVICE * FileDiskOpen (const char * path,
+*                                                       BYTE readOnly)
+*
+* PreCondition:    None
+*
+* Input:           path       - Name of the image file
+*                  readOnly   - TRUE to report the media as write protected
+*
+* Output:          The driver to pass to FSSetBlockDevice(), or NULL if the
+*                  image could not be opened
+*
+* Side Effects:    An image opened before is closed; the counts in
+*                  gFileDiskStats are cleared
+*
+* Overview:        Open a disk image as the media
+*
+* Note:            None
+*****************************************************************************/
+
+const FS_BLOCK_DEVICE * FileDiskOpen (const char * path, BYTE readOnly)
+{
+    off_t   size;
+
+    FileDiskClose();
+
+    if ((diskFile = fopen (path, readOnly ? "rb" : "r+b")) == NULL)
+        return NULL;
+
+    if ((fseeko (diskFile, 0, SEEK_END) != 0) || ((size = ftello (diskFile)) < 0))
+    {
+        FileDiskClose();
+        return NULL;
+    }
+
+    diskSectors = (DWORD)(size / diskSectorSize);
+    diskReadOnly = readOnly;
+    memset (&gFileDiskStats, 0, sizeof (gFileDiskStats));
+
+    return &fileDisk;
+}
+
+
+/******************************************************************************
+* Function:        void FileDiskClose (void)
+*
+* PreCondition:    None
+*
+* Input:           None
+*
+* Output:          None
+*
+* Side Effects:    None
+*
+* Overview:        Write out and close the open image
+*
+* Note:            None
+*****************************************************************************/
+
+void FileDiskClose (void)
+{
+    if (diskFile != NULL)
+    {
+        fclose (diskFile);
+        diskFile = NULL;
+    }
+    diskSectors = 0;
+}
+
+
+/******************************************************************************
+* Function:        BYTE FileDiskMediaDetect (void)
+*
+* PreCondition:    None
+*
+* Input:           None
+*
+* Output:          TRUE       - An image is open
+*                  FALSE      - No image is open
+*
+* Side Effects:    None
+*
+* Overview:        MediaDetect entry of the driver
+*
+* Note:            None
+*****************************************************************************/
+
+static BYTE FileDiskMediaDetect (void)
+{
+    return (diskFile != NULL);
+}
+
+
+/******************************************************************************
+* Function:        BYTE FileDiskMediaInitialize (void)
+*
+* PreCondition:    None
+*
+* Input:           None
+*
+* Output:          TRUE       - An image is open
+*                  FALSE      - No image is open
+*
+* Side Effects:    None
+*
+* Overview:        MediaInitialize entry of the driver
+*
+* Note:            None
+*****************************************************************************/
+
+static BYTE FileDiskMediaInitialize (void)
+{
+    return (diskFile != NULL);
+}
+
+
+/******************************************************************************
+* Function:        BYTE FileDiskSectorReadMultiple (DWORD sector, WORD count,
+*                                                   BYTE * buffer)
+*
+* PreCondition:    Image open
+*
+* Input:           sector     - First sector to read
+*                  count      - Number of consecutive sectors
+*                  buffer     - Destination, count sectors
+*
+* Output:          TRUE       - All sectors read
+*                  FALSE      - The run is past the end of the image, or
+*                               the file could not be read
+*
+* Side Effects:    None
+*
+* Overview:        SectorReadMultiple entry of the driver
+*
+* Note:            None
+*****************************************************************************/
+
+static BYTE FileDiskSectorReadMultiple (DWORD sector, WORD count, BYTE * buffer)
+{
+    if ((diskFile == NULL) || (sector >= diskSectors) || (count > diskSectors - sector))
+        return FALSE;
+
+    gFileDiskStats.readCommands++;
+    gFileDiskStats.readSectors += count;
+
+    if (fseeko (diskFile, (off_t)sector * diskSectorSize, SEEK_SET) != 0)
+        return FALSE;
+    return (fread (buffer, diskSectorSize, count, diskFile) == count);
+}
+
+
+/******************************************************************************
+* Function:        BYTE FileDiskSectorWriteMultiple (DWORD sector, WORD count,
+*                                        BYTE * buffer, BYTE allowWriteToZero)
+*
+* PreCondition:    Image open
+*
+* Input:           sector           - First sector to write
+*                  count            - Number of consecutive sectors
+*                  buffer           - Source, count sectors
+*                  allowWriteToZero - TRUE if sector 0 may be written
+*
+* Output:          TRUE       - All sectors written
+*                  FALSE      - The image is read only, the run is past its
+*                               end or includes sector 0 when that isn't
+*                               allowed, or the file could not be written
+*
+* Side Effects:    None
+*
+* Overview:        SectorWriteMultiple entry of the driver
+*
+* Note:            None
+*****************************************************************************/
+
+static BYTE FileDiskSectorWriteMultiple (DWORD sector, WORD count, BYTE * buffer, BYTE allowWriteToZero)
+{
+    if ((diskFile == NULL) || diskReadOnly || (sector >= diskSectors) || (count > diskSectors - sector))
+        return FALSE;
+    if ((sector == 0) && !allowWriteToZero)
+        return FALSE;
+
+    gFileDiskStats.writeCommands++;
+    gFileDiskStats.writeSectors += count;
+
+    if (fseeko (diskFile, (off_t)sector * diskSectorSize, SEEK_SET) != 0)
+        return FALSE;
+    return (fwrite (buffer, diskSectorSize, count, diskFile) == count);
+}
+
+
+/******************************************************************************
+* Function:        BYTE FileDiskMediaSync (void)
+*
+* PreCondition:    Image open
+*
+* Input:           None
+*
+* Output:          TRUE       - The writes are in the image file
+*                  FALSE      - They could not be written out
+*
+* Side Effects:    None
+*
+* Overview:        MediaSync entry of the driver
+*
+* Note:            None
+*****************************************************************************/
+
+static BYTE FileDiskMediaSync (void)
+{
+    if (diskFile == NULL)
+        return FALSE;
+
+    gFileDiskStats.syncs++;
+
+    if (fflush (diskFile) != 0)
+        return FALSE;
+    return (fsync (fileno (diskFile)) == 0);
+}
+
+
+/******************************************************************************
+* Function:        DWORD FileDiskMediaCapacity (void)
+*
+* PreCondition:    None
+*
+* Input:           None
+*
+* Output:          DWORD      - Size of the image in sectors
+*
+* Side Effects:    None
+*
+* Overview:        MediaCapacity entry of the driver
+*
+* Note:            None
+*****************************************************************************/
+
+static DWORD FileDiskMediaCapacity (void)
+{
+    return diskSectors;
+}
+
+
+/******************************************************************************
+* Function:        BYTE FileDiskWriteProtectState (void)
+*
+* PreCondition:    None
+*
+* Input:           None
+*
+* Output:          TRUE       - The image was opened read only
+*                  FALSE      - The image can be written
+*
+* Side Effects:    None
+*
+* Overview:        WriteProtectState entry of the driver
+*
+* Note:            None
+*****************************************************************************/
+
+static BYTE FileDiskWriteProtectState (void)
+{
+    return diskReadOnly;
+}
+
+
+/******************************************************************************
+* Function:        WORD FileDiskMediaSectorSize (void)
+*
+* PreCondition:    None
+*
+* Input:           None
+*
+* Output:          WORD       - Bytes in a sector of the image
+*
+* Side Effects:    None
+*
+* Overview:        sectorSize entry of the driver
+*
+* Note:            None
+*****************************************************************************/
+
+static WORD FileDiskMediaSectorSize (void)
+{
+    return diskSectorSize;
+}
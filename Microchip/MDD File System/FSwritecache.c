@@ -0,0 +1,642 @@
+/******************************************************************************
+ *
+ *               Microchip Memory Disk Drive File System
+ *
+ ******************************************************************************
+ * FileName:        FSwritecache.c
+ * Dependencies:    FSwritecache.h, FSmedia.h, the media layer named by INCLUDEFILE
+ * Processor:       PIC24/dsPIC30/dsPIC33/PIC32MX, or a workstation
+ * Compiler:        C30/C32/GCC
+ *
+ * Write-back cache of the sectors written by the file system.  See
+ * FSwritecache.h.
+ *
+ * Each of the FS_WRITE_CACHE_SECTORS slots holds one sector, clean (the
+ * same as on the media) or dirty.  A write to a sector that isn't cached
+ * takes an empty slot, or the least recently used clean one; when every
+ * slot is dirty the whole cache is written back first.  Reads are not
+ * cached, but they see the cached sectors.
+ *
+ * To write back, the slots are sorted by sector, moving the buffers, so a
+ * run of consecutive sectors is also one block of RAM and goes to the media
+ * with one command.  Clean sectors between dirty ones are written with them
+ * rather than splitting the run.
+ *
+ * All slots belong to the media unit last selected; selecting another unit
+ * writes them back first.  If a write back fails, the cache is emptied (the
+ * media is most likely gone).
+ *
+*****************************************************************************/
+
+#include "MDD File System/FSIO.h"
+#include INCLUDEFILE
+#include "MDD File System/FSmedia.h"
+#include "string.h"
+#include "MDD File System/FSwritecache.h"
+
+#if defined(ALLOW_WRITES) && defined(FS_WRITE_CACHE_SECTORS)
+
+#if (FS_WRITE_CACHE_SECTORS < 1) || (FS_WRITE_CACHE_SECTORS > 32)
+    #error FS_WRITE_CACHE_SECTORS must be between 1 and 32
+#endif
+
+#if !defined(SectorReadMultiple) || !defined(SectorWriteMultiple)
+    #error FS_WRITE_CACHE_SECTORS needs a media layer with SectorReadMultiple and SectorWriteMultiple
+#endif
+
+// With background writes the cache writes back into the write queue
+#ifdef FS_BACKGROUND_WRITES
+    #include "MDD File System/FSwritequeue.h"
+    #undef SectorReadMultiple
+    #undef SectorWriteMultiple
+    #undef MediaSync
+    #define SectorReadMultiple      WriteQueueSectorRead
+    #define SectorWriteMultiple     WriteQueueSectorWrite
+    #define MediaSync               WriteQueueMediaSync
+    #ifdef SectorZeroMultiple
+        #undef SectorZeroMultiple
+        #define SectorZeroMultiple  WriteQueueSectorZero
+    #endif
+    #ifdef MediaSelect
+        #undef MediaSelect
+        #define MediaSelect         WriteQueueMediaSelect
+    #endif
+#endif
+
+// Buffer of slot i
+#define WriteCacheSlot(i)   (gWriteCacheBuffer + (DWORD)(i) * gWriteCacheSectorSize)
+
+#define WRITE_CACHE_EMPTY   0       // The slot holds nothing
+#define WRITE_CACHE_CLEAN   1       // The slot is the same as the media
+#define WRITE_CACHE_DIRTY   2       // The slot is newer than the media
+
+
+/*****************************************************************************/
+/*                         Global Variables                                  */
+/*****************************************************************************/
+
+BYTE    gWriteCacheBuffer[FS_WRITE_CACHE_SECTORS * MEDIA_SECTOR_SIZE];
+WORD    gWriteCacheSectorSize = MEDIA_SECTOR_SIZE;      // Bytes in each slot
+DWORD   gWriteCacheSector[FS_WRITE_CACHE_SECTORS];      // Sector in each slot
+BYTE    gWriteCacheState[FS_WRITE_CACHE_SECTORS];       // WRITE_CACHE_EMPTY, _CLEAN or _DIRTY
+BYTE    gWriteCacheAllowZero[FS_WRITE_CACHE_SECTORS];   // The slot may go to sector 0
+BYTE    gWriteCacheAge[FS_WRITE_CACHE_SECTORS];         // 0 for the most recently used slot
+BYTE    gWriteCacheDirtyCount = 0;  // Number of dirty slots
+BYTE    gWriteCacheFailed = FALSE;  // A write back at a unit change failed
+BYTE    gWriteCacheFailedUnit = 0;  // Media unit of the failed write back
+BYTE    gWriteCacheUnit = 0;        // Media unit of the slots
+
+
+/*****************************************************************************/
+/*                         Prototypes                                        */
+/*****************************************************************************/
+
+BYTE WriteCacheFind (DWORD sector);
+BYTE WriteCacheVictim (void);
+void WriteCacheTouch (BYTE slot);
+void WriteCacheSort (void);
+BYTE WriteCacheWriteBack (void);
+void WriteCacheCheckSize (void);
+
+
+/******************************************************************************
+* Function:        BYTE WriteCacheSectorRead (DWORD sector, WORD count,
+*                                             BYTE * buffer)
+*
+* PreCondition:    Media initialized
+*
+* Input:           sector     - First sector to read
+*                  count      - Number of consecutive sectors
+*                  buffer     - Destination, count sectors
+*
+* Output:          TRUE       - All sectors read
+*                  FALSE      - A sector could not be read
+*
+* Side Effects:    None
+*
+* Overview:        SectorRead() and SectorReadMultiple() of the file system
+*
+* Note:            A single cached sector is copied from the cache.  Other
+*                  reads go to the media, and the cached sectors in the run
+*                  are copied over what was read.
+*****************************************************************************/
+
+BYTE WriteCacheSectorRead (DWORD sector, WORD count, BYTE * buffer)
+{
+    BYTE    slot;
+
+    WriteCacheCheckSize();
+
+    if (count == 1)
+    {
+        slot = WriteCacheFind (sector);
+        if (slot != FS_WRITE_CACHE_SECTORS)
+        {
+            memcpy (buffer, WriteCacheSlot (slot), gWriteCacheSectorSize);
+            WriteCacheTouch (slot);
+            return TRUE;
+        }
+    }
+
+    if (!SectorReadMultiple (sector, count, buffer))
+        return FALSE;
+
+    for (slot = 0; slot < FS_WRITE_CACHE_SECTORS; slot++)
+    {
+        if ((gWriteCacheState[slot] != WRITE_CACHE_EMPTY) && (gWriteCacheSector[slot] - sector < count))
+            memcpy (buffer + (DWORD)(gWriteCacheSector[slot] - sector) * gWriteCacheSectorSize, WriteCacheSlot (slot), gWriteCacheSectorSize);
+    }
+
+    return TRUE;
+}
+
+
+/******************************************************************************
+* Function:        BYTE WriteCacheSectorWrite (DWORD sector, WORD count,
+*                                        BYTE * buffer, BYTE allowWriteToZero)
+*
+* PreCondition:    Media initialized
+*
+* Input:           sector           - First sector to write
+*                  count            - Number of consecutive sectors
+*                  buffer           - Source, count sectors
+*                  allowWriteToZero - TRUE if sector 0 may be written
+*
+* Output:          TRUE       - All sectors are cached or written
+*                  FALSE      - The run includes sector 0 when that isn't
+*                               allowed, or a write to the media failed
+*
+* Side Effects:    May write the cache back
+*
+* Overview:        SectorWrite() and SectorWriteMultiple() of the file system
+*
+* Note:            A run as long as the cache or longer is written straight
+*                  to the media; the cached copies of its sectors are
+*                  updated and become clean.
+*****************************************************************************/
+
+BYTE WriteCacheSectorWrite (DWORD sector, WORD count, BYTE * buffer, BYTE allowWriteToZero)
+{
+    BYTE    slot;
+
+    if ((sector == 0) && !allowWriteToZero)
+        return FALSE;
+
+    WriteCacheCheckSize();
+
+    if (count >= FS_WRITE_CACHE_SECTORS)
+    {
+        for (slot = 0; slot < FS_WRITE_CACHE_SECTORS; slot++)
+        {
+            if ((gWriteCacheState[slot] != WRITE_CACHE_EMPTY) && (gWriteCacheSector[slot] - sector < count))
+            {
+                memcpy (WriteCacheSlot (slot), buffer + (DWORD)(gWriteCacheSector[slot] - sector) * gWriteCacheSectorSize, gWriteCacheSectorSize);
+                if (gWriteCacheState[slot] == WRITE_CACHE_DIRTY)
+                    gWriteCacheDirtyCount--;
+                gWriteCacheState[slot] = WRITE_CACHE_CLEAN;
+            }
+        }
+
+        if (!SectorWriteMultiple (sector, count, buffer, allowWriteToZero))
+        {
+            WriteCacheInvalidate();
+            return FALSE;
+        }
+        return TRUE;
+    }
+
+    while (count != 0)
+    {
+        slot = WriteCacheFind (sector);
+        if (slot == FS_WRITE_CACHE_SECTORS)
+        {
+            slot = WriteCacheVictim();
+            if (slot == FS_WRITE_CACHE_SECTORS)
+            {
+                // Every slot is dirty
+                if (!WriteCacheWriteBack())
+                    return FALSE;
+                slot = WriteCacheVictim();
+            }
+            gWriteCacheSector[slot] = sector;
+            gWriteCacheAllowZero[slot] = FALSE;
+        }
+
+        memcpy (WriteCacheSlot (slot), buffer, gWriteCacheSectorSize);
+        if (gWriteCacheState[slot] != WRITE_CACHE_DIRTY)
+        {
+            gWriteCacheState[slot] = WRITE_CACHE_DIRTY;
+            gWriteCacheDirtyCount++;
+        }
+        if (allowWriteToZero)
+            gWriteCacheAllowZero[slot] = TRUE;
+        WriteCacheTouch (slot);
+
+        sector++;
+        count--;
+        buffer += gWriteCacheSectorSize;
+    }
+
+    return TRUE;
+}
+
+
+/******************************************************************************
+* Function:        BYTE WriteCacheSectorZero (DWORD sector, DWORD count,
+*                                          BYTE * buffer, WORD bufferSectors)
+*
+* PreCondition:    Media initialized
+*
+* Input:           sector           - First sector to clear
+*                  count            - Number of consecutive sectors
+*                  buffer           - bufferSectors sectors of zeros
+*                  bufferSectors    - Size of buffer in sectors
+*
+* Output:          TRUE             - All sectors cleared
+*                  FALSE            - A sector could not be written
+*
+* Side Effects:    None
+*
+* Overview:        SectorZeroMultiple() of the file system
+*
+* Note:            The cached sectors in the run are dropped, since the
+*                  media layer clears them.  Only used with media layers
+*                  that clear runs themselves.
+*****************************************************************************/
+
+#ifdef SectorZeroMultiple
+BYTE WriteCacheSectorZero (DWORD sector, DWORD count, BYTE * buffer, WORD bufferSectors)
+{
+    BYTE    slot;
+
+    for (slot = 0; slot < FS_WRITE_CACHE_SECTORS; slot++)
+    {
+        if ((gWriteCacheState[slot] != WRITE_CACHE_EMPTY) && (gWriteCacheSector[slot] - sector < count))
+        {
+            if (gWriteCacheState[slot] == WRITE_CACHE_DIRTY)
+                gWriteCacheDirtyCount--;
+            gWriteCacheState[slot] = WRITE_CACHE_EMPTY;
+        }
+    }
+
+    return SectorZeroMultiple (sector, count, buffer, bufferSectors);
+}
+#endif
+
+
+/******************************************************************************
+* Function:        BYTE WriteCacheMediaSync (void)
+*
+* PreCondition:    Media initialized
+*
+* Input:           None
+*
+* Output:          TRUE       - Every write so far is on the media
+*                  FALSE      - The cache could not be written back, or the
+*                               media could not be synced
+*
+* Side Effects:    The cache is written back
+*
+* Overview:        MediaSync() of the file system
+*
+* Note:            A failed write back at an earlier unit change is
+*                  reported here, once, for that unit.
+*****************************************************************************/
+
+BYTE WriteCacheMediaSync (void)
+{
+    BYTE    good = TRUE;
+
+    if (gWriteCacheFailed && (gWriteCacheFailedUnit == gWriteCacheUnit))
+    {
+        gWriteCacheFailed = FALSE;
+        good = FALSE;
+    }
+
+    if (!WriteCacheWriteBack())
+        good = FALSE;
+    if (!MediaSync())
+        good = FALSE;
+
+    return good;
+}
+
+
+/******************************************************************************
+* Function:        BYTE WriteCacheMediaSelect (BYTE unit)
+*
+* PreCondition:    None
+*
+* Input:           unit       - The media unit to use
+*
+* Output:          TRUE       - The unit is present and selected
+*                  FALSE      - No such unit
+*
+* Side Effects:    Writes the cache back and empties it when the unit
+*                  changes
+*
+* Overview:        MediaSelect() of the file system
+*
+* Note:            Only used with media layers that have units.  The file
+*                  system may have selected another unit (that wasn't
+*                  there) since the sectors were cached, so their unit is
+*                  selected again to write them.
+*****************************************************************************/
+
+#ifdef MediaSelect
+BYTE WriteCacheMediaSelect (BYTE unit)
+{
+    if (unit != gWriteCacheUnit)
+    {
+        if ((gWriteCacheDirtyCount != 0) &&
+            (!MediaSelect (gWriteCacheUnit) || !WriteCacheWriteBack()))
+        {
+            gWriteCacheFailed = TRUE;
+            gWriteCacheFailedUnit = gWriteCacheUnit;
+        }
+        WriteCacheInvalidate();
+        gWriteCacheUnit = unit;
+    }
+    return MediaSelect (unit);
+}
+#endif
+
+
+/******************************************************************************
+* Function:        void WriteCacheInvalidate (void)
+*
+* PreCondition:    None
+*
+* Input:           None
+*
+* Output:          None
+*
+* Side Effects:    Dirty sectors are dropped without being written
+*
+* Overview:        Empty the write cache
+*
+* Note:            FSInit() calls this, since the media may have changed
+*                  under the cache
+*****************************************************************************/
+
+void WriteCacheInvalidate (void)
+{
+    BYTE    i;
+
+    for (i = 0; i < FS_WRITE_CACHE_SECTORS; i++)
+    {
+        gWriteCacheState[i] = WRITE_CACHE_EMPTY;
+        gWriteCacheAge[i] = i;
+    }
+    gWriteCacheDirtyCount = 0;
+}
+
+
+/******************************************************************************
+* Function:        BYTE WriteCacheFind (DWORD sector)
+*
+* PreCondition:    None
+*
+* Input:           sector     - The sector wanted
+*
+* Output:          BYTE       - The slot holding it, or
+*                               FS_WRITE_CACHE_SECTORS if it isn't cached
+*
+* Side Effects:    None
+*
+* Overview:        Look a sector up in the write cache
+*
+* Note:            None
+*****************************************************************************/
+
+BYTE WriteCacheFind (DWORD sector)
+{
+    BYTE    slot;
+
+    for (slot = 0; slot < FS_WRITE_CACHE_SECTORS; slot++)
+    {
+        if ((gWriteCacheState[slot] != WRITE_CACHE_EMPTY) && (gWriteCacheSector[slot] == sector))
+            break;
+    }
+    return slot;
+}
+
+
+/******************************************************************************
+* Function:        BYTE WriteCacheVictim (void)
+*
+* PreCondition:    None
+*
+* Input:           None
+*
+* Output:          BYTE       - An empty slot, else the least recently used
+*                               clean one, or FS_WRITE_CACHE_SECTORS if
+*                               every slot is dirty
+*
+* Side Effects:    None
+*
+* Overview:        Pick the slot a newly cached sector goes in
+*
+* Note:            None
+*****************************************************************************/
+
+BYTE WriteCacheVictim (void)
+{
+    BYTE    i;
+    BYTE    slot = FS_WRITE_CACHE_SECTORS;
+
+    for (i = 0; i < FS_WRITE_CACHE_SECTORS; i++)
+    {
+        if (gWriteCacheState[i] == WRITE_CACHE_EMPTY)
+            return i;
+        if ((gWriteCacheState[i] == WRITE_CACHE_CLEAN) &&
+            ((slot == FS_WRITE_CACHE_SECTORS) || (gWriteCacheAge[i] > gWriteCacheAge[slot])))
+        {
+            slot = i;
+        }
+    }
+    return slot;
+}
+
+
+/******************************************************************************
+* Function:        void WriteCacheTouch (BYTE slot)
+*
+* PreCondition:    None
+*
+* Input:           slot       - The slot just used
+*
+* Output:          None
+*
+* Side Effects:    None
+*
+* Overview:        Make a slot the most recently used
+*
+* Note:            None
+*****************************************************************************/
+
+void WriteCacheTouch (BYTE slot)
+{
+    BYTE    i, age;
+
+    age = gWriteCacheAge[slot];
+    for (i = 0; i < FS_WRITE_CACHE_SECTORS; i++)
+    {
+        if (gWriteCacheAge[i] < age)
+            gWriteCacheAge[i]++;
+    }
+    gWriteCacheAge[slot] = 0;
+}
+
+
+/******************************************************************************
+* Function:        void WriteCacheSort (void)
+*
+* PreCondition:    None
+*
+* Input:           None
+*
+* Output:          None
+*
+* Side Effects:    None
+*
+* Overview:        Order the slots by sector, empty slots last
+*
+* Note:            The buffers are moved with the slots.  Sectors written
+*                  in order are usually in order already, so little moves.
+*****************************************************************************/
+
+void WriteCacheSort (void)
+{
+    BYTE    i, j, min, b;
+    DWORD   l;
+    WORD    k;
+
+    for (i = 0; i + 1 < FS_WRITE_CACHE_SECTORS; i++)
+    {
+        min = i;
+        for (j = i + 1; j < FS_WRITE_CACHE_SECTORS; j++)
+        {
+            if ((gWriteCacheState[min] == WRITE_CACHE_EMPTY) ? (gWriteCacheState[j] != WRITE_CACHE_EMPTY) :
+                ((gWriteCacheState[j] != WRITE_CACHE_EMPTY) && (gWriteCacheSector[j] < gWriteCacheSector[min])))
+            {
+                min = j;
+            }
+        }
+        if (min == i)
+            continue;
+
+        for (k = 0; k < gWriteCacheSectorSize; k++)
+        {
+            b = WriteCacheSlot (i)[k];
+            WriteCacheSlot (i)[k] = WriteCacheSlot (min)[k];
+            WriteCacheSlot (min)[k] = b;
+        }
+        l = gWriteCacheSector[i];
+        gWriteCacheSector[i] = gWriteCacheSector[min];
+        gWriteCacheSector[min] = l;
+        b = gWriteCacheState[i];
+        gWriteCacheState[i] = gWriteCacheState[min];
+        gWriteCacheState[min] = b;
+        b = gWriteCacheAllowZero[i];
+        gWriteCacheAllowZero[i] = gWriteCacheAllowZero[min];
+        gWriteCacheAllowZero[min] = b;
+        b = gWriteCacheAge[i];
+        gWriteCacheAge[i] = gWriteCacheAge[min];
+        gWriteCacheAge[min] = b;
+    }
+}
+
+
+/******************************************************************************
+* Function:        BYTE WriteCacheWriteBack (void)
+*
+* PreCondition:    The unit of the slots is selected
+*
+* Input:           None
+*
+* Output:          TRUE       - No slot is dirty
+*                  FALSE      - A write failed; the cache has been emptied
+*
+* Side Effects:    None
+*
+* Overview:        Write every dirty sector to the media
+*
+* Note:            Each run of consecutive cached sectors that starts and
+*                  ends with a dirty one is written with one command.
+*****************************************************************************/
+
+BYTE WriteCacheWriteBack (void)
+{
+    BYTE    first, last, i;
+
+    if (gWriteCacheDirtyCount == 0)
+        return TRUE;
+
+    WriteCacheSort();
+
+    for (first = 0; (first < FS_WRITE_CACHE_SECTORS) && (gWriteCacheState[first] != WRITE_CACHE_EMPTY); first = last + 1)
+    {
+        last = first;
+        if (gWriteCacheState[first] != WRITE_CACHE_DIRTY)
+            continue;
+
+        for (i = first + 1; (i < FS_WRITE_CACHE_SECTORS) && (gWriteCacheState[i] != WRITE_CACHE_EMPTY) &&
+                            (gWriteCacheSector[i] == gWriteCacheSector[i - 1] + 1); i++)
+        {
+            if (gWriteCacheState[i] == WRITE_CACHE_DIRTY)
+                last = i;
+        }
+
+        // Only the first sector of a run can be sector 0
+        if (!SectorWriteMultiple (gWriteCacheSector[first], last - first + 1, WriteCacheSlot (first), gWriteCacheAllowZero[first]))
+        {
+            WriteCacheInvalidate();
+            return FALSE;
+        }
+
+        for (i = first; i <= last; i++)
+        {
+            if (gWriteCacheState[i] == WRITE_CACHE_DIRTY)
+            {
+                gWriteCacheState[i] = WRITE_CACHE_CLEAN;
+                gWriteCacheDirtyCount--;
+            }
+        }
+    }
+
+    return TRUE;
+}
+
+
+
+/******************************************************************************
+* Function:        void WriteCacheCheckSize (void)
+*
+* PreCondition:    None
+*
+* Input:           None
+*
+* Output:          None
+*
+* Side Effects:    The cache is emptied if the sector size has changed
+*
+* Overview:        Size the slots to the sectors of the selected media
+*
+* Note:            The slots are as large as the media's sectors, which may
+*                  be smaller than MEDIA_SECTOR_SIZE, so that a run of them
+*                  is one block of memory.  Sectors cached for media whose
+*                  sector size has changed since are for other media, and
+*                  are dropped.
+*****************************************************************************/
+
+void WriteCacheCheckSize (void)
+{
+    if (gWriteCacheSectorSize != MediaSectorSize())
+    {
+        WriteCacheInvalidate();
+        gWriteCacheSectorSize = MediaSectorSize();
+    }
+}
+
+#endif
@@ -0,0 +1,510 @@
+/******************************************************************************
+ *
+ *               Microchip Memory Disk Drive File System
+ *
+ ******************************************************************************
+ * FileName:        FSwritequeue.c
+ * Dependencies:    FSwritequeue.h, FSmedia.h, the media layer named by INCLUDEFILE
+ * Processor:       PIC24/dsPIC30/dsPIC33/PIC32MX, or a workstation
+ * Compiler:        C30/C32/GCC
+ *
+ * Queue of sectors written by the file system, sent to the media in the
+ * background.  See FSwritequeue.h.
+ *
+ * The queue is a ring of FS_WRITE_QUEUE_SECTORS sector buffers, oldest
+ * first.  The entries at the front that are being written stay in the queue
+ * until the media reports the write complete.  All entries belong to the
+ * media unit last selected; selecting another unit waits for them first.
+ * The entries are as large as the unit's sectors, which may be smaller than
+ * MEDIA_SECTOR_SIZE, so that a run of them is one block of memory.
+ *
+ * If a background write fails, the queue is emptied (the media is most
+ * likely gone) and the next write, sync or flush on that unit returns the
+ * error.
+ *
+*****************************************************************************/
+
+#include "MDD File System/FSIO.h"
+#include INCLUDEFILE
+#include "MDD File System/FSmedia.h"
+#include "string.h"
+#include "MDD File System/FSwritequeue.h"
+
+#if defined(ALLOW_WRITES) && defined(FS_BACKGROUND_WRITES)
+
+// Four sectors are queued unless the configuration asks for another number
+#ifndef FS_WRITE_QUEUE_SECTORS
+    #define FS_WRITE_QUEUE_SECTORS  4
+#endif
+#if (FS_WRITE_QUEUE_SECTORS < 1) || (FS_WRITE_QUEUE_SECTORS > 255)
+    #error FS_WRITE_QUEUE_SECTORS must be between 1 and 255
+#endif
+
+#if !defined(SectorReadMultiple) || !defined(SectorWriteMultiple)
+    #error FS_BACKGROUND_WRITES needs a media layer with SectorReadMultiple and SectorWriteMultiple
+#endif
+
+// Media layers that can't write in the background write each run when it
+// is started
+#ifndef SectorWriteStart
+    #define SectorWriteStart(s,c,b,z)   SectorWriteMultiple ((s), (c), (b), (z))
+    #define SectorWriteIsComplete(e)    ((*(e) = 0), TRUE)
+#endif
+
+// Buffer of entry i
+#define WriteQueueEntry(i)  (gWriteQueueBuffer + (DWORD)(i) * gWriteQueueSectorSize)
+
+
+/*****************************************************************************/
+/*                         Global Variables                                  */
+/*****************************************************************************/
+
+BYTE    gWriteQueueBuffer[FS_WRITE_QUEUE_SECTORS * MEDIA_SECTOR_SIZE];
+WORD    gWriteQueueSectorSize = MEDIA_SECTOR_SIZE;      // Bytes in each entry
+DWORD   gWriteQueueSector[FS_WRITE_QUEUE_SECTORS];      // Sector each entry is written to
+BYTE    gWriteQueueAllowZero[FS_WRITE_QUEUE_SECTORS];   // The entry may go to sector 0
+BYTE    gWriteQueueFirst = 0;       // Oldest entry
+BYTE    gWriteQueueCount = 0;       // Entries in use, including those being written
+BYTE    gWriteQueueWriting = 0;     // Entries at the front in the running write, 0 if none
+BYTE    gWriteQueueFailed = FALSE;  // A write failed since the error was last returned
+BYTE    gWriteQueueFailedUnit = 0;  // Media unit of the failed write
+BYTE    gWriteQueueUnit = 0;        // Media unit of the entries
+
+
+/*****************************************************************************/
+/*                         Prototypes                                        */
+/*****************************************************************************/
+
+void WriteQueueCheck (void);
+void WriteQueueWait (void);
+void WriteQueueDrop (void);
+BYTE WriteQueueError (void);
+
+
+/******************************************************************************
+* Function:        void FSWriteQueueTasks (void)
+*
+* PreCondition:    None
+*
+* Input:           None
+*
+* Output:          None
+*
+* Side Effects:    None
+*
+* Overview:        Finish the running write and start the next one
+*
+* Note:            The oldest entries are sent together for as long as they
+*                  follow on from each other both on the media and in the
+*                  ring, so a file written sector after sector goes out in
+*                  runs of up to FS_WRITE_QUEUE_SECTORS sectors.
+*****************************************************************************/
+
+void FSWriteQueueTasks (void)
+{
+    BYTE    first;
+    BYTE    run;
+
+    WriteQueueCheck();
+    if ((gWriteQueueWriting != 0) || (gWriteQueueCount == 0))
+        return;
+
+    first = gWriteQueueFirst;
+    run = 1;
+    while ((run < gWriteQueueCount) && (first + run < FS_WRITE_QUEUE_SECTORS) &&
+           (gWriteQueueSector[first + run] == gWriteQueueSector[first] + run))
+    {
+        run++;
+    }
+
+    if (SectorWriteStart (gWriteQueueSector[first], run, WriteQueueEntry (first), gWriteQueueAllowZero[first]))
+    {
+        gWriteQueueWriting = run;
+    }
+    else
+    {
+        WriteQueueDrop();
+    }
+}
+
+
+/******************************************************************************
+* Function:        WORD FSWriteQueueFree (void)
+*
+* PreCondition:    None
+*
+* Input:           None
+*
+* Output:          WORD    - Number of sectors that can be queued without
+*                            waiting
+*
+* Side Effects:    None
+*
+* Overview:        Room left in the write queue
+*
+* Note:            None
+*****************************************************************************/
+
+WORD FSWriteQueueFree (void)
+{
+    return FS_WRITE_QUEUE_SECTORS - gWriteQueueCount;
+}
+
+
+/******************************************************************************
+* Function:        int FSWriteQueueFlush (void)
+*
+* PreCondition:    None
+*
+* Input:           None
+*
+* Output:          0       - Every queued sector is on the media
+*                  EOF     - A background write failed, or the media could
+*                            not be synced
+*
+* Side Effects:    Waits for the queue to empty
+*
+* Overview:        Put every queued sector on the media
+*
+* Note:            None
+*****************************************************************************/
+
+int FSWriteQueueFlush (void)
+{
+    if (!WriteQueueMediaSync())
+        return EOF;
+    return 0;
+}
+
+
+/******************************************************************************
+* Function:        BYTE WriteQueueSectorRead (DWORD sector, WORD count,
+*                                             BYTE * buffer)
+*
+* PreCondition:    Media initialized
+*
+* Input:           sector     - First sector to read
+*                  count      - Number of consecutive sectors
+*                  buffer     - Destination, count sectors
+*
+* Output:          TRUE       - All sectors read
+*                  FALSE      - A sector could not be read
+*
+* Side Effects:    None
+*
+* Overview:        SectorRead() and SectorReadMultiple() of the file system
+*
+* Note:            The running write is finished first so the media layer
+*                  doesn't report the read's result in its place.  If any
+*                  of the sectors is still queued, the whole queue is
+*                  written before reading.
+*****************************************************************************/
+
+BYTE WriteQueueSectorRead (DWORD sector, WORD count, BYTE * buffer)
+{
+    BYTE    i;
+    BYTE    result;
+
+    while (gWriteQueueWriting != 0)
+        WriteQueueCheck();
+
+    for (i = 0; i < gWriteQueueCount; i++)
+    {
+        if ((gWriteQueueSector[(gWriteQueueFirst + i) % FS_WRITE_QUEUE_SECTORS] - sector) < count)
+        {
+            WriteQueueWait();
+            break;
+        }
+    }
+
+    result = SectorReadMultiple (sector, count, buffer);
+
+    FSWriteQueueTasks();
+    return result;
+}
+
+
+/******************************************************************************
+* Function:        BYTE WriteQueueSectorWrite (DWORD sector, WORD count,
+*                                        BYTE * buffer, BYTE allowWriteToZero)
+*
+* PreCondition:    Media initialized
+*
+* Input:           sector           - First sector to write
+*                  count            - Number of consecutive sectors
+*                  buffer           - Source, count sectors
+*                  allowWriteToZero - TRUE if sector 0 may be written
+*
+* Output:          TRUE       - All sectors are queued
+*                  FALSE      - The run includes sector 0 when that isn't
+*                               allowed, or an earlier background write
+*                               failed
+*
+* Side Effects:    None
+*
+* Overview:        SectorWrite() and SectorWriteMultiple() of the file system
+*
+* Note:            The data is copied, so the buffer can be used again at
+*                  once.  When the queue is full, this waits for room.
+*                  Entries queued for media whose sector size has changed
+*                  since are for other media, and are dropped.
+*****************************************************************************/
+
+BYTE WriteQueueSectorWrite (DWORD sector, WORD count, BYTE * buffer, BYTE allowWriteToZero)
+{
+    BYTE    slot;
+
+    if ((sector == 0) && !allowWriteToZero)
+        return FALSE;
+    if (gWriteQueueSectorSize != MediaSectorSize())
+    {
+        while (gWriteQueueWriting != 0)
+            WriteQueueCheck();
+        if (gWriteQueueCount != 0)
+            WriteQueueDrop();
+        gWriteQueueSectorSize = MediaSectorSize();
+    }
+    if (WriteQueueError())
+        return FALSE;
+
+    while (count != 0)
+    {
+        while (gWriteQueueCount == FS_WRITE_QUEUE_SECTORS)
+        {
+            FSWriteQueueTasks();
+            if (WriteQueueError())
+                return FALSE;
+        }
+
+        slot = (gWriteQueueFirst + gWriteQueueCount) % FS_WRITE_QUEUE_SECTORS;
+        memcpy (WriteQueueEntry (slot), buffer, gWriteQueueSectorSize);
+        gWriteQueueSector[slot] = sector;
+        gWriteQueueAllowZero[slot] = allowWriteToZero;
+        gWriteQueueCount++;
+
+        sector++;
+        count--;
+        buffer += gWriteQueueSectorSize;
+    }
+
+    // Start it if the media is idle
+    FSWriteQueueTasks();
+    return TRUE;
+}
+
+
+/******************************************************************************
+* Function:        BYTE WriteQueueSectorZero (DWORD sector, DWORD count,
+*                                          BYTE * buffer, WORD bufferSectors)
+*
+* PreCondition:    Media initialized
+*
+* Input:           sector           - First sector to clear
+*                  count            - Number of consecutive sectors
+*                  buffer           - bufferSectors sectors of zeros
+*                  bufferSectors    - Size of buffer in sectors
+*
+* Output:          TRUE             - All sectors cleared
+*                  FALSE            - A sector could not be written, or an
+*                                     earlier background write failed
+*
+* Side Effects:    Waits for the queue to empty
+*
+* Overview:        SectorZeroMultiple() of the file system
+*
+* Note:            Only used with media layers that clear runs themselves;
+*                  the file system's own loop writes through the queue.
+*****************************************************************************/
+
+#ifdef SectorZeroMultiple
+BYTE WriteQueueSectorZero (DWORD sector, DWORD count, BYTE * buffer, WORD bufferSectors)
+{
+    WriteQueueWait();
+    if (WriteQueueError())
+        return FALSE;
+    return SectorZeroMultiple (sector, count, buffer, bufferSectors);
+}
+#endif
+
+
+/******************************************************************************
+* Function:        BYTE WriteQueueMediaSync (void)
+*
+* PreCondition:    Media initialized
+*
+* Input:           None
+*
+* Output:          TRUE       - Every write so far is on the media
+*                  FALSE      - A background write failed, or the media
+*                               could not be synced
+*
+* Side Effects:    Waits for the queue to empty
+*
+* Overview:        MediaSync() of the file system
+*
+* Note:            None
+*****************************************************************************/
+
+BYTE WriteQueueMediaSync (void)
+{
+    WriteQueueWait();
+    if (WriteQueueError())
+        return FALSE;
+    return MediaSync();
+}
+
+
+/******************************************************************************
+* Function:        BYTE WriteQueueMediaSelect (BYTE unit)
+*
+* PreCondition:    None
+*
+* Input:           unit       - The media unit to use
+*
+* Output:          TRUE       - The unit is present and selected
+*                  FALSE      - No such unit
+*
+* Side Effects:    Waits for the queue to empty when the unit changes
+*
+* Overview:        MediaSelect() of the file system
+*
+* Note:            Only used with media layers that have units.  The media
+*                  layer writes to the unit selected last, and the file
+*                  system may have selected another one (that wasn't there)
+*                  since the sectors were queued, so their unit is selected
+*                  again to write them.  If it has gone, they are dropped
+*                  and the next write to it returns the error.
+*****************************************************************************/
+
+#ifdef MediaSelect
+BYTE WriteQueueMediaSelect (BYTE unit)
+{
+    if (unit != gWriteQueueUnit)
+    {
+        while (gWriteQueueWriting != 0)
+            WriteQueueCheck();
+        if ((gWriteQueueCount != 0) && !MediaSelect (gWriteQueueUnit))
+            WriteQueueDrop();
+        WriteQueueWait();
+        gWriteQueueUnit = unit;
+    }
+    return MediaSelect (unit);
+}
+#endif
+
+
+/******************************************************************************
+* Function:        void WriteQueueCheck (void)
+*
+* PreCondition:    None
+*
+* Input:           None
+*
+* Output:          None
+*
+* Side Effects:    None
+*
+* Overview:        Take the entries of the running write off the queue once
+*                  the media has written them
+*
+* Note:            None
+*****************************************************************************/
+
+void WriteQueueCheck (void)
+{
+    BYTE    errorCode;
+
+    if (gWriteQueueWriting == 0)
+        return;
+    if (!SectorWriteIsComplete (&errorCode))
+        return;
+
+    if (errorCode != 0)
+    {
+        // What is queued behind it can't be written either
+        WriteQueueDrop();
+    }
+    else
+    {
+        gWriteQueueFirst = (gWriteQueueFirst + gWriteQueueWriting) % FS_WRITE_QUEUE_SECTORS;
+        gWriteQueueCount -= gWriteQueueWriting;
+    }
+    gWriteQueueWriting = 0;
+}
+
+
+/******************************************************************************
+* Function:        void WriteQueueWait (void)
+*
+* PreCondition:    None
+*
+* Input:           None
+*
+* Output:          None
+*
+* Side Effects:    None
+*
+* Overview:        Wait until every queued sector is written or dropped
+*
+* Note:            None
+*****************************************************************************/
+
+void WriteQueueWait (void)
+{
+    while (gWriteQueueCount != 0)
+        FSWriteQueueTasks();
+}
+
+
+/******************************************************************************
+* Function:        void WriteQueueDrop (void)
+*
+* PreCondition:    None
+*
+* Input:           None
+*
+* Output:          None
+*
+* Side Effects:    None
+*
+* Overview:        Empty the queue after a write failed
+*
+* Note:            What is queued behind a failed write can't be written
+*                  either.  The error is kept for the unit of the queue.
+*****************************************************************************/
+
+void WriteQueueDrop (void)
+{
+    gWriteQueueCount = 0;
+    gWriteQueueFailed = TRUE;
+    gWriteQueueFailedUnit = gWriteQueueUnit;
+}
+
+
+/******************************************************************************
+* Function:        BYTE WriteQueueError (void)
+*
+* PreCondition:    None
+*
+* Input:           None
+*
+* Output:          TRUE       - A background write to the selected unit
+*                               failed since the last call
+*                  FALSE      - No write failed
+*
+* Side Effects:    The error is cleared
+*
+* Overview:        Report a failed background write once
+*
+* Note:            None
+*****************************************************************************/
+
+BYTE WriteQueueError (void)
+{
+    if (!gWriteQueueFailed || (gWriteQueueFailedUnit != gWriteQueueUnit))
+        return FALSE;
+    gWriteQueueFailed = FALSE;
+    return TRUE;
+}
+
+#endif
@@ -0,0 +1,886 @@
+/******************************************************************************
+
+  USB Host Hub Driver
+
+This is the hub class driver file for a USB Embedded Host device.  This file
+should be used in a project with usb_host.c to provided the USB hardware
+interface.
+
+To interface with usb_host.c, the routine USBHostHubInitialize() should be
+specified as the Initialize() function, and USBHostHubEventHandler() should
+be specified as the EventHandler() function in the usbClientDrvTable[] array
+declared in usb_config.c.
+
+When a hub is attached, the driver reads its hub descriptor, powers its ports
+and waits for the power to be good.  It then keeps a read running on the
+status change endpoint.  When a port reports a change, the port status is
+read and the change bits are cleared.  A new connection is debounced, the
+device gets its entry and address from USBHostHubPortAttach(), the port is
+reset, and USBHostHubPortEnabled() lets usb_host.c enumerate the device.  A
+disconnection is passed to USBHostHubPortDetach().  Only one port of a hub
+uses EP0 of the hub at a time.  Nothing here is built unless usb_config.h
+defines USB_HUB_SUPPORT_INCLUDED.
+
+All the transfers are polled, so USBHostHubTasks() must be called from
+USBTasks() whether or not transfer events are used.  The waits use the frame
+number of the USB module as a millisecond counter.
+
+* FileName:        usb_host_hub.c
+* Dependencies:    None
+* Processor:       PIC24/dsPIC30/dsPIC33/PIC32MX
+* Compiler:        C30 v2.01/C32 v0.00.18
+* Company:         Microchip Technology, Inc.
+
+Software License Agreement
+
+The software supplied herewith by Microchip Technology Incorporated
+(the Company) for its PICmicro Microcontroller is intended and
+supplied to you, the Companys customer, for use solely and
+exclusively on Microchip PICmicro Microcontroller products. The
+software is owned by the Company and/or its supplier, and is
+protected under applicable copyright laws. All rights are reserved.
+Any use in violation of the foregoing restrictions may subject the
+user to criminal sanctions under applicable laws, as well as to
+civil liability for the breach of the terms and conditions of this
+license.
+
+THIS SOFTWARE IS PROVIDED IN AN AS IS CONDITION. NO WARRANTIES,
+WHETHER EXPRESS, IMPLIED OR STATUTORY, INCLUDING, BUT NOT LIMITED
+TO, IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+PARTICULAR PURPOSE APPLY TO THIS SOFTWARE. THE COMPANY SHALL NOT,
+IN ANY CIRCUMSTANCES, BE LIABLE FOR SPECIAL, INCIDENTAL OR
+CONSEQUENTIAL DAMAGES, FOR ANY REASON WHATSOEVER.
+
+*******************************************************************************/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "GenericTypeDefs.h"
+#include "HardwareProfile.h"
+#include "USB/usb.h"
+#include "USB/usb_host_hub.h"
+
+//#define DEBUG_MODE
+#ifdef DEBUG_MODE
+    #include "uart2.h"
+#endif
+
+#ifdef USB_HUB_SUPPORT_INCLUDED
+
+#if (USB_HUB_MAX_PORTS > 15)
+    #error USB_HUB_MAX_PORTS can be at most 15.
+#endif
+
+
+// *****************************************************************************
+// *****************************************************************************
+// Section: Constants
+// *****************************************************************************
+// *****************************************************************************
+
+// *****************************************************************************
+// Section: State Machine Constants
+// *****************************************************************************
+
+#define HUB_STATE_DETACHED                  0x00    // Entry is free.
+#define HUB_STATE_WAIT_FOR_ENUMERATION      0x01    // The hub is being configured.
+#define HUB_STATE_GET_DESCRIPTOR            0x02    // Ask for the hub descriptor.
+#define HUB_STATE_WAIT_FOR_DESCRIPTOR       0x03    //
+#define HUB_STATE_POWER_PORT                0x04    // Power the next port.
+#define HUB_STATE_WAIT_FOR_POWER            0x05    //
+#define HUB_STATE_WAIT_FOR_POWER_GOOD       0x06    // Give the ports bPwrOn2PwrGood.
+#define HUB_STATE_RUNNING                   0x07    // Watch the ports.
+#define HUB_STATE_HOLDING                   0x08    // Holding due to an error.
+
+#define PORT_STATE_IDLE                     0x00    // Nothing is on the port.
+#define PORT_STATE_GET_STATUS               0x01    // Read the port status and change bits.
+#define PORT_STATE_WAIT_FOR_STATUS          0x02    //
+#define PORT_STATE_CLEAR_CHANGE             0x03    // Clear the next change bit that was set.
+#define PORT_STATE_WAIT_FOR_CLEAR           0x04    //
+#define PORT_STATE_DEBOUNCE                 0x05    // Wait for the connection to settle.
+#define PORT_STATE_ATTACH                   0x06    // Get an address for the device.
+#define PORT_STATE_RESET                    0x07    // Start the port reset.
+#define PORT_STATE_WAIT_FOR_RESET           0x08    // Wait, then read the status until the reset ends.
+#define PORT_STATE_RESET_RECOVERY           0x09    // Give the device time to recover.
+#define PORT_STATE_ENUMERATING              0x0A    // usb_host.c is enumerating the device.
+#define PORT_STATE_DISABLE                  0x0B    // Disable the port of a device that failed.
+#define PORT_STATE_WAIT_FOR_DISABLE         0x0C    //
+#define PORT_STATE_RUNNING                  0x0D    // The device is running, or holding on a disabled port.
+#define PORT_STATE_DETACH                   0x0E    // Remove the device from usb_host.c.
+
+// *****************************************************************************
+// Section: Other Constants
+// *****************************************************************************
+
+#define HUB_DESCRIPTOR_SIZE                 9       // Bytes of the hub descriptor read (up to 7 ports are described).
+#define HUB_BITMAP_SIZE                     4       // Largest status change bitmap taken (up to 31 ports).
+
+#define HUB_DEBOUNCE_TIME                   100     // ms a new connection must last before the port is reset.
+#define HUB_RESET_TIME                      10      // ms before the end of the port reset is looked for.
+#define HUB_RESET_TIMEOUT                   500     // ms after which a port reset that has not ended is abandoned.
+#define HUB_RESET_RECOVERY_TIME             10      // ms between the end of the reset and the first request.
+
+#define PORT_STATUS_CONNECTION              0x0001  // wPortStatus bits
+#define PORT_STATUS_ENABLE                  0x0002
+#define PORT_STATUS_RESET                   0x0010
+#define PORT_STATUS_LOW_SPEED               0x0200
+
+#define PORT_CHANGE_CONNECTION              0x0001  // wPortChange bits; bit n is cleared with feature C_PORT_CONNECTION + n
+#define PORT_CHANGE_ALL                     0x001F
+
+
+//******************************************************************************
+//******************************************************************************
+// Section: Data Structures
+//******************************************************************************
+//******************************************************************************
+
+// *****************************************************************************
+/* USB Hub Port Information
+
+This structure holds the state of one port of a hub.
+*/
+typedef struct _USB_HUB_PORT_INFO
+{
+    BYTE    state;                  // State machine state of the port.
+    BYTE    deviceAddress;          // Address of the device on the port, or 0 if none.
+    BYTE    resetting;              // The port reset has been started and has not ended.
+} USB_HUB_PORT_INFO;
+
+
+// *****************************************************************************
+/* USB Hub Device Information
+
+This structure is used to hold all the information about an attached hub.
+*/
+typedef struct _USB_HUB_DEVICE_INFO
+{
+    BYTE                deviceAddress;                  // Address of the hub, or 0 if the entry is free.
+    BYTE                state;                          // State machine state of the hub.
+    BYTE                errorCode;                      // Error code of the last error.
+    BYTE                endpointStatus;                 // Interrupt IN endpoint of the status change bitmap.
+    BYTE                numberOfPorts;                  // Ports used, up to USB_HUB_MAX_PORTS.
+    BYTE                bitmapSize;                     // Bytes in the status change bitmap of the hub.
+    WORD                powerOnTime;                    // ms from port power on until the power is good.
+    BYTE                port;                           // Port using EP0 (or being powered), or 0 if none.
+    BYTE                readRunning;                    // A read of the status change endpoint is running.
+    WORD                waitStart;                      // Frame number at the start of the current wait.
+    WORD                portChanged;                    // Bit n is set when port n has reported a change.
+    WORD                portStatus;                     // wPortStatus of the port using EP0.
+    WORD                portChange;                     // wPortChange bits of the port using EP0 left to clear.
+    BYTE                data[HUB_DESCRIPTOR_SIZE];      // Hub descriptor, or port status.
+    BYTE                bitmap[HUB_BITMAP_SIZE];        // Status change bitmap.
+    USB_HUB_PORT_INFO   portInfo[USB_HUB_MAX_PORTS];    // Ports, from port 1.
+} USB_HUB_DEVICE_INFO;
+
+
+//******************************************************************************
+//******************************************************************************
+// Section: Local Prototypes
+//******************************************************************************
+//******************************************************************************
+
+void    _USBHostHub_PortStatusRead( USB_HUB_DEVICE_INFO *hub );
+void    _USBHostHub_PortTasks( USB_HUB_DEVICE_INFO *hub );
+BYTE    _USBHostHub_PortFeature( USB_HUB_DEVICE_INFO *hub, BYTE bRequest, BYTE feature );
+
+
+//******************************************************************************
+//******************************************************************************
+// Section: Macros
+//******************************************************************************
+//******************************************************************************
+
+// The 11 bit frame number of the USB module counts milliseconds while SOFs
+// are being sent.
+#define _USBHostHub_Now()                   ((WORD)(U1FRML | ((WORD)U1FRMH << 8)))
+#define _USBHostHub_Elapsed( start )        ((_USBHostHub_Now() - (start)) & 0x07FF)
+
+
+//******************************************************************************
+//******************************************************************************
+// Section: Hub Host Global Variables
+//******************************************************************************
+//******************************************************************************
+
+USB_HUB_DEVICE_INFO     deviceInfoHub[USB_MAX_HUBS];
+
+
+// *****************************************************************************
+// *****************************************************************************
+// Section: Application Callable Functions
+// *****************************************************************************
+// *****************************************************************************
+
+/****************************************************************************
+  Function:
+    BYTE USBHostHubDeviceStatus( BYTE deviceAddress )
+
+  Summary:
+    See usb_host_hub.h
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+BYTE USBHostHubDeviceStatus( BYTE deviceAddress )
+{
+    BYTE    i;
+    BYTE    status;
+
+    for (i=0; (i<USB_MAX_HUBS) && (deviceInfoHub[i].deviceAddress != deviceAddress); i++);
+    if ((deviceAddress == 0) || (i == USB_MAX_HUBS))
+    {
+        return USB_HUB_DEVICE_NOT_FOUND;
+    }
+
+    status = USBHostDeviceStatus( deviceAddress );
+    if (status != USB_DEVICE_ATTACHED)
+    {
+        return status;
+    }
+
+    switch (deviceInfoHub[i].state)
+    {
+        case HUB_STATE_RUNNING:
+            return USB_HUB_NORMAL_RUNNING;
+            break;
+
+        case HUB_STATE_HOLDING:
+            return USB_HUB_ERROR_STATE;
+            break;
+
+        default:
+            return USB_HUB_INITIALIZING;
+            break;
+    }
+}
+
+
+/****************************************************************************
+  Function:
+    void USBHostHubTasks( void )
+
+  Summary:
+    See usb_host_hub.h
+
+  Remarks:
+    A failed request leaves the hub holding.  The devices already behind it
+    keep running.
+  ***************************************************************************/
+
+void USBHostHubTasks( void )
+{
+    USB_HUB_DEVICE_INFO *hub;
+    DWORD               byteCount;
+    BYTE                errorCode;
+    BYTE                i;
+    BYTE                port;
+
+    for (i=0; i<USB_MAX_HUBS; i++)
+    {
+        hub = &deviceInfoHub[i];
+        if (hub->deviceAddress == 0)
+        {
+            continue;
+        }
+
+        switch (hub->state)
+        {
+            case HUB_STATE_WAIT_FOR_ENUMERATION:
+                errorCode = USBHostDeviceStatus( hub->deviceAddress );
+                if (errorCode == USB_DEVICE_ATTACHED)
+                {
+                    hub->state = HUB_STATE_GET_DESCRIPTOR;
+                }
+                else if (errorCode != USB_DEVICE_ENUMERATING)
+                {
+                    hub->errorCode = errorCode;
+                    hub->state     = HUB_STATE_HOLDING;
+                }
+                break;
+
+            case HUB_STATE_GET_DESCRIPTOR:
+                if (!USBHostDeviceRequest( hub->deviceAddress,
+                        USB_SETUP_DEVICE_TO_HOST | USB_SETUP_TYPE_CLASS | USB_SETUP_RECIPIENT_DEVICE,
+                        USB_REQUEST_GET_DESCRIPTOR, USB_HUB_DESCRIPTOR_HUB << 8, 0, HUB_DESCRIPTOR_SIZE,
+                        hub->data, USB_DEVICE_REQUEST_GET ))
+                {
+                    hub->state = HUB_STATE_WAIT_FOR_DESCRIPTOR;
+                }
+                break;
+
+            case HUB_STATE_WAIT_FOR_DESCRIPTOR:
+                if (USBHostTransferIsComplete( hub->deviceAddress, 0, &errorCode, &byteCount ))
+                {
+                    // bNbrPorts and bPwrOn2PwrGood are all we need.
+                    if (errorCode || (byteCount < 7) || (hub->data[2] == 0) ||
+                        (hub->data[2] >= HUB_BITMAP_SIZE * 8))
+                    {
+                        #ifdef DEBUG_MODE
+                            UART2PrintString( "HUB: Bad hub descriptor.\r\n" );
+                        #endif
+                        hub->errorCode = errorCode ? errorCode : USB_HOLDING_UNSUPPORTED_DEVICE;
+                        hub->state     = HUB_STATE_HOLDING;
+                        break;
+                    }
+
+                    hub->bitmapSize     = (hub->data[2] + 8) / 8;
+                    hub->numberOfPorts  = hub->data[2];
+                    if (hub->numberOfPorts > USB_HUB_MAX_PORTS)
+                    {
+                        hub->numberOfPorts = USB_HUB_MAX_PORTS;
+                    }
+                    hub->powerOnTime    = (WORD)hub->data[5] * 2;
+                    hub->port           = 1;
+                    hub->state          = HUB_STATE_POWER_PORT;
+                }
+                break;
+
+            case HUB_STATE_POWER_PORT:
+                if (!_USBHostHub_PortFeature( hub, USB_REQUEST_SET_FEATURE, USB_HUB_PORT_POWER ))
+                {
+                    hub->state = HUB_STATE_WAIT_FOR_POWER;
+                }
+                break;
+
+            case HUB_STATE_WAIT_FOR_POWER:
+                if (USBHostTransferIsComplete( hub->deviceAddress, 0, &errorCode, &byteCount ))
+                {
+                    if (errorCode)
+                    {
+                        hub->errorCode = errorCode;
+                        hub->state     = HUB_STATE_HOLDING;
+                    }
+                    else if (hub->port < hub->numberOfPorts)
+                    {
+                        hub->port ++;
+                        hub->state = HUB_STATE_POWER_PORT;
+                    }
+                    else
+                    {
+                        hub->waitStart = _USBHostHub_Now();
+                        hub->state     = HUB_STATE_WAIT_FOR_POWER_GOOD;
+                    }
+                }
+                break;
+
+            case HUB_STATE_WAIT_FOR_POWER_GOOD:
+                if (_USBHostHub_Elapsed( hub->waitStart ) >= hub->powerOnTime)
+                {
+                    #ifdef DEBUG_MODE
+                        UART2PrintString( "HUB: Ports powered.\r\n" );
+                    #endif
+                    // Look at every port once, in case the change bits of a
+                    // device that was already there are not reported.
+                    hub->port           = 0;
+                    hub->portChanged    = ((1 << hub->numberOfPorts) - 1) << 1;
+                    hub->readRunning    = FALSE;
+                    hub->state          = HUB_STATE_RUNNING;
+                }
+                break;
+
+            case HUB_STATE_RUNNING:
+                // Keep a read running on the status change endpoint.  A NAK
+                // ends it with no data.
+                if (hub->readRunning)
+                {
+                    if (USBHostTransferIsComplete( hub->deviceAddress, hub->endpointStatus, &errorCode, &byteCount ))
+                    {
+                        hub->readRunning = FALSE;
+                        if (errorCode)
+                        {
+                            USBHostClearEndpointErrors( hub->deviceAddress, hub->endpointStatus );
+                        }
+                        else
+                        {
+                            for (port = 1; (port <= hub->numberOfPorts) && (port < byteCount * 8); port++)
+                            {
+                                if (hub->bitmap[port >> 3] & (1 << (port & 0x07)))
+                                {
+                                    hub->portChanged |= 1 << port;
+                                }
+                            }
+                        }
+                    }
+                }
+                if (!hub->readRunning)
+                {
+                    if (!USBHostRead( hub->deviceAddress, hub->endpointStatus, hub->bitmap, hub->bitmapSize ))
+                    {
+                        hub->readRunning = TRUE;
+                    }
+                }
+
+                _USBHostHub_PortTasks( hub );
+                break;
+
+            default:
+                break;
+        }
+    }
+}
+
+
+// *****************************************************************************
+// *****************************************************************************
+// Section: Host Stack Interface Functions
+// *****************************************************************************
+// *****************************************************************************
+
+/****************************************************************************
+  Function:
+    BOOL USBHostHubInitialize( BYTE address, DWORD flags )
+
+  Summary:
+    See usb_host_hub.h
+
+  Remarks:
+    The hub is not used until usb_host.c has finished configuring it.
+  ***************************************************************************/
+
+BOOL USBHostHubInitialize( BYTE address, DWORD flags )
+{
+    BYTE    *descriptor;
+    BYTE    device;
+    WORD    i;
+
+    #ifdef DEBUG_MODE
+        UART2PrintString( "HUB: USBHostHubInitialize(0x" );
+        UART2PutHex( flags );
+        UART2PrintString( ")\r\n" );
+    #endif
+
+    // Find the free slot in the table.  If we cannot find one, kick off the device.
+    for (device = 0; (device < USB_MAX_HUBS) && (deviceInfoHub[device].deviceAddress != 0); device++);
+    if (device == USB_MAX_HUBS)
+    {
+        #ifdef DEBUG_MODE
+            UART2PrintString( "HUB: No free slots available for hub.\r\n" );
+        #endif
+        return FALSE;
+    }
+
+    descriptor = USBHostGetCurrentConfigurationDescriptor( address );
+
+    // Find the hub interface, and the interrupt IN endpoint after it.
+    i = 0;
+    while (i < ((USB_CONFIGURATION_DESCRIPTOR *)descriptor)->wTotalLength)
+    {
+        if ((descriptor[i+1] == USB_DESCRIPTOR_INTERFACE) && (descriptor[i+5] == USB_HUB_CLASSCODE))
+        {
+            i += descriptor[i];
+            while (descriptor[i+1] == USB_DESCRIPTOR_ENDPOINT)
+            {
+                if ((descriptor[i+3] == 0x03) && (descriptor[i+2] & 0x80))   // Interrupt IN
+                {
+                    memset( &deviceInfoHub[device], 0, sizeof(USB_HUB_DEVICE_INFO) );
+                    deviceInfoHub[device].deviceAddress  = address;
+                    deviceInfoHub[device].endpointStatus = descriptor[i+2];
+                    deviceInfoHub[device].state          = HUB_STATE_WAIT_FOR_ENUMERATION;
+                    #ifdef DEBUG_MODE
+                        UART2PrintString( "HUB: Hub attached.\r\n" );
+                    #endif
+                    return TRUE;
+                }
+                i += descriptor[i];
+            }
+        }
+        else
+        {
+            // Jump to the next descriptor in this configuration.
+            i += descriptor[i];
+        }
+    }
+
+    // This configuration is not valid for a hub.
+    return FALSE;
+}
+
+
+/****************************************************************************
+  Function:
+    BOOL USBHostHubEventHandler( BYTE address, USB_EVENT event,
+                            void *data, DWORD size )
+
+  Summary:
+    See usb_host_hub.h
+
+  Remarks:
+    When the hub is detached, usb_host.c has already removed the devices
+    behind it, so its ports are simply forgotten.
+  ***************************************************************************/
+
+BOOL USBHostHubEventHandler( BYTE address, USB_EVENT event, void *data, DWORD size )
+{
+    BYTE    i;
+
+    for (i=0; (i<USB_MAX_HUBS) && (deviceInfoHub[i].deviceAddress != address); i++);
+    if ((address == 0) || (i == USB_MAX_HUBS))
+    {
+        return FALSE;
+    }
+
+    switch (event)
+    {
+        case EVENT_NONE:             // No event occured (NULL event)
+        case EVENT_TRANSFER:         // The transfers are polled.
+        case EVENT_BUS_ERROR:
+            return TRUE;
+            break;
+
+        case EVENT_DETACH:           // USB cable has been detached (data: BYTE, address of device)
+            #ifdef DEBUG_MODE
+                UART2PrintString( "HUB: Detach\r\n" );
+            #endif
+            deviceInfoHub[i].deviceAddress  = 0;
+            deviceInfoHub[i].state          = HUB_STATE_DETACHED;
+            return TRUE;
+            break;
+
+        default:
+            return FALSE;
+            break;
+    }
+}
+
+
+// *****************************************************************************
+// *****************************************************************************
+// Section: Internal Functions
+// *****************************************************************************
+// *****************************************************************************
+
+/****************************************************************************
+  Function:
+    BYTE _USBHostHub_PortFeature( USB_HUB_DEVICE_INFO *hub, BYTE bRequest,
+                        BYTE feature )
+
+  Description:
+    This function starts a SET_FEATURE or CLEAR_FEATURE request for a
+    feature of hub->port.
+
+  Precondition:
+    EP0 of the hub is free.
+
+  Parameters:
+    USB_HUB_DEVICE_INFO *hub    - The hub
+    BYTE bRequest               - USB_REQUEST_SET_FEATURE or
+                                    USB_REQUEST_CLEAR_FEATURE
+    BYTE feature                - Port feature selector
+
+  Return Values:
+    USB_SUCCESS - The request was started
+    Other       - Error from USBHostDeviceRequest()
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+BYTE _USBHostHub_PortFeature( USB_HUB_DEVICE_INFO *hub, BYTE bRequest, BYTE feature )
+{
+    return USBHostDeviceRequest( hub->deviceAddress,
+                USB_SETUP_HOST_TO_DEVICE | USB_SETUP_TYPE_CLASS | USB_SETUP_RECIPIENT_OTHER,
+                bRequest, feature, hub->port, 0, NULL, USB_DEVICE_REQUEST_SET );
+}
+
+
+/****************************************************************************
+  Function:
+    void _USBHostHub_PortStatusRead( USB_HUB_DEVICE_INFO *hub )
+
+  Description:
+    This function decides what to do with hub->port once its status has
+    been read and its change bits have been cleared.
+
+  Precondition:
+    hub->portStatus holds wPortStatus.
+
+  Parameters:
+    USB_HUB_DEVICE_INFO *hub    - The hub
+
+  Returns:
+    None
+
+  Remarks:
+    A device is removed when its port loses the connection or reports a new
+    one.  A connection on a port with no device is debounced.  A port that
+    is being reset is polled until the reset ends.
+  ***************************************************************************/
+
+void _USBHostHub_PortStatusRead( USB_HUB_DEVICE_INFO *hub )
+{
+    USB_HUB_PORT_INFO   *portInfo = &hub->portInfo[hub->port - 1];
+    BOOL                connected = (hub->portStatus & PORT_STATUS_CONNECTION) != 0;
+
+    if (portInfo->resetting)
+    {
+        if (hub->portStatus & PORT_STATUS_RESET)
+        {
+            portInfo->state = PORT_STATE_WAIT_FOR_RESET;
+        }
+        else
+        {
+            portInfo->resetting = FALSE;
+            if (connected && (hub->portStatus & PORT_STATUS_ENABLE))
+            {
+                hub->waitStart  = _USBHostHub_Now();
+                portInfo->state = PORT_STATE_RESET_RECOVERY;
+            }
+            else
+            {
+                portInfo->state = PORT_STATE_DETACH;
+            }
+        }
+    }
+    else if (portInfo->deviceAddress != 0)
+    {
+        if (!connected || (hub->data[2] & PORT_CHANGE_CONNECTION))
+        {
+            portInfo->state = PORT_STATE_DETACH;
+        }
+        else
+        {
+            // Nothing new.  Go back to watching the device.
+            portInfo->state = PORT_STATE_ENUMERATING;
+            hub->port       = 0;
+        }
+    }
+    else if (connected)
+    {
+        hub->waitStart  = _USBHostHub_Now();
+        portInfo->state = PORT_STATE_DEBOUNCE;
+    }
+    else
+    {
+        portInfo->state = PORT_STATE_IDLE;
+        hub->port       = 0;
+    }
+}
+
+
+/****************************************************************************
+  Function:
+    void _USBHostHub_PortTasks( USB_HUB_DEVICE_INFO *hub )
+
+  Description:
+    This function moves the ports of a running hub on.
+
+  Precondition:
+    The hub is running.
+
+  Parameters:
+    USB_HUB_DEVICE_INFO *hub    - The hub
+
+  Returns:
+    None
+
+  Remarks:
+    The devices being enumerated are watched first.  Then, if no port is
+    using EP0 of the hub, the next port with a reported change or a device
+    to disable takes it.  The port using EP0 keeps it until it is idle or
+    its device is handed to usb_host.c.
+  ***************************************************************************/
+
+void _USBHostHub_PortTasks( USB_HUB_DEVICE_INFO *hub )
+{
+    USB_HUB_PORT_INFO   *portInfo;
+    DWORD               byteCount;
+    BYTE                errorCode;
+    BYTE                port;
+
+    for (port = 1; port <= hub->numberOfPorts; port++)
+    {
+        portInfo = &hub->portInfo[port - 1];
+        if ((portInfo->state == PORT_STATE_ENUMERATING) && (hub->port != port))
+        {
+            errorCode = USBHostDeviceStatus( portInfo->deviceAddress );
+            if (errorCode == USB_DEVICE_ATTACHED)
+            {
+                portInfo->state = PORT_STATE_RUNNING;
+            }
+            else if (errorCode == USB_DEVICE_DETACHED)
+            {
+                portInfo->deviceAddress = 0;
+                portInfo->state         = PORT_STATE_IDLE;
+            }
+            else if (errorCode != USB_DEVICE_ENUMERATING)
+            {
+                #ifdef DEBUG_MODE
+                    UART2PrintString( "HUB: Device failed, disabling its port.\r\n" );
+                #endif
+                portInfo->state = PORT_STATE_DISABLE;
+            }
+        }
+    }
+
+    if (hub->port == 0)
+    {
+        for (port = 1; port <= hub->numberOfPorts; port++)
+        {
+            portInfo = &hub->portInfo[port - 1];
+            if (hub->portChanged & (1 << port))
+            {
+                hub->portChanged &= ~(1 << port);
+                hub->port         = port;
+                portInfo->state   = PORT_STATE_GET_STATUS;
+                break;
+            }
+            if (portInfo->state == PORT_STATE_DISABLE)
+            {
+                hub->port = port;
+                break;
+            }
+        }
+        if (hub->port == 0)
+        {
+            return;
+        }
+    }
+
+    portInfo = &hub->portInfo[hub->port - 1];
+    switch (portInfo->state)
+    {
+        case PORT_STATE_GET_STATUS:
+            if (!USBHostDeviceRequest( hub->deviceAddress,
+                    USB_SETUP_DEVICE_TO_HOST | USB_SETUP_TYPE_CLASS | USB_SETUP_RECIPIENT_OTHER,
+                    USB_REQUEST_GET_STATUS, 0, hub->port, 4, hub->data, USB_DEVICE_REQUEST_GET ))
+            {
+                portInfo->state = PORT_STATE_WAIT_FOR_STATUS;
+            }
+            break;
+
+        case PORT_STATE_WAIT_FOR_STATUS:
+            if (USBHostTransferIsComplete( hub->deviceAddress, 0, &errorCode, &byteCount ))
+            {
+                if (errorCode || (byteCount < 4))
+                {
+                    hub->errorCode = errorCode;
+                    hub->state     = HUB_STATE_HOLDING;
+                    break;
+                }
+                hub->portStatus = hub->data[0] | ((WORD)hub->data[1] << 8);
+                hub->portChange = (hub->data[2] | ((WORD)hub->data[3] << 8)) & PORT_CHANGE_ALL;
+                portInfo->state = PORT_STATE_CLEAR_CHANGE;
+            }
+            break;
+
+        case PORT_STATE_CLEAR_CHANGE:
+            if (hub->portChange == 0)
+            {
+                _USBHostHub_PortStatusRead( hub );
+                break;
+            }
+            for (port = 0; !(hub->portChange & (1 << port)); port++);
+            if (!_USBHostHub_PortFeature( hub, USB_REQUEST_CLEAR_FEATURE, USB_HUB_C_PORT_CONNECTION + port ))
+            {
+                hub->portChange &= ~(1 << port);
+                portInfo->state  = PORT_STATE_WAIT_FOR_CLEAR;
+            }
+            break;
+
+        case PORT_STATE_WAIT_FOR_CLEAR:
+            if (USBHostTransferIsComplete( hub->deviceAddress, 0, &errorCode, &byteCount ))
+            {
+                portInfo->state = PORT_STATE_CLEAR_CHANGE;
+            }
+            break;
+
+        case PORT_STATE_DEBOUNCE:
+            if (_USBHostHub_Elapsed( hub->waitStart ) >= HUB_DEBOUNCE_TIME)
+            {
+                portInfo->state = PORT_STATE_ATTACH;
+            }
+            break;
+
+        case PORT_STATE_ATTACH:
+            // Only one device may be at address 0, so this waits until the
+            // other devices behind hubs have been enumerated.
+            portInfo->deviceAddress = USBHostHubPortAttach( hub->deviceAddress, hub->port );
+            if (portInfo->deviceAddress != 0)
+            {
+                portInfo->state = PORT_STATE_RESET;
+            }
+            break;
+
+        case PORT_STATE_RESET:
+            if (!_USBHostHub_PortFeature( hub, USB_REQUEST_SET_FEATURE, USB_HUB_PORT_RESET ))
+            {
+                portInfo->resetting = TRUE;
+                hub->waitStart      = _USBHostHub_Now();
+                portInfo->state     = PORT_STATE_WAIT_FOR_RESET;
+            }
+            break;
+
+        case PORT_STATE_WAIT_FOR_RESET:
+            if (!USBHostTransferIsComplete( hub->deviceAddress, 0, &errorCode, &byteCount ))
+            {
+                break;
+            }
+            if (_USBHostHub_Elapsed( hub->waitStart ) >= HUB_RESET_TIMEOUT)
+            {
+                portInfo->resetting = FALSE;
+                portInfo->state     = PORT_STATE_DETACH;
+            }
+            else if (_USBHostHub_Elapsed( hub->waitStart ) >= HUB_RESET_TIME)
+            {
+                portInfo->state = PORT_STATE_GET_STATUS;
+            }
+            break;
+
+        case PORT_STATE_RESET_RECOVERY:
+            if (_USBHostHub_Elapsed( hub->waitStart ) >= HUB_RESET_RECOVERY_TIME)
+            {
+                USBHostHubPortEnabled( portInfo->deviceAddress, (hub->portStatus & PORT_STATUS_LOW_SPEED) != 0 );
+                portInfo->state = PORT_STATE_ENUMERATING;
+                hub->port       = 0;
+            }
+            break;
+
+        case PORT_STATE_DISABLE:
+            if (!_USBHostHub_PortFeature( hub, USB_REQUEST_CLEAR_FEATURE, USB_HUB_PORT_ENABLE ))
+            {
+                portInfo->state = PORT_STATE_WAIT_FOR_DISABLE;
+            }
+            break;
+
+        case PORT_STATE_WAIT_FOR_DISABLE:
+            if (USBHostTransferIsComplete( hub->deviceAddress, 0, &errorCode, &byteCount ))
+            {
+                portInfo->state = PORT_STATE_RUNNING;
+                hub->port       = 0;
+            }
+            break;
+
+        case PORT_STATE_DETACH:
+            if ((portInfo->deviceAddress != 0) &&
+                (USBHostHubPortDetach( portInfo->deviceAddress ) == USB_BUSY))
+            {
+                // A token of the device is on the bus.  Try again.
+                break;
+            }
+            #ifdef DEBUG_MODE
+                UART2PrintString( "HUB: Device removed.\r\n" );
+            #endif
+            portInfo->deviceAddress = 0;
+            if (hub->portStatus & PORT_STATUS_CONNECTION)
+            {
+                // Something is (again) on the port.
+                hub->waitStart  = _USBHostHub_Now();
+                portInfo->state = PORT_STATE_DEBOUNCE;
+            }
+            else
+            {
+                portInfo->state = PORT_STATE_IDLE;
+                hub->port       = 0;
+            }
+            break;
+
+        default:
+            hub->port = 0;
+            break;
+    }
+}
+
+#endif  // USB_HUB_SUPPORT_INCLUDED
@@ -76,8 +76,8 @@ KO          15-Oct-2007 First release
 #include <string.h>
 #include "GenericTypeDefs.h"
 #include "HardwareProfile.h"
-#include "USB\usb.h"
-#include "USB\usb_host_msd.h"
+#include "USB/usb.h"
+#include "USB/usb_host_msd.h"
 
 //#define DEBUG_MODE
 #ifdef DEBUG_MODE
@@ -96,12 +96,27 @@ KO          15-Oct-2007 First release
 
 This value represents the maximum number of attached devices this class driver
 can support.  If the user does not define a value, it will be set to 1.
-Currently this must be set to 1, due to limitations in the USB Host layer.
+More than one device can only be attached through a hub, so a larger value
+also needs USB_HUB_SUPPORT_INCLUDED and USB_MAX_DEVICES in usb_config.h.
 */
 #ifndef USB_MAX_MASS_STORAGE_DEVICES
     #define USB_MAX_MASS_STORAGE_DEVICES        1
 #endif
 
+// *****************************************************************************
+/* Command Queue Depth
+
+This value is the number of commands each device can hold, counting the one
+that is running.  Commands given to USBHostMSDTransfer() while one is running
+wait in the queue, and the CBW of the next one is sent as soon as the CSW of
+the running one has been checked, without waiting for the application.  Each
+queued command takes 33 bytes (PIC24) or 36 bytes (PIC32) of RAM per device.
+If the user does not define a value, it will be set to 1 (no queue).
+*/
+#ifndef USB_MSD_COMMAND_QUEUE_DEPTH
+    #define USB_MSD_COMMAND_QUEUE_DEPTH         1
+#endif
+
 // *****************************************************************************
 // *****************************************************************************
 // Section: Constants
@@ -201,6 +216,21 @@ Currently this must be set to 1, due to limitations in the USB Host layer.
 //******************************************************************************
 //******************************************************************************
 
+#if (USB_MSD_COMMAND_QUEUE_DEPTH > 1)
+// *****************************************************************************
+/* Queued Mass Storage Command
+
+This structure holds a command that waits behind the running command of a
+device.  Its CBW is built when it is queued.
+*/
+typedef struct _USB_MSD_QUEUED_COMMAND
+{
+    BYTE                                blockData[31];          // CBW of the command.
+    BYTE                                *userData;              // Pointer to the user's data buffer.
+} USB_MSD_QUEUED_COMMAND;
+#endif
+
+
 // *****************************************************************************
 /* USB Mass Storage Device Information
 
@@ -231,9 +261,14 @@ typedef struct _USB_MSD_DEVICE_INFO
     BYTE                                endpointDATA;           // Endpoint to use for the current transfer.
     BYTE                                *userData;              // Pointer to the user's data buffer.
     DWORD                               userDataLength;         // Length of the user's data buffer.
-    DWORD                               bytesTransferred;       // Number of bytes transferred to/from the user's data buffer.
+    DWORD                               bytesTransferred;       // Number of bytes transferred to/from the user's data buffers.
     DWORD                               dCBWTag;                // The value of the dCBWTag to verify against the dCSWtag.
     BYTE                                attemptsCSW;            // Number of attempts to retrieve the CSW.
+#if (USB_MSD_COMMAND_QUEUE_DEPTH > 1)
+    BYTE                                queueHead;              // Index of the next command to run in queue.
+    BYTE                                queueCount;             // Number of commands in queue.
+    USB_MSD_QUEUED_COMMAND              queue[USB_MSD_COMMAND_QUEUE_DEPTH-1];   // Commands waiting behind the running one.
+#endif
 } USB_MSD_DEVICE_INFO;
 
 
@@ -286,6 +321,9 @@ typedef struct _USB_MSD_CSW
 
 DWORD   _USBHostMSD_GetNextTag( void );
 void    _USBHostMSD_ResetStateJump( BYTE i );
+#if (USB_MSD_COMMAND_QUEUE_DEPTH > 1)
+BOOL    _USBHostMSD_StartNextCommand( BYTE i );
+#endif
 
 
 //******************************************************************************
@@ -294,24 +332,38 @@ void    _USBHostMSD_ResetStateJump( BYTE i );
 //******************************************************************************
 //******************************************************************************
 
+#if (USB_MSD_COMMAND_QUEUE_DEPTH > 1)
+  #define _USBHostMSD_FlushQueue( i )               { deviceInfoMSD[i].queueCount = 0; }
+  #ifndef USB_ENABLE_TRANSFER_EVENT
+    #define _USBHostMSD_CommandRunning( i )         ((deviceInfoMSD[i].state > (STATE_RUNNING | SUBSTATE_HOLDING)) && (deviceInfoMSD[i].state < (STATE_RUNNING | SUBSTATE_TRANSFER_DONE)))
+  #else
+    #define _USBHostMSD_CommandRunning( i )         ((deviceInfoMSD[i].state >= STATE_CBW_WAIT) && (deviceInfoMSD[i].state <= STATE_CSW_WAIT))
+  #endif
+#else
+  #define _USBHostMSD_FlushQueue( i )
+#endif
+
 #ifndef USB_ENABLE_TRANSFER_EVENT
   #define _USBHostMSD_SetNextState()                { deviceInfoMSD[i].state = (deviceInfoMSD[i].state & STATE_MASK) + NEXT_STATE; }
   #define _USBHostMSD_SetNextSubState()             { deviceInfoMSD[i].state += NEXT_SUBSTATE; }
   #define _USBHostMSD_TerminateTransfer( error )    {                                                                           \
                                                         deviceInfoMSD[i].errorCode  = error;                                    \
                                                         deviceInfoMSD[i].state      = STATE_RUNNING | SUBSTATE_TRANSFER_DONE;   \
+                                                        _USBHostMSD_FlushQueue( i );                                            \
                                                     }
 #else
   #ifdef USB_MSD_ENABLE_TRANSFER_EVENT
     #define _USBHostMSD_TerminateTransfer( error )  {                                                                                                           \
                                                         deviceInfoMSD[i].errorCode  = error;                                                                    \
                                                         deviceInfoMSD[i].state      = STATE_RUNNING;                                         \
+                                                        _USBHostMSD_FlushQueue( i );                                                            \
                                                         usbMediaInterfaceTable.EventHandler( deviceInfoMSD[i].deviceAddress, EVENT_MSD_TRANSFER, NULL, 0 );     \
                                                     }
   #else
     #define _USBHostMSD_TerminateTransfer( error )  {                                                                                                           \
                                                         deviceInfoMSD[i].errorCode  = error;                                                                    \
                                                         deviceInfoMSD[i].state      = STATE_RUNNING;                                         \
+                                                        _USBHostMSD_FlushQueue( i );                                                            \
                                                     }
   #endif
 #endif
@@ -816,24 +868,30 @@ void USBHostMSDTasks( void )
                                 }
                                 else
                                 {
-                                    deviceInfoMSD[i].bytesTransferred = deviceInfoMSD[i].userDataLength - ((USB_MSD_CSW *)(deviceInfoMSD[i].blockData))->dCSWDataResidue;
+                                    deviceInfoMSD[i].bytesTransferred += deviceInfoMSD[i].userDataLength - ((USB_MSD_CSW *)(deviceInfoMSD[i].blockData))->dCSWDataResidue;
 
                                     if (((USB_MSD_CSW *)(deviceInfoMSD[i].blockData))->dCSWStatus != 0x00)
                                     {
                                         _USBHostMSD_TerminateTransfer( ((USB_MSD_CSW *)(deviceInfoMSD[i].blockData))->dCSWStatus | USB_MSD_ERROR );
+
+                                        // If we have a phase error, we need to perform corrective action instead of
+                                        // returning to normal running.
+                                        if (((USB_MSD_CSW *)(deviceInfoMSD[i].blockData))->dCSWStatus == MSD_PHASE_ERROR)
+                                        {
+                                            deviceInfoMSD[i].flags.val |= MARK_RESET_RECOVERY;
+                                            deviceInfoMSD[i].returnState = STATE_RUNNING | SUBSTATE_HOLDING;
+                                            _USBHostMSD_ResetStateJump( i );
+                                        }
                                     }
                                     else
                                     {
-                                        _USBHostMSD_TerminateTransfer( USB_SUCCESS );
-                                    }
-
-                                    // If we have a phase error, we need to perform corrective action instead of
-                                    // returning to normal running.
-                                    if (((USB_MSD_CSW *)(deviceInfoMSD[i].blockData))->dCSWStatus == MSD_PHASE_ERROR)
-                                    {
-                                        deviceInfoMSD[i].flags.val |= MARK_RESET_RECOVERY;
-                                        deviceInfoMSD[i].returnState = STATE_RUNNING | SUBSTATE_HOLDING;
-                                        _USBHostMSD_ResetStateJump( i );
+                                        // Send the CBW of the next queued command right away.
+                                        #if (USB_MSD_COMMAND_QUEUE_DEPTH > 1)
+                                            if (!_USBHostMSD_StartNextCommand( i ))
+                                        #endif
+                                        {
+                                            _USBHostMSD_TerminateTransfer( USB_SUCCESS );
+                                        }
                                     }
                                 }
                             }
@@ -995,7 +1053,8 @@ void USBHostMSDTasks( void )
 
   Remarks:
     After executing this function, the application may have to reset the
-    device in order for the device to continue working properly.
+    device in order for the device to continue working properly.  Commands
+    queued behind the running one are dropped.
   ***************************************************************************/
 
 void USBHostMSDTerminateTransfer( BYTE deviceAddress )
@@ -1031,6 +1090,9 @@ void USBHostMSDTerminateTransfer( BYTE deviceAddress )
         #else
             deviceInfoMSD[i].state = STATE_RUNNING;
         #endif
+
+        // The queued commands are dropped.
+        _USBHostMSD_FlushQueue( i );
     }
     return;
 }
@@ -1046,7 +1108,10 @@ void USBHostMSDTerminateTransfer( BYTE deviceAddress )
 
   Description:
     This function starts a mass storage transfer.  Usually, applications will
-    probably utilize a read/write wrapper to access this function.
+    probably utilize a read/write wrapper to access this function.  If a
+    transfer is running and USB_MSD_COMMAND_QUEUE_DEPTH leaves room, the
+    transfer is queued, and it is started as soon as the ones before it have
+    completed successfully.
 
   Precondition:
     None
@@ -1062,19 +1127,21 @@ void USBHostMSDTerminateTransfer( BYTE deviceAddress )
 
 
   Return Values:
-    USB_SUCCESS                 - Request started successfully
+    USB_SUCCESS                 - Request started or queued successfully
     USB_MSD_DEVICE_NOT_FOUND    - No device with specified address
     USB_MSD_DEVICE_BUSY         - Device not in proper state for performing
-                                    a transfer
+                                    a transfer, or the queue is full
     USB_MSD_INVALID_LUN         - Specified LUN does not exist
 
   Remarks:
-    None
+    USBHostMSDTransferIsComplete() reports on the whole chain of queued
+    transfers.  If one fails, the ones behind it are dropped.
   ***************************************************************************/
 
 BYTE USBHostMSDTransfer( BYTE deviceAddress, BYTE deviceLUN, BYTE direction, BYTE *commandBlock,
                         BYTE commandBlockLength, BYTE *data, DWORD dataLength )
 {
+    BYTE    *pCBW;
     BYTE    i;
     BYTE    j;
 
@@ -1104,13 +1171,30 @@ BYTE USBHostMSDTransfer( BYTE deviceAddress, BYTE deviceLUN, BYTE direction, BYT
     }
 
     // Make sure the device is in a state ready to read/write.
+    pCBW = deviceInfoMSD[i].blockData;
     #ifndef USB_ENABLE_TRANSFER_EVENT
         if (deviceInfoMSD[i].state != (STATE_RUNNING | SUBSTATE_HOLDING))
     #else
         if (deviceInfoMSD[i].state != STATE_RUNNING)
     #endif
     {
-        return USB_MSD_DEVICE_BUSY;
+        #if (USB_MSD_COMMAND_QUEUE_DEPTH > 1)
+            // Queue the transfer behind the running one, if there is room.
+            if (!_USBHostMSD_CommandRunning( i ) ||
+                (deviceInfoMSD[i].queueCount == USB_MSD_COMMAND_QUEUE_DEPTH-1))
+            {
+                return USB_MSD_DEVICE_BUSY;
+            }
+            j = deviceInfoMSD[i].queueHead + deviceInfoMSD[i].queueCount;
+            if (j >= USB_MSD_COMMAND_QUEUE_DEPTH-1)
+            {
+                j -= USB_MSD_COMMAND_QUEUE_DEPTH-1;
+            }
+            pCBW = deviceInfoMSD[i].queue[j].blockData;
+            deviceInfoMSD[i].queue[j].userData = data;
+        #else
+            return USB_MSD_DEVICE_BUSY;
+        #endif
     }
 
     // Verify the selected LUN.
@@ -1119,6 +1203,28 @@ BYTE USBHostMSDTransfer( BYTE deviceAddress, BYTE deviceLUN, BYTE direction, BYT
         return USB_MSD_INVALID_LUN;
     }
 
+    // Prepare the CBW so we can give the user back his command block RAM.
+    ((USB_MSD_CBW *)pCBW)->dCBWSignature             = USB_MSD_DCBWSIGNATURE;
+    ((USB_MSD_CBW *)pCBW)->dCBWTag                   = _USBHostMSD_GetNextTag();
+    ((USB_MSD_CBW *)pCBW)->dCBWDataTransferLength    = dataLength;
+    ((USB_MSD_CBW *)pCBW)->bmCBWflags.val            = 0;
+    ((USB_MSD_CBW *)pCBW)->bmCBWflags.bfDirection    = direction;
+    ((USB_MSD_CBW *)pCBW)->bCBWLUN                   = deviceLUN;
+    ((USB_MSD_CBW *)pCBW)->bCBWCBLength              = commandBlockLength;
+    for (j=0; j<commandBlockLength; j++)
+    {
+        ((USB_MSD_CBW *)pCBW)->CBWCB[j]              = commandBlock[j];
+    }
+
+    #if (USB_MSD_COMMAND_QUEUE_DEPTH > 1)
+        if (pCBW != deviceInfoMSD[i].blockData)
+        {
+            // The CSW of the running transfer starts this one.
+            deviceInfoMSD[i].queueCount++;
+            return USB_SUCCESS;
+        }
+    #endif
+
     // Initialize the transfer information.
     deviceInfoMSD[i].attemptsCSW       = CSW_RECEIVE_ATTEMPTS;
     deviceInfoMSD[i].bytesTransferred  = 0;
@@ -1127,7 +1233,7 @@ BYTE USBHostMSDTransfer( BYTE deviceAddress, BYTE deviceLUN, BYTE direction, BYT
     deviceInfoMSD[i].flags.bfDirection = direction;
     deviceInfoMSD[i].userData          = data;
     deviceInfoMSD[i].userDataLength    = dataLength;
-    deviceInfoMSD[i].dCBWTag           = _USBHostMSD_GetNextTag();
+    deviceInfoMSD[i].dCBWTag           = ((USB_MSD_CBW *)pCBW)->dCBWTag;
     deviceInfoMSD[i].endpointDATA      = deviceInfoMSD[i].endpointIN;
     if (!direction) // OUT
     {
@@ -1139,18 +1245,6 @@ BYTE USBHostMSDTransfer( BYTE deviceAddress, BYTE deviceLUN, BYTE direction, BYT
         UART2PrintString( "\r\n" );
     #endif
 
-    // Prepare the CBW so we can give the user back his command block RAM.
-    ((USB_MSD_CBW *)(deviceInfoMSD[i].blockData))->dCBWSignature             = USB_MSD_DCBWSIGNATURE;
-    ((USB_MSD_CBW *)(deviceInfoMSD[i].blockData))->dCBWTag                   = deviceInfoMSD[i].dCBWTag;
-    ((USB_MSD_CBW *)(deviceInfoMSD[i].blockData))->dCBWDataTransferLength    = deviceInfoMSD[i].userDataLength;
-    ((USB_MSD_CBW *)(deviceInfoMSD[i].blockData))->bmCBWflags.bfDirection    = direction;
-    ((USB_MSD_CBW *)(deviceInfoMSD[i].blockData))->bCBWLUN                   = deviceLUN;
-    ((USB_MSD_CBW *)(deviceInfoMSD[i].blockData))->bCBWCBLength              = commandBlockLength;
-    for (j=0; j<commandBlockLength; j++)
-    {
-        ((USB_MSD_CBW *)(deviceInfoMSD[i].blockData))->CBWCB[j]              = commandBlock[j];
-    }
-
     #ifndef USB_ENABLE_TRANSFER_EVENT
         // Jump to the transfer state.
         deviceInfoMSD[i].state             = STATE_RUNNING | SUBSTATE_SEND_CBW;
@@ -1197,7 +1291,9 @@ BYTE USBHostMSDTransfer( BYTE deviceAddress, BYTE deviceLUN, BYTE direction, BYT
     FALSE   - Transfer is not complete, errorCode is not valid
 
   Remarks:
-    None
+    If transfers were queued, TRUE is returned once the last one has
+    completed or one has failed, and the byte count is the total of the
+    transfers that completed.
   ***************************************************************************/
 
 BOOL USBHostMSDTransferIsComplete( BYTE deviceAddress, BYTE *errorCode, DWORD *byteCount )
@@ -1365,6 +1461,10 @@ BOOL USBHostMSDInitialize( BYTE address, DWORD flags )
                         deviceInfoMSD[device].deviceAddress    = address;
                         deviceInfoMSD[device].endpointIN       = endpointIN;
                         deviceInfoMSD[device].endpointOUT      = endpointOUT;
+                        #if (USB_MSD_COMMAND_QUEUE_DEPTH > 1)
+                            deviceInfoMSD[device].queueHead    = 0;
+                            deviceInfoMSD[device].queueCount   = 0;
+                        #endif
                         #ifdef DEBUG_MODE
                             UART2PrintString( "MSD: Bulk endpoint IN: " );
                             UART2PutHex( endpointIN );
@@ -1466,6 +1566,7 @@ BOOL USBHostMSDEventHandler( BYTE address, USB_EVENT event, void *data, DWORD si
             {
                 deviceInfoMSD[i].deviceAddress    = 0;
                 deviceInfoMSD[i].state            = STATE_DETACHED;
+                _USBHostMSD_FlushQueue( i );
 
                 // Inform the next higher layer of the event.
                 usbMediaInterfaceTable.EventHandler( address, EVENT_DETACH, NULL, 0 );
@@ -1674,24 +1775,30 @@ BOOL USBHostMSDEventHandler( BYTE address, USB_EVENT event, void *data, DWORD si
                         }
                         else
                         {
-                            deviceInfoMSD[i].bytesTransferred = deviceInfoMSD[i].userDataLength - ((USB_MSD_CSW *)(deviceInfoMSD[i].blockData))->dCSWDataResidue;
+                            deviceInfoMSD[i].bytesTransferred += deviceInfoMSD[i].userDataLength - ((USB_MSD_CSW *)(deviceInfoMSD[i].blockData))->dCSWDataResidue;
 
                             if (((USB_MSD_CSW *)(deviceInfoMSD[i].blockData))->dCSWStatus != 0x00)
                             {
                                 _USBHostMSD_TerminateTransfer( ((USB_MSD_CSW *)(deviceInfoMSD[i].blockData))->dCSWStatus | USB_MSD_ERROR );
+
+                                // If we have a phase error, we need to perform corrective action instead of
+                                // returning to normal running.
+                                if (((USB_MSD_CSW *)(deviceInfoMSD[i].blockData))->dCSWStatus == MSD_PHASE_ERROR)
+                                {
+                                    deviceInfoMSD[i].flags.val |= MARK_RESET_RECOVERY;
+                                    deviceInfoMSD[i].returnState = STATE_RUNNING;
+                                    _USBHostMSD_ResetStateJump( i );
+                                }
                             }
                             else
                             {
-                                _USBHostMSD_TerminateTransfer( USB_SUCCESS );
-                            }
-
-                            // If we have a phase error, we need to perform corrective action instead of
-                            // returning to normal running.
-                            if (((USB_MSD_CSW *)(deviceInfoMSD[i].blockData))->dCSWStatus == MSD_PHASE_ERROR)
-                            {
-                                deviceInfoMSD[i].flags.val |= MARK_RESET_RECOVERY;
-                                deviceInfoMSD[i].returnState = STATE_RUNNING;
-                                _USBHostMSD_ResetStateJump( i );
+                                // Send the CBW of the next queued command right away.
+                                #if (USB_MSD_COMMAND_QUEUE_DEPTH > 1)
+                                    if (!_USBHostMSD_StartNextCommand( i ))
+                                #endif
+                                {
+                                    _USBHostMSD_TerminateTransfer( USB_SUCCESS );
+                                }
                             }
                         }
                         break;
@@ -1880,6 +1987,23 @@ void _USBHostMSD_ResetStateJump( BYTE i )
     {
         usbMediaInterfaceTable.EventHandler( deviceInfoMSD[i].deviceAddress, EVENT_MSD_RESET, NULL, 0 );
 
+        #if (USB_MSD_COMMAND_QUEUE_DEPTH > 1)
+            // If the running command was given up, the ones queued behind it
+            // are not sent, and the caller must not take them as done.
+            #ifndef USB_ENABLE_TRANSFER_EVENT
+                if ((deviceInfoMSD[i].returnState == (STATE_RUNNING | SUBSTATE_HOLDING)) && deviceInfoMSD[i].queueCount)
+            #else
+                if ((deviceInfoMSD[i].returnState == STATE_RUNNING) && deviceInfoMSD[i].queueCount)
+            #endif
+            {
+                _USBHostMSD_FlushQueue( i );
+                if (deviceInfoMSD[i].errorCode == USB_SUCCESS)
+                {
+                    deviceInfoMSD[i].errorCode = USB_MSD_CSW_ERROR;
+                }
+            }
+        #endif
+
         #ifndef USB_ENABLE_TRANSFER_EVENT
             deviceInfoMSD[i].state = deviceInfoMSD[i].returnState;
         #else
@@ -1910,3 +2034,90 @@ void _USBHostMSD_ResetStateJump( BYTE i )
 }
 
 
+/****************************************************************************
+  Function:
+    BOOL _USBHostMSD_StartNextCommand( BYTE i )
+
+  Description:
+    This function takes the next command off the queue of the device and
+    sends its CBW.  It is called when the CSW of the running command shows
+    that it passed, so the device gets the next CBW without waiting for the
+    application to see the result.
+
+  Precondition:
+    The device information must be in the deviceInfoMSD array, and the
+    running command has completed successfully.
+
+  Parameters:
+    BYTE i  - Index into the deviceInfoMSD structure for the device.
+
+  Return Values:
+    TRUE    - A queued command was taken.  It is running, or it could not
+                be started and the transfer was terminated.
+    FALSE   - The queue is empty.
+
+  Remarks:
+    bytesTransferred and errorCode are left alone, so
+    USBHostMSDTransferIsComplete() reports on the whole chain.
+  ***************************************************************************/
+
+#if (USB_MSD_COMMAND_QUEUE_DEPTH > 1)
+BOOL _USBHostMSD_StartNextCommand( BYTE i )
+{
+    USB_MSD_QUEUED_COMMAND  *command;
+    BYTE                    errorCode;
+    BYTE                    j;
+
+    if (deviceInfoMSD[i].queueCount == 0)
+    {
+        return FALSE;
+    }
+
+    command = &deviceInfoMSD[i].queue[deviceInfoMSD[i].queueHead];
+    deviceInfoMSD[i].queueHead++;
+    if (deviceInfoMSD[i].queueHead == USB_MSD_COMMAND_QUEUE_DEPTH-1)
+    {
+        deviceInfoMSD[i].queueHead = 0;
+    }
+    deviceInfoMSD[i].queueCount--;
+
+    for (j=0; j<CBW_SIZE; j++)
+    {
+        deviceInfoMSD[i].blockData[j] = command->blockData[j];
+    }
+
+    // Initialize the transfer information from the CBW.
+    deviceInfoMSD[i].attemptsCSW       = CSW_RECEIVE_ATTEMPTS;
+    deviceInfoMSD[i].flags.val         = 0;
+    deviceInfoMSD[i].flags.bfDirection = ((USB_MSD_CBW *)(deviceInfoMSD[i].blockData))->bmCBWflags.bfDirection;
+    deviceInfoMSD[i].userData          = command->userData;
+    deviceInfoMSD[i].userDataLength    = ((USB_MSD_CBW *)(deviceInfoMSD[i].blockData))->dCBWDataTransferLength;
+    deviceInfoMSD[i].dCBWTag           = ((USB_MSD_CBW *)(deviceInfoMSD[i].blockData))->dCBWTag;
+    deviceInfoMSD[i].endpointDATA      = deviceInfoMSD[i].endpointIN;
+    if (!deviceInfoMSD[i].flags.bfDirection) // OUT
+    {
+        deviceInfoMSD[i].endpointDATA  = deviceInfoMSD[i].endpointOUT;
+    }
+
+    #ifdef DEBUG_MODE
+        UART2PrintString( "MSD: Writing queued CBW\r\n" );
+    #endif
+    errorCode = USBHostWrite( deviceInfoMSD[i].deviceAddress, deviceInfoMSD[i].endpointOUT, deviceInfoMSD[i].blockData, CBW_SIZE );
+    if (errorCode)
+    {
+        _USBHostMSD_TerminateTransfer( errorCode );
+    }
+    else
+    {
+        #ifndef USB_ENABLE_TRANSFER_EVENT
+            deviceInfoMSD[i].state = STATE_RUNNING | SUBSTATE_CBW_WAIT;
+        #else
+            deviceInfoMSD[i].state = STATE_CBW_WAIT;
+        #endif
+    }
+
+    return TRUE;
+}
+#endif
+
+
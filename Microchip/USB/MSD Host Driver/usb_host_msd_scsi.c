@@ -13,12 +13,31 @@ Storage Class, allowing a PIC application to utilize mass storage devices such
 as USB flash drives.  For ease of integration, this file contains macros to
 allow the File System code to reference the functions in this file.
 
-Currently, the file system layer above this interface layer is limited to one
-LUN (Logical Unit Number) on a single mass storage device.  This layer accepts
-and stores the max LUN from the USB MSD layer, but all sector reads and writes
-are hard-coded to LUN 0, since the layer above does not specify a LUN in the
-sector read and write commands.  Also, to interface with the existing file
-system code, only one attached device is allowed.
+Up to USB_MAX_MASS_STORAGE_DEVICES devices are tracked, and each LUN (Logical
+Unit Number) of each device is a media unit that the file system can mount as
+a volume.  The sector read and write commands of the file system do not name
+a unit, so they go to the unit last picked with USBHostMSDSCSIUnitSelect()
+(MediaSelect() in the file system).  LUN 0 of the first device attached is
+selected until another unit is picked.
+
+Sector transfers can also run in the background.  USBHostMSDSCSISectorReadStart()
+and USBHostMSDSCSISectorWriteStart() send the first command and return; the
+rest of the run is moved by USBHostMSDSCSITasks() (part of USBTasks()), and
+the end of the request is reported through a callback or
+USBHostMSDSCSITransferIsComplete().  If the mass storage driver queues
+commands (USB_MSD_COMMAND_QUEUE_DEPTH), the next commands of the run are kept
+in its queue, so each one starts as soon as the one before it completes.
+The blocking sector functions are built on the same requests.  Each device
+has its own request, so a run on one device (behind a hub) can be started
+while another device is busy.
+
+What a unit reports about itself (capacity, block size, largest transfer,
+write protection, removable medium) is read by the first
+USBHostMSDSCSIMediaInitialize() after the device is attached and kept, so
+mounting the unit again sends no commands.  If a sector command fails, the
+next USBHostMSDSCSIMediaInitialize() asks for the sense data, and the unit is
+only examined again (starting with TEST UNIT READY) if the sense data says
+the medium may have changed.
 
 * FileName:        usb_host_msd_scsi.c
 * Dependencies:    Microchip Memory Disk Drive File System v1.01
@@ -57,11 +76,11 @@ KO          15-Oct-2007 First release
 #include "GenericTypeDefs.h"
 #include "HardwareProfile.h"
 #include "FSconfig.h"
-#include "MDD File System\FSDefs.h"
-#include "MDD File System\FSIO.h"
-#include "USB\usb.h"
-#include "USB\usb_host_msd.h"
-#include "USB\usb_host_msd_scsi.h"
+#include "MDD File System/FSDefs.h"
+#include "MDD File System/FSIO.h"
+#include "USB/usb.h"
+#include "USB/usb_host_msd.h"
+#include "USB/usb_host_msd_scsi.h"
 
 //#define DEBUG_MODE
 #if defined(DEBUG_MODE)
@@ -81,6 +100,66 @@ KO          15-Oct-2007 First release
 #define FUA_ALLOW_CACHE             0x00        // Force Unit Access, allow cache use
 #define RDPROTECT_NORMAL            0x00        // Normal Read Protect behavior.
 #define WRPROTECT_NORMAL            0x00        // Normal Write Protect behavior.
+#define WRITE_SAME_MAX_BLOCKS       0xFFFF      // Largest Number of Logical Blocks in a WRITE SAME (10) command.
+
+#define SCSI_REQUEST_IDLE           0           // No sector request is running.
+#define SCSI_REQUEST_RUNNING        1           // A sector request is moving its sectors.
+
+#define SCSI_UNIT_UNKNOWN           0           // The unit has not been examined since the device was attached.
+#define SCSI_UNIT_VALID             1           // The unit information is up to date.
+#define SCSI_UNIT_CHECK             2           // A command failed; ask for sense data before using the unit information.
+
+#define SENSE_KEY_NOT_READY         0x02        // Sense key: the medium is not ready, or not present.
+#define SENSE_KEY_UNIT_ATTENTION    0x06        // Sense key: the medium may have changed, or the device was reset.
+
+#ifndef USB_MAX_MASS_STORAGE_DEVICES
+    #define USB_MAX_MASS_STORAGE_DEVICES    1   // Number of attached devices tracked; normally set in usb_config.h.
+#endif
+
+
+// *****************************************************************************
+// *****************************************************************************
+// Section: Data Structures
+// *****************************************************************************
+// *****************************************************************************
+
+typedef struct _SCSI_UNIT_INFO
+{
+    DWORD   blockCount;         // Number of logical blocks, from READ CAPACITY 10.
+    WORD    blockSize;          // Bytes in a logical block, from READ CAPACITY 10.
+    WORD    maxTransfer;        // Most blocks asked for by one READ10 or WRITE10, from the Block Limits page.
+    WORD    maxWriteSame;       // Most blocks in one WRITE SAME 10, from the Block Limits page, or 0 to use WRITE10.
+    BYTE    state;              // SCSI_UNIT_UNKNOWN, SCSI_UNIT_VALID or SCSI_UNIT_CHECK.
+    BYTE    writeProtect;       // Write protect bit from MODE SENSE 6.
+    BYTE    removable;          // Removable medium bit from INQUIRY.
+} SCSI_UNIT_INFO;
+
+typedef struct _SCSI_REQUEST
+{
+    DWORD                   sectorAddress;  // Next sector to transfer.
+    BYTE                    *dataBuffer;    // Application data for the next sector.
+    USB_MSD_SCSI_CALLBACK   callback;       // Called when the request ends, or NULL.
+    SCSI_UNIT_INFO          *unit;          // Unit of the request.
+    WORD                    sectorCount;    // Sectors not yet given to the device.
+    WORD                    blocks;         // Sectors in the commands given to the device, or 0 if none is running.
+    WORD                    maxBlocks;      // Most sectors in one command.
+    WORD                    blockSize;      // Bytes in a sector of the unit.
+    BYTE                    address;        // USB address of the device of the request.
+    BYTE                    LUN;            // Logical Unit Number of the request.
+    BYTE                    direction;      // 1 to read, 0 to write.
+    BYTE                    state;          // SCSI_REQUEST_IDLE or SCSI_REQUEST_RUNNING.
+    BYTE                    errorCode;      // Result of the last request that ended.
+    BYTE                    transferDone;   // EVENT_MSD_TRANSFER seen for the running commands.
+} SCSI_REQUEST;
+
+typedef struct _SCSI_DEVICE_INFO
+{
+    BYTE    address;            // USB address of the device, or 0 if the entry is free.
+    BYTE    maxLUN;             // Maximum Logical Unit Number of the device.
+    SCSI_UNIT_INFO  unit[USB_MSD_MAX_LUNS];     // What each LUN reported about itself.
+    SCSI_REQUEST    request;                    // The sector request of the device, in the background or not.
+} SCSI_DEVICE_INFO;
+
 
 
 //******************************************************************************
@@ -94,12 +173,20 @@ KO          15-Oct-2007 First release
         {                               \
             USBHostTasks();             \
             USBHostMSDTasks();          \
+            USBHostMSDSCSITasks();      \
         }
 #endif
 
-#if defined( PERFORM_TEST_UNIT_READY )
-    BOOL    _USBHostMSDSCSI_TestUnitReady( void );
-#endif
+BYTE    _USBHostMSDSCSI_Command( BYTE direction, BYTE *commandBlock, BYTE commandBlockLength, BYTE *data, DWORD dataLength );
+BOOL    _USBHostMSDSCSI_MediaChanged( BYTE *senseData );
+BOOL    _USBHostMSDSCSI_ReadUnitInfo( SCSI_UNIT_INFO *unit );
+BYTE    _USBHostMSDSCSI_RequestSense( BYTE *senseData );
+BOOL    _USBHostMSDSCSI_TestUnitReady( void );
+BYTE    _USBHostMSDSCSI_RequestCommand( SCSI_REQUEST *request );
+void    _USBHostMSDSCSI_RequestEnd( SCSI_REQUEST *request, BYTE errorCode );
+BYTE    _USBHostMSDSCSI_RequestQueue( SCSI_REQUEST *request );
+BYTE    _USBHostMSDSCSI_RequestStart( DWORD sectorAddress, WORD sectorCount, BYTE *dataBuffer, BYTE direction, USB_MSD_SCSI_CALLBACK callback );
+void    _USBHostMSDSCSI_WaitIdle( void );
 
 
 //******************************************************************************
@@ -112,8 +199,10 @@ KO          15-Oct-2007 First release
 // Section: Internal Global Variables
 //******************************************************************************
 
-BYTE    deviceAddress   = 0x00;         // USB address of the attached device.
-BYTE    maxLUN          = 0x00;         // Maximum Logical Unit Number of the attached device.
+SCSI_DEVICE_INFO    scsiDeviceInfo[USB_MAX_MASS_STORAGE_DEVICES];   // The attached devices.
+BYTE    deviceAddress   = 0x00;         // USB address of the device of the selected unit, or 0 if none.
+BYTE    deviceLUN       = 0x00;         // Logical Unit Number of the selected unit.
+BYTE    deviceIndex     = 0x00;         // Entry in scsiDeviceInfo of the device of the selected unit.
 
 
 // *****************************************************************************
@@ -143,26 +232,35 @@ BYTE    maxLUN          = 0x00;         // Maximum Logical Unit Number of the at
     FALSE   -   We cannot support the device.
 
   Remarks:
-    None
+    If no unit is selected, LUN 0 of the new device is selected.
   ***************************************************************************/
 
 BOOL USBHostMSDSCSIInitialize( BYTE address, DWORD flags )
 {
+    BYTE    i;
+
     #ifdef DEBUG_MODE
         UART2PrintString( "SCSI: Device attached.\r\n" );
     #endif
 
-    if (deviceAddress == 0)
+    for (i=0; (i<USB_MAX_MASS_STORAGE_DEVICES) && (scsiDeviceInfo[i].address != 0); i++);
+    if (i == USB_MAX_MASS_STORAGE_DEVICES)
     {
-        // Save the address of the new device.
-        deviceAddress = address;
-        return TRUE;
+        // We can't handle any more devices.
+        return FALSE;
     }
-    else
+
+    // Save the address of the new device.  Its units are examined when they
+    // are first initialized.
+    scsiDeviceInfo[i].address   = address;
+    scsiDeviceInfo[i].maxLUN    = 0;
+    memset( scsiDeviceInfo[i].unit, 0, sizeof(scsiDeviceInfo[i].unit) );
+
+    if (deviceAddress == 0)
     {
-        // We can currently only handle one device.
-        return FALSE;
+        USBHostMSDSCSIUnitSelect( USB_MSD_SCSI_UNIT( i, 0 ) );
     }
+    return TRUE;
 }
 
 
@@ -194,12 +292,23 @@ BOOL USBHostMSDSCSIInitialize( BYTE address, DWORD flags )
 
 BOOL USBHostMSDSCSIEventHandler( BYTE address, USB_EVENT event, void *data, DWORD size )
 {
-    if (deviceAddress == address)
+    BYTE    i;
+
+    for (i=0; (i<USB_MAX_MASS_STORAGE_DEVICES) && (scsiDeviceInfo[i].address != address); i++);
+    if ((address != 0) && (i < USB_MAX_MASS_STORAGE_DEVICES))
     {
-        switch( event )
+        switch( (int)event )
         {
             case EVENT_MSD_NONE:
+                return TRUE;
+                break;
+
             case EVENT_MSD_TRANSFER:                 // A MSD transfer has completed
+                if (scsiDeviceInfo[i].request.address == address)
+                {
+                    // USBHostMSDSCSITasks() moves the request on.
+                    scsiDeviceInfo[i].request.transferDone = TRUE;
+                }
                 return TRUE;
                 break;
 
@@ -214,7 +323,7 @@ BOOL USBHostMSDSCSIEventHandler( BYTE address, USB_EVENT event, void *data, DWOR
                 #ifdef DEBUG_MODE
                     UART2PrintString( "SCSI: Max LUN set.\r\n" );
                 #endif
-                maxLUN = *((BYTE *)data);
+                scsiDeviceInfo[i].maxLUN = *((BYTE *)data);
                 return TRUE;
                 break;
 
@@ -222,7 +331,17 @@ BOOL USBHostMSDSCSIEventHandler( BYTE address, USB_EVENT event, void *data, DWOR
                 #ifdef DEBUG_MODE
                     UART2PrintString( "SCSI: Device detached.\r\n" );
                 #endif
-                deviceAddress = 0;
+                scsiDeviceInfo[i].address = 0;
+                if (scsiDeviceInfo[i].request.address == address)
+                {
+                    // Let a running request see that the device is gone.
+                    scsiDeviceInfo[i].request.transferDone = TRUE;
+                }
+                if (deviceIndex == i)
+                {
+                    // The selected unit is gone.
+                    deviceAddress = 0;
+                }
                 return TRUE;
                 break;
 
@@ -294,9 +413,12 @@ BYTE USBHostMSDSCSIMediaDetect( void )
     FALSE   -   Initialization was unsuccessful
 
   Remarks:
-    This function performs the following SCSI commands:
-                        * READ CAPACITY 10
-                        * REQUEST SENSE
+    The first time a unit is initialized after its device is attached, this
+    function examines it with INQUIRY, READ CAPACITY 10, the Block Limits
+    page of INQUIRY (SPC-3 devices only) and MODE SENSE 6, and keeps what it
+    reports.  After that it sends no commands unless a sector command to the
+    unit has failed.  Then it sends REQUEST SENSE, and examines the unit again
+    only if the sense key is NOT READY or UNIT ATTENTION.
 
     The READ CAPACITY 10 command block is as follows:
 
@@ -318,7 +440,7 @@ BYTE USBHostMSDSCSIMediaDetect( void )
 
     <code>
         Byte/Bit    7       6       5       4       3       2       1       0
-           0                    Operation Code (0x02)
+           0                    Operation Code (0x03)
            1        [                      Reserved                 ] [ DESC]
            2        [                      Reserved
            3                                                                ]
@@ -329,12 +451,8 @@ BYTE USBHostMSDSCSIMediaDetect( void )
 
 BYTE USBHostMSDSCSIMediaInitialize( void )
 {
-    BYTE        attempts;
-    DWORD       byteCount;
-    BYTE        commandBlock[10];
-    BOOL        commandComplete;
-    BYTE        errorCode;
-    BYTE        inquiryData[36];
+    BYTE            senseData[18];
+    SCSI_UNIT_INFO  *unit;
 
     // Make sure the device is still attached.
     if (deviceAddress == 0)
@@ -342,96 +460,31 @@ BYTE USBHostMSDSCSIMediaInitialize( void )
         return FALSE;
     }
 
-    attempts = 3;
-    commandComplete = FALSE;
-    while ((attempts != 0) && !commandComplete)
-    {
-        attempts --;
-
-        #ifdef DEBUG_MODE
-            UART2PrintString( "SCSI: READ CAPACITY 10..." );
-        #endif
-
-        // Fill in the command block with the READ CAPACITY 10 parameters.
-        commandBlock[0] = 0x25;     // Operation Code
-        commandBlock[1] = 0;        //
-        commandBlock[2] = 0;        //
-        commandBlock[3] = 0;        //
-        commandBlock[4] = 0;        //
-        commandBlock[5] = 0;        //
-        commandBlock[6] = 0;        //
-        commandBlock[7] = 0;        //
-        commandBlock[8] = 0;        //
-        commandBlock[9] = 0x00;     // Control
-
-        errorCode = USBHostMSDRead( deviceAddress, 0, commandBlock, 10, inquiryData, 8 );
-        #ifdef DEBUG_MODE
-            UART2PutHex( errorCode ) ;
-            UART2PutChar( ' ' );
-        #endif
+    _USBHostMSDSCSI_WaitIdle();
 
-        if (!errorCode)
-        {
-            while (!USBHostMSDTransferIsComplete( deviceAddress, &errorCode, &byteCount ))
-            {
-                // TODO Any other timeout?  Maybe at the host level, using the 1ms timer...
-                USBTasks();
-            }
-        }
+    unit = &scsiDeviceInfo[deviceIndex].unit[deviceLUN];
 
-        if (!errorCode)
+    if (unit->state == SCSI_UNIT_CHECK)
+    {
+        // A command failed since the unit was examined.  Unless the failure
+        // was caused by a change of medium, what we know still holds.
+        if ((_USBHostMSDSCSI_RequestSense( senseData ) == USB_SUCCESS) &&
+            !_USBHostMSDSCSI_MediaChanged( senseData ))
         {
-            commandComplete = TRUE;
-
-            #ifdef DEBUG_MODE
-                UART2PutHex( errorCode ) ;
-                UART2PrintString( "\r\n" );
-            #endif
-
-            // Check for a 512 byte sector size
-            if (!((inquiryData[4] == 0) && (inquiryData[5] == 0) &&
-                  (inquiryData[6] == 2) && (inquiryData[7] == 0)))
-            {
-                #ifdef DEBUG_MODE
-                    UART2PrintString( "SCSI: Bad sector size\r\n" );
-                #endif
-                return FALSE;
-            }
+            unit->state = SCSI_UNIT_VALID;
         }
         else
         {
-            // Perform a Request Sense to try to clear the stall.
-            #ifdef DEBUG_MODE
-                UART2PrintString( "SCSI: REQUEST SENSE..." );
-            #endif
-
-            // Fill in the command block with the REQUEST SENSE parameters.
-            commandBlock[0] = 0x03;     // Operation Code
-            commandBlock[1] = 0;        //
-            commandBlock[2] = 0;        //
-            commandBlock[3] = 0;        //
-            commandBlock[4] = 18;       // Allocation length
-            commandBlock[5] = 0;        // Control
-
-            errorCode = USBHostMSDRead( deviceAddress, 0, commandBlock, 6, inquiryData, 18 );
-            #ifdef DEBUG_MODE
-                UART2PutHex( errorCode ) ;
-                UART2PutChar( ' ' );
-            #endif
-
-            if (!errorCode)
-            {
-                while (!USBHostMSDTransferIsComplete( deviceAddress, &errorCode, &byteCount ))
-                {
-                    // TODO Any other timeout?  Maybe at the host level, using the 1ms timer...
-                    USBTasks();
-                }
-            }
+            unit->state = SCSI_UNIT_UNKNOWN;
         }
     }
 
-    return commandComplete;
+    if (unit->state == SCSI_UNIT_VALID)
+    {
+        return TRUE;
+    }
 
+    return _USBHostMSDSCSI_ReadUnitInfo( unit );
 }
 
 
@@ -489,15 +542,63 @@ BYTE USBHostMSDSCSIMediaReset( void  )
 }
 
 
+/****************************************************************************
+  Function:
+    BYTE USBHostMSDSCSIUnitSelect( BYTE unit )
+
+  Summary:
+    This function picks the media unit that later commands go to.
+
+  Description:
+    This function picks the device and LUN that the sector read and write
+    functions and the media functions work on.  The unit is made with
+    USB_MSD_SCSI_UNIT(); unit 0 is LUN 0 of the first device attached.
+
+  Precondition:
+    None
+
+  Parameters:
+    BYTE unit   - The media unit to use
+
+  Return Values:
+    TRUE    - The unit is present and selected
+    FALSE   - There is no such device or LUN, or the LUN is not below
+                USB_MSD_MAX_LUNS; commands fail until another unit is
+                selected
+
+  Remarks:
+    This is MediaSelect() in the file system, which calls it whenever it
+    moves to a volume on another unit.
+  ***************************************************************************/
+
+BYTE USBHostMSDSCSIUnitSelect( BYTE unit )
+{
+    BYTE    i   = unit >> 4;
+    BYTE    lun = unit & 0x0F;
+
+    if ((i >= USB_MAX_MASS_STORAGE_DEVICES) || (scsiDeviceInfo[i].address == 0) ||
+        (lun > scsiDeviceInfo[i].maxLUN) || (lun >= USB_MSD_MAX_LUNS))
+    {
+        deviceAddress = 0;
+        return FALSE;
+    }
+
+    deviceAddress = scsiDeviceInfo[i].address;
+    deviceLUN     = lun;
+    deviceIndex   = i;
+    return TRUE;
+}
+
+
 /****************************************************************************
   Function:
     BYTE USBHostMSDSCSISectorRead( DWORD sectorAddress, BYTE *dataBuffer)
 
   Summary:
-    This function reads a 512-byte sector.
+    This function reads one sector.
 
   Description:
-    This function uses the SCSI command READ10 to read a 512-byte sector.
+    This function uses the SCSI command READ10 to read one sector.
     The data is stored in the application buffer.
 
   Precondition:
@@ -508,9 +609,48 @@ BYTE USBHostMSDSCSIMediaReset( void  )
     BYTE    *dataBuffer     - buffer to store data
 
   Return Values:
-    USB_SUCCESS - read performed successfully
-    Other       - Error codes from USBHostMSDRead() and
-                    USBHostMSDTransferIsComplete()
+    TRUE    - read performed successfully
+    FALSE   - read failed
+
+  Remarks:
+    This is a one sector USBHostMSDSCSISectorReadMultiple().
+  ***************************************************************************/
+
+BYTE USBHostMSDSCSISectorRead( DWORD sectorAddress, BYTE *dataBuffer )
+{
+    return USBHostMSDSCSISectorReadMultiple( sectorAddress, 1, dataBuffer );
+}
+
+
+/****************************************************************************
+  Function:
+    BYTE USBHostMSDSCSISectorReadMultiple( DWORD sectorAddress,
+                        WORD sectorCount, BYTE *dataBuffer )
+
+  Summary:
+    This function reads a run of consecutive sectors.
+
+  Description:
+    This function uses the SCSI command READ10 to read sectorCount
+    consecutive sectors starting at sectorAddress.  The data is stored in the
+    application buffer, which must be able to hold sectorCount sectors of the
+    unit.  Each READ10 command transfers up to the unit's Maximum Transfer
+    Length, or USB_MSD_MAX_TRANSFER_SECTORS sectors if it gives none, so a
+    long run costs one CBW/data/CSW exchange per that many sectors rather
+    than one per sector.  The function waits for a background request to
+    end, then runs its own and waits for it.
+
+  Precondition:
+    None
+
+  Parameters:
+    DWORD   sectorAddress   - address of the first sector to read
+    WORD    sectorCount     - number of sectors to read
+    BYTE    *dataBuffer     - buffer to store data
+
+  Return Values:
+    TRUE    - read performed successfully
+    FALSE   - read failed
 
   Remarks:
     The READ10 command block is as follows:
@@ -530,54 +670,18 @@ BYTE USBHostMSDSCSIMediaReset( void  )
     </code>
   ***************************************************************************/
 
-BYTE USBHostMSDSCSISectorRead( DWORD sectorAddress, BYTE *dataBuffer )
+BYTE USBHostMSDSCSISectorReadMultiple( DWORD sectorAddress, WORD sectorCount, BYTE *dataBuffer )
 {
-    DWORD   byteCount;
-    BYTE    commandBlock[10];
     BYTE    errorCode;
 
-    #ifdef DEBUG_MODE
-        UART2PrintString( "SCSI: Reading sector " );
-        UART2PutHex(sectorAddress >> 24);
-        UART2PutHex(sectorAddress >> 16);
-        UART2PutHex(sectorAddress >> 8);
-        UART2PutHex(sectorAddress);
-        UART2PrintString( " Device " );
-        UART2PutHex(deviceAddress);
-        UART2PrintString( "\r\n" );
-    #endif
-
-    if (deviceAddress == 0)
-    {
-        return USB_MSD_DEVICE_NOT_FOUND;
-    }
-
-    // Fill in the command block with the READ10 parameters.
-    commandBlock[0] = 0x28;     // Operation code
-    commandBlock[1] = RDPROTECT_NORMAL | FUA_ALLOW_CACHE;
-    commandBlock[2] = (BYTE) (sectorAddress >> 24);     // Big endian!
-    commandBlock[3] = (BYTE) (sectorAddress >> 16);
-    commandBlock[4] = (BYTE) (sectorAddress >> 8);
-    commandBlock[5] = (BYTE) (sectorAddress);
-    commandBlock[6] = 0x00;     // Group Number
-    commandBlock[7] = 0x00;     // Number of blocks - Big endian!
-    commandBlock[8] = 0x01;
-    commandBlock[9] = 0x00;     // Control
-
-    // TODO Currently using LUN=0.  When the File System supports multiple LUN's, this will change.
-    errorCode = USBHostMSDRead( deviceAddress, 0, commandBlock, 10, dataBuffer, MEDIA_SECTOR_SIZE );
-    #ifdef DEBUG_MODE
-        UART2PrintString( "SCSI: Read sector init error " );
-        UART2PutHex( errorCode );
-        UART2PrintString( "\r\n" );
-    #endif
+    _USBHostMSDSCSI_WaitIdle();
 
+    errorCode = USBHostMSDSCSISectorReadStart( sectorAddress, sectorCount, dataBuffer, NULL );
     if (!errorCode)
     {
-        while (!USBHostMSDTransferIsComplete( deviceAddress, &errorCode, &byteCount ))
+        while (!USBHostMSDSCSITransferIsComplete( &errorCode ))
         {
             // TODO Any other timeout?  Maybe at the host level, using the 1ms timer...
-            USBTasks();
         }
     }
 
@@ -587,26 +691,25 @@ BYTE USBHostMSDSCSISectorRead( DWORD sectorAddress, BYTE *dataBuffer )
         UART2PrintString( "\r\n" );
     #endif
 
-    if (!errorCode)
-    {
-        return TRUE;
-    }
-    else
+    if (errorCode)
     {
 //        USBHostMSDSCSIMediaReset();
         return FALSE;
     }
+
+    return TRUE;
 }
 
+
 /****************************************************************************
   Function:
     BYTE USBHostMSDSCSISectorWrite( DWORD sectorAddress, BYTE *dataBuffer, BYTE allowWriteToZero )
 
   Summary:
-    This function writes a 512-byte sector.
+    This function writes one sector.
 
   Description:
-    This function uses the SCSI command WRITE10 to write a 512-byte sector.
+    This function uses the SCSI command WRITE10 to write one sector.
     The data is read from the application buffer.
 
   Precondition:
@@ -618,9 +721,49 @@ BYTE USBHostMSDSCSISectorRead( DWORD sectorAddress, BYTE *dataBuffer )
     BYTE    allowWriteToZero- If a write to sector 0 is allowed.
 
   Return Values:
-    USB_SUCCESS - Write performed successfully
-                    Other       - Error codes from USBHostMSDWrite() and
-                                USBHostMSDTransferIsComplete()
+    TRUE    - Write performed successfully
+    FALSE   - Write failed, or a write to sector 0 was not allowed
+
+  Remarks:
+    This is a one sector USBHostMSDSCSISectorWriteMultiple().
+  ***************************************************************************/
+
+BYTE USBHostMSDSCSISectorWrite( DWORD sectorAddress, BYTE *dataBuffer, BYTE allowWriteToZero )
+{
+    return USBHostMSDSCSISectorWriteMultiple( sectorAddress, 1, dataBuffer, allowWriteToZero );
+}
+
+
+/****************************************************************************
+  Function:
+    BYTE USBHostMSDSCSISectorWriteMultiple( DWORD sectorAddress,
+                        WORD sectorCount, BYTE *dataBuffer,
+                        BYTE allowWriteToZero )
+
+  Summary:
+    This function writes a run of consecutive sectors.
+
+  Description:
+    This function uses the SCSI command WRITE10 to write sectorCount
+    consecutive sectors starting at sectorAddress.  The data is read from the
+    application buffer, which must hold sectorCount sectors of the unit.
+    Each WRITE10 command transfers up to the unit's Maximum Transfer Length,
+    or USB_MSD_MAX_TRANSFER_SECTORS sectors if it gives none.  The function
+    waits for a background request to end, then runs its own and waits for
+    it.
+
+  Precondition:
+    None
+
+  Parameters:
+    DWORD   sectorAddress   - address of the first sector to write
+    WORD    sectorCount     - number of sectors to write
+    BYTE    *dataBuffer     - buffer with application data
+    BYTE    allowWriteToZero- If a write to sector 0 is allowed.
+
+  Return Values:
+    TRUE    - Write performed successfully
+    FALSE   - Write failed, or a write to sector 0 was not allowed
 
   Remarks:
     To follow convention, this function blocks until the write is complete.
@@ -642,59 +785,18 @@ BYTE USBHostMSDSCSISectorRead( DWORD sectorAddress, BYTE *dataBuffer )
     </code>
   ***************************************************************************/
 
-BYTE USBHostMSDSCSISectorWrite( DWORD sectorAddress, BYTE *dataBuffer, BYTE allowWriteToZero )
+BYTE USBHostMSDSCSISectorWriteMultiple( DWORD sectorAddress, WORD sectorCount, BYTE *dataBuffer, BYTE allowWriteToZero )
 {
-    DWORD   byteCount;
-    BYTE    commandBlock[10];
     BYTE    errorCode;
 
-    #ifdef DEBUG_MODE
-        UART2PrintString( "SCSI: Writing sector " );
-        UART2PutHex(sectorAddress >> 24);
-        UART2PutHex(sectorAddress >> 16);
-        UART2PutHex(sectorAddress >> 8);
-        UART2PutHex(sectorAddress);
-        UART2PrintString( " Device " );
-        UART2PutHex(deviceAddress);
-        UART2PrintString( "\r\n" );
-    #endif
-
-    if (deviceAddress == 0)
-    {
-        return USB_MSD_DEVICE_NOT_FOUND;
-    }
-
-    if ((sectorAddress == 0) && (allowWriteToZero == FALSE))
-    {
-        return USB_SCSI_ERROR_SECTOR_0;
-    }
-
-    // Fill in the command block with the WRITE 10 parameters.
-    commandBlock[0] = 0x2A;     // Operation code
-    commandBlock[1] = WRPROTECT_NORMAL | FUA_ALLOW_CACHE;
-    commandBlock[2] = (BYTE) (sectorAddress >> 24);     // Big endian!
-    commandBlock[3] = (BYTE) (sectorAddress >> 16);
-    commandBlock[4] = (BYTE) (sectorAddress >> 8);
-    commandBlock[5] = (BYTE) (sectorAddress);
-    commandBlock[6] = 0x00;     // Group Number
-    commandBlock[7] = 0x00;     // Number of blocks - Big endian!
-    commandBlock[8] = 0x01;
-    commandBlock[9] = 0x00;     // Control
-
-    // TODO Currently using LUN=0.  When the File System supports multiple LUN's, this will change.
-    errorCode = USBHostMSDWrite( deviceAddress, 0, commandBlock, 10, dataBuffer, MEDIA_SECTOR_SIZE );
-    #ifdef DEBUG_MODE
-        UART2PrintString( "SCSI: Write sector init error " );
-        UART2PutHex( errorCode );
-        UART2PrintString( "\r\n" );
-    #endif
+    _USBHostMSDSCSI_WaitIdle();
 
+    errorCode = USBHostMSDSCSISectorWriteStart( sectorAddress, sectorCount, dataBuffer, allowWriteToZero, NULL );
     if (!errorCode)
     {
-        while (!USBHostMSDTransferIsComplete( deviceAddress, &errorCode, &byteCount ))
+        while (!USBHostMSDSCSITransferIsComplete( &errorCode ))
         {
             // TODO Any other timeout?  Maybe at the host level, using the 1ms timer...
-            USBTasks();
         }
     }
 
@@ -704,58 +806,852 @@ BYTE USBHostMSDSCSISectorWrite( DWORD sectorAddress, BYTE *dataBuffer, BYTE allo
         UART2PrintString( "\r\n" );
     #endif
 
-    if (!errorCode)
-    {
-        return TRUE;
-    }
-    else
+    if (errorCode)
     {
 //        USBHostMSDSCSIMediaReset();
         return FALSE;
     }
+
+    return TRUE;
 }
 
 
 /****************************************************************************
   Function:
-    BYTE USBHostMSDSCSIWriteProtectState( void )
+    BYTE USBHostMSDSCSISectorZeroMultiple( DWORD sectorAddress,
+                        DWORD sectorCount, BYTE *zeroBuffer,
+                        WORD bufferSectors )
+
+  Summary:
+    This function fills a run of consecutive sectors with zeros.
 
   Description:
-    This function returns the write protect status of the device.
+    This function writes zeros to sectorCount consecutive sectors starting at
+    sectorAddress.  If the selected unit gave a Maximum WRITE SAME Length on
+    its Block Limits page, it sends the SCSI command WRITE SAME (10), which
+    sends one sector of zeros and has the device repeat it over up to that
+    many sectors, or 65535.  Otherwise, or once a WRITE SAME fails in any
+    way, the run is written with WRITE10 commands that each send the zero
+    buffer, up to USB_MSD_MAX_TRANSFER_SECTORS sectors at a time.  WRITE SAME
+    is then not sent to the unit again until it is examined again after a
+    media change.
 
   Precondition:
     None
 
   Parameters:
-    None - None
+    DWORD   sectorAddress   - address of the first sector to clear
+    DWORD   sectorCount     - number of sectors to clear
+    BYTE    *zeroBuffer     - buffer of zeros
+    WORD    bufferSectors   - size of zeroBuffer, in sectors
 
   Return Values:
-    0 - not write protected
-
+    TRUE    - The sectors were cleared
+    FALSE   - A write failed, or the run includes sector 0
 
   Remarks:
-    None
+    To follow convention, this function blocks until the write is complete.
+    Define USB_MSD_NO_WRITE_SAME to always use WRITE10.
+
+    The WRITE SAME (10) command block is as follows:
+
+    <code>
+        Byte/Bit    7       6       5       4       3       2       1       0
+           0                    Operation Code (0x41)
+           1        [    WRPROTECT      ] ANCHOR  UNMAP     -       -       -
+           2        [ (MSB)
+           3                        Logical Block Address
+           4
+           5                                                          (LSB) ]
+           6        [         -         ][          Group Number            ]
+           7        [ (MSB)         Number of Logical Blocks
+           8                                                          (LSB) ]
+           9        [                    Control                            ]
+    </code>
   ***************************************************************************/
 
-BYTE    USBHostMSDSCSIWriteProtectState( void )
+BYTE USBHostMSDSCSISectorZeroMultiple( DWORD sectorAddress, DWORD sectorCount, BYTE *zeroBuffer, WORD bufferSectors )
 {
-    return 0;
-}
-
+#ifndef USB_MSD_NO_WRITE_SAME
+    BYTE            commandBlock[10];
+    BYTE            senseData[18];
+    SCSI_UNIT_INFO  *unit;
+#endif
+    WORD            blocks;
+
+    if ((deviceAddress == 0) || (sectorAddress == 0) || (bufferSectors == 0))
+    {
+        return FALSE;
+    }
+
+    _USBHostMSDSCSI_WaitIdle();
+
+    if (bufferSectors > USB_MSD_MAX_TRANSFER_SECTORS)
+    {
+        bufferSectors = USB_MSD_MAX_TRANSFER_SECTORS;
+    }
+
+    #ifndef USB_MSD_NO_WRITE_SAME
+    unit = &scsiDeviceInfo[deviceIndex].unit[deviceLUN];
+    #endif
+
+    while (sectorCount != 0)
+    {
+        #ifndef USB_MSD_NO_WRITE_SAME
+        if (unit->maxWriteSame != 0)
+        {
+            blocks = unit->maxWriteSame;
+            if (sectorCount < blocks)
+            {
+                blocks = (WORD)sectorCount;
+            }
+
+            // Fill in the command block with the WRITE SAME 10 parameters.
+            commandBlock[0] = 0x41;     // Operation code
+            commandBlock[1] = WRPROTECT_NORMAL;
+            commandBlock[2] = (BYTE) (sectorAddress >> 24);     // Big endian!
+            commandBlock[3] = (BYTE) (sectorAddress >> 16);
+            commandBlock[4] = (BYTE) (sectorAddress >> 8);
+            commandBlock[5] = (BYTE) (sectorAddress);
+            commandBlock[6] = 0x00;     // Group Number
+            commandBlock[7] = (BYTE) (blocks >> 8);     // Number of blocks - Big endian!
+            commandBlock[8] = (BYTE) (blocks);
+            commandBlock[9] = 0x00;     // Control
+
+            if (_USBHostMSDSCSI_Command( 0, commandBlock, 10, zeroBuffer, USBHostMSDSCSIMediaSectorSize() ) == USB_SUCCESS)
+            {
+                sectorAddress += blocks;
+                sectorCount   -= blocks;
+                continue;
+            }
+
+            // Whatever went wrong, clear the error and write the zeros
+            // instead.
+            _USBHostMSDSCSI_RequestSense( senseData );
+            unit->maxWriteSame = 0;
+        }
+        #endif
+
+        blocks = bufferSectors;
+        if (sectorCount < bufferSectors)
+        {
+            blocks = (WORD)sectorCount;
+        }
+
+        if (!USBHostMSDSCSISectorWriteMultiple( sectorAddress, blocks, zeroBuffer, FALSE ))
+        {
+            return FALSE;
+        }
+
+        sectorAddress += blocks;
+        sectorCount   -= blocks;
+    }
+
+    return TRUE;
+}
+
+
+/****************************************************************************
+  Function:
+    BYTE USBHostMSDSCSISectorReadStart( DWORD sectorAddress,
+                        WORD sectorCount, BYTE *dataBuffer,
+                        USB_MSD_SCSI_CALLBACK callback )
+
+  Summary:
+    This function starts reading a run of sectors in the background.
+
+  Description:
+    This function starts a request that reads sectorCount consecutive
+    sectors starting at sectorAddress from the selected unit into dataBuffer,
+    with the same READ10 commands as USBHostMSDSCSISectorReadMultiple().  It
+    sends the first command and returns.  USBHostMSDSCSITasks() sends the
+    others as each one completes.  When the last one completes, or one
+    fails, the callback is called with the result, and
+    USBHostMSDSCSITransferIsComplete() returns TRUE.
+
+  Precondition:
+    None
+
+  Parameters:
+    DWORD   sectorAddress   - address of the first sector to read
+    WORD    sectorCount     - number of sectors to read
+    BYTE    *dataBuffer     - buffer to store data, sectorCount
+                                sectors
+    USB_MSD_SCSI_CALLBACK callback - function to call when the request
+                                ends, or NULL
+
+  Return Values:
+    USB_SUCCESS                 - The request is running
+    USB_MSD_DEVICE_BUSY         - Another request is running on the device
+    USB_MSD_DEVICE_NOT_FOUND    - No unit is selected
+    Other                       - The first command could not be sent
+
+  Remarks:
+    The buffer must not be used until the request ends.  Only one request
+    runs at a time on a device, since the device takes one command at a
+    time.  Requests on different devices run together.
+  ***************************************************************************/
+
+BYTE USBHostMSDSCSISectorReadStart( DWORD sectorAddress, WORD sectorCount, BYTE *dataBuffer, USB_MSD_SCSI_CALLBACK callback )
+{
+    #ifdef DEBUG_MODE
+        UART2PrintString( "SCSI: Reading sector " );
+        UART2PutHex(sectorAddress >> 24);
+        UART2PutHex(sectorAddress >> 16);
+        UART2PutHex(sectorAddress >> 8);
+        UART2PutHex(sectorAddress);
+        UART2PrintString( " Count " );
+        UART2PutHex(sectorCount >> 8);
+        UART2PutHex(sectorCount);
+        UART2PrintString( " Device " );
+        UART2PutHex(deviceAddress);
+        UART2PrintString( "\r\n" );
+    #endif
+
+    return _USBHostMSDSCSI_RequestStart( sectorAddress, sectorCount, dataBuffer, 1, callback );
+}
+
+
+/****************************************************************************
+  Function:
+    BYTE USBHostMSDSCSISectorWriteStart( DWORD sectorAddress,
+                        WORD sectorCount, BYTE *dataBuffer,
+                        BYTE allowWriteToZero,
+                        USB_MSD_SCSI_CALLBACK callback )
+
+  Summary:
+    This function starts writing a run of sectors in the background.
+
+  Description:
+    This function starts a request that writes sectorCount consecutive
+    sectors starting at sectorAddress on the selected unit from dataBuffer,
+    with the same WRITE10 commands as USBHostMSDSCSISectorWriteMultiple().
+    It sends the first command and returns.  USBHostMSDSCSITasks() sends the
+    others as each one completes.  When the last one completes, or one
+    fails, the callback is called with the result, and
+    USBHostMSDSCSITransferIsComplete() returns TRUE.
+
+  Precondition:
+    None
+
+  Parameters:
+    DWORD   sectorAddress   - address of the first sector to write
+    WORD    sectorCount     - number of sectors to write
+    BYTE    *dataBuffer     - buffer with application data, sectorCount
+                                sectors
+    BYTE    allowWriteToZero- If a write to sector 0 is allowed.
+    USB_MSD_SCSI_CALLBACK callback - function to call when the request
+                                ends, or NULL
+
+  Return Values:
+    USB_SUCCESS                 - The request is running
+    USB_MSD_DEVICE_BUSY         - Another request is running on the device
+    USB_MSD_DEVICE_NOT_FOUND    - No unit is selected
+    USB_SCSI_ERROR_SECTOR_0     - A write to sector 0 was not allowed
+    Other                       - The first command could not be sent
+
+  Remarks:
+    The buffer must not be changed until the request ends.  Only one request
+    runs at a time on a device, since the device takes one command at a
+    time.  Requests on different devices run together.
+  ***************************************************************************/
+
+BYTE USBHostMSDSCSISectorWriteStart( DWORD sectorAddress, WORD sectorCount, BYTE *dataBuffer, BYTE allowWriteToZero, USB_MSD_SCSI_CALLBACK callback )
+{
+    #ifdef DEBUG_MODE
+        UART2PrintString( "SCSI: Writing sector " );
+        UART2PutHex(sectorAddress >> 24);
+        UART2PutHex(sectorAddress >> 16);
+        UART2PutHex(sectorAddress >> 8);
+        UART2PutHex(sectorAddress);
+        UART2PrintString( " Count " );
+        UART2PutHex(sectorCount >> 8);
+        UART2PutHex(sectorCount);
+        UART2PrintString( " Device " );
+        UART2PutHex(deviceAddress);
+        UART2PrintString( "\r\n" );
+    #endif
+
+    if ((sectorAddress == 0) && (allowWriteToZero == FALSE))
+    {
+        return USB_SCSI_ERROR_SECTOR_0;
+    }
+
+    return _USBHostMSDSCSI_RequestStart( sectorAddress, sectorCount, dataBuffer, 0, callback );
+}
+
+
+/****************************************************************************
+  Function:
+    BOOL USBHostMSDSCSITransferIsComplete( BYTE *errorCode )
+
+  Summary:
+    This function indicates whether or not the sector request has ended.
+
+  Description:
+    This function runs the USB tasks, then indicates whether or not the
+    request started with USBHostMSDSCSISectorReadStart() or
+    USBHostMSDSCSISectorWriteStart() on the device of the selected unit has
+    ended.  If it has, the error code is its result.
+
+  Precondition:
+    None
+
+  Parameters:
+    BYTE *errorCode     - Result of the last request: USB_SUCCESS, or the
+                            error from USBHostMSDTransferIsComplete()
+
+  Return Values:
+    TRUE    - No request is running, errorCode is valid
+    FALSE   - The request is still running, errorCode is not valid
+
+  Remarks:
+    The application can call this function in its main loop instead of
+    waiting for the callback.
+  ***************************************************************************/
+
+BOOL USBHostMSDSCSITransferIsComplete( BYTE *errorCode )
+{
+    SCSI_REQUEST    *request = &scsiDeviceInfo[deviceIndex].request;
+
+    if (request->state == SCSI_REQUEST_RUNNING)
+    {
+        USBTasks();
+    }
+
+    *errorCode = request->errorCode;
+    return (request->state == SCSI_REQUEST_IDLE);
+}
+
+
+/****************************************************************************
+  Function:
+    void USBHostMSDSCSITasks( void )
+
+  Summary:
+    This function moves the sector requests on.
+
+  Description:
+    This function checks whether the running commands of the sector request
+    of each device have completed.  If they have, it sends the next command
+    of the run, or ends the request and calls its callback.  While they are
+    running, it queues the next commands of the run with the mass storage
+    driver, as far as its queue allows.  With USB_MSD_ENABLE_TRANSFER_EVENT
+    defined, it only looks at the commands after EVENT_MSD_TRANSFER was
+    received for them.
+
+  Precondition:
+    None
+
+  Parameters:
+    None - None
+
+  Returns:
+    None
+
+  Remarks:
+    This function is part of USBTasks().  The callback is called from here,
+    and may start another request.
+  ***************************************************************************/
+
+void USBHostMSDSCSITasks( void )
+{
+    SCSI_REQUEST    *request;
+    DWORD           byteCount;
+    BYTE            errorCode;
+    BYTE            i;
+
+    for (i=0; i<USB_MAX_MASS_STORAGE_DEVICES; i++)
+    {
+        request = &scsiDeviceInfo[i].request;
+        if (request->state != SCSI_REQUEST_RUNNING)
+        {
+            continue;
+        }
+
+        #ifdef USB_MSD_ENABLE_TRANSFER_EVENT
+            if ((request->blocks != 0) && request->transferDone)
+        #else
+            if (request->blocks != 0)
+        #endif
+        {
+            if (USBHostMSDTransferIsComplete( request->address, &errorCode, &byteCount ))
+            {
+                if (errorCode)
+                {
+                    _USBHostMSDSCSI_RequestEnd( request, errorCode );
+                    continue;
+                }
+                request->blocks = 0;
+            }
+        }
+
+        if ((request->blocks == 0) && (request->sectorCount == 0))
+        {
+            _USBHostMSDSCSI_RequestEnd( request, USB_SUCCESS );
+            continue;
+        }
+
+        errorCode = _USBHostMSDSCSI_RequestQueue( request );
+        if (errorCode)
+        {
+            _USBHostMSDSCSI_RequestEnd( request, errorCode );
+        }
+    }
+}
+
+
+/****************************************************************************
+  Function:
+    BYTE USBHostMSDSCSIWriteProtectState( void )
+
+  Description:
+    This function returns the write protect status of the device.
+
+  Precondition:
+    None
+
+  Parameters:
+    None - None
+
+  Return Values:
+    0 - not write protected
+    1 - write protected
+
+  Remarks:
+    This is the write protect bit the selected unit reported to MODE SENSE 6
+    when it was initialized.  No command is sent.
+  ***************************************************************************/
+
+BYTE    USBHostMSDSCSIWriteProtectState( void )
+{
+    if ((deviceAddress == 0) || (scsiDeviceInfo[deviceIndex].unit[deviceLUN].state == SCSI_UNIT_UNKNOWN))
+    {
+        return 0;
+    }
+    return scsiDeviceInfo[deviceIndex].unit[deviceLUN].writeProtect;
+}
+
+
+/****************************************************************************
+  Function:
+    WORD USBHostMSDSCSIMediaSectorSize( void )
+
+  Description:
+    This function returns the number of bytes in a sector of the selected
+    unit.
+
+  Precondition:
+    None
+
+  Parameters:
+    None - None
+
+  Returns:
+    The logical block length the unit reported to READ CAPACITY 10 when it
+    was initialized: a power of 2 from 512 to MEDIA_SECTOR_SIZE.  512 if the
+    unit has not been initialized.
+
+  Remarks:
+    No command is sent.
+  ***************************************************************************/
+
+WORD    USBHostMSDSCSIMediaSectorSize( void )
+{
+    if ((deviceAddress == 0) || (scsiDeviceInfo[deviceIndex].unit[deviceLUN].state == SCSI_UNIT_UNKNOWN))
+    {
+        return 512;
+    }
+    return scsiDeviceInfo[deviceIndex].unit[deviceLUN].blockSize;
+}
+
+
+/****************************************************************************
+  Function:
+    DWORD USBHostMSDSCSIMediaCapacity( void )
+
+  Description:
+    This function returns the number of sectors of the selected unit.
+
+  Precondition:
+    None
+
+  Parameters:
+    None - None
+
+  Returns:
+    The number of logical blocks the unit reported to READ CAPACITY 10 when
+    it was initialized.  0 if the unit has not been initialized.
+
+  Remarks:
+    This lets FSformat() put a partition table on a blank unit.  No command
+    is sent.
+  ***************************************************************************/
+
+DWORD   USBHostMSDSCSIMediaCapacity( void )
+{
+    if ((deviceAddress == 0) || (scsiDeviceInfo[deviceIndex].unit[deviceLUN].state == SCSI_UNIT_UNKNOWN))
+    {
+        return 0;
+    }
+    return scsiDeviceInfo[deviceIndex].unit[deviceLUN].blockCount;
+}
+
 
 // *****************************************************************************
-// *****************************************************************************
+// *****************************************************************************
 // Section: Internal Functions
 // *****************************************************************************
 // *****************************************************************************
 
 
+/*******************************************************************************
+  Function:
+    BYTE _USBHostMSDSCSI_Command( BYTE direction, BYTE *commandBlock,
+                        BYTE commandBlockLength, BYTE *data,
+                        DWORD dataLength )
+
+  Precondition:
+    No sector request is running.
+
+  Overview:
+    This function sends a command to the selected unit and waits for it to
+    complete.
+
+  Parameters:
+    BYTE    direction           - 1 to read or move no data, 0 to write
+    BYTE    *commandBlock       - the SCSI command block
+    BYTE    commandBlockLength  - bytes in the command block
+    BYTE    *data               - buffer for the data the device returns, or
+                                    the data to send it
+    DWORD   dataLength          - bytes to move, or 0
+
+  Return Values:
+    USB_SUCCESS             - The command completed without error
+    USB_MSD_COMMAND_FAILED  - The device reported an error; REQUEST SENSE
+                                tells why
+    Other                   - Error from USBHostMSDTransfer()
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+BYTE _USBHostMSDSCSI_Command( BYTE direction, BYTE *commandBlock, BYTE commandBlockLength, BYTE *data, DWORD dataLength )
+{
+    DWORD       byteCount;
+    BYTE        errorCode;
+
+    #ifdef DEBUG_MODE
+        UART2PrintString( "SCSI: Command " );
+        UART2PutHex( commandBlock[0] );
+        UART2PutChar( ' ' );
+    #endif
+
+    errorCode = USBHostMSDTransfer( deviceAddress, deviceLUN, direction, commandBlock, commandBlockLength, data, dataLength );
+    if (!errorCode)
+    {
+        while (!USBHostMSDTransferIsComplete( deviceAddress, &errorCode, &byteCount ))
+        {
+            // TODO Any other timeout?  Maybe at the host level, using the 1ms timer...
+            USBTasks();
+        }
+    }
+
+    #ifdef DEBUG_MODE
+        UART2PutHex( errorCode ) ;
+        UART2PrintString( "\r\n" );
+    #endif
+
+    return errorCode;
+}
+
+
+/*******************************************************************************
+  Function:
+    BOOL _USBHostMSDSCSI_MediaChanged( BYTE *senseData )
+
+  Precondition:
+    None
+
+  Overview:
+    This function tells if sense data means the medium may have changed.
+
+  Parameters:
+    BYTE    *senseData  - fixed format sense data from REQUEST SENSE
+
+  Return Values:
+    TRUE    - The sense key is NOT READY or UNIT ATTENTION
+    FALSE   - Some other error, or none
+
+  Remarks:
+    UNIT ATTENTION is also reported after the device is reset or powered on;
+    examining the unit again is right then too.
+  ***************************************************************************/
+
+BOOL _USBHostMSDSCSI_MediaChanged( BYTE *senseData )
+{
+    BYTE    senseKey = senseData[2] & 0x0F;
+
+    return (senseKey == SENSE_KEY_NOT_READY) || (senseKey == SENSE_KEY_UNIT_ATTENTION);
+}
+
+
+/*******************************************************************************
+  Function:
+    BOOL _USBHostMSDSCSI_ReadUnitInfo( SCSI_UNIT_INFO *unit )
+
+  Precondition:
+    The unit is selected and no sector request is running.
+
+  Overview:
+    This function asks the selected unit what it is and keeps the answers.
+
+  Parameters:
+    SCSI_UNIT_INFO  *unit   - where to keep them
+
+  Return Values:
+    TRUE    - The unit is ready and its blocks fit in MEDIA_SECTOR_SIZE
+    FALSE   - The unit did not answer READ CAPACITY 10, or has another block
+                size
+
+  Remarks:
+    READ CAPACITY 10 is tried three times.  After each failure the sense data
+    is read, and if it says the medium is not ready or has changed, TEST UNIT
+    READY is sent until the unit is ready.  Failures of INQUIRY, of the Block
+    Limits page and of MODE SENSE 6 are not fatal; the unit is then taken to
+    be fixed, to take USB_MSD_MAX_TRANSFER_SECTORS blocks per command, not to
+    take WRITE SAME, and to be writable.  A unit whose Block Limits page
+    gives a Maximum Transfer Length of 0 (no limit) also gets
+    USB_MSD_MAX_TRANSFER_SECTORS blocks per command; one that gives another
+    length gets up to that many, at most 65535, the most READ10 can ask for.
+
+    The INQUIRY command block is as follows:
+
+    <code>
+        Byte/Bit    7       6       5       4       3       2       1       0
+           0                    Operation Code (0x12)
+           1        [                      Reserved                 ] [ EVPD]
+           2        [                      Page Code                        ]
+           3        [ (MSB)         Allocation Length
+           4                                                          (LSB) ]
+           5        [                    Control                            ]
+    </code>
+
+    The MODE SENSE 6 command block is as follows:
+
+    <code>
+        Byte/Bit    7       6       5       4       3       2       1       0
+           0                    Operation Code (0x1A)
+           1        [         Reserved          ] [ DBD ] [    Reserved     ]
+           2        [  PC  ] [                Page Code                     ]
+           3        [                    Subpage Code                       ]
+           4        [                  Allocation Length                    ]
+           5        [                    Control                            ]
+    </code>
+  ***************************************************************************/
+
+BOOL _USBHostMSDSCSI_ReadUnitInfo( SCSI_UNIT_INFO *unit )
+{
+    BYTE        attempts;
+    BYTE        commandBlock[10];
+    BYTE        data[44];
+    DWORD       maxTransfer;
+    BYTE        version;
+
+    unit->state         = SCSI_UNIT_UNKNOWN;
+    unit->maxTransfer   = USB_MSD_MAX_TRANSFER_SECTORS;
+    unit->maxWriteSame  = 0;
+    unit->writeProtect  = FALSE;
+    unit->removable     = FALSE;
+    version             = 0;
+
+    // Fill in the command block with the INQUIRY parameters.
+    commandBlock[0] = 0x12;     // Operation Code
+    commandBlock[1] = 0;        // Standard inquiry data
+    commandBlock[2] = 0;        // Page Code
+    commandBlock[3] = 0;        // Allocation length - Big endian!
+    commandBlock[4] = 36;       //
+    commandBlock[5] = 0x00;     // Control
+
+    if (_USBHostMSDSCSI_Command( 1, commandBlock, 6, data, 36 ) == USB_SUCCESS)
+    {
+        unit->removable = (data[1] & 0x80) ? TRUE : FALSE;
+        version         = data[2];
+    }
+    else
+    {
+        _USBHostMSDSCSI_RequestSense( data );
+    }
+
+    attempts = 3;
+    while (TRUE)
+    {
+        // Fill in the command block with the READ CAPACITY 10 parameters.
+        commandBlock[0] = 0x25;     // Operation Code
+        commandBlock[1] = 0;        //
+        commandBlock[2] = 0;        //
+        commandBlock[3] = 0;        //
+        commandBlock[4] = 0;        //
+        commandBlock[5] = 0;        //
+        commandBlock[6] = 0;        //
+        commandBlock[7] = 0;        //
+        commandBlock[8] = 0;        //
+        commandBlock[9] = 0x00;     // Control
+
+        if (_USBHostMSDSCSI_Command( 1, commandBlock, 10, data, 8 ) == USB_SUCCESS)
+        {
+            break;
+        }
+
+        attempts --;
+        if (attempts == 0)
+        {
+            return FALSE;
+        }
+
+        // Clear the error, and wait for the medium if it is coming.
+        if ((_USBHostMSDSCSI_RequestSense( data ) == USB_SUCCESS) &&
+            _USBHostMSDSCSI_MediaChanged( data ))
+        {
+            _USBHostMSDSCSI_TestUnitReady();
+        }
+    }
+
+    // The last block address and the block length, big endian.
+    unit->blockCount = (((DWORD)data[0] << 24) | ((DWORD)data[1] << 16) | ((DWORD)data[2] << 8) | data[3]) + 1;
+    if ((data[4] != 0) || (data[5] != 0))
+    {
+        unit->blockSize = 0;
+    }
+    else
+    {
+        unit->blockSize = ((WORD)data[6] << 8) | data[7];
+    }
+
+    // The sectors must fit in the file system's sector buffers.  Drives
+    // with 4096 byte logical blocks need MEDIA_SECTOR_SIZE set to 4096.
+    if ((unit->blockSize < 512) || (unit->blockSize > MEDIA_SECTOR_SIZE) ||
+        ((unit->blockSize & (unit->blockSize - 1)) != 0))
+    {
+        #ifdef DEBUG_MODE
+            UART2PrintString( "SCSI: Bad sector size\r\n" );
+        #endif
+        return FALSE;
+    }
+
+    // SPC-3 devices give the most blocks they take in one command in the
+    // Block Limits page.  Older ones don't have it.
+    if (version >= 0x05)
+    {
+        commandBlock[0] = 0x12;     // Operation Code
+        commandBlock[1] = 0x01;     // EVPD
+        commandBlock[2] = 0xB0;     // Page Code: Block Limits
+        commandBlock[3] = 0;        // Allocation length - Big endian!
+        commandBlock[4] = 44;       //
+        commandBlock[5] = 0x00;     // Control
+
+        if (_USBHostMSDSCSI_Command( 1, commandBlock, 6, data, 44 ) == USB_SUCCESS)
+        {
+            maxTransfer = ((DWORD)data[8] << 24) | ((DWORD)data[9] << 16) | ((DWORD)data[10] << 8) | data[11];
+            if (maxTransfer > 0xFFFF)
+            {
+                unit->maxTransfer = 0xFFFF;
+            }
+            else if (maxTransfer != 0)
+            {
+                unit->maxTransfer = (WORD)maxTransfer;
+            }
+
+            // A unit that takes WRITE SAME gives its Maximum WRITE SAME
+            // Length in bytes 36 to 43.  Shorter pages, and 0, mean it
+            // doesn't say, so WRITE SAME is not sent to it.
+            if ((data[2] != 0) || (data[3] >= 40))
+            {
+                if (data[36] | data[37] | data[38] | data[39] | data[40] | data[41])
+                {
+                    unit->maxWriteSame = WRITE_SAME_MAX_BLOCKS;
+                }
+                else
+                {
+                    unit->maxWriteSame = ((WORD)data[42] << 8) | data[43];
+                }
+            }
+        }
+        else
+        {
+            _USBHostMSDSCSI_RequestSense( data );
+        }
+    }
+
+    // Fill in the command block with the MODE SENSE 6 parameters.  Only the
+    // header is asked for; it has the write protect bit.
+    commandBlock[0] = 0x1A;     // Operation Code
+    commandBlock[1] = 0;        //
+    commandBlock[2] = 0x3F;     // Current values, all pages
+    commandBlock[3] = 0;        // Subpage Code
+    commandBlock[4] = 4;        // Allocation length
+    commandBlock[5] = 0x00;     // Control
+
+    if (_USBHostMSDSCSI_Command( 1, commandBlock, 6, data, 4 ) == USB_SUCCESS)
+    {
+        unit->writeProtect = (data[2] & 0x80) ? TRUE : FALSE;
+    }
+    else
+    {
+        _USBHostMSDSCSI_RequestSense( data );
+    }
+
+    unit->state = SCSI_UNIT_VALID;
+    return TRUE;
+}
+
+
+/*******************************************************************************
+  Function:
+    BYTE _USBHostMSDSCSI_RequestSense( BYTE *senseData )
+
+  Precondition:
+    No sector request is running.
+
+  Overview:
+    This function reads the sense data of the selected unit, which tells why
+    its last command failed, and clears it.
+
+  Parameters:
+    BYTE    *senseData  - 18 byte buffer for the fixed format sense data
+
+  Return Values:
+    USB_SUCCESS - The sense data was read
+    Other       - Error from _USBHostMSDSCSI_Command()
+
+  Remarks:
+    The format of the REQUEST SENSE command is shown with
+    USBHostMSDSCSIMediaInitialize().
+  ***************************************************************************/
+
+BYTE _USBHostMSDSCSI_RequestSense( BYTE *senseData )
+{
+    BYTE        commandBlock[6];
+
+    // Fill in the command block with the REQUEST SENSE parameters.
+    commandBlock[0] = 0x03;     // Operation Code
+    commandBlock[1] = 0;        //
+    commandBlock[2] = 0;        //
+    commandBlock[3] = 0;        //
+    commandBlock[4] = 18;       // Allocation length
+    commandBlock[5] = 0;        // Control
+
+    memset( senseData, 0, 18 );
+    return _USBHostMSDSCSI_Command( 1, commandBlock, 6, senseData, 18 );
+}
+
+
 /*******************************************************************************
   Function:
     BOOL _USBHostMSDSCSI_TestUnitReady( void )
 
   Precondition:
-    None
+    No sector request is running.
 
   Overview:
     This function sends the TEST UNIT READY SCSI command
@@ -768,6 +1664,9 @@ BYTE    USBHostMSDSCSIWriteProtectState( void )
     FALSE   - Error while performing command
 
   Remarks:
+    The command is tried up to five times.  It is only sent when the sense
+    data says the medium is not ready or has changed.
+
     The format of the TEST UNIT READY command is as follows:
 
     <code>
@@ -781,20 +1680,12 @@ BYTE    USBHostMSDSCSIWriteProtectState( void )
     </code>
   ***************************************************************************/
 
-#ifdef PERFORM_TEST_UNIT_READY
 BOOL _USBHostMSDSCSI_TestUnitReady( void )
 {
-    DWORD       byteCount;
-    BYTE        commandBlock[10];
-    BYTE        errorCode;
-    BYTE        inquiryData[36];
+    BYTE        commandBlock[6];
+    BYTE        senseData[18];
     BYTE        unitReadyCount;
 
-    // Issue a TEST UNIT READY
-    #ifdef DEBUG_MODE
-        UART2PrintString( "SCSI: TEST UNIT READY..." );
-    #endif
-
     unitReadyCount = 0;
     while (unitReadyCount < 5)
     {
@@ -808,32 +1699,302 @@ BOOL _USBHostMSDSCSI_TestUnitReady( void )
         commandBlock[4] = 0;        // Reserved
         commandBlock[5] = 0x00;     // Control
 
-        errorCode = USBHostMSDRead( deviceAddress, 0, commandBlock, 6, inquiryData, 0 );
-        #ifdef DEBUG_MODE
-            UART2PutHex( errorCode ) ;
-            UART2PutChar( ' ' );
-        #endif
+        if (_USBHostMSDSCSI_Command( 1, commandBlock, 6, NULL, 0 ) == USB_SUCCESS)
+        {
+            return TRUE;
+        }
+
+        // Clear the error before trying again.
+        _USBHostMSDSCSI_RequestSense( senseData );
+    }
+
+    return FALSE;
+}
+
 
-        if (!errorCode)
+/*******************************************************************************
+  Function:
+    BYTE _USBHostMSDSCSI_RequestStart( DWORD sectorAddress,
+                        WORD sectorCount, BYTE *dataBuffer, BYTE direction,
+                        USB_MSD_SCSI_CALLBACK callback )
+
+  Precondition:
+    None
+
+  Overview:
+    This function sets up the sector request of the device of the selected
+    unit and sends its first commands.
+
+  Parameters:
+    DWORD   sectorAddress   - address of the first sector
+    WORD    sectorCount     - number of sectors
+    BYTE    *dataBuffer     - application buffer
+    BYTE    direction       - 1 to read, 0 to write
+    USB_MSD_SCSI_CALLBACK callback - function to call when the request
+                                ends, or NULL
+
+  Return Values:
+    USB_SUCCESS                 - The request is running
+    USB_MSD_DEVICE_BUSY         - Another request is running on the device
+    USB_MSD_DEVICE_NOT_FOUND    - No unit is selected
+    Other                       - The first command could not be sent
+
+  Remarks:
+    A request for no sectors ends at the next USBHostMSDSCSITasks().
+  ***************************************************************************/
+
+BYTE _USBHostMSDSCSI_RequestStart( DWORD sectorAddress, WORD sectorCount, BYTE *dataBuffer, BYTE direction, USB_MSD_SCSI_CALLBACK callback )
+{
+    SCSI_REQUEST    *request = &scsiDeviceInfo[deviceIndex].request;
+    BYTE            errorCode;
+
+    if (request->state != SCSI_REQUEST_IDLE)
+    {
+        return USB_MSD_DEVICE_BUSY;
+    }
+
+    if (deviceAddress == 0)
+    {
+        return USB_MSD_DEVICE_NOT_FOUND;
+    }
+
+    request->sectorAddress  = sectorAddress;
+    request->sectorCount    = sectorCount;
+    request->dataBuffer     = dataBuffer;
+    request->callback       = callback;
+    request->unit           = &scsiDeviceInfo[deviceIndex].unit[deviceLUN];
+    request->maxBlocks      = USB_MSD_MAX_TRANSFER_SECTORS;
+    request->blockSize      = 512;
+    if (request->unit->state != SCSI_UNIT_UNKNOWN)
+    {
+        request->maxBlocks  = request->unit->maxTransfer;
+        request->blockSize  = request->unit->blockSize;
+    }
+    request->address        = deviceAddress;
+    request->LUN            = deviceLUN;
+    request->direction      = direction;
+    request->blocks         = 0;
+
+    if (sectorCount != 0)
+    {
+        errorCode = _USBHostMSDSCSI_RequestQueue( request );
+        if (errorCode)
         {
-            while (!USBHostMSDTransferIsComplete( deviceAddress, &errorCode, &byteCount ))
-            {
-                USBTasks();
-            }
+            return errorCode;
         }
-        #ifdef DEBUG_MODE
-            UART2PutHex( errorCode ) ;
-            UART2PrintString( "\r\n" );
-        #endif
-        if (!errorCode)
+    }
+
+    request->state = SCSI_REQUEST_RUNNING;
+    return USB_SUCCESS;
+}
+
+
+/*******************************************************************************
+  Function:
+    BYTE _USBHostMSDSCSI_RequestCommand( SCSI_REQUEST *request )
+
+  Precondition:
+    The sector request has sectors left.
+
+  Overview:
+    This function sends the READ10 or WRITE10 command for the next part of
+    the sector request, up to the Maximum Transfer Length the unit reported,
+    or USB_MSD_MAX_TRANSFER_SECTORS sectors if it reported none.  If the
+    command is taken, the request moves on to the sectors after it.
+
+  Parameters:
+    SCSI_REQUEST *request   - The sector request
+
+  Return Values:
+    USB_SUCCESS - The command was sent or queued
+    Other       - Error from USBHostMSDRead() or USBHostMSDWrite()
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+BYTE _USBHostMSDSCSI_RequestCommand( SCSI_REQUEST *request )
+{
+    BYTE    commandBlock[10];
+    BYTE    errorCode;
+    WORD    blocks;
+
+    blocks = request->sectorCount;
+    if (blocks > request->maxBlocks)
+    {
+        blocks = request->maxBlocks;
+    }
+
+    // Fill in the command block with the READ10 or WRITE10 parameters.
+    if (request->direction)
+    {
+        commandBlock[0] = 0x28;     // Operation code
+        commandBlock[1] = RDPROTECT_NORMAL | FUA_ALLOW_CACHE;
+    }
+    else
+    {
+        commandBlock[0] = 0x2A;     // Operation code
+        commandBlock[1] = WRPROTECT_NORMAL | FUA_ALLOW_CACHE;
+    }
+    commandBlock[2] = (BYTE) (request->sectorAddress >> 24);     // Big endian!
+    commandBlock[3] = (BYTE) (request->sectorAddress >> 16);
+    commandBlock[4] = (BYTE) (request->sectorAddress >> 8);
+    commandBlock[5] = (BYTE) (request->sectorAddress);
+    commandBlock[6] = 0x00;     // Group Number
+    commandBlock[7] = (BYTE) (blocks >> 8);     // Number of blocks - Big endian!
+    commandBlock[8] = (BYTE) (blocks);
+    commandBlock[9] = 0x00;     // Control
+
+    if (request->direction)
+    {
+        errorCode = USBHostMSDRead( request->address, request->LUN, commandBlock, 10, request->dataBuffer, (DWORD)blocks * request->blockSize );
+    }
+    else
+    {
+        errorCode = USBHostMSDWrite( request->address, request->LUN, commandBlock, 10, request->dataBuffer, (DWORD)blocks * request->blockSize );
+    }
+    #ifdef DEBUG_MODE
+        UART2PrintString( "SCSI: Sector command init error " );
+        UART2PutHex( errorCode );
+        UART2PrintString( "\r\n" );
+    #endif
+
+    if (!errorCode)
+    {
+        request->sectorAddress += blocks;
+        request->sectorCount   -= blocks;
+        request->dataBuffer    += (DWORD)blocks * request->blockSize;
+        request->blocks        += blocks;
+        request->transferDone  = FALSE;
+    }
+    return errorCode;
+}
+
+
+/*******************************************************************************
+  Function:
+    void _USBHostMSDSCSI_RequestEnd( SCSI_REQUEST *request, BYTE errorCode )
+
+  Precondition:
+    The sector request is running.
+
+  Overview:
+    This function ends the sector request and calls its callback.
+
+  Parameters:
+    SCSI_REQUEST *request   - The sector request
+    BYTE errorCode          - Result of the request
+
+  Returns:
+    None
+
+  Remarks:
+    The request is idle before the callback is called, so the callback may
+    start another one.  If the device reported an error, the unit is marked
+    so the next USBHostMSDSCSIMediaInitialize() asks why.
+  ***************************************************************************/
+
+void _USBHostMSDSCSI_RequestEnd( SCSI_REQUEST *request, BYTE errorCode )
+{
+    USB_MSD_SCSI_CALLBACK   callback;
+
+    if ((errorCode == USB_MSD_COMMAND_FAILED) && (request->unit->state == SCSI_UNIT_VALID))
+    {
+        request->unit->state = SCSI_UNIT_CHECK;
+    }
+
+    callback            = request->callback;
+    request->errorCode  = errorCode;
+    request->blocks     = 0;
+    request->state      = SCSI_REQUEST_IDLE;
+
+    if (callback != NULL)
+    {
+        callback( errorCode );
+    }
+}
+
+
+/*******************************************************************************
+  Function:
+    BYTE _USBHostMSDSCSI_RequestQueue( SCSI_REQUEST *request )
+
+  Precondition:
+    The sector request is being started or is running.
+
+  Overview:
+    This function gives the device as many commands of the sector request as
+    it will take: one if it is idle, and more while its mass storage queue
+    has room.
+
+  Parameters:
+    SCSI_REQUEST *request   - The sector request
+
+  Return Values:
+    USB_SUCCESS - The device has at least one command of the request
+    Other       - Error from _USBHostMSDSCSI_RequestCommand()
+
+  Remarks:
+    If a command cannot be given for any reason other than a full queue, the
+    commands already given are terminated.
+  ***************************************************************************/
+
+BYTE _USBHostMSDSCSI_RequestQueue( SCSI_REQUEST *request )
+{
+    BYTE    errorCode;
+
+    while (request->sectorCount != 0)
+    {
+        errorCode = _USBHostMSDSCSI_RequestCommand( request );
+        if ((errorCode == USB_MSD_DEVICE_BUSY) && (request->blocks != 0))
         {
-            return TRUE;
+            // The queue is full.
+            break;
+        }
+        if (errorCode)
+        {
+            if (request->blocks != 0)
+            {
+                USBHostMSDTerminateTransfer( request->address );
+            }
+            return errorCode;
         }
     }
 
-    return FALSE;
+    return USB_SUCCESS;
+}
+
+
+/*******************************************************************************
+  Function:
+    void _USBHostMSDSCSI_WaitIdle( void )
+
+  Precondition:
+    None
+
+  Overview:
+    This function waits until no sector request is running on the device of
+    the selected unit, so a command of its own can be sent to the device.
+
+  Parameters:
+    None - None
+
+  Returns:
+    None
+
+  Remarks:
+    The result of the request that was running is left to its callback.
+  ***************************************************************************/
+
+void _USBHostMSDSCSI_WaitIdle( void )
+{
+    BYTE    errorCode;
+
+    while (!USBHostMSDSCSITransferIsComplete( &errorCode ))
+    {
+        // TODO Any other timeout?  Maybe at the host level, using the 1ms timer...
+    }
 }
-#endif
 
 
 /****************************************************************************
@@ -136,7 +136,7 @@ typedef union __BDT
     {
         struct
         {
-            BYTE CNT         __attribute__ ((packed));
+            BYTE CNT;
             BD_STAT     STAT __attribute__ ((packed));
         };
         struct
@@ -41,7 +41,7 @@ BC           11-10-2006 Initial Creation
 #ifndef _USB_HAL_LOCAL_H_
 #define _USB_HAL_LOCAL_H_
 
-#include "usb/usb.h"
+#include "USB/usb.h"
 
 #if defined (__18CXX)
     #include "USB PIC18.h"
@@ -57,7 +57,7 @@ KO/BC       15-Oct-2007 First release
 #include <stdlib.h>
 #include <string.h>
 #include "GenericTypeDefs.h"
-#include "USB\usb.h"
+#include "USB/usb.h"
 #include "usb_host_local.h"
 #include "usb_hal_local.h"
 
@@ -82,6 +82,20 @@ KO/BC       15-Oct-2007 First release
 // of a frame.
 #define ALLOW_MULTIPLE_BULK_TRANSACTIONS_PER_FRAME
 
+// If this is defined, a bulk transfer keeps the bus for the rest of the frame
+// once it has been picked.  The next packet is set up in the other ping-pong
+// Buffer Descriptor while one is on the bus, and the Transfer Done interrupt
+// sends it at once instead of searching all the endpoints again.  It needs
+// full ping-pong and multiple bulk transactions per frame.
+#define PIPELINE_BULK_PACKETS
+
+// If this is defined, a bulk transfer started after the bulk endpoints have
+// run out of work for the frame goes on the bus at once instead of waiting
+// for the next SOF.  Class drivers that chain phases (CBW, data, CSW) then
+// do not lose the rest of the frame between them.  It needs multiple bulk
+// transactions per frame.
+#define START_BULK_TRANSFERS_IN_FRAME
+
 // If this is defined, then we will repeat a NAK'd request in the same frame.
 // Otherwise, we will wait until the next frame to repeat the request.  Some
 // mass storage devices require the host to wait until the next frame to
@@ -90,6 +104,19 @@ KO/BC       15-Oct-2007 First release
 
 //#define USE_MANUAL_DETACH_DETECT
 
+#if (USB_MAX_DEVICES > 1) && !defined( USB_HUB_SUPPORT_INCLUDED )
+    #error USB_MAX_DEVICES can be more than 1 only if USB_HUB_SUPPORT_INCLUDED is defined.
+#endif
+
+#if defined( PIPELINE_BULK_PACKETS ) && \
+    ((USB_PING_PONG_MODE != USB_PING_PONG__FULL_PING_PONG) || !defined( ALLOW_MULTIPLE_BULK_TRANSACTIONS_PER_FRAME ))
+    #undef PIPELINE_BULK_PACKETS
+#endif
+
+#if defined( START_BULK_TRANSFERS_IN_FRAME ) && !defined( ALLOW_MULTIPLE_BULK_TRANSACTIONS_PER_FRAME )
+    #undef START_BULK_TRANSFERS_IN_FRAME
+#endif
+
 
 //******************************************************************************
 //******************************************************************************
@@ -118,15 +145,14 @@ BYTE                        countConfigurations;                        // Count
 BYTE                        numCommandTries;                            // The number of times the current command has been tried.
 BYTE                        numEnumerationTries;                        // The number of times enumeration has been attempted on the attached device.
 volatile WORD               numTimerInterrupts;                         // The number of milliseconds elapsed during the current waiting period.
+USB_DEVICE_INFO            *pCurrentDevice                     = NULL;  // Device the host state machine is working on.
 volatile USB_ENDPOINT_INFO *pCurrentEndpoint;                           // Pointer to the endpoint currently performing a transfer.
-USB_CONFIGURATION          *pConfigurationDescriptorList       = NULL;  // Pointer to the list of Donfiguration Descriptors of the attached device.
-BYTE                       *pCurrentConfigurationDescriptor    = NULL;  // Pointer to the current configuration descriptor of the attached device.
-BYTE                       *pDeviceDescriptor                  = NULL;  // Pointer to the Device Descriptor of the attached device.
-USB_ENDPOINT_INFO          *pEndpointList                      = NULL;  // List of endpoints on the attached device.
-BYTE                       *pEP0Data                           = NULL;  // A data buffer for use by EP0.
-USB_INTERFACE_INFO         *pInterfaceList                     = NULL;  // List of interfaces on the attached device.
+USB_ENDPOINT_INFO          *pEndpointList                      = NULL;  // List of endpoints on all attached devices.  EP0 of the root port device is first.
+#ifdef PIPELINE_BULK_PACKETS
+    BDT_ENTRY              *pNextBulkBDT                       = NULL;  // Buffer Descriptor holding the next packet of the current bulk transfer.
+#endif
 USB_BUS_INFO                usbBusInfo;                                 // Information about the USB bus.
-USB_DEVICE_INFO             usbDeviceInfo;                              // A collection of information about the attached device.
+USB_DEVICE_INFO             usbDeviceInfo[USB_MAX_DEVICES];             // A collection of information about each attached device.
 #if defined( USB_ENABLE_TRANSFER_EVENT )
     USB_EVENT_QUEUE         usbEventQueue;                              // Queue of USB events used to synchronize ISR to main tasks loop.
 #endif
@@ -134,6 +160,28 @@ volatile WORD               usbHostState;                               // State
 volatile WORD               usbOverrideHostState;                       // Next state machine state, when set by interrupt processing.
 USB_ROOT_HUB_INFO           usbRootHubInfo;                             // Information about a specific port.
 
+#ifdef USB_HOST_MEMORY_POOLS
+    USB_ENDPOINT_INFO       usbPoolEndpoints[USB_HOST_POOL_ENDPOINTS];  // Endpoint records.
+    USB_INTERFACE_INFO      usbPoolInterfaces[USB_HOST_POOL_INTERFACES];// Interface records.
+    USB_CONFIGURATION       usbPoolConfigurations[USB_HOST_POOL_CONFIGURATIONS];    // Configuration records.
+    DWORD                   usbPoolBuffer[USB_HOST_POOL_BUFFER_BLOCKS * USB_HOST_POOL_BLOCK_SIZE / 4];  // Descriptors and EP0 data buffers.
+    BYTE                    usbPoolMap[USB_HOST_POOL_ENDPOINTS + USB_HOST_POOL_INTERFACES +
+                                       USB_HOST_POOL_CONFIGURATIONS + USB_HOST_POOL_BUFFER_BLOCKS];   // Per block: 0 if free, else the length of the allocation starting there, or 0xFF inside one.
+    USB_HOST_POOL_STATS     usbPoolStats;                               // Use of each pool.
+
+    // Memory, block size and map of each pool, indexed by USB_HOST_POOL_*.
+    BYTE * const            usbPoolMemory[USB_HOST_POOLS]       = { (BYTE *)usbPoolEndpoints, (BYTE *)usbPoolInterfaces,
+                                                                    (BYTE *)usbPoolConfigurations, (BYTE *)usbPoolBuffer };
+    const WORD              usbPoolBlockSize[USB_HOST_POOLS]    = { sizeof(USB_ENDPOINT_INFO), sizeof(USB_INTERFACE_INFO),
+                                                                    sizeof(USB_CONFIGURATION), USB_HOST_POOL_BLOCK_SIZE };
+    const WORD              usbPoolBlocks[USB_HOST_POOLS]       = { USB_HOST_POOL_ENDPOINTS, USB_HOST_POOL_INTERFACES,
+                                                                    USB_HOST_POOL_CONFIGURATIONS, USB_HOST_POOL_BUFFER_BLOCKS };
+    BYTE * const            usbPoolMapStart[USB_HOST_POOLS]     = { usbPoolMap,
+                                                                    usbPoolMap + USB_HOST_POOL_ENDPOINTS,
+                                                                    usbPoolMap + USB_HOST_POOL_ENDPOINTS + USB_HOST_POOL_INTERFACES,
+                                                                    usbPoolMap + USB_HOST_POOL_ENDPOINTS + USB_HOST_POOL_INTERFACES + USB_HOST_POOL_CONFIGURATIONS };
+#endif
+
 #ifdef ENABLE_STATE_TRACE   // Debug trace support
     WORD prevHostState;
 #endif
@@ -176,10 +224,11 @@ USB_ROOT_HUB_INFO           usbRootHubInfo;                             // Infor
 
 BYTE USBHostClearEndpointErrors( BYTE deviceAddress, BYTE endpoint )
 {
+    USB_DEVICE_INFO   *pDevice;
     USB_ENDPOINT_INFO *ep;
 
     // Find the required device
-    if (deviceAddress != usbDeviceInfo.deviceAddress)
+    if ((pDevice = _USB_FindDevice( deviceAddress )) == NULL)
     {
         return USB_UNKNOWN_DEVICE;
     }
@@ -187,7 +236,7 @@ BYTE USBHostClearEndpointErrors( BYTE deviceAddress, BYTE endpoint )
     ep = pEndpointList;
     while (ep != NULL)
     {
-        if (ep->bEndpointAddress == endpoint)
+        if ((ep->pDevice == pDevice) && (ep->bEndpointAddress == endpoint))
         {
             ep->status.bfStalled    = 0;
             ep->status.bfError      = 0;
@@ -260,20 +309,22 @@ BYTE USBHostClearEndpointErrors( BYTE deviceAddress, BYTE endpoint )
 BYTE USBHostDeviceRequest( BYTE deviceAddress, BYTE bmRequestType, BYTE bRequest,
             WORD wValue, WORD wIndex, WORD wLength, BYTE *data, BYTE dataDirection )
 {
+    USB_DEVICE_INFO *pDevice;
+
     // Find the required device
-    if (deviceAddress != usbDeviceInfo.deviceAddress)
+    if ((pDevice = _USB_FindDevice( deviceAddress )) == NULL)
     {
         return USB_UNKNOWN_DEVICE;
     }
 
     // If we are not in a normal user running state, we cannot do this.
-    if ((usbHostState & STATE_MASK) != STATE_RUNNING)
+    if ((_USB_GetDeviceState( pDevice ) & STATE_MASK) != STATE_RUNNING)
     {
         return USB_INVALID_STATE;
     }
 
     // Make sure no other reads or writes on EP0 are in progress.
-    if (!pEndpointList->status.bfTransferComplete)
+    if (!pDevice->pEndpoint0->status.bfTransferComplete)
     {
         return USB_ENDPOINT_BUSY;
     }
@@ -289,34 +340,34 @@ BYTE USBHostDeviceRequest( BYTE deviceAddress, BYTE bmRequestType, BYTE bRequest
     // If the user is doing a SET INTERFACE, we must reset DATA0 for all endpoints.
     if (bRequest == USB_REQUEST_SET_INTERFACE)
     {
-        _USB_ResetDATA0( 0 );
+        _USB_ResetDATA0( pDevice, 0 );
     }
 
     // If the user is doing a CLEAR FEATURE(ENDPOINT_HALT), we must reset DATA0 for that endpoint.
     if ((bRequest == USB_REQUEST_CLEAR_FEATURE) && (wValue == USB_FEATURE_ENDPOINT_HALT))
     {
-        _USB_ResetDATA0( (BYTE)wIndex );
+        _USB_ResetDATA0( pDevice, (BYTE)wIndex );
     }
 
     // Set up the control packet.
-    pEP0Data[0] = bmRequestType;
-    pEP0Data[1] = bRequest;
-    pEP0Data[2] = wValue & 0xFF;
-    pEP0Data[3] = (wValue >> 8) & 0xFF;
-    pEP0Data[4] = wIndex & 0xFF;
-    pEP0Data[5] = (wIndex >> 8) & 0xFF;
-    pEP0Data[6] = wLength & 0xFF;
-    pEP0Data[7] = (wLength >> 8) & 0xFF;
+    pDevice->pEP0Data[0] = bmRequestType;
+    pDevice->pEP0Data[1] = bRequest;
+    pDevice->pEP0Data[2] = wValue & 0xFF;
+    pDevice->pEP0Data[3] = (wValue >> 8) & 0xFF;
+    pDevice->pEP0Data[4] = wIndex & 0xFF;
+    pDevice->pEP0Data[5] = (wIndex >> 8) & 0xFF;
+    pDevice->pEP0Data[6] = wLength & 0xFF;
+    pDevice->pEP0Data[7] = (wLength >> 8) & 0xFF;
 
     if (dataDirection == USB_DEVICE_REQUEST_SET)
     {
         // We are doing a SET command that requires data be sent.
-        _USB_InitControlWrite( pEndpointList, pEP0Data,8, data, wLength );
+        _USB_InitControlWrite( pDevice->pEndpoint0, pDevice->pEP0Data,8, data, wLength );
     }
     else
     {
         // We are doing a GET request.
-        _USB_InitControlRead( pEndpointList, pEP0Data, 8, data, wLength );
+        _USB_InitControlRead( pDevice->pEndpoint0, pDevice->pEP0Data, 8, data, wLength );
     }
 
     return USB_SUCCESS;
@@ -346,7 +397,7 @@ BYTE USBHostDeviceRequest( BYTE deviceAddress, BYTE bmRequestType, BYTE bRequest
     USB_HOLDING_OUT_OF_MEMORY           - Not enough heap space available
     USB_HOLDING_UNSUPPORTED_DEVICE      - Invalid configuration or
                                             unsupported class
-    USB_HOLDING_UNSUPPORTED_HUB         - Hubs are not supported
+    USB_HOLDING_UNSUPPORTED_HUB         - Hub support is not included
     USB_HOLDING_INVALID_CONFIGURATION   - Invalid configuration requested
     USB_HOLDING_PROCESSING_CAPACITY     - Processing requirement excessive
     USB_HOLDING_POWER_REQUIREMENT       - Power requirement excessive
@@ -362,14 +413,32 @@ BYTE USBHostDeviceRequest( BYTE deviceAddress, BYTE bmRequestType, BYTE bRequest
 
 BYTE USBHostDeviceStatus( BYTE deviceAddress )
 {
-    if ((usbHostState & STATE_MASK) == STATE_DETACHED)
+    USB_DEVICE_INFO *pDevice;
+    WORD            state;
+
+    // The device on the root port is asked for by the address it will get,
+    // before it has one, so the application can follow attach and enumeration.
+    // Addresses above it belong to devices behind a hub.
+    if ((pDevice = _USB_FindDevice( deviceAddress )) == NULL)
+    {
+        #ifdef USB_HUB_SUPPORT_INCLUDED
+            if (deviceAddress > USB_SINGLE_DEVICE_ADDRESS)
+            {
+                return USB_DEVICE_DETACHED;
+            }
+        #endif
+        pDevice = usbDeviceInfo;
+    }
+    state = _USB_GetDeviceState( pDevice );
+
+    if ((state & STATE_MASK) == STATE_DETACHED)
     {
         return USB_DEVICE_DETACHED;
     }
 
-    if ((usbHostState & STATE_MASK) == STATE_RUNNING)
+    if ((state & STATE_MASK) == STATE_RUNNING)
     {
-        if ((usbHostState & SUBSTATE_MASK) == SUBSTATE_SUSPEND_AND_RESUME)
+        if ((state & SUBSTATE_MASK) == SUBSTATE_SUSPEND_AND_RESUME)
         {
             return USB_DEVICE_SUSPENDED;
         }
@@ -379,14 +448,344 @@ BYTE USBHostDeviceStatus( BYTE deviceAddress )
         }
     }
 
-    if ((usbHostState & STATE_MASK) == STATE_HOLDING)
+    if ((state & STATE_MASK) == STATE_HOLDING)
     {
-        return usbDeviceInfo.errorCode;
+        return pDevice->errorCode;
     }
 
     return USB_DEVICE_ENUMERATING;
 }
 
+/****************************************************************************
+  Function:
+    BYTE * USBHostGetCurrentConfigurationDescriptor( BYTE deviceAddress )
+
+  Description:
+    This function returns a pointer to the current configuration descriptor
+    of the requested device.
+
+  Precondition:
+    None
+
+  Parameters:
+    BYTE deviceAddress  - Address of device
+
+  Returns:
+    BYTE *  - Pointer to the Configuration Descriptor, or NULL if the device
+                is not attached.
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+BYTE * USBHostGetCurrentConfigurationDescriptor( BYTE deviceAddress )
+{
+    USB_DEVICE_INFO *pDevice;
+
+    if ((pDevice = _USB_FindDevice( deviceAddress )) == NULL)
+    {
+        return NULL;
+    }
+    return pDevice->pCurrentConfigurationDescriptor;
+}
+
+/****************************************************************************
+  Function:
+    BYTE * USBHostGetDeviceDescriptor( BYTE deviceAddress )
+
+  Description:
+    This function returns a pointer to the device descriptor of the
+    requested device.
+
+  Precondition:
+    None
+
+  Parameters:
+    BYTE deviceAddress  - Address of device
+
+  Returns:
+    BYTE *  - Pointer to the Device Descriptor, or NULL if the device is not
+                attached.
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+BYTE * USBHostGetDeviceDescriptor( BYTE deviceAddress )
+{
+    USB_DEVICE_INFO *pDevice;
+
+    if ((pDevice = _USB_FindDevice( deviceAddress )) == NULL)
+    {
+        return NULL;
+    }
+    return pDevice->pDeviceDescriptor;
+}
+
+
+/****************************************************************************
+  Function:
+    void USBHostGetPoolStatistics( USB_HOST_POOL_STATS *pStats )
+
+  Summary:
+    This function returns the use of the memory pools of the host layer.
+
+  Description:
+    This function copies the size, current use, high-water mark, extent and
+    failure count of each memory pool.
+
+  Precondition:
+    USB_HOST_MEMORY_POOLS is defined.
+
+  Parameters:
+    USB_HOST_POOL_STATS *pStats - Where to put the statistics
+
+  Returns:
+    None
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+#ifdef USB_HOST_MEMORY_POOLS
+void USBHostGetPoolStatistics( USB_HOST_POOL_STATS *pStats )
+{
+    BYTE    i;
+
+    for (i = 0; i < USB_HOST_POOLS; i++)
+    {
+        usbPoolStats.pool[i].size = usbPoolBlocks[i];
+    }
+    *pStats = usbPoolStats;
+}
+#endif
+
+#ifdef USB_HUB_SUPPORT_INCLUDED
+/****************************************************************************
+  Function:
+    BYTE USBHostHubPortAttach( BYTE hubAddress, BYTE portNumber )
+
+  Summary:
+    This function is called by a hub client driver before it resets a port
+    with a device on it.
+
+  Description:
+    This function is called by a hub client driver when a device has been
+    connected to one of its ports and the connection has settled, before
+    the port is reset.  It gives the device an entry in the device table
+    and the address it will be given.  The device keeps this address until
+    USBHostHubPortDetach() is called.
+
+    Only one device may be at the default address at a time.  If another
+    device behind a hub is still being reset or enumerated, or the device
+    table is full, the function returns 0 and the hub driver should try
+    again later without resetting the port.
+
+  Precondition:
+    None
+
+  Parameters:
+    BYTE hubAddress - Address of the hub
+    BYTE portNumber - Port of the hub the device is connected to
+
+  Return Values:
+    0       - The port cannot be reset now.
+    Other   - The address the device will be given.
+
+  Remarks:
+    Once the port reset is complete and the port is enabled, the hub driver
+    calls USBHostHubPortEnabled() to start enumeration.
+  ***************************************************************************/
+
+BYTE USBHostHubPortAttach( BYTE hubAddress, BYTE portNumber )
+{
+    USB_DEVICE_INFO     *pDevice;
+    USB_DEVICE_INFO     *pFree;
+    USB_ENDPOINT_INFO   *ep;
+    BYTE                i;
+
+    // The state machine must be free, and no other device may be on its
+    // way to the default address.
+    if ((pCurrentDevice != usbDeviceInfo) || (usbHostState != (STATE_RUNNING | SUBSTATE_NORMAL_RUN)))
+    {
+        return 0;
+    }
+
+    pFree = NULL;
+    for (i = 1; i < USB_MAX_DEVICES; i++)
+    {
+        pDevice = &usbDeviceInfo[i];
+        if (pDevice->pEndpoint0 == NULL)
+        {
+            if (pFree == NULL)
+            {
+                pFree = pDevice;
+            }
+        }
+        else if ((pDevice->hostState != (STATE_RUNNING | SUBSTATE_NORMAL_RUN)) &&
+                 (pDevice->hostState != (STATE_HOLDING | SUBSTATE_HOLD)))
+        {
+            return 0;
+        }
+    }
+    if (pFree == NULL)
+    {
+        return 0;
+    }
+
+    // Allocate EP0 and its data buffer.  We'll make the buffer 8 bytes for
+    // now, which is the minimum wMaxPacketSize for EP0.
+    if ((ep = (USB_ENDPOINT_INFO *)USB_MALLOC( USB_HOST_POOL_ENDPOINT, sizeof(USB_ENDPOINT_INFO) )) == NULL)
+    {
+        return 0;
+    }
+    if ((pFree->pEP0Data = (BYTE *)USB_MALLOC( USB_HOST_POOL_BUFFER, 8 )) == NULL)
+    {
+        USB_FREE( ep );
+        return 0;
+    }
+
+    // Initialize Endpoint 0 attributes.
+    ep->next                        = NULL;
+    ep->pDevice                     = pFree;
+    ep->status.val                  = 0x00;
+    ep->status.bfUseDTS             = 1;
+    ep->status.bfTransferComplete   = 1;    // Initialize to success to allow preprocessing loops.
+    ep->wMaxPacketSize              = 64;
+    ep->dataCount                   = 0;    // Initialize to 0 since we set bfTransferComplete.
+    ep->bEndpointAddress            = 0;
+    ep->transferState               = TSTATE_IDLE;
+    ep->bmAttributes.val            = 0;
+    ep->bmAttributes.bfTransferType = USB_TRANSFER_TYPE_CONTROL;
+    ep->pInterface                  = NULL;
+
+    // Initialize the USB Device information.  The device waits in the
+    // reset state until its hub driver has enabled the port.
+    pFree->currentConfiguration     = 0;
+    pFree->attributesOTG            = 0;
+    pFree->flags.val                = 0;
+    pFree->errorCode                = USB_SUCCESS;
+    pFree->deviceAddressAndSpeed    = 0;
+    pFree->deviceAddress            = (pFree - usbDeviceInfo) + USB_SINGLE_DEVICE_ADDRESS;
+    pFree->hubAddress               = hubAddress;
+    pFree->hubPort                  = portNumber;
+    pFree->hostState                = STATE_ATTACHED | SUBSTATE_RESET_DEVICE;
+    pFree->pEndpoint0               = ep;
+
+    // Put EP0 at the end of the endpoint list.  The device's other endpoints
+    // will follow it.
+    ep = pEndpointList;
+    while (ep->next != NULL)
+    {
+        ep = ep->next;
+    }
+    ep->next = pFree->pEndpoint0;
+
+    return pFree->deviceAddress;
+}
+
+/****************************************************************************
+  Function:
+    BYTE USBHostHubPortDetach( BYTE deviceAddress )
+
+  Summary:
+    This function is called by a hub client driver when a device has been
+    removed from one of its ports.
+
+  Description:
+    This function is called by a hub client driver when a device has been
+    removed from one of its ports, or when the hub driver gives up on it.
+    The transfers of the device are stopped, the event EVENT_DETACH is sent
+    to its client drivers, and its memory and address are freed.  If the
+    device is itself a hub, the devices behind it are removed first.
+
+  Precondition:
+    None
+
+  Parameters:
+    BYTE deviceAddress  - Address returned by USBHostHubPortAttach()
+
+  Return Values:
+    USB_SUCCESS         - The device has been removed.
+    USB_UNKNOWN_DEVICE  - Device not found
+    USB_BUSY            - A token of the device is on the bus.  Call again.
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+BYTE USBHostHubPortDetach( BYTE deviceAddress )
+{
+    USB_DEVICE_INFO *pDevice;
+
+    if (((pDevice = _USB_FindDevice( deviceAddress )) == NULL) || (pDevice == usbDeviceInfo))
+    {
+        return USB_UNKNOWN_DEVICE;
+    }
+
+    if (!_USB_RemoveDevice( pDevice ))
+    {
+        return USB_BUSY;
+    }
+    return USB_SUCCESS;
+}
+
+/****************************************************************************
+  Function:
+    BYTE USBHostHubPortEnabled( BYTE deviceAddress, BOOL lowSpeed )
+
+  Summary:
+    This function is called by a hub client driver when a port reset is
+    complete.
+
+  Description:
+    This function is called by a hub client driver when it has reset the
+    port of a device given by USBHostHubPortAttach() and the port is
+    enabled.  The device is now at the default address, and the host state
+    machine will enumerate it the next time it is free.
+
+  Precondition:
+    USBHostHubPortAttach() returned deviceAddress.
+
+  Parameters:
+    BYTE deviceAddress  - Address returned by USBHostHubPortAttach()
+    BOOL lowSpeed       - The hub reported a low speed device on the port
+
+  Return Values:
+    USB_SUCCESS         - Enumeration will start.
+    USB_UNKNOWN_DEVICE  - Device not found
+    USB_ILLEGAL_REQUEST - The device is not waiting for its port reset.
+
+  Remarks:
+    The hub driver should follow the device with USBHostDeviceStatus().  If
+    it reports an error, the device is holding and the port may be disabled.
+  ***************************************************************************/
+
+BYTE USBHostHubPortEnabled( BYTE deviceAddress, BOOL lowSpeed )
+{
+    USB_DEVICE_INFO *pDevice;
+
+    if (((pDevice = _USB_FindDevice( deviceAddress )) == NULL) || (pDevice == usbDeviceInfo))
+    {
+        return USB_UNKNOWN_DEVICE;
+    }
+
+    if (pDevice->hostState != (STATE_ATTACHED | SUBSTATE_RESET_DEVICE))
+    {
+        return USB_ILLEGAL_REQUEST;
+    }
+
+    if (lowSpeed)
+    {
+        pDevice->flags.bfIsLowSpeed     = 1;
+        pDevice->deviceAddressAndSpeed  = 0x80;
+    }
+    pDevice->hostState = STATE_ATTACHED | SUBSTATE_GET_DEVICE_DESCRIPTOR_SIZE;
+
+    return USB_SUCCESS;
+}
+#endif
+
 /****************************************************************************
   Function:
     BOOL USBHostInit(  unsigned long flags  )
@@ -414,17 +813,21 @@ BYTE USBHostDeviceStatus( BYTE deviceAddress )
     If the endpoint list is empty, an entry is created in the endpoint list
     for EP0.  If the list is not empty, free all allocated memory other than
     the EP0 node.  This allows the routine to be called multiple times by the
-    application.
+    application.  Devices behind a hub lose their EP0 nodes as well.
   ***************************************************************************/
 
 BOOL USBHostInit(  unsigned long flags  )
 {
+    #ifdef USB_HUB_SUPPORT_INCLUDED
+        BYTE    i;
+    #endif
+
     // Allocate space for Endpoint 0.  We will initialize it in the state machine,
     // so we can reinitialize when another device connects.  If the Endpoint 0
     // node already exists, free all other allocated memory.
     if (pEndpointList == NULL)
     {
-        if ((pEndpointList = (USB_ENDPOINT_INFO*)malloc( sizeof(USB_ENDPOINT_INFO) )) == NULL)
+        if ((pEndpointList = (USB_ENDPOINT_INFO*)USB_MALLOC( USB_HOST_POOL_ENDPOINT, sizeof(USB_ENDPOINT_INFO) )) == NULL)
         {
             #ifdef DEBUG_MODE
                 UART2PrintString( "HOST: Cannot allocate for endpoint list.\r\n" );
@@ -436,15 +839,29 @@ BOOL USBHostInit(  unsigned long flags  )
     }
     else
     {
-        _USB_FreeMemory();
+        #ifdef USB_HUB_SUPPORT_INCLUDED
+            for (i = 1; i < USB_MAX_DEVICES; i++)
+            {
+                if (usbDeviceInfo[i].pEndpoint0 != NULL)
+                {
+                    _USB_FreeDevice( &usbDeviceInfo[i] );
+                }
+            }
+        #endif
+        _USB_FreeMemory( usbDeviceInfo );
     }
 
     // Initialize other variables.
+    pCurrentDevice                          = usbDeviceInfo;
     pCurrentEndpoint                        = pEndpointList;
+    pEndpointList->pDevice                  = usbDeviceInfo;
     usbHostState                            = STATE_DETACHED;
     usbOverrideHostState                    = NO_STATE;
-    usbDeviceInfo.deviceAddressAndSpeed     = 0;
-    usbDeviceInfo.deviceAddress             = 0;
+    usbDeviceInfo[0].pEndpoint0             = pEndpointList;
+    usbDeviceInfo[0].hubAddress             = USB_ROOT_HUB;
+    usbDeviceInfo[0].hubPort                = 0;
+    usbDeviceInfo[0].deviceAddressAndSpeed  = 0;
+    usbDeviceInfo[0].deviceAddress          = 0;
     usbRootHubInfo.flags.bPowerGoodPort0    = 1;
 
     // Initialize event queue
@@ -490,16 +907,17 @@ BOOL USBHostInit(  unsigned long flags  )
 
 BYTE USBHostRead( BYTE deviceAddress, BYTE endpoint, BYTE *pData, DWORD size )
 {
+    USB_DEVICE_INFO   *pDevice;
     USB_ENDPOINT_INFO *ep;
 
     // Find the required device
-    if (deviceAddress != usbDeviceInfo.deviceAddress)
+    if ((pDevice = _USB_FindDevice( deviceAddress )) == NULL)
     {
         return USB_UNKNOWN_DEVICE;
     }
 
     // If we are not in a normal user running state, we cannot do this.
-    if ((usbHostState & STATE_MASK) != STATE_RUNNING)
+    if ((_USB_GetDeviceState( pDevice ) & STATE_MASK) != STATE_RUNNING)
     {
         return USB_INVALID_STATE;
     }
@@ -507,7 +925,7 @@ BYTE USBHostRead( BYTE deviceAddress, BYTE endpoint, BYTE *pData, DWORD size )
     ep = pEndpointList;
     while (ep != NULL)
     {
-        if (ep->bEndpointAddress == endpoint)
+        if ((ep->pDevice == pDevice) && (ep->bEndpointAddress == endpoint))
         {
             if (ep->bmAttributes.bfTransferType == USB_TRANSFER_TYPE_CONTROL)
             {
@@ -542,6 +960,12 @@ BYTE USBHostRead( BYTE deviceAddress, BYTE endpoint, BYTE *pData, DWORD size )
             }
 
             _USB_InitRead( ep, pData, size );
+            #ifdef START_BULK_TRANSFERS_IN_FRAME
+                if (ep->bmAttributes.bfTransferType == USB_TRANSFER_TYPE_BULK)
+                {
+                    _USB_StartBulkInFrame();
+                }
+            #endif
 
             return USB_SUCCESS;
         }
@@ -578,22 +1002,27 @@ BYTE USBHostRead( BYTE deviceAddress, BYTE endpoint, BYTE *pData, DWORD size )
     rather than a reset state.  The ATTACH interrupt will automatically be
     triggered when the module is re-enabled, and the proper reset will be
     performed.
+
+    Only the device on the root port can be reset this way.  A device behind
+    a hub is reset through its hub port by the hub client driver.
   ***************************************************************************/
 
 BYTE USBHostResetDevice( BYTE deviceAddress )
 {
+    USB_DEVICE_INFO *pDevice;
+
     // Find the required device
-    if (deviceAddress != usbDeviceInfo.deviceAddress)
+    if ((pDevice = _USB_FindDevice( deviceAddress )) == NULL)
     {
         return USB_UNKNOWN_DEVICE;
     }
 
-    if ((usbHostState & STATE_MASK) == STATE_DETACHED)
+    if ((pDevice != usbDeviceInfo) || ((_USB_GetDeviceState( pDevice ) & STATE_MASK) == STATE_DETACHED))
     {
         return USB_ILLEGAL_REQUEST;
     }
 
-    usbHostState = STATE_DETACHED;
+    _USB_SetDeviceState( pDevice, STATE_DETACHED );
 
     return USB_SUCCESS;
 }
@@ -626,13 +1055,18 @@ BYTE USBHostResetDevice( BYTE deviceAddress )
 
 BYTE USBHostResumeDevice( BYTE deviceAddress )
 {
+    USB_DEVICE_INFO *pDevice;
+
     // Find the required device
-    if (deviceAddress != usbDeviceInfo.deviceAddress)
+    if ((pDevice = _USB_FindDevice( deviceAddress )) == NULL)
     {
         return USB_UNKNOWN_DEVICE;
     }
 
-    if (usbHostState != (STATE_RUNNING | SUBSTATE_SUSPEND_AND_RESUME | SUBSUBSTATE_SUSPEND))
+    // Only the device on the root port is suspended, and it stays the current
+    // device while it is.
+    if ((pDevice != pCurrentDevice) ||
+        (usbHostState != (STATE_RUNNING | SUBSTATE_SUSPEND_AND_RESUME | SUBSUBSTATE_SUSPEND)))
     {
         return USB_ILLEGAL_REQUEST;
     }
@@ -681,33 +1115,36 @@ BYTE USBHostResumeDevice( BYTE deviceAddress )
 
 BYTE USBHostSetDeviceConfiguration( BYTE deviceAddress, BYTE configuration )
 {
+    USB_DEVICE_INFO *pDevice;
+
     // Find the required device
-    if (deviceAddress != usbDeviceInfo.deviceAddress)
+    if ((pDevice = _USB_FindDevice( deviceAddress )) == NULL)
     {
         return USB_UNKNOWN_DEVICE;
     }
 
     // If we are not in a normal user running state, we cannot do this.
-    if ((usbHostState & STATE_MASK) != STATE_RUNNING)
+    if ((_USB_GetDeviceState( pDevice ) & STATE_MASK) != STATE_RUNNING)
     {
         return USB_INVALID_STATE;
     }
 
     // Make sure no other reads or writes are in progress.
-    if (_USB_TransferInProgress())
+    if (_USB_TransferInProgress( pDevice ))
     {
         return USB_BUSY;
     }
 
     // Set the new device configuration.
-    usbDeviceInfo.currentConfiguration = configuration;
+    pDevice->currentConfiguration = configuration;
 
     // Set the state back to configure the device.  This will destroy the
     // endpoint list and terminate any current transactions.  We already have
     // the configuration, so we can jump into the Select Configuration state.
     // If the configuration value is invalid, the state machine will error and
-    // put the device into a holding state.
-    usbHostState = STATE_CONFIGURING | SUBSTATE_SELECT_CONFIGURATION;
+    // put the device into a holding state.  A device behind a hub is picked
+    // up by the state machine once it is free.
+    _USB_SetDeviceState( pDevice, STATE_CONFIGURING | SUBSTATE_SELECT_CONFIGURATION );
 
     return USB_SUCCESS;
 }
@@ -721,7 +1158,7 @@ BYTE USBHostSetDeviceConfiguration( BYTE deviceAddress, BYTE configuration )
     This function turns off the USB module and frees all unnecessary memory.
     This routine can be called by the application layer to shut down all
     USB activity, which effectively detaches all devices.  The event
-    EVENT_DETACH will be sent to the client drivers for the attached device,
+    EVENT_DETACH will be sent to the client drivers for each attached device,
     and the event EVENT_VBUS_RELEASE_POWER will be sent to the application
     layer.
 
@@ -740,22 +1177,28 @@ BYTE USBHostSetDeviceConfiguration( BYTE deviceAddress, BYTE configuration )
 
 void USBHostShutdown( void )
 {
+    USB_VBUS_POWER_EVENT_DATA   powerRequest;
+    USB_DEVICE_INFO             *pDevice;
+    int                         i;
+
     // Shut off the power to the module first, in case we are in an
     // overcurrent situation.
     U1PWRC = USB_NORMAL_OPERATION | USB_DISABLED;
 
-    // If we currently have an attached device, notify the higher layers that
-    // the device is being removed.
-    if (usbDeviceInfo.deviceAddress)
+    // If we currently have attached devices, notify the higher layers that
+    // they are being removed.  Devices behind a hub go before the hub.
+    for (i = USB_MAX_DEVICES - 1; i >= 0; i--)
     {
-        USB_VBUS_POWER_EVENT_DATA   powerRequest;
-
-        powerRequest.port = 0;  // Currently was have only one port.
+        pDevice = &usbDeviceInfo[i];
+        if ((pDevice->pEndpoint0 != NULL) && pDevice->deviceAddress)
+        {
+            powerRequest.port = pDevice->hubPort;
 
-        USB_HOST_APP_EVENT_HANDLER( usbDeviceInfo.deviceAddress, EVENT_VBUS_RELEASE_POWER,
-            &powerRequest, sizeof(USB_VBUS_POWER_EVENT_DATA) );
-        _USB_NotifyClients(usbDeviceInfo.deviceAddress, EVENT_DETACH,
-            &usbDeviceInfo.deviceAddress, sizeof(BYTE) );
+            USB_HOST_APP_EVENT_HANDLER( pDevice->deviceAddress, EVENT_VBUS_RELEASE_POWER,
+                &powerRequest, sizeof(USB_VBUS_POWER_EVENT_DATA) );
+            _USB_NotifyClients(pDevice->deviceAddress, EVENT_DETACH,
+                &pDevice->deviceAddress, sizeof(BYTE) );
+        }
     }
 
     // Free all extra allocated memory, initialize variables, and reset the
@@ -793,13 +1236,18 @@ void USBHostShutdown( void )
 
 BYTE USBHostSuspendDevice( BYTE deviceAddress )
 {
+    USB_DEVICE_INFO *pDevice;
+
     // Find the required device
-    if (deviceAddress != usbDeviceInfo.deviceAddress)
+    if ((pDevice = _USB_FindDevice( deviceAddress )) == NULL)
     {
         return USB_UNKNOWN_DEVICE;
     }
 
-    if (usbHostState != (STATE_RUNNING | SUBSTATE_NORMAL_RUN))
+    // Only the device on the root port can be suspended, which idles the
+    // whole bus.  It cannot be done while a device behind a hub enumerates.
+    if ((pDevice != pCurrentDevice) || (pDevice != usbDeviceInfo) ||
+        (usbHostState != (STATE_RUNNING | SUBSTATE_NORMAL_RUN)))
     {
         return USB_ILLEGAL_REQUEST;
     }
@@ -901,7 +1349,7 @@ void USBHostTasks( void )
             {
                 case EVENT_TRANSFER:
                 case EVENT_BUS_ERROR:
-                    _USB_NotifyClients( usbDeviceInfo.deviceAddress, item->event, &item->TransferData, sizeof(HOST_TRANSFER_DATA) );
+                    _USB_NotifyClients( item->deviceAddress, item->event, &item->TransferData, sizeof(HOST_TRANSFER_DATA) );
                     break;
                 default:
                     break;
@@ -925,6 +1373,9 @@ void USBHostTasks( void )
         #ifdef DEBUG_MODE
             UART2PutChar('>');
         #endif
+        // Only the root port raises these.  Whatever device we were working
+        // on goes with it.
+        pCurrentDevice = usbDeviceInfo;
         usbHostState = usbOverrideHostState;
         usbOverrideHostState = NO_STATE;
     }
@@ -961,10 +1412,10 @@ void USBHostTasks( void )
 
                     // Initialize any device specific information.
                     numEnumerationTries                 = USB_NUM_ENUMERATION_TRIES;
-                    usbDeviceInfo.currentConfiguration  = 0; // Will be overwritten by config process or the user later
-                    usbDeviceInfo.attributesOTG         = 0;
-                    usbDeviceInfo.deviceAddressAndSpeed = 0;
-                    usbDeviceInfo.flags.val             = 0;
+                    pCurrentDevice->currentConfiguration  = 0; // Will be overwritten by config process or the user later
+                    pCurrentDevice->attributesOTG         = 0;
+                    pCurrentDevice->deviceAddressAndSpeed = 0;
+                    pCurrentDevice->flags.val             = 0;
 
                     // Set up the hardware.
                     U1IE                = 0;        // Clear and turn off interrupts.
@@ -977,7 +1428,7 @@ void USBHostTasks( void )
 
                     // Initialize the Buffer Descriptor Table pointer.
                     #if defined(__C30__)
-                       U1BDTP1 = (WORD)(&BDT) >> 8;
+                       U1BDTP1 = ((unsigned long)&BDT & 0xFF00) >> 8;
                     #elif defined(__PIC32MX__)
                        U1BDTP1 = ((DWORD)KVA_TO_PA(&BDT) & 0x0000FF00) >> 8;
                        U1BDTP2 = ((DWORD)KVA_TO_PA(&BDT) & 0x00FF0000) >> 16;
@@ -1102,11 +1553,11 @@ void USBHostTasks( void )
 
                             // Prepare a data buffer for us to use.  We'll make it 8 bytes for now,
                             // which is the minimum wMaxPacketSize for EP0.
-                            if (pEP0Data != NULL)
+                            if (pCurrentDevice->pEP0Data != NULL)
                             {
-                                freez( pEP0Data );
+                                freez( pCurrentDevice->pEP0Data );
                             }
-                            if ((pEP0Data = (BYTE *)malloc( 8 )) == NULL)
+                            if ((pCurrentDevice->pEP0Data = (BYTE *)USB_MALLOC( USB_HOST_POOL_BUFFER, 8 )) == NULL)
                             {
                                 #ifdef DEBUG_MODE
                                     UART2PrintString( "HOST: Error alloc-ing pEP0Data\r\n" );
@@ -1117,9 +1568,9 @@ void USBHostTasks( void )
                             }
 
                             // Initialize the USB Device information
-                            usbDeviceInfo.currentConfiguration      = 0;
-                            usbDeviceInfo.attributesOTG             = 0;
-                            usbDeviceInfo.flags.val                 = 0;
+                            pCurrentDevice->currentConfiguration      = 0;
+                            pCurrentDevice->attributesOTG             = 0;
+                            pCurrentDevice->flags.val                 = 0;
 
                             _USB_InitErrorCounters();
 
@@ -1147,8 +1598,8 @@ void USBHostTasks( void )
                                 #ifdef DEBUG_MODE
                                     UART2PrintString( "HOST: Low Speed!\r\n" );
                                 #endif
-                                usbDeviceInfo.flags.bfIsLowSpeed    = 1;
-                                usbDeviceInfo.deviceAddressAndSpeed = 0x80;
+                                pCurrentDevice->flags.bfIsLowSpeed    = 1;
+                                pCurrentDevice->deviceAddressAndSpeed = 0x80;
                                 U1ADDR                              = 0x80;
                                 U1EP0bits.LSPD                      = 1;
                             }
@@ -1156,8 +1607,11 @@ void USBHostTasks( void )
                             // Reset all ping-pong buffers if they are being used.
                             U1CONbits.PPBRST                    = 1;
                             U1CONbits.PPBRST                    = 0;
-                            usbDeviceInfo.flags.bfPingPongIn    = 0;
-                            usbDeviceInfo.flags.bfPingPongOut   = 0;
+                            usbBusInfo.flags.bfPingPongIn       = 0;
+                            usbBusInfo.flags.bfPingPongOut      = 0;
+                            #ifdef PIPELINE_BULK_PACKETS
+                                pNextBulkBDT                    = NULL;
+                            #endif
 
                             // Assert reset for 10ms.  Start a timer countdown.
                             U1CONbits.USBRST                    = 1;
@@ -1227,32 +1681,32 @@ void USBHostTasks( void )
                             #endif
 
                             // Set up and send GET DEVICE DESCRIPTOR
-                            if (pDeviceDescriptor != NULL)
+                            if (pCurrentDevice->pDeviceDescriptor != NULL)
                             {
-                                freez( pDeviceDescriptor );
+                                freez( pCurrentDevice->pDeviceDescriptor );
                             }
 
-                            pEP0Data[0] = USB_SETUP_DEVICE_TO_HOST | USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_DEVICE;
-                            pEP0Data[1] = USB_REQUEST_GET_DESCRIPTOR;
-                            pEP0Data[2] = 0; // Index
-                            pEP0Data[3] = USB_DESCRIPTOR_DEVICE; // Type
-                            pEP0Data[4] = 0;
-                            pEP0Data[5] = 0;
-                            pEP0Data[6] = 8;
-                            pEP0Data[7] = 0;
+                            pCurrentDevice->pEP0Data[0] = USB_SETUP_DEVICE_TO_HOST | USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_DEVICE;
+                            pCurrentDevice->pEP0Data[1] = USB_REQUEST_GET_DESCRIPTOR;
+                            pCurrentDevice->pEP0Data[2] = 0; // Index
+                            pCurrentDevice->pEP0Data[3] = USB_DESCRIPTOR_DEVICE; // Type
+                            pCurrentDevice->pEP0Data[4] = 0;
+                            pCurrentDevice->pEP0Data[5] = 0;
+                            pCurrentDevice->pEP0Data[6] = 8;
+                            pCurrentDevice->pEP0Data[7] = 0;
 
-                            _USB_InitControlRead( pEndpointList, pEP0Data, 8, pEP0Data, 8 );
+                            _USB_InitControlRead( pCurrentDevice->pEndpoint0, pCurrentDevice->pEP0Data, 8, pCurrentDevice->pEP0Data, 8 );
                             _USB_SetNextSubSubState();
                             break;
 
                         case SUBSUBSTATE_WAIT_FOR_GET_DEVICE_DESCRIPTOR_SIZE:
-                            if (pEndpointList->status.bfTransferComplete)
+                            if (pCurrentDevice->pEndpoint0->status.bfTransferComplete)
                             {
-                                if (pEndpointList->status.bfTransferSuccessful)
+                                if (pCurrentDevice->pEndpoint0->status.bfTransferSuccessful)
                                 {
                                     #ifndef USB_HUB_SUPPORT_INCLUDED
                                         // See if a hub is attached.  Hubs are not supported.
-                                        if (pEP0Data[4] == USB_HUB_CLASSCODE)   // bDeviceClass
+                                        if (pCurrentDevice->pEP0Data[4] == USB_HUB_CLASSCODE)   // bDeviceClass
                                         {
                                             _USB_SetErrorCode( USB_HOLDING_UNSUPPORTED_HUB );
                                             _USB_SetHoldState();
@@ -1277,7 +1731,7 @@ void USBHostTasks( void )
 
                         case SUBSUBSTATE_GET_DEVICE_DESCRIPTOR_SIZE_COMPLETE:
                             // Allocate a buffer for the entire Device Descriptor
-                            if ((pDeviceDescriptor = (BYTE *)malloc( *pEP0Data )) == NULL)
+                            if ((pCurrentDevice->pDeviceDescriptor = (BYTE *)USB_MALLOC( USB_HOST_POOL_BUFFER, *pCurrentDevice->pEP0Data )) == NULL)
                             {
                                 // We cannot continue.  Freeze until the device is removed.
                                 _USB_SetErrorCode( USB_HOLDING_OUT_OF_MEMORY );
@@ -1285,14 +1739,14 @@ void USBHostTasks( void )
                                 break;
                             }
                             // Save the descriptor size in the descriptor (bLength)
-                            *pDeviceDescriptor = *pEP0Data;
+                            *pCurrentDevice->pDeviceDescriptor = *pCurrentDevice->pEP0Data;
 
                             // Set the EP0 packet size.
-                            pEndpointList->wMaxPacketSize = ((USB_DEVICE_DESCRIPTOR *)pEP0Data)->bMaxPacketSize0;
+                            pCurrentDevice->pEndpoint0->wMaxPacketSize = ((USB_DEVICE_DESCRIPTOR *)pCurrentDevice->pEP0Data)->bMaxPacketSize0;
 
                             // Make our pEP0Data buffer the size of the max packet.
-                            freez( pEP0Data );
-                            if ((pEP0Data = (BYTE *)malloc( pEndpointList->wMaxPacketSize )) == NULL)
+                            freez( pCurrentDevice->pEP0Data );
+                            if ((pCurrentDevice->pEP0Data = (BYTE *)USB_MALLOC( USB_HOST_POOL_BUFFER, pCurrentDevice->pEndpoint0->wMaxPacketSize )) == NULL)
                             {
                                 // We cannot continue.  Freeze until the device is removed.
                                 #ifdef DEBUG_MODE
@@ -1327,22 +1781,22 @@ void USBHostTasks( void )
                                 break;
 
                             // Set up and send GET DEVICE DESCRIPTOR
-                            pEP0Data[0] = USB_SETUP_DEVICE_TO_HOST | USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_DEVICE;
-                            pEP0Data[1] = USB_REQUEST_GET_DESCRIPTOR;
-                            pEP0Data[2] = 0; // Index
-                            pEP0Data[3] = USB_DESCRIPTOR_DEVICE; // Type
-                            pEP0Data[4] = 0;
-                            pEP0Data[5] = 0;
-                            pEP0Data[6] = *pDeviceDescriptor;
-                            pEP0Data[7] = 0;
-                            _USB_InitControlRead( pEndpointList, pEP0Data, 8, pDeviceDescriptor, *pDeviceDescriptor  );
+                            pCurrentDevice->pEP0Data[0] = USB_SETUP_DEVICE_TO_HOST | USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_DEVICE;
+                            pCurrentDevice->pEP0Data[1] = USB_REQUEST_GET_DESCRIPTOR;
+                            pCurrentDevice->pEP0Data[2] = 0; // Index
+                            pCurrentDevice->pEP0Data[3] = USB_DESCRIPTOR_DEVICE; // Type
+                            pCurrentDevice->pEP0Data[4] = 0;
+                            pCurrentDevice->pEP0Data[5] = 0;
+                            pCurrentDevice->pEP0Data[6] = *pCurrentDevice->pDeviceDescriptor;
+                            pCurrentDevice->pEP0Data[7] = 0;
+                            _USB_InitControlRead( pCurrentDevice->pEndpoint0, pCurrentDevice->pEP0Data, 8, pCurrentDevice->pDeviceDescriptor, *pCurrentDevice->pDeviceDescriptor  );
                             _USB_SetNextSubSubState();
                             break;
 
                         case SUBSUBSTATE_WAIT_FOR_GET_DEVICE_DESCRIPTOR:
-                            if (pEndpointList->status.bfTransferComplete)
+                            if (pCurrentDevice->pEndpoint0->status.bfTransferComplete)
                             {
-                                if (pEndpointList->status.bfTransferSuccessful)
+                                if (pCurrentDevice->pEndpoint0->status.bfTransferSuccessful)
                                 {
                                     _USB_SetNextSubSubState();
                                 }
@@ -1401,27 +1855,27 @@ void USBHostTasks( void )
 
                             // Select an address for the device.  Store it so we can access it again
                             // easily.  We'll put the low speed indicator on later.
-                            // This has been broken out so when we allow multiple devices, we have
-                            // a single interface point to allocate a new address.
-                            usbDeviceInfo.deviceAddress = USB_SINGLE_DEVICE_ADDRESS;
+                            // Each entry of the device table owns one address, so a device
+                            // behind a hub already has this one from when its port came up.
+                            pCurrentDevice->deviceAddress = (pCurrentDevice - usbDeviceInfo) + USB_SINGLE_DEVICE_ADDRESS;
 
                             // Set up and send SET ADDRESS
-                            pEP0Data[0] = USB_SETUP_HOST_TO_DEVICE | USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_DEVICE;
-                            pEP0Data[1] = USB_REQUEST_SET_ADDRESS;
-                            pEP0Data[2] = usbDeviceInfo.deviceAddress;
-                            pEP0Data[3] = 0;
-                            pEP0Data[4] = 0;
-                            pEP0Data[5] = 0;
-                            pEP0Data[6] = 0;
-                            pEP0Data[7] = 0;
-                            _USB_InitControlWrite( pEndpointList, pEP0Data, 8, NULL, 0 );
+                            pCurrentDevice->pEP0Data[0] = USB_SETUP_HOST_TO_DEVICE | USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_DEVICE;
+                            pCurrentDevice->pEP0Data[1] = USB_REQUEST_SET_ADDRESS;
+                            pCurrentDevice->pEP0Data[2] = pCurrentDevice->deviceAddress;
+                            pCurrentDevice->pEP0Data[3] = 0;
+                            pCurrentDevice->pEP0Data[4] = 0;
+                            pCurrentDevice->pEP0Data[5] = 0;
+                            pCurrentDevice->pEP0Data[6] = 0;
+                            pCurrentDevice->pEP0Data[7] = 0;
+                            _USB_InitControlWrite( pCurrentDevice->pEndpoint0, pCurrentDevice->pEP0Data, 8, NULL, 0 );
                             _USB_SetNextSubSubState();
                             break;
 
                         case SUBSUBSTATE_WAIT_FOR_SET_DEVICE_ADDRESS:
-                            if (pEndpointList->status.bfTransferComplete)
+                            if (pCurrentDevice->pEndpoint0->status.bfTransferComplete)
                             {
-                                if (pEndpointList->status.bfTransferSuccessful)
+                                if (pCurrentDevice->pEndpoint0->status.bfTransferSuccessful)
                                 {
                                     _USB_SetNextSubSubState();
                                 }
@@ -1437,7 +1891,7 @@ void USBHostTasks( void )
 
                         case SUBSUBSTATE_SET_DEVICE_ADDRESS_COMPLETE:
                             // Set the device's address here.
-                            usbDeviceInfo.deviceAddressAndSpeed = (usbDeviceInfo.flags.bfIsLowSpeed << 7) | usbDeviceInfo.deviceAddress;
+                            pCurrentDevice->deviceAddressAndSpeed = (pCurrentDevice->flags.bfIsLowSpeed << 7) | pCurrentDevice->deviceAddress;
 
                             // Clean up and advance to the next state.
                             _USB_InitErrorCounters();
@@ -1459,13 +1913,13 @@ void USBHostTasks( void )
                     // initialize the counter.  We will request the descriptors
                     // from highest to lowest so the lowest will be first in
                     // the list.
-                    countConfigurations = ((USB_DEVICE_DESCRIPTOR *)pDeviceDescriptor)->bNumConfigurations;
-                    while (pConfigurationDescriptorList != NULL)
+                    countConfigurations = ((USB_DEVICE_DESCRIPTOR *)pCurrentDevice->pDeviceDescriptor)->bNumConfigurations;
+                    while (pCurrentDevice->pConfigurationDescriptorList != NULL)
                     {
-                        pTemp = (BYTE *)pConfigurationDescriptorList->next;
-                        free( pConfigurationDescriptorList->descriptor );
-                        free( pConfigurationDescriptorList );
-                        pConfigurationDescriptorList = (USB_CONFIGURATION *)pTemp;
+                        pTemp = (BYTE *)pCurrentDevice->pConfigurationDescriptorList->next;
+                        USB_FREE( pCurrentDevice->pConfigurationDescriptorList->descriptor );
+                        USB_FREE( pCurrentDevice->pConfigurationDescriptorList );
+                        pCurrentDevice->pConfigurationDescriptorList = (USB_CONFIGURATION *)pTemp;
                     }
                     _USB_SetNextSubState();
                     break;
@@ -1480,22 +1934,22 @@ void USBHostTasks( void )
                             #endif
 
                             // Set up and send GET CONFIGURATION (n) DESCRIPTOR with a length of 8
-                            pEP0Data[0] = USB_SETUP_DEVICE_TO_HOST | USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_DEVICE;
-                            pEP0Data[1] = USB_REQUEST_GET_DESCRIPTOR;
-                            pEP0Data[2] = countConfigurations-1;    // USB 2.0 - range is 0 - count-1
-                            pEP0Data[3] = USB_DESCRIPTOR_CONFIGURATION;
-                            pEP0Data[4] = 0;
-                            pEP0Data[5] = 0;
-                            pEP0Data[6] = 8;
-                            pEP0Data[7] = 0;
-                            _USB_InitControlRead( pEndpointList, pEP0Data, 8, pEP0Data, 8 );
+                            pCurrentDevice->pEP0Data[0] = USB_SETUP_DEVICE_TO_HOST | USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_DEVICE;
+                            pCurrentDevice->pEP0Data[1] = USB_REQUEST_GET_DESCRIPTOR;
+                            pCurrentDevice->pEP0Data[2] = countConfigurations-1;    // USB 2.0 - range is 0 - count-1
+                            pCurrentDevice->pEP0Data[3] = USB_DESCRIPTOR_CONFIGURATION;
+                            pCurrentDevice->pEP0Data[4] = 0;
+                            pCurrentDevice->pEP0Data[5] = 0;
+                            pCurrentDevice->pEP0Data[6] = 8;
+                            pCurrentDevice->pEP0Data[7] = 0;
+                            _USB_InitControlRead( pCurrentDevice->pEndpoint0, pCurrentDevice->pEP0Data, 8, pCurrentDevice->pEP0Data, 8 );
                             _USB_SetNextSubSubState();
                             break;
 
                         case SUBSUBSTATE_WAIT_FOR_GET_CONFIG_DESCRIPTOR_SIZE:
-                            if (pEndpointList->status.bfTransferComplete)
+                            if (pCurrentDevice->pEndpoint0->status.bfTransferComplete)
                             {
-                                if (pEndpointList->status.bfTransferSuccessful)
+                                if (pCurrentDevice->pEndpoint0->status.bfTransferSuccessful)
                                 {
                                     _USB_SetNextSubSubState();
                                 }
@@ -1511,7 +1965,7 @@ void USBHostTasks( void )
 
                         case SUBSUBSTATE_GET_CONFIG_DESCRIPTOR_SIZECOMPLETE:
                             // Allocate a buffer for an entry in the configuration descriptor list.
-                            if ((pTemp = (BYTE *)malloc( sizeof (USB_CONFIGURATION) )) == NULL)
+                            if ((pTemp = (BYTE *)USB_MALLOC( USB_HOST_POOL_CONFIGURATION, sizeof (USB_CONFIGURATION) )) == NULL)
                             {
                                 // We cannot continue.  Freeze until the device is removed.
                                 _USB_SetErrorCode( USB_HOLDING_OUT_OF_MEMORY );
@@ -1520,7 +1974,7 @@ void USBHostTasks( void )
                             }
 
                             // Allocate a buffer for the entire Configuration Descriptor
-                            if ((((USB_CONFIGURATION *)pTemp)->descriptor = (BYTE *)malloc( ((WORD)pEP0Data[3] << 8) + (WORD)pEP0Data[2] )) == NULL)
+                            if ((((USB_CONFIGURATION *)pTemp)->descriptor = (BYTE *)USB_MALLOC( USB_HOST_POOL_BUFFER, ((WORD)pCurrentDevice->pEP0Data[3] << 8) + (WORD)pCurrentDevice->pEP0Data[2] )) == NULL)
                             {
                                 // Not enough memory for the descriptor!
                                 freez( pTemp );
@@ -1533,14 +1987,14 @@ void USBHostTasks( void )
 
                             // Save wTotalLength
                             ((USB_CONFIGURATION_DESCRIPTOR *)((USB_CONFIGURATION *)pTemp)->descriptor)->wTotalLength =
-                                    ((WORD)pEP0Data[3] << 8) + (WORD)pEP0Data[2];
+                                    ((WORD)pCurrentDevice->pEP0Data[3] << 8) + (WORD)pCurrentDevice->pEP0Data[2];
 
                             // Put the new node at the front of the list.
-                            ((USB_CONFIGURATION *)pTemp)->next = pConfigurationDescriptorList;
-                            pConfigurationDescriptorList = (USB_CONFIGURATION *)pTemp;
+                            ((USB_CONFIGURATION *)pTemp)->next = pCurrentDevice->pConfigurationDescriptorList;
+                            pCurrentDevice->pConfigurationDescriptorList = (USB_CONFIGURATION *)pTemp;
 
                             // Save the configuration descriptor pointer and number
-                            pCurrentConfigurationDescriptor            = ((USB_CONFIGURATION *)pTemp)->descriptor;
+                            pCurrentDevice->pCurrentConfigurationDescriptor            = ((USB_CONFIGURATION *)pTemp)->descriptor;
                             ((USB_CONFIGURATION *)pTemp)->configNumber = countConfigurations;
 
                             // Clean up and advance to the next state.
@@ -1563,23 +2017,23 @@ void USBHostTasks( void )
                             #endif
 
                             // Set up and send GET CONFIGURATION (n) DESCRIPTOR.
-                            pEP0Data[0] = USB_SETUP_DEVICE_TO_HOST | USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_DEVICE;
-                            pEP0Data[1] = USB_REQUEST_GET_DESCRIPTOR;
-                            pEP0Data[2] = countConfigurations-1;
-                            pEP0Data[3] = USB_DESCRIPTOR_CONFIGURATION;
-                            pEP0Data[4] = 0;
-                            pEP0Data[5] = 0;
-                            pEP0Data[6] = pConfigurationDescriptorList->descriptor[2];    // wTotalLength
-                            pEP0Data[7] = pConfigurationDescriptorList->descriptor[3];
-                            _USB_InitControlRead( pEndpointList, pEP0Data, 8, pConfigurationDescriptorList->descriptor,
-                                    ((USB_CONFIGURATION_DESCRIPTOR *)pConfigurationDescriptorList->descriptor)->wTotalLength );
+                            pCurrentDevice->pEP0Data[0] = USB_SETUP_DEVICE_TO_HOST | USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_DEVICE;
+                            pCurrentDevice->pEP0Data[1] = USB_REQUEST_GET_DESCRIPTOR;
+                            pCurrentDevice->pEP0Data[2] = countConfigurations-1;
+                            pCurrentDevice->pEP0Data[3] = USB_DESCRIPTOR_CONFIGURATION;
+                            pCurrentDevice->pEP0Data[4] = 0;
+                            pCurrentDevice->pEP0Data[5] = 0;
+                            pCurrentDevice->pEP0Data[6] = pCurrentDevice->pConfigurationDescriptorList->descriptor[2];    // wTotalLength
+                            pCurrentDevice->pEP0Data[7] = pCurrentDevice->pConfigurationDescriptorList->descriptor[3];
+                            _USB_InitControlRead( pCurrentDevice->pEndpoint0, pCurrentDevice->pEP0Data, 8, pCurrentDevice->pConfigurationDescriptorList->descriptor,
+                                    ((USB_CONFIGURATION_DESCRIPTOR *)pCurrentDevice->pConfigurationDescriptorList->descriptor)->wTotalLength );
                             _USB_SetNextSubSubState();
                             break;
 
                         case SUBSUBSTATE_WAIT_FOR_GET_CONFIG_DESCRIPTOR:
-                            if (pEndpointList->status.bfTransferComplete)
+                            if (pCurrentDevice->pEndpoint0->status.bfTransferComplete)
                             {
-                                if (pEndpointList->status.bfTransferSuccessful)
+                                if (pCurrentDevice->pEndpoint0->status.bfTransferSuccessful)
                                 {
                                     _USB_SetNextSubSubState();
                                 }
@@ -1620,16 +2074,16 @@ void USBHostTasks( void )
                     {
                         case SUBSUBSTATE_SELECT_CONFIGURATION:
                             // Free the old configuration (if any)
-                            _USB_FreeConfigMemory();
+                            _USB_FreeConfigMemory( pCurrentDevice );
 
                             // If the configuration wasn't selected based on the VID & PID
-                            if (usbDeviceInfo.currentConfiguration == 0)
+                            if (pCurrentDevice->currentConfiguration == 0)
                             {
                                 // Search for a supported class-specific configuration.
-                                pCurrentConfigurationNode = pConfigurationDescriptorList;
+                                pCurrentConfigurationNode = pCurrentDevice->pConfigurationDescriptorList;
                                 while (pCurrentConfigurationNode)
                                 {
-                                    pCurrentConfigurationDescriptor = pCurrentConfigurationNode->descriptor;
+                                    pCurrentDevice->pCurrentConfigurationDescriptor = pCurrentConfigurationNode->descriptor;
                                     if (_USB_ParseConfigurationDescriptor())
                                     {
                                         break;
@@ -1638,7 +2092,7 @@ void USBHostTasks( void )
                                     {
                                         // Free the memory allocated and
                                         // advance to  next configuration
-                                        _USB_FreeConfigMemory();
+                                        _USB_FreeConfigMemory( pCurrentDevice );
                                         pCurrentConfigurationNode = pCurrentConfigurationNode->next;
                                     }
                                 }
@@ -1646,16 +2100,16 @@ void USBHostTasks( void )
                             else
                             {
                                 // Configuration selected by VID & PID, initialize data structures
-                                pCurrentConfigurationNode = pConfigurationDescriptorList;
-                                while (pCurrentConfigurationNode && pCurrentConfigurationNode->configNumber != usbDeviceInfo.currentConfiguration)
+                                pCurrentConfigurationNode = pCurrentDevice->pConfigurationDescriptorList;
+                                while (pCurrentConfigurationNode && pCurrentConfigurationNode->configNumber != pCurrentDevice->currentConfiguration)
                                 {
                                     pCurrentConfigurationNode = pCurrentConfigurationNode->next;
                                 }
-                                pCurrentConfigurationDescriptor = pCurrentConfigurationNode->descriptor;
+                                pCurrentDevice->pCurrentConfigurationDescriptor = pCurrentConfigurationNode->descriptor;
                                 if (!_USB_ParseConfigurationDescriptor())
                                 {
                                     // Free the memory allocated, config attempt failed.
-                                    _USB_FreeConfigMemory();
+                                    _USB_FreeConfigMemory( pCurrentDevice );
                                     pCurrentConfigurationNode = NULL;
                                 }
                             }
@@ -1680,30 +2134,30 @@ void USBHostTasks( void )
                             // If the device does not support OTG, or
                             // if the device has already been configured, bail.
                             // Otherwise, send SET FEATURE to configure it.
-                            if (!usbDeviceInfo.flags.bfConfiguredOTG)
+                            if (!pCurrentDevice->flags.bfConfiguredOTG)
                             {
                                 #ifdef DEBUG_MODE
                                     UART2PrintString( "HOST: ...OTG needs configuring.\r\n" );
                                 #endif
-                                usbDeviceInfo.flags.bfConfiguredOTG = 1;
+                                pCurrentDevice->flags.bfConfiguredOTG = 1;
 
                                 // Send SET FEATURE
-                                pEP0Data[0] = USB_SETUP_HOST_TO_DEVICE | USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_DEVICE;
-                                pEP0Data[1] = USB_REQUEST_SET_FEATURE;
-                                if (usbDeviceInfo.flags.bfAllowHNP) // Needs to be set by the user
+                                pCurrentDevice->pEP0Data[0] = USB_SETUP_HOST_TO_DEVICE | USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_DEVICE;
+                                pCurrentDevice->pEP0Data[1] = USB_REQUEST_SET_FEATURE;
+                                if (pCurrentDevice->flags.bfAllowHNP) // Needs to be set by the user
                                 {
-                                    pEP0Data[2] = OTG_FEATURE_B_HNP_ENABLE;
+                                    pCurrentDevice->pEP0Data[2] = OTG_FEATURE_B_HNP_ENABLE;
                                 }
                                 else
                                 {
-                                    pEP0Data[2] = OTG_FEATURE_A_HNP_SUPPORT;
+                                    pCurrentDevice->pEP0Data[2] = OTG_FEATURE_A_HNP_SUPPORT;
                                 }
-                                pEP0Data[3] = 0;
-                                pEP0Data[4] = 0;
-                                pEP0Data[5] = 0;
-                                pEP0Data[6] = 0;
-                                pEP0Data[7] = 0;
-                                _USB_InitControlWrite( pEndpointList, pEP0Data, 8, NULL, 0 );
+                                pCurrentDevice->pEP0Data[3] = 0;
+                                pCurrentDevice->pEP0Data[4] = 0;
+                                pCurrentDevice->pEP0Data[5] = 0;
+                                pCurrentDevice->pEP0Data[6] = 0;
+                                pCurrentDevice->pEP0Data[7] = 0;
+                                _USB_InitControlWrite( pCurrentDevice->pEndpoint0, pCurrentDevice->pEP0Data, 8, NULL, 0 );
                                 _USB_SetNextSubSubState();
                             }
                             else
@@ -1716,9 +2170,9 @@ void USBHostTasks( void )
                             break;
 
                         case SUBSUBSTATE_WAIT_FOR_SET_OTG_DONE:
-                            if (pEndpointList->status.bfTransferComplete)
+                            if (pCurrentDevice->pEndpoint0->status.bfTransferComplete)
                             {
-                                if (pEndpointList->status.bfTransferSuccessful)
+                                if (pCurrentDevice->pEndpoint0->status.bfTransferSuccessful)
                                 {
                                     _USB_SetNextSubSubState();
                                 }
@@ -1753,22 +2207,22 @@ void USBHostTasks( void )
                             #endif
 
                             // Set up and send SET CONFIGURATION.
-                            pEP0Data[0] = USB_SETUP_HOST_TO_DEVICE | USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_DEVICE;
-                            pEP0Data[1] = USB_REQUEST_SET_CONFIGURATION;
-                            pEP0Data[2] = usbDeviceInfo.currentConfiguration;
-                            pEP0Data[3] = 0;
-                            pEP0Data[4] = 0;
-                            pEP0Data[5] = 0;
-                            pEP0Data[6] = 0;
-                            pEP0Data[7] = 0;
-                            _USB_InitControlWrite( pEndpointList, pEP0Data, 8, NULL, 0 );
+                            pCurrentDevice->pEP0Data[0] = USB_SETUP_HOST_TO_DEVICE | USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_DEVICE;
+                            pCurrentDevice->pEP0Data[1] = USB_REQUEST_SET_CONFIGURATION;
+                            pCurrentDevice->pEP0Data[2] = pCurrentDevice->currentConfiguration;
+                            pCurrentDevice->pEP0Data[3] = 0;
+                            pCurrentDevice->pEP0Data[4] = 0;
+                            pCurrentDevice->pEP0Data[5] = 0;
+                            pCurrentDevice->pEP0Data[6] = 0;
+                            pCurrentDevice->pEP0Data[7] = 0;
+                            _USB_InitControlWrite( pCurrentDevice->pEndpoint0, pCurrentDevice->pEP0Data, 8, NULL, 0 );
                             _USB_SetNextSubSubState();
                             break;
 
                         case SUBSUBSTATE_WAIT_FOR_SET_CONFIGURATION:
-                            if (pEndpointList->status.bfTransferComplete)
+                            if (pCurrentDevice->pEndpoint0->status.bfTransferComplete)
                             {
-                                if (pEndpointList->status.bfTransferSuccessful)
+                                if (pCurrentDevice->pEndpoint0->status.bfTransferSuccessful)
                                 {
                                     _USB_SetNextSubSubState();
                                 }
@@ -1791,10 +2245,10 @@ void USBHostTasks( void )
                         case SUBSUBSTATE_INIT_CLIENT_DRIVERS:
                             _USB_SetNextState();
                             // Initialize client driver(s) for this configuration.
-                            if (usbDeviceInfo.flags.bfUseDeviceClientDriver)
+                            if (pCurrentDevice->flags.bfUseDeviceClientDriver)
                             {
-                                temp = usbDeviceInfo.deviceClientDriver;
-                                if (!usbClientDrvTable[temp].Initialize(usbDeviceInfo.deviceAddress, usbClientDrvTable[temp].flags))
+                                temp = pCurrentDevice->deviceClientDriver;
+                                if (!usbClientDrvTable[temp].Initialize(pCurrentDevice->deviceAddress, usbClientDrvTable[temp].flags))
                                 {
                                     _USB_SetErrorCode( USB_HOLDING_CLIENT_INIT_ERROR );
                                     _USB_SetHoldState();
@@ -1802,11 +2256,11 @@ void USBHostTasks( void )
                             }
                             else
                             {
-                                pCurrentInterface = pInterfaceList;
+                                pCurrentInterface = pCurrentDevice->pInterfaceList;
                                 while (pCurrentInterface)
                                 {
                                     temp = pCurrentInterface->clientDriver;
-                                    if (!usbClientDrvTable[temp].Initialize(usbDeviceInfo.deviceAddress, usbClientDrvTable[temp].flags))
+                                    if (!usbClientDrvTable[temp].Initialize(pCurrentDevice->deviceAddress, usbClientDrvTable[temp].flags))
                                     {
                                         _USB_SetErrorCode( USB_HOLDING_CLIENT_INIT_ERROR );
                                         _USB_SetHoldState();
@@ -1886,20 +2340,25 @@ void USBHostTasks( void )
                 case SUBSTATE_HOLD_INIT:
                     // We're here because we cannot communicate with the current device
                     // that is plugged in.  Turn off SOF's and all interrupts except
-                    // the DETACH interrupt.
+                    // the DETACH interrupt.  A device behind a hub only holds itself;
+                    // the rest of the bus keeps running, and its hub driver disables
+                    // the port.
                     #ifdef DEBUG_MODE
                         UART2PrintString( "HOST: Holding.\r\n" );
                     #endif
-                    U1CON               = USB_HOST_MODE_ENABLE | USB_SOF_DISABLE;                       // Turn of SOF's to cut down noise
-                    U1IE                = 0;
-                    U1IR                = 0xFF;
-                    U1OTGIE             = 0;
-                    U1OTGIR             = 0xFF;
-                    U1EIE               = 0;
-                    U1EIR               = 0xFF;
-                    U1IEbits.DETACHIE   = 1;
+                    if (pCurrentDevice == usbDeviceInfo)
+                    {
+                        U1CON               = USB_HOST_MODE_ENABLE | USB_SOF_DISABLE;                       // Turn of SOF's to cut down noise
+                        U1IE                = 0;
+                        U1IR                = 0xFF;
+                        U1OTGIE             = 0;
+                        U1OTGIR             = 0xFF;
+                        U1EIE               = 0;
+                        U1EIR               = 0xFF;
+                        U1IEbits.DETACHIE   = 1;
+                    }
 
-                    switch (usbDeviceInfo.errorCode )
+                    switch (pCurrentDevice->errorCode )
                     {
                         case USB_HOLDING_UNSUPPORTED_HUB:
                             temp = EVENT_HUB_ATTACH;
@@ -1927,7 +2386,7 @@ void USBHostTasks( void )
                     }
 
                     // Report the problem to the application.
-                    USB_HOST_APP_EVENT_HANDLER( usbDeviceInfo.deviceAddress, temp, &usbDeviceInfo.currentConfigurationPower , 1 );
+                    USB_HOST_APP_EVENT_HANDLER( pCurrentDevice->deviceAddress, temp, &pCurrentDevice->currentConfigurationPower , 1 );
 
                     _USB_SetNextSubState();
                     break;
@@ -1942,6 +2401,9 @@ void USBHostTasks( void )
             break;
     }
 
+    #ifdef USB_HUB_SUPPORT_INCLUDED
+        _USB_SelectNextDevice();
+    #endif
 }
 
 /****************************************************************************
@@ -1973,10 +2435,11 @@ void USBHostTasks( void )
 
 void USBHostTerminateTransfer( BYTE deviceAddress, BYTE endpoint )
 {
+    USB_DEVICE_INFO   *pDevice;
     USB_ENDPOINT_INFO *ep;
 
     // Find the required device
-    if (deviceAddress != usbDeviceInfo.deviceAddress)
+    if ((pDevice = _USB_FindDevice( deviceAddress )) == NULL)
     {
         return; // USB_UNKNOWN_DEVICE;
     }
@@ -1984,7 +2447,7 @@ void USBHostTerminateTransfer( BYTE deviceAddress, BYTE endpoint )
     ep = pEndpointList;
     while (ep != NULL)
     {
-        if (ep->bEndpointAddress == endpoint)
+        if ((ep->pDevice == pDevice) && (ep->bEndpointAddress == endpoint))
         {
             ep->status.bfUserAbort          = 1;
             ep->status.bfTransferComplete   = 1;
@@ -2043,11 +2506,12 @@ void USBHostTerminateTransfer( BYTE deviceAddress, BYTE endpoint )
 BOOL USBHostTransferIsComplete( BYTE deviceAddress, BYTE endpoint, BYTE *errorCode,
             DWORD *byteCount )
 {
+    USB_DEVICE_INFO     *pDevice;
     USB_ENDPOINT_INFO   *ep;
     BYTE                transferComplete;
 
     // Find the required device
-    if (deviceAddress != usbDeviceInfo.deviceAddress)
+    if ((pDevice = _USB_FindDevice( deviceAddress )) == NULL)
     {
         *errorCode = USB_UNKNOWN_DEVICE;
         *byteCount = 0;
@@ -2057,7 +2521,7 @@ BOOL USBHostTransferIsComplete( BYTE deviceAddress, BYTE endpoint, BYTE *errorCo
     ep = pEndpointList;
     while (ep != NULL)
     {
-        if (ep->bEndpointAddress == endpoint)
+        if ((ep->pDevice == pDevice) && (ep->bEndpointAddress == endpoint))
         {
             // bfTransferComplete, the status flags, and byte count can be
             // changed in an interrupt service routine.  Therefore, we'll
@@ -2200,16 +2664,17 @@ BYTE  USBHostVbusEvent(USB_EVENT vbusEvent, BYTE hubAddress, BYTE portNumber)
 
 BYTE USBHostWrite( BYTE deviceAddress, BYTE endpoint, BYTE *data, DWORD size )
 {
+    USB_DEVICE_INFO   *pDevice;
     USB_ENDPOINT_INFO *ep;
 
     // Find the required device
-    if (deviceAddress != usbDeviceInfo.deviceAddress)
+    if ((pDevice = _USB_FindDevice( deviceAddress )) == NULL)
     {
         return USB_UNKNOWN_DEVICE;
     }
 
     // If we are not in a normal user running state, we cannot do this.
-    if ((usbHostState & STATE_MASK) != STATE_RUNNING)
+    if ((_USB_GetDeviceState( pDevice ) & STATE_MASK) != STATE_RUNNING)
     {
         return USB_INVALID_STATE;
     }
@@ -2217,7 +2682,7 @@ BYTE USBHostWrite( BYTE deviceAddress, BYTE endpoint, BYTE *data, DWORD size )
     ep = pEndpointList;
     while (ep != NULL)
     {
-        if (ep->bEndpointAddress == endpoint)
+        if ((ep->pDevice == pDevice) && (ep->bEndpointAddress == endpoint))
         {
             if (ep->bmAttributes.bfTransferType == USB_TRANSFER_TYPE_CONTROL)
             {
@@ -2252,6 +2717,12 @@ BYTE USBHostWrite( BYTE deviceAddress, BYTE endpoint, BYTE *data, DWORD size )
             }
 
             _USB_InitWrite( ep, data, size );
+            #ifdef START_BULK_TRANSFERS_IN_FRAME
+                if (ep->bmAttributes.bfTransferType == USB_TRANSFER_TYPE_BULK)
+                {
+                    _USB_StartBulkInFrame();
+                }
+            #endif
 
             return USB_SUCCESS;
         }
@@ -2269,22 +2740,14 @@ BYTE USBHostWrite( BYTE deviceAddress, BYTE endpoint, BYTE *data, DWORD size )
 
 /****************************************************************************
   Function:
-    void _USB_CheckCommandAndEnumerationAttempts( void )
-
-  Summary:
-    This function is called when we've received a STALL or a NAK when trying
-    to enumerate.
+    void _USB_CancelNextBulkPacket( void )
 
   Description:
-    This function is called when we've received a STALL or a NAK when trying
-    to enumerate.  We allow so many attempts at each command, and so many
-    attempts at enumeration.  If the command fails and there are more command
-    attempts, we try the command again.  If the command fails and there are
-    more enumeration attempts, we reset and try to enumerate again.
-    Otherwise, we go to the holding state.
+    This function takes back the Buffer Descriptor that holds the next packet
+    of the current bulk transfer, if one has been set up.
 
   Precondition:
-    usbHostState != STATE_RUNNING
+    None
 
   Parameters:
     None - None
@@ -2293,19 +2756,70 @@ BYTE USBHostWrite( BYTE deviceAddress, BYTE endpoint, BYTE *data, DWORD size )
     None
 
   Remarks:
-    None
+    The module takes the Buffer Descriptors of each direction in ping-pong
+    order, so the ping-pong status is stepped back as well.  The next token
+    in that direction will then use this Buffer Descriptor.
   ***************************************************************************/
 
-void _USB_CheckCommandAndEnumerationAttempts( void )
+#ifdef PIPELINE_BULK_PACKETS
+void _USB_CancelNextBulkPacket( void )
 {
-    #ifdef DEBUG_MODE
-        UART2PutChar( '=' );
-    #endif
+    if (pNextBulkBDT != NULL)
+    {
+        pNextBulkBDT->STAT.Val = 0;
+        if ((pNextBulkBDT == BDT_IN) || (pNextBulkBDT == BDT_IN_ODD))
+        {
+            usbBusInfo.flags.bfPingPongIn = ~usbBusInfo.flags.bfPingPongIn;
+        }
+        else
+        {
+            usbBusInfo.flags.bfPingPongOut = ~usbBusInfo.flags.bfPingPongOut;
+        }
+        pNextBulkBDT = NULL;
+    }
+}
+#endif
+
+
+/****************************************************************************
+  Function:
+    void _USB_CheckCommandAndEnumerationAttempts( void )
+
+  Summary:
+    This function is called when we've received a STALL or a NAK when trying
+    to enumerate.
+
+  Description:
+    This function is called when we've received a STALL or a NAK when trying
+    to enumerate.  We allow so many attempts at each command, and so many
+    attempts at enumeration.  If the command fails and there are more command
+    attempts, we try the command again.  If the command fails and there are
+    more enumeration attempts, we reset and try to enumerate again.
+    Otherwise, we go to the holding state.
+
+  Precondition:
+    usbHostState != STATE_RUNNING
+
+  Parameters:
+    None - None
+
+  Returns:
+    None
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+void _USB_CheckCommandAndEnumerationAttempts( void )
+{
+    #ifdef DEBUG_MODE
+        UART2PutChar( '=' );
+    #endif
 
     // Clear the error and stall flags.  A stall here does not require
     // host intervention to clear.
-    pCurrentEndpoint->status.bfError    = 0;
-    pCurrentEndpoint->status.bfStalled  = 0;
+    pCurrentDevice->pEndpoint0->status.bfError    = 0;
+    pCurrentDevice->pEndpoint0->status.bfStalled  = 0;
 
     numCommandTries --;
     if (numCommandTries != 0)
@@ -2318,14 +2832,15 @@ void _USB_CheckCommandAndEnumerationAttempts( void )
         // This command has timed out.
         // We are enumerating.  See if we can try to enumerate again.
         numEnumerationTries --;
-        if (numEnumerationTries != 0)
+        if ((numEnumerationTries != 0) && (pCurrentDevice == usbDeviceInfo))
         {
             // We still have retries left to try to enumerate.  Reset and try again.
             usbHostState = STATE_ATTACHED | SUBSTATE_RESET_DEVICE;
         }
         else
         {
-            // Give up.  The device is not responding properly.
+            // Give up.  The device is not responding properly.  A device behind
+            // a hub cannot be reset from here, so it gives up at once.
             _USB_SetErrorCode( USB_CANNOT_ENUMERATE );
             _USB_SetHoldState();
         }
@@ -2391,6 +2906,43 @@ BOOL _USB_FindClassDriver( BYTE bClass, BYTE bSubClass, BYTE bProtocol, BYTE *pb
 } // _USB_FindClassDriver
 
 
+/****************************************************************************
+  Function:
+    USB_DEVICE_INFO * _USB_FindDevice( BYTE deviceAddress )
+
+  Description:
+    This function finds the entry of the device table for a device address.
+
+  Precondition:
+    None
+
+  Parameters:
+    BYTE deviceAddress  - Device address
+
+  Returns:
+    USB_DEVICE_INFO *   - Pointer to the device's entry, or NULL if no
+                            device has that address.
+
+  Remarks:
+    The device on the root port is found first, so address 0 finds it
+    until it has been given its address.
+  ***************************************************************************/
+
+USB_DEVICE_INFO * _USB_FindDevice( BYTE deviceAddress )
+{
+    BYTE    i;
+
+    for (i = 0; i < USB_MAX_DEVICES; i++)
+    {
+        if ((usbDeviceInfo[i].pEndpoint0 != NULL) && (usbDeviceInfo[i].deviceAddress == deviceAddress))
+        {
+            return &usbDeviceInfo[i];
+        }
+    }
+    return NULL;
+}
+
+
 /****************************************************************************
   Function:
     BOOL _USB_FindDeviceLevelClientDriver( void )
@@ -2419,11 +2971,11 @@ BOOL _USB_FindClassDriver( BYTE bClass, BYTE bSubClass, BYTE bProtocol, BYTE *pb
 BOOL _USB_FindDeviceLevelClientDriver( void )
 {
     WORD                   i;
-    USB_DEVICE_DESCRIPTOR *pDesc = (USB_DEVICE_DESCRIPTOR *)pDeviceDescriptor;
+    USB_DEVICE_DESCRIPTOR *pDesc = (USB_DEVICE_DESCRIPTOR *)pCurrentDevice->pDeviceDescriptor;
 
     // Scan TPL
     i = 0;
-    usbDeviceInfo.flags.bfUseDeviceClientDriver = 0;
+    pCurrentDevice->flags.bfUseDeviceClientDriver = 0;
     while (i < NUM_TPL_ENTRIES)
     {
         if (usbTPL[i].flags.bfIsClassDriver)
@@ -2433,7 +2985,7 @@ BOOL _USB_FindDeviceLevelClientDriver( void )
                 (usbTPL[i].device.bSubClass == pDesc->bDeviceSubClass) &&
                 (usbTPL[i].device.bProtocol == pDesc->bDeviceProtocol)   )
             {
-                usbDeviceInfo.flags.bfUseDeviceClientDriver = 1;
+                pCurrentDevice->flags.bfUseDeviceClientDriver = 1;
             }
         }
         else
@@ -2442,19 +2994,19 @@ BOOL _USB_FindDeviceLevelClientDriver( void )
             if ((usbTPL[i].device.idVendor  == pDesc->idVendor ) &&
                 (usbTPL[i].device.idProduct == pDesc->idProduct)   )
             {
-                usbDeviceInfo.flags.bfUseDeviceClientDriver = 1;
+                pCurrentDevice->flags.bfUseDeviceClientDriver = 1;
             }
         }
 
-        if (usbDeviceInfo.flags.bfUseDeviceClientDriver)
+        if (pCurrentDevice->flags.bfUseDeviceClientDriver)
         {
             // Save client driver info
-            usbDeviceInfo.deviceClientDriver = usbTPL[i].ClientDriver;
+            pCurrentDevice->deviceClientDriver = usbTPL[i].ClientDriver;
 
             // Select configuration if it is given in the TPL
             if (usbTPL[i].flags.bfSetConfiguration)
             {
-                usbDeviceInfo.currentConfiguration = usbTPL[i].bConfiguration;
+                pCurrentDevice->currentConfiguration = usbTPL[i].bConfiguration;
             }
 
             return TRUE;
@@ -2491,7 +3043,7 @@ BOOL _USB_FindDeviceLevelClientDriver( void )
 
 USB_INTERFACE_INFO * _USB_FindInterface ( BYTE bInterface, BYTE bAltSetting )
 {
-    USB_INTERFACE_INFO *pCurIntf = pInterfaceList;
+    USB_INTERFACE_INFO *pCurIntf = pCurrentDevice->pInterfaceList;
 
     while (pCurIntf)
     {
@@ -2542,10 +3094,16 @@ void _USB_FindNextToken( void )
     USB_ENDPOINT_INFO   *ep;
     BOOL                illegalState = FALSE;
 
+    // The pinned bulk transfer has stopped, or the frame is over.  Any
+    // endpoint may be next, so take back its next packet.
+    #ifdef PIPELINE_BULK_PACKETS
+        _USB_CancelNextBulkPacket();
+    #endif
+
     // If the device is suspended or resuming, do not send any tokens.  We will
     // send the next token on an SOF interrupt after the resume recovery time
     // has expired.
-    if ((usbHostState & (SUBSTATE_MASK | SUBSUBSTATE_MASK)) == (STATE_RUNNING | SUBSTATE_SUSPEND_AND_RESUME))
+    if ((usbHostState & (STATE_MASK | SUBSTATE_MASK)) == (STATE_RUNNING | SUBSTATE_SUSPEND_AND_RESUME))
     {
         return;
     }
@@ -2606,6 +3164,7 @@ void _USB_FindNextToken( void )
 
                                         data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                         data->event = EVENT_TRANSFER;
+                                        data->deviceAddress                 = ep->pDevice->deviceAddress;
                                         data->TransferData.dataCount        = ep->dataCount;
                                         data->TransferData.pUserData        = ep->pUserData;
                                         data->TransferData.bEndpointAddress = ep->bEndpointAddress;
@@ -2629,6 +3188,7 @@ void _USB_FindNextToken( void )
 
                                         data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                         data->event = EVENT_BUS_ERROR;
+                                        data->deviceAddress                 = ep->pDevice->deviceAddress;
                                         data->TransferData.dataCount        = 0;
                                         data->TransferData.pUserData        = NULL;
                                         data->TransferData.bEndpointAddress = ep->bEndpointAddress;
@@ -2691,6 +3251,7 @@ void _USB_FindNextToken( void )
 
                                         data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                         data->event = EVENT_TRANSFER;
+                                        data->deviceAddress                 = ep->pDevice->deviceAddress;
                                         data->TransferData.dataCount        = ep->dataCount;
                                         data->TransferData.pUserData        = ep->pUserData;
                                         data->TransferData.bEndpointAddress = ep->bEndpointAddress;
@@ -2714,6 +3275,7 @@ void _USB_FindNextToken( void )
 
                                         data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                         data->event = EVENT_BUS_ERROR;
+                                        data->deviceAddress                 = ep->pDevice->deviceAddress;
                                         data->TransferData.dataCount        = 0;
                                         data->TransferData.pUserData        = NULL;
                                         data->TransferData.bEndpointAddress = ep->bEndpointAddress;
@@ -2776,6 +3338,7 @@ void _USB_FindNextToken( void )
 
                                         data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                         data->event = EVENT_TRANSFER;
+                                        data->deviceAddress                 = ep->pDevice->deviceAddress;
                                         data->TransferData.dataCount        = ep->dataCount;
                                         data->TransferData.pUserData        = ep->pUserData;
                                         data->TransferData.bEndpointAddress = ep->bEndpointAddress;
@@ -2799,6 +3362,7 @@ void _USB_FindNextToken( void )
 
                                         data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                         data->event = EVENT_BUS_ERROR;
+                                        data->deviceAddress                 = ep->pDevice->deviceAddress;
                                         data->TransferData.dataCount        = 0;
                                         data->TransferData.pUserData        = NULL;
                                         data->TransferData.bEndpointAddress = ep->bEndpointAddress;
@@ -2899,6 +3463,7 @@ void _USB_FindNextToken( void )
 
                                                 data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                                 data->event = EVENT_TRANSFER;
+                                                data->deviceAddress                 = ep->pDevice->deviceAddress;
                                                 data->TransferData.dataCount        = ep->dataCount;
                                                 data->TransferData.pUserData        = ep->pUserData;
                                                 data->TransferData.bEndpointAddress = ep->bEndpointAddress;
@@ -2922,6 +3487,7 @@ void _USB_FindNextToken( void )
 
                                                 data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                                 data->event = EVENT_BUS_ERROR;
+                                                data->deviceAddress                 = ep->pDevice->deviceAddress;
                                                 data->TransferData.dataCount        = 0;
                                                 data->TransferData.pUserData        = NULL;
                                                 data->TransferData.bEndpointAddress = ep->bEndpointAddress;
@@ -2967,6 +3533,7 @@ void _USB_FindNextToken( void )
 
                                                 data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                                 data->event = EVENT_TRANSFER;
+                                                data->deviceAddress                 = ep->pDevice->deviceAddress;
                                                 data->TransferData.dataCount        = ep->dataCount;
                                                 data->TransferData.pUserData        = ep->pUserData;
                                                 data->TransferData.bEndpointAddress = ep->bEndpointAddress;
@@ -2990,6 +3557,7 @@ void _USB_FindNextToken( void )
 
                                                 data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                                 data->event = EVENT_BUS_ERROR;
+                                                data->deviceAddress                 = ep->pDevice->deviceAddress;
                                                 data->TransferData.dataCount        = 0;
                                                 data->TransferData.pUserData        = NULL;
                                                 data->TransferData.bEndpointAddress = ep->bEndpointAddress;
@@ -3083,6 +3651,7 @@ void _USB_FindNextToken( void )
 
                                                 data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                                 data->event = EVENT_TRANSFER;
+                                                data->deviceAddress                 = ep->pDevice->deviceAddress;
                                                 data->TransferData.dataCount        = ep->dataCount;
                                                 data->TransferData.pUserData        = ep->pUserData;
                                                 data->TransferData.bEndpointAddress = ep->bEndpointAddress;
@@ -3106,6 +3675,7 @@ void _USB_FindNextToken( void )
 
                                                 data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                                 data->event = EVENT_BUS_ERROR;
+                                                data->deviceAddress                 = ep->pDevice->deviceAddress;
                                                 data->TransferData.dataCount        = 0;
                                                 data->TransferData.pUserData        = NULL;
                                                 data->TransferData.bEndpointAddress = ep->bEndpointAddress;
@@ -3150,6 +3720,7 @@ void _USB_FindNextToken( void )
 
                                                 data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                                 data->event = EVENT_TRANSFER;
+                                                data->deviceAddress                 = ep->pDevice->deviceAddress;
                                                 data->TransferData.dataCount        = ep->dataCount;
                                                 data->TransferData.pUserData        = ep->pUserData;
                                                 data->TransferData.bEndpointAddress = ep->bEndpointAddress;
@@ -3173,6 +3744,7 @@ void _USB_FindNextToken( void )
 
                                                 data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                                 data->event = EVENT_BUS_ERROR;
+                                                data->deviceAddress                 = ep->pDevice->deviceAddress;
                                                 data->TransferData.dataCount        = 0;
                                                 data->TransferData.pUserData        = NULL;
                                                 data->TransferData.bEndpointAddress = ep->bEndpointAddress;
@@ -3257,6 +3829,9 @@ TryBulk:
                                     case TSUBSTATE_BULK_READ_DATA:
                                         _USB_SetBDT( USB_TOKEN_IN );
                                         _USB_SendToken( ep->bEndpointAddress, USB_TOKEN_IN );
+                                        #ifdef PIPELINE_BULK_PACKETS
+                                            _USB_PrepareNextBulkPacket();
+                                        #endif
                                         return;
                                         break;
 
@@ -3270,6 +3845,7 @@ TryBulk:
 
                                                 data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                                 data->event = EVENT_TRANSFER;
+                                                data->deviceAddress                 = ep->pDevice->deviceAddress;
                                                 data->TransferData.dataCount        = ep->dataCount;
                                                 data->TransferData.pUserData        = ep->pUserData;
                                                 data->TransferData.bEndpointAddress = ep->bEndpointAddress;
@@ -3293,6 +3869,7 @@ TryBulk:
 
                                                 data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                                 data->event = EVENT_BUS_ERROR;
+                                                data->deviceAddress                 = ep->pDevice->deviceAddress;
                                                 data->TransferData.dataCount        = 0;
                                                 data->TransferData.pUserData        = NULL;
                                                 data->TransferData.bEndpointAddress = ep->bEndpointAddress;
@@ -3318,6 +3895,9 @@ TryBulk:
                                     case TSUBSTATE_BULK_WRITE_DATA:
                                         _USB_SetBDT( USB_TOKEN_OUT );
                                         _USB_SendToken( ep->bEndpointAddress, USB_TOKEN_OUT );
+                                        #ifdef PIPELINE_BULK_PACKETS
+                                            _USB_PrepareNextBulkPacket();
+                                        #endif
                                         return;
                                         break;
 
@@ -3331,6 +3911,7 @@ TryBulk:
 
                                                 data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                                 data->event = EVENT_TRANSFER;
+                                                data->deviceAddress                 = ep->pDevice->deviceAddress;
                                                 data->TransferData.dataCount        = ep->dataCount;
                                                 data->TransferData.pUserData        = ep->pUserData;
                                                 data->TransferData.bEndpointAddress = ep->bEndpointAddress;
@@ -3354,6 +3935,7 @@ TryBulk:
 
                                                 data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                                 data->event = EVENT_BUS_ERROR;
+                                                data->deviceAddress                 = ep->pDevice->deviceAddress;
                                                 data->TransferData.dataCount        = 0;
                                                 data->TransferData.pUserData        = NULL;
                                                 data->TransferData.bEndpointAddress = ep->bEndpointAddress;
@@ -3413,7 +3995,7 @@ TryBulk:
 
 /****************************************************************************
   Function:
-    void _USB_FreeConfigMemory( void )
+    void _USB_FreeConfigMemory( USB_DEVICE_INFO *pDevice )
 
   Description:
     This function frees the interface and endpoint lists associated
@@ -3423,54 +4005,145 @@ TryBulk:
     None
 
   Parameters:
-    None - None
+    USB_DEVICE_INFO *pDevice    - Device whose configuration is freed
 
   Returns:
     None
 
   Remarks:
-    The EP 0 block is retained.
+    The EP 0 block is retained.  The endpoints of other devices stay in the
+    list and keep running, so the interrupt handler is kept out while the
+    device's nodes are taken off.
   ***************************************************************************/
 
-void _USB_FreeConfigMemory( void )
+void _USB_FreeConfigMemory( USB_DEVICE_INFO *pDevice )
 {
-    BYTE    *pTemp;
+    USB_ENDPOINT_INFO   *ep;
+    BYTE                *pTemp;
+    #if defined( __C30__ )
+        WORD            interrupt_mask;
+    #elif defined( __PIC32MX__ )
+        UINT32          interrupt_mask;
+    #else
+        #error Cannot save interrupt status
+    #endif
 
-    while (pInterfaceList != NULL)
+    while (pDevice->pInterfaceList != NULL)
     {
-        pTemp = (BYTE *)pInterfaceList->next;
-        free(pInterfaceList);
-        pInterfaceList = (USB_INTERFACE_INFO *)pTemp;
+        pTemp = (BYTE *)pDevice->pInterfaceList->next;
+        USB_FREE( pDevice->pInterfaceList );
+        pDevice->pInterfaceList = (USB_INTERFACE_INFO *)pTemp;
     }
 
-    if (pEndpointList != NULL) // Should not be null!
+    // Guard against USB interrupts
+    interrupt_mask = U1IE;
+    U1IE = 0;
+
+    ep = pDevice->pEndpoint0;
+    if (ep != NULL) // Should not be null!
     {
-        while (pEndpointList->next != NULL) // Leave EP0 intact
+        // The device's endpoints follow its EP0.  Leave EP0 intact.
+        while (ep->next != NULL)
         {
-            pTemp = (BYTE *)pEndpointList->next->next;
-            free( pEndpointList->next );
-            pEndpointList->next = (USB_ENDPOINT_INFO *)pTemp;
+            if (ep->next->pDevice == pDevice)
+            {
+                pTemp = (BYTE *)ep->next;
+                ep->next = ep->next->next;
+                if (pCurrentEndpoint == (USB_ENDPOINT_INFO *)pTemp)
+                {
+                    pCurrentEndpoint = pEndpointList;
+                }
+                USB_FREE( pTemp );
+            }
+            else
+            {
+                ep = ep->next;
+            }
         }
-        pEndpointList->next = NULL;
     }
-    pCurrentEndpoint = pEndpointList;
+
+    // Re-enable USB interrupts
+    U1IE = interrupt_mask;
 
 } // _USB_FreeConfigMemory
 
 
+#ifdef USB_HUB_SUPPORT_INCLUDED
+/****************************************************************************
+  Function:
+    void _USB_FreeDevice( USB_DEVICE_INFO *pDevice )
+
+  Description:
+    This function frees all the memory of a device behind a hub, including
+    its EP0 node, and frees its entry in the device table.
+
+  Precondition:
+    No token of the device is on the bus.
+
+  Parameters:
+    USB_DEVICE_INFO *pDevice    - Device to free
+
+  Returns:
+    None
+
+  Remarks:
+    The device on the root port owns the head of the endpoint list, which is
+    never freed.
+  ***************************************************************************/
+
+void _USB_FreeDevice( USB_DEVICE_INFO *pDevice )
+{
+    USB_ENDPOINT_INFO   *ep;
+    #if defined( __C30__ )
+        WORD            interrupt_mask;
+    #elif defined( __PIC32MX__ )
+        UINT32          interrupt_mask;
+    #else
+        #error Cannot save interrupt status
+    #endif
+
+    _USB_FreeMemory( pDevice );
+
+    // Guard against USB interrupts
+    interrupt_mask = U1IE;
+    U1IE = 0;
+
+    ep = pEndpointList;
+    while ((ep->next != NULL) && (ep->next != pDevice->pEndpoint0))
+    {
+        ep = ep->next;
+    }
+    ep->next = pDevice->pEndpoint0->next;
+    if (pCurrentEndpoint == pDevice->pEndpoint0)
+    {
+        pCurrentEndpoint = pEndpointList;
+    }
+
+    // Re-enable USB interrupts
+    U1IE = interrupt_mask;
+
+    freez( pDevice->pEndpoint0 );
+    pDevice->deviceAddress          = 0;
+    pDevice->deviceAddressAndSpeed  = 0;
+    pDevice->hostState              = STATE_DETACHED;
+    pDevice->flags.val              = 0;
+}
+#endif
+
+
 /****************************************************************************
   Function:
-    void _USB_FreeMemory( void )
+    void _USB_FreeMemory( USB_DEVICE_INFO *pDevice )
 
   Description:
-    This function frees all memory that can be freed.  Only the EP0
-    information block is retained.
+    This function frees all memory of a device that can be freed.  Only the
+    EP0 information block is retained.
 
   Precondition:
     None
 
   Parameters:
-    None - None
+    USB_DEVICE_INFO *pDevice    - Device whose memory is freed
 
   Returns:
     None
@@ -3479,27 +4152,28 @@ void _USB_FreeConfigMemory( void )
     None
   ***************************************************************************/
 
-void _USB_FreeMemory( void )
+void _USB_FreeMemory( USB_DEVICE_INFO *pDevice )
 {
     BYTE    *pTemp;
 
-    while (pConfigurationDescriptorList != NULL)
+    while (pDevice->pConfigurationDescriptorList != NULL)
     {
-        pTemp = (BYTE *)pConfigurationDescriptorList->next;
-        free( pConfigurationDescriptorList->descriptor );
-        free( pConfigurationDescriptorList );
-        pConfigurationDescriptorList = (USB_CONFIGURATION *)pTemp;
+        pTemp = (BYTE *)pDevice->pConfigurationDescriptorList->next;
+        USB_FREE( pDevice->pConfigurationDescriptorList->descriptor );
+        USB_FREE( pDevice->pConfigurationDescriptorList );
+        pDevice->pConfigurationDescriptorList = (USB_CONFIGURATION *)pTemp;
     }
-    if (pDeviceDescriptor != NULL)
+    pDevice->pCurrentConfigurationDescriptor = NULL;
+    if (pDevice->pDeviceDescriptor != NULL)
     {
-        freez( pDeviceDescriptor );
+        freez( pDevice->pDeviceDescriptor );
     }
-    if (pEP0Data != NULL)
+    if (pDevice->pEP0Data != NULL)
     {
-        freez( pEP0Data );
+        freez( pDevice->pEP0Data );
     }
 
-    _USB_FreeConfigMemory();
+    _USB_FreeConfigMemory( pDevice );
 
 }
 
@@ -3621,7 +4295,7 @@ void _USB_InitControlWrite( USB_ENDPOINT_INFO *pEndpoint, BYTE *pControlData,
 /****************************************************************************
   Function:
     void _USB_InitRead( USB_ENDPOINT_INFO *pEndpoint, BYTE *pData,
-                        WORD size )
+                        DWORD size )
 
   Description:
     This function sets up the endpoint information for an interrupt,
@@ -3635,7 +4309,7 @@ void _USB_InitControlWrite( USB_ENDPOINT_INFO *pEndpoint, BYTE *pControlData,
                                     endpoint information list.
     BYTE *pData                   - Points to where the data is to be
                                     stored.
-    WORD size                     - Number of data bytes to read.
+    DWORD size                    - Number of data bytes to read.
 
   Returns:
     None
@@ -3650,7 +4324,7 @@ void _USB_InitControlWrite( USB_ENDPOINT_INFO *pEndpoint, BYTE *pControlData,
         reaches 0.
   ***************************************************************************/
 
-void _USB_InitRead( USB_ENDPOINT_INFO *pEndpoint, BYTE *pData, WORD size )
+void _USB_InitRead( USB_ENDPOINT_INFO *pEndpoint, BYTE *pData, DWORD size )
 {
     pEndpoint->status.bfUserAbort           = 0;
     pEndpoint->status.bfTransferSuccessful  = 0;
@@ -3681,7 +4355,7 @@ void _USB_InitRead( USB_ENDPOINT_INFO *pEndpoint, BYTE *pData, WORD size )
 /****************************************************************************
   Function:
     void _USB_InitWrite( USB_ENDPOINT_INFO *pEndpoint, BYTE *pData,
-                            WORD size )
+                            DWORD size )
 
   Description:
     This function sets up the endpoint information for an interrupt,
@@ -3695,7 +4369,7 @@ void _USB_InitRead( USB_ENDPOINT_INFO *pEndpoint, BYTE *pData, WORD size )
                                     endpoint information list.
     BYTE *pData                   - Points to where the data to send is
                                     stored.
-    WORD size                     - Number of data bytes to write.
+    DWORD size                    - Number of data bytes to write.
 
   Returns:
     None
@@ -3710,7 +4384,7 @@ void _USB_InitRead( USB_ENDPOINT_INFO *pEndpoint, BYTE *pData, WORD size )
                 count reaches 0.
   ***************************************************************************/
 
-void _USB_InitWrite( USB_ENDPOINT_INFO *pEndpoint, BYTE *pData, WORD size )
+void _USB_InitWrite( USB_ENDPOINT_INFO *pEndpoint, BYTE *pData, DWORD size )
 {
     pEndpoint->status.bfUserAbort           = 0;
     pEndpoint->status.bfTransferSuccessful  = 0;
@@ -3766,15 +4440,21 @@ void _USB_InitWrite( USB_ENDPOINT_INFO *pEndpoint, BYTE *pData, WORD size )
 
 void _USB_NotifyClients( BYTE address, USB_EVENT event, void *data, unsigned int size )
 {
-    // To Do: Update this for multiple devices.
+    USB_DEVICE_INFO *pDevice;
+
+    // The device may have been removed since the event was queued.
+    if ((pDevice = _USB_FindDevice( address )) == NULL)
+    {
+        return;
+    }
 
-    if (usbDeviceInfo.flags.bfUseDeviceClientDriver)
+    if (pDevice->flags.bfUseDeviceClientDriver)
     {
-        usbClientDrvTable[usbDeviceInfo.deviceClientDriver].EventHandler(address, event, data, size);
+        usbClientDrvTable[pDevice->deviceClientDriver].EventHandler(address, event, data, size);
     }
     else
     {
-        USB_INTERFACE_INFO *pInterface = pInterfaceList;
+        USB_INTERFACE_INFO *pInterface = pDevice->pInterfaceList;
 
         while (pInterface != NULL)
         {
@@ -3795,10 +4475,10 @@ void _USB_NotifyClients( BYTE address, USB_EVENT event, void *data, unsigned int
     information.
 
   Precondition:
-    pCurrentConfigurationDescriptor points to a valid Configuration
-    Descriptor, which contains the endpoint descriptors.  The current
-    interface and the current interface settings must be set up in
-    usbDeviceInfo.
+    pCurrentDevice->pCurrentConfigurationDescriptor points to a valid
+    Configuration Descriptor, which contains the endpoint descriptors.  The
+    current interface and the current interface settings must be set up in
+    pCurrentDevice.
 
   Parameters:
     None - None
@@ -3846,13 +4526,13 @@ BOOL _USB_ParseConfigurationDescriptor( void )
 
     // Prime the loops.
     index                   = 0;
-    ptr                     = pCurrentConfigurationDescriptor;
+    ptr                     = pCurrentDevice->pCurrentConfigurationDescriptor;
     currentInterface        = 0;
     currentAlternateSetting = 0;
 
     // Assume no OTG support (determine otherwise, below).
-    usbDeviceInfo.flags.bfSupportsOTG   = 0;
-    usbDeviceInfo.flags.bfConfiguredOTG = 1;
+    pCurrentDevice->flags.bfSupportsOTG   = 0;
+    pCurrentDevice->flags.bfConfiguredOTG = 1;
 
     // Load up the values from the Configuration Descriptor
     bLength              = *ptr++;
@@ -3867,17 +4547,17 @@ BOOL _USB_ParseConfigurationDescriptor( void )
 
     // Check Max Power to see if we can support this configuration.
     powerRequest.current = bMaxPower;
-    powerRequest.port    = 0;        // Port 0
-    if (!USB_HOST_APP_EVENT_HANDLER( USB_ROOT_HUB, EVENT_VBUS_REQUEST_POWER,
+    powerRequest.port    = pCurrentDevice->hubPort;
+    if (!USB_HOST_APP_EVENT_HANDLER( pCurrentDevice->hubAddress, EVENT_VBUS_REQUEST_POWER,
             &powerRequest, sizeof(USB_VBUS_POWER_EVENT_DATA) ))
     {
-        usbDeviceInfo.errorCode = USB_ERROR_INSUFFICIENT_POWER;
+        pCurrentDevice->errorCode = USB_ERROR_INSUFFICIENT_POWER;
         return FALSE;
     }
 
     // Skip over the rest of the Configuration Descriptor
     index += bLength;
-    ptr    = &pCurrentConfigurationDescriptor[index];
+    ptr    = &pCurrentDevice->pCurrentConfigurationDescriptor[index];
 
     while (index < wTotalLength)
     {
@@ -3890,14 +4570,14 @@ BOOL _USB_ParseConfigurationDescriptor( void )
         if (bDescriptorType == USB_DESCRIPTOR_OTG)
         {
             // We found an OTG Descriptor, so the device supports OTG.
-            usbDeviceInfo.flags.bfSupportsOTG = 1;
-            usbDeviceInfo.attributesOTG       = *ptr;
+            pCurrentDevice->flags.bfSupportsOTG = 1;
+            pCurrentDevice->attributesOTG       = *ptr;
 
             // See if we need to send the SET FEATURE command.  If we do,
             // clear the bConfiguredOTG flag.
-            if ( (usbDeviceInfo.attributesOTG & OTG_HNP_SUPPORT) && (usbDeviceInfo.flags.bfAllowHNP))
+            if ( (pCurrentDevice->attributesOTG & OTG_HNP_SUPPORT) && (pCurrentDevice->flags.bfAllowHNP))
             {
-                usbDeviceInfo.flags.bfConfiguredOTG = 0;
+                pCurrentDevice->flags.bfConfiguredOTG = 0;
             }
         }
 
@@ -3906,7 +4586,7 @@ BOOL _USB_ParseConfigurationDescriptor( void )
         {
             // Skip over the rest of the Descriptor
             index += bLength;
-            ptr = &pCurrentConfigurationDescriptor[index];
+            ptr = &pCurrentDevice->pCurrentConfigurationDescriptor[index];
         }
         else
         {
@@ -3919,9 +4599,9 @@ BOOL _USB_ParseConfigurationDescriptor( void )
             Protocol          = *ptr++;
 
             // Get client driver index
-            if (usbDeviceInfo.flags.bfUseDeviceClientDriver)
+            if (pCurrentDevice->flags.bfUseDeviceClientDriver)
             {
-                ClientDriver = usbDeviceInfo.deviceClientDriver;
+                ClientDriver = pCurrentDevice->deviceClientDriver;
             }
             else
             {
@@ -3930,7 +4610,7 @@ BOOL _USB_ParseConfigurationDescriptor( void )
                     // Skip to the next interface descriptor
                     currentAlternateSetting++;
                     index += bLength;
-                    ptr = &pCurrentConfigurationDescriptor[index];
+                    ptr = &pCurrentDevice->pCurrentConfigurationDescriptor[index];
                     continue;
                 }
             }
@@ -3941,12 +4621,12 @@ BOOL _USB_ParseConfigurationDescriptor( void )
             {
                 // Skip over the rest of the Descriptor
                 index += bLength;
-                ptr = &pCurrentConfigurationDescriptor[index];
+                ptr = &pCurrentDevice->pCurrentConfigurationDescriptor[index];
             }
             else
             {
                 // This is the setting we want.  Create an entry for the new interface.
-                if ((newInterfaceInfo = (USB_INTERFACE_INFO *)malloc( sizeof(USB_INTERFACE_INFO) )) == NULL)
+                if ((newInterfaceInfo = (USB_INTERFACE_INFO *)USB_MALLOC( USB_HOST_POOL_INTERFACE, sizeof(USB_INTERFACE_INFO) )) == NULL)
                 {
                     return FALSE;   // To Do: Handle out of memory error
                 }
@@ -3957,8 +4637,8 @@ BOOL _USB_ParseConfigurationDescriptor( void )
                 newInterfaceInfo->clientDriver        = ClientDriver;
 
                 // Insert it into the list.
-                newInterfaceInfo->next                = (USB_INTERFACE_INFO *)pInterfaceList;
-                pInterfaceList                        = newInterfaceInfo;
+                newInterfaceInfo->next                = (USB_INTERFACE_INFO *)pCurrentDevice->pInterfaceList;
+                pCurrentDevice->pInterfaceList                        = newInterfaceInfo;
 
                 // Advance to the next interface
                 currentInterface++;
@@ -3969,7 +4649,7 @@ BOOL _USB_ParseConfigurationDescriptor( void )
 
                 // Skip over the rest of the Interface Descriptor
                 index += bLength;
-                ptr = &pCurrentConfigurationDescriptor[index];
+                ptr = &pCurrentDevice->pCurrentConfigurationDescriptor[index];
 
                 // Find the Endpoint Descriptors.  There might be Class and Vendor descriptors in here
                 while ((index < wTotalLength) && (currentEndpoint < bNumEndpoints))
@@ -3981,12 +4661,12 @@ BOOL _USB_ParseConfigurationDescriptor( void )
                     {
                         // Skip over the rest of the Descriptor
                         index += bLength;
-                        ptr = &pCurrentConfigurationDescriptor[index];
+                        ptr = &pCurrentDevice->pCurrentConfigurationDescriptor[index];
                     }
                     else
                     {
                         // Create an entry for the new endpoint.
-                        if ((newEndpointInfo = (USB_ENDPOINT_INFO *)malloc( sizeof(USB_ENDPOINT_INFO) )) == NULL)
+                        if ((newEndpointInfo = (USB_ENDPOINT_INFO *)USB_MALLOC( USB_HOST_POOL_ENDPOINT, sizeof(USB_ENDPOINT_INFO) )) == NULL)
                         {
                             return FALSE;   // To Do: Handle out of memory error
                         }
@@ -4001,6 +4681,7 @@ BOOL _USB_ParseConfigurationDescriptor( void )
                         newEndpointInfo->dataCount                  = 0;  // Initialize to 0 since we set bfTransferComplete.
                         newEndpointInfo->transferState              = TSTATE_IDLE;
                         newEndpointInfo->pInterface                 = newInterfaceInfo;
+                        newEndpointInfo->pDevice                    = pCurrentDevice;
 
                         // Special setup for isochronous endpoints.
                         if (newEndpointInfo->bmAttributes.bfTransferType == USB_TRANSFER_TYPE_ISOCHRONOUS)
@@ -4017,16 +4698,16 @@ BOOL _USB_ParseConfigurationDescriptor( void )
 
                         // Initialize interval count
                         newEndpointInfo->wIntervalCount = newEndpointInfo->wInterval;
-                        // Put the new endpoint in the list after EP0.
-                        newEndpointInfo->next = pEndpointList->next;
-                        pEndpointList->next   = newEndpointInfo;
+                        // Put the new endpoint in the list after the device's EP0.
+                        newEndpointInfo->next               = pCurrentDevice->pEndpoint0->next;
+                        pCurrentDevice->pEndpoint0->next    = newEndpointInfo;
 
                         // To Do: Check the available bandwidth to make sure that we can support this endpoint.
 
                         // Get ready for the next endpoint.
                         currentEndpoint++;
                         index += bLength;
-                        ptr = &pCurrentConfigurationDescriptor[index];
+                        ptr = &pCurrentDevice->pCurrentConfigurationDescriptor[index];
                     }
                 }
 
@@ -4046,8 +4727,8 @@ BOOL _USB_ParseConfigurationDescriptor( void )
     }
 
     // Set configuration.
-    usbDeviceInfo.currentConfiguration      = currentConfiguration;
-    usbDeviceInfo.currentConfigurationPower = bMaxPower;
+    pCurrentDevice->currentConfiguration      = currentConfiguration;
+    pCurrentDevice->currentConfigurationPower = bMaxPower;
 
     // Success!
     return TRUE;
@@ -4056,34 +4737,342 @@ BOOL _USB_ParseConfigurationDescriptor( void )
 
 /****************************************************************************
   Function:
-    void _USB_ResetDATA0( BYTE endpoint )
+    void * _USB_PoolAlloc( BYTE pool, WORD size )
 
   Description:
-    This function resets DATA0 for the specified endpoint.  If the
-    specified endpoint is 0, it resets DATA0 for all endpoints.
+    This function takes memory from one of the fixed pools of the host
+    layer.  The record pools hand out one record; the buffer pool hands out
+    the first run of free blocks that is long enough.
 
   Precondition:
     None
 
   Parameters:
-    BYTE endpoint   - Endpoint number to reset.
+    BYTE pool   - Pool to use, USB_HOST_POOL_*
+    WORD size   - Number of bytes needed
+
+  Returns:
+    void *  - Pointer to the memory, or NULL if it does not fit.
+
+  Remarks:
+    A failure is counted in the statistics of the pool.  The pools are used
+    only from the host tasks, like the heap was, so they are not protected
+    from interrupts.
+  ***************************************************************************/
+
+#ifdef USB_HOST_MEMORY_POOLS
+void * _USB_PoolAlloc( BYTE pool, WORD size )
+{
+    WORD                i;
+    BYTE               *map;
+    WORD                needed;
+    WORD                run;
+    USB_HOST_POOL_USAGE *pUsage;
+
+    map     = usbPoolMapStart[pool];
+    pUsage  = &usbPoolStats.pool[pool];
+    // Round up in a DWORD; in 16 bits a size near 64K would wrap to 0.
+    needed  = (WORD)(((DWORD)size + usbPoolBlockSize[pool] - 1) / usbPoolBlockSize[pool]);
+    if (needed == 0)
+    {
+        needed = 1;
+    }
+
+    run = 0;
+    if (needed < 0xFF)
+    {
+        for (i = 0; i < usbPoolBlocks[pool]; i++)
+        {
+            if (map[i] != 0)
+            {
+                run = 0;
+            }
+            else if (++run == needed)
+            {
+                // Mark the run, and keep the statistics.
+                i -= needed - 1;
+                map[i] = needed;
+                memset( &map[i+1], 0xFF, needed - 1 );
 
+                pUsage->inUse += needed;
+                if (pUsage->inUse > pUsage->highWater)
+                {
+                    pUsage->highWater = pUsage->inUse;
+                }
+                if (i + needed > pUsage->extent)
+                {
+                    pUsage->extent = i + needed;
+                }
+                return usbPoolMemory[pool] + i * usbPoolBlockSize[pool];
+            }
+        }
+    }
+
+    pUsage->failures++;
+    return NULL;
+}
+#endif
+
+
+/****************************************************************************
+  Function:
+    void _USB_PoolFree( void *ptr )
+
+  Description:
+    This function gives memory from _USB_PoolAlloc() back to its pool.
+
+  Precondition:
+    None
+
+  Parameters:
+    void *ptr   - Memory to free, or NULL
 
   Returns:
     None
 
   Remarks:
+    The pool is found from the address, so the callers do not have to
+    remember it.
+  ***************************************************************************/
+
+#ifdef USB_HOST_MEMORY_POOLS
+void _USB_PoolFree( void *ptr )
+{
+    WORD    i;
+    BYTE   *map;
+    BYTE    pool;
+
+    for (pool = 0; pool < USB_HOST_POOLS; pool++)
+    {
+        if (((BYTE *)ptr >= usbPoolMemory[pool]) &&
+            ((BYTE *)ptr <  usbPoolMemory[pool] + usbPoolBlocks[pool] * usbPoolBlockSize[pool]))
+        {
+            map = usbPoolMapStart[pool];
+            i   = ((BYTE *)ptr - usbPoolMemory[pool]) / usbPoolBlockSize[pool];
+
+            usbPoolStats.pool[pool].inUse -= map[i];
+            memset( &map[i], 0, map[i] );
+            return;
+        }
+    }
+}
+#endif
+
+
+/****************************************************************************
+  Function:
+    void _USB_PrepareNextBulkPacket( void )
+
+  Description:
+    This function sets up the other ping-pong Buffer Descriptor with the
+    packet that follows the one on the bus, so that the Transfer Done
+    interrupt only has to send the token.
+
+  Precondition:
+    The token of pCurrentEndpoint, a bulk endpoint, has just been sent.
+
+  Parameters:
+    None - None
+
+  Returns:
     None
+
+  Remarks:
+    Every packet but the last is wMaxPacketSize long, so the packet on the
+    bus starts at dataCount.  Nothing is set up if it is the last packet.
+    If the transfer stops early instead, on a short IN packet, a NAK, or an
+    error, _USB_FindNextToken() takes the Buffer Descriptor back.
   ***************************************************************************/
 
-void _USB_ResetDATA0( BYTE endpoint )
+#ifdef PIPELINE_BULK_PACKETS
+void _USB_PrepareNextBulkPacket( void )
+{
+    DWORD               offset;
+    WORD                currentPacketSize;
+    BDT_ENTRY           *pBDT;
+
+    if ((pCurrentEndpoint->dataCountMax - pCurrentEndpoint->dataCount) <= pCurrentEndpoint->wMaxPacketSize)
+    {
+        return;
+    }
+    offset = pCurrentEndpoint->dataCount + pCurrentEndpoint->wMaxPacketSize;
+
+    if ((pCurrentEndpoint->dataCountMax - offset) > pCurrentEndpoint->wMaxPacketSize)
+    {
+        currentPacketSize = pCurrentEndpoint->wMaxPacketSize;
+    }
+    else
+    {
+        currentPacketSize = pCurrentEndpoint->dataCountMax - offset;
+    }
+
+    // Find the Buffer Descriptor after the one on the bus.
+    if ((pCurrentEndpoint->transferState & TSTATE_MASK) == TSTATE_BULK_READ)
+    {
+        pBDT = BDT_IN;
+        if (usbBusInfo.flags.bfPingPongIn)
+        {
+            pBDT = BDT_IN_ODD;
+        }
+        usbBusInfo.flags.bfPingPongIn = ~usbBusInfo.flags.bfPingPongIn;
+    }
+    else
+    {
+        pBDT = BDT_OUT;
+        if (usbBusInfo.flags.bfPingPongOut)
+        {
+            pBDT = BDT_OUT_ODD;
+        }
+        usbBusInfo.flags.bfPingPongOut = ~usbBusInfo.flags.bfPingPongOut;
+    }
+
+    #if defined(__C30__)
+        pBDT->ADR  = pCurrentEndpoint->pUserData + offset;
+    #elif defined(__PIC32MX__)
+        pBDT->ADR  = (BYTE *)KVA_TO_PA((DWORD)pCurrentEndpoint->pUserData + offset);
+    #else
+        #error Cannot set BDT address.
+    #endif
+
+    // The packet takes the other DATA0/DATA1 toggle from the one on the bus.
+    pBDT->STAT.Val      = 0;
+    pBDT->count         = currentPacketSize;
+    pBDT->STAT.DTS      = pCurrentEndpoint->status.bfNextDATA01 ? 0 : 1;
+    pBDT->STAT.DTSEN    = pCurrentEndpoint->status.bfUseDTS;
+    pBDT->STAT.UOWN     = 1;
+
+    pNextBulkBDT = pBDT;
+}
+#endif
+
+
+#ifdef USB_HUB_SUPPORT_INCLUDED
+/****************************************************************************
+  Function:
+    BOOL _USB_RemoveDevice( USB_DEVICE_INFO *pDevice )
+
+  Description:
+    This function removes a device behind a hub.  Its transfers are stopped,
+    its client drivers and the application are told, and its memory and
+    entry in the device table are freed.  Devices behind it go first.
+
+  Precondition:
+    pDevice is not the device on the root port.
+
+  Parameters:
+    USB_DEVICE_INFO *pDevice    - Device to remove
+
+  Return Values:
+    TRUE    - The device has been removed.
+    FALSE   - A token of the device is still on the bus.  Try again later.
+
+  Remarks:
+    The Transfer Done interrupt uses pCurrentEndpoint, so its node cannot be
+    freed while the token is outstanding.
+  ***************************************************************************/
+
+BOOL _USB_RemoveDevice( USB_DEVICE_INFO *pDevice )
+{
+    USB_VBUS_POWER_EVENT_DATA   powerRequest;
+    USB_ENDPOINT_INFO           *ep;
+    BYTE                        i;
+    #if defined( __C30__ )
+        WORD                    interrupt_mask;
+    #elif defined( __PIC32MX__ )
+        UINT32                  interrupt_mask;
+    #else
+        #error Cannot save interrupt status
+    #endif
+
+    for (i = 1; i < USB_MAX_DEVICES; i++)
+    {
+        if ((usbDeviceInfo[i].pEndpoint0 != NULL) && (usbDeviceInfo[i].hubAddress == pDevice->deviceAddress))
+        {
+            if (!_USB_RemoveDevice( &usbDeviceInfo[i] ))
+            {
+                return FALSE;
+            }
+        }
+    }
+
+    // Guard against USB interrupts
+    interrupt_mask = U1IE;
+    U1IE = 0;
+
+    // Stop all the transfers of the device, so none of its tokens are sent
+    // again.
+    ep = pEndpointList;
+    while (ep != NULL)
+    {
+        if (ep->pDevice == pDevice)
+        {
+            ep->transferState               = TSTATE_IDLE;
+            ep->status.bfUserAbort          = 1;
+            ep->status.bfTransferComplete   = 1;
+        }
+        ep = ep->next;
+    }
+
+    if ((pCurrentEndpoint->pDevice == pDevice) && (U1CONbits.TOKBUSY || U1IRbits.TRNIF))
+    {
+        // Re-enable USB interrupts
+        U1IE = interrupt_mask;
+        return FALSE;
+    }
+
+    // Re-enable USB interrupts
+    U1IE = interrupt_mask;
+
+    // If the device was being enumerated, go back to the root port.
+    if (pDevice == pCurrentDevice)
+    {
+        pCurrentDevice  = usbDeviceInfo;
+        usbHostState    = usbDeviceInfo[0].hostState;
+    }
+
+    powerRequest.port = pDevice->hubPort;
+    USB_HOST_APP_EVENT_HANDLER( pDevice->deviceAddress, EVENT_VBUS_RELEASE_POWER,
+        &powerRequest, sizeof(USB_VBUS_POWER_EVENT_DATA) );
+    _USB_NotifyClients( pDevice->deviceAddress, EVENT_DETACH,
+        &pDevice->deviceAddress, sizeof(BYTE) );
+
+    _USB_FreeDevice( pDevice );
+    return TRUE;
+}
+#endif
+
+
+/****************************************************************************
+  Function:
+    void _USB_ResetDATA0( USB_DEVICE_INFO *pDevice, BYTE endpoint )
+
+  Description:
+    This function resets DATA0 for the specified endpoint of a device.  If
+    the specified endpoint is 0, it resets DATA0 for all its endpoints.
+
+  Precondition:
+    None
+
+  Parameters:
+    USB_DEVICE_INFO *pDevice    - Device that owns the endpoint.
+    BYTE endpoint               - Endpoint number to reset.
+
+
+  Returns:
+    None
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+void _USB_ResetDATA0( USB_DEVICE_INFO *pDevice, BYTE endpoint )
 {
     USB_ENDPOINT_INFO   *ep;
 
     ep = pEndpointList;
     while (ep != NULL)
     {
-        if ((endpoint == 0) || (endpoint == ep->bEndpointAddress))
+        if ((ep->pDevice == pDevice) && ((endpoint == 0) || (endpoint == ep->bEndpointAddress)))
         {
             ep->status.bfNextDATA01 = 0;
         }
@@ -4092,6 +5081,78 @@ void _USB_ResetDATA0( BYTE endpoint )
 }
 
 
+#ifdef USB_HUB_SUPPORT_INCLUDED
+/****************************************************************************
+  Function:
+    void _USB_SelectNextDevice( void )
+
+  Description:
+    This function picks the device the host state machine works on next.
+    The devices behind a hub share the state machine with the device on the
+    root port, one at a time.  Once the current device is running or
+    holding, it is parked with its state saved, and the next device that
+    needs enumeration or a new configuration is taken up.  Between them,
+    the state machine goes back to the device on the root port.
+
+  Precondition:
+    None
+
+  Parameters:
+    None - None
+
+  Returns:
+    None
+
+  Remarks:
+    A device whose port is still being reset by its hub is not at the
+    default address yet, so it is skipped.  The ISR only changes the state
+    during the root port's attach, reset and resume timing, when no other
+    device can be current.
+  ***************************************************************************/
+
+void _USB_SelectNextDevice( void )
+{
+    USB_DEVICE_INFO *pDevice;
+    BYTE            i;
+
+    if ((usbHostState != (STATE_RUNNING | SUBSTATE_NORMAL_RUN)) &&
+        (usbHostState != (STATE_HOLDING | SUBSTATE_HOLD)))
+    {
+        return;
+    }
+
+    if (pCurrentDevice != usbDeviceInfo)
+    {
+        pCurrentDevice->hostState   = usbHostState;
+        pCurrentDevice              = usbDeviceInfo;
+        usbHostState                = pCurrentDevice->hostState;
+        return;
+    }
+
+    if (usbHostState != (STATE_RUNNING | SUBSTATE_NORMAL_RUN))
+    {
+        return;
+    }
+
+    for (i = 1; i < USB_MAX_DEVICES; i++)
+    {
+        pDevice = &usbDeviceInfo[i];
+        if ((pDevice->pEndpoint0 != NULL) &&
+            (pDevice->hostState != (STATE_RUNNING | SUBSTATE_NORMAL_RUN)) &&
+            (pDevice->hostState != (STATE_HOLDING | SUBSTATE_HOLD)) &&
+            (pDevice->hostState != (STATE_ATTACHED | SUBSTATE_RESET_DEVICE)))
+        {
+            pCurrentDevice->hostState   = usbHostState;
+            pCurrentDevice              = pDevice;
+            usbHostState                = pCurrentDevice->hostState;
+            _USB_InitErrorCounters();
+            return;
+        }
+    }
+}
+#endif
+
+
 /****************************************************************************
   Function:
     void _USB_SendToken( BYTE endpoint, BYTE tokenType )
@@ -4116,13 +5177,18 @@ void _USB_ResetDATA0( BYTE endpoint )
 
 void _USB_SendToken( BYTE endpoint, BYTE tokenType )
 {
-    BYTE    temp;
+    USB_DEVICE_INFO *pDevice;
+    BYTE            temp;
+
+    pDevice = pCurrentEndpoint->pDevice;
 
     // Disable retries, disable control transfers, enable Rx and Tx and handshaking.
     temp = 0x5D;
 
-    // Enable low speed transfer if the device is low speed.
-    if (usbDeviceInfo.flags.bfIsLowSpeed)
+    // Enable low speed transfer if the device is low speed and on the root
+    // port.  Behind a hub, the low speed bit in U1ADDR alone makes the module
+    // send the PREamble to the hub at full speed.
+    if (pDevice->flags.bfIsLowSpeed && (pDevice->hubAddress == USB_ROOT_HUB))
     {
         temp |= 0x80;   // Set LSPD
     }
@@ -4145,7 +5211,7 @@ void _USB_SendToken( BYTE endpoint, BYTE tokenType )
         if (U1CONbits.TOKBUSY) UART2PutChar( '+' );
     #endif
 
-    U1ADDR = usbDeviceInfo.deviceAddressAndSpeed;
+    U1ADDR = pDevice->deviceAddressAndSpeed;
     U1TOK = (tokenType << 4) | (endpoint & 0x7F);
 
     U1CONbits.TOKBUSY = 1;
@@ -4196,7 +5262,7 @@ void _USB_SetBDT( BYTE token )
         // Find the BDT we need to use.
         #if (USB_PING_PONG_MODE == USB_PING_PONG__FULL_PING_PONG)
             pBDT = BDT_IN;
-            if (usbDeviceInfo.flags.bfPingPongIn)
+            if (usbBusInfo.flags.bfPingPongIn)
             {
                 pBDT = BDT_IN_ODD;
             }
@@ -4206,7 +5272,7 @@ void _USB_SetBDT( BYTE token )
 
         // Set up ping-pong for the next transfer
         #if (USB_PING_PONG_MODE == USB_PING_PONG__FULL_PING_PONG)
-            usbDeviceInfo.flags.bfPingPongIn = ~usbDeviceInfo.flags.bfPingPongIn;
+            usbBusInfo.flags.bfPingPongIn = ~usbBusInfo.flags.bfPingPongIn;
         #endif
     }
     else  // USB_TOKEN_OUT or USB_TOKEN_SETUP
@@ -4214,7 +5280,7 @@ void _USB_SetBDT( BYTE token )
         // Find the BDT we need to use.
         #if (USB_PING_PONG_MODE == USB_PING_PONG__FULL_PING_PONG) || (USB_PING_PONG_MODE == USB_PING_PONG__EP0_OUT_ONLY)
             pBDT = BDT_OUT;
-            if (usbDeviceInfo.flags.bfPingPongOut)
+            if (usbBusInfo.flags.bfPingPongOut)
             {
                 pBDT = BDT_OUT_ODD;
             }
@@ -4224,7 +5290,7 @@ void _USB_SetBDT( BYTE token )
 
         // Set up ping-pong for the next transfer
         #if (USB_PING_PONG_MODE == USB_PING_PONG__FULL_PING_PONG) || (USB_PING_PONG_MODE == USB_PING_PONG__EP0_OUT_ONLY)
-            usbDeviceInfo.flags.bfPingPongOut = ~usbDeviceInfo.flags.bfPingPongOut;
+            usbBusInfo.flags.bfPingPongOut = ~usbBusInfo.flags.bfPingPongOut;
         #endif
     }
 
@@ -4266,7 +5332,7 @@ void _USB_SetBDT( BYTE token )
     else
     {
         #if defined(__C30__)
-            pBDT->ADR  = (BYTE *)((WORD)pCurrentEndpoint->pUserData + (WORD)pCurrentEndpoint->dataCount);
+            pBDT->ADR  = pCurrentEndpoint->pUserData + pCurrentEndpoint->dataCount;
         #elif defined(__PIC32MX__)
             pBDT->ADR  = (BYTE *)KVA_TO_PA((DWORD)pCurrentEndpoint->pUserData + (DWORD)pCurrentEndpoint->dataCount);
         #else
@@ -4302,17 +5368,69 @@ void _USB_SetBDT( BYTE token )
 
 /****************************************************************************
   Function:
-    BOOL _USB_TransferInProgress( void )
+    void _USB_StartBulkInFrame( void )
+
+  Description:
+    This function puts a newly started bulk transfer on the bus in the
+    current frame.  Once the bulk endpoints have run out of work,
+    _USB_FindNextToken() stops looking at them until the next SOF, so a
+    transfer started after that would lose the rest of the frame.  If the
+    bus is idle, the bulk search is opened again and the next token is
+    sent now.
+
+  Precondition:
+    The transfer has been set up with _USB_InitRead() or _USB_InitWrite().
+
+  Parameters:
+    None
+
+  Returns:
+    None
+
+  Remarks:
+    If a token is on the bus, the Transfer Done interrupt will find the new
+    transfer, so nothing is done.
+  ***************************************************************************/
+
+#ifdef START_BULK_TRANSFERS_IN_FRAME
+void _USB_StartBulkInFrame( void )
+{
+    #if defined( __C30__ )
+        WORD            interrupt_mask;
+    #elif defined( __PIC32MX__ )
+        UINT32          interrupt_mask;
+    #else
+        #error Cannot save interrupt status
+    #endif
+
+    // Keep the SOF and Transfer Done interrupts out while we look at the bus.
+    interrupt_mask = U1IE;
+    U1IE = 0;
+
+    if (usbBusInfo.flags.bfBulkTransfersDone && !U1CONbits.TOKBUSY && !U1IRbits.TRNIF)
+    {
+        usbBusInfo.flags.bfBulkTransfersDone = 0;
+        _USB_FindNextToken();
+    }
+
+    U1IE = interrupt_mask;
+}
+#endif
+
+
+/****************************************************************************
+  Function:
+    BOOL _USB_TransferInProgress( USB_DEVICE_INFO *pDevice )
 
   Description:
     This function checks to see if any read or write transfers are in
-    progress.
+    progress on a device.
 
   Precondition:
     None
 
   Parameters:
-    None - None
+    USB_DEVICE_INFO *pDevice    - Device to check
 
   Returns:
     TRUE    - At least one read or write transfer is occurring.
@@ -4322,14 +5440,14 @@ void _USB_SetBDT( BYTE token )
     None
   ***************************************************************************/
 
-BOOL _USB_TransferInProgress( void )
+BOOL _USB_TransferInProgress( USB_DEVICE_INFO *pDevice )
 {
     USB_ENDPOINT_INFO   *ep;
 
     ep = pEndpointList;
     while (ep != NULL)
     {
-        if (!ep->status.bfTransferComplete)
+        if ((ep->pDevice == pDevice) && !ep->status.bfTransferComplete)
         {
             return TRUE;
         }
@@ -4468,6 +5586,9 @@ void _USB1Interrupt( void )
         #endif
         WORD                    packetSize;
         BDT_ENTRY               *pBDT;
+        #ifdef PIPELINE_BULK_PACKETS
+            BOOL                sendNextBulkPacket = FALSE;
+        #endif
 
         #ifdef DEBUG_MODE
             UART2PutChar( '!' );
@@ -4563,6 +5684,9 @@ void _USB1Interrupt( void )
                     {
                         // We need to process more data.  Keep this endpoint in its current
                         // transfer state.
+                        #ifdef PIPELINE_BULK_PACKETS
+                            sendNextBulkPacket = (pNextBulkBDT != NULL);
+                        #endif
                     }
                 }
             }
@@ -4605,6 +5729,9 @@ void _USB1Interrupt( void )
                 {
                     // We need to process more data.  Keep this endpoint in its current
                     // transfer state.
+                    #ifdef PIPELINE_BULK_PACKETS
+                        sendNextBulkPacket = (pNextBulkBDT != NULL);
+                    #endif
                 }
             }
             else if (pBDT->STAT.PID == PID_NAK)
@@ -4710,7 +5837,30 @@ void _USB1Interrupt( void )
             // The user may be trying to select a new configuration.  Discard the transaction.
         }
 
-        _USB_FindNextToken();
+        #ifdef PIPELINE_BULK_PACKETS
+            if (sendNextBulkPacket && !pCurrentEndpoint->status.bfTransferComplete)
+            {
+                // The next packet of this bulk transfer is already in its Buffer
+                // Descriptor.  Send it, then set up the one after it while it is
+                // on the bus.  The SOF interrupt ends this at the end of the frame.
+                pNextBulkBDT = NULL;
+                if ((pCurrentEndpoint->transferState & TSTATE_MASK) == TSTATE_BULK_READ)
+                {
+                    _USB_SendToken( pCurrentEndpoint->bEndpointAddress, USB_TOKEN_IN );
+                }
+                else
+                {
+                    _USB_SendToken( pCurrentEndpoint->bEndpointAddress, USB_TOKEN_OUT );
+                }
+                _USB_PrepareNextBulkPacket();
+            }
+            else
+            {
+                _USB_FindNextToken();
+            }
+        #else
+            _USB_FindNextToken();
+        #endif
     } // U1IRbits.TRNIF
 
 
@@ -4749,7 +5899,13 @@ void _USB1Interrupt( void )
         usbBusInfo.flags.bfIsochronousTransfersDone = 0;
         usbBusInfo.flags.bfBulkTransfersDone        = 0;
         usbBusInfo.dBytesSentInFrame                = 0;
-        usbBusInfo.lastBulkTransaction              = 0;
+        #ifndef USB_HUB_SUPPORT_INCLUDED
+            usbBusInfo.lastBulkTransaction          = 0;
+        #else
+            // Start the bulk search after the endpoint served last, so a
+            // transfer that keeps the bus for a frame does not shut out
+            // the other devices behind the hub.
+        #endif
 
         _USB_FindNextToken();
     }
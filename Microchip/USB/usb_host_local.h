@@ -390,6 +390,8 @@ typedef struct _USB_BUS_INFO
             BYTE        bfInterruptTransfersDone    : 1;    // All interrupt transfers in the current frame are complete.
             BYTE        bfIsochronousTransfersDone  : 1;    // All isochronous transfers in the current frame are complete.
             BYTE        bfBulkTransfersDone         : 1;    // All bulk transfers in the current frame are complete.
+            BYTE        bfPingPongIn                : 1;    // Ping-pong status of IN buffers (default = 0).
+            BYTE        bfPingPongOut               : 1;    // Ping-pong status of OUT buffers (default = 0).
         };
         WORD            val;                                //
     }                   flags;                              //
@@ -416,10 +418,21 @@ typedef struct _USB_CONFIGURATION
 /* USB Device Information
 
 This structure is used to hold all the information about an attached device.
+The host keeps one of these for each device on the bus (see USB_MAX_DEVICES).
+The first one is always the device on the root port.
 */
 typedef struct _USB_DEVICE_INFO
 {
     USB_CONFIGURATION   *currentConfigurationDescriptor;    // Descriptor of the current Configuration.
+    USB_CONFIGURATION   *pConfigurationDescriptorList;      // List of the Configuration Descriptors of the device.
+    BYTE                *pCurrentConfigurationDescriptor;   // Current Configuration Descriptor of the device.
+    BYTE                *pDeviceDescriptor;                 // Device Descriptor of the device.
+    BYTE                *pEP0Data;                          // A data buffer for use by EP0.
+    struct _USB_INTERFACE_INFO  *pInterfaceList;            // List of interfaces on the device.
+    struct _USB_ENDPOINT_INFO   *pEndpoint0;                // EP0 node of the device in the endpoint list.  NULL if the entry is free.
+    WORD                hostState;                          // State machine state while another device is being serviced.
+    BYTE                hubAddress;                         // Address of the hub the device is attached to, or USB_ROOT_HUB.
+    BYTE                hubPort;                            // Port of that hub (0 for the root port).
     BYTE                currentConfiguration;               // Value of current Configuration.
     BYTE                attributesOTG;                      // OTG attributes.
     BYTE                deviceAddressAndSpeed;              // Device address and low/full speed indication.
@@ -436,8 +449,6 @@ typedef struct _USB_DEVICE_INFO
             BYTE        bfSupportsOTG               : 1;    // If the device supports OTG (default = 0).
             BYTE        bfConfiguredOTG             : 1;    // If OTG on the device has been configured (default = 0).
             BYTE        bfAllowHNP                  : 1;    // If Host Negotiation Protocol is allowed (default = 0).
-            BYTE        bfPingPongIn                : 1;    // Ping-pong status of IN buffers (default = 0).
-            BYTE        bfPingPongOut               : 1;    // Ping-pong status of OUT buffers (default = 0).
             BYTE        bfUseDeviceClientDriver     : 1;    // Indicates driver should use a single client driver (deviceClientDriver)
         };
         WORD            val;
@@ -470,6 +481,7 @@ endpoints form a linked list.
 typedef struct _USB_ENDPOINT_INFO
 {
     struct _USB_ENDPOINT_INFO   *next;                  // Pointer to the next node in the list.
+    USB_DEVICE_INFO            *pDevice;                // Device that owns this endpoint.
 
     volatile union
     {
@@ -538,6 +550,7 @@ the client drivers.
     typedef struct
     {
         USB_EVENT               event;          // Event that occured.
+        BYTE                    deviceAddress;  // Device that generated the event.
         union
         {
             //BYTE                deviceAddress;  // Event: EVENT_DETACH, sent directly
@@ -604,15 +617,24 @@ USB_EVENT_DATA, above).  See "struct_queue.h" for usage and operations.
 
 #define _USB_InitErrorCounters()        { numCommandTries   = USB_NUM_COMMAND_TRIES; }
 #define _USB_SetDATA01(x)               { pCurrentEndpoint->status.bfNextDATA01 = x; }
-#define _USB_SetErrorCode(x)            { usbDeviceInfo.errorCode = x; }
+#define _USB_GetDeviceState(p)          ( ((p) == pCurrentDevice) ? usbHostState : (p)->hostState )
+#define _USB_SetDeviceState(p,x)        { if ((p) == pCurrentDevice) usbHostState = x; else (p)->hostState = x; }
+#define _USB_SetErrorCode(x)            { pCurrentDevice->errorCode = x; }
 #define _USB_SetHoldState()             { usbHostState = STATE_HOLDING; }
 #define _USB_SetNextState()             { usbHostState = (usbHostState & STATE_MASK) + NEXT_STATE; }
 #define _USB_SetNextSubState()          { usbHostState = (usbHostState & (STATE_MASK | SUBSTATE_MASK)) + NEXT_SUBSTATE; }
 #define _USB_SetNextSubSubState()       { usbHostState =  usbHostState + NEXT_SUBSUBSTATE; }
 #define _USB_SetNextTransferState()     { pCurrentEndpoint->transferState ++; }
 #define _USB_SetPreviousSubSubState()   { usbHostState =  usbHostState - NEXT_SUBSUBSTATE; }
-#define _USB_SetTransferErrorState(x)   { x->transferState = (x->transferState & ~TSTATE_MASK) | TSUBSTATE_ERROR; }
-#define freez(x)                        { free(x); x = NULL; }
+#define _USB_SetTransferErrorState(x)   { x->transferState = (x->transferState & TSTATE_MASK) | TSUBSTATE_ERROR; }
+#ifdef USB_HOST_MEMORY_POOLS
+    #define USB_MALLOC(pool,size)       _USB_PoolAlloc( pool, size )
+    #define USB_FREE(ptr)               _USB_PoolFree( ptr )
+#else
+    #define USB_MALLOC(pool,size)       malloc( size )
+    #define USB_FREE(ptr)               free( ptr )
+#endif
+#define freez(x)                        { USB_FREE(x); x = NULL; }
 
 
 //******************************************************************************
@@ -621,25 +643,42 @@ USB_EVENT_DATA, above).  See "struct_queue.h" for usage and operations.
 //******************************************************************************
 //******************************************************************************
 
+void                 _USB_CancelNextBulkPacket( void );
 void                 _USB_CheckCommandAndEnumerationAttempts( void );
 BOOL                 _USB_FindClassDriver( BYTE bClass, BYTE bSubClass, BYTE bProtocol, BYTE *pbClientDrv );
+USB_DEVICE_INFO *    _USB_FindDevice( BYTE deviceAddress );
 BOOL                 _USB_FindDeviceLevelClientDriver( void );
 USB_INTERFACE_INFO * _USB_FindInterface ( BYTE bInterface, BYTE bAltSetting );
 void                 _USB_FindNextToken( void );
-void                 _USB_FreeConfigMemory( void );
-void                 _USB_FreeMemory( void );
+void                 _USB_FreeConfigMemory( USB_DEVICE_INFO *pDevice );
+#ifdef USB_HUB_SUPPORT_INCLUDED
+void                 _USB_FreeDevice( USB_DEVICE_INFO *pDevice );
+#endif
+void                 _USB_FreeMemory( USB_DEVICE_INFO *pDevice );
 void                 _USB_InitControlRead( USB_ENDPOINT_INFO *pEndpoint, BYTE *pControlData, WORD controlSize,
                               BYTE *pData, WORD size );
 void                 _USB_InitControlWrite( USB_ENDPOINT_INFO *pEndpoint, BYTE *pControlData, WORD controlSize,
                                BYTE *pData, WORD size );
-void                 _USB_InitRead( USB_ENDPOINT_INFO *pEndpoint, BYTE *pData, WORD size );
-void                 _USB_InitWrite( USB_ENDPOINT_INFO *pEndpoint, BYTE *pData, WORD size );
+void                 _USB_InitRead( USB_ENDPOINT_INFO *pEndpoint, BYTE *pData, DWORD size );
+void                 _USB_InitWrite( USB_ENDPOINT_INFO *pEndpoint, BYTE *pData, DWORD size );
 void                 _USB_NotifyClients( BYTE DevAddress, USB_EVENT event, void *data, unsigned int size );
 BOOL                 _USB_ParseConfigurationDescriptor( void );
-void                 _USB_ResetDATA0( BYTE endpoint );
+#ifdef USB_HOST_MEMORY_POOLS
+void *               _USB_PoolAlloc( BYTE pool, WORD size );
+void                 _USB_PoolFree( void *ptr );
+#endif
+void                 _USB_PrepareNextBulkPacket( void );
+#ifdef USB_HUB_SUPPORT_INCLUDED
+BOOL                 _USB_RemoveDevice( USB_DEVICE_INFO *pDevice );
+#endif
+void                 _USB_ResetDATA0( USB_DEVICE_INFO *pDevice, BYTE endpoint );
+#ifdef USB_HUB_SUPPORT_INCLUDED
+void                 _USB_SelectNextDevice( void );
+#endif
 void                 _USB_SendToken( BYTE endpoint, BYTE tokenType );
 void                 _USB_SetBDT( BYTE  direction );
-BOOL                 _USB_TransferInProgress( void );
+void                 _USB_StartBulkInFrame( void );
+BOOL                 _USB_TransferInProgress( USB_DEVICE_INFO *pDevice );
 
 
 #endif // _USB_HOST_LOCAL_
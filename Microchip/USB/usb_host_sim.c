@@ -0,0 +1,1860 @@
+/******************************************************************************
+
+    USB Host Controller Simulator
+
+This file stands in for the PIC24 USB OTG module and a bulk-only mass storage
+device plugged into it, so the USB Embedded Host stack can be run and measured
+on a workstation.  See usb_host_sim.h.
+
+The module part follows what usb_host.c expects of the hardware.  Writing
+U1TOK and setting U1CONbits.TOKBUSY sends a token.  The transaction uses the
+even or odd Buffer Descriptor of its direction in turn, as the ping-pong
+pointers of the part do, and ends with the PID in the descriptor, UOWN clear,
+U1STAT pointing at the descriptor and TRNIF set.  A token is held back while
+less than U1SOF byte times are left in the frame.  SOF packets are sent at
+each frame while SOFEN is set, and T1MSECIF is set every millisecond.
+
+Each drive answers at full speed with a 64 byte EP0, bulk IN endpoint 1 and
+bulk OUT endpoint 2.  It takes TEST UNIT READY, REQUEST SENSE, INQUIRY (and
+the Block Limits page when the version is 5 or more), MODE SENSE 6, READ
+CAPACITY 10, READ 10, WRITE 10 and WRITE SAME 10 (when it gives a maximum
+WRITE SAME length); other commands fail with ILLEGAL REQUEST.  It NAKs its bulk endpoints until the times in
+gUSBHostSimConfig have passed.  Each drive keeps its own state and times, so
+drives behind the hub work at the same time.
+
+When gUSBHostSimConfig.hubPorts is set, a full speed hub is on the root port
+and drive n is on its port n + 1.  The hub powers and resets its ports, ends
+a port reset after 10 ms, and reports connection, enable and reset changes
+on its status change endpoint (interrupt IN endpoint 1, NAKed while nothing
+has changed).  A token reaches the root device, or a drive whose port is
+enabled, with the address in U1ADDR.
+
+This file is not part of the PIC projects.  Build it with usb_host.c, the
+Mass Storage client driver and an application whose usb_config.h includes
+usb_host_sim.h; see "USB Host Bench".
+
+* FileName:        usb_host_sim.c
+* Dependencies:    None
+* Processor:       Workstation (POSIX)
+* Compiler:        GCC
+
+*******************************************************************************/
+
+#define _FILE_OFFSET_BITS   64
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include "GenericTypeDefs.h"
+#include "USB/usb.h"
+#include "usb_host_local.h"
+#include "usb_hal_local.h"
+
+
+//******************************************************************************
+//******************************************************************************
+// Section: Constants
+//******************************************************************************
+//******************************************************************************
+
+#define FRAME_BIT_TIMES             12000   // One millisecond at 12 Mbit/s.
+
+// Bus time of the parts of a transaction, in byte times.  A transaction with
+// data costs its data plus the token, the data packet overhead, the
+// handshake and the gaps between them, as in the full speed bulk budget of
+// the USB specification.
+#define TRANSACTION_BYTES           13      // Token, data PID and CRC, handshake and turnarounds.
+#define HANDSHAKE_ONLY_BYTES        9       // An IN answered with NAK or STALL.
+#define TIMEOUT_BYTES               20      // A token with no answer.
+#define SOF_BYTES                   6       // A start of frame packet.
+
+#define FLAGS_WRITTEN               0x8000  // Cleared when the stack writes a flag register.
+
+#define EP0_SIZE                    64
+#define BULK_SIZE                   64
+#define BULK_IN_ENDPOINT            1
+#define BULK_OUT_ENDPOINT           2
+
+#define CBW_SIGNATURE               0x43425355ul
+#define CSW_SIGNATURE               0x53425355ul
+#define CBW_LENGTH                  31
+#define CSW_LENGTH                  13
+
+// Control transfer stages of EP0
+#define EP0_IDLE                    0
+#define EP0_DATA_IN                 1       // Sending the data of a control read.
+#define EP0_DATA_OUT                2       // Taking the data of a control write.
+#define EP0_STATUS_IN               3       // The zero length status packet of a no-data or write request is next.
+
+// Bulk-only transport stages
+#define BOT_CBW                     0       // Waiting for a Command Block Wrapper.
+#define BOT_DATA_IN                 1
+#define BOT_DATA_OUT                2
+#define BOT_CSW                     3       // The Command Status Wrapper is next.
+
+// What the data stage of the running command moves
+#define DATA_RESPONSE               0       // The response buffer (or nothing).
+#define DATA_READ                   1       // Blocks read from the image.
+#define DATA_WRITE                  2       // Blocks written to the image.
+#define DATA_WRITE_SAME             3       // One block written to a run of blocks.
+#define DATA_DISCARD                4       // Data out for a failed command.
+
+// The hub
+#define HUB_INTERRUPT_ENDPOINT      1
+#define HUB_DESCRIPTOR_TYPE         0x29
+#define HUB_POWER_ON_TIME           50      // bPwrOn2PwrGood, in 2 ms units.
+#define PORT_RESET_BIT_TIMES        (10 * FRAME_BIT_TIMES)
+
+#define PORT_STATUS_CONNECTION      0x0001  // wPortStatus bits; the same bits of wPortChange are the changes.
+#define PORT_STATUS_ENABLE          0x0002
+#define PORT_STATUS_RESET           0x0010
+#define PORT_STATUS_POWER           0x0100
+
+#define PORT_CONNECTION             0       // Port feature selectors
+#define PORT_ENABLE                 1
+#define PORT_RESET                  4
+#define PORT_POWER                  8
+#define C_PORT_CONNECTION           16
+
+// Sense keys and additional sense codes
+#define SENSE_NONE                  0x00
+#define SENSE_ILLEGAL_REQUEST       0x05
+#define SENSE_DATA_PROTECT          0x07
+#define ASC_INVALID_COMMAND         0x20
+#define ASC_LBA_OUT_OF_RANGE        0x21
+#define ASC_INVALID_FIELD           0x24
+#define ASC_WRITE_PROTECTED         0x27
+
+
+//******************************************************************************
+//******************************************************************************
+// Section: Module Registers
+//******************************************************************************
+//******************************************************************************
+
+volatile USB_SIM_U1OTGIR    usbSimU1OTGIR;
+volatile USB_SIM_U1OTGIE    usbSimU1OTGIE;
+volatile USB_SIM_U1PWRC     usbSimU1PWRC;
+volatile USB_SIM_U1IR       usbSimU1IR;
+volatile USB_SIM_U1IE       usbSimU1IE;
+volatile USB_SIM_U1EIR      usbSimU1EIR;
+volatile USB_SIM_U1EIR      usbSimU1EIE;
+volatile USB_SIM_U1STAT     usbSimU1STAT;
+volatile USB_SIM_U1CON      usbSimU1CON;
+volatile USB_SIM_U1EP0      usbSimU1EP0;
+volatile WORD               usbSimU1EP[16];
+volatile WORD               U1OTGSTAT, U1OTGCON, U1ADDR, U1TOK, U1SOF;
+volatile WORD               U1CNFG1, U1CNFG2, U1BDTP1, U1BDTP2, U1BDTP3;
+volatile WORD               IFS5, IEC5, IPC21;
+volatile WORD               U1FRML, U1FRMH;
+
+// The U1IR flags in the order _USB1Interrupt() services them
+static const WORD interruptOrder[] =
+{
+    USB_INTERRUPT_ATTACH, USB_INTERRUPT_DETACH, USB_INTERRUPT_TRANSFER, USB_INTERRUPT_SOF,
+    USB_INTERRUPT_ERROR, USB_INTERRUPT_STALL, USB_INTERRUPT_IDLE, USB_INTERRUPT_RESUME
+};
+
+// The BDT pointer registers cannot hold a workstation address, so the
+// module uses the table in usb_host.c directly.
+extern BDT_ENTRY            BDT[];
+
+void _USB1Interrupt( void );
+
+
+//******************************************************************************
+//******************************************************************************
+// Section: Simulator Variables
+//******************************************************************************
+//******************************************************************************
+
+USB_HOST_SIM_CONFIG gUSBHostSimConfig =
+{
+    512,                    // blockSize
+    0x06,                   // scsiVersion (SPC-4)
+    FALSE,                  // writeProtect
+    0,                      // maxTransfer
+    0xFFFF,                 // maxWriteSame
+    0,                      // commandTime
+    0,                      // readTime
+    0,                      // writeTime
+    0,                      // nakEvery
+    0,                      // interruptTime
+    20,                     // taskTime
+    0,                      // hubPorts
+    0                       // configLength
+};
+
+USB_HOST_SIM_STATS  gUSBHostSimStats;
+
+// The module
+static QWORD    simTime;                // Now, in bit times.
+static QWORD    frameStart;             // Start of the current frame.
+static WORD     flagsIR;                // Interrupt flags that are set; the registers read these.
+static WORD     flagsOTGIR;
+static WORD     flagsEIR;
+static BYTE     pingPongIn;             // Odd descriptor is next for IN.
+static BYTE     pingPongOut;            // Odd descriptor is next for OUT and SETUP.
+static BYTE     resetting;              // USBRST was set the last time it was looked at.
+
+// A device on the bus: a drive, or the hub
+typedef struct _SIM_DEVICE
+{
+    BYTE    hub;                    // This is the hub.
+    BYTE    attached;
+    BYTE    deviceAddress;
+    BYTE    pendingAddress;         // Taken by SET ADDRESS at its status stage.
+    BYTE    configuration;
+    DWORD   bulkTokens;             // Bulk tokens the device could take, for nakEvery.
+
+    BYTE    ep0Stage;
+    BYTE    ep0Stalled;
+    BYTE    ep0Toggle;              // DATA1 if set.
+    BYTE    ep0Data[64];            // Data of the control read.
+    WORD    ep0Length;
+    WORD    ep0Sent;
+
+    FILE *  image;
+    DWORD   imageBlocks;
+    BYTE    bulkInToggle;
+    BYTE    bulkOutToggle;
+    BYTE    botStage;
+    BYTE    dataKind;
+    DWORD   tag;                    // dCBWTag of the running command.
+    DWORD   dataExpected;           // dCBWDataTransferLength
+    DWORD   dataMoved;
+    DWORD   dataAvailable;          // Bytes the device has for a data in stage.
+    BYTE    status;                 // bCSWStatus
+    QWORD   readyTime;              // The data or status stage starts then.
+    DWORD   blockAddress;           // Next block of the image to read or write.
+    DWORD   blocksLeft;
+    BYTE    response[64];
+    BYTE    block[4096];            // The block being read or written.
+    BYTE    senseKey;
+    BYTE    senseCode;
+} SIM_DEVICE;
+
+// A downstream port of the hub
+typedef struct _SIM_PORT
+{
+    WORD    status;                 // wPortStatus
+    WORD    change;                 // wPortChange
+    QWORD   resetEnd;               // The port reset ends then.
+} SIM_PORT;
+
+// The devices
+static SIM_DEVICE   drives[USB_HOST_SIM_MAX_DRIVES];
+static SIM_DEVICE   hubDevice;
+static SIM_PORT     ports[USB_HOST_SIM_MAX_DRIVES];     // Port n + 1 has drive n.
+static BYTE         hubToggle;                          // Of the status change endpoint.
+static SIM_DEVICE   *pDevice;                           // The device the token is for.
+
+// What is on the root port
+#define ROOT_DEVICE     (gUSBHostSimConfig.hubPorts ? &hubDevice : &drives[0])
+
+
+//******************************************************************************
+//******************************************************************************
+// Section: Descriptors
+//******************************************************************************
+//******************************************************************************
+
+static const BYTE deviceDescriptor[] =
+{
+    18, USB_DESCRIPTOR_DEVICE,
+    0x00, 0x02,                 // USB 2.0
+    0x00, 0x00, 0x00,           // Class in the interface
+    EP0_SIZE,
+    0xD8, 0x04,                 // Vendor
+    0x09, 0x00,                 // Product
+    0x00, 0x01,                 // Release
+    0, 0, 0,                    // No strings
+    1                           // Configurations
+};
+
+static const BYTE configurationDescriptor[] =
+{
+    9, USB_DESCRIPTOR_CONFIGURATION,
+    32, 0,                      // Total length
+    1, 1, 0,                    // Interfaces, value, string
+    0x80, 50,                   // Bus powered, 100 mA
+    9, USB_DESCRIPTOR_INTERFACE,
+    0, 0, 2,                    // Interface, alternate setting, endpoints
+    0x08, 0x06, 0x50, 0,        // Mass storage, SCSI, bulk-only, string
+    7, USB_DESCRIPTOR_ENDPOINT,
+    0x80 | BULK_IN_ENDPOINT, 0x02, BULK_SIZE, 0, 0,
+    7, USB_DESCRIPTOR_ENDPOINT,
+    BULK_OUT_ENDPOINT, 0x02, BULK_SIZE, 0, 0
+};
+
+static const BYTE hubDeviceDescriptor[] =
+{
+    18, USB_DESCRIPTOR_DEVICE,
+    0x00, 0x02,                 // USB 2.0
+    USB_HUB_CLASSCODE, 0x00, 0x00,  // Full speed hub
+    EP0_SIZE,
+    0xD8, 0x04,                 // Vendor
+    0x0A, 0x00,                 // Product
+    0x00, 0x01,                 // Release
+    0, 0, 0,                    // No strings
+    1                           // Configurations
+};
+
+static const BYTE hubConfigurationDescriptor[] =
+{
+    9, USB_DESCRIPTOR_CONFIGURATION,
+    25, 0,                      // Total length
+    1, 1, 0,                    // Interfaces, value, string
+    0xE0, 50,                   // Self powered, remote wakeup, 100 mA
+    9, USB_DESCRIPTOR_INTERFACE,
+    0, 0, 1,                    // Interface, alternate setting, endpoints
+    USB_HUB_CLASSCODE, 0x00, 0x00, 0,
+    7, USB_DESCRIPTOR_ENDPOINT,
+    0x80 | HUB_INTERRUPT_ENDPOINT, 0x03, 1, 0, 12   // Interrupt, 1 byte, 12 ms
+};
+
+
+//******************************************************************************
+//******************************************************************************
+// Section: Local Prototypes
+//******************************************************************************
+//******************************************************************************
+
+static void     _USBHostSim_Advance( DWORD bitTimes );
+static void     _USBHostSim_DeviceReset( SIM_DEVICE *pReset );
+static void     _USBHostSim_Interrupt( void );
+static BOOL     _USBHostSim_InterruptPending( void );
+static void     _USBHostSim_Raise( WORD ir, WORD otgir, WORD eir );
+static void     _USBHostSim_Sync( void );
+static BOOL     _USBHostSim_Token( void );
+
+static BYTE     _USBHostSim_Setup( BYTE *data );
+static BYTE     _USBHostSim_In( BYTE endpoint, BYTE *data, WORD *length, BYTE *dataPID );
+static BYTE     _USBHostSim_Out( BYTE endpoint, BYTE *data, WORD length, BYTE dataPID );
+static void     _USBHostSim_Command( BYTE *cbw );
+static void     _USBHostSim_Fail( BYTE key, BYTE code );
+static SIM_DEVICE * _USBHostSim_FindDevice( BYTE address );
+static BOOL     _USBHostSim_HubRequest( BYTE bmRequestType, BYTE bRequest, WORD wValue, WORD wIndex );
+static BYTE     _USBHostSim_HubIn( BYTE endpoint, BYTE *data, WORD *length, BYTE *dataPID );
+static void     _USBHostSim_HubPorts( void );
+
+
+// *****************************************************************************
+// *****************************************************************************
+// Section: Application Interface
+// *****************************************************************************
+// *****************************************************************************
+
+/****************************************************************************
+  Function:
+    BOOL USBHostSimOpen( const char *path )
+
+  Summary:
+    See usb_host_sim.h
+  ***************************************************************************/
+
+BOOL USBHostSimOpen( const char *path )
+{
+    USBHostSimClose();
+    memset( &gUSBHostSimStats, 0, sizeof(gUSBHostSimStats) );
+    return USBHostSimOpenDrive( 0, path );
+}
+
+
+/****************************************************************************
+  Function:
+    BOOL USBHostSimOpenDrive( BYTE drive, const char *path )
+
+  Summary:
+    See usb_host_sim.h
+  ***************************************************************************/
+
+BOOL USBHostSimOpenDrive( BYTE drive, const char *path )
+{
+    SIM_DEVICE  *pDrive;
+    off_t       size;
+    WORD        blockSize = gUSBHostSimConfig.blockSize;
+
+    if (drive >= USB_HOST_SIM_MAX_DRIVES)
+    {
+        return FALSE;
+    }
+    pDrive = &drives[drive];
+
+    USBHostSimDetachDrive( drive );
+    if (pDrive->image != NULL)
+    {
+        fclose( pDrive->image );
+        pDrive->image = NULL;
+    }
+
+    if ((blockSize < 512) || (blockSize > sizeof(pDrive->block)) || ((blockSize & (blockSize - 1)) != 0))
+    {
+        return FALSE;
+    }
+
+    if ((pDrive->image = fopen( path, gUSBHostSimConfig.writeProtect ? "rb" : "r+b" )) == NULL)
+    {
+        return FALSE;
+    }
+    if ((fseeko( pDrive->image, 0, SEEK_END ) != 0) || ((size = ftello( pDrive->image )) < blockSize))
+    {
+        fclose( pDrive->image );
+        pDrive->image = NULL;
+        return FALSE;
+    }
+    pDrive->imageBlocks = (DWORD)(size / blockSize);
+    return TRUE;
+}
+
+
+/****************************************************************************
+  Function:
+    void USBHostSimClose( void )
+
+  Summary:
+    See usb_host_sim.h
+  ***************************************************************************/
+
+void USBHostSimClose( void )
+{
+    BYTE    i;
+
+    USBHostSimDetach();
+    for (i = 0; i < USB_HOST_SIM_MAX_DRIVES; i++)
+    {
+        USBHostSimDetachDrive( i );
+        if (drives[i].image != NULL)
+        {
+            fclose( drives[i].image );
+            drives[i].image = NULL;
+        }
+    }
+}
+
+
+/****************************************************************************
+  Function:
+    void USBHostSimAttach( void )
+
+  Summary:
+    See usb_host_sim.h
+  ***************************************************************************/
+
+void USBHostSimAttach( void )
+{
+    if (gUSBHostSimConfig.hubPorts > USB_HOST_SIM_MAX_DRIVES)
+    {
+        return;
+    }
+    if (!gUSBHostSimConfig.hubPorts)
+    {
+        USBHostSimAttachDrive( 0 );
+    }
+    else if (!hubDevice.attached)
+    {
+        hubDevice.hub      = TRUE;
+        hubDevice.attached = TRUE;
+        _USBHostSim_DeviceReset( &hubDevice );
+    }
+}
+
+
+/****************************************************************************
+  Function:
+    void USBHostSimDetach( void )
+
+  Summary:
+    See usb_host_sim.h
+  ***************************************************************************/
+
+void USBHostSimDetach( void )
+{
+    if (!gUSBHostSimConfig.hubPorts)
+    {
+        USBHostSimDetachDrive( 0 );
+    }
+    else if (hubDevice.attached)
+    {
+        hubDevice.attached = FALSE;
+        _USBHostSim_DeviceReset( &hubDevice );
+        _USBHostSim_Sync();
+        _USBHostSim_Raise( USB_INTERRUPT_DETACH, 0, 0 );
+    }
+}
+
+
+/****************************************************************************
+  Function:
+    void USBHostSimAttachDrive( BYTE drive )
+
+  Summary:
+    See usb_host_sim.h
+
+  Remarks:
+    Behind the hub, the drive only shows as a connection change of its port.
+    It takes no tokens until the host has reset the port.
+  ***************************************************************************/
+
+void USBHostSimAttachDrive( BYTE drive )
+{
+    SIM_DEVICE  *pDrive = &drives[drive];
+
+    if ((drive >= USB_HOST_SIM_MAX_DRIVES) || (pDrive->image == NULL) || pDrive->attached)
+    {
+        return;
+    }
+
+    if (!gUSBHostSimConfig.hubPorts)
+    {
+        if (drive == 0)
+        {
+            pDrive->attached = TRUE;
+            _USBHostSim_DeviceReset( pDrive );
+        }
+    }
+    else if (drive < gUSBHostSimConfig.hubPorts)
+    {
+        pDrive->attached = TRUE;
+        _USBHostSim_DeviceReset( pDrive );
+        if (ports[drive].status & PORT_STATUS_POWER)
+        {
+            ports[drive].status |= PORT_STATUS_CONNECTION;
+            ports[drive].change |= PORT_STATUS_CONNECTION;
+        }
+    }
+}
+
+
+/****************************************************************************
+  Function:
+    void USBHostSimDetachDrive( BYTE drive )
+
+  Summary:
+    See usb_host_sim.h
+  ***************************************************************************/
+
+void USBHostSimDetachDrive( BYTE drive )
+{
+    SIM_DEVICE  *pDrive = &drives[drive];
+
+    if ((drive >= USB_HOST_SIM_MAX_DRIVES) || !pDrive->attached)
+    {
+        return;
+    }
+
+    pDrive->attached = FALSE;
+    if (!gUSBHostSimConfig.hubPorts)
+    {
+        _USBHostSim_Sync();
+        _USBHostSim_Raise( USB_INTERRUPT_DETACH, 0, 0 );
+    }
+    else if (ports[drive].status & PORT_STATUS_CONNECTION)
+    {
+        ports[drive].status &= PORT_STATUS_POWER;
+        ports[drive].change |= PORT_STATUS_CONNECTION;
+    }
+}
+
+
+/****************************************************************************
+  Function:
+    void USBHostSimTasks( void )
+
+  Summary:
+    See usb_host_sim.h
+
+  Remarks:
+    The tokens the stack has started and the interrupts they cause are run
+    until the bus is idle or the next token has to wait for the next frame.
+    Then the processor spends gUSBHostSimConfig.taskTime on the rest of the
+    main loop pass.  The loop stops calling the interrupt if the stack leaves
+    an enabled flag set.
+  ***************************************************************************/
+
+void USBHostSimTasks( void )
+{
+    BYTE    calls = 0;
+
+    while (TRUE)
+    {
+        _USBHostSim_Sync();
+
+        if (_USBHostSim_InterruptPending() && (calls < 8))
+        {
+            calls ++;
+            _USBHostSim_Interrupt();
+            continue;
+        }
+        calls = 0;
+
+        if (!U1CONbits.TOKBUSY || !_USBHostSim_Token())
+        {
+            break;
+        }
+    }
+
+    // Time always moves on, so a loop waiting for the bus ends.
+    _USBHostSim_Advance( gUSBHostSimConfig.taskTime ? gUSBHostSimConfig.taskTime * USB_HOST_SIM_BIT_TIMES_PER_US : 1 );
+}
+
+
+// *****************************************************************************
+// *****************************************************************************
+// Section: Module
+// *****************************************************************************
+// *****************************************************************************
+
+/****************************************************************************
+  Function:
+    void _USBHostSim_Sync( void )
+
+  Description:
+    This function takes in what the stack wrote to the registers since the
+    module last looked.
+
+  Remarks:
+    A flag register the stack wrote has lost FLAGS_WRITTEN; the flags it
+    wrote as 1 are cleared.  The registers then show the flags that are set.
+  ***************************************************************************/
+
+static void _USBHostSim_Sync( void )
+{
+    if (!(U1IR & FLAGS_WRITTEN))
+    {
+        flagsIR &= ~U1IR;
+    }
+    if (!(U1OTGIR & FLAGS_WRITTEN))
+    {
+        flagsOTGIR &= ~U1OTGIR;
+    }
+    if (!(U1EIR & FLAGS_WRITTEN))
+    {
+        flagsEIR &= ~U1EIR;
+    }
+
+    // The attach flag follows the bus state.
+    if (ROOT_DEVICE->attached && U1CONbits.HOSTEN && U1PWRCbits.USBPWR)
+    {
+        flagsIR |= USB_INTERRUPT_ATTACH;
+    }
+    else
+    {
+        flagsIR &= ~USB_INTERRUPT_ATTACH;
+    }
+    U1CONbits.JSTATE = ROOT_DEVICE->attached;
+
+    // Reset signaling resets the device and the ping-pong pointers.
+    if (U1CONbits.USBRST && !resetting && ROOT_DEVICE->attached)
+    {
+        _USBHostSim_DeviceReset( ROOT_DEVICE );
+    }
+    resetting = U1CONbits.USBRST;
+    if (resetting || U1CONbits.PPBRST)
+    {
+        pingPongIn  = 0;
+        pingPongOut = 0;
+    }
+
+    U1IR    = flagsIR | FLAGS_WRITTEN;
+    U1OTGIR = flagsOTGIR | FLAGS_WRITTEN;
+    U1EIR   = flagsEIR | FLAGS_WRITTEN;
+}
+
+
+/****************************************************************************
+  Function:
+    void _USBHostSim_Raise( WORD ir, WORD otgir, WORD eir )
+
+  Description:
+    This function sets interrupt flags.
+
+  Parameters:
+    WORD ir     - Flags to set in U1IR
+    WORD otgir  - Flags to set in U1OTGIR
+    WORD eir    - Flags to set in U1EIR; UERRIF is set with them
+  ***************************************************************************/
+
+static void _USBHostSim_Raise( WORD ir, WORD otgir, WORD eir )
+{
+    if (eir != 0)
+    {
+        ir |= USB_INTERRUPT_ERROR;
+    }
+    flagsIR    |= ir;
+    flagsOTGIR |= otgir;
+    flagsEIR   |= eir;
+
+    U1IR    = flagsIR | FLAGS_WRITTEN;
+    U1OTGIR = flagsOTGIR | FLAGS_WRITTEN;
+    U1EIR   = flagsEIR | FLAGS_WRITTEN;
+}
+
+
+/****************************************************************************
+  Function:
+    BOOL _USBHostSim_InterruptPending( void )
+
+  Description:
+    This function tells whether the USB interrupt would be taken.
+  ***************************************************************************/
+
+static BOOL _USBHostSim_InterruptPending( void )
+{
+    if (!(IEC5 & 0x0040))
+    {
+        return FALSE;
+    }
+    return ((flagsIR & U1IE & 0xFF) != 0) || ((flagsOTGIR & U1OTGIE & 0xFF) != 0);
+}
+
+
+/****************************************************************************
+  Function:
+    void _USBHostSim_Interrupt( void )
+
+  Description:
+    This function takes the USB interrupt for one of the enabled flags that
+    are set.
+
+  Remarks:
+    The handler clears each flag it services with a write of the whole
+    register, and only the last write to a register can be seen here.  So it
+    is shown one enabled flag per call, as if the other flags were raised
+    just after it returned.  The flags are taken in the order the handler
+    checks them, so a transfer is finished before the SOF that follows it
+    looks for the next token.  A later write, like the error flag after a
+    transaction has failed too often, hides the first one, so the flag shown
+    is taken as cleared once the handler has written the register.
+  ***************************************************************************/
+
+static void _USBHostSim_Interrupt( void )
+{
+    WORD    ir      = flagsIR & U1IE & 0xFF;
+    WORD    otgir   = flagsOTGIR & U1OTGIE & 0xFF;
+    BYTE    i;
+
+    if (otgir != 0)
+    {
+        otgir &= -otgir;
+        ir     = 0;
+    }
+    else
+    {
+        for (i = 0; !(ir & interruptOrder[i]); i++);
+        ir = interruptOrder[i];
+    }
+    U1IR    = (flagsIR & ~U1IE & 0xFF) | ir | FLAGS_WRITTEN;
+    U1OTGIR = (flagsOTGIR & ~U1OTGIE & 0xFF) | otgir | FLAGS_WRITTEN;
+
+    IFS5 |= 0x0040;
+    gUSBHostSimStats.interrupts ++;
+    _USB1Interrupt();
+
+    if (!(U1IR & FLAGS_WRITTEN))
+    {
+        flagsIR &= ~ir;
+    }
+    _USBHostSim_Sync();
+    _USBHostSim_Advance( gUSBHostSimConfig.interruptTime * USB_HOST_SIM_BIT_TIMES_PER_US );
+}
+
+
+/****************************************************************************
+  Function:
+    void _USBHostSim_Advance( DWORD bitTimes )
+
+  Description:
+    This function moves the simulated time on, starting frames as it goes.
+
+  Parameters:
+    DWORD bitTimes  - Time to move on
+  ***************************************************************************/
+
+static void _USBHostSim_Advance( DWORD bitTimes )
+{
+    simTime += bitTimes;
+    gUSBHostSimStats.bitTimes += bitTimes;
+
+    while (simTime >= frameStart + FRAME_BIT_TIMES)
+    {
+        frameStart += FRAME_BIT_TIMES;
+
+        if (U1PWRCbits.USBPWR)
+        {
+            _USBHostSim_Raise( 0, USB_INTERRUPT_T1MSECIF, 0 );
+            if (U1CONbits.SOFEN && U1CONbits.HOSTEN)
+            {
+                if (++U1FRML > 0xFF)
+                {
+                    U1FRML = 0;
+                    U1FRMH = (U1FRMH + 1) & 0x07;
+                }
+                gUSBHostSimStats.frames ++;
+                gUSBHostSimStats.busyBitTimes += SOF_BYTES * 8;
+                _USBHostSim_Raise( USB_INTERRUPT_SOF, 0, 0 );
+            }
+        }
+    }
+}
+
+
+/****************************************************************************
+  Function:
+    BOOL _USBHostSim_Token( void )
+
+  Description:
+    This function runs the transaction of the token in U1TOK.
+
+  Return Values:
+    TRUE    - The transaction is done
+    FALSE   - It does not fit in what is left of the frame
+
+  Remarks:
+    On the part, the Buffer Descriptor of a transaction is picked by the
+    direction and the ping-pong pointer, never by the endpoint.
+  ***************************************************************************/
+
+static BOOL _USBHostSim_Token( void )
+{
+    BDT_ENTRY   *pBDT;
+    BYTE        token       = (U1TOK >> 4) & 0x0F;
+    BYTE        endpoint    = U1TOK & 0x0F;
+    BYTE        odd;
+    BYTE        pid;
+    BYTE        dataPID     = PID_DATA0;
+    WORD        length;
+    WORD        bytes;
+    WORD        threshold;
+    QWORD       start;
+    BYTE        packet[BULK_SIZE > EP0_SIZE ? BULK_SIZE : EP0_SIZE];
+
+    // The SOF packet opens the frame, and the token must start early enough
+    // to end before the next one.
+    start = simTime;
+    if (U1CONbits.SOFEN && (start < frameStart + SOF_BYTES * 8))
+    {
+        start = frameStart + SOF_BYTES * 8;
+    }
+    threshold = (U1SOF & 0xFF) * 8;
+    if (threshold < (TRANSACTION_BYTES + BULK_SIZE) * 8)
+    {
+        threshold = (TRANSACTION_BYTES + BULK_SIZE) * 8;
+    }
+    if (start + threshold > frameStart + FRAME_BIT_TIMES)
+    {
+        return FALSE;
+    }
+    _USBHostSim_Advance( (DWORD)(start - simTime) );
+
+    // Pick the Buffer Descriptor the way the part does.
+    if (token == USB_TOKEN_IN)
+    {
+        odd = pingPongIn;
+        #if (USB_PING_PONG_MODE == USB_PING_PONG__FULL_PING_PONG)
+            pBDT = &BDT[odd];
+            pingPongIn ^= 1;
+        #else
+            pBDT = &BDT[0];
+            odd  = 0;
+        #endif
+    }
+    else
+    {
+        odd = pingPongOut;
+        #if (USB_PING_PONG_MODE == USB_PING_PONG__FULL_PING_PONG)
+            pBDT = &BDT[2 + odd];
+            pingPongOut ^= 1;
+        #elif (USB_PING_PONG_MODE == USB_PING_PONG__EP0_OUT_ONLY)
+            pBDT = &BDT[1 + odd];
+            pingPongOut ^= 1;
+        #else
+            pBDT = &BDT[1];
+            odd  = 0;
+        #endif
+    }
+
+    U1CONbits.TOKBUSY = 0;
+    U1STAT = (endpoint << 4) | ((token != USB_TOKEN_IN) ? 0x08 : 0x00) | (odd ? 0x04 : 0x00);
+
+    if (!pBDT->STAT.UOWN)
+    {
+        // The module has no buffer to use.
+        gUSBHostSimStats.errors ++;
+        _USBHostSim_Advance( TIMEOUT_BYTES * 8 );
+        _USBHostSim_Raise( 0, 0, 0x20 );    // DMAEF
+        return TRUE;
+    }
+
+    length = pBDT->count;
+    _USBHostSim_HubPorts();
+    if ((pDevice = _USBHostSim_FindDevice( U1ADDR & 0x7F )) == NULL)
+    {
+        // Nobody answers.
+        pid   = 0;
+        bytes = TIMEOUT_BYTES;
+        gUSBHostSimStats.errors ++;
+    }
+    else if (token == USB_TOKEN_SETUP)
+    {
+        gUSBHostSimStats.setupTokens ++;
+        pid   = _USBHostSim_Setup( pBDT->ADR );
+        bytes = TRANSACTION_BYTES + length;
+        gUSBHostSimStats.outBytes += length;
+    }
+    else if (token == USB_TOKEN_OUT)
+    {
+        gUSBHostSimStats.outTokens ++;
+        pid   = _USBHostSim_Out( endpoint, pBDT->ADR, length, pBDT->STAT.DTS ? PID_DATA1 : PID_DATA0 );
+        bytes = TRANSACTION_BYTES + length;
+        if (pid == PID_ACK)
+        {
+            gUSBHostSimStats.outBytes += length;
+        }
+    }
+    else
+    {
+        gUSBHostSimStats.inTokens ++;
+        pid = _USBHostSim_In( endpoint, packet, &length, &dataPID );
+        if (pid == PID_ACK)
+        {
+            bytes = TRANSACTION_BYTES + length;
+            if (length > pBDT->count)
+            {
+                // Data overrun.  The part flags it and keeps what fits.
+                gUSBHostSimStats.errors ++;
+                length = pBDT->count;
+                _USBHostSim_Raise( 0, 0, 0x08 );    // DFN8EF
+            }
+            memcpy( pBDT->ADR, packet, length );
+            pBDT->count = length;
+            pid = dataPID;
+            gUSBHostSimStats.inBytes += length;
+        }
+        else
+        {
+            bytes = HANDSHAKE_ONLY_BYTES;
+        }
+    }
+
+    if (pid == PID_NAK)
+    {
+        gUSBHostSimStats.naks ++;
+    }
+    else if (pid == PID_STALL)
+    {
+        gUSBHostSimStats.stalls ++;
+    }
+
+    pBDT->STAT.Val = pid << 2;
+    gUSBHostSimStats.busyBitTimes += bytes * 8;
+    _USBHostSim_Advance( bytes * 8 );
+    _USBHostSim_Raise( USB_INTERRUPT_TRANSFER, 0, 0 );
+    return TRUE;
+}
+
+
+// *****************************************************************************
+// *****************************************************************************
+// Section: Device
+// *****************************************************************************
+// *****************************************************************************
+
+/****************************************************************************
+  Function:
+    void _USBHostSim_DeviceReset( SIM_DEVICE *pReset )
+
+  Description:
+    This function puts a device in its state after a bus reset.
+
+  Parameters:
+    SIM_DEVICE *pReset  - The device
+
+  Remarks:
+    A hub that is reset turns its ports off, so the drives behind it can
+    no longer be reached.
+  ***************************************************************************/
+
+static void _USBHostSim_DeviceReset( SIM_DEVICE *pReset )
+{
+    pReset->deviceAddress   = 0;
+    pReset->pendingAddress  = 0;
+    pReset->configuration   = 0;
+    pReset->ep0Stage        = EP0_IDLE;
+    pReset->ep0Stalled      = FALSE;
+    pReset->bulkInToggle    = 0;
+    pReset->bulkOutToggle   = 0;
+    pReset->botStage        = BOT_CBW;
+    pReset->senseKey        = SENSE_NONE;
+    pReset->senseCode       = 0;
+
+    if (pReset->hub)
+    {
+        memset( ports, 0, sizeof(ports) );
+        hubToggle = 0;
+    }
+}
+
+
+/****************************************************************************
+  Function:
+    BOOL _USBHostSim_BulkNAK( void )
+
+  Description:
+    This function counts a bulk token the device could take, and tells
+    whether it is one that gUSBHostSimConfig.nakEvery says to NAK anyway.
+  ***************************************************************************/
+
+static BOOL _USBHostSim_BulkNAK( void )
+{
+    pDevice->bulkTokens ++;
+    return (gUSBHostSimConfig.nakEvery != 0) && ((pDevice->bulkTokens % gUSBHostSimConfig.nakEvery) == 0);
+}
+
+
+/****************************************************************************
+  Function:
+    BYTE _USBHostSim_Setup( BYTE *data )
+
+  Description:
+    This function takes the SETUP packet of a control transfer.
+
+  Parameters:
+    BYTE *data  - The 8 byte request
+
+  Returns:
+    PID_ACK; a request the device does not know stalls its data or status
+    stage.
+  ***************************************************************************/
+
+static BYTE _USBHostSim_Setup( BYTE *data )
+{
+    BYTE    bmRequestType   = data[0];
+    BYTE    bRequest        = data[1];
+    WORD    wValue          = data[2] | ((WORD)data[3] << 8);
+    WORD    wIndex          = data[4] | ((WORD)data[5] << 8);
+    WORD    wLength         = data[6] | ((WORD)data[7] << 8);
+    BOOL    known           = TRUE;
+
+    pDevice->ep0Stalled  = FALSE;
+    pDevice->ep0Toggle   = 1;
+    pDevice->ep0Length   = 0;
+    pDevice->ep0Sent     = 0;
+    pDevice->ep0Stage    = (bmRequestType & USB_SETUP_DEVICE_TO_HOST) ? EP0_DATA_IN :
+                    ((wLength != 0) ? EP0_DATA_OUT : EP0_STATUS_IN);
+
+    switch (bmRequestType & 0x7F)
+    {
+        case USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_DEVICE:
+            switch (bRequest)
+            {
+                case USB_REQUEST_GET_DESCRIPTOR:
+                    if ((wValue >> 8) == USB_DESCRIPTOR_DEVICE)
+                    {
+                        pDevice->ep0Length = sizeof(deviceDescriptor);
+                        memcpy( pDevice->ep0Data, pDevice->hub ? hubDeviceDescriptor : deviceDescriptor, pDevice->ep0Length );
+                    }
+                    else if ((wValue >> 8) == USB_DESCRIPTOR_CONFIGURATION)
+                    {
+                        if (pDevice->hub)
+                        {
+                            pDevice->ep0Length = sizeof(hubConfigurationDescriptor);
+                            memcpy( pDevice->ep0Data, hubConfigurationDescriptor, pDevice->ep0Length );
+                        }
+                        else
+                        {
+                            pDevice->ep0Length = sizeof(configurationDescriptor);
+                            memcpy( pDevice->ep0Data, configurationDescriptor, pDevice->ep0Length );
+                            if (gUSBHostSimConfig.configLength != 0)
+                            {
+                                pDevice->ep0Data[2] = (BYTE)gUSBHostSimConfig.configLength;
+                                pDevice->ep0Data[3] = (BYTE)(gUSBHostSimConfig.configLength >> 8);
+                            }
+                        }
+                    }
+                    else
+                    {
+                        known = FALSE;
+                    }
+                    break;
+
+                case USB_REQUEST_SET_ADDRESS:
+                    pDevice->pendingAddress = wValue & 0x7F;
+                    break;
+
+                case USB_REQUEST_SET_CONFIGURATION:
+                    pDevice->configuration = (BYTE)wValue;
+                    pDevice->bulkInToggle  = 0;
+                    pDevice->bulkOutToggle = 0;
+                    pDevice->botStage      = BOT_CBW;
+                    if (pDevice->hub)
+                    {
+                        hubToggle = 0;
+                    }
+                    break;
+
+                case USB_REQUEST_GET_CONFIGURATION:
+                    pDevice->ep0Data[0] = pDevice->configuration;
+                    pDevice->ep0Length  = 1;
+                    break;
+
+                case USB_REQUEST_GET_STATUS:
+                    pDevice->ep0Data[0] = 0;
+                    pDevice->ep0Data[1] = 0;
+                    pDevice->ep0Length  = 2;
+                    break;
+
+                default:
+                    known = FALSE;
+                    break;
+            }
+            break;
+
+        case USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_ENDPOINT:
+            if ((bRequest == USB_REQUEST_CLEAR_FEATURE) && (wValue == USB_FEATURE_ENDPOINT_HALT))
+            {
+                if (pDevice->hub)
+                {
+                    hubToggle = 0;
+                }
+                else if ((wIndex & 0x0F) == BULK_IN_ENDPOINT)
+                {
+                    pDevice->bulkInToggle = 0;
+                }
+                else if ((wIndex & 0x0F) == BULK_OUT_ENDPOINT)
+                {
+                    pDevice->bulkOutToggle = 0;
+                }
+            }
+            else if (bRequest == USB_REQUEST_GET_STATUS)
+            {
+                pDevice->ep0Data[0] = 0;
+                pDevice->ep0Data[1] = 0;
+                pDevice->ep0Length  = 2;
+            }
+            else
+            {
+                known = FALSE;
+            }
+            break;
+
+        case USB_SETUP_TYPE_CLASS | USB_SETUP_RECIPIENT_DEVICE:
+        case USB_SETUP_TYPE_CLASS | USB_SETUP_RECIPIENT_OTHER:
+            known = pDevice->hub && _USBHostSim_HubRequest( bmRequestType, bRequest, wValue, wIndex );
+            break;
+
+        case USB_SETUP_TYPE_CLASS | USB_SETUP_RECIPIENT_INTERFACE:
+            if (pDevice->hub)
+            {
+                known = FALSE;
+            }
+            else if (bRequest == 0xFE)      // Get Max LUN
+            {
+                pDevice->ep0Data[0] = 0;
+                pDevice->ep0Length  = 1;
+            }
+            else if (bRequest == 0xFF)      // Bulk-Only Mass Storage Reset
+            {
+                pDevice->botStage = BOT_CBW;
+            }
+            else
+            {
+                known = FALSE;
+            }
+            break;
+
+        default:
+            known = FALSE;
+            break;
+    }
+
+    if (!known)
+    {
+        pDevice->ep0Stalled = TRUE;
+    }
+    if (pDevice->ep0Length > wLength)
+    {
+        pDevice->ep0Length = wLength;
+    }
+    return PID_ACK;
+}
+
+
+/****************************************************************************
+  Function:
+    BYTE _USBHostSim_In( BYTE endpoint, BYTE *data, WORD *length, BYTE *dataPID )
+
+  Description:
+    This function answers an IN token.
+
+  Parameters:
+    BYTE endpoint   - Endpoint number
+    BYTE *data      - Where the data packet goes
+    WORD *length    - Returns the length of the data packet
+    BYTE *dataPID   - Returns PID_DATA0 or PID_DATA1
+
+  Returns:
+    PID_ACK if a data packet was sent (the host is taken to acknowledge it),
+    otherwise PID_NAK or PID_STALL.
+  ***************************************************************************/
+
+static BYTE _USBHostSim_In( BYTE endpoint, BYTE *data, WORD *length, BYTE *dataPID )
+{
+    DWORD   n;
+
+    *length = 0;
+
+    if (endpoint == 0)
+    {
+        if (pDevice->ep0Stalled)
+        {
+            return PID_STALL;
+        }
+        if (pDevice->ep0Stage == EP0_DATA_IN)
+        {
+            n = pDevice->ep0Length - pDevice->ep0Sent;
+            if (n > EP0_SIZE)
+            {
+                n = EP0_SIZE;
+            }
+            memcpy( data, pDevice->ep0Data + pDevice->ep0Sent, n );
+            pDevice->ep0Sent += n;
+            *length = n;
+        }
+        else if (pDevice->ep0Stage == EP0_STATUS_IN)
+        {
+            if (pDevice->pendingAddress != 0)
+            {
+                pDevice->deviceAddress  = pDevice->pendingAddress;
+                pDevice->pendingAddress = 0;
+            }
+            pDevice->ep0Stage = EP0_IDLE;
+        }
+        else
+        {
+            return PID_STALL;
+        }
+        *dataPID = pDevice->ep0Toggle ? PID_DATA1 : PID_DATA0;
+        pDevice->ep0Toggle ^= 1;
+        return PID_ACK;
+    }
+
+    if (pDevice->hub)
+    {
+        return _USBHostSim_HubIn( endpoint, data, length, dataPID );
+    }
+    if ((endpoint != BULK_IN_ENDPOINT) || (pDevice->configuration == 0))
+    {
+        return PID_STALL;
+    }
+    if ((pDevice->botStage != BOT_DATA_IN) && (pDevice->botStage != BOT_CSW))
+    {
+        return PID_NAK;
+    }
+
+    if (pDevice->botStage == BOT_DATA_IN)
+    {
+        if (pDevice->dataKind == DATA_READ)
+        {
+            // Each block is ready once the device has had the time to read it.
+            if (simTime < pDevice->readyTime + (QWORD)gUSBHostSimConfig.readTime * USB_HOST_SIM_BIT_TIMES_PER_US *
+                                        (pDevice->dataMoved / gUSBHostSimConfig.blockSize + 1))
+            {
+                return PID_NAK;
+            }
+        }
+        else if (simTime < pDevice->readyTime)
+        {
+            return PID_NAK;
+        }
+        if (_USBHostSim_BulkNAK())
+        {
+            return PID_NAK;
+        }
+
+        n = pDevice->dataAvailable - pDevice->dataMoved;
+        if (n > BULK_SIZE)
+        {
+            n = BULK_SIZE;
+        }
+        if (pDevice->dataKind == DATA_READ)
+        {
+            if ((pDevice->dataMoved % gUSBHostSimConfig.blockSize) == 0)
+            {
+                if ((fseeko( pDevice->image, (off_t)pDevice->blockAddress * gUSBHostSimConfig.blockSize, SEEK_SET ) != 0) ||
+                    (fread( pDevice->block, gUSBHostSimConfig.blockSize, 1, pDevice->image ) != 1))
+                {
+                    memset( pDevice->block, 0, gUSBHostSimConfig.blockSize );
+                }
+                pDevice->blockAddress ++;
+            }
+            memcpy( data, pDevice->block + (pDevice->dataMoved % gUSBHostSimConfig.blockSize), n );
+        }
+        else
+        {
+            memcpy( data, pDevice->response + pDevice->dataMoved, n );
+        }
+        pDevice->dataMoved += n;
+        *length = n;
+
+        // A short packet, or all the host asked for, ends the stage.
+        if ((n < BULK_SIZE) || (pDevice->dataMoved == pDevice->dataExpected))
+        {
+            pDevice->botStage = BOT_CSW;
+        }
+    }
+    else
+    {
+        if (simTime < pDevice->readyTime)
+        {
+            return PID_NAK;
+        }
+        if (_USBHostSim_BulkNAK())
+        {
+            return PID_NAK;
+        }
+
+        data[0]  = (BYTE)CSW_SIGNATURE;
+        data[1]  = (BYTE)(CSW_SIGNATURE >> 8);
+        data[2]  = (BYTE)(CSW_SIGNATURE >> 16);
+        data[3]  = (BYTE)(CSW_SIGNATURE >> 24);
+        data[4]  = (BYTE)pDevice->tag;
+        data[5]  = (BYTE)(pDevice->tag >> 8);
+        data[6]  = (BYTE)(pDevice->tag >> 16);
+        data[7]  = (BYTE)(pDevice->tag >> 24);
+        n = pDevice->dataExpected - pDevice->dataMoved;
+        data[8]  = (BYTE)n;
+        data[9]  = (BYTE)(n >> 8);
+        data[10] = (BYTE)(n >> 16);
+        data[11] = (BYTE)(n >> 24);
+        data[12] = pDevice->status;
+        *length  = CSW_LENGTH;
+        pDevice->botStage = BOT_CBW;
+    }
+
+    *dataPID = pDevice->bulkInToggle ? PID_DATA1 : PID_DATA0;
+    pDevice->bulkInToggle ^= 1;
+    return PID_ACK;
+}
+
+
+/****************************************************************************
+  Function:
+    BYTE _USBHostSim_Out( BYTE endpoint, BYTE *data, WORD length, BYTE dataPID )
+
+  Description:
+    This function takes the data packet of an OUT token.
+
+  Parameters:
+    BYTE endpoint   - Endpoint number
+    BYTE *data      - The data packet
+    WORD length     - Its length
+    BYTE dataPID    - PID_DATA0 or PID_DATA1
+
+  Returns:
+    PID_ACK, PID_NAK or PID_STALL
+  ***************************************************************************/
+
+static BYTE _USBHostSim_Out( BYTE endpoint, BYTE *data, WORD length, BYTE dataPID )
+{
+    WORD    blockSize = gUSBHostSimConfig.blockSize;
+    WORD    packetLength = length;
+    WORD    offset;
+    WORD    n;
+
+    if (endpoint == 0)
+    {
+        if (pDevice->ep0Stalled)
+        {
+            return PID_STALL;
+        }
+        if (pDevice->ep0Stage == EP0_DATA_IN)
+        {
+            // Status stage of a control read.
+            pDevice->ep0Stage = EP0_IDLE;
+        }
+        else if (pDevice->ep0Stage == EP0_DATA_OUT)
+        {
+            // The data of control writes is not used.
+            pDevice->ep0Stage = EP0_STATUS_IN;
+        }
+        return PID_ACK;
+    }
+
+    if ((endpoint != BULK_OUT_ENDPOINT) || (pDevice->configuration == 0) || pDevice->hub)
+    {
+        return PID_STALL;
+    }
+    if ((pDevice->botStage != BOT_CBW) && (pDevice->botStage != BOT_DATA_OUT))
+    {
+        // The next command waits until the status has been read.
+        return PID_NAK;
+    }
+    if ((pDevice->botStage == BOT_DATA_OUT) && (simTime < pDevice->readyTime))
+    {
+        return PID_NAK;
+    }
+    if (_USBHostSim_BulkNAK())
+    {
+        return PID_NAK;
+    }
+
+    if ((dataPID == PID_DATA1) != (pDevice->bulkOutToggle != 0))
+    {
+        // A repeat of a packet that was taken; the host missed the ACK.
+        return PID_ACK;
+    }
+    pDevice->bulkOutToggle ^= 1;
+
+    if (pDevice->botStage == BOT_CBW)
+    {
+        if ((length == CBW_LENGTH) &&
+            ((data[0] | ((DWORD)data[1] << 8) | ((DWORD)data[2] << 16) | ((DWORD)data[3] << 24)) == CBW_SIGNATURE))
+        {
+            gUSBHostSimStats.commands ++;
+            _USBHostSim_Command( data );
+        }
+        return PID_ACK;
+    }
+
+    // Data out stage
+    while ((length != 0) && (pDevice->dataMoved < pDevice->dataExpected))
+    {
+        offset = pDevice->dataMoved % blockSize;
+        n = blockSize - offset;
+        if (n > length)
+        {
+            n = length;
+        }
+        if (pDevice->dataMoved + n > pDevice->dataExpected)
+        {
+            n = pDevice->dataExpected - pDevice->dataMoved;
+        }
+        memcpy( pDevice->block + offset, data, n );
+        data      += n;
+        length    -= n;
+        pDevice->dataMoved += n;
+
+        if ((offset + n == blockSize) && (pDevice->dataKind != DATA_DISCARD) && (pDevice->blocksLeft != 0))
+        {
+            do
+            {
+                if ((fseeko( pDevice->image, (off_t)pDevice->blockAddress * blockSize, SEEK_SET ) != 0) ||
+                    (fwrite( pDevice->block, blockSize, 1, pDevice->image ) != 1))
+                {
+                    _USBHostSim_Fail( 0x03, 0x0C );     // MEDIUM ERROR, WRITE ERROR
+                }
+                pDevice->blockAddress ++;
+                pDevice->blocksLeft --;
+            } while ((pDevice->dataKind == DATA_WRITE_SAME) && (pDevice->blocksLeft != 0));
+        }
+    }
+
+    if ((pDevice->dataMoved == pDevice->dataExpected) || (packetLength < BULK_SIZE))
+    {
+        pDevice->botStage  = BOT_CSW;
+        pDevice->readyTime = simTime + (QWORD)gUSBHostSimConfig.writeTime * USB_HOST_SIM_BIT_TIMES_PER_US *
+                        (pDevice->dataMoved / blockSize);
+    }
+    return PID_ACK;
+}
+
+
+/****************************************************************************
+  Function:
+    void _USBHostSim_Fail( BYTE key, BYTE code )
+
+  Description:
+    This function ends the running command with a failed status and keeps
+    the sense data for REQUEST SENSE.
+  ***************************************************************************/
+
+static void _USBHostSim_Fail( BYTE key, BYTE code )
+{
+    pDevice->status    = 0x01;
+    pDevice->senseKey  = key;
+    pDevice->senseCode = code;
+}
+
+
+/****************************************************************************
+  Function:
+    void _USBHostSim_Command( BYTE *cbw )
+
+  Description:
+    This function starts the command in a Command Block Wrapper.
+
+  Parameters:
+    BYTE *cbw   - The 31 byte wrapper
+  ***************************************************************************/
+
+static void _USBHostSim_Command( BYTE *cbw )
+{
+    BYTE    *cb         = cbw + 15;
+    BOOL    dataIn      = (cbw[12] & 0x80) != 0;
+    WORD    blockSize   = gUSBHostSimConfig.blockSize;
+    DWORD   last        = pDevice->imageBlocks - 1;
+    DWORD   count;
+
+    pDevice->tag             = cbw[4] | ((DWORD)cbw[5] << 8) | ((DWORD)cbw[6] << 16) | ((DWORD)cbw[7] << 24);
+    pDevice->dataExpected    = cbw[8] | ((DWORD)cbw[9] << 8) | ((DWORD)cbw[10] << 16) | ((DWORD)cbw[11] << 24);
+    pDevice->dataMoved       = 0;
+    pDevice->dataAvailable   = 0;
+    pDevice->dataKind        = DATA_RESPONSE;
+    pDevice->status          = 0x00;
+    pDevice->readyTime       = simTime + (QWORD)gUSBHostSimConfig.commandTime * USB_HOST_SIM_BIT_TIMES_PER_US;
+    pDevice->blockAddress    = ((DWORD)cb[2] << 24) | ((DWORD)cb[3] << 16) | ((DWORD)cb[4] << 8) | cb[5];
+    pDevice->blocksLeft      = 0;
+    count           = ((WORD)cb[7] << 8) | cb[8];
+
+    memset( pDevice->response, 0, sizeof(pDevice->response) );
+
+    switch (cb[0])
+    {
+        case 0x00:      // TEST UNIT READY
+            break;
+
+        case 0x03:      // REQUEST SENSE
+            pDevice->response[0]  = 0x70;
+            pDevice->response[2]  = pDevice->senseKey;
+            pDevice->response[7]  = 10;
+            pDevice->response[12] = pDevice->senseCode;
+            pDevice->dataAvailable = 18;
+            pDevice->senseKey  = SENSE_NONE;
+            pDevice->senseCode = 0;
+            break;
+
+        case 0x12:      // INQUIRY
+            if (!(cb[1] & 0x01))
+            {
+                pDevice->response[1] = 0x80;                 // Removable
+                pDevice->response[2] = gUSBHostSimConfig.scsiVersion;
+                pDevice->response[3] = 0x02;
+                pDevice->response[4] = 31;
+                memcpy( pDevice->response + 8, "Sim     USB Host Sim    1.00", 28 );
+                pDevice->dataAvailable = 36;
+            }
+            else if ((cb[2] == 0xB0) && (gUSBHostSimConfig.scsiVersion >= 0x05))
+            {
+                pDevice->response[1] = 0xB0;                 // Block Limits
+                pDevice->response[3] = 0x3C;
+                pDevice->response[10] = (BYTE)(gUSBHostSimConfig.maxTransfer >> 8);
+                pDevice->response[11] = (BYTE)gUSBHostSimConfig.maxTransfer;
+                pDevice->response[42] = (BYTE)(gUSBHostSimConfig.maxWriteSame >> 8);
+                pDevice->response[43] = (BYTE)gUSBHostSimConfig.maxWriteSame;
+                pDevice->dataAvailable = 64;
+            }
+            else
+            {
+                _USBHostSim_Fail( SENSE_ILLEGAL_REQUEST, ASC_INVALID_FIELD );
+            }
+            break;
+
+        case 0x1A:      // MODE SENSE 6
+            pDevice->response[0] = 3;
+            pDevice->response[2] = gUSBHostSimConfig.writeProtect ? 0x80 : 0x00;
+            pDevice->dataAvailable = 4;
+            break;
+
+        case 0x25:      // READ CAPACITY 10
+            pDevice->response[0] = (BYTE)(last >> 24);
+            pDevice->response[1] = (BYTE)(last >> 16);
+            pDevice->response[2] = (BYTE)(last >> 8);
+            pDevice->response[3] = (BYTE)last;
+            pDevice->response[6] = (BYTE)(blockSize >> 8);
+            pDevice->response[7] = (BYTE)blockSize;
+            pDevice->dataAvailable = 8;
+            break;
+
+        case 0x28:      // READ 10
+        case 0x2A:      // WRITE 10
+        case 0x41:      // WRITE SAME 10
+            if ((cb[0] == 0x41) && ((gUSBHostSimConfig.scsiVersion < 0x05) || (gUSBHostSimConfig.maxWriteSame == 0)))
+            {
+                _USBHostSim_Fail( SENSE_ILLEGAL_REQUEST, ASC_INVALID_COMMAND );
+            }
+            else if ((cb[0] == 0x41) && (count > gUSBHostSimConfig.maxWriteSame))
+            {
+                _USBHostSim_Fail( SENSE_ILLEGAL_REQUEST, ASC_INVALID_FIELD );
+            }
+            else if ((cb[0] != 0x41) && (gUSBHostSimConfig.scsiVersion >= 0x05) &&
+                     (gUSBHostSimConfig.maxTransfer != 0) && (count > gUSBHostSimConfig.maxTransfer))
+            {
+                _USBHostSim_Fail( SENSE_ILLEGAL_REQUEST, ASC_INVALID_FIELD );
+            }
+            else if ((pDevice->blockAddress > last) || (count > pDevice->imageBlocks - pDevice->blockAddress))
+            {
+                _USBHostSim_Fail( SENSE_ILLEGAL_REQUEST, ASC_LBA_OUT_OF_RANGE );
+            }
+            else if ((cb[0] != 0x28) && gUSBHostSimConfig.writeProtect)
+            {
+                _USBHostSim_Fail( SENSE_DATA_PROTECT, ASC_WRITE_PROTECTED );
+            }
+            else if (cb[0] == 0x28)
+            {
+                pDevice->dataKind      = DATA_READ;
+                pDevice->blocksLeft    = count;
+                pDevice->dataAvailable = count * blockSize;
+            }
+            else
+            {
+                pDevice->dataKind   = (cb[0] == 0x2A) ? DATA_WRITE : DATA_WRITE_SAME;
+                pDevice->blocksLeft = count;
+            }
+            break;
+
+        default:
+            _USBHostSim_Fail( SENSE_ILLEGAL_REQUEST, ASC_INVALID_COMMAND );
+            break;
+    }
+
+    if (pDevice->dataExpected == 0)
+    {
+        pDevice->botStage = BOT_CSW;
+    }
+    else if (dataIn)
+    {
+        if (pDevice->dataAvailable > pDevice->dataExpected)
+        {
+            pDevice->dataAvailable = pDevice->dataExpected;
+        }
+        pDevice->botStage = BOT_DATA_IN;
+    }
+    else
+    {
+        if ((pDevice->dataKind != DATA_WRITE) && (pDevice->dataKind != DATA_WRITE_SAME))
+        {
+            pDevice->dataKind = DATA_DISCARD;
+        }
+        pDevice->botStage = BOT_DATA_OUT;
+    }
+}
+
+
+// *****************************************************************************
+// *****************************************************************************
+// Section: Hub
+// *****************************************************************************
+// *****************************************************************************
+
+/****************************************************************************
+  Function:
+    SIM_DEVICE * _USBHostSim_FindDevice( BYTE address )
+
+  Description:
+    This function finds the device that answers a token sent to an address.
+
+  Parameters:
+    BYTE address    - The address in U1ADDR
+
+  Returns:
+    The device, or NULL if nobody answers
+
+  Remarks:
+    A drive behind the hub can only be reached through an enabled port.
+  ***************************************************************************/
+
+static SIM_DEVICE * _USBHostSim_FindDevice( BYTE address )
+{
+    BYTE    i;
+
+    if (ROOT_DEVICE->attached && (ROOT_DEVICE->deviceAddress == address))
+    {
+        return ROOT_DEVICE;
+    }
+    if (!gUSBHostSimConfig.hubPorts || !hubDevice.attached || (hubDevice.configuration == 0))
+    {
+        return NULL;
+    }
+    for (i = 0; i < gUSBHostSimConfig.hubPorts; i++)
+    {
+        if (drives[i].attached && (ports[i].status & PORT_STATUS_ENABLE) &&
+            (drives[i].deviceAddress == address))
+        {
+            return &drives[i];
+        }
+    }
+    return NULL;
+}
+
+
+/****************************************************************************
+  Function:
+    void _USBHostSim_HubPorts( void )
+
+  Description:
+    This function ends the port resets whose time has come.
+
+  Remarks:
+    The drive on the port is reset with it, and the port is enabled if the
+    drive is still there.
+  ***************************************************************************/
+
+static void _USBHostSim_HubPorts( void )
+{
+    BYTE    i;
+
+    for (i = 0; i < gUSBHostSimConfig.hubPorts; i++)
+    {
+        if ((ports[i].status & PORT_STATUS_RESET) && (simTime >= ports[i].resetEnd))
+        {
+            ports[i].status &= ~PORT_STATUS_RESET;
+            ports[i].change |= PORT_STATUS_RESET;
+            if (drives[i].attached)
+            {
+                _USBHostSim_DeviceReset( &drives[i] );
+                ports[i].status |= PORT_STATUS_ENABLE;
+            }
+        }
+    }
+}
+
+
+/****************************************************************************
+  Function:
+    BOOL _USBHostSim_HubRequest( BYTE bmRequestType, BYTE bRequest,
+                        WORD wValue, WORD wIndex )
+
+  Description:
+    This function takes a hub class request.
+
+  Parameters:
+    BYTE bmRequestType  - Request type
+    BYTE bRequest       - Request
+    WORD wValue         - Descriptor type or feature selector
+    WORD wIndex         - Port
+
+  Return Values:
+    TRUE    - The request was taken
+    FALSE   - The hub stalls it
+  ***************************************************************************/
+
+static BOOL _USBHostSim_HubRequest( BYTE bmRequestType, BYTE bRequest, WORD wValue, WORD wIndex )
+{
+    SIM_PORT    *pPort;
+    BYTE        port = (BYTE)wIndex;
+
+    if ((bmRequestType & 0x1F) == USB_SETUP_RECIPIENT_DEVICE)
+    {
+        memset( pDevice->ep0Data, 0, sizeof(pDevice->ep0Data) );
+        if ((bRequest == USB_REQUEST_GET_DESCRIPTOR) && ((wValue >> 8) == HUB_DESCRIPTOR_TYPE))
+        {
+            pDevice->ep0Data[0] = 9;
+            pDevice->ep0Data[1] = HUB_DESCRIPTOR_TYPE;
+            pDevice->ep0Data[2] = gUSBHostSimConfig.hubPorts;
+            pDevice->ep0Data[3] = 0x09;                 // Individual power switching and over-current
+            pDevice->ep0Data[5] = HUB_POWER_ON_TIME;
+            pDevice->ep0Data[6] = 100;
+            pDevice->ep0Data[8] = 0xFF;
+            pDevice->ep0Length  = 9;
+            return TRUE;
+        }
+        if (bRequest == USB_REQUEST_GET_STATUS)
+        {
+            pDevice->ep0Length = 4;
+            return TRUE;
+        }
+        return (bRequest == USB_REQUEST_CLEAR_FEATURE) || (bRequest == USB_REQUEST_SET_FEATURE);
+    }
+
+    if ((port == 0) || (port > gUSBHostSimConfig.hubPorts))
+    {
+        return FALSE;
+    }
+    pPort = &ports[port - 1];
+
+    switch (bRequest)
+    {
+        case USB_REQUEST_GET_STATUS:
+            pDevice->ep0Data[0] = (BYTE)pPort->status;
+            pDevice->ep0Data[1] = (BYTE)(pPort->status >> 8);
+            pDevice->ep0Data[2] = (BYTE)pPort->change;
+            pDevice->ep0Data[3] = (BYTE)(pPort->change >> 8);
+            pDevice->ep0Length  = 4;
+            return TRUE;
+
+        case USB_REQUEST_SET_FEATURE:
+            if ((wValue == PORT_POWER) && !(pPort->status & PORT_STATUS_POWER))
+            {
+                pPort->status |= PORT_STATUS_POWER;
+                if (drives[port - 1].attached)
+                {
+                    pPort->status |= PORT_STATUS_CONNECTION;
+                    pPort->change |= PORT_STATUS_CONNECTION;
+                }
+            }
+            else if ((wValue == PORT_RESET) && (pPort->status & PORT_STATUS_CONNECTION))
+            {
+                pPort->status  |= PORT_STATUS_RESET;
+                pPort->status  &= ~PORT_STATUS_ENABLE;
+                pPort->resetEnd = simTime + PORT_RESET_BIT_TIMES;
+            }
+            return TRUE;
+
+        case USB_REQUEST_CLEAR_FEATURE:
+            if (wValue == PORT_ENABLE)
+            {
+                pPort->status &= ~PORT_STATUS_ENABLE;
+            }
+            else if (wValue == PORT_POWER)
+            {
+                pPort->status = 0;
+            }
+            else if (wValue >= C_PORT_CONNECTION)
+            {
+                pPort->change &= ~(1 << (wValue - C_PORT_CONNECTION));
+            }
+            return TRUE;
+
+        default:
+            return FALSE;
+    }
+}
+
+
+/****************************************************************************
+  Function:
+    BYTE _USBHostSim_HubIn( BYTE endpoint, BYTE *data, WORD *length, BYTE *dataPID )
+
+  Description:
+    This function answers an IN token to the status change endpoint of the
+    hub.
+
+  Parameters:
+    BYTE endpoint   - Endpoint number
+    BYTE *data      - Where the data packet goes
+    WORD *length    - Returns the length of the data packet
+    BYTE *dataPID   - Returns PID_DATA0 or PID_DATA1
+
+  Returns:
+    PID_ACK with the bitmap of the ports that changed, PID_NAK if none has,
+    or PID_STALL.
+  ***************************************************************************/
+
+static BYTE _USBHostSim_HubIn( BYTE endpoint, BYTE *data, WORD *length, BYTE *dataPID )
+{
+    BYTE    i;
+
+    if ((endpoint != HUB_INTERRUPT_ENDPOINT) || (pDevice->configuration == 0))
+    {
+        return PID_STALL;
+    }
+
+    data[0] = 0;
+    for (i = 0; i < gUSBHostSimConfig.hubPorts; i++)
+    {
+        if (ports[i].change != 0)
+        {
+            data[0] |= 2 << i;
+        }
+    }
+    if (data[0] == 0)
+    {
+        return PID_NAK;
+    }
+
+    *length   = 1;
+    *dataPID  = hubToggle ? PID_DATA1 : PID_DATA0;
+    hubToggle ^= 1;
+    return PID_ACK;
+}
@@ -108,6 +108,10 @@ KO          14-Feb-2008 First release
 //******************************************************************************
 //******************************************************************************
 
+// Space reserved on the flash drive when a capture starts, so the capture
+// file does not have to allocate clusters while samples are being written.
+#define CAPTURE_RESERVE_SIZE        (256ul * 1024)
+
 // To control the color, write the inverse of the saturation value to the PWM.
 #define CONVERT_TO_COLOR(x)         (~x & 0xFF)
 
@@ -301,6 +305,9 @@ void CaptureMonitorMedia( void )
     BYTE            mountTries;
 
     USBTasks();
+#ifdef FS_BACKGROUND_WRITES
+    FSWriteQueueTasks();
+#endif
 
     mediaPresentNow = USBHostMSDSCSIMediaDetect();
     if (mediaPresentNow != mediaPresent)
@@ -315,7 +322,7 @@ void CaptureMonitorMedia( void )
                 if (screenState == SCREEN_CAPTURE_MEDIA)
                 {
                     // Open the capture file
-                    if ((captureFile = FSfopen( "CAPTURE.CSV", "w" )) == NULL)
+                    if ((captureFile = FSfopenReserve( "CAPTURE.CSV", "w", CAPTURE_RESERVE_SIZE )) == NULL)
                     {
                         // Shut down the USB.
                         USBHostShutdown();
@@ -49,6 +49,12 @@
 // memory usage
 #define FS_MAX_FILES_OPEN    2
 
+// Number of volumes that can be mounted at once, as drives A:, B:, ... (up to
+// 26). Each can be on its own media unit (a LUN of a USB device) or MBR
+// partition, and has its own current working directory. Names and paths can
+// start with the drive letter ("B:LOG.TXT"). Costs about 200 bytes per volume
+#define FS_MAX_VOLUMES       2
+
 
 // Comment this line out if you don't intend to write data to the card
 #define ALLOW_WRITES
@@ -59,6 +65,56 @@
 #define ALLOW_DIRS
 // Uncomment this to use the FindFirst, FindNext, and FindPrev
 #define ALLOW_FILESEARCH
+// Comment this line out to drop FAT32 support (mount, format and
+// 32-bit cluster chains) and save code space
+#define SUPPORT_FAT32
+// Size in bytes of the free cluster map; each bit covers a group of clusters
+// so allocation can skip parts of the FAT that are known to be full.
+// Comment this line out to scan the FAT linearly and save the RAM
+#define FS_FREE_MAP_SIZE    64
+// Number of FAT sectors kept in RAM (MEDIA_SECTOR_SIZE bytes each). Changed
+// sectors are written to every FAT copy when evicted or when a file is closed.
+// More than one lets several open files walk their cluster chains without
+// evicting each other's FAT sectors
+#define FS_FAT_CACHE_SECTORS    4
+// Number of runs of contiguous clusters remembered per open file (8 bytes each)
+// so seeks and reads can find a cluster without following the FAT chain.
+// Comment this line out to always follow the chain
+#define FS_EXTENT_MAP_SIZE      8
+// Give every open file its own MEDIA_SECTOR_SIZE data buffer instead of
+// sharing one, so reading one file while writing another doesn't keep
+// flushing and reloading it. Costs FS_MAX_FILES_OPEN sectors of RAM (taken
+// with FS_malloc when FS_DYNAMIC_MEM is used). Comment out to share one buffer
+#define FS_FILE_BUFFERS
+// Number of recently found directory entries remembered (about 32 bytes each)
+// so opening a file or changing directory again doesn't scan the directory.
+// Comment this line out to always search the directory
+#define FS_DIR_CACHE_SIZE       8
+// Read and write VFAT long file names. Names that aren't 8.3 are kept in long
+// name entries next to a NAME~N.EXT alias, and FindFirst/FindNext return them
+// in longFilename. Comment this line out to handle 8.3 names only
+#define SUPPORT_LFN
+// Longest long file name handled (up to 255 characters). Costs two buffers of
+// this size plus one in every SearchRec
+#define FS_LFN_MAX_CHARS        64
+// Queue the sectors the file system writes and send them to the media in the
+// background, so FSfwrite returns at once. FSWriteQueueTasks() must then be
+// called from the main loop. Comment this line out to write in the foreground.
+// Left out on this board: with the other buffers above, its RAM would not
+// leave room for the stack
+//#define FS_BACKGROUND_WRITES
+// Sectors in the write queue. Costs a 512 byte buffer each
+//#define FS_WRITE_QUEUE_SECTORS  4
+// Keep this many written sectors in RAM and write them back sorted, so sectors
+// written again (FAT, directory) go out once and consecutive ones go out with
+// one command. FSfclose, FSfflush, FSsync and FSunmount write them back.
+// Costs a 512 byte buffer each. Comment out to write at once
+//#define FS_WRITE_CACHE_SECTORS  4
+// Once a file has been read across a sector boundary in order, read up to this
+// many of the sectors after it with one command. Costs a 512 byte buffer each.
+// Comment out to read sector by sector. Left out on this board for the same
+// reason as the write queue
+//#define FS_READ_AHEAD_SECTORS   4
 // Allows the use of FATfopenpgm, FATremovepgm, etc with PIC18
 //#define ALLOW_PGMFUNCTIONS
 // Allows the use of the FATfprintf function
@@ -71,11 +127,15 @@
     #define SYSTEM_CLOCK    8000000ul
 #endif
 
-// The size of a sector
+// The size of the sector buffers, so the largest sector size the media can
+// have.  Drives with 4096 byte logical blocks need 4096 here, which makes
+// every sector buffer above eight times larger; the smaller sectors of
+// other drives then use part of each buffer.
 #define MEDIA_SECTOR_SIZE       512
 
 
-// Defines the device type
+// Defines the device type. "MDD File System/FSblockdev.h" instead lets the
+// application pick the driver at run time with FSSetBlockDevice
 #define INCLUDEFILE       "USB\usb_host_msd_scsi.h"
 
 #if defined( __C30__ )
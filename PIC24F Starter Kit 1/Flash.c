@@ -78,7 +78,7 @@ KO          14-Feb-2008 First release
 
 #define BUTTON_HEIGHT               0
 #define DIRECTORY_NAME_POSITION     (2*sizeof(XCHAR))
-#define FILE_INFO_SIZE              (12+4+1)    // 8.3, up to 4 leading chars, null
+#define FILE_INFO_SIZE(n)           ((n)+4+1)   // name, up to 4 leading chars, null
 #define FILENAME_IS_FILE            2
 #define FILENAME_IS_SUBDIRECTORY    1
 #define HELLO_WORLD                 "Insert media..."
@@ -124,7 +124,7 @@ VOLUME_INFO             volume;
 
 void FlashDeleteListBoxItems( void );
 void FlashDisplayDirectory( void );
-void FlashDisplayFiles( int fileType );
+void FlashDisplayFiles( void );
 char * FlashFormatFileInformation( SearchRec searchRecord );
 void FlashUpdateVolume( void );
 
@@ -173,8 +173,8 @@ void FlashDeleteListBoxItems( void )
   Description:
     This function displays the files in the current working directory.  First,
     it deletes the files that are currently being displayed.  Then it finds
-    and displays all subdirectories, so they are listed first in the list box.
-    Then it finds and displays all other files.
+    and displays all subdirectories and files, with the subdirectories listed
+    first in the list box.
 
   Precondition:
     * A USB flash drive is attached, enumerated, and initialized.
@@ -195,10 +195,8 @@ void FlashDisplayDirectory( void )
     // Delete all the files that are currently displayed.
     FlashDeleteListBoxItems();
 
-    // Display all of the subdirectories in the directory, then all the
-    // files in the directory.
-    FlashDisplayFiles( FILENAME_IS_SUBDIRECTORY );
-    FlashDisplayFiles( FILENAME_IS_FILE );
+    // Display all of the subdirectories and files in the directory.
+    FlashDisplayFiles();
 
     // Focus and select the first item in the list, and set the range and position of the slider.
     LbSetFocusedItem( pFlashFiles, 1 );
@@ -215,66 +213,80 @@ void FlashDisplayDirectory( void )
 
 /****************************************************************************
   Function:
-    void FlashDisplayFiles( int fileType )
+    void FlashDisplayFiles( void )
 
   Description:
-    This function finds all files of the requested file type and displays
-    them in the global list box.
+    This function finds all subdirectories and files in the current working
+    directory and displays them in the global list box.  The directory is
+    read in a single pass; each subdirectory is inserted after the last one
+    found so far, so the subdirectories come before the files.
 
   Precondition:
     ShowScreenFlash() must have been called.
 
   Parameters:
-    int fileType    - The type of file to be found.  Valid values are:
-                        * FILENAME_IS_SUBDIRECTORY
-                        * FILENAME_IS_FILE
+    None
 
   Returns:
     None
 
   Remarks:
-    None
+    The data of each list box item is FILENAME_IS_SUBDIRECTORY or
+    FILENAME_IS_FILE.
   ***************************************************************************/
 
-void FlashDisplayFiles( int fileType )
+void FlashDisplayFiles( void )
 {
-    void            *bitmap;
-    BYTE            fileAttributes;
     char            *fileInformation;
+    LISTITEM        *pItem;
+    LISTITEM        *pLastDirectory;
     SearchRec       searchRecord;
 
-    if (fileType == FILENAME_IS_SUBDIRECTORY)
-    {
-        fileAttributes = ATTR_DIRECTORY;
-        bitmap = &iconFolderSmall;
-    }
-    else
-    {
-        fileAttributes = ATTR_ARCHIVE | ATTR_READ_ONLY | ATTR_HIDDEN;
-        bitmap = NULL;
-    }
+    pLastDirectory = NULL;
 
-    if (!FindFirst( "*.*", fileAttributes, &searchRecord ))
+    if (!FindFirst( "*.*", ATTR_DIRECTORY | ATTR_ARCHIVE | ATTR_READ_ONLY | ATTR_HIDDEN, &searchRecord ))
     {
-        if ((fileInformation = FlashFormatFileInformation( searchRecord )) != NULL)
+        do
         {
-            LbAddItem( pFlashFiles, NULL, fileInformation, bitmap, LB_STS_REDRAW, 0 );
-            while (!FindNext( &searchRecord ))
+            if ((fileInformation = FlashFormatFileInformation( searchRecord )) == NULL)
             {
-                if ((fileInformation = FlashFormatFileInformation( searchRecord )) != NULL)
-                {
-                    LbAddItem( pFlashFiles, NULL, fileInformation, bitmap, LB_STS_REDRAW, fileType );
-                }
-                else
+                // We are out of memory
+                break;
+            }
+
+            if (searchRecord.attributes & ATTR_DIRECTORY)
+            {
+                pItem = LbAddItem( pFlashFiles, pLastDirectory, fileInformation, &iconFolderSmall, LB_STS_REDRAW, FILENAME_IS_SUBDIRECTORY );
+                if (pItem != NULL)
                 {
-                    // We are out of memory
+                    if ((pLastDirectory == NULL) && (pItem != pFlashFiles->pItemList))
+                    {
+                        // Files were found first.  LbAddItem appended the
+                        // first subdirectory, so move it to the front.
+                        pItem->pPrevItem->pNextItem = NULL;
+                        pItem->pPrevItem = NULL;
+                        pItem->pNextItem = pFlashFiles->pItemList;
+                        pFlashFiles->pItemList = pItem;
+                    }
+                    if (pItem->pNextItem != NULL)
+                    {
+                        pItem->pNextItem->pPrevItem = pItem;
+                    }
+                    pLastDirectory = pItem;
                 }
             }
-        }
-        else
-        {
-            // We are out of memory
-        }
+            else
+            {
+                pItem = LbAddItem( pFlashFiles, NULL, fileInformation, NULL, LB_STS_REDRAW, FILENAME_IS_FILE );
+            }
+
+            if (pItem == NULL)
+            {
+                // We are out of memory
+                free( fileInformation );
+                break;
+            }
+        } while (!FindNext( &searchRecord ));
     }
 }
 
@@ -286,7 +298,9 @@ void FlashDisplayFiles( int fileType )
     This routine creates a formatted string containing the name of the file
     specified in the input parameter.  If the file is a directory, a .\ is
     prepended to the file name.  Otherwise, space padding is prepended so the
-    file names are aligned.
+    file names are aligned.  Files are shown by their long names when long
+    file names are supported; directories keep their 8.3 names, since the
+    name shown is the one passed to FindFirst and FSchdir when selected.
 
   Precondition:
     None
@@ -305,8 +319,17 @@ void FlashDisplayFiles( int fileType )
 char * FlashFormatFileInformation( SearchRec searchRecord )
 {
     char        *pBuffer;
+    char        *pName;
+
+    pName = searchRecord.filename;
+    #ifdef SUPPORT_LFN
+        if (!(searchRecord.attributes & ATTR_DIRECTORY))
+        {
+            pName = searchRecord.longFilename;
+        }
+    #endif
 
-    if ((pBuffer = malloc( FILE_INFO_SIZE )) != NULL)
+    if ((pBuffer = malloc( FILE_INFO_SIZE( strlen( pName ) ) )) != NULL)
     {
         // Display the file size.  If the file is actually a directory, display an indication.
         if (searchRecord.attributes & ATTR_DIRECTORY)
@@ -319,7 +342,7 @@ char * FlashFormatFileInformation( SearchRec searchRecord )
         }
 
         // Display the file name.
-        strcat( pBuffer, searchRecord.filename );
+        strcat( pBuffer, pName );
     }
     return pBuffer;
 }
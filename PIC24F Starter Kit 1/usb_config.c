@@ -40,6 +40,9 @@ DEFENSE THEREOF), OR OTHER SIMILAR COSTS.
 #include "USB\usb.h"
 #include "USB\usb_host_msd.h"
 #include "USB\usb_host_msd_scsi.h"
+#ifdef USB_HUB_SUPPORT_INCLUDED
+#include "USB\usb_host_hub.h"
+#endif
 
 // *****************************************************************************
 // Media Interface Function Pointer Table for the Mass Storage client driver
@@ -63,6 +66,14 @@ CLIENT_DRIVER_TABLE usbClientDrvTable[] =
         USBHostMSDEventHandler,
         0
     }
+#ifdef USB_HUB_SUPPORT_INCLUDED
+    ,
+    {
+        USBHostHubInitialize,
+        USBHostHubEventHandler,
+        0
+    }
+#endif
 };
 
 // *****************************************************************************
@@ -72,5 +83,8 @@ CLIENT_DRIVER_TABLE usbClientDrvTable[] =
 USB_TPL usbTPL[] =
 {
     { INIT_CL_SC_P( 0x08ul, 0x06ul, 0x50ul ), 0, 0, {TPL_CLASS_DRV} }, // flash
+#ifdef USB_HUB_SUPPORT_INCLUDED
+    { INIT_CL_SC_P( 0x09ul, 0x00ul, 0x00ul ), 0, 1, {TPL_CLASS_DRV} }, // hub
+#endif
 };
 
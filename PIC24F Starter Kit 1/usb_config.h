@@ -50,9 +50,33 @@ DEFENSE THEREOF), OR OTHER SIMILAR COSTS.
 
 #define USB_PING_PONG_MODE  USB_PING_PONG__FULL_PING_PONG
 
-#define NUM_TPL_ENTRIES 1
+// Uncomment to use drives behind a hub on the port, for example to log to a
+// primary and a mirror drive at once.  This adds the hub client driver to
+// the tables in usb_config.c, and RAM for each device slot.
+//#define USB_HUB_SUPPORT_INCLUDED
 
-#define USB_MAX_MASS_STORAGE_DEVICES 1
+#ifdef USB_HUB_SUPPORT_INCLUDED
+    #define NUM_TPL_ENTRIES 2
+    #define USB_MAX_HUBS 1
+    #define USB_HUB_MAX_PORTS 4
+    #define USB_MAX_DEVICES 3
+    #define USB_MAX_MASS_STORAGE_DEVICES 2
+#else
+    #define NUM_TPL_ENTRIES 1
+    #define USB_MAX_MASS_STORAGE_DEVICES 1
+#endif
+#define USB_MSD_MAX_TRANSFER_SECTORS 64
+
+// Each drive holds a second command behind the running one, so its CBW goes
+// out as soon as the CSW of the running one arrives.  This costs 33 bytes of
+// RAM per drive.
+#define USB_MSD_COMMAND_QUEUE_DEPTH 2
+
+// The host layer keeps its descriptors and endpoint records in fixed pools
+// instead of the heap, so plugging drives in and out does not fragment it.
+// The pools are sized from USB_MAX_DEVICES unless USB_HOST_POOL_* are given;
+// USBHostGetPoolStatistics() shows how much of them has been used.
+#define USB_HOST_MEMORY_POOLS
 #define USB_NUM_CONTROL_NAKS 20
 #define USB_SUPPORT_INTERRUPT_TRANSFERS
 #define USB_NUM_INTERRUPT_NAKS 3
@@ -63,11 +87,27 @@ DEFENSE THEREOF), OR OTHER SIMILAR COSTS.
 #define USB_INSERT_TIME (250+1)
 #define USB_HOST_APP_EVENT_HANDLER USB_ApplicationEventHandler
 
+// USBTasks() is used in usb_host_msd.c, which doesn't include usb_host_msd_scsi.h
+void USBHostMSDSCSITasks( void );
+
+#ifdef USB_HUB_SUPPORT_INCLUDED
+void USBHostHubTasks( void );
+
 #define USBTasks()                  \
     {                               \
         USBHostTasks();             \
+        USBHostHubTasks();          \
         USBHostMSDTasks();          \
+        USBHostMSDSCSITasks();      \
     }
+#else
+#define USBTasks()                  \
+    {                               \
+        USBHostTasks();             \
+        USBHostMSDTasks();          \
+        USBHostMSDSCSITasks();      \
+    }
+#endif
 
 #define USBInitialize(x)            \
     {                               \
@@ -0,0 +1,53 @@
+/******************************************************************************
+ *
+ *                PIC FAT File System Interface Library
+ *
+ ******************************************************************************
+ * FileName:        FSconfig.h
+ * Dependencies:    None
+ * Processor:       Workstation (POSIX)
+ * Compiler:        GCC
+ *
+ * File system configuration for running the library on a workstation over
+ * the USB host stack and the simulated USB OTG module (see usbbench.c).
+ * Keep the options the same as the board's FSconfig.h so the numbers
+ * measured here apply there.
+ *
+*****************************************************************************/
+
+
+#ifndef _FAT16_DEF_
+
+
+#define FS_MAX_FILES_OPEN    2
+
+#define FS_MAX_VOLUMES       2
+
+#define ALLOW_WRITES
+#define ALLOW_FORMATS
+#define ALLOW_DIRS
+#define ALLOW_FILESEARCH
+#define SUPPORT_FAT32
+#define FS_FREE_MAP_SIZE    64
+#define FS_FAT_CACHE_SECTORS    4
+#define FS_EXTENT_MAP_SIZE      8
+#define FS_FILE_BUFFERS
+#define FS_DIR_CACHE_SIZE       8
+#define SUPPORT_LFN
+#define FS_LFN_MAX_CHARS        64
+#define FS_BACKGROUND_WRITES
+#define FS_WRITE_QUEUE_SECTORS  4
+#define FS_READ_AHEAD_SECTORS   4
+
+// The size of the sector buffers, so the largest sector size the media can
+// have.  Devices with smaller blocks (the simulated one has 512 byte blocks
+// unless usbbench is told otherwise) use part of each buffer.
+#define MEDIA_SECTOR_SIZE       4096
+
+// Defines the device type
+#define INCLUDEFILE       "USB/usb_host_msd_scsi.h"
+
+// The application sets the time with SetClockVars
+#define USERDEFINEDCLOCK
+
+#endif
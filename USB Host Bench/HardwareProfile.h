@@ -0,0 +1,18 @@
+/******************************************************************************
+
+HardwareProfile.h
+
+The USB Host Bench runs on a workstation against the simulated USB OTG module
+(usb_host_sim.h), so there is no hardware to describe.  The clock is the
+board's, for code that works out delays from it.
+
+******************************************************************************/
+
+#ifndef _HARDWARE_PROFILE_H_
+#define _HARDWARE_PROFILE_H_
+
+#define GetSystemClock()            32000000UL
+#define GetPeripheralClock()        (GetSystemClock())
+#define GetInstructionClock()       (GetSystemClock() / 2)
+
+#endif
@@ -0,0 +1,55 @@
+/******************************************************************************
+
+    USB Host Bench configuration
+
+The client driver tables and Targeted Peripheral List of the PIC24F Starter
+Kit's usb_config.c.
+
+*******************************************************************************/
+
+#include "GenericTypeDefs.h"
+#include "HardwareProfile.h"
+#include "USB/usb.h"
+#include "USB/usb_host_msd.h"
+#include "USB/usb_host_msd_scsi.h"
+#include "USB/usb_host_hub.h"
+
+// *****************************************************************************
+// Media Interface Function Pointer Table for the Mass Storage client driver
+// *****************************************************************************
+
+CLIENT_DRIVER_TABLE usbMediaInterfaceTable =
+{
+    USBHostMSDSCSIInitialize,
+    USBHostMSDSCSIEventHandler,
+    0
+};
+
+// *****************************************************************************
+// Client Driver Function Pointer Table for the USB Embedded Host foundation
+// *****************************************************************************
+
+CLIENT_DRIVER_TABLE usbClientDrvTable[] =
+{
+    {
+        USBHostMSDInitialize,
+        USBHostMSDEventHandler,
+        0
+    },
+    {
+        USBHostHubInitialize,
+        USBHostHubEventHandler,
+        0
+    }
+};
+
+// *****************************************************************************
+// USB Embedded Host Targeted Peripheral List (TPL)
+// *****************************************************************************
+
+USB_TPL usbTPL[] =
+{
+    { INIT_CL_SC_P( 0x08ul, 0x06ul, 0x50ul ), 0, 0, {TPL_CLASS_DRV} }, // flash
+    { INIT_CL_SC_P( 0x09ul, 0x00ul, 0x00ul ), 0, 1, {TPL_CLASS_DRV} }, // hub
+};
+
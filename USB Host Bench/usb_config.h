@@ -0,0 +1,63 @@
+/******************************************************************************
+
+    USB Host Bench configuration
+
+The options of the PIC24F Starter Kit's usb_config.h, with the processor
+header replaced by the simulated USB OTG module (usb_host_sim.h).  Keep them
+the same as the board's so the numbers measured here apply there.
+
+*******************************************************************************/
+
+#include "USB/usb_host_sim.h"
+
+#define _USB_CONFIG_VERSION_MAJOR 1
+#define _USB_CONFIG_VERSION_MINOR 0
+#define _USB_CONFIG_VERSION_DOT   0
+#define _USB_CONFIG_VERSION_BUILD 0
+
+#define USB_SUPPORT_HOST
+
+#define USB_PING_PONG_MODE  USB_PING_PONG__FULL_PING_PONG
+
+#define NUM_TPL_ENTRIES 2
+
+// A hub with up to four drives behind it (usbbench -h).
+#define USB_HUB_SUPPORT_INCLUDED
+#define USB_MAX_HUBS 1
+#define USB_HUB_MAX_PORTS 4
+#define USB_MAX_DEVICES 5
+
+#define USB_MAX_MASS_STORAGE_DEVICES 4
+#define USB_MSD_MAX_TRANSFER_SECTORS 64
+#define USB_MSD_COMMAND_QUEUE_DEPTH 2
+#define USB_HOST_MEMORY_POOLS
+#define USB_NUM_CONTROL_NAKS 20
+#define USB_SUPPORT_INTERRUPT_TRANSFERS
+#define USB_NUM_INTERRUPT_NAKS 3
+#define USB_SUPPORT_BULK_TRANSFERS
+#define USB_NUM_BULK_NAKS 10000
+#define USB_SUPPORT_ISOCHRONOUS_TRANSFERS
+#define USB_INITIAL_VBUS_CURRENT (100/2)
+#define USB_INSERT_TIME (250+1)
+#define USB_HOST_APP_EVENT_HANDLER USB_ApplicationEventHandler
+
+// USBTasks() is used in usb_host_msd.c, which doesn't include usb_host_msd_scsi.h
+void USBHostMSDSCSITasks( void );
+void USBHostHubTasks( void );
+
+// The simulated module runs first, as the hardware would have while the
+// processor was elsewhere.
+#define USBTasks()                  \
+    {                               \
+        USBHostSimTasks();          \
+        USBHostTasks();             \
+        USBHostHubTasks();          \
+        USBHostMSDTasks();          \
+        USBHostMSDSCSITasks();      \
+    }
+
+#define USBInitialize(x)            \
+    {                               \
+        USBHostInit(x);             \
+    }
+
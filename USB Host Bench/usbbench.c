@@ -0,0 +1,634 @@
+/******************************************************************************
+ *
+ *               Microchip USB Embedded Host Stack
+ *
+ ******************************************************************************
+ * FileName:        usbbench.c
+ * Dependencies:    usb_host.c, usb_host_msd.c, usb_host_msd_scsi.c, usb_host_hub.c,
+ *                  usb_host_sim.c, FSIO.c, FSwritequeue.c, FSwritecache.c
+ * Processor:       Workstation (POSIX)
+ * Compiler:        GCC
+ *
+ * Runs the USB host stack, the Mass Storage client driver and the file
+ * system against the simulated USB OTG module and mass storage device of
+ * usb_host_sim.c, to measure them without a board.  It attaches the device,
+ * writes and reads sectors in order, reads single sectors at random places,
+ * then formats the image and writes and reads a file through the file
+ * system, checking what it reads.  With -h, the drives are behind a hub:
+ * the sectors are written to all of them at once (as a mirror) and read
+ * back from all of them at once, then one drive is unplugged in the middle
+ * of a read and plugged back in.  The images of drives 1 and up are the
+ * image name with .1, .2 and .3 added.  For each step it shows the simulated
+ * time and throughput, the frames, the SETUP/IN/OUT tokens, the NAKs, the
+ * interrupts taken and how busy the bus was, and the time the workstation
+ * took.  At the end it shows how much of each memory pool of the host layer
+ * was used.  The exit status is 0 only if every step worked, the data read
+ * back matched and no pool ran out.
+ *
+ *      usbbench [options] [image [megabytes [sectors per command]]]
+ *
+ *      -b bytes    logical block length of the device (512 to 4096)
+ *      -v version  SCSI version the device reports in INQUIRY
+ *      -m sectors  most sectors the device takes in one command (Block Limits)
+ *      -s sectors  most sectors in one WRITE SAME (Block Limits, 0 to reject it)
+ *      -l us       device time from a command to its data or status
+ *      -r us       device time to read each block
+ *      -w us       device time to write each block
+ *      -n count    NAK every count-th bulk token the device could take
+ *      -i us       processor time in each USB interrupt
+ *      -t us       processor time in each main loop pass (20 unless given)
+ *      -h drives   put that many drives (1 to 4) behind a hub
+ *      -c bytes    have the drive claim a configuration descriptor this long;
+ *                  the bench then only checks that the host refuses it with
+ *                  EVENT_OUT_OF_MEMORY when it is more than the buffer pool
+ *
+ * Build it with
+ *
+ *      gcc -O2 -fgnu89-inline -fpack-struct=2 -I "USB Host Bench"
+ *          -I Microchip/Include -I Microchip/USB
+ *          Microchip/USB/usb_host.c Microchip/USB/usb_host_sim.c
+ *          "Microchip/USB/MSD Host Driver/usb_host_msd.c"
+ *          "Microchip/USB/MSD Host Driver/usb_host_msd_scsi.c"
+ *          "Microchip/USB/HUB Host Driver/usb_host_hub.c"
+ *          "Microchip/MDD File System/FSIO.c"
+ *          "Microchip/MDD File System/FSwritequeue.c"
+ *          "Microchip/MDD File System/FSwritecache.c"
+ *          "USB Host Bench/usb_config.c" "USB Host Bench/usbbench.c" -o usbbench
+ *
+*****************************************************************************/
+
+#define _FILE_OFFSET_BITS   64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "GenericTypeDefs.h"
+#include "USB/usb.h"
+#include "USB/usb_host_msd.h"
+#include "USB/usb_host_msd_scsi.h"
+#include "MDD File System/FSIO.h"
+
+
+#define RANDOM_READS        256
+#define MAX_PER_COMMAND     256     // Most sectors in one request of the bench
+
+static BYTE     sectorBuffer[USB_MSD_MAX_TRANSFER_SECTORS * 4096];
+static BYTE     driveBuffer[USB_HOST_SIM_MAX_DRIVES][MAX_PER_COMMAND * 4096];
+static BYTE     chunkBuffer[4096];
+static double   stepStart;
+static BOOL     outOfMemory;
+
+
+/******************************************************************************
+* Function:        BOOL USB_ApplicationEventHandler (BYTE address, USB_EVENT event,
+*                                                    void * data, DWORD size)
+*
+* Overview:        Take the events of the host stack; the bench only notes
+*                  EVENT_OUT_OF_MEMORY, and allows any VBUS current
+*****************************************************************************/
+
+BOOL USB_ApplicationEventHandler (BYTE address, USB_EVENT event, void * data, DWORD size)
+{
+    (void)address;
+    (void)data;
+    (void)size;
+    if (event == EVENT_OUT_OF_MEMORY)
+        outOfMemory = TRUE;
+    return TRUE;
+}
+
+
+/******************************************************************************
+* Function:        double Now (void)
+*
+* Output:          double     - Seconds from an arbitrary starting point
+*
+* Overview:        Read the monotonic clock
+*****************************************************************************/
+
+static double Now (void)
+{
+    struct timespec t;
+
+    clock_gettime (CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+/******************************************************************************
+* Function:        void Report (const char * step, DWORD bytes)
+*
+* Input:           step       - What was measured
+*                  bytes      - Data moved, 0 if none
+*
+* Overview:        Print one result line and clear the bus counts
+*****************************************************************************/
+
+static void Report (const char * step, DWORD bytes)
+{
+    double  ms = gUSBHostSimStats.bitTimes / (USB_HOST_SIM_BIT_TIMES_PER_US * 1e3);
+
+    printf ("%-8s %10.1f ms", step, ms);
+    if ((bytes != 0) && (ms > 0))
+        printf (" %8.1f KB/s", bytes / ms * 1e3 / 1024.0);
+    else
+        printf ("             ");
+    printf ("   frames %6lu  tokens %lu/%lu/%lu  naks %lu  isrs %lu  bus %5.1f%%  host %.3f s\n",
+        (unsigned long)gUSBHostSimStats.frames,
+        (unsigned long)gUSBHostSimStats.setupTokens, (unsigned long)gUSBHostSimStats.inTokens,
+        (unsigned long)gUSBHostSimStats.outTokens, (unsigned long)gUSBHostSimStats.naks,
+        (unsigned long)gUSBHostSimStats.interrupts,
+        gUSBHostSimStats.bitTimes ? 100.0 * gUSBHostSimStats.busyBitTimes / gUSBHostSimStats.bitTimes : 0.0,
+        Now() - stepStart);
+
+    memset (&gUSBHostSimStats, 0, sizeof (gUSBHostSimStats));
+    stepStart = Now();
+}
+
+
+/******************************************************************************
+* Function:        BYTE Pattern (DWORD sector, WORD blockSize, DWORD i)
+*
+* Output:          BYTE       - What byte i of the sector holds
+*
+* Overview:        The data written to the sectors, different in each one
+*****************************************************************************/
+
+static BYTE Pattern (DWORD sector, WORD blockSize, DWORD i)
+{
+    DWORD   offset = sector * blockSize + i;
+
+    return (BYTE)(offset * 7 + (offset >> 9));
+}
+
+
+/******************************************************************************
+* Function:        BYTE Units (void)
+*
+* Output:          BYTE       - Units the client driver has ready
+*
+* Overview:        Count the devices whose LUN 0 is ready
+*****************************************************************************/
+
+static BYTE Units (void)
+{
+    BYTE    i, found;
+
+    for (i = found = 0; i < USB_MAX_MASS_STORAGE_DEVICES; i++)
+    {
+        if (USBHostMSDSCSIUnitSelect (USB_MSD_SCSI_UNIT (i, 0)) && USBHostMSDSCSIMediaDetect())
+            found ++;
+    }
+    return found;
+}
+
+
+/******************************************************************************
+* Function:        BOOL AttachAll (BYTE drives)
+*
+* Input:           drives     - Drives that must be there
+*
+* Output:          BOOL       - TRUE if the client driver has them all
+*
+* Overview:        Run the USB tasks until the client driver has a unit for
+*                  each drive, and initialize the media of each unit.
+*                  Unit 0 is selected at the end.
+*****************************************************************************/
+
+static BOOL AttachAll (BYTE drives)
+{
+    QWORD   start = gUSBHostSimStats.bitTimes;
+    BYTE    i;
+
+    while (Units() < drives)
+    {
+        USBTasks();
+        if (gUSBHostSimStats.bitTimes - start > 5000ull * 12000)
+            return FALSE;
+    }
+
+    for (i = 0; i < drives; i++)
+    {
+        if (!USBHostMSDSCSIUnitSelect (USB_MSD_SCSI_UNIT (i, 0)) || !USBHostMSDSCSIMediaInitialize())
+            return FALSE;
+    }
+    USBHostMSDSCSIUnitSelect (USB_MSD_SCSI_UNIT (0, 0));
+    return TRUE;
+}
+
+
+/******************************************************************************
+* Function:        BOOL WaitAll (BYTE drives)
+*
+* Input:           drives     - Units with a request running
+*
+* Output:          BOOL       - TRUE if all the requests ended without error
+*
+* Overview:        Wait until the background sector requests of units 0 to
+*                  drives - 1 have ended
+*****************************************************************************/
+
+static BOOL WaitAll (BYTE drives)
+{
+    BYTE    i, running, errorCode;
+    BOOL    ok = TRUE;
+
+    do
+    {
+        for (i = running = 0; i < drives; i++)
+        {
+            USBHostMSDSCSIUnitSelect (USB_MSD_SCSI_UNIT (i, 0));
+            if (!USBHostMSDSCSITransferIsComplete (&errorCode))
+                running ++;
+            else if (errorCode != USB_SUCCESS)
+                ok = FALSE;
+        }
+    } while (running != 0);
+
+    USBHostMSDSCSIUnitSelect (USB_MSD_SCSI_UNIT (0, 0));
+    return ok;
+}
+
+
+/******************************************************************************
+* Function:        BOOL CheckSectors (BYTE * buffer, DWORD sector, DWORD n,
+*                                     WORD blockSize)
+*
+* Output:          BOOL       - TRUE if the buffer holds what was written
+*
+* Overview:        Compare sectors read with the pattern written to them
+*****************************************************************************/
+
+static BOOL CheckSectors (BYTE * buffer, DWORD sector, DWORD n, WORD blockSize)
+{
+    DWORD   i;
+
+    for (i = 0; i < n * blockSize; i++)
+    {
+        if (buffer[i] != Pattern (sector, blockSize, i))
+        {
+            printf ("sector data wrong at %lu\n", (unsigned long)(sector + i / blockSize));
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+
+/******************************************************************************
+* Function:        BOOL RunAll (BYTE drives, DWORD total, DWORD perCommand,
+*                               WORD blockSize, BOOL write)
+*
+* Input:           drives     - Units 0 to drives - 1 are used
+*                  total      - Sectors to move on each unit, from sector 0
+*                  perCommand - Sectors in each request
+*                  write      - Write the pattern, or read and check it
+*
+* Output:          BOOL       - TRUE if all the requests worked
+*
+* Overview:        Move the sectors of every unit with background requests.
+*                  Each unit gets its next request as soon as its last one
+*                  ends, so a drive that is busy writing or reading its
+*                  medium does not hold the others up.
+*****************************************************************************/
+
+static BOOL RunAll (BYTE drives, DWORD total, DWORD perCommand, WORD blockSize, BOOL write)
+{
+    DWORD   next[USB_HOST_SIM_MAX_DRIVES];
+    DWORD   count[USB_HOST_SIM_MAX_DRIVES];
+    DWORD   i;
+    BYTE    d, running, errorCode, result;
+
+    memset (count, 0, sizeof (count));
+    memset (next, 0, sizeof (next));
+    do
+    {
+        for (d = running = 0; d < drives; d++)
+        {
+            USBHostMSDSCSIUnitSelect (USB_MSD_SCSI_UNIT (d, 0));
+            if (count[d] != 0)
+            {
+                if (!USBHostMSDSCSITransferIsComplete (&errorCode))
+                {
+                    running ++;
+                    continue;
+                }
+                if ((errorCode != USB_SUCCESS) ||
+                    (!write && !CheckSectors (driveBuffer[d], next[d] - count[d], count[d], blockSize)))
+                {
+                    printf ("%s failed on unit %u at %lu\n", write ? "write" : "read",
+                        (unsigned)d, (unsigned long)(next[d] - count[d]));
+                    return FALSE;
+                }
+            }
+            if (next[d] == total)
+            {
+                count[d] = 0;
+                continue;
+            }
+
+            count[d] = (total - next[d] < perCommand) ? total - next[d] : perCommand;
+            if (write)
+            {
+                for (i = 0; i < count[d] * blockSize; i++)
+                    driveBuffer[d][i] = Pattern (next[d], blockSize, i);
+                result = USBHostMSDSCSISectorWriteStart (next[d], (WORD)count[d], driveBuffer[d], TRUE, NULL);
+            }
+            else
+            {
+                result = USBHostMSDSCSISectorReadStart (next[d], (WORD)count[d], driveBuffer[d], NULL);
+            }
+            if (result != USB_SUCCESS)
+            {
+                printf ("the %s could not be started on unit %u\n", write ? "write" : "read", (unsigned)d);
+                return FALSE;
+            }
+            next[d] += count[d];
+            running ++;
+        }
+    } while (running != 0);
+
+    USBHostMSDSCSIUnitSelect (USB_MSD_SCSI_UNIT (0, 0));
+    return TRUE;
+}
+
+
+int main (int argc, char ** argv)
+{
+    const char *    image;
+    DWORD           megabytes, perCommand;
+    DWORD           sectors, total, done, sector, i, n;
+    WORD            blockSize;
+    FILE *          f;
+    FSFILE *        file;
+    int             option;
+    BOOL            badOption = FALSE;
+    BYTE            drives = 1;
+    BYTE            d;
+    char            name[FILENAME_MAX];
+
+    while ((option = getopt (argc, argv, "b:v:m:s:l:r:w:n:i:t:h:c:")) != -1)
+    {
+        switch (option)
+        {
+            case 'b':   gUSBHostSimConfig.blockSize = (WORD)strtoul (optarg, NULL, 0);      break;
+            case 'v':   gUSBHostSimConfig.scsiVersion = (BYTE)strtoul (optarg, NULL, 0);    break;
+            case 'm':   gUSBHostSimConfig.maxTransfer = (WORD)strtoul (optarg, NULL, 0);    break;
+            case 's':   gUSBHostSimConfig.maxWriteSame = (WORD)strtoul (optarg, NULL, 0);   break;
+            case 'l':   gUSBHostSimConfig.commandTime = strtoul (optarg, NULL, 0);          break;
+            case 'r':   gUSBHostSimConfig.readTime = strtoul (optarg, NULL, 0);             break;
+            case 'w':   gUSBHostSimConfig.writeTime = strtoul (optarg, NULL, 0);            break;
+            case 'n':   gUSBHostSimConfig.nakEvery = (WORD)strtoul (optarg, NULL, 0);       break;
+            case 'i':   gUSBHostSimConfig.interruptTime = strtoul (optarg, NULL, 0);        break;
+            case 't':   gUSBHostSimConfig.taskTime = strtoul (optarg, NULL, 0);             break;
+            case 'h':   gUSBHostSimConfig.hubPorts = drives = (BYTE)strtoul (optarg, NULL, 0); break;
+            case 'c':   gUSBHostSimConfig.configLength = (WORD)strtoul (optarg, NULL, 0);   break;
+            default:    badOption = TRUE;                                                   break;
+        }
+    }
+    image = (optind < argc) ? argv[optind] : "usbbench.img";
+    megabytes = (optind + 1 < argc) ? strtoul (argv[optind + 1], NULL, 0) : 8;
+    perCommand = (optind + 2 < argc) ? strtoul (argv[optind + 2], NULL, 0) : USB_MSD_MAX_TRANSFER_SECTORS;
+    blockSize = gUSBHostSimConfig.blockSize;
+    #ifndef USB_HOST_MEMORY_POOLS
+    if (gUSBHostSimConfig.configLength != 0)
+        badOption = TRUE;           // Without the pools, malloc() decides
+    #endif
+
+    if (badOption || (megabytes < 2) || (perCommand == 0) || (perCommand > MAX_PER_COMMAND) ||
+        (blockSize < 512) || (blockSize > MEDIA_SECTOR_SIZE) || (blockSize & (blockSize - 1)) ||
+        (drives < 1) || (drives > USB_HOST_SIM_MAX_DRIVES) || (drives > USB_MAX_MASS_STORAGE_DEVICES))
+    {
+        printf ("usage: usbbench [-b block bytes (512 to %u)] [-v SCSI version] [-m sectors/command] [-s sectors/WRITE SAME]\n"
+                "                [-l command us] [-r read us/block] [-w write us/block] [-n NAK every n] [-i interrupt us]\n"
+                "                [-t main loop us] [-h drives behind a hub (1 to %u)] [-c configuration bytes]\n"
+                "                [image [megabytes (2 or more) [sectors per command (up to %u)]]]\n",
+                (unsigned)MEDIA_SECTOR_SIZE, (unsigned)USB_HOST_SIM_MAX_DRIVES, (unsigned)MAX_PER_COMMAND);
+        return 2;
+    }
+    sectors = megabytes * (1048576 / blockSize);
+    total = sectors / 2;
+
+    USBHostSimClose();
+    memset (&gUSBHostSimStats, 0, sizeof (gUSBHostSimStats));
+    for (d = 0; d < drives; d++)
+    {
+        if (d == 0)
+            snprintf (name, sizeof (name), "%s", image);
+        else
+            snprintf (name, sizeof (name), "%s.%u", image, (unsigned)d);
+        if (((f = fopen (name, "w+b")) == NULL) || (ftruncate (fileno (f), (off_t)sectors * blockSize) != 0) ||
+            (fclose (f) != 0) || !USBHostSimOpenDrive (d, name))
+        {
+            printf ("can't make %s\n", name);
+            return 1;
+        }
+    }
+    SetClockVars (2009, 1, 1, 0, 0, 0);
+
+    // Attach the device and wait until the client driver has it
+    stepStart = Now();
+    USBInitialize (0);
+    USBHostSimAttach();
+    for (d = 0; d < drives; d++)
+        USBHostSimAttachDrive (d);
+
+    #ifdef USB_HOST_MEMORY_POOLS
+    if (gUSBHostSimConfig.configLength != 0)
+    {
+        USB_HOST_POOL_STATS     pools;
+
+        // A configuration descriptor longer than the buffer pool must be
+        // refused, not read over the pool
+        while (!outOfMemory && (gUSBHostSimStats.bitTimes < 5000ull * 12000))
+            USBTasks();
+        Report ("refuse", 0);
+        USBHostGetPoolStatistics (&pools);
+        USBHostSimClose();
+        if (!outOfMemory || (pools.pool[USB_HOST_POOL_BUFFER].failures == 0))
+        {
+            printf ("a %u byte configuration descriptor was not refused\n", (unsigned)gUSBHostSimConfig.configLength);
+            return 1;
+        }
+        return 0;
+    }
+    #endif
+
+    if (!AttachAll (drives))
+    {
+        printf ("the devices were not enumerated\n");
+        return 1;
+    }
+    Report ("attach", 0);
+
+    // Write half the image in order, the given number of sectors at a time,
+    // to every drive at once, then read it back from all of them and check it
+    if (!RunAll (drives, total, perCommand, blockSize, TRUE))
+        return 1;
+    Report ((drives > 1) ? "mirror" : "write", total * blockSize * drives);
+
+    if (!RunAll (drives, total, perCommand, blockSize, FALSE))
+        return 1;
+    Report ((drives > 1) ? "read all" : "read", total * blockSize * drives);
+
+    // Unplug the last drive while all of them are reading, check what the
+    // others read, and plug it back in
+    if (drives > 1)
+    {
+        n = perCommand;
+        for (d = 0; d < drives; d++)
+        {
+            USBHostMSDSCSIUnitSelect (USB_MSD_SCSI_UNIT (d, 0));
+            USBHostMSDSCSISectorReadStart (0, (WORD)n, driveBuffer[d], NULL);
+        }
+        for (i = 0; i < 10; i++)
+            USBTasks();
+        USBHostSimDetachDrive (drives - 1);
+        WaitAll (drives);
+        for (d = 0; d < drives; d++)
+        {
+            USBHostMSDSCSIUnitSelect (USB_MSD_SCSI_UNIT (d, 0));
+            if (USBHostMSDSCSIMediaDetect() && !CheckSectors (driveBuffer[d], 0, n, blockSize))
+                return 1;
+        }
+        for (i = 0; (i < 1000) && (Units() == drives); i++)
+            USBTasks();
+        if (Units() != drives - 1)
+        {
+            printf ("the drive unplugged was not removed\n");
+            return 1;
+        }
+        USBHostSimAttachDrive (drives - 1);
+        if (!AttachAll (drives))
+        {
+            printf ("the drive plugged back in was not enumerated\n");
+            return 1;
+        }
+        for (d = 0; d < drives; d++)
+        {
+            USBHostMSDSCSIUnitSelect (USB_MSD_SCSI_UNIT (d, 0));
+            if (!USBHostMSDSCSISectorReadMultiple (total - n, (WORD)n, driveBuffer[d]) ||
+                !CheckSectors (driveBuffer[d], total - n, n, blockSize))
+            {
+                printf ("drive %u can't be read after the unplug\n", (unsigned)d);
+                return 1;
+            }
+        }
+        USBHostMSDSCSIUnitSelect (USB_MSD_SCSI_UNIT (0, 0));
+        Report ("unplug", 0);
+    }
+
+    // Read single sectors here and there
+    srand (1);
+    for (done = 0; done < RANDOM_READS; done++)
+    {
+        sector = (DWORD)rand() % total;
+        if (!USBHostMSDSCSISectorRead (sector, sectorBuffer))
+        {
+            printf ("USBHostMSDSCSISectorRead failed at %lu\n", (unsigned long)sector);
+            return 1;
+        }
+        for (i = 0; i < blockSize; i++)
+        {
+            if (sectorBuffer[i] != Pattern (sector, blockSize, i))
+            {
+                printf ("sector data wrong at %lu\n", (unsigned long)sector);
+                return 1;
+            }
+        }
+    }
+    Report ("random", RANDOM_READS * blockSize);
+
+    // Format the device and write and read a file through the file system
+    if (FSformat (1, 0x12345678, "USBBENCH") != 0)
+    {
+        printf ("FSformat failed\n");
+        return 1;
+    }
+    if (!FSInit())
+    {
+        printf ("FSInit failed\n");
+        return 1;
+    }
+    Report ("format", 0);
+
+    total = (megabytes / 4) * 1048576;
+    if ((file = FSfopen ("BENCH.BIN", "w")) == NULL)
+    {
+        printf ("FSfopen failed\n");
+        return 1;
+    }
+    for (done = 0; done < total; done += n)
+    {
+        n = (total - done < sizeof (chunkBuffer)) ? total - done : sizeof (chunkBuffer);
+        for (i = 0; i < n; i++)
+            chunkBuffer[i] = (BYTE)((done + i) * 7 + ((done + i) >> 9));
+        if (FSfwrite (chunkBuffer, 1, n, file) != n)
+        {
+            printf ("FSfwrite failed at %lu\n", (unsigned long)done);
+            return 1;
+        }
+    }
+    if ((FSfclose (file) != 0) || (FSsync() != 0))
+    {
+        printf ("FSfclose failed\n");
+        return 1;
+    }
+    Report ("fwrite", total);
+
+    if ((file = FSfopen ("BENCH.BIN", "r")) == NULL)
+    {
+        printf ("FSfopen failed\n");
+        return 1;
+    }
+    for (done = 0; done < total; done += n)
+    {
+        n = (total - done < sizeof (chunkBuffer)) ? total - done : sizeof (chunkBuffer);
+        if (FSfread (chunkBuffer, 1, n, file) != n)
+        {
+            printf ("FSfread failed at %lu\n", (unsigned long)done);
+            return 1;
+        }
+        for (i = 0; i < n; i++)
+        {
+            if (chunkBuffer[i] != (BYTE)((done + i) * 7 + ((done + i) >> 9)))
+            {
+                printf ("file data wrong at %lu\n", (unsigned long)(done + i));
+                return 1;
+            }
+        }
+    }
+    FSfclose (file);
+    Report ("fread", total);
+
+    if (FSunmount ('A') != 0)
+    {
+        printf ("FSunmount failed\n");
+        return 1;
+    }
+    USBHostSimClose();
+
+    #ifdef USB_HOST_MEMORY_POOLS
+    {
+        static const char * const poolNames[USB_HOST_POOLS] = { "endpoints", "interfaces", "configurations", "buffer blocks" };
+        USB_HOST_POOL_STATS     pools;
+
+        // Show how much of each pool the run needed; a failure means a pool
+        // is too small for the drives used
+        USBHostGetPoolStatistics (&pools);
+        printf ("%-15s %5s %6s %10s %7s %8s\n", "pool", "size", "in use", "high water", "extent", "failures");
+        for (d = 0; d < USB_HOST_POOLS; d++)
+        {
+            printf ("%-15s %5u %6u %10u %7u %8u\n", poolNames[d], (unsigned)pools.pool[d].size,
+                    (unsigned)pools.pool[d].inUse, (unsigned)pools.pool[d].highWater,
+                    (unsigned)pools.pool[d].extent, (unsigned)pools.pool[d].failures);
+            if (pools.pool[d].failures != 0)
+                return 1;
+        }
+    }
+    #endif
+
+    return 0;
+}